@@ -0,0 +1,436 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A command-line front-end to GisScribe, without any UI, so that installs can
+ * be scripted and the scribe measured on its own. For example, to measure how
+ * fast an image can be written to a file:
+ *
+ *   eos-installer-cli eos-eos3.8-amd64-amd64.200601-121212.en.img.xz target.img
+ *
+ * The image is checked and verified just as the app does, then the metrics
+ * from gis_scribe_dup_metrics() are printed; or, with --json, a line in the
+ * same format as gis_install_record_append() writes. The exit status says
+ * whether, and roughly why, the install failed.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib-unix.h>
+#include <glib/gi18n.h>
+#include <gio/gio.h>
+
+#include "gis-dmi.h"
+#include "gis-errors.h"
+#include "gis-image-probe.h"
+#include "gis-install-record.h"
+#include "gis-scribe.h"
+#include "gis-split-image.h"
+#include "gis-squashfs-reader.h"
+#include "gis-trace.h"
+
+typedef enum {
+  EXIT_STATUS_SUCCESS = 0,
+  /* Writing the image failed */
+  EXIT_STATUS_FAILED = 1,
+  EXIT_STATUS_USAGE = 2,
+  /* The image could not be read, or is not an Endless OS image */
+  EXIT_STATUS_INVALID_IMAGE = 3,
+  /* The image does not match its signature or checksum */
+  EXIT_STATUS_VERIFICATION_FAILED = 4,
+  /* Interrupted by SIGINT or SIGTERM */
+  EXIT_STATUS_CANCELLED = 130,
+} ExitStatus;
+
+static ExitStatus
+get_exit_status (const GError *error)
+{
+  if (error == NULL)
+    return EXIT_STATUS_SUCCESS;
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return EXIT_STATUS_CANCELLED;
+
+  if (g_error_matches (error, GIS_IMAGE_ERROR,
+                       GIS_IMAGE_ERROR_VERIFICATION_FAILED))
+    return EXIT_STATUS_VERIFICATION_FAILED;
+
+  if (error->domain == GIS_IMAGE_ERROR ||
+      g_error_matches (error, GIS_INSTALL_ERROR,
+                       GIS_INSTALL_ERROR_DECOMPRESSION_FAILED))
+    return EXIT_STATUS_INVALID_IMAGE;
+
+  return EXIT_STATUS_FAILED;
+}
+
+static gboolean
+cancel_cb (gpointer data)
+{
+  g_cancellable_cancel (G_CANCELLABLE (data));
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+write_cb (GObject      *source,
+          GAsyncResult *result,
+          gpointer      data)
+{
+  GAsyncResult **result_out = data;
+
+  *result_out = g_object_ref (result);
+}
+
+static void
+progress_cb (GObject    *object,
+             GParamSpec *pspec,
+             gpointer    data)
+{
+  GisScribe *scribe = GIS_SCRIBE (object);
+  gdouble progress = gis_scribe_get_progress (scribe);
+
+  if (progress < 0)
+    return;
+
+  g_printerr ("\rStep %u of 2: %3.0f%%", gis_scribe_get_step (scribe),
+              progress * 100);
+}
+
+static gchar *
+format_rate (guint64 bytes,
+             gint64  usec)
+{
+  g_autofree gchar *size = NULL;
+
+  if (usec <= 0)
+    return g_strdup ("-");
+
+  size = g_format_size (bytes * (gdouble) G_USEC_PER_SEC / usec);
+  return g_strdup_printf ("%s/s", size);
+}
+
+static void
+print_metrics (GVariant *metrics)
+{
+  g_autoptr(GVariant) stages =
+    g_variant_lookup_value (metrics, "stages", G_VARIANT_TYPE ("a{sa{sv}}"));
+  const gchar *bottleneck, *bound;
+  gint64 elapsed_usec = 0;
+  GVariantIter iter;
+  const gchar *label;
+  GVariant *stage;
+
+  g_print ("%-10s %11s %11s %9s %13s %9s %9s %11s\n",
+           "stage", "in", "out", "busy", "rate", "upstream", "downstream",
+           "peak queue");
+
+  g_variant_iter_init (&iter, stages);
+  while (g_variant_iter_loop (&iter, "{&s@a{sv}}", &label, &stage))
+    {
+      guint64 bytes_in = 0, bytes_out = 0, queue_peak = 0;
+      gint64 busy_usec = 0, upstream_usec = 0, downstream_usec = 0;
+      g_autofree gchar *in = NULL;
+      g_autofree gchar *out = NULL;
+      g_autofree gchar *rate = NULL;
+      g_autofree gchar *peak = NULL;
+
+      g_variant_lookup (stage, "bytes-in", "t", &bytes_in);
+      g_variant_lookup (stage, "bytes-out", "t", &bytes_out);
+      g_variant_lookup (stage, "busy-usec", "x", &busy_usec);
+      g_variant_lookup (stage, "upstream-blocked-usec", "x", &upstream_usec);
+      g_variant_lookup (stage, "downstream-blocked-usec", "x",
+                        &downstream_usec);
+      g_variant_lookup (stage, "queue-peak-bytes", "t", &queue_peak);
+
+      in = g_format_size (bytes_in);
+      out = g_format_size (bytes_out);
+      rate = format_rate (MAX (bytes_in, bytes_out), busy_usec);
+      peak = g_format_size (queue_peak);
+      g_print ("%-10s %11s %11s %8.1fs %13s %8.1fs %9.1fs %11s\n",
+               label, in, out,
+               busy_usec / (gdouble) G_USEC_PER_SEC,
+               rate,
+               upstream_usec / (gdouble) G_USEC_PER_SEC,
+               downstream_usec / (gdouble) G_USEC_PER_SEC,
+               peak);
+    }
+
+  g_variant_lookup (metrics, "elapsed-usec", "x", &elapsed_usec);
+  g_print ("elapsed: %.1fs\n", elapsed_usec / (gdouble) G_USEC_PER_SEC);
+
+  if (g_variant_lookup (metrics, "bottleneck", "&s", &bottleneck) &&
+      g_variant_lookup (metrics, "bound", "&s", &bound))
+    g_print ("bottleneck: %s (%s-bound)\n", bottleneck, bound);
+}
+
+static void
+print_record (GFile        *image,
+              guint64       image_size,
+              guint64       compressed_size,
+              GVariant     *metrics,
+              const GError *install_error)
+{
+  g_autofree gchar *basename = g_file_get_basename (image);
+  g_autofree gchar *vendor = NULL;
+  g_autofree gchar *product = NULL;
+  g_autoptr(GVariant) record = NULL;
+  g_autofree gchar *json = NULL;
+
+  /* Not every computer (or container) has DMI tables */
+  gis_dmi_read_vendor_product (&vendor, &product, NULL);
+
+  record = gis_install_record_new (basename,
+                                   gis_install_record_get_image_format (image),
+                                   image_size,
+                                   compressed_size,
+                                   vendor,
+                                   product,
+                                   NULL,
+                                   metrics,
+                                   install_error);
+  json = gis_install_record_to_json (record);
+  g_print ("%s\n", json);
+}
+
+/* Like the app, saves the trace of the write if GIS_TRACE_ENV is set; here,
+ * to the working directory.
+ */
+static void
+write_trace (GisScribe *scribe)
+{
+  GisTrace *trace = gis_scribe_get_trace (scribe);
+  g_autoptr(GFile) cwd = g_file_new_for_path (".");
+  g_autoptr(GFile) file = NULL;
+  g_autofree gchar *path = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (trace == NULL)
+    return;
+
+  file = gis_trace_write (trace, cwd, NULL, NULL, &error);
+  if (file == NULL)
+    {
+      g_printerr ("%s: failed to write trace: %s\n", g_get_prgname (),
+                  error->message);
+      return;
+    }
+
+  path = g_file_get_path (file);
+  g_printerr ("%s: wrote trace to %s\n", g_get_prgname (), path);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autofree gchar *signature_path = NULL;
+  g_autofree gchar *checksum_path = NULL;
+  gint target_fd = -1;
+  gboolean convert_to_mbr = FALSE;
+  gboolean json = FALSE;
+  gboolean quiet = FALSE;
+  GOptionEntry entries[] = {
+    { "signature", 's', 0, G_OPTION_ARG_FILENAME, &signature_path,
+      "GPG signature for IMAGE, or for the image within it if IMAGE is a "
+      "squashfs (default: IMAGE.asc)", "FILE" },
+    { "checksum", 'c', 0, G_OPTION_ARG_FILENAME, &checksum_path,
+      "SHA-256 checksum for IMAGE, used if there is no signature "
+      "(default: IMAGE.sha256)", "FILE" },
+    { "target-fd", 0, 0, G_OPTION_ARG_INT, &target_fd,
+      "Write to this open file descriptor, rather than opening TARGET", "FD" },
+    { "mbr", 0, 0, G_OPTION_ARG_NONE, &convert_to_mbr,
+      "Convert the target to an MBR partition table once written", NULL },
+    { "json", 0, 0, G_OPTION_ARG_NONE, &json,
+      "Print a line of JSON describing the install, rather than a table of "
+      "metrics", NULL },
+    { "quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet,
+      "Don't show progress", NULL },
+    { NULL }
+  };
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) image = NULL;
+  g_autoptr(GFile) signature = NULL;
+  g_autoptr(GFile) checksum = NULL;
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GCancellable) cancellable = NULL;
+  g_autoptr(GisScribe) scribe = NULL;
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GVariant) metrics = NULL;
+  const gchar *image_path;
+  const gchar *target_path;
+  GisImageFormat format;
+  guint64 required_size = 0;
+  guint64 uncompressed_size = 0;
+  guint64 split_size = 0;
+  guint64 compressed_size;
+  guint sigint_id, sigterm_id;
+  struct stat st;
+
+  setlocale (LC_ALL, "");
+  bindtextdomain (GETTEXT_PACKAGE, GNOMELOCALEDIR);
+  bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
+  textdomain (GETTEXT_PACKAGE);
+
+  context = g_option_context_new ("IMAGE TARGET");
+  g_option_context_set_summary (context,
+      "Writes IMAGE, an Endless OS disk image, to TARGET, a disk or file,\n"
+      "verifying it against its signature or checksum as it goes. If TARGET\n"
+      "is a file, or does not exist, it is written as a sparse file.");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s: %s\n", g_get_prgname (), error->message);
+      return EXIT_STATUS_USAGE;
+    }
+
+  if (argc != 3)
+    {
+      g_autofree gchar *help = g_option_context_get_help (context, TRUE, NULL);
+
+      g_printerr ("%s", help);
+      return EXIT_STATUS_USAGE;
+    }
+
+  image_path = argv[1];
+  target_path = argv[2];
+  image = g_file_new_for_commandline_arg (image_path);
+
+  if (!gis_image_probe_file (image_path, NULL, &format, &required_size,
+                             &uncompressed_size, &split_size))
+    {
+      g_printerr ("%s: %s is not a valid Endless OS image\n",
+                  g_get_prgname (), image_path);
+      return EXIT_STATUS_INVALID_IMAGE;
+    }
+
+  info = g_file_query_info (image, G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                            G_FILE_QUERY_INFO_NONE, NULL, &error);
+  if (info == NULL)
+    {
+      g_printerr ("%s: %s\n", g_get_prgname (), error->message);
+      return EXIT_STATUS_INVALID_IMAGE;
+    }
+
+  compressed_size = split_size > 0 ? split_size : g_file_info_get_size (info);
+
+  if (gis_split_image_is_split (image))
+    {
+      g_autoptr(GFile) manifest = gis_split_image_get_manifest (image);
+
+      /* The signature and checksum are for the manifest */
+      if (checksum_path == NULL)
+        checksum_path = g_file_get_path (manifest);
+      if (signature_path == NULL)
+        signature_path = g_strconcat (checksum_path, ".asc", NULL);
+    }
+  else
+    {
+      if (signature_path == NULL)
+        signature_path = g_strconcat (image_path, ".asc", NULL);
+      if (checksum_path == NULL)
+        checksum_path = g_strconcat (image_path, ".sha256", NULL);
+    }
+
+  /* The scribe reads the image within a squashfs, and decompresses split
+   * images as it reads them, so it reports progress through (and, for a
+   * squashfs, verifies) the uncompressed image.
+   */
+  if (gis_squashfs_reader_is_squashfs (image) ||
+      gis_split_image_is_split (image))
+    compressed_size = required_size;
+
+  if (target_fd < 0)
+    {
+      /* O_EXCL makes this fail if TARGET is a disk which is mounted. If
+       * TARGET doesn't exist, write the image to a new (sparse) file.
+       */
+      target_fd = open (target_path, O_WRONLY | O_CLOEXEC | O_EXCL);
+      if (target_fd < 0 && errno == ENOENT)
+        target_fd = open (target_path, O_WRONLY | O_CLOEXEC | O_CREAT | O_EXCL,
+                          0666);
+      if (target_fd < 0)
+        {
+          int errsv = errno;
+
+          g_printerr ("%s: can't open %s: %s\n", g_get_prgname (),
+                      target_path, g_strerror (errsv));
+          return EXIT_STATUS_FAILED;
+        }
+    }
+
+  if (convert_to_mbr &&
+      fstat (target_fd, &st) == 0 && S_ISREG (st.st_mode))
+    {
+      g_printerr ("%s: --mbr only works when TARGET is a disk\n",
+                  g_get_prgname ());
+      close (target_fd);
+      return EXIT_STATUS_USAGE;
+    }
+
+  signature = g_file_new_for_commandline_arg (signature_path);
+  checksum = g_file_new_for_commandline_arg (checksum_path);
+  scribe = gis_scribe_new (image,
+                           required_size,
+                           compressed_size,
+                           signature,
+                           checksum,
+                           target_path,
+                           target_fd,
+                           convert_to_mbr);
+
+  if (!quiet && isatty (STDERR_FILENO))
+    g_signal_connect (scribe, "notify::progress",
+                      (GCallback) progress_cb, NULL);
+
+  cancellable = g_cancellable_new ();
+  sigint_id = g_unix_signal_add (SIGINT, cancel_cb, cancellable);
+  sigterm_id = g_unix_signal_add (SIGTERM, cancel_cb, cancellable);
+
+  gis_scribe_write_async (scribe, cancellable, write_cb, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_source_remove (sigint_id);
+  g_source_remove (sigterm_id);
+
+  if (!quiet && isatty (STDERR_FILENO))
+    g_printerr ("\n");
+
+  gis_scribe_write_finish (scribe, result, &error);
+  write_trace (scribe);
+
+  metrics = gis_scribe_dup_metrics (scribe);
+  if (json)
+    print_record (image, required_size, compressed_size, metrics, error);
+  else
+    print_metrics (metrics);
+
+  if (error != NULL)
+    g_printerr ("%s: %s\n", g_get_prgname (), error->message);
+
+  return get_exit_status (error);
+}
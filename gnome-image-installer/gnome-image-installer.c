@@ -30,6 +30,7 @@
 #include <glib/gi18n.h>
 #include <udisks/udisks.h>
 
+#include "pages/batch/gis-batch-page.h"
 #include "pages/confirm/gis-confirm-page.h"
 #include "pages/diskimage/gis-diskimage-page.h"
 #include "pages/disktarget/gis-disktarget-page.h"
@@ -60,6 +61,17 @@ static PageData page_table[] = {
   { NULL },
 };
 
+/* In batch mode, drives are written as they are plugged in, until the
+ * installer is closed. The finished page is only reached if something goes
+ * wrong before then.
+ */
+static PageData batch_page_table[] = {
+  PAGE (diskimage),
+  PAGE (batch),
+  PAGE (finished),
+  { NULL },
+};
+
 #undef PAGE
 
 #define EOS_GROUP "EndlessOS"
@@ -206,7 +218,8 @@ check_for_live_boot (gchar **uuid)
 static void
 rebuild_pages_cb (GisDriver *driver)
 {
-  PageData *page_data = page_table;
+  PageData *table = gis_store_is_batch () ? batch_page_table : page_table;
+  PageData *page_data = table;
   GisAssistant *assistant;
   GisPage *current_page;
 
@@ -216,7 +229,7 @@ rebuild_pages_cb (GisDriver *driver)
   if (current_page != NULL) {
     destroy_pages_after (assistant, current_page);
 
-    for (page_data = page_table; page_data->page_id != NULL; ++page_data)
+    for (page_data = table; page_data->page_id != NULL; ++page_data)
       if (g_str_equal (page_data->page_id, GIS_PAGE_GET_CLASS (current_page)->page_id))
         break;
 
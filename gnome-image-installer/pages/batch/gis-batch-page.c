@@ -0,0 +1,346 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Batch page {{{1 */
+
+#define PAGE_ID "batch"
+
+#include "config.h"
+#include "batch-resources.h"
+#include "gis-batch-page.h"
+#include "gis-batch-writer.h"
+#include "gis-split-image.h"
+#include "gis-store.h"
+
+#include <udisks/udisks.h>
+#include <glib/gi18n.h>
+#include <gio/gio.h>
+
+typedef enum {
+  DRIVE_COLUMN_OBJECT_PATH = 0,
+  DRIVE_COLUMN_NAME,
+  DRIVE_COLUMN_STATUS,
+  /* TRUE until the drive has been written, or failed */
+  DRIVE_COLUMN_ACTIVE,
+} GisBatchPageDriveColumn;
+
+struct _GisBatchPagePrivate {
+  GisBatchWriter *writer;
+  guint inhibit_cookie;
+
+  guint n_written;
+  guint n_failed;
+
+  GtkLabel *status_label;
+  GtkLabel *summary_label;
+  GtkListStore *drive_store;
+};
+typedef struct _GisBatchPagePrivate GisBatchPagePrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (GisBatchPage, gis_batch_page, GIS_TYPE_PAGE);
+
+static void
+gis_batch_page_update_status (GisBatchPage *self)
+{
+  GisBatchPagePrivate *priv = gis_batch_page_get_instance_private (self);
+  guint n_queued = gis_batch_writer_get_n_queued (priv->writer);
+  guint n_writing = gis_batch_writer_get_n_writing (priv->writer);
+  g_autofree gchar *status = NULL;
+  g_autofree gchar *summary = NULL;
+
+  if (n_queued == 0 && n_writing == 0)
+    status = g_strdup (_("Plug in a disk to reformat it."));
+  else
+    status = g_strdup_printf (_("Reformatting %u disk(s), %u waiting"),
+                              n_writing, n_queued);
+
+  summary = g_strdup_printf (_("Finished: %u. Failed: %u."),
+                             priv->n_written, priv->n_failed);
+
+  gtk_label_set_text (priv->status_label, status);
+  gtk_label_set_text (priv->summary_label, summary);
+}
+
+static void
+gis_batch_page_counts_changed_cb (GObject    *object,
+                                  GParamSpec *pspec,
+                                  gpointer    data)
+{
+  gis_batch_page_update_status (GIS_BATCH_PAGE (data));
+}
+
+/* Finds the row for the drive at @object_path which is still being dealt
+ * with. The same drive may be plugged in more than once, each time getting a
+ * new row.
+ */
+static gboolean
+gis_batch_page_find_drive (GisBatchPage *self,
+                           const gchar  *object_path,
+                           GtkTreeIter  *iter)
+{
+  GisBatchPagePrivate *priv = gis_batch_page_get_instance_private (self);
+  GtkTreeModel *model = GTK_TREE_MODEL (priv->drive_store);
+  gboolean valid;
+
+  for (valid = gtk_tree_model_get_iter_first (model, iter);
+       valid;
+       valid = gtk_tree_model_iter_next (model, iter))
+    {
+      g_autofree gchar *row_path = NULL;
+      gboolean active;
+
+      gtk_tree_model_get (model, iter,
+                          DRIVE_COLUMN_OBJECT_PATH, &row_path,
+                          DRIVE_COLUMN_ACTIVE, &active,
+                          -1);
+      if (active && g_strcmp0 (row_path, object_path) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+gis_batch_page_drive_queued_cb (GisBatchWriter *writer,
+                                const gchar    *object_path,
+                                const gchar    *device,
+                                const gchar    *description,
+                                gpointer        data)
+{
+  GisBatchPage *self = GIS_BATCH_PAGE (data);
+  GisBatchPagePrivate *priv = gis_batch_page_get_instance_private (self);
+  g_autofree gchar *name = g_strdup_printf ("%s (%s)", description, device);
+  GtkTreeIter iter;
+
+  gtk_list_store_insert_with_values (priv->drive_store, &iter, -1,
+                                     DRIVE_COLUMN_OBJECT_PATH, object_path,
+                                     DRIVE_COLUMN_NAME, name,
+                                     DRIVE_COLUMN_STATUS, _("Waiting"),
+                                     DRIVE_COLUMN_ACTIVE, TRUE,
+                                     -1);
+}
+
+static void
+gis_batch_page_drive_started_cb (GisBatchWriter *writer,
+                                 const gchar    *object_path,
+                                 gpointer        data)
+{
+  GisBatchPage *self = GIS_BATCH_PAGE (data);
+  GisBatchPagePrivate *priv = gis_batch_page_get_instance_private (self);
+  GtkTreeIter iter;
+
+  if (gis_batch_page_find_drive (self, object_path, &iter))
+    gtk_list_store_set (priv->drive_store, &iter,
+                        DRIVE_COLUMN_STATUS, _("Reformatting…"),
+                        -1);
+}
+
+static void
+gis_batch_page_drive_finished_cb (GisBatchWriter *writer,
+                                  const gchar    *object_path,
+                                  gint64          duration_usec,
+                                  guint64         bytes,
+                                  const GError   *error,
+                                  gpointer        data)
+{
+  GisBatchPage *self = GIS_BATCH_PAGE (data);
+  GisBatchPagePrivate *priv = gis_batch_page_get_instance_private (self);
+  g_autofree gchar *status = NULL;
+  GtkTreeIter iter;
+
+  if (error != NULL)
+    {
+      /* Translators: the placeholder is an error message. */
+      status = g_strdup_printf (_("Failed: %s"), error->message);
+      priv->n_failed++;
+    }
+  else
+    {
+      gint64 seconds = MAX (duration_usec / G_USEC_PER_SEC, 1);
+      g_autofree gchar *rate = g_format_size (bytes / seconds);
+
+      /* Translators: the first placeholder is a duration in minutes and
+       * seconds, such as 12:34; the second is a rate, such as "20.5 MB".
+       */
+      status = g_strdup_printf (_("Finished in %d:%02d (%s/s)"),
+                                (int) (seconds / 60), (int) (seconds % 60),
+                                rate);
+      priv->n_written++;
+    }
+
+  if (gis_batch_page_find_drive (self, object_path, &iter))
+    gtk_list_store_set (priv->drive_store, &iter,
+                        DRIVE_COLUMN_STATUS, status,
+                        DRIVE_COLUMN_ACTIVE, FALSE,
+                        -1);
+
+  gis_batch_page_update_status (self);
+}
+
+static void
+gis_batch_page_start (GisBatchPage *self)
+{
+  GisBatchPagePrivate *priv = gis_batch_page_get_instance_private (self);
+  UDisksClient *client = UDISKS_CLIENT (gis_store_get_object (GIS_STORE_UDISKS_CLIENT));
+  GObject *image_source = gis_store_get_object (GIS_STORE_IMAGE_SOURCE);
+  GFile *image = G_FILE (gis_store_get_object (GIS_STORE_IMAGE));
+  const gchar *signature_path = gis_store_get_image_signature ();
+  g_autoptr(GFile) signature = g_file_new_for_path (signature_path);
+  g_autoptr(GFile) checksum = g_file_new_for_path (gis_store_get_image_checksum ());
+  guint64 uncompressed_size_bytes = gis_store_get_required_size ();
+  guint64 compressed_size_bytes = gis_store_get_image_size ();
+  const gchar *image_drive_path = NULL;
+
+  if (image_source != NULL && UDISKS_IS_DRIVE (image_source))
+    image_drive_path = g_dbus_proxy_get_object_path (G_DBUS_PROXY (image_source));
+
+  /* As on the install page, for squashfs images we read the mapped
+   * uncompressed image from within it, and split images are decompressed as
+   * they are read.
+   */
+  if (g_str_has_suffix (signature_path, ".img.asc") ||
+      gis_split_image_is_split (image))
+    compressed_size_bytes = uncompressed_size_bytes;
+
+  priv->writer = gis_batch_writer_new (client,
+                                       gis_store_get_unattended_config (),
+                                       image,
+                                       uncompressed_size_bytes,
+                                       compressed_size_bytes,
+                                       signature,
+                                       checksum,
+                                       gis_store_get_image_cache (),
+                                       gis_store_get_image_verifier (),
+                                       image_drive_path);
+
+  g_signal_connect (priv->writer, "notify::n-queued",
+                    G_CALLBACK (gis_batch_page_counts_changed_cb), self);
+  g_signal_connect (priv->writer, "notify::n-writing",
+                    G_CALLBACK (gis_batch_page_counts_changed_cb), self);
+  g_signal_connect (priv->writer, "drive-queued",
+                    G_CALLBACK (gis_batch_page_drive_queued_cb), self);
+  g_signal_connect (priv->writer, "drive-started",
+                    G_CALLBACK (gis_batch_page_drive_started_cb), self);
+  g_signal_connect (priv->writer, "drive-finished",
+                    G_CALLBACK (gis_batch_page_drive_finished_cb), self);
+
+  gis_batch_writer_start (priv->writer);
+  gis_batch_page_update_status (self);
+}
+
+static void
+gis_batch_page_shown (GisPage *page)
+{
+  GisBatchPage *self = GIS_BATCH_PAGE (page);
+  GisBatchPagePrivate *priv = gis_batch_page_get_instance_private (self);
+  GtkWidget *toplevel = gtk_widget_get_toplevel (GTK_WIDGET (page));
+
+  if (gis_store_get_error () != NULL)
+    {
+      gis_assistant_next_page (gis_driver_get_assistant (page->driver));
+      return;
+    }
+
+  if (priv->writer != NULL)
+    return;
+
+  /* The bench may be left alone for a while between drives. */
+  priv->inhibit_cookie =
+    gtk_application_inhibit (GTK_APPLICATION (page->driver),
+                             GTK_WINDOW (toplevel),
+                             GTK_APPLICATION_INHIBIT_SUSPEND |
+                             GTK_APPLICATION_INHIBIT_IDLE,
+                             _("Reformatting disks as they are plugged in."));
+  if (priv->inhibit_cookie == 0)
+    g_warning ("Failed to inhibit suspend/idle");
+
+  gis_batch_page_start (self);
+}
+
+static void
+gis_batch_page_dispose (GObject *object)
+{
+  GisBatchPage *self = GIS_BATCH_PAGE (object);
+  GisBatchPagePrivate *priv = gis_batch_page_get_instance_private (self);
+
+  if (priv->writer != NULL)
+    g_signal_handlers_disconnect_by_data (priv->writer, self);
+
+  g_clear_object (&priv->writer);
+
+  if (priv->inhibit_cookie != 0)
+    {
+      gtk_application_uninhibit (GTK_APPLICATION (GIS_PAGE (self)->driver),
+                                 priv->inhibit_cookie);
+      priv->inhibit_cookie = 0;
+    }
+
+  G_OBJECT_CLASS (gis_batch_page_parent_class)->dispose (object);
+}
+
+static void
+gis_batch_page_constructed (GObject *object)
+{
+  G_OBJECT_CLASS (gis_batch_page_parent_class)->constructed (object);
+
+  gtk_widget_show (GTK_WIDGET (object));
+}
+
+static void
+gis_batch_page_locale_changed (GisPage *page)
+{
+  gis_page_set_title (page, _("Batch Reformatting"));
+}
+
+static void
+gis_batch_page_class_init (GisBatchPageClass *klass)
+{
+  GisPageClass *page_class = GIS_PAGE_CLASS (klass);
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  gtk_widget_class_set_template_from_resource (GTK_WIDGET_CLASS (klass), "/org/gnome/initial-setup/gis-batch-page.ui");
+
+  gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisBatchPage, status_label);
+  gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisBatchPage, summary_label);
+  gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisBatchPage, drive_store);
+
+  page_class->page_id = PAGE_ID;
+  page_class->hide_forward_button = TRUE;
+  page_class->hide_backward_button = TRUE;
+  page_class->locale_changed = gis_batch_page_locale_changed;
+  page_class->shown = gis_batch_page_shown;
+  object_class->constructed = gis_batch_page_constructed;
+  object_class->dispose = gis_batch_page_dispose;
+}
+
+static void
+gis_batch_page_init (GisBatchPage *self)
+{
+  g_resources_register (batch_get_resource ());
+
+  gtk_widget_init_template (GTK_WIDGET (self));
+}
+
+void
+gis_prepare_batch_page (GisDriver *driver)
+{
+  gis_driver_add_page (driver,
+                       g_object_new (GIS_TYPE_BATCH_PAGE,
+                                     "driver", driver,
+                                     NULL));
+}
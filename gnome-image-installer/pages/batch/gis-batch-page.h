@@ -0,0 +1,52 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GIS_BATCH_PAGE_H__
+#define __GIS_BATCH_PAGE_H__
+
+#include "gnome-initial-setup.h"
+
+G_BEGIN_DECLS
+
+#define GIS_TYPE_BATCH_PAGE               (gis_batch_page_get_type ())
+#define GIS_BATCH_PAGE(obj)                           (G_TYPE_CHECK_INSTANCE_CAST ((obj), GIS_TYPE_BATCH_PAGE, GisBatchPage))
+#define GIS_BATCH_PAGE_CLASS(klass)                   (G_TYPE_CHECK_CLASS_CAST ((klass),  GIS_TYPE_BATCH_PAGE, GisBatchPageClass))
+#define GIS_IS_BATCH_PAGE(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GIS_TYPE_BATCH_PAGE))
+#define GIS_IS_BATCH_PAGE_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass),  GIS_TYPE_BATCH_PAGE))
+#define GIS_BATCH_PAGE_GET_CLASS(obj)                 (G_TYPE_INSTANCE_GET_CLASS ((obj),  GIS_TYPE_BATCH_PAGE, GisBatchPageClass))
+
+typedef struct _GisBatchPage        GisBatchPage;
+typedef struct _GisBatchPageClass   GisBatchPageClass;
+
+struct _GisBatchPage
+{
+  GisPage parent;
+};
+
+struct _GisBatchPageClass
+{
+  GisPageClass parent_class;
+};
+
+GType gis_batch_page_get_type (void);
+
+void gis_prepare_batch_page (GisDriver *driver);
+
+G_END_DECLS
+
+#endif /* __GIS_BATCH_PAGE_H__ */
@@ -0,0 +1,832 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "gis-batch-writer.h"
+
+#include <glib/gi18n.h>
+#include <gio/gunixfdlist.h>
+#include <unistd.h>
+
+#include "gis-scribe.h"
+
+/* How long to wait after a drive is plugged in before starting to write to it.
+ * This gives udisks a chance to finish probing it, and means that several
+ * drives plugged in at once are written together, reading and verifying the
+ * image only once.
+ */
+#define SETTLE_TIMEOUT_SECONDS 3
+
+typedef struct _GisBatchRun GisBatchRun;
+
+/* A drive which has been plugged in, and is waiting to be or being written. */
+typedef struct {
+  /* Object paths of the UDisksDrive and its whole-disk UDisksBlock */
+  gchar *drive_object_path;
+  gchar *block_object_path;
+  /* eg /dev/sdb */
+  gchar *device;
+
+  /* The run this job is part of, or NULL if it's still queued */
+  GisBatchRun *run;
+  /* Writable fd for device, once opened; owned until handed to the scribe */
+  gint fd;
+  /* Index of this job's target in run->scribe, or -1 if not (yet) added */
+  gint target_index;
+  GError *error;
+} GisBatchJob;
+
+/* One pass of a GisScribe over a group of jobs. */
+struct _GisBatchRun {
+  GisBatchWriter *self;
+  GisScribe *scribe;
+  /* (owned) GisBatchJob * */
+  GPtrArray *jobs;
+  guint pending_opens;
+};
+
+struct _GisBatchWriter {
+  GObject parent;
+
+  UDisksClient *client;
+  GisUnattendedConfig *config;
+  GFile *image;
+  guint64 image_size;
+  guint64 compressed_size;
+  GFile *signature;
+  GFile *checksum;
+  GisImageCache *image_cache;
+  GisImageVerifier *image_verifier;
+  /* Object path of the UDisksDrive hosting the image, if known */
+  gchar *image_drive_path;
+  guint max_concurrent_writes;
+
+  gboolean started;
+
+  /* Set of object paths of drives which have been queued since they were
+   * plugged in. Paths are removed when the drive is unplugged, so each drive
+   * is written once per insertion.
+   */
+  GHashTable *seen;
+
+  /* (owned) GisBatchJob * which are waiting for a free slot */
+  GQueue queue;
+  /* Number of jobs in a GisBatchRun */
+  guint n_writing;
+
+  /* (owned) GisScribe * which are not currently writing, kept to be reused by
+   * the next run.
+   */
+  GPtrArray *idle_scribes;
+
+  guint settle_id;
+};
+
+G_DEFINE_TYPE (GisBatchWriter, gis_batch_writer, G_TYPE_OBJECT)
+
+typedef enum {
+  PROP_N_QUEUED = 1,
+  PROP_N_WRITING,
+  N_PROPERTIES
+} GisBatchWriterPropertyId;
+
+static GParamSpec *props[N_PROPERTIES] = { 0 };
+
+enum {
+  DRIVE_QUEUED,
+  DRIVE_STARTED,
+  DRIVE_FINISHED,
+  N_SIGNALS
+};
+
+static guint signals[N_SIGNALS] = { 0 };
+
+static GisBatchJob *
+gis_batch_job_new (const gchar *drive_object_path,
+                   const gchar *block_object_path,
+                   const gchar *device)
+{
+  GisBatchJob *job = g_slice_new0 (GisBatchJob);
+
+  job->drive_object_path = g_strdup (drive_object_path);
+  job->block_object_path = g_strdup (block_object_path);
+  job->device = g_strdup (device);
+  job->fd = -1;
+  job->target_index = -1;
+
+  return job;
+}
+
+static void
+gis_batch_job_free (GisBatchJob *job)
+{
+  g_clear_pointer (&job->drive_object_path, g_free);
+  g_clear_pointer (&job->block_object_path, g_free);
+  g_clear_pointer (&job->device, g_free);
+  g_clear_error (&job->error);
+
+  if (job->fd != -1)
+    close (job->fd);
+  job->fd = -1;
+
+  g_slice_free (GisBatchJob, job);
+}
+
+static void
+gis_batch_run_free (GisBatchRun *run)
+{
+  g_clear_object (&run->self);
+  g_clear_object (&run->scribe);
+  g_clear_pointer (&run->jobs, g_ptr_array_unref);
+
+  g_slice_free (GisBatchRun, run);
+}
+
+static void
+gis_batch_writer_get_property (GObject    *object,
+                               guint       property_id,
+                               GValue     *value,
+                               GParamSpec *pspec)
+{
+  GisBatchWriter *self = GIS_BATCH_WRITER (object);
+
+  switch ((GisBatchWriterPropertyId) property_id)
+    {
+    case PROP_N_QUEUED:
+      g_value_set_uint (value, gis_batch_writer_get_n_queued (self));
+      break;
+
+    case PROP_N_WRITING:
+      g_value_set_uint (value, gis_batch_writer_get_n_writing (self));
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+gis_batch_writer_dispose (GObject *object)
+{
+  GisBatchWriter *self = GIS_BATCH_WRITER (object);
+
+  if (self->client != NULL)
+    {
+      GDBusObjectManager *manager =
+        udisks_client_get_object_manager (self->client);
+
+      g_signal_handlers_disconnect_by_data (manager, self);
+    }
+
+  if (self->settle_id != 0)
+    {
+      g_source_remove (self->settle_id);
+      self->settle_id = 0;
+    }
+
+  g_clear_object (&self->client);
+  g_clear_object (&self->config);
+  g_clear_object (&self->image);
+  g_clear_object (&self->signature);
+  g_clear_object (&self->checksum);
+  g_clear_object (&self->image_cache);
+  g_clear_object (&self->image_verifier);
+  g_clear_pointer (&self->idle_scribes, g_ptr_array_unref);
+
+  G_OBJECT_CLASS (gis_batch_writer_parent_class)->dispose (object);
+}
+
+static void
+gis_batch_writer_finalize (GObject *object)
+{
+  GisBatchWriter *self = GIS_BATCH_WRITER (object);
+
+  /* Each run holds a reference to self */
+  g_assert_cmpuint (self->n_writing, ==, 0);
+
+  g_queue_foreach (&self->queue, (GFunc) gis_batch_job_free, NULL);
+  g_queue_clear (&self->queue);
+  g_clear_pointer (&self->seen, g_hash_table_unref);
+  g_clear_pointer (&self->image_drive_path, g_free);
+
+  G_OBJECT_CLASS (gis_batch_writer_parent_class)->finalize (object);
+}
+
+static void
+gis_batch_writer_class_init (GisBatchWriterClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->get_property = gis_batch_writer_get_property;
+  object_class->dispose = gis_batch_writer_dispose;
+  object_class->finalize = gis_batch_writer_finalize;
+
+  /**
+   * GisBatchWriter:n-queued:
+   *
+   * Number of drives which have been plugged in and are waiting to be written.
+   */
+  props[PROP_N_QUEUED] = g_param_spec_uint (
+      "n-queued",
+      "Queued drives",
+      "Number of drives waiting to be written",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GisBatchWriter:n-writing:
+   *
+   * Number of drives which are currently being written. This never exceeds
+   * the [Batch] max-concurrent-writes setting.
+   */
+  props[PROP_N_WRITING] = g_param_spec_uint (
+      "n-writing",
+      "Drives being written",
+      "Number of drives currently being written",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, props);
+
+  /**
+   * GisBatchWriter::drive-queued:
+   * @drive_object_path: object path of the UDisksDrive
+   * @device: path to the drive's block device, such as /dev/sdb
+   * @description: human-readable name of the drive
+   *
+   * Emitted when a suitable drive is plugged in.
+   */
+  signals[DRIVE_QUEUED] =
+    g_signal_new ("drive-queued",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL, NULL, NULL,
+                  G_TYPE_NONE, 3,
+                  G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+
+  /**
+   * GisBatchWriter::drive-started:
+   * @drive_object_path: object path of the UDisksDrive
+   *
+   * Emitted when writing to a queued drive begins.
+   */
+  signals[DRIVE_STARTED] =
+    g_signal_new ("drive-started",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL, NULL, NULL,
+                  G_TYPE_NONE, 1,
+                  G_TYPE_STRING);
+
+  /**
+   * GisBatchWriter::drive-finished:
+   * @drive_object_path: object path of the UDisksDrive
+   * @duration_usec: time taken to write the drive, in microseconds, or 0 if
+   *  writing never began
+   * @bytes: number of bytes of image data written to the drive
+   * @error: (nullable): the error writing to the drive failed with, or %NULL
+   *  on success
+   *
+   * Emitted when a queued drive has been written, or has failed, or has been
+   * unplugged before writing began.
+   */
+  signals[DRIVE_FINISHED] =
+    g_signal_new ("drive-finished",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL, NULL, NULL,
+                  G_TYPE_NONE, 4,
+                  G_TYPE_STRING, G_TYPE_INT64, G_TYPE_UINT64, G_TYPE_ERROR);
+}
+
+static void
+gis_batch_writer_init (GisBatchWriter *self)
+{
+  self->seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->idle_scribes = g_ptr_array_new_with_free_func (g_object_unref);
+  g_queue_init (&self->queue);
+}
+
+/**
+ * gis_batch_writer_new:
+ * @client: the UDisks client to watch for new drives
+ * @config: the unattended configuration, which must be in batch mode
+ * @image_cache: (nullable): cache of decompressed images, so that the image
+ *  only needs to be read, verified and decompressed once
+ * @image_verifier: (nullable): verifier which may already have checked
+ *  @image, so that it need not be verified while it is written
+ * @image_drive_path: (nullable): object path of the UDisksDrive which hosts
+ *  @image, which is never written
+ *
+ * The remaining arguments are as for gis_scribe_new().
+ *
+ * Returns: (transfer full): a new #GisBatchWriter. Call
+ *  gis_batch_writer_start() to start watching for drives.
+ */
+GisBatchWriter *
+gis_batch_writer_new (UDisksClient        *client,
+                      GisUnattendedConfig *config,
+                      GFile               *image,
+                      guint64              image_size,
+                      guint64              compressed_size,
+                      GFile               *signature,
+                      GFile               *checksum,
+                      GisImageCache       *image_cache,
+                      GisImageVerifier    *image_verifier,
+                      const gchar         *image_drive_path)
+{
+  GisBatchWriter *self;
+
+  g_return_val_if_fail (UDISKS_IS_CLIENT (client), NULL);
+  g_return_val_if_fail (GIS_IS_UNATTENDED_CONFIG (config), NULL);
+  g_return_val_if_fail (G_IS_FILE (image), NULL);
+  g_return_val_if_fail (G_IS_FILE (signature), NULL);
+  g_return_val_if_fail (G_IS_FILE (checksum), NULL);
+
+  self = g_object_new (GIS_TYPE_BATCH_WRITER, NULL);
+  self->client = g_object_ref (client);
+  self->config = g_object_ref (config);
+  self->image = g_object_ref (image);
+  self->image_size = image_size;
+  self->compressed_size = compressed_size;
+  self->signature = g_object_ref (signature);
+  self->checksum = g_object_ref (checksum);
+  if (image_cache != NULL)
+    self->image_cache = g_object_ref (image_cache);
+  if (image_verifier != NULL)
+    self->image_verifier = g_object_ref (image_verifier);
+  self->image_drive_path = g_strdup (image_drive_path);
+  self->max_concurrent_writes =
+    gis_unattended_config_get_max_concurrent_writes (config);
+
+  return self;
+}
+
+static void
+gis_batch_writer_notify_counts (GisBatchWriter *self)
+{
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_N_QUEUED]);
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_N_WRITING]);
+}
+
+static void
+gis_batch_writer_report (GisBatchWriter *self,
+                         GisBatchJob    *job,
+                         gint64          duration_usec)
+{
+  guint64 bytes = (job->error == NULL) ? self->image_size : 0;
+
+  if (job->error != NULL)
+    {
+      g_message ("%s: batch write failed: %s", job->device, job->error->message);
+    }
+  else
+    {
+      gint64 seconds = duration_usec / G_USEC_PER_SEC;
+      gdouble rate = (duration_usec > 0)
+        ? (gdouble) bytes * G_USEC_PER_SEC / (gdouble) duration_usec
+        : 0;
+
+      g_message ("%s: batch write complete: %01" G_GINT64_FORMAT ":%02d:%02d, "
+                 "%.1f MB/s",
+                 job->device, seconds / (60 * 60), (int) (seconds / 60) % 60,
+                 (int) seconds % 60, rate / 1000000);
+    }
+
+  g_signal_emit (self, signals[DRIVE_FINISHED], 0,
+                 job->drive_object_path, duration_usec, bytes, job->error);
+}
+
+static void gis_batch_writer_start_runs (GisBatchWriter *self);
+
+static void
+gis_batch_writer_finish_run (GisBatchRun *run)
+{
+  GisBatchWriter *self = g_object_ref (run->self);
+  guint i;
+
+  for (i = 0; i < run->jobs->len; i++)
+    {
+      GisBatchJob *job = g_ptr_array_index (run->jobs, i);
+      gint64 duration_usec = 0;
+
+      /* Jobs which failed to open never started writing. The others are
+       * written in parallel, but each drive finishes at its own pace.
+       */
+      if (job->target_index >= 0)
+        duration_usec = gis_scribe_get_target_duration (run->scribe,
+                                                        job->target_index);
+
+      gis_batch_writer_report (self, job, duration_usec);
+    }
+
+  g_assert_cmpuint (self->n_writing, >=, run->jobs->len);
+  self->n_writing -= run->jobs->len;
+
+  if (run->scribe != NULL)
+    g_ptr_array_add (self->idle_scribes, g_steal_pointer (&run->scribe));
+
+  gis_batch_run_free (run);
+  gis_batch_writer_notify_counts (self);
+
+  /* Drives which were queued while all slots were busy, and have settled. */
+  if (self->settle_id == 0)
+    gis_batch_writer_start_runs (self);
+
+  g_object_unref (self);
+}
+
+static void
+gis_batch_writer_write_cb (GObject      *source,
+                           GAsyncResult *result,
+                           gpointer      data)
+{
+  GisScribe *scribe = GIS_SCRIBE (source);
+  GisBatchRun *run = data;
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+  guint i;
+
+  ret = gis_scribe_write_finish (scribe, result, &error);
+
+  for (i = 0; i < run->jobs->len; i++)
+    {
+      GisBatchJob *job = g_ptr_array_index (run->jobs, i);
+
+      if (job->error != NULL || job->target_index < 0)
+        continue;
+
+      job->error = gis_scribe_dup_target_error (scribe, job->target_index);
+
+      /* Reading, verifying or decompressing the image failed, so all targets
+       * failed, even if they didn't notice.
+       */
+      if (job->error == NULL && !ret)
+        job->error = g_error_copy (error);
+    }
+
+  gis_batch_writer_finish_run (run);
+}
+
+static void
+gis_batch_writer_begin_write (GisBatchRun *run)
+{
+  GisBatchWriter *self = run->self;
+  guint n_targets = 0;
+  guint i;
+
+  if (self->idle_scribes->len > 0)
+    {
+      guint last = self->idle_scribes->len - 1;
+
+      run->scribe = g_object_ref (g_ptr_array_index (self->idle_scribes, last));
+      g_ptr_array_remove_index_fast (self->idle_scribes, last);
+    }
+  else
+    {
+      /* Neither the target machines nor their firmware are known, so leave
+       * the partition table as it is in the image.
+       */
+      run->scribe = gis_scribe_new (self->image,
+                                    self->image_size,
+                                    self->compressed_size,
+                                    self->signature,
+                                    self->checksum,
+                                    NULL, -1,
+                                    FALSE);
+      g_object_set (run->scribe,
+                    "image-cache", self->image_cache,
+                    "image-verifier", self->image_verifier,
+                    NULL);
+    }
+
+  for (i = 0; i < run->jobs->len; i++)
+    {
+      GisBatchJob *job = g_ptr_array_index (run->jobs, i);
+
+      if (job->fd < 0)
+        continue;
+
+      gis_scribe_add_target (run->scribe, job->device, job->fd);
+      job->fd = -1;
+      job->target_index = n_targets++;
+    }
+
+  if (n_targets == 0)
+    {
+      gis_batch_writer_finish_run (run);
+      return;
+    }
+
+  gis_scribe_write_async (run->scribe, NULL, gis_batch_writer_write_cb, run);
+}
+
+static void
+gis_batch_writer_open_for_restore_cb (GObject      *source,
+                                      GAsyncResult *result,
+                                      gpointer      data)
+{
+  UDisksBlock *block = UDISKS_BLOCK (source);
+  GisBatchJob *job = data;
+  GisBatchRun *run = job->run;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) fd_index = NULL;
+
+  if (udisks_block_call_open_for_restore_finish (block, &fd_index, &fd_list,
+                                                 result, &job->error))
+    {
+      job->fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (fd_index),
+                                    &job->error);
+      if (job->fd < 0)
+        g_prefix_error (&job->error,
+                        "Error extracting fd with handle %d from D-Bus message: ",
+                        g_variant_get_handle (fd_index));
+    }
+
+  g_assert_cmpuint (run->pending_opens, >, 0);
+  if (--run->pending_opens == 0)
+    gis_batch_writer_begin_write (run);
+}
+
+static void
+gis_batch_writer_start_runs (GisBatchWriter *self)
+{
+  while (!g_queue_is_empty (&self->queue) &&
+         self->n_writing < self->max_concurrent_writes)
+    {
+      guint n_jobs = MIN (g_queue_get_length (&self->queue),
+                          self->max_concurrent_writes - self->n_writing);
+      GisBatchRun *run = g_slice_new0 (GisBatchRun);
+      guint i;
+
+      run->self = g_object_ref (self);
+      run->jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) gis_batch_job_free);
+
+      for (i = 0; i < n_jobs; i++)
+        {
+          GisBatchJob *job = g_queue_pop_head (&self->queue);
+
+          job->run = run;
+          g_ptr_array_add (run->jobs, job);
+        }
+
+      self->n_writing += n_jobs;
+      gis_batch_writer_notify_counts (self);
+
+      g_message ("starting batch write to %u drive(s)", n_jobs);
+
+      /* Count all opens as pending before starting any, since a call could
+       * conceivably complete before the next one begins.
+       */
+      run->pending_opens = n_jobs + 1;
+      for (i = 0; i < n_jobs; i++)
+        {
+          GisBatchJob *job = g_ptr_array_index (run->jobs, i);
+          g_autoptr(UDisksObject) object =
+            udisks_client_get_object (self->client, job->block_object_path);
+          UDisksBlock *block =
+            (object != NULL) ? udisks_object_peek_block (object) : NULL;
+
+          g_signal_emit (self, signals[DRIVE_STARTED], 0,
+                         job->drive_object_path);
+
+          if (block == NULL)
+            {
+              g_set_error_literal (&job->error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                                   _("The drive was removed before it could be written."));
+              run->pending_opens--;
+              continue;
+            }
+
+          udisks_block_call_open_for_restore (block,
+                                              g_variant_new ("a{sv}", NULL), /* options */
+                                              NULL, /* fd_list */
+                                              NULL, /* cancellable */
+                                              gis_batch_writer_open_for_restore_cb,
+                                              job);
+        }
+
+      if (--run->pending_opens == 0)
+        gis_batch_writer_begin_write (run);
+    }
+}
+
+static gboolean
+gis_batch_writer_settle_cb (gpointer data)
+{
+  GisBatchWriter *self = GIS_BATCH_WRITER (data);
+
+  self->settle_id = 0;
+  gis_batch_writer_start_runs (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Finds the drive and its whole-disk block device, given either of them as
+ * @object. Returns FALSE if @object is neither, or if the other one has not
+ * appeared yet: udisks adds them separately, in no particular order.
+ */
+static gboolean
+gis_batch_writer_get_drive_and_block (GisBatchWriter  *self,
+                                      UDisksObject    *object,
+                                      UDisksDrive    **drive_out,
+                                      UDisksBlock    **block_out)
+{
+  UDisksDrive *drive = udisks_object_peek_drive (object);
+  UDisksBlock *block = udisks_object_peek_block (object);
+
+  if (drive != NULL)
+    {
+      *block_out = udisks_client_get_block_for_drive (self->client, drive, TRUE);
+      if (*block_out == NULL)
+        return FALSE;
+
+      *drive_out = g_object_ref (drive);
+      return TRUE;
+    }
+
+  if (block != NULL && udisks_object_peek_partition (object) == NULL)
+    {
+      *drive_out = udisks_client_get_drive_for_block (self->client, block);
+      if (*drive_out == NULL)
+        return FALSE;
+
+      *block_out = g_object_ref (block);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+gis_batch_writer_object_added_cb (GDBusObjectManager *manager,
+                                  GDBusObject        *object,
+                                  gpointer            data)
+{
+  GisBatchWriter *self = GIS_BATCH_WRITER (data);
+  g_autoptr(UDisksDrive) drive = NULL;
+  g_autoptr(UDisksBlock) block = NULL;
+  g_autoptr(GDBusObject) block_object = NULL;
+  g_autofree gchar *description = NULL;
+  const gchar *drive_object_path;
+  const gchar *device;
+  GisBatchJob *job;
+
+  if (!gis_batch_writer_get_drive_and_block (self, UDISKS_OBJECT (object),
+                                             &drive, &block))
+    return;
+
+  drive_object_path = g_dbus_proxy_get_object_path (G_DBUS_PROXY (drive));
+  device = udisks_block_get_device (block);
+
+  /* Both the drive and its block device were added; only look at it once */
+  if (g_hash_table_contains (self->seen, drive_object_path))
+    return;
+
+#define skip_if(cond, reason, ...) \
+  if (cond) \
+    { \
+      g_message ("skipping drive %s: " reason, drive_object_path, ##__VA_ARGS__); \
+      return; \
+    }
+
+  skip_if (g_strcmp0 (drive_object_path, self->image_drive_path) == 0,
+           "it hosts the image partition");
+  skip_if (udisks_drive_get_optical (drive), "optical");
+  skip_if (!udisks_drive_get_media_available (drive), "no media");
+  skip_if (udisks_block_get_read_only (block), "block device is read-only");
+  skip_if (udisks_drive_get_size (drive) < self->image_size,
+           "it is too small (%" G_GUINT64_FORMAT " bytes)",
+           udisks_drive_get_size (drive));
+  skip_if (!gis_unattended_config_matches_device (self->config, device),
+           "it doesn't match the unattended config");
+#undef skip_if
+
+  g_message ("queueing drive %s (%s) for batch write", drive_object_path, device);
+
+  block_object = g_dbus_interface_dup_object (G_DBUS_INTERFACE (block));
+  g_hash_table_add (self->seen, g_strdup (drive_object_path));
+
+  job = gis_batch_job_new (drive_object_path,
+                           g_dbus_object_get_object_path (block_object),
+                           device);
+  g_queue_push_tail (&self->queue, job);
+
+  description = g_strdup_printf ("%s %s",
+                                 udisks_drive_get_vendor (drive),
+                                 udisks_drive_get_model (drive));
+  g_signal_emit (self, signals[DRIVE_QUEUED], 0,
+                 drive_object_path, device, g_strstrip (description));
+  gis_batch_writer_notify_counts (self);
+
+  /* Wait for things to settle down before starting, in case several drives
+   * are being plugged in at once.
+   */
+  if (self->settle_id != 0)
+    g_source_remove (self->settle_id);
+  self->settle_id = g_timeout_add_seconds (SETTLE_TIMEOUT_SECONDS,
+                                           gis_batch_writer_settle_cb, self);
+}
+
+static void
+gis_batch_writer_object_removed_cb (GDBusObjectManager *manager,
+                                    GDBusObject        *object,
+                                    gpointer            data)
+{
+  GisBatchWriter *self = GIS_BATCH_WRITER (data);
+  const gchar *object_path = g_dbus_object_get_object_path (object);
+  GList *l;
+
+  /* If it's plugged in again, it should be written again. */
+  if (!g_hash_table_remove (self->seen, object_path))
+    return;
+
+  for (l = self->queue.head; l != NULL; l = l->next)
+    {
+      GisBatchJob *job = l->data;
+
+      if (g_strcmp0 (job->drive_object_path, object_path) != 0)
+        continue;
+
+      g_queue_delete_link (&self->queue, l);
+
+      g_set_error_literal (&job->error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                           _("The drive was removed before it could be written."));
+      gis_batch_writer_report (self, job, 0);
+      gis_batch_job_free (job);
+      gis_batch_writer_notify_counts (self);
+      break;
+    }
+}
+
+/**
+ * gis_batch_writer_start:
+ *
+ * Starts watching for drives being plugged in. Each suitable drive is written
+ * once per insertion, until @self is destroyed. Drives which are present
+ * before this function is called are never written.
+ */
+void
+gis_batch_writer_start (GisBatchWriter *self)
+{
+  GDBusObjectManager *manager;
+
+  g_return_if_fail (GIS_IS_BATCH_WRITER (self));
+  g_return_if_fail (!self->started);
+
+  self->started = TRUE;
+
+  manager = udisks_client_get_object_manager (self->client);
+  g_signal_connect (manager, "object-added",
+                    G_CALLBACK (gis_batch_writer_object_added_cb), self);
+  g_signal_connect (manager, "object-removed",
+                    G_CALLBACK (gis_batch_writer_object_removed_cb), self);
+
+  g_message ("batch mode: waiting for drives (at most %u at once)",
+             self->max_concurrent_writes);
+}
+
+/**
+ * gis_batch_writer_get_n_queued:
+ *
+ * Returns: the #GisBatchWriter:n-queued property.
+ */
+guint
+gis_batch_writer_get_n_queued (GisBatchWriter *self)
+{
+  g_return_val_if_fail (GIS_IS_BATCH_WRITER (self), 0);
+
+  return g_queue_get_length (&self->queue);
+}
+
+/**
+ * gis_batch_writer_get_n_writing:
+ *
+ * Returns: the #GisBatchWriter:n-writing property.
+ */
+guint
+gis_batch_writer_get_n_writing (GisBatchWriter *self)
+{
+  g_return_val_if_fail (GIS_IS_BATCH_WRITER (self), 0);
+
+  return self->n_writing;
+}
@@ -0,0 +1,57 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_BATCH_WRITER_H
+#define GIS_BATCH_WRITER_H
+
+#include <gio/gio.h>
+#include <udisks/udisks.h>
+
+#include "gis-image-cache.h"
+#include "gis-image-verifier.h"
+#include "gis-unattended-config.h"
+
+G_BEGIN_DECLS
+
+#define GIS_TYPE_BATCH_WRITER (gis_batch_writer_get_type ())
+G_DECLARE_FINAL_TYPE (GisBatchWriter, gis_batch_writer, GIS, BATCH_WRITER, GObject)
+
+GisBatchWriter *
+gis_batch_writer_new (UDisksClient        *client,
+                      GisUnattendedConfig *config,
+                      GFile               *image,
+                      guint64              image_size,
+                      guint64              compressed_size,
+                      GFile               *signature,
+                      GFile               *checksum,
+                      GisImageCache       *image_cache,
+                      GisImageVerifier    *image_verifier,
+                      const gchar         *image_drive_path);
+
+void
+gis_batch_writer_start (GisBatchWriter *self);
+
+guint
+gis_batch_writer_get_n_queued (GisBatchWriter *self);
+
+guint
+gis_batch_writer_get_n_writing (GisBatchWriter *self);
+
+G_END_DECLS
+
+#endif /* GIS_BATCH_WRITER_H */
@@ -26,7 +26,9 @@
 #include "gis-confirm-page.h"
 #include "gis-dmi.h"
 #include "gis-errors.h"
+#include "gis-install-page.h"
 #include "gis-store.h"
+#include "gis-throughput.h"
 
 #include <udisks/udisks.h>
 #include <glib/gstdio.h>
@@ -43,6 +45,13 @@ struct _GisConfirmPagePrivate {
     GtkLabel *model1_label;
     GtkLabel *device1_label;
     GtkLabel *size1_label;
+    GtkLabel *estimate1_caption;
+    GtkLabel *estimate1_label;
+
+    /* Vendor and model of the target, which past install times are
+     * recorded against
+     */
+    gchar *target_model;
 
     GtkBox *warning_box;
     GtkLabel *warning_label;
@@ -55,6 +64,8 @@ struct _GisConfirmPagePrivate {
 
     guint countdown_source;
     guint countdown_remaining_seconds;
+
+    GCancellable *prewarm_cancellable;
 };
 typedef struct _GisConfirmPagePrivate GisConfirmPagePrivate;
 
@@ -75,12 +86,62 @@ gis_confirm_page_advance (GisConfirmPage *self)
   gis_assistant_next_page (gis_driver_get_assistant (page->driver));
 }
 
+/* Shows roughly how long the install will take, once enough is known to
+ * say. Past installs to the same model of disk are the best guide; failing
+ * that, the disk target page measures how fast the disk can be read, in the
+ * background, so this is called again as the countdown ticks in case it has
+ * finished since.
+ */
+static void
+gis_confirm_page_update_estimate (GisConfirmPage *self)
+{
+  GisConfirmPagePrivate *priv = gis_confirm_page_get_instance_private (self);
+  GFile *image_dir = G_FILE (gis_store_get_object (GIS_STORE_IMAGE_DIR));
+  g_autofree gchar *image_dir_path = NULL;
+  g_autofree gchar *estimate = NULL;
+  gdouble write_rate = 0;
+  gdouble decode_rate, verify_rate;
+  guint64 seconds;
+  guint minutes;
+
+  if (image_dir != NULL)
+    image_dir_path = g_file_get_path (image_dir);
+
+  if (image_dir_path != NULL)
+    write_rate = gis_throughput_history_lookup (image_dir_path,
+                                                priv->target_model);
+
+  if (write_rate <= 0)
+    write_rate = gis_store_get_target_rate ();
+
+  gis_store_get_image_rates (&decode_rate, &verify_rate);
+  seconds = gis_throughput_estimate_seconds (gis_store_get_image_size (),
+                                             gis_store_get_required_size (),
+                                             write_rate,
+                                             decode_rate,
+                                             verify_rate);
+  gtk_widget_set_visible (GTK_WIDGET (priv->estimate1_caption), seconds > 0);
+  gtk_widget_set_visible (GTK_WIDGET (priv->estimate1_label), seconds > 0);
+  if (seconds == 0)
+    return;
+
+  minutes = MAX (1, (seconds + 30) / 60);
+  estimate = g_strdup_printf (g_dngettext (GETTEXT_PACKAGE,
+                                           "About %u minute",
+                                           "About %u minutes",
+                                           minutes),
+                              minutes);
+  gtk_label_set_text (priv->estimate1_label, estimate);
+}
+
 static gboolean
 gis_confirm_page_countdown_cb (gpointer data)
 {
   GisConfirmPage *self = GIS_CONFIRM_PAGE (data);
   GisConfirmPagePrivate *priv = gis_confirm_page_get_instance_private (self);
 
+  gis_confirm_page_update_estimate (self);
+
   if (priv->countdown_remaining_seconds == 0)
     {
       gis_confirm_page_advance (self);
@@ -124,6 +185,13 @@ gis_confirm_page_start_countdown (GisConfirmPage *self)
   priv->countdown_source = g_timeout_add_seconds (1,
                                                   gis_confirm_page_countdown_cb,
                                                   self);
+
+  /* Nothing is written to the disk until the countdown ends, but there's no
+   * reason not to start reading, verifying and decompressing the image in the
+   * meantime.
+   */
+  priv->prewarm_cancellable = g_cancellable_new ();
+  gis_install_page_prewarm (priv->prewarm_cancellable);
 }
 
 static void
@@ -185,12 +253,16 @@ gis_confirm_page_shown (GisPage *page)
                                   udisks_drive_get_model  (target_drive));
   g_strstrip (target_model);
   gtk_label_set_text (priv->model1_label, target_model);
+  g_free (priv->target_model);
+  priv->target_model = g_strdup (target_model);
   gtk_label_set_text (priv->device1_label, udisks_block_get_device (target_block));
   target_size = g_format_size (udisks_drive_get_size (target_drive));
   gtk_label_set_text (priv->size1_label, target_size);
 
   g_clear_object (&target_drive);
 
+  gis_confirm_page_update_estimate (self);
+
   config = gis_store_get_unattended_config ();
   g_assert (config != NULL);
   match = gis_unattended_config_match_computer (config, vendor, product);
@@ -221,11 +293,19 @@ static void
 gis_confirm_page_cancel_clicked (GtkButton *button,
                                  GisConfirmPage *self)
 {
+  GisConfirmPagePrivate *priv = gis_confirm_page_get_instance_private (self);
   g_autoptr(GError) error =
     g_error_new_literal (G_IO_ERROR,
                          G_IO_ERROR_CANCELLED,
                          _("Unattended installation was cancelled."));
 
+  /* Throw away whatever the countdown read ahead. */
+  if (priv->prewarm_cancellable != NULL)
+    {
+      g_cancellable_cancel (priv->prewarm_cancellable);
+      gis_store_clear_object (GIS_STORE_PREWARMED_SCRIBE);
+    }
+
   gis_store_set_error (error);
   gis_confirm_page_advance (self);
 }
@@ -257,6 +337,30 @@ gis_confirm_page_constructed (GObject *object)
   gtk_widget_show (GTK_WIDGET (self));
 }
 
+static void
+gis_confirm_page_dispose (GObject *object)
+{
+  GisConfirmPage *self = GIS_CONFIRM_PAGE (object);
+  GisConfirmPagePrivate *priv = gis_confirm_page_get_instance_private (self);
+
+  /* Has no effect if the install page has already started writing. */
+  g_cancellable_cancel (priv->prewarm_cancellable);
+  g_clear_object (&priv->prewarm_cancellable);
+
+  G_OBJECT_CLASS (gis_confirm_page_parent_class)->dispose (object);
+}
+
+static void
+gis_confirm_page_finalize (GObject *object)
+{
+  GisConfirmPage *self = GIS_CONFIRM_PAGE (object);
+  GisConfirmPagePrivate *priv = gis_confirm_page_get_instance_private (self);
+
+  g_free (priv->target_model);
+
+  G_OBJECT_CLASS (gis_confirm_page_parent_class)->finalize (object);
+}
+
 static void
 gis_confirm_page_locale_changed (GisPage *page)
 {
@@ -278,6 +382,8 @@ gis_confirm_page_class_init (GisConfirmPageClass *klass)
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisConfirmPage, model1_label);
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisConfirmPage, device1_label);
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisConfirmPage, size1_label);
+  gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisConfirmPage, estimate1_caption);
+  gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisConfirmPage, estimate1_label);
 
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisConfirmPage, warning_box);
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisConfirmPage, warning_label);
@@ -294,6 +400,8 @@ gis_confirm_page_class_init (GisConfirmPageClass *klass)
   page_class->locale_changed = gis_confirm_page_locale_changed;
   page_class->shown = gis_confirm_page_shown;
   object_class->constructed = gis_confirm_page_constructed;
+  object_class->dispose = gis_confirm_page_dispose;
+  object_class->finalize = gis_confirm_page_finalize;
 }
 
 static void
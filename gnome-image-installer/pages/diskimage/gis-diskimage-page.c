@@ -28,10 +28,14 @@
 #include "diskimage-resources.h"
 #include "gis-diskimage-page.h"
 #include "gis-errors.h"
+#include "gis-http-image.h"
+#include "gis-image-catalog.h"
+#include "gis-image-metadata-cache.h"
+#include "gis-image-probe.h"
+#include "gis-split-image.h"
+#include "gis-squashfs-reader.h"
 #include "gis-store.h"
-#include "gpt.h"
-#include "gpt_gz.h"
-#include "gpt_lzma.h"
+#include "gis-throughput.h"
 
 #define GNOME_DESKTOP_USE_UNSTABLE_API
 #include <libgnome-desktop/gnome-languages.h>
@@ -46,6 +50,21 @@
 struct _GisDiskImagePagePrivate {
     GtkListStore *image_store;
     GtkComboBox *image_combo;
+
+    /* Cancels background verification of the previously-selected image */
+    GCancellable *verify_cancellable;
+
+    /* Cancels measuring how fast the previously-selected image decompresses */
+    GCancellable *rate_cancellable;
+
+    /* What was learned about the images the last time they were probed */
+    GisImageMetadataCache *metadata_cache;
+
+    /* For an image on an HTTP server: cancels fetching its signature and
+     * checksum, which are saved in url_tmpdir, and probing it.
+     */
+    GCancellable *url_cancellable;
+    gchar *url_tmpdir;
 };
 typedef struct _GisDiskImagePagePrivate GisDiskImagePagePrivate;
 
@@ -53,13 +72,19 @@ G_DEFINE_TYPE_WITH_PRIVATE (GisDiskImagePage, gis_diskimage_page, GIS_TYPE_PAGE)
 
 /* A symlink to the uncompressed endless.img loopback mount used in image
  * boots, useful for 2 reasons:
- * - We currently have no other way of reading the image within the squashfs,
- *   if that is the setup that we have booted from.
+ * - If that is the setup that we have booted from, the kernel has probably
+ *   already got some of the image within the squashfs in its page cache, so
+ *   this is cheaper than reading it ourselves with GisSquashfsReader.
  * - udisks still uses FUSE-based NTFS drivers, which incur a big overhead,
  *   for any less usual case where NTFS is being used for live boot.
  */
 static const gchar * const live_device_path = "/dev/disk/endless-image";
 
+/* How much of an image on an HTTP server to fetch to find its partition
+ * table. This is far more than is needed, even if it is compressed.
+ */
+#define HTTP_HEAD_SIZE (1024 * 1024)
+
 /* Deliberately out-of-order so that sorting is exercised in English */
 static const gchar * const sea_locales[] = {
   "th",
@@ -80,6 +105,211 @@ enum {
     IMAGE_REQUIRED_SIZE
 };
 
+typedef struct {
+    GisPage *page;
+    GisImageMetadataCache *metadata_cache;
+    gchar *path;
+} VerifyData;
+
+static void
+verify_data_free (VerifyData *data)
+{
+  g_clear_object (&data->page);
+  g_clear_object (&data->metadata_cache);
+  g_free (data->path);
+  g_free (data);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (VerifyData, verify_data_free);
+
+/* Remembers the outcome of verifying the image, so that it need not be
+ * verified in the background next time.
+ */
+static void
+verify_data_record (VerifyData           *data,
+                    GisImageVerification  verification)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (data->metadata_cache == NULL || data->path == NULL)
+    return;
+
+  gis_image_metadata_cache_set_verification (data->metadata_cache,
+                                             data->path, verification);
+  if (!gis_image_metadata_cache_save (data->metadata_cache, &error))
+    g_message ("can't save image metadata cache: %s", error->message);
+}
+
+static void
+gis_diskimage_page_verify_cb (GObject      *source,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+  GisImageVerifier *verifier = GIS_IMAGE_VERIFIER (source);
+  g_autoptr(VerifyData) data = user_data;
+  GisPage *page = data->page;
+  g_autoptr(GError) error = NULL;
+  GisAssistant *assistant;
+  const gchar *current_page_id;
+
+  if (gis_image_verifier_verify_finish (verifier, result, &error))
+    {
+      verify_data_record (data, GIS_IMAGE_VERIFICATION_VERIFIED);
+      return;
+    }
+
+  if (!g_error_matches (error, GIS_IMAGE_ERROR,
+                        GIS_IMAGE_ERROR_VERIFICATION_FAILED))
+    {
+      /* The image will be verified again while it is written, so this is
+       * not fatal.
+       */
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_message ("Couldn't verify image in the background: %s",
+                   error->message);
+      return;
+    }
+
+  g_message ("Image failed verification: %s", error->message);
+  verify_data_record (data, GIS_IMAGE_VERIFICATION_FAILED);
+
+  /* Once the user has confirmed, the write will fail anyway. Before that,
+   * skip straight to reporting the error.
+   */
+  assistant = gis_driver_get_assistant (page->driver);
+  current_page_id =
+    GIS_PAGE_GET_CLASS (gis_assistant_get_current_page (assistant))->page_id;
+  if (g_strcmp0 (current_page_id, PAGE_ID) != 0 &&
+      g_strcmp0 (current_page_id, "disktarget") != 0)
+    return;
+
+  if (gis_store_get_error () == NULL)
+    gis_store_set_error (error);
+
+  gis_assistant_next_page (assistant);
+}
+
+/* Starts verifying the selected image at low priority, so that if it is bad
+ * the user finds out before being asked to confirm that their disk may be
+ * erased. This is skipped if the image is unchanged since it last passed;
+ * it is verified again while it is written regardless.
+ */
+static void
+gis_diskimage_page_verify_in_background (GisDiskImagePage *self,
+                                         GFile            *image,
+                                         const gchar      *signature_path,
+                                         const gchar      *checksum_path)
+{
+  GisDiskImagePagePrivate *priv = gis_diskimage_page_get_instance_private (self);
+  g_autoptr(GFile) signature = g_file_new_for_path (signature_path);
+  g_autoptr(GFile) checksum = g_file_new_for_path (checksum_path);
+  VerifyData *data;
+  GisImageMetadata metadata;
+
+  if (priv->verify_cancellable != NULL)
+    g_cancellable_cancel (priv->verify_cancellable);
+  g_clear_object (&priv->verify_cancellable);
+
+  data = g_new0 (VerifyData, 1);
+  data->page = GIS_PAGE (g_object_ref (self));
+  data->path = g_file_get_path (image);
+  if (priv->metadata_cache != NULL)
+    data->metadata_cache = g_object_ref (priv->metadata_cache);
+
+  if (data->metadata_cache != NULL && data->path != NULL &&
+      gis_image_metadata_cache_lookup (data->metadata_cache, data->path,
+                                       &metadata) &&
+      metadata.verification == GIS_IMAGE_VERIFICATION_VERIFIED)
+    {
+      g_message ("%s was verified previously; not verifying it in the background",
+                 data->path);
+      verify_data_free (data);
+      return;
+    }
+
+  priv->verify_cancellable = g_cancellable_new ();
+
+  gis_image_verifier_verify_async (gis_store_get_image_verifier (),
+                                   image, signature, checksum,
+                                   priv->verify_cancellable,
+                                   gis_diskimage_page_verify_cb,
+                                   data);
+}
+
+static void
+gis_diskimage_page_probe_rates_cb (GObject      *source,
+                                   GAsyncResult *result,
+                                   gpointer      user_data)
+{
+  GFile *image = g_task_get_task_data (G_TASK (result));
+  GFile *selected = G_FILE (gis_store_get_object (GIS_STORE_IMAGE));
+  g_autofree gdouble *rates = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *decode = NULL;
+  g_autofree gchar *verify = NULL;
+
+  rates = g_task_propagate_pointer (G_TASK (result), &error);
+  if (rates == NULL)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_message ("can't measure image throughput: %s", error->message);
+      return;
+    }
+
+  decode = g_format_size ((guint64) rates[0]);
+  verify = g_format_size ((guint64) rates[1]);
+  g_message ("image decompresses at %s/s and is verified at %s/s",
+             decode, verify);
+
+  if (selected != NULL && g_file_equal (image, selected))
+    gis_store_set_image_rates (rates[0], rates[1]);
+}
+
+static void
+gis_diskimage_page_probe_rates_thread (GTask        *task,
+                                       gpointer      source_object,
+                                       gpointer      task_data,
+                                       GCancellable *cancellable)
+{
+  GFile *image = task_data;
+  g_autofree gdouble *rates = g_new0 (gdouble, 2);
+  GError *error = NULL;
+
+  if (gis_throughput_probe_image (image, cancellable, &rates[0], &rates[1],
+                                  &error))
+    g_task_return_pointer (task, g_steal_pointer (&rates), g_free);
+  else
+    g_task_return_error (task, error);
+}
+
+/* Measures how fast the selected image can be decompressed and verified, so
+ * that the install time can be estimated. Split images are decompressed in
+ * parallel, and images on HTTP servers go as fast as the network, so neither
+ * is measured.
+ */
+static void
+gis_diskimage_page_probe_rates (GisDiskImagePage *self,
+                                GFile            *image)
+{
+  GisDiskImagePagePrivate *priv = gis_diskimage_page_get_instance_private (self);
+  g_autoptr(GTask) task = NULL;
+
+  if (priv->rate_cancellable != NULL)
+    g_cancellable_cancel (priv->rate_cancellable);
+  g_clear_object (&priv->rate_cancellable);
+
+  gis_store_set_image_rates (0, 0);
+
+  if (gis_http_image_is_http (image) || gis_split_image_is_split (image))
+    return;
+
+  priv->rate_cancellable = g_cancellable_new ();
+  task = g_task_new (self, priv->rate_cancellable,
+                     gis_diskimage_page_probe_rates_cb, NULL);
+  g_task_set_task_data (task, g_object_ref (image), g_object_unref);
+  g_task_run_in_thread (task, gis_diskimage_page_probe_rates_thread);
+}
+
 static void
 gis_diskimage_page_selection_changed(GtkWidget *combo, GisPage *page)
 {
@@ -111,33 +341,39 @@ gis_diskimage_page_selection_changed(GtkWidget *combo, GisPage *page)
   gis_store_set_required_size (required_size);
   g_free (name);
 
-  file = g_file_new_for_path (image);
+  file = g_file_new_for_commandline_arg (image);
   gis_store_set_object (GIS_STORE_IMAGE, G_OBJECT (file));
-  g_object_unref(file);
 
   if (signature == NULL)
     signature = g_strjoin (NULL, image, ".asc", NULL);
 
   gis_store_set_image_signature (signature);
-  g_free (signature);
 
   if (checksum == NULL)
     checksum = g_strjoin (NULL, image, ".sha256", NULL);
 
   gis_store_set_image_checksum (checksum);
 
+  /* Verifying an image on an HTTP server in the background would mean
+   * downloading it twice.
+   */
+  if (!gis_http_image_is_http (file))
+    gis_diskimage_page_verify_in_background (GIS_DISK_IMAGE_PAGE (page), file,
+                                             signature, checksum);
+  gis_diskimage_page_probe_rates (GIS_DISK_IMAGE_PAGE (page), file);
+  g_object_unref(file);
+  g_free (signature);
+
   gis_page_set_complete (page, TRUE);
 
   if (gis_store_is_unattended ())
     {
-      if (gtk_tree_model_iter_n_children (model, NULL) > 1)
-        {
-          g_autoptr(GError) error =
-            g_error_new_literal (GIS_UNATTENDED_ERROR,
-                                 GIS_UNATTENDED_ERROR_IMAGE_AMBIGUOUS,
-                                 _("More than one image was found."));
-          gis_store_set_error (error);
-        }
+      GisUnattendedConfig *config = gis_store_get_unattended_config ();
+      g_autoptr(GError) error = NULL;
+
+      if (!gis_unattended_config_check_images (
+              config, gtk_tree_model_iter_n_children (model, NULL), &error))
+        gis_store_set_error (error);
       gis_assistant_next_page (gis_driver_get_assistant (page->driver));
     }
 }
@@ -211,7 +447,7 @@ static gchar *get_display_name(const gchar *fullname)
   GMatchInfo *info;
   gchar *name = NULL;
 
-  reg = g_regex_new ("^.*/([^-]+)-([^-]+)-(?:[^-]+)-(?:[^.]+)\\.(?:[^.]+)\\.([^.]+)(?:\\.(disk\\d))?\\.img(?:\\.([gx]z|asc|sha256))?$", 0, 0, NULL);
+  reg = g_regex_new ("^.*/([^-]+)-([^-]+)-(?:[^-]+)-(?:[^.]+)\\.(?:[^.]+)\\.([^.]+)(?:\\.(disk\\d))?\\.img(?:\\.([gx]z|asc|sha256))?(?:\\.\\d{3})?$", 0, 0, NULL);
   g_regex_match (reg, fullname, 0, &info);
   if (g_match_info_matches (info))
     {
@@ -299,95 +535,206 @@ static gchar *get_display_name(const gchar *fullname)
   return name;
 }
 
+/* An image which may be offered to the user. */
+typedef struct {
+  gchar *image;
+  /* The device to read the image from, if not @image itself */
+  gchar *image_device;
+  gchar *signature;
+  gchar *checksum;
+
+  /* Filled in by probe_image() */
+  guint64 size_bytes;
+  guint64 required_size;
+} ImageProbe;
+
+static ImageProbe *
+image_probe_new (const gchar *image,
+                 const gchar *image_device,
+                 const gchar *signature,
+                 const gchar *checksum)
+{
+  ImageProbe *probe = g_new0 (ImageProbe, 1);
+
+  probe->image = g_strdup (image);
+  probe->image_device = g_strdup (image_device);
+  probe->signature = g_strdup (signature);
+  probe->checksum = g_strdup (checksum);
+
+  return probe;
+}
+
 static void
-add_image (
-    GtkListStore *store,
-    const gchar  *image,
-    const gchar  *image_device,
-    const gchar  *signature,
-    const gchar  *checksum)
+image_probe_free (ImageProbe *probe)
 {
-  GtkTreeIter i;
+  g_free (probe->image);
+  g_free (probe->image_device);
+  g_free (probe->signature);
+  g_free (probe->checksum);
+  g_free (probe);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ImageProbe, image_probe_free)
+
+/* Checks that @probe's image has a valid GPT, and finds its size and the
+ * size it needs on the target disk. Unless the answer is in @cache, this may
+ * decompress the start of the image, so it is called from a worker thread.
+ */
+static gboolean
+probe_image (ImageProbe            *probe,
+             GisImageMetadataCache *cache)
+{
+  const gchar *image = probe->image;
   GError *error = NULL;
-  g_autoptr(GFile) f = g_file_new_for_path (image);
-  g_autoptr(GFileInfo) fi = g_file_query_info (f, G_FILE_ATTRIBUTE_STANDARD_SIZE,
-                                     G_FILE_QUERY_INFO_NONE, NULL,
-                                     &error);
-  if (fi != NULL)
-    {
-      gchar *size = NULL;
-      gchar *displayname = NULL;
-      gboolean valid = FALSE;
-      guint64 required_size = 0;
-
-      if (g_str_has_suffix (image, ".img.gz"))
-        {
-          valid = get_gzip_is_valid_eos_gpt (image, &required_size);
-        }
-      else if (g_str_has_suffix (image, ".img.xz"))
-        {
-          valid = get_xz_is_valid_eos_gpt (image, &required_size);
-        }
-      else if (image_device != NULL)
-        {
-          valid = get_is_valid_eos_gpt (image_device, &required_size);
-        }
-      else if (g_str_has_suffix (image, ".img"))
+  g_autoptr(GFile) f = g_file_new_for_commandline_arg (image);
+  g_autoptr(GFileInfo) fi = NULL;
+  g_autoptr(GBytes) http_head = NULL;
+  gboolean valid = FALSE;
+  guint64 required_size = 0;
+  guint64 split_size = 0;
+  goffset size_bytes;
+  GisImageMetadata metadata = { 0 };
+  gboolean cached = FALSE;
+
+  if (gis_http_image_is_http (f))
+    {
+      guint64 http_size = 0;
+
+      /* Fetch just enough to find the partition table, even if the image
+       * is compressed.
+       */
+      http_head = gis_http_image_fetch_range (f, 0, HTTP_HEAD_SIZE,
+                                              &http_size, NULL, &error);
+      if (http_head != NULL)
         {
-          valid = get_is_valid_eos_gpt (image, &required_size);
+          fi = g_file_info_new ();
+          g_file_info_set_size (fi, http_size);
         }
+    }
+  else
+    {
+      fi = g_file_query_info (f, G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                              G_FILE_QUERY_INFO_NONE, NULL,
+                              &error);
+    }
+
+  if (fi == NULL)
+    {
+      g_warning ("Could not get file info: %s", error->message);
+      g_clear_error (&error);
+      return FALSE;
+    }
+
+  /* Split images and images on HTTP servers are cheap enough to probe, and
+   * are not cached.
+   */
+  if (cache != NULL && http_head == NULL && !gis_split_image_is_split (f))
+    cached = gis_image_metadata_cache_lookup (cache, image, &metadata);
 
-      if (!valid || required_size == 0)
+  if (cached)
+    {
+      valid = metadata.valid;
+      required_size = metadata.required_size;
+    }
+  else if (http_head != NULL)
+    {
+      valid = gis_image_probe_http_head (image, http_head, &required_size);
+    }
+  else
+    {
+      if (gis_split_image_is_split (f))
         {
-          g_warning ("%s is not a valid image file", image);
-          return;
+          g_autoptr(GFile) manifest = NULL;
+
+          /* The first part stands for the whole image */
+          if (!g_str_has_suffix (image, ".000"))
+            return FALSE;
+
+          /* The signature and checksum are for the manifest */
+          manifest = gis_split_image_get_manifest (f);
+          if (probe->checksum == NULL)
+            probe->checksum = g_file_get_path (manifest);
+          if (probe->signature == NULL)
+            probe->signature = g_strconcat (probe->checksum, ".asc", NULL);
         }
 
-      displayname = get_display_name (image);
+      valid = gis_image_probe_file (image, probe->image_device,
+                                    &metadata.format, &required_size,
+                                    &metadata.uncompressed_size, &split_size);
+    }
+
+  /* Only remember images which were actually probed, not the signatures and
+   * other files alongside them.
+   */
+  if (!cached && cache != NULL && metadata.format != GIS_IMAGE_FORMAT_UNKNOWN)
+    {
+      metadata.valid = valid && required_size != 0;
+      metadata.required_size = required_size;
+      gis_image_metadata_cache_update (cache, image, &metadata);
+    }
+
+  if (!valid || required_size == 0)
+    {
+      g_warning ("%s is not a valid image file%s", image,
+                 cached ? " (according to the metadata cache)" : "");
+      return FALSE;
+    }
+
+  size_bytes = g_file_info_get_size (fi);
+  g_warn_if_fail (size_bytes >= 0);
+  if (split_size > 0)
+    size_bytes = split_size;
+
+  probe->size_bytes = size_bytes;
+  probe->required_size = required_size;
+  return TRUE;
+}
+
+/* Adds a row for @probe, which has passed probe_image(), to @store. */
+static gboolean
+store_image (GtkListStore     *store,
+             const ImageProbe *probe,
+             GtkTreeIter      *iter)
+{
+  g_autofree gchar *size = NULL;
+  g_autofree gchar *displayname = NULL;
+
+  displayname = get_display_name (probe->image);
 
-      /* if we have a signature file or checksum file passed in,
-       * attempt to get the name from that too */
-      if (displayname == NULL)
+  /* if we have a signature file or checksum file passed in,
+   * attempt to get the name from that too */
+  if (displayname == NULL)
+    {
+      if (probe->signature != NULL)
         {
-          if (signature != NULL)
-            {
-              displayname = get_display_name (signature);
-            }
-          if (displayname == NULL && checksum != NULL)
-            {
-              displayname = get_display_name (checksum);
-            }
+          displayname = get_display_name (probe->signature);
         }
-
-      if (displayname == NULL)
+      if (displayname == NULL && probe->checksum != NULL)
         {
-          g_warning ("Could not determine display name for %s", image);
-          return;
+          displayname = get_display_name (probe->checksum);
         }
-
-      goffset size_bytes = g_file_info_get_size (fi);
-      g_warn_if_fail (size_bytes >= 0);
-      size = g_format_size_full (size_bytes, G_FORMAT_SIZE_DEFAULT);
-
-      gtk_list_store_append (store, &i);
-      g_message ("storing image %s", image);
-      gtk_list_store_set (store, &i,
-                          IMAGE_NAME, displayname,
-                          IMAGE_SIZE, size,
-                          IMAGE_SIZE_BYTES, (guint64) size_bytes,
-                          IMAGE_FILE, image_device != NULL ? image_device : image,
-                          IMAGE_SIGNATURE, signature,
-                          IMAGE_CHECKSUM, checksum,
-                          IMAGE_REQUIRED_SIZE, required_size,
-                          -1);
-      g_free (size);
-      g_free (displayname);
     }
-  else
+
+  if (displayname == NULL)
     {
-      g_warning ("Could not get file info: %s", error->message);
-      g_clear_error (&error);
+      g_warning ("Could not determine display name for %s", probe->image);
+      return FALSE;
     }
+
+  size = g_format_size_full (probe->size_bytes, G_FORMAT_SIZE_DEFAULT);
+
+  gtk_list_store_append (store, iter);
+  g_message ("storing image %s", probe->image);
+  gtk_list_store_set (store, iter,
+                      IMAGE_NAME, displayname,
+                      IMAGE_SIZE, size,
+                      IMAGE_SIZE_BYTES, probe->size_bytes,
+                      IMAGE_FILE, probe->image_device != NULL ? probe->image_device : probe->image,
+                      IMAGE_SIGNATURE, probe->signature,
+                      IMAGE_CHECKSUM, probe->checksum,
+                      IMAGE_REQUIRED_SIZE, probe->required_size,
+                      -1);
+  return TRUE;
 }
 
 static gboolean
@@ -436,10 +783,10 @@ first_existing (
  * name that the image "should" have by reading /endless/live, and find the
  * corresponding signature file.
  * For ISOs the disk image is called endless.squash.
+ * Returns the live image, yet to be probed; or %NULL with @error set.
  */
-static gboolean
-gis_diskimage_page_add_live_image (
-    GtkListStore        *store,
+static ImageProbe *
+gis_diskimage_page_find_live_image (
     const gchar         *path,
     const gchar         *ufile,
     GError             **error)
@@ -459,10 +806,10 @@ gis_diskimage_page_add_live_image (
 
   endless_path = first_existing (endless_img_path, endless_squash_path, error);
   if (endless_path == NULL)
-    return FALSE;
+    return NULL;
 
   if (!g_file_get_contents (live_flag_path, &live_flag_contents, NULL, error))
-    return FALSE;
+    return NULL;
 
   /* live_flag_contents contains the name that 'endless.img' would have had;
    * so we should be able to find its signature at ${live_flag_contents}.asc
@@ -475,7 +822,7 @@ gis_diskimage_page_add_live_image (
 
   if (!first_existing (live_sig, live_csum, error))
     {
-      return FALSE;
+      return NULL;
     }
 
   if (ufile != NULL && g_strcmp0 (ufile, live_flag_contents) != 0)
@@ -484,96 +831,485 @@ gis_diskimage_page_add_live_image (
                    GIS_UNATTENDED_ERROR_IMAGE_NOT_FOUND,
                    _("Live image ‘%s’ does not match configured image ‘%s’."),
                    live_flag_contents, ufile);
-      return FALSE;
+      return NULL;
     }
 
   if (file_exists (live_device_path, NULL))
     {
-      add_image (store, endless_path, live_device_path, live_sig, live_csum);
+      return image_probe_new (endless_path, live_device_path, live_sig,
+                              live_csum);
     }
   else if (endless_path == endless_img_path)
     {
       g_message ("can't find image device %s; will use %s directly",
                  live_device_path, endless_img_path);
-      add_image (store, endless_img_path, NULL, live_sig, live_csum);
+      return image_probe_new (endless_img_path, NULL, live_sig, live_csum);
     }
   else
     {
-      // TODO: mount the squashfs image and read endless.img from within it?
-      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_SUPPORTED,
-                   _("Cannot find image device ‘%s’ and cannot use ‘%s’ directly."),
-                   live_device_path, endless_path);
-      return FALSE;
+      g_message ("can't find image device %s; will read %s from %s",
+                 live_device_path, GIS_SQUASHFS_LIVE_IMAGE_PATH,
+                 endless_squash_path);
+      return image_probe_new (endless_squash_path, NULL, live_sig,
+                              live_csum);
     }
-
-  return TRUE;
 }
 
+/* Finds the images in a directory, and probes them on a pool of worker
+ * threads so that a stick holding many images does not freeze the UI. Each
+ * valid image is added to the page's store as soon as it has been probed.
+ * If the directory has an up-to-date signed catalog, the images it lists are
+ * offered without being probed at all.
+ */
+typedef struct {
+  GisDiskImagePage *page;
+  gchar *path;
+  /* Only set in the unattended case */
+  gchar *ufile;
+  gboolean is_live;
+  GisImageMetadataCache *metadata_cache;
+  GisImageVerifier *verifier;
+
+  GThreadPool *pool;
+  /* Probes which have not yet reported back, plus one for the enumeration
+   * of @path until it is complete.
+   */
+  gint n_pending;
+  /* Why there might be no images. Only set by the enumeration. */
+  GError *error;
+} ProbeContext;
+
+typedef struct {
+  ProbeContext *context;
+  ImageProbe *probe;
+  gboolean valid;
+} ProbeJob;
+
+/* Enough to overlap decompressing some images' heads with reading others',
+ * without the probes fighting over a slow USB stick.
+ */
+#define MAX_PROBE_THREADS 4
+
 static void
-gis_diskimage_page_populate_model (GisPage     *page,
-                                   const gchar *path)
+probe_context_finish (ProbeContext *context)
 {
-  GisDiskImagePage *self = GIS_DISK_IMAGE_PAGE (page);
+  GisDiskImagePage *self = context->page;
   GisDiskImagePagePrivate *priv = gis_diskimage_page_get_instance_private (self);
-  g_autoptr(GFile) path_file = g_file_new_for_path (path);
-  g_autoptr(GError) error = NULL;
-  const gchar *file = NULL;
-  GisUnattendedConfig *config = gis_store_get_unattended_config ();
-  const gchar *ufile =
-    (config != NULL) ? gis_unattended_config_get_image (config) : NULL;
-  g_autoptr(GDir) dir = NULL;
+  GisPage *page = GIS_PAGE (self);
+  GError *error = NULL;
   GtkTreeIter iter;
-  gboolean is_live = gis_store_is_live_install ();
 
-  dir = g_dir_open (path, 0, &error);
-  if (dir == NULL)
+  g_thread_pool_free (context->pool, FALSE, TRUE);
+
+  if (!gis_image_metadata_cache_save (context->metadata_cache, &error))
+    g_message ("can't save image metadata cache: %s", error->message);
+  g_clear_error (&error);
+
+  if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (priv->image_store), &iter))
+    {
+      /* In the unattended case, nothing is selected until every image has
+       * been probed, so that an ambiguous configuration is noticed.
+       */
+      if (gtk_combo_box_get_active (priv->image_combo) < 0)
+        gtk_combo_box_set_active_iter (priv->image_combo, &iter);
+    }
+  else
     {
+      error = g_steal_pointer (&context->error);
+
+      if (error == NULL)
+        {
+          if (context->ufile != NULL)
+            g_set_error (&error, GIS_UNATTENDED_ERROR,
+                         GIS_UNATTENDED_ERROR_IMAGE_NOT_FOUND,
+                         /* Translators: the placeholder is a filename. */
+                         _("Configured image ‘%s’ was not found."),
+                         context->ufile);
+          else
+            g_set_error_literal (&error, GIS_IMAGE_ERROR,
+                                 GIS_IMAGE_ERROR_NOT_FOUND,
+                                 _("No suitable images were found."));
+        }
       gis_store_set_error (error);
+      g_clear_error (&error);
       gis_assistant_next_page (gis_driver_get_assistant (page->driver));
+    }
+
+  g_clear_error (&context->error);
+  g_clear_object (&context->metadata_cache);
+  g_clear_object (&context->verifier);
+  g_clear_object (&context->page);
+  g_free (context->path);
+  g_free (context->ufile);
+  g_free (context);
+}
+
+static void
+probe_context_release (ProbeContext *context)
+{
+  if (g_atomic_int_dec_and_test (&context->n_pending))
+    probe_context_finish (context);
+}
+
+/* Called on the main thread once a probe is complete. */
+static gboolean
+probe_job_done_cb (gpointer user_data)
+{
+  ProbeJob *job = user_data;
+  ProbeContext *context = job->context;
+  GisDiskImagePagePrivate *priv =
+    gis_diskimage_page_get_instance_private (context->page);
+  GtkTreeIter iter;
+
+  /* The first valid image can be chosen straight away, while the others are
+   * still being probed; but not in the unattended case, where choosing an
+   * image moves on to the next page. probe_context_finish() chooses it once
+   * every image is known, even if no image is configured.
+   */
+  if (job->valid &&
+      store_image (priv->image_store, job->probe, &iter) &&
+      !gis_store_is_unattended () &&
+      gtk_combo_box_get_active (priv->image_combo) < 0)
+    gtk_combo_box_set_active_iter (priv->image_combo, &iter);
+
+  image_probe_free (job->probe);
+  g_free (job);
+
+  probe_context_release (context);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+probe_job_thread (gpointer data,
+                  gpointer user_data)
+{
+  ProbeJob *job = data;
+
+  job->valid = probe_image (job->probe, job->context->metadata_cache);
+  g_main_context_invoke (NULL, probe_job_done_cb, job);
+}
+
+/* Called from the enumeration thread. */
+static void
+probe_context_push (ProbeContext *context,
+                    ImageProbe   *probe)
+{
+  ProbeJob *job = g_new0 (ProbeJob, 1);
+
+  job->context = context;
+  job->probe = probe;
+
+  g_atomic_int_inc (&context->n_pending);
+  g_thread_pool_push (context->pool, job, NULL);
+}
+
+/* Called from the enumeration thread, for an image which needs no probing. */
+static void
+probe_context_add_probed (ProbeContext *context,
+                          ImageProbe   *probe)
+{
+  ProbeJob *job = g_new0 (ProbeJob, 1);
+
+  job->context = context;
+  job->probe = probe;
+  job->valid = TRUE;
+
+  g_atomic_int_inc (&context->n_pending);
+  g_main_context_invoke (NULL, probe_job_done_cb, job);
+}
+
+/* Offers the images listed in the catalog in @context's directory, if it is
+ * signed and up to date. Returns %FALSE if the directory must be scanned
+ * instead. Called from the enumeration thread.
+ */
+static gboolean
+probe_context_add_catalog (ProbeContext *context,
+                           GCancellable *cancellable)
+{
+  g_autoptr(GPtrArray) entries = NULL;
+  g_autoptr(GPtrArray) probes = NULL;
+  g_autoptr(GError) error = NULL;
+  guint i;
+
+  entries = gis_image_catalog_load (context->path, context->verifier,
+                                    cancellable, &error);
+  if (entries == NULL)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_warning ("ignoring image catalog: %s", error->message);
+      return FALSE;
+    }
+
+  probes = g_ptr_array_new_with_free_func ((GDestroyNotify) image_probe_free);
+  for (i = 0; i < entries->len; i++)
+    {
+      const GisImageCatalogEntry *entry = g_ptr_array_index (entries, i);
+      g_autofree gchar *basename = g_path_get_basename (entry->path);
+      ImageProbe *probe;
+
+      /* ufile is only set in the unattended case */
+      if (context->ufile != NULL && g_strcmp0 (context->ufile, basename) != 0)
+        continue;
+
+      /* The partition's contents have changed since it was written */
+      if (!gis_image_catalog_entry_check (entry, &error))
+        {
+          g_warning ("ignoring out-of-date image catalog: %s",
+                     error->message);
+          return FALSE;
+        }
+
+      probe = image_probe_new (entry->path, NULL, entry->signature,
+                               entry->checksum);
+      probe->size_bytes = entry->size;
+      probe->required_size = entry->required_size;
+      g_ptr_array_add (probes, probe);
+    }
+
+  /* For example, the configured image was copied on afterwards */
+  if (probes->len == 0)
+    return FALSE;
+
+  g_ptr_array_set_free_func (probes, NULL);
+  for (i = 0; i < probes->len; i++)
+    probe_context_add_probed (context, g_ptr_array_index (probes, i));
+
+  return TRUE;
+}
+
+static void
+enumerate_images_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  ProbeContext *context = task_data;
+  g_autoptr(GDir) dir = NULL;
+  const gchar *file = NULL;
+  GError *error = NULL;
+
+  /* The live image is found by other means, not listed in a catalog */
+  if (!context->is_live && probe_context_add_catalog (context, cancellable))
+    {
+      g_task_return_boolean (task, TRUE);
       return;
     }
 
-  gis_store_set_object (GIS_STORE_IMAGE_DIR, G_OBJECT (path_file));
-  gtk_list_store_clear (priv->image_store);
+  dir = g_dir_open (context->path, 0, &error);
+  if (dir == NULL)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
 
   while ((file = g_dir_read_name (dir)))
     {
       /* ufile is only set in the unattended case */
-      if (ufile == NULL || g_strcmp0 (ufile, file) == 0)
+      if (context->ufile == NULL || g_strcmp0 (context->ufile, file) == 0)
         {
-          g_autofree gchar *fullpath = g_build_path ("/", path, file, NULL);
-          add_image (priv->image_store, fullpath, NULL, NULL, NULL);
+          g_autofree gchar *fullpath = g_build_path ("/", context->path, file,
+                                                     NULL);
+          probe_context_push (context,
+                              image_probe_new (fullpath, NULL, NULL, NULL));
         }
     }
 
-  if (is_live &&
-      !gis_diskimage_page_add_live_image (priv->image_store, path, ufile, &error))
+  if (context->is_live)
     {
-      g_warning ("finding live image failed: %s", error->message);
+      ImageProbe *probe = gis_diskimage_page_find_live_image (context->path,
+                                                              context->ufile,
+                                                              &error);
+
+      if (probe != NULL)
+        {
+          probe_context_push (context, probe);
+        }
+      else
+        {
+          g_warning ("finding live image failed: %s", error->message);
+          /* Only read once the enumeration is complete */
+          context->error = error;
+        }
     }
 
-  if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (priv->image_store), &iter))
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+enumerate_images_cb (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  ProbeContext *context = user_data;
+  g_autoptr(GError) error = NULL;
+
+  if (!g_task_propagate_boolean (G_TASK (result), &error))
+    {
+      g_clear_error (&context->error);
+      context->error = g_steal_pointer (&error);
+    }
+
+  probe_context_release (context);
+}
+
+static void
+gis_diskimage_page_populate_model (GisPage     *page,
+                                   const gchar *path)
+{
+  GisDiskImagePage *self = GIS_DISK_IMAGE_PAGE (page);
+  GisDiskImagePagePrivate *priv = gis_diskimage_page_get_instance_private (self);
+  g_autoptr(GFile) path_file = g_file_new_for_path (path);
+  GisUnattendedConfig *config = gis_store_get_unattended_config ();
+  const gchar *ufile =
+    (config != NULL) ? gis_unattended_config_get_image (config) : NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autofree gchar *fallback_dir = g_build_filename (g_get_user_runtime_dir (),
+                                                     "eos-installer", NULL);
+  ProbeContext *context;
+
+  gis_store_set_object (GIS_STORE_IMAGE_DIR, G_OBJECT (path_file));
+  gtk_list_store_clear (priv->image_store);
+
+  g_clear_object (&priv->metadata_cache);
+  priv->metadata_cache = gis_image_metadata_cache_new (path, fallback_dir);
+
+  context = g_new0 (ProbeContext, 1);
+  context->page = g_object_ref (self);
+  context->path = g_strdup (path);
+  context->ufile = g_strdup (ufile);
+  context->is_live = gis_store_is_live_install ();
+  context->metadata_cache = g_object_ref (priv->metadata_cache);
+  /* Created lazily, so not on the enumeration thread */
+  context->verifier = g_object_ref (gis_store_get_image_verifier ());
+  context->n_pending = 1;
+  context->pool = g_thread_pool_new (probe_job_thread, context,
+                                     MIN (g_get_num_processors (),
+                                          MAX_PROBE_THREADS),
+                                     FALSE, NULL);
+
+  task = g_task_new (NULL, NULL, enumerate_images_cb, context);
+  g_task_set_source_tag (task, gis_diskimage_page_populate_model);
+  g_task_set_task_data (task, context, NULL);
+  g_task_run_in_thread (task, enumerate_images_thread);
+}
+
+/* Removes the directory which an image's signature and checksum were fetched
+ * to, and its contents.
+ */
+static void
+remove_url_tmpdir (const gchar *tmpdir)
+{
+  g_autoptr(GDir) dir = g_dir_open (tmpdir, 0, NULL);
+  const gchar *name;
+
+  while (dir != NULL && (name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *path = g_build_filename (tmpdir, name, NULL);
+
+      if (g_unlink (path) < 0)
+        g_message ("can't remove %s: %s", path, g_strerror (errno));
+    }
+
+  if (g_rmdir (tmpdir) < 0)
+    g_message ("can't remove %s: %s", tmpdir, g_strerror (errno));
+}
+
+static void
+gis_diskimage_page_populate_model_from_url_cb (GObject      *source,
+                                               GAsyncResult *result,
+                                               gpointer      user_data)
+{
+  GisDiskImagePage *self = GIS_DISK_IMAGE_PAGE (source);
+  GisDiskImagePagePrivate *priv = gis_diskimage_page_get_instance_private (self);
+  GisPage *page = GIS_PAGE (self);
+  ImageProbe *probe = g_task_get_task_data (G_TASK (result));
+  g_autoptr(GError) error = NULL;
+  GtkTreeIter iter;
+  gboolean valid;
+
+  valid = g_task_propagate_boolean (G_TASK (result), &error);
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return;
+
+  if (valid && store_image (priv->image_store, probe, &iter))
     {
       gtk_combo_box_set_active_iter (priv->image_combo, &iter);
+      return;
     }
-  else
+
+  if (error == NULL)
+    g_set_error_literal (&error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_FOUND,
+                         _("No suitable images were found."));
+  gis_store_set_error (error);
+  gis_assistant_next_page (gis_driver_get_assistant (page->driver));
+}
+
+/* Fetches the signature or checksum of the image to the directory that the
+ * probe's signature and checksum paths are in, then probes the image. Both
+ * mean waiting for the server, so this runs on a worker thread.
+ */
+static void
+gis_diskimage_page_populate_model_from_url_thread (GTask        *task,
+                                                   gpointer      source_object,
+                                                   gpointer      task_data,
+                                                   GCancellable *cancellable)
+{
+  ImageProbe *probe = task_data;
+  g_autoptr(GFile) image = g_file_new_for_uri (probe->image);
+  g_autoptr(GFile) signature = g_file_new_for_path (probe->signature);
+  g_autoptr(GFile) dir = g_file_get_parent (signature);
+  GError *error = NULL;
+
+  if (!gis_http_image_fetch_sidecars (image, dir, cancellable, &error))
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  g_task_return_boolean (task, probe_image (probe, NULL));
+}
+
+/* Offers the image at @url on an HTTP or HTTPS server. Its signature or
+ * checksum is fetched to a temporary directory first, since gpg needs a local
+ * file; that directory is removed when the page is disposed.
+ */
+static void
+gis_diskimage_page_populate_model_from_url (GisPage     *page,
+                                            const gchar *url)
+{
+  GisDiskImagePage *self = GIS_DISK_IMAGE_PAGE (page);
+  GisDiskImagePagePrivate *priv = gis_diskimage_page_get_instance_private (self);
+  g_autoptr(GFile) image = g_file_new_for_uri (url);
+  g_autoptr(GFile) dir = NULL;
+  g_autofree gchar *basename = g_file_get_basename (image);
+  g_autofree gchar *signature = NULL;
+  g_autofree gchar *checksum = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GError) error = NULL;
+
+  priv->url_tmpdir = g_dir_make_tmp ("eos-installer-XXXXXX", &error);
+  if (priv->url_tmpdir == NULL)
     {
-      if (error == NULL)
-        {
-          if (ufile != NULL)
-            g_set_error (&error, GIS_UNATTENDED_ERROR,
-                         GIS_UNATTENDED_ERROR_IMAGE_NOT_FOUND,
-                         /* Translators: the placeholder is a filename. */
-                         _("Configured image ‘%s’ was not found."),
-                         ufile);
-          else
-            g_set_error_literal (&error, GIS_IMAGE_ERROR,
-                                 GIS_IMAGE_ERROR_NOT_FOUND,
-                                 _("No suitable images were found."));
-        }
       gis_store_set_error (error);
       gis_assistant_next_page (gis_driver_get_assistant (page->driver));
+      return;
     }
+
+  dir = g_file_new_for_path (priv->url_tmpdir);
+  gis_store_set_object (GIS_STORE_IMAGE_DIR, G_OBJECT (dir));
+  gtk_list_store_clear (priv->image_store);
+
+  signature = g_strconcat (priv->url_tmpdir, "/", basename, ".asc", NULL);
+  checksum = g_strconcat (priv->url_tmpdir, "/", basename, ".sha256", NULL);
+
+  priv->url_cancellable = g_cancellable_new ();
+  task = g_task_new (self, priv->url_cancellable,
+                     gis_diskimage_page_populate_model_from_url_cb, NULL);
+  g_task_set_source_tag (task, gis_diskimage_page_populate_model_from_url);
+  g_task_set_task_data (task,
+                        image_probe_new (url, NULL, signature, checksum),
+                        (GDestroyNotify) image_probe_free);
+  g_task_run_in_thread (task, gis_diskimage_page_populate_model_from_url_thread);
 }
 
 static void
@@ -626,6 +1362,8 @@ gis_diskimage_page_mount (GisPage *page)
 
       g_message ("found label or UUID partition at %s", dev);
 
+      gis_store_set_object (GIS_STORE_IMAGE_BLOCK, G_OBJECT (block));
+
       drive = udisks_client_get_drive_for_block (client, block);
       if (drive != NULL)
         {
@@ -696,11 +1434,22 @@ static gboolean
 gis_diskimage_page_shown_idle_cb (gpointer user_data)
 {
   GisPage *page = GIS_PAGE (user_data);
+  /* For imaging servers on the local network */
+  const gchar *url = g_getenv ("EI_IMAGE_URL");
 
   if (gis_store_get_error () != NULL)
-    gis_assistant_next_page (gis_driver_get_assistant (page->driver));
+    {
+      gis_assistant_next_page (gis_driver_get_assistant (page->driver));
+    }
+  else if (url != NULL && *url != '\0')
+    {
+      g_message ("EI_IMAGE_URL set to %s", url);
+      gis_diskimage_page_populate_model_from_url (page, url);
+    }
   else
-    gis_diskimage_page_mount (page);
+    {
+      gis_diskimage_page_mount (page);
+    }
 
   return G_SOURCE_REMOVE;
 }
@@ -736,6 +1485,29 @@ gis_diskimage_page_constructed (GObject *object)
   gtk_widget_show (GTK_WIDGET (page));
 }
 
+static void
+gis_diskimage_page_dispose (GObject *object)
+{
+  GisDiskImagePage *page = GIS_DISK_IMAGE_PAGE (object);
+  GisDiskImagePagePrivate *priv = gis_diskimage_page_get_instance_private (page);
+
+  if (priv->verify_cancellable != NULL)
+    g_cancellable_cancel (priv->verify_cancellable);
+  g_clear_object (&priv->verify_cancellable);
+  if (priv->rate_cancellable != NULL)
+    g_cancellable_cancel (priv->rate_cancellable);
+  g_clear_object (&priv->rate_cancellable);
+  g_clear_object (&priv->metadata_cache);
+  if (priv->url_cancellable != NULL)
+    g_cancellable_cancel (priv->url_cancellable);
+  g_clear_object (&priv->url_cancellable);
+  if (priv->url_tmpdir != NULL)
+    remove_url_tmpdir (priv->url_tmpdir);
+  g_clear_pointer (&priv->url_tmpdir, g_free);
+
+  G_OBJECT_CLASS (gis_diskimage_page_parent_class)->dispose (object);
+}
+
 static void
 gis_diskimage_page_locale_changed (GisPage *page)
 {
@@ -757,6 +1529,7 @@ gis_diskimage_page_class_init (GisDiskImagePageClass *klass)
   page_class->locale_changed = gis_diskimage_page_locale_changed;
   page_class->shown = gis_diskimage_page_shown;
   object_class->constructed = gis_diskimage_page_constructed;
+  object_class->dispose = gis_diskimage_page_dispose;
 }
 
 static void
@@ -0,0 +1,509 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Indexes udisks objects by how they relate to the drives and loop devices
+ * which might be written to, so that the disk target page needn't scan every
+ * object to find a drive's block device, a block device's partitions or the
+ * root filesystem. The index is kept up to date as objects come, go and
+ * change, and #GisDiskIndex::device-changed is emitted for each drive or loop
+ * device whose suitability as a target may have changed as a result.
+ */
+#include "config.h"
+#include "gis-disk-index.h"
+
+/* What is known about one object, as of when it was last indexed. */
+typedef struct {
+  /* Object path of the drive or loop device this object is (or, for the
+   * whole-disk block device of a drive, belongs to)
+   */
+  gchar *device;
+  /* Object path of the partition table's block device, for a partition */
+  gchar *table;
+  /* Whether this is the whole-disk block device of ->device */
+  gboolean is_whole_disk;
+  /* Whether the root filesystem is mounted from this block device */
+  gboolean is_root;
+} GisDiskIndexEntry;
+
+struct _GisDiskIndex {
+  GObject parent;
+
+  UDisksClient *client;
+
+  /* Object path → (owned) GisDiskIndexEntry * */
+  GHashTable *entries;
+  /* Set of object paths of drives and loop devices */
+  GHashTable *devices;
+  /* Drive object path → object path of its whole-disk block device */
+  GHashTable *whole_disks;
+  /* Block object path → set of object paths of partitions in its table */
+  GHashTable *partitions;
+
+  /* Block device the root filesystem is mounted from, and its drive */
+  gchar *root_path;
+  gchar *root_drive_path;
+};
+
+G_DEFINE_TYPE (GisDiskIndex, gis_disk_index, G_TYPE_OBJECT)
+
+enum {
+  DEVICE_CHANGED,
+  N_SIGNALS
+};
+
+static guint signals[N_SIGNALS] = { 0 };
+
+static void
+gis_disk_index_entry_free (GisDiskIndexEntry *entry)
+{
+  g_free (entry->device);
+  g_free (entry->table);
+  g_free (entry);
+}
+
+/* The drive or loop device which @entry is part of, if known. */
+static const gchar *
+gis_disk_index_entry_get_device (GisDiskIndex      *self,
+                                 GisDiskIndexEntry *entry)
+{
+  GisDiskIndexEntry *table_entry;
+
+  if (entry->table == NULL)
+    return entry->device;
+
+  table_entry = g_hash_table_lookup (self->entries, entry->table);
+  return table_entry != NULL ? table_entry->device : NULL;
+}
+
+static void
+add_affected (GHashTable  *affected,
+              const gchar *device)
+{
+  if (device != NULL)
+    g_hash_table_add (affected, g_strdup (device));
+}
+
+static void
+gis_disk_index_remove (GisDiskIndex *self,
+                       const gchar  *object_path,
+                       GHashTable   *affected)
+{
+  GisDiskIndexEntry *entry = g_hash_table_lookup (self->entries, object_path);
+
+  if (entry == NULL)
+    return;
+
+  add_affected (affected, gis_disk_index_entry_get_device (self, entry));
+
+  if (entry->table != NULL)
+    {
+      GHashTable *siblings = g_hash_table_lookup (self->partitions,
+                                                  entry->table);
+
+      if (siblings != NULL && g_hash_table_remove (siblings, object_path) &&
+          g_hash_table_size (siblings) == 0)
+        g_hash_table_remove (self->partitions, entry->table);
+    }
+
+  if (entry->is_whole_disk &&
+      g_strcmp0 (g_hash_table_lookup (self->whole_disks, entry->device),
+                 object_path) == 0)
+    g_hash_table_remove (self->whole_disks, entry->device);
+
+  if (entry->is_root)
+    {
+      /* Every other device was compared to the root drive */
+      add_affected (affected, self->root_drive_path);
+      g_clear_pointer (&self->root_path, g_free);
+      g_clear_pointer (&self->root_drive_path, g_free);
+    }
+
+  g_hash_table_remove (self->devices, object_path);
+  g_hash_table_remove (self->entries, object_path);
+}
+
+static void
+gis_disk_index_add (GisDiskIndex *self,
+                    GDBusObject  *object,
+                    GHashTable   *affected)
+{
+  UDisksObject *udisks_object = UDISKS_OBJECT (object);
+  const gchar *object_path = g_dbus_object_get_object_path (object);
+  UDisksDrive *drive = udisks_object_peek_drive (udisks_object);
+  UDisksLoop *loop = udisks_object_peek_loop (udisks_object);
+  UDisksBlock *block = udisks_object_peek_block (udisks_object);
+  UDisksPartition *partition = udisks_object_peek_partition (udisks_object);
+  UDisksFilesystem *fs = udisks_object_peek_filesystem (udisks_object);
+  GisDiskIndexEntry *entry = g_new0 (GisDiskIndexEntry, 1);
+  gboolean was_root = g_strcmp0 (object_path, self->root_path) == 0;
+
+  gis_disk_index_remove (self, object_path, affected);
+
+  if (drive != NULL || loop != NULL)
+    {
+      entry->device = g_strdup (object_path);
+      g_hash_table_add (self->devices, g_strdup (object_path));
+    }
+
+  if (partition != NULL)
+    {
+      const gchar *table = udisks_partition_get_table (partition);
+      GHashTable *siblings = g_hash_table_lookup (self->partitions, table);
+
+      if (siblings == NULL)
+        {
+          siblings = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, NULL);
+          g_hash_table_insert (self->partitions, g_strdup (table), siblings);
+        }
+
+      g_hash_table_add (siblings, g_strdup (object_path));
+      entry->table = g_strdup (table);
+    }
+  else if (block != NULL && loop == NULL)
+    {
+      const gchar *drive_path = udisks_block_get_drive (block);
+
+      if (g_strcmp0 (drive_path, "/") != 0)
+        {
+          entry->device = g_strdup (drive_path);
+          entry->is_whole_disk = TRUE;
+
+          /* Prefer the first, as udisks_client_get_block_for_drive() does */
+          if (!g_hash_table_contains (self->whole_disks, drive_path))
+            g_hash_table_insert (self->whole_disks, g_strdup (drive_path),
+                                 g_strdup (object_path));
+        }
+    }
+
+  if (block != NULL && fs != NULL)
+    {
+      const gchar * const *mounts = udisks_filesystem_get_mount_points (fs);
+      const gchar *drive_path = udisks_block_get_drive (block);
+
+      if (mounts != NULL && g_strv_contains (mounts, "/"))
+        {
+          if (!was_root)
+            g_message ("found root filesystem %s", object_path);
+          entry->is_root = TRUE;
+
+          add_affected (affected, self->root_drive_path);
+          g_free (self->root_path);
+          self->root_path = g_strdup (object_path);
+          g_free (self->root_drive_path);
+          self->root_drive_path =
+            g_strcmp0 (drive_path, "/") != 0 ? g_strdup (drive_path) : NULL;
+          add_affected (affected, self->root_drive_path);
+
+          if (!was_root && self->root_drive_path == NULL)
+            g_warning ("Couldn't get UDisksDrive for block");
+        }
+    }
+
+  g_hash_table_insert (self->entries, g_strdup (object_path), entry);
+  add_affected (affected, gis_disk_index_entry_get_device (self, entry));
+}
+
+static void
+gis_disk_index_emit (GisDiskIndex *self,
+                     GHashTable   *affected)
+{
+  GHashTableIter iter;
+  const gchar *device;
+
+  g_hash_table_iter_init (&iter, affected);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &device, NULL))
+    g_signal_emit (self, signals[DEVICE_CHANGED], 0, device);
+}
+
+static void
+gis_disk_index_object_added_cb (GDBusObjectManager *manager,
+                                GDBusObject        *object,
+                                gpointer            data)
+{
+  GisDiskIndex *self = GIS_DISK_INDEX (data);
+  g_autoptr(GHashTable) affected =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  gis_disk_index_add (self, object, affected);
+  gis_disk_index_emit (self, affected);
+}
+
+static void
+gis_disk_index_object_removed_cb (GDBusObjectManager *manager,
+                                  GDBusObject        *object,
+                                  gpointer            data)
+{
+  GisDiskIndex *self = GIS_DISK_INDEX (data);
+  g_autoptr(GHashTable) affected =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  gis_disk_index_remove (self, g_dbus_object_get_object_path (object),
+                         affected);
+  gis_disk_index_emit (self, affected);
+}
+
+static void
+gis_disk_index_interface_changed_cb (GDBusObjectManager *manager,
+                                     GDBusObject        *object,
+                                     GDBusInterface     *interface,
+                                     gpointer            data)
+{
+  gis_disk_index_object_added_cb (manager, object, data);
+}
+
+static void
+gis_disk_index_properties_changed_cb (GDBusObjectManagerClient *manager,
+                                      GDBusObjectProxy         *object_proxy,
+                                      GDBusProxy               *interface_proxy,
+                                      GVariant                 *changed_properties,
+                                      const gchar * const      *invalidated_properties,
+                                      gpointer                  data)
+{
+  gis_disk_index_object_added_cb (G_DBUS_OBJECT_MANAGER (manager),
+                                  G_DBUS_OBJECT (object_proxy), data);
+}
+
+static void
+gis_disk_index_dispose (GObject *object)
+{
+  GisDiskIndex *self = GIS_DISK_INDEX (object);
+
+  if (self->client != NULL)
+    {
+      GDBusObjectManager *manager =
+        udisks_client_get_object_manager (self->client);
+
+      g_signal_handlers_disconnect_by_data (manager, self);
+    }
+
+  g_clear_object (&self->client);
+
+  G_OBJECT_CLASS (gis_disk_index_parent_class)->dispose (object);
+}
+
+static void
+gis_disk_index_finalize (GObject *object)
+{
+  GisDiskIndex *self = GIS_DISK_INDEX (object);
+
+  g_clear_pointer (&self->entries, g_hash_table_unref);
+  g_clear_pointer (&self->devices, g_hash_table_unref);
+  g_clear_pointer (&self->whole_disks, g_hash_table_unref);
+  g_clear_pointer (&self->partitions, g_hash_table_unref);
+  g_clear_pointer (&self->root_path, g_free);
+  g_clear_pointer (&self->root_drive_path, g_free);
+
+  G_OBJECT_CLASS (gis_disk_index_parent_class)->finalize (object);
+}
+
+static void
+gis_disk_index_class_init (GisDiskIndexClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = gis_disk_index_dispose;
+  object_class->finalize = gis_disk_index_finalize;
+
+  /**
+   * GisDiskIndex::device-changed:
+   * @object_path: object path of a UDisksDrive or loop device
+   *
+   * Emitted when a drive or loop device appears or disappears, or it or
+   * anything on it changes.
+   */
+  signals[DEVICE_CHANGED] =
+    g_signal_new ("device-changed",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL, NULL, NULL,
+                  G_TYPE_NONE, 1,
+                  G_TYPE_STRING);
+}
+
+static void
+gis_disk_index_init (GisDiskIndex *self)
+{
+  self->entries = g_hash_table_new_full (
+      g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) gis_disk_index_entry_free);
+  self->devices = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, NULL);
+  self->whole_disks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, g_free);
+  self->partitions = g_hash_table_new_full (
+      g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) g_hash_table_unref);
+}
+
+/**
+ * gis_disk_index_new:
+ * @client: the udisks client to index the objects of
+ *
+ * Returns: (transfer full): an index of @client's objects, which is kept up
+ *  to date until it is destroyed.
+ */
+GisDiskIndex *
+gis_disk_index_new (UDisksClient *client)
+{
+  GisDiskIndex *self;
+  GDBusObjectManager *manager;
+  g_autoptr(GHashTable) affected = NULL;
+  GList *objects, *l;
+
+  g_return_val_if_fail (UDISKS_IS_CLIENT (client), NULL);
+
+  self = g_object_new (GIS_TYPE_DISK_INDEX, NULL);
+  self->client = g_object_ref (client);
+
+  /* Nobody is listening yet */
+  affected = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  manager = udisks_client_get_object_manager (client);
+  objects = g_dbus_object_manager_get_objects (manager);
+  for (l = objects; l != NULL; l = l->next)
+    gis_disk_index_add (self, G_DBUS_OBJECT (l->data), affected);
+  g_list_free_full (objects, g_object_unref);
+
+  g_signal_connect (manager, "object-added",
+                    G_CALLBACK (gis_disk_index_object_added_cb), self);
+  g_signal_connect (manager, "object-removed",
+                    G_CALLBACK (gis_disk_index_object_removed_cb), self);
+  g_signal_connect (manager, "interface-added",
+                    G_CALLBACK (gis_disk_index_interface_changed_cb), self);
+  g_signal_connect (manager, "interface-removed",
+                    G_CALLBACK (gis_disk_index_interface_changed_cb), self);
+  if (G_IS_DBUS_OBJECT_MANAGER_CLIENT (manager))
+    g_signal_connect (manager, "interface-proxy-properties-changed",
+                      G_CALLBACK (gis_disk_index_properties_changed_cb), self);
+
+  return self;
+}
+
+/**
+ * gis_disk_index_get_devices:
+ *
+ * Returns: (transfer container) (element-type UDisksObject): the objects of
+ *  every drive and loop device, in no particular order.
+ */
+GPtrArray *
+gis_disk_index_get_devices (GisDiskIndex *self)
+{
+  GPtrArray *devices;
+  GHashTableIter iter;
+  const gchar *object_path;
+
+  g_return_val_if_fail (GIS_IS_DISK_INDEX (self), NULL);
+
+  devices = g_ptr_array_new_full (g_hash_table_size (self->devices),
+                                  g_object_unref);
+  g_hash_table_iter_init (&iter, self->devices);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &object_path, NULL))
+    {
+      UDisksObject *object = udisks_client_get_object (self->client,
+                                                       object_path);
+
+      if (object != NULL)
+        g_ptr_array_add (devices, object);
+    }
+
+  return devices;
+}
+
+/**
+ * gis_disk_index_peek_block_for_drive:
+ * @drive: a drive
+ *
+ * Like udisks_client_get_block_for_drive(), but without scanning every
+ * object.
+ *
+ * Returns: (transfer none) (nullable): the whole-disk block device of @drive
+ */
+UDisksBlock *
+gis_disk_index_peek_block_for_drive (GisDiskIndex *self,
+                                     UDisksDrive  *drive)
+{
+  const gchar *block_path;
+  UDisksObject *object;
+
+  g_return_val_if_fail (GIS_IS_DISK_INDEX (self), NULL);
+  g_return_val_if_fail (UDISKS_IS_DRIVE (drive), NULL);
+
+  block_path = g_hash_table_lookup (
+      self->whole_disks, g_dbus_proxy_get_object_path (G_DBUS_PROXY (drive)));
+  if (block_path == NULL)
+    return NULL;
+
+  object = udisks_client_peek_object (self->client, block_path);
+  return object != NULL ? udisks_object_peek_block (object) : NULL;
+}
+
+/**
+ * gis_disk_index_get_partitions:
+ * @block: a block device
+ *
+ * Like udisks_client_get_partitions(), but without scanning every object.
+ *
+ * Returns: (transfer full) (element-type UDisksPartition): the partitions in
+ *  @block's partition table, if it has one.
+ */
+GList *
+gis_disk_index_get_partitions (GisDiskIndex *self,
+                               UDisksBlock  *block)
+{
+  GHashTable *siblings;
+  GHashTableIter iter;
+  const gchar *object_path;
+  GList *partitions = NULL;
+
+  g_return_val_if_fail (GIS_IS_DISK_INDEX (self), NULL);
+  g_return_val_if_fail (UDISKS_IS_BLOCK (block), NULL);
+
+  siblings = g_hash_table_lookup (
+      self->partitions, g_dbus_proxy_get_object_path (G_DBUS_PROXY (block)));
+  if (siblings == NULL)
+    return NULL;
+
+  g_hash_table_iter_init (&iter, siblings);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &object_path, NULL))
+    {
+      UDisksObject *object = udisks_client_peek_object (self->client,
+                                                        object_path);
+      UDisksPartition *partition =
+        object != NULL ? udisks_object_get_partition (object) : NULL;
+
+      if (partition != NULL)
+        partitions = g_list_prepend (partitions, partition);
+    }
+
+  return partitions;
+}
+
+/**
+ * gis_disk_index_get_root_drive_path:
+ *
+ * Returns: (nullable): the object path of the drive the root filesystem is
+ *  mounted from, if it is on a drive.
+ */
+const gchar *
+gis_disk_index_get_root_drive_path (GisDiskIndex *self)
+{
+  g_return_val_if_fail (GIS_IS_DISK_INDEX (self), NULL);
+
+  return self->root_drive_path;
+}
@@ -0,0 +1,49 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_DISK_INDEX_H
+#define GIS_DISK_INDEX_H
+
+#include <gio/gio.h>
+#include <udisks/udisks.h>
+
+G_BEGIN_DECLS
+
+#define GIS_TYPE_DISK_INDEX (gis_disk_index_get_type ())
+G_DECLARE_FINAL_TYPE (GisDiskIndex, gis_disk_index, GIS, DISK_INDEX, GObject)
+
+GisDiskIndex *
+gis_disk_index_new (UDisksClient *client);
+
+GPtrArray *
+gis_disk_index_get_devices (GisDiskIndex *self);
+
+UDisksBlock *
+gis_disk_index_peek_block_for_drive (GisDiskIndex *self,
+                                     UDisksDrive  *drive);
+
+GList *
+gis_disk_index_get_partitions (GisDiskIndex *self,
+                               UDisksBlock  *block);
+
+const gchar *
+gis_disk_index_get_root_drive_path (GisDiskIndex *self);
+
+G_END_DECLS
+
+#endif /* GIS_DISK_INDEX_H */
@@ -27,19 +27,34 @@
 #include "config.h"
 #include "disktarget-resources.h"
 #include "gis-disktarget-page.h"
+#include "gis-disk-index.h"
 #include "gis-errors.h"
 #include "gis-store.h"
+#include "gis-throughput.h"
 
 #include <udisks/udisks.h>
 #include <glib/gstdio.h>
 #include <glib/gi18n.h>
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
 
 struct _GisDiskTargetPagePrivate {
   UDisksClient *client;
+  GisDiskIndex *index;
   gboolean has_valid_disks;
+  /* Object path of each listed drive or loop device → its
+   * (owned) GtkTreeRowReference in target_store
+   */
+  GHashTable *rows;
+  /* Object path of each block device which has been probed → (owned)
+   * gdouble rate at which it was read, or NULL if the probe has not
+   * finished or failed
+   */
+  GHashTable *rates;
+  GCancellable *probe_cancellable;
 
   GtkComboBox *disk_combo;
   GtkListStore *target_store;
@@ -95,6 +110,146 @@ gis_disktarget_page_confirm_toggled(GtkToggleButton *button, GisDiskTargetPage *
   check_can_continue(page);
 }
 
+/* Tells the rest of the installer how fast the chosen disk is, if known. */
+static void
+gis_disktarget_page_update_target_rate (GisDiskTargetPage *page)
+{
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+  GObject *block = gis_store_get_object (GIS_STORE_BLOCK_DEVICE);
+  const gdouble *rate = NULL;
+
+  if (block != NULL && priv->rates != NULL)
+    rate = g_hash_table_lookup (priv->rates,
+                                g_dbus_proxy_get_object_path (G_DBUS_PROXY (block)));
+
+  gis_store_set_target_rate (rate != NULL ? *rate : 0);
+}
+
+typedef struct {
+  gchar *block_path;
+  gint fd;
+} ProbeTargetData;
+
+static void
+probe_target_data_free (ProbeTargetData *data)
+{
+  g_free (data->block_path);
+  if (data->fd >= 0)
+    close (data->fd);
+  g_free (data);
+}
+
+static void
+gis_disktarget_page_probe_target_cb (GObject      *source,
+                                     GAsyncResult *result,
+                                     gpointer      user_data)
+{
+  GisDiskTargetPage *page = GIS_DISK_TARGET_PAGE (source);
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+  ProbeTargetData *data = g_task_get_task_data (G_TASK (result));
+  g_autofree gdouble *rate = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *formatted = NULL;
+
+  rate = g_task_propagate_pointer (G_TASK (result), &error);
+  if (rate == NULL)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_message ("can't probe %s: %s", data->block_path, error->message);
+      return;
+    }
+
+  formatted = g_format_size ((guint64) *rate);
+  g_message ("%s reads at %s/s", data->block_path, formatted);
+
+  if (priv->rates == NULL)
+    return;
+
+  g_hash_table_insert (priv->rates, g_strdup (data->block_path),
+                       g_steal_pointer (&rate));
+  gis_disktarget_page_update_target_rate (page);
+}
+
+static void
+gis_disktarget_page_probe_target_thread (GTask        *task,
+                                         gpointer      source_object,
+                                         gpointer      task_data,
+                                         GCancellable *cancellable)
+{
+  ProbeTargetData *data = task_data;
+  g_autofree gdouble *rate = g_new0 (gdouble, 1);
+  GError *error = NULL;
+
+  if (gis_throughput_probe_device (data->fd, cancellable, rate, &error))
+    g_task_return_pointer (task, g_steal_pointer (&rate), g_free);
+  else
+    g_task_return_error (task, error);
+}
+
+static void
+gis_disktarget_page_open_for_probe_cb (GObject      *source,
+                                       GAsyncResult *result,
+                                       gpointer      user_data)
+{
+  g_autoptr(GTask) task = G_TASK (user_data);
+  ProbeTargetData *data = g_task_get_task_data (task);
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) fd_index = NULL;
+  GError *error = NULL;
+
+  if (!udisks_block_call_open_for_backup_finish (UDISKS_BLOCK (source),
+                                                 &fd_index, &fd_list,
+                                                 result, &error))
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  data->fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (fd_index),
+                                 &error);
+  if (data->fd < 0)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  g_task_run_in_thread (task, gis_disktarget_page_probe_target_thread);
+}
+
+/* Measures how fast @block can be read, in the background, so that the
+ * install time can be estimated. This only reads from the disk, and each
+ * disk is only probed once.
+ */
+static void
+gis_disktarget_page_probe_target (GisDiskTargetPage *page,
+                                  UDisksBlock       *block)
+{
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+  const gchar *block_path = g_dbus_proxy_get_object_path (G_DBUS_PROXY (block));
+  ProbeTargetData *data;
+  GTask *task;
+
+  if (g_hash_table_contains (priv->rates, block_path))
+    return;
+
+  g_hash_table_insert (priv->rates, g_strdup (block_path), NULL);
+
+  data = g_new0 (ProbeTargetData, 1);
+  data->block_path = g_strdup (block_path);
+  data->fd = -1;
+
+  task = g_task_new (page, priv->probe_cancellable,
+                     gis_disktarget_page_probe_target_cb, NULL);
+  g_task_set_task_data (task, data, (GDestroyNotify) probe_target_data_free);
+
+  udisks_block_call_open_for_backup (block,
+                                     g_variant_new ("a{sv}", NULL), /* options */
+                                     NULL, /* fd_list */
+                                     priv->probe_cancellable,
+                                     gis_disktarget_page_open_for_probe_cb,
+                                     task);
+}
+
 static void
 gis_disktarget_page_selection_changed(GtkWidget *combo, GisPage *page)
 {
@@ -109,6 +264,8 @@ gis_disktarget_page_selection_changed(GtkWidget *combo, GisPage *page)
 
   if (!gtk_combo_box_get_active_iter (GTK_COMBO_BOX (combo), &i))
     {
+      /* The chosen disk may have been unplugged */
+      gis_page_set_complete (page, FALSE);
       gtk_widget_hide (GTK_WIDGET (priv->confirm_box));
       gtk_widget_hide (GTK_WIDGET (priv->partition_button));
       gtk_widget_show (GTK_WIDGET (priv->error_box));
@@ -123,6 +280,7 @@ gis_disktarget_page_selection_changed(GtkWidget *combo, GisPage *page)
       guint64 available = drive ? udisks_drive_get_size (drive) : udisks_block_get_size (UDISKS_BLOCK(block));
       gis_store_set_object (GIS_STORE_BLOCK_DEVICE, block);
       g_object_unref(block);
+      gis_disktarget_page_update_target_rate (disktarget);
       if (available < gis_store_get_required_size())
         {
           g_autofree gchar *size = g_format_size_full (
@@ -163,35 +321,22 @@ gis_disktarget_page_selection_changed(GtkWidget *combo, GisPage *page)
 }
 
 static gboolean
-gis_disktarget_page_has_data_partitions(GisPage *page, GList *objects, UDisksBlock* block)
+gis_disktarget_page_has_data_partitions (GisDiskTargetPage *page,
+                                         UDisksBlock       *block)
 {
-  GisDiskTargetPage *disktarget = GIS_DISK_TARGET_PAGE (page);
-  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (disktarget);
-  UDisksPartitionTable *table;
-  UDisksObject *obj = NULL;
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+  GList *partitions;
   gint datapartitions = 0;
   GList *l;
 
-  for (l = objects; l != NULL; l = l->next)
+  partitions = gis_disk_index_get_partitions (priv->index, block);
+  if (g_list_length (partitions) < 2)
     {
-      UDisksBlock *blockiter = udisks_object_peek_block (UDISKS_OBJECT (l->data));
-      if (blockiter == block)
-        {
-          obj = UDISKS_OBJECT (l->data);
-          break;
-        }
+      g_list_free_full (partitions, g_object_unref);
+      return FALSE;
     }
 
-  table = udisks_object_peek_partition_table (obj);
-
-  if (table == NULL)
-    return FALSE;
-
-  l = udisks_client_get_partitions(priv->client, table);
-  if (g_list_length (l) < 2)
-    return FALSE;
-
-  for (; l != NULL; l = l->next)
+  for (l = partitions; l != NULL; l = l->next)
     {
       UDisksPartition *part = UDISKS_PARTITION(l->data);
       const gchar *type = udisks_partition_get_type_(part);
@@ -220,62 +365,41 @@ gis_disktarget_page_has_data_partitions(GisPage *page, GList *objects, UDisksBlo
         }
     }
 
+  g_list_free_full (partitions, g_object_unref);
+
   if (datapartitions > 1)
     return TRUE;
 
   return FALSE;
 }
 
-static UDisksDrive *
-gis_disktarget_page_get_root_drive (UDisksClient *client)
-{
-  GDBusObjectManager *manager = udisks_client_get_object_manager(client);
-  GList *objects = g_dbus_object_manager_get_objects(manager);
-  GList *l;
-  UDisksDrive *drive = NULL;
-
-  for (l = objects; drive == NULL && l != NULL; l = l->next)
-    {
-      UDisksObject *object = UDISKS_OBJECT (l->data);
-      UDisksFilesystem *fs = udisks_object_peek_filesystem (object);
-      UDisksBlock *block = udisks_object_peek_block (object);
-      const gchar *const* mounts = NULL;
-
-      if (fs == NULL || block == NULL)
-        {
-          continue;
-        }
-
-      mounts = udisks_filesystem_get_mount_points (fs);
-      if (mounts == NULL || !g_strv_contains (mounts, "/"))
-        {
-          continue;
-        }
-
-      g_message ("found root filesystem %s",
-                 g_dbus_object_get_object_path (G_DBUS_OBJECT (object)));
-      drive = udisks_client_get_drive_for_block (client, block);
-      if (drive == NULL)
-        g_warning ("Couldn't get UDisksDrive for block");
-    }
-
-  return drive;
-}
-
-static void
-gis_disktarget_page_populate_model(GisPage *page, UDisksClient *client)
+/* Decides whether @object, a drive or loop device, may be offered as a target,
+ * and if so how to describe it.
+ */
+static gboolean
+gis_disktarget_page_describe_device (GisDiskTargetPage *page,
+                                     UDisksObject      *object,
+                                     gchar            **targetname,
+                                     gchar            **targetsize,
+                                     UDisksBlock      **block_out,
+                                     gboolean          *has_data_partitions)
 {
-  GList *l;
-  GisDiskTargetPage *disktarget = GIS_DISK_TARGET_PAGE (page);
-  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (disktarget);
-  GDBusObjectManager *manager = udisks_client_get_object_manager(client);
-  GList *objects = g_dbus_object_manager_get_objects(manager);
-  GtkTreeIter i;
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
   GisUnattendedConfig *config = gis_store_get_unattended_config ();
-  UDisksDrive *root = NULL;
   GObject *image_source = gis_store_get_object (GIS_STORE_IMAGE_SOURCE);
   const gchar *image_drive_path = NULL;
   const gchar *image_loop_path = NULL;
+  const gchar *object_path;
+  const gchar *object_type;
+  UDisksDrive *drive = udisks_object_peek_drive(object);
+  UDisksLoop *loop = udisks_object_peek_loop(object);
+  UDisksBlock *block;
+  const gchar *block_device;
+  g_autofree gchar *name = NULL;
+  g_autofree gchar *size = NULL;
+
+  if (drive == NULL && loop == NULL)
+    return FALSE;
 
   if (image_source != NULL)
     {
@@ -285,115 +409,214 @@ gis_disktarget_page_populate_model(GisPage *page, UDisksClient *client)
         image_loop_path = g_dbus_proxy_get_object_path (G_DBUS_PROXY (UDISKS_LOOP (image_source)));
     }
 
-  priv->has_valid_disks = FALSE;
-  gtk_list_store_clear (priv->target_store);
-  root = gis_disktarget_page_get_root_drive (client);
-  for (l = objects; l != NULL; l = l->next)
-    {
-      gchar *targetname, *targetsize;
-      UDisksObject *object = UDISKS_OBJECT(l->data);
-      const gchar *object_path;
-      const gchar *object_type;
-      UDisksDrive *drive = udisks_object_peek_drive(object);
-      UDisksLoop *loop = udisks_object_peek_loop(object);
-      UDisksBlock *block;
-      const gchar *block_device;
-      gboolean has_data_partitions;
-      if (drive == NULL && loop == NULL)
-        continue;
-
-      object_path = g_dbus_object_get_object_path (G_DBUS_OBJECT (object));
-      object_type = drive ? "drive" : "loop";
+  object_path = g_dbus_object_get_object_path (G_DBUS_OBJECT (object));
+  object_type = drive ? "drive" : "loop";
 
 #define skip_if(cond, reason, ...) \
-      if (cond) \
-        { \
-          g_message ("skipping %s %s: " reason, object_type, object_path, ##__VA_ARGS__); \
-          continue; \
+  if (cond) \
+    { \
+      g_message ("skipping %s %s: " reason, object_type, object_path, ##__VA_ARGS__); \
+      return FALSE; \
+    }
+
+  if (drive)
+    {
+      skip_if (0 == g_strcmp0 (object_path,
+                               gis_disk_index_get_root_drive_path (priv->index)),
+               "it is the root device");
+      skip_if (udisks_drive_get_optical (drive), "optical");
+      skip_if (udisks_drive_get_ejectable (drive), "ejectable");
+
+      block = gis_disk_index_peek_block_for_drive (priv->index, drive);
+      skip_if (block == NULL, "no corresponding block object");
+
+      skip_if (0 == g_strcmp0 (object_path, image_drive_path),
+               "it hosts the image partition");
+
+      if (udisks_drive_get_size(drive) >= gis_store_get_required_size())
+        {
+          priv->has_valid_disks = TRUE;
         }
 
-      if (drive)
+      name = g_strdup_printf("%s %s",
+                             udisks_drive_get_vendor(drive),
+                             udisks_drive_get_model(drive));
+      size = g_format_size_full (udisks_drive_get_size(drive),
+                                 G_FORMAT_SIZE_DEFAULT);
+    }
+  else
+    {
+      const gchar *backing_file = udisks_loop_get_backing_file (loop);
+      skip_if (backing_file == NULL || *backing_file == '\0',
+               "no backing file");
+      skip_if (!g_file_test (backing_file, G_FILE_TEST_EXISTS),
+               "backing file %s does not exist", backing_file);
+
+      block = udisks_object_peek_block (object);
+      skip_if (block == NULL, "no corresponding block object");
+
+      skip_if (0 == g_strcmp0 (object_path, image_loop_path),
+               "it hosts the image partition");
+
+      UDisksFilesystem *fs = udisks_object_peek_filesystem (object);
+      if (fs != NULL)
         {
-          skip_if (drive == root, "it is the root device");
-          skip_if (udisks_drive_get_optical (drive), "optical");
-          skip_if (udisks_drive_get_ejectable (drive), "ejectable");
-
-          block = udisks_client_get_block_for_drive(client, drive, TRUE);
-          skip_if (block == NULL, "no corresponding block object");
-
-          skip_if (0 == g_strcmp0 (object_path, image_drive_path),
-                   "it hosts the image partition");
-
-          if (udisks_drive_get_size(drive) >= gis_store_get_required_size())
-            {
-              priv->has_valid_disks = TRUE;
-            }
-
-          targetname = g_strdup_printf("%s %s",
-                                       udisks_drive_get_vendor(drive),
-                                       udisks_drive_get_model(drive));
-          targetsize = g_format_size_full (udisks_drive_get_size(drive),
-                                           G_FORMAT_SIZE_DEFAULT);
+          const gchar * const *mount_points =
+            udisks_filesystem_get_mount_points (fs);
+          skip_if (mount_points != NULL && mount_points[0] != NULL,
+                   "it is mounted at (at least) %s",
+                   mount_points[0]);
         }
-      else
+
+      if (udisks_block_get_size (block) >= gis_store_get_required_size ())
         {
-          const gchar *backing_file = udisks_loop_get_backing_file (loop);
-          skip_if (backing_file == NULL || *backing_file == '\0',
-                   "no backing file");
-          skip_if (!g_file_test (backing_file, G_FILE_TEST_EXISTS),
-                   "backing file %s does not exist", backing_file);
-
-          block = udisks_object_peek_block (object);
-          skip_if (block == NULL, "no corresponding block object");
-
-          skip_if (0 == g_strcmp0 (object_path, image_loop_path),
-                   "it hosts the image partition");
-
-          UDisksFilesystem *fs = udisks_object_peek_filesystem (object);
-          if (fs != NULL)
-            {
-              const gchar * const *mount_points =
-                udisks_filesystem_get_mount_points (fs);
-              skip_if (mount_points != NULL && mount_points[0] != NULL,
-                       "it is mounted at (at least) %s",
-                       mount_points[0]);
-            }
-
-          if (udisks_block_get_size (block) >= gis_store_get_required_size ())
-            {
-              priv->has_valid_disks = TRUE;
-            }
-
-          targetname = g_strdup_printf("%s %s",
-                                       udisks_block_get_device (block),
-                                       backing_file);
-          targetsize = g_format_size_full (udisks_block_get_size (block),
-                                           G_FORMAT_SIZE_DEFAULT);
+          priv->has_valid_disks = TRUE;
         }
 
-      skip_if (udisks_block_get_read_only (block), "block device is read-only");
+      name = g_strdup_printf("%s %s",
+                             udisks_block_get_device (block),
+                             backing_file);
+      size = g_format_size_full (udisks_block_get_size (block),
+                                 G_FORMAT_SIZE_DEFAULT);
+    }
+
+  skip_if (udisks_block_get_read_only (block), "block device is read-only");
 
-      block_device = udisks_block_get_device (block);
-      skip_if (config != NULL &&
-               !gis_unattended_config_matches_device (config, block_device),
-               "it doesn't match the unattended config");
+  block_device = udisks_block_get_device (block);
+  skip_if (config != NULL &&
+           !gis_unattended_config_matches_device (config, block_device),
+           "it doesn't match the unattended config");
 #undef skip_if
 
-      g_message ("adding %s %s to list", object_type, object_path);
+  *targetname = g_steal_pointer (&name);
+  *targetsize = g_steal_pointer (&size);
+  *block_out = block;
+  *has_data_partitions = gis_disktarget_page_has_data_partitions (page, block);
+  return TRUE;
+}
+
+/* Adds, updates or removes @object_path's row in the store, according to
+ * whether it is (still) a suitable target.
+ */
+static void
+gis_disktarget_page_update_device (GisDiskTargetPage *page,
+                                   const gchar       *object_path)
+{
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+  GtkTreeRowReference *row = g_hash_table_lookup (priv->rows, object_path);
+  UDisksObject *object = udisks_client_peek_object (priv->client, object_path);
+  g_autofree gchar *targetname = NULL;
+  g_autofree gchar *targetsize = NULL;
+  UDisksBlock *block = NULL;
+  gboolean has_data_partitions = FALSE;
+  GtkTreePath *path;
+  GtkTreeIter i;
 
-      has_data_partitions = gis_disktarget_page_has_data_partitions(page, objects, block);
+  if (object == NULL ||
+      !gis_disktarget_page_describe_device (page, object, &targetname,
+                                            &targetsize, &block,
+                                            &has_data_partitions))
+    {
+      if (row != NULL)
+        {
+          g_message ("removing %s from list", object_path);
+          path = gtk_tree_row_reference_get_path (row);
+          if (gtk_tree_model_get_iter (GTK_TREE_MODEL (priv->target_store),
+                                       &i, path))
+            gtk_list_store_remove (priv->target_store, &i);
+          gtk_tree_path_free (path);
+          g_hash_table_remove (priv->rows, object_path);
+        }
+      return;
+    }
 
+  if (row != NULL)
+    {
+      path = gtk_tree_row_reference_get_path (row);
+      gtk_tree_model_get_iter (GTK_TREE_MODEL (priv->target_store), &i, path);
+      gtk_tree_path_free (path);
+    }
+  else
+    {
+      g_message ("adding %s to list", object_path);
       gtk_list_store_append (priv->target_store, &i);
-      gtk_list_store_set (priv->target_store, &i,
-                          0, targetname,
-                          1, targetsize,
-                          2, G_OBJECT(block),
-                          3, has_data_partitions,
-                          -1);
-      g_free(targetname);
-      g_free(targetsize);
+      path = gtk_tree_model_get_path (GTK_TREE_MODEL (priv->target_store), &i);
+      g_hash_table_insert (priv->rows, g_strdup (object_path),
+                           gtk_tree_row_reference_new (
+                               GTK_TREE_MODEL (priv->target_store), path));
+      gtk_tree_path_free (path);
+    }
+
+  gtk_list_store_set (priv->target_store, &i,
+                      0, targetname,
+                      1, targetsize,
+                      2, G_OBJECT(block),
+                      3, has_data_partitions,
+                      -1);
+
+  gis_disktarget_page_probe_target (page, block);
+}
+
+static void
+gis_disktarget_page_show_no_targets (GisDiskTargetPage *page)
+{
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+
+  gtk_widget_hide (GTK_WIDGET (priv->confirm_box));
+  gtk_widget_hide (GTK_WIDGET (priv->partition_button));
+  gtk_widget_hide (GTK_WIDGET (priv->too_small_box));
+  gtk_widget_show (GTK_WIDGET (priv->error_box));
+}
+
+/* Keeps the list up to date as disks are plugged in and out while the page
+ * is shown. Once the user has moved on, the list is left alone until the page
+ * is shown again, so the chosen disk cannot change underneath them.
+ */
+static void
+gis_disktarget_page_device_changed_cb (GisDiskIndex      *index,
+                                       const gchar       *object_path,
+                                       GisDiskTargetPage *page)
+{
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+  GisAssistant *assistant = gis_driver_get_assistant (GIS_PAGE (page)->driver);
+  GtkTreeIter i;
+
+  if (gis_assistant_get_current_page (assistant) != GIS_PAGE (page) ||
+      gis_store_get_error () != NULL)
+    return;
+
+  gis_disktarget_page_update_device (page, object_path);
+
+  if (gtk_combo_box_get_active (priv->disk_combo) >= 0)
+    return;
+
+  if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (priv->target_store), &i))
+    gtk_combo_box_set_active_iter (priv->disk_combo, &i);
+  else
+    gis_disktarget_page_show_no_targets (page);
+}
+
+static void
+gis_disktarget_page_populate_model(GisPage *page)
+{
+  GisDiskTargetPage *disktarget = GIS_DISK_TARGET_PAGE (page);
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (disktarget);
+  g_autoptr(GPtrArray) devices = NULL;
+  GtkTreeIter i;
+  guint j;
+
+  priv->has_valid_disks = FALSE;
+  gtk_list_store_clear (priv->target_store);
+  g_hash_table_remove_all (priv->rows);
+
+  devices = gis_disk_index_get_devices (priv->index);
+  for (j = 0; j < devices->len; j++)
+    {
+      GDBusObject *object = g_ptr_array_index (devices, j);
+
+      gis_disktarget_page_update_device (disktarget,
+                                         g_dbus_object_get_object_path (object));
     }
-  g_clear_object (&root);
 
   if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (priv->target_store), &i))
     {
@@ -401,10 +624,7 @@ gis_disktarget_page_populate_model(GisPage *page, UDisksClient *client)
     }
   else
     {
-      gtk_widget_hide (GTK_WIDGET (priv->confirm_box));
-      gtk_widget_hide (GTK_WIDGET (priv->partition_button));
-      gtk_widget_hide (GTK_WIDGET (priv->too_small_box));
-      gtk_widget_show (GTK_WIDGET (priv->error_box));
+      gis_disktarget_page_show_no_targets (disktarget);
     }
 
   gtk_widget_set_visible (GTK_WIDGET (priv->suitable_disks_box), !priv->has_valid_disks);
@@ -449,9 +669,17 @@ gis_disktarget_page_shown (GisPage *page)
       return;
     }
 
-  priv->client = UDISKS_CLIENT (gis_store_get_object (GIS_STORE_UDISKS_CLIENT));
-  g_assert (priv->client != NULL);
-  gis_disktarget_page_populate_model(page, priv->client);
+  if (priv->index == NULL)
+    {
+      priv->client = UDISKS_CLIENT (gis_store_get_object (GIS_STORE_UDISKS_CLIENT));
+      g_assert (priv->client != NULL);
+      priv->index = gis_disk_index_new (priv->client);
+      g_signal_connect (priv->index, "device-changed",
+                        G_CALLBACK (gis_disktarget_page_device_changed_cb),
+                        page);
+    }
+
+  gis_disktarget_page_populate_model(page);
 }
 
 static void
@@ -479,6 +707,23 @@ gis_disktarget_page_constructed (GObject *object)
 
 }
 
+static void
+gis_disktarget_page_dispose (GObject *object)
+{
+  GisDiskTargetPage *page = GIS_DISK_TARGET_PAGE (object);
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+
+  if (priv->index != NULL)
+    g_signal_handlers_disconnect_by_data (priv->index, page);
+  g_clear_object (&priv->index);
+  g_clear_pointer (&priv->rows, g_hash_table_unref);
+  g_cancellable_cancel (priv->probe_cancellable);
+  g_clear_object (&priv->probe_cancellable);
+  g_clear_pointer (&priv->rates, g_hash_table_unref);
+
+  G_OBJECT_CLASS (gis_disktarget_page_parent_class)->dispose (object);
+}
+
 static void
 gis_disktarget_page_locale_changed (GisPage *page)
 {
@@ -510,14 +755,24 @@ gis_disktarget_page_class_init (GisDiskTargetPageClass *klass)
   page_class->locale_changed = gis_disktarget_page_locale_changed;
   page_class->shown = gis_disktarget_page_shown;
   object_class->constructed = gis_disktarget_page_constructed;
+  object_class->dispose = gis_disktarget_page_dispose;
 }
 
 static void
 gis_disktarget_page_init (GisDiskTargetPage *page)
 {
+  GisDiskTargetPagePrivate *priv = gis_disktarget_page_get_instance_private (page);
+
   g_resources_register (disktarget_get_resource ());
 
   gtk_widget_init_template (GTK_WIDGET (page));
+
+  priv->rows = g_hash_table_new_full (
+      g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) gtk_tree_row_reference_free);
+  priv->rates = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                       g_free);
+  priv->probe_cancellable = g_cancellable_new ();
 }
 
 void
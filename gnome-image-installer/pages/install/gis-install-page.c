@@ -26,10 +26,14 @@
 
 #include "config.h"
 #include "install-resources.h"
+#include "gis-dmi.h"
 #include "gis-errors.h"
 #include "gis-install-page.h"
+#include "gis-install-record.h"
 #include "gis-scribe.h"
+#include "gis-split-image.h"
 #include "gis-store.h"
+#include "gis-throughput.h"
 
 #include <udisks/udisks.h>
 #include <glib/gstdio.h>
@@ -42,6 +46,32 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+/* Number of one-second samples of each stage's throughput which the
+ * performance overlay charts.
+ */
+#define PERF_HISTORY_LENGTH 120
+
+typedef enum {
+  PERF_SERIES_READ,
+  PERF_SERIES_VERIFY,
+  PERF_SERIES_DECODE,
+  PERF_SERIES_WRITE,
+  PERF_N_SERIES
+} PerfSeries;
+
+static const struct {
+  const gchar *label;
+  /* The stage in gis_scribe_dup_metrics() and its counter to chart */
+  const gchar *stage;
+  const gchar *key;
+  const gchar *colour;
+} perf_series[PERF_N_SERIES] = {
+  { "read", "tee", "bytes-in", "#8ae234" },
+  { "verify", "verify", "bytes-in", "#fce94f" },
+  { "decode", "decompress", "bytes-out", "#729fcf" },
+  { "write", "write", "bytes-out", "#ef2929" },
+};
+
 struct _GisInstallPagePrivate {
   guint pulse_id;
 
@@ -50,6 +80,28 @@ struct _GisInstallPagePrivate {
 
   GtkLabel *install_label;
   GtkProgressBar *install_progress;
+
+  /* Monotonic time at which writing began */
+  gint64 write_start_time;
+
+  GtkAccelGroup *accel_group;
+  GtkWidget *perf_overlay;
+  GtkWidget *perf_chart;
+  GtkLabel *perf_label;
+
+  /* The scribe's latest metrics, and a ring buffer of the throughput of each
+   * stage over the last PERF_HISTORY_LENGTH seconds, in bytes per second.
+   * These are sampled whether or not the overlay is shown, so that it has
+   * some history to show as soon as it is.
+   */
+  GisScribe *scribe;
+  guint perf_timeout_id;
+  GVariant *perf_metrics;
+  gdouble perf_history[PERF_N_SERIES][PERF_HISTORY_LENGTH];
+  guint perf_history_len;
+  guint perf_history_next;
+  guint64 perf_last_bytes[PERF_N_SERIES];
+  gint64 perf_last_usec;
 };
 typedef struct _GisInstallPagePrivate GisInstallPagePrivate;
 
@@ -122,6 +174,18 @@ gis_install_page_stop_pulsing (GisInstallPage *page)
     }
 }
 
+static void
+gis_install_page_stop_perf_sampling (GisInstallPage *page)
+{
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (page);
+
+  if (priv->perf_timeout_id != 0)
+    {
+      g_source_remove (priv->perf_timeout_id);
+      priv->perf_timeout_id = 0;
+    }
+}
+
 static gboolean
 gis_install_page_teardown (GisPage *page)
 {
@@ -129,8 +193,10 @@ gis_install_page_teardown (GisPage *page)
   GisInstallPagePrivate *priv = gis_install_page_get_instance_private (install);
 
   gis_install_page_stop_pulsing (install);
+  gis_install_page_stop_perf_sampling (install);
 
   gtk_progress_bar_set_fraction (priv->install_progress, 1.0);
+  gtk_progress_bar_set_show_text (priv->install_progress, FALSE);
 
   /*
    * If there's a message dialog asking whether the user wants to quit, and
@@ -183,7 +249,7 @@ gis_install_page_ensure_pulsing (GisInstallPage *page)
 }
 
 static gboolean
-gis_install_page_is_efi_system (GisPage *page)
+gis_install_page_is_efi_system (void)
 {
   return g_file_test ("/sys/firmware/efi", G_FILE_TEST_IS_DIR);
 }
@@ -225,9 +291,379 @@ gis_install_page_progress_cb (GObject    *object,
   gdouble progress = gis_scribe_get_progress (scribe);
 
   if (progress < 0)
-    gis_install_page_ensure_pulsing (self);
+    {
+      gis_install_page_ensure_pulsing (self);
+    }
   else
-    gtk_progress_bar_set_fraction (priv->install_progress, progress);
+    {
+      gis_install_page_stop_pulsing (self);
+      gtk_progress_bar_set_fraction (priv->install_progress, progress);
+    }
+}
+
+static void
+gis_install_page_eta_cb (GObject    *object,
+                         GParamSpec *pspec,
+                         gpointer    data)
+{
+  GisInstallPage *self = GIS_INSTALL_PAGE (data);
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+  GisScribe *scribe = GIS_SCRIBE (object);
+  gint64 eta = gis_scribe_get_eta (scribe);
+  g_autofree gchar *text = NULL;
+  guint minutes;
+
+  if (eta < 0)
+    {
+      gtk_progress_bar_set_show_text (priv->install_progress, FALSE);
+      return;
+    }
+
+  if (eta < 60)
+    {
+      text = g_strdup (_("Less than a minute remaining"));
+    }
+  else
+    {
+      minutes = (eta + 30) / 60;
+      text = g_strdup_printf (g_dngettext (GETTEXT_PACKAGE,
+                                           "About %u minute remaining",
+                                           "About %u minutes remaining",
+                                           minutes),
+                              minutes);
+    }
+
+  gtk_progress_bar_set_text (priv->install_progress, text);
+  gtk_progress_bar_set_show_text (priv->install_progress, TRUE);
+}
+
+static void
+gis_install_page_perf_append_stage (GString     *text,
+                                    GVariant    *stages,
+                                    PerfSeries   series,
+                                    gdouble      rate)
+{
+  g_autoptr(GVariant) stage =
+    g_variant_lookup_value (stages, perf_series[series].stage,
+                            G_VARIANT_TYPE_VARDICT);
+  g_autofree gchar *formatted_rate = g_format_size ((guint64) rate);
+  guint64 queue_bytes = 0;
+  guint64 queue_capacity = 0;
+
+  g_string_append_printf (text, "<span foreground=\"%s\">%-7s</span>%12s/s",
+                          perf_series[series].colour,
+                          perf_series[series].label,
+                          formatted_rate);
+
+  /* The tee reads straight from the image, so has no buffer of its own; nor
+   * does the verifier if it is hashing the image in-process.
+   */
+  if (stage != NULL &&
+      g_variant_lookup (stage, "queue-bytes", "t", &queue_bytes) &&
+      g_variant_lookup (stage, "queue-capacity-bytes", "t", &queue_capacity) &&
+      queue_capacity > 0)
+    {
+      g_autofree gchar *formatted_capacity = g_format_size (queue_capacity);
+
+      g_string_append_printf (text, "  buffer %3u%% of %s",
+                              (guint) (100 * MIN (queue_bytes, queue_capacity)
+                                       / queue_capacity),
+                              formatted_capacity);
+    }
+
+  g_string_append_c (text, '\n');
+}
+
+static gdouble
+gis_install_page_perf_get_latest_rate (GisInstallPagePrivate *priv,
+                                       PerfSeries             series)
+{
+  if (priv->perf_history_len == 0)
+    return 0;
+
+  return priv->perf_history[series][(priv->perf_history_next +
+                                     PERF_HISTORY_LENGTH - 1) %
+                                    PERF_HISTORY_LENGTH];
+}
+
+static void
+gis_install_page_perf_update (GisInstallPage *self)
+{
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+  g_autoptr(GVariant) stages = NULL;
+  g_autoptr(GString) text = g_string_new (NULL);
+  const gchar *bottleneck = NULL;
+  const gchar *bound = NULL;
+  guint64 dirty_bytes = 0;
+  g_autofree gchar *formatted_dirty = NULL;
+  guint i;
+
+  if (priv->perf_metrics == NULL)
+    {
+      gtk_label_set_text (priv->perf_label, "waiting for the write to begin");
+      gtk_widget_queue_draw (priv->perf_chart);
+      return;
+    }
+
+  stages = g_variant_lookup_value (priv->perf_metrics, "stages",
+                                   G_VARIANT_TYPE ("a{sa{sv}}"));
+  for (i = 0; i < PERF_N_SERIES && stages != NULL; i++)
+    gis_install_page_perf_append_stage (text, stages, i,
+                                        gis_install_page_perf_get_latest_rate (priv, i));
+
+  if (g_variant_lookup (priv->perf_metrics, "bottleneck", "&s", &bottleneck) &&
+      g_variant_lookup (priv->perf_metrics, "bound", "&s", &bound))
+    g_string_append_printf (text, "bottleneck %s (%s-bound)\n",
+                            bottleneck, bound);
+
+  g_variant_lookup (priv->perf_metrics, "dirty-bytes", "t", &dirty_bytes);
+  formatted_dirty = g_format_size (dirty_bytes);
+  g_string_append_printf (text, "dirty      %s", formatted_dirty);
+
+  gtk_label_set_markup (priv->perf_label, text->str);
+  gtk_widget_queue_draw (priv->perf_chart);
+}
+
+static gboolean
+gis_install_page_perf_sample_cb (gpointer data)
+{
+  GisInstallPage *self = GIS_INSTALL_PAGE (data);
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+  g_autoptr(GVariant) stages = NULL;
+  gint64 elapsed_usec = 0;
+  gint64 interval_usec;
+  guint i;
+
+  g_clear_pointer (&priv->perf_metrics, g_variant_unref);
+  priv->perf_metrics = gis_scribe_dup_metrics (priv->scribe);
+
+  /* Once the write has finished, the counters stop. */
+  g_variant_lookup (priv->perf_metrics, "elapsed-usec", "x", &elapsed_usec);
+  interval_usec = elapsed_usec - priv->perf_last_usec;
+  if (interval_usec <= 0)
+    return G_SOURCE_CONTINUE;
+
+  stages = g_variant_lookup_value (priv->perf_metrics, "stages",
+                                   G_VARIANT_TYPE ("a{sa{sv}}"));
+  for (i = 0; i < PERF_N_SERIES; i++)
+    {
+      g_autoptr(GVariant) stage = NULL;
+      guint64 bytes = 0;
+
+      if (stages != NULL)
+        stage = g_variant_lookup_value (stages, perf_series[i].stage,
+                                        G_VARIANT_TYPE_VARDICT);
+      if (stage != NULL)
+        g_variant_lookup (stage, perf_series[i].key, "t", &bytes);
+
+      /* The counters start again from zero if the scribe restarts its
+       * pipeline, as it does when a pre-warmed write gains its target.
+       */
+      priv->perf_history[i][priv->perf_history_next] =
+        bytes >= priv->perf_last_bytes[i]
+        ? (bytes - priv->perf_last_bytes[i]) * (gdouble) G_USEC_PER_SEC / interval_usec
+        : 0;
+      priv->perf_last_bytes[i] = bytes;
+    }
+
+  priv->perf_last_usec = elapsed_usec;
+  priv->perf_history_next = (priv->perf_history_next + 1) % PERF_HISTORY_LENGTH;
+  priv->perf_history_len = MIN (priv->perf_history_len + 1, PERF_HISTORY_LENGTH);
+
+  if (gtk_widget_get_visible (priv->perf_overlay))
+    gis_install_page_perf_update (self);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Charts the throughput of each stage over time, newest on the right, scaled
+ * to the fastest rate seen in that time.
+ */
+static gboolean
+gis_install_page_perf_draw_cb (GtkWidget      *widget,
+                               cairo_t        *cr,
+                               GisInstallPage *self)
+{
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+  gdouble width = gtk_widget_get_allocated_width (widget);
+  gdouble height = gtk_widget_get_allocated_height (widget);
+  gdouble max_rate = 1024 * 1024;
+  guint i, j;
+
+  for (i = 0; i < PERF_N_SERIES; i++)
+    for (j = 0; j < priv->perf_history_len; j++)
+      max_rate = MAX (max_rate, priv->perf_history[i][j]);
+
+  cairo_set_line_width (cr, 1.5);
+  cairo_set_line_join (cr, CAIRO_LINE_JOIN_ROUND);
+
+  for (i = 0; i < PERF_N_SERIES; i++)
+    {
+      GdkRGBA colour;
+
+      if (!gdk_rgba_parse (&colour, perf_series[i].colour))
+        g_assert_not_reached ();
+      gdk_cairo_set_source_rgba (cr, &colour);
+
+      for (j = 0; j < priv->perf_history_len; j++)
+        {
+          guint index = (priv->perf_history_next + PERF_HISTORY_LENGTH -
+                         priv->perf_history_len + j) % PERF_HISTORY_LENGTH;
+          gdouble x = width - (priv->perf_history_len - 1 - j) * width /
+                              (PERF_HISTORY_LENGTH - 1);
+          gdouble y = height - height * priv->perf_history[i][index] / max_rate;
+
+          if (j == 0)
+            cairo_move_to (cr, x, y);
+          else
+            cairo_line_to (cr, x, y);
+        }
+
+      cairo_stroke (cr);
+    }
+
+  return FALSE;
+}
+
+static void
+gis_install_page_toggle_perf_overlay_cb (GisInstallPage *self)
+{
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+  gboolean visible = !gtk_widget_get_visible (priv->perf_overlay);
+
+  gtk_widget_set_visible (priv->perf_overlay, visible);
+  if (visible)
+    gis_install_page_perf_update (self);
+}
+
+/* Returns the vendor and model of the disk being written to, or %NULL if it
+ * is not known.
+ */
+static gchar *
+gis_install_page_get_target_model (void)
+{
+  UDisksClient *client =
+    UDISKS_CLIENT (gis_store_get_object (GIS_STORE_UDISKS_CLIENT));
+  UDisksBlock *block =
+    UDISKS_BLOCK (gis_store_get_object (GIS_STORE_BLOCK_DEVICE));
+  g_autoptr(UDisksDrive) drive = NULL;
+  gchar *model;
+
+  if (client == NULL || block == NULL)
+    return NULL;
+
+  drive = udisks_client_get_drive_for_block (client, block);
+  if (drive == NULL)
+    return NULL;
+
+  model = g_strdup_printf ("%s %s",
+                           udisks_drive_get_vendor (drive),
+                           udisks_drive_get_model (drive));
+  return g_strstrip (model);
+}
+
+/* Remembers how long the image took to write to this model of disk, so
+ * that the next install to the same model can be estimated more closely.
+ */
+static void
+gis_install_page_record_throughput (GisInstallPage *self)
+{
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+  GFile *image_dir = G_FILE (gis_store_get_object (GIS_STORE_IMAGE_DIR));
+  g_autofree gchar *image_dir_path = NULL;
+  g_autofree gchar *model = NULL;
+  g_autofree gchar *formatted = NULL;
+  g_autoptr(GError) error = NULL;
+  gint64 elapsed = g_get_monotonic_time () - priv->write_start_time;
+  gdouble write_rate;
+
+  if (image_dir == NULL || priv->write_start_time == 0)
+    return;
+
+  image_dir_path = g_file_get_path (image_dir);
+  model = gis_install_page_get_target_model ();
+  if (image_dir_path == NULL || model == NULL)
+    return;
+
+  write_rate = gis_store_get_required_size () * (gdouble) G_USEC_PER_SEC /
+               MAX (elapsed, 1);
+  formatted = g_format_size ((guint64) write_rate);
+  g_message ("wrote image to %s at %s/s", model, formatted);
+
+  if (!gis_throughput_history_record (image_dir_path, model, write_rate,
+                                      &error))
+    g_message ("can't record install time: %s", error->message);
+}
+
+/* If GIS_TRACE_ENV is set, saves the trace of the write alongside where
+ * the diagnostics would go, whether or not it succeeded.
+ */
+static void
+gis_install_page_write_trace (GisScribe *scribe)
+{
+  GisTrace *trace = gis_scribe_get_trace (scribe);
+  GFile *image_dir = G_FILE (gis_store_get_object (GIS_STORE_IMAGE_DIR));
+  g_autoptr(GFile) file = NULL;
+  g_autofree gchar *path = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (trace == NULL)
+    return;
+
+  file = gis_trace_write (trace, image_dir, g_get_home_dir (), NULL, &error);
+  if (file == NULL)
+    {
+      g_message ("failed to write trace: %s", error->message);
+      return;
+    }
+
+  path = g_file_get_path (file);
+  g_message ("wrote trace to %s", path);
+}
+
+/* Appends a line describing this install, successful or not, to the record
+ * of installs alongside where the diagnostics would go. @scribe is %NULL if
+ * the install failed before writing began.
+ */
+static void
+gis_install_page_append_record (GisScribe    *scribe,
+                                const GError *install_error)
+{
+  GFile *image = G_FILE (gis_store_get_object (GIS_STORE_IMAGE));
+  GFile *image_dir = G_FILE (gis_store_get_object (GIS_STORE_IMAGE_DIR));
+  g_autofree gchar *vendor = NULL;
+  g_autofree gchar *product = NULL;
+  g_autofree gchar *target_model = gis_install_page_get_target_model ();
+  g_autoptr(GVariant) metrics = NULL;
+  g_autoptr(GVariant) record = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (!gis_dmi_read_vendor_product (&vendor, &product, &error))
+    {
+      g_message ("failed to read DMI vendor and product: %s", error->message);
+      g_clear_error (&error);
+    }
+
+  if (scribe != NULL)
+    metrics = gis_scribe_dup_metrics (scribe);
+
+  record = gis_install_record_new (gis_store_get_image_name (),
+                                   image != NULL
+                                   ? gis_install_record_get_image_format (image)
+                                   : NULL,
+                                   gis_store_get_required_size (),
+                                   gis_store_get_image_size (),
+                                   vendor,
+                                   product,
+                                   target_model,
+                                   metrics,
+                                   install_error);
+
+  file = gis_install_record_append (record, image_dir, g_get_home_dir (),
+                                    NULL, &error);
+  if (file == NULL)
+    g_message ("failed to append install record: %s", error->message);
 }
 
 static void
@@ -239,47 +675,73 @@ gis_install_page_write_cb (GObject      *source,
   GisScribe *scribe = GIS_SCRIBE (source);
   g_autoptr(GError) error = NULL;
 
+  gis_install_page_write_trace (scribe);
+
   if (!gis_scribe_write_finish (scribe, result, &error))
     gis_store_set_error (error);
+  else
+    gis_install_page_record_throughput (GIS_INSTALL_PAGE (page));
+
+  gis_install_page_append_record (scribe, error);
 
   gis_install_page_teardown (page);
 }
 
-static void
-gis_install_page_open_for_restore_cb (GObject      *source,
-                                      GAsyncResult *result,
-                                      gpointer      data)
+/* Returns a new #GisScribe for the selected image, writing to @drive_path
+ * (if not %NULL).
+ */
+/* Opens the partition holding @image for reading, so that the scribe can
+ * read the image from it directly rather than through the filesystem.
+ * Returns -1 if @image is not on GIS_STORE_IMAGE_BLOCK or it can't be opened,
+ * in which case the image is just read through the filesystem.
+ *
+ * This is a synchronous D-Bus call, but udisks answers it straight away.
+ */
+static gint
+gis_install_page_open_image_device (GFile *image)
 {
-  GisPage *page = GIS_PAGE (data);
-  UDisksBlock *block = UDISKS_BLOCK (source);
+  UDisksBlock *block =
+    UDISKS_BLOCK (gis_store_get_object (GIS_STORE_IMAGE_BLOCK));
+  GFile *image_dir = G_FILE (gis_store_get_object (GIS_STORE_IMAGE_DIR));
   g_autoptr(GUnixFDList) fd_list = NULL;
   g_autoptr(GVariant) fd_index = NULL;
-  gint fd = -1;
   g_autoptr(GError) error = NULL;
+  gint fd;
+
+  if (block == NULL || image_dir == NULL ||
+      !g_file_has_prefix (image, image_dir))
+    return -1;
+
+  if (!udisks_block_call_open_for_backup_sync (block,
+                                               g_variant_new ("a{sv}", NULL),
+                                               NULL, &fd_index, &fd_list,
+                                               NULL, &error))
+    {
+      g_message ("can't open %s to read image: %s",
+                 udisks_block_get_device (block), error->message);
+      return -1;
+    }
+
+  fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (fd_index), &error);
+  if (fd < 0)
+    g_message ("can't extract image device fd: %s", error->message);
+
+  return fd;
+}
+
+static GisScribe *
+gis_install_page_new_scribe (const gchar *drive_path,
+                             gint         drive_fd)
+{
   g_autoptr(GFile) image = NULL;
   const gchar *signature_path = NULL;
   g_autoptr(GFile) signature = NULL;
   const gchar *checksum_path = NULL;
   g_autoptr(GFile) checksum = NULL;
-  g_autoptr(GisScribe) scribe = NULL;
+  GisScribe *scribe;
   guint64 uncompressed_size_bytes = gis_store_get_required_size ();
   guint64 compressed_size_bytes = gis_store_get_image_size ();
 
-  if (!udisks_block_call_open_for_restore_finish (block, &fd_index, &fd_list,
-                                                  result, &error))
-    {
-      goto error;
-    }
-
-  fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (fd_index), &error);
-  if (fd < 0)
-    {
-      g_prefix_error (&error,
-                      "Error extracting fd with handle %d from D-Bus message: ",
-                      g_variant_get_handle (fd_index));
-      goto error;
-    }
-
   image = g_object_ref (G_FILE (gis_store_get_object (GIS_STORE_IMAGE)));
   signature_path = gis_store_get_image_signature ();
   signature = g_file_new_for_path (signature_path);
@@ -290,9 +752,11 @@ gis_install_page_open_for_restore_cb (GObject      *source,
    * squashfs image, but the file we read is the mapped uncompressed image from
    * within it. So for the purposes of the scribe, the "compressed size" is the
    * uncompressed size. It's a bit clumsy to put this special-case here, but
-   * anywhere else seemed equally clumsy.
+   * anywhere else seemed equally clumsy. The same goes for split images,
+   * which the scribe decompresses as it reads them.
    */
-  if (g_str_has_suffix (signature_path, ".img.asc"))
+  if (g_str_has_suffix (signature_path, ".img.asc") ||
+      gis_split_image_is_split (image))
     compressed_size_bytes = uncompressed_size_bytes;
 
   scribe = gis_scribe_new (image,
@@ -300,14 +764,78 @@ gis_install_page_open_for_restore_cb (GObject      *source,
                            compressed_size_bytes,
                            signature,
                            checksum,
-                           udisks_block_get_device (block),
-                           fd,
-                           !gis_install_page_is_efi_system (page));
+                           drive_path,
+                           drive_fd,
+                           !gis_install_page_is_efi_system ());
+  g_object_set (scribe,
+                "image-cache", gis_store_get_image_cache (),
+                "image-verifier", gis_store_get_image_verifier (),
+                "image-device-fd", gis_install_page_open_image_device (image),
+                NULL);
+
+  return scribe;
+}
+
+static void
+gis_install_page_open_for_restore_cb (GObject      *source,
+                                      GAsyncResult *result,
+                                      gpointer      data)
+{
+  GisPage *page = GIS_PAGE (data);
+  GisInstallPagePrivate *priv =
+    gis_install_page_get_instance_private (GIS_INSTALL_PAGE (page));
+  UDisksBlock *block = UDISKS_BLOCK (source);
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) fd_index = NULL;
+  gint fd = -1;
+  g_autoptr(GError) error = NULL;
+  GisScribe *prewarmed_scribe;
+  g_autoptr(GisScribe) scribe = NULL;
+
+  if (!udisks_block_call_open_for_restore_finish (block, &fd_index, &fd_list,
+                                                  result, &error))
+    {
+      goto error;
+    }
+
+  fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (fd_index), &error);
+  if (fd < 0)
+    {
+      g_prefix_error (&error,
+                      "Error extracting fd with handle %d from D-Bus message: ",
+                      g_variant_get_handle (fd_index));
+      goto error;
+    }
+
+  /* If the unattended mode countdown has already started reading the image,
+   * pick up where it left off.
+   */
+  prewarmed_scribe =
+    GIS_SCRIBE (gis_store_get_object (GIS_STORE_PREWARMED_SCRIBE));
+  if (prewarmed_scribe != NULL)
+    {
+      scribe = g_object_ref (prewarmed_scribe);
+      gis_store_clear_object (GIS_STORE_PREWARMED_SCRIBE);
+      gis_scribe_add_target (scribe, udisks_block_get_device (block), fd);
+    }
+  else
+    {
+      scribe = gis_install_page_new_scribe (udisks_block_get_device (block),
+                                            fd);
+    }
+
   g_signal_connect (scribe, "notify::step",
                     (GCallback) gis_install_page_step_cb, page);
   g_signal_connect (scribe, "notify::progress",
                     (GCallback) gis_install_page_progress_cb, page);
+  g_signal_connect (scribe, "notify::eta",
+                    (GCallback) gis_install_page_eta_cb, page);
+
+  g_set_object (&priv->scribe, scribe);
+  priv->perf_timeout_id =
+    g_timeout_add_seconds (1, gis_install_page_perf_sample_cb, page);
 
+  priv->write_start_time = g_get_monotonic_time ();
   gis_scribe_write_async (scribe,
                           NULL,
                           gis_install_page_write_cb,
@@ -315,6 +843,7 @@ gis_install_page_open_for_restore_cb (GObject      *source,
   return;
 
 error:
+  gis_install_page_append_record (NULL, error);
   gis_store_set_error (error);
   gis_install_page_teardown (page);
 }
@@ -401,19 +930,54 @@ gis_install_page_constructed (GObject *object)
   GisInstallPage *page = GIS_INSTALL_PAGE (object);
   GisInstallPagePrivate *priv = gis_install_page_get_instance_private (page);
 
+  GClosure *closure;
+
   G_OBJECT_CLASS (gis_install_page_parent_class)->constructed (object);
 
   gtk_progress_bar_set_fraction (priv->install_progress, 0.0);
 
+  g_signal_connect (priv->perf_chart, "draw",
+                    G_CALLBACK (gis_install_page_perf_draw_cb), page);
+
+  /* Use Ctrl+P to show how fast each stage of the write is going */
+  priv->accel_group = gtk_accel_group_new ();
+  closure = g_cclosure_new_swap (G_CALLBACK (gis_install_page_toggle_perf_overlay_cb),
+                                 page, NULL);
+  gtk_accel_group_connect (priv->accel_group, GDK_KEY_p, GDK_CONTROL_MASK, 0,
+                           closure);
+
   gtk_widget_show (GTK_WIDGET (page));
 }
 
+static void
+gis_install_page_dispose (GObject *object)
+{
+  GisInstallPage *page = GIS_INSTALL_PAGE (object);
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (page);
+
+  gis_install_page_stop_perf_sampling (page);
+  g_clear_pointer (&priv->perf_metrics, g_variant_unref);
+  g_clear_object (&priv->scribe);
+  g_clear_object (&priv->accel_group);
+
+  G_OBJECT_CLASS (gis_install_page_parent_class)->dispose (object);
+}
+
 static void
 gis_install_page_locale_changed (GisPage *page)
 {
   gis_page_set_title (page, _("Reformatting"));
 }
 
+static GtkAccelGroup *
+gis_install_page_get_accel_group (GisPage *page)
+{
+  GisInstallPage *self = GIS_INSTALL_PAGE (page);
+  GisInstallPagePrivate *priv = gis_install_page_get_instance_private (self);
+
+  return priv->accel_group;
+}
+
 static void
 gis_install_page_class_init (GisInstallPageClass *klass)
 {
@@ -424,6 +988,9 @@ gis_install_page_class_init (GisInstallPageClass *klass)
 
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisInstallPage, install_label);
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisInstallPage, install_progress);
+  gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisInstallPage, perf_overlay);
+  gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisInstallPage, perf_chart);
+  gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (klass), GisInstallPage, perf_label);
 
   page_class->page_id = PAGE_ID;
   page_class->hide_forward_button = TRUE;
@@ -431,7 +998,9 @@ gis_install_page_class_init (GisInstallPageClass *klass)
   page_class->hide_window_controls = TRUE;
   page_class->locale_changed = gis_install_page_locale_changed;
   page_class->shown = gis_install_page_shown;
+  page_class->get_accel_group = gis_install_page_get_accel_group;
   object_class->constructed = gis_install_page_constructed;
+  object_class->dispose = gis_install_page_dispose;
 }
 
 static void
@@ -442,6 +1011,24 @@ gis_install_page_init (GisInstallPage *self)
   gtk_widget_init_template (GTK_WIDGET (self));
 }
 
+/**
+ * gis_install_page_prewarm:
+ * @cancellable: used to abandon the pre-warmed write
+ *
+ * Starts reading, verifying and decompressing the selected image before the
+ * install page is shown, so that once it is the target can be written at full
+ * speed straight away. Nothing is written until then. If @cancellable is
+ * triggered first, the image data read so far is thrown away.
+ */
+void
+gis_install_page_prewarm (GCancellable *cancellable)
+{
+  g_autoptr(GisScribe) scribe = gis_install_page_new_scribe (NULL, -1);
+
+  gis_scribe_prewarm (scribe, cancellable);
+  gis_store_set_object (GIS_STORE_PREWARMED_SCRIBE, G_OBJECT (scribe));
+}
+
 void
 gis_prepare_install_page (GisDriver *driver)
 {
@@ -51,6 +51,8 @@ GType gis_install_page_get_type (void);
 
 void gis_prepare_install_page (GisDriver *driver);
 
+void gis_install_page_prewarm (GCancellable *cancellable);
+
 G_END_DECLS
 
 #endif /* __GIS_INSTALL_PAGE_H__ */
@@ -0,0 +1,49 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_PROBES_H
+#define GIS_PROBES_H
+
+/* Static (USDT) probes in the scribe's hot paths, for attaching bpftrace or
+ * SystemTap to a running installer:
+ *
+ *   bpftrace -e 'usdt:/usr/libexec/gnome-image-installer:eos_installer:write__chunk__done
+ *                { @bytes = hist(arg2); }'
+ *
+ * Each probe is a single no-op instruction until something attaches to it.
+ * They can be compiled out altogether with -Dsdt=disabled.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define GIS_PROBE1(name, a) \
+  DTRACE_PROBE1 (eos_installer, name, a)
+#define GIS_PROBE2(name, a, b) \
+  DTRACE_PROBE2 (eos_installer, name, a, b)
+#define GIS_PROBE3(name, a, b, c) \
+  DTRACE_PROBE3 (eos_installer, name, a, b, c)
+#else
+#define GIS_PROBE1(name, a) do { } while (0)
+#define GIS_PROBE2(name, a, b) do { } while (0)
+#define GIS_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif /* GIS_PROBES_H */
@@ -25,17 +25,35 @@
 #include <glib-unix.h>
 #include <glib/gi18n.h>
 
+/* for F_GETPIPE_SZ, fallocate() */
+#include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 /* for BLKGETSIZE64, BLKDISCARD */
 #include <linux/fs.h>
+/* for FALLOC_FL_PUNCH_HOLE */
+#include <linux/falloc.h>
 /* for sysconf() */
 #include <unistd.h>
 
 #include "glnx-errors.h"
+#include "gduxzdecompressor.h"
 #include "gis-errors.h"
+#include "gis-image-cache.h"
+#include "gis-image-extents.h"
+#include "gis-image-reader.h"
+#include "gis-image-verifier.h"
+#include "gis-probes.h"
+#include "gis-split-image.h"
+#include "gis-squashfs-reader.h"
+#include "gis-throughput.h"
+#include "gis-trace.h"
 
-#define IMAGE_KEYRING "/usr/share/keyrings/eos-image-keyring.gpg"
 #define BUFFER_SIZE (1 * 1024 * 1024)
+/* Granularity with which runs of zeros are skipped when writing to a regular
+ * file; the block size of most filesystems.
+ */
+#define SPARSE_BLOCK_SIZE 4096
 /* MBR + two copies of (GPT header plus at least 32 512-byte sectors of
  * partition entries)
  */
@@ -44,12 +62,36 @@
  * disk image to one byte.
  */
 #define MINIMUM_COMPRESSED_SIZE 1
+/* Maximum number of BUFFER_SIZE chunks of decompressed data which may be
+ * waiting to be written to any one target. This lets a target which
+ * momentarily stalls (say, while a USB stick flushes its cache) fall behind
+ * the others without holding them up; since the chunks are shared between
+ * targets, it also bounds the total memory used to hold them.
+ */
+#define FAN_OUT_QUEUE_LENGTH 64
+/* Maximum number of BUFFER_SIZE chunks of decompressed data which
+ * gis_scribe_prewarm() reads ahead before there are any targets to hand them
+ * to. Large enough that the writers have plenty to get on with while the rest
+ * of the pipeline catches up, but small enough to hold in memory on the
+ * smallest computers we install onto.
+ */
+#define PREWARM_QUEUE_LENGTH 256
+/* How long partprobe and eos-repartition-mbr are expected to take, in
+ * seconds, until they have been timed on a previous write.
+ */
+#define DEFAULT_PROBE_COST 1
+#define DEFAULT_CONVERT_TO_MBR_COST 5
 
 typedef enum {
   GIS_SCRIBE_TASK_TEE        = 1 << 0,
   GIS_SCRIBE_TASK_VERIFY     = 1 << 1,
   GIS_SCRIBE_TASK_DECOMPRESS = 1 << 2,
   GIS_SCRIBE_TASK_WRITE      = 1 << 3,
+  GIS_SCRIBE_TASK_FAN_OUT    = 1 << 4,
+  /* Not a real subtask: set while a pre-warmed pipeline is waiting for
+   * gis_scribe_write_async() to provide its targets.
+   */
+  GIS_SCRIBE_TASK_AWAIT_TARGETS = 1 << 5,
 } GisScribeTask;
 
 static const gchar *
@@ -65,11 +107,163 @@ gis_scribe_task_get_label (GisScribeTask flag)
       return "decompress";
     case GIS_SCRIBE_TASK_WRITE:
       return "write";
+    case GIS_SCRIBE_TASK_FAN_OUT:
+      return "fan-out";
+    case GIS_SCRIBE_TASK_AWAIT_TARGETS:
+      return "await-targets";
     default:
       return "invalid task flag";
     }
 }
 
+/* What a target's writer is doing. Once the image has been copied to the
+ * target, the writer waits for the kernel to flush it to the disk, has the
+ * partition table re-read, and (on non-EFI systems) converts it to MBR, which
+ * can take a significant fraction of the total time on slow disks.
+ */
+typedef enum {
+  GIS_SCRIBE_PHASE_WRITE,
+  GIS_SCRIBE_PHASE_SYNC,
+  GIS_SCRIBE_PHASE_PROBE,
+  GIS_SCRIBE_PHASE_CONVERT_TO_MBR,
+  GIS_SCRIBE_PHASE_DONE,
+  GIS_SCRIBE_N_PHASES
+} GisScribePhase;
+
+/* Stages of the pipeline, for gis_scribe_dup_metrics(). The tee is the source
+ * of the pipeline, so its busy time is the time spent reading the image; gpg
+ * and the decompressor run in subprocesses, so theirs is the CPU time they
+ * have used. Split and squashfs images are instead decompressed as the tee
+ * reads them, so the time it spends reading is the decompressor's. The last
+ * three stages run once per target.
+ */
+typedef enum {
+  GIS_SCRIBE_STAGE_TEE,
+  GIS_SCRIBE_STAGE_VERIFY,
+  GIS_SCRIBE_STAGE_DECOMPRESS,
+  GIS_SCRIBE_STAGE_WRITE,
+  GIS_SCRIBE_STAGE_DISCARD,
+  GIS_SCRIBE_STAGE_SYNC,
+  GIS_SCRIBE_N_STAGES
+} GisScribeStage;
+
+static const struct {
+  const gchar *label;
+  /* What an install is bound by if this stage is the bottleneck */
+  const gchar *bound;
+} stage_info[GIS_SCRIBE_N_STAGES] = {
+  { "tee", "source" },
+  { "verify", "cpu" },
+  { "decompress", "cpu" },
+  { "write", "target" },
+  { "discard", "target" },
+  { "sync", "target" },
+};
+
+typedef struct {
+  guint64 bytes_in;
+  guint64 bytes_out;
+  gint64 busy_usec;
+  /* Time spent waiting for the previous stage to provide data, and for the
+   * next stage to make room for it.
+   */
+  gint64 upstream_usec;
+  gint64 downstream_usec;
+  /* Bytes waiting for this stage to consume them, sampled as it goes */
+  guint64 queue_total;
+  guint64 queue_samples;
+  guint64 queue_peak;
+  /* The latest sample, and how much could have been waiting at the time */
+  guint64 queue_last;
+  guint64 queue_capacity;
+} GisScribeStageMetrics;
+
+/* One of the drives that the image is being written to. The first target is
+ * given by the :drive-path and :drive-fd properties; more may be added with
+ * gis_scribe_add_target().
+ */
+typedef struct {
+  gchar *drive_path;
+  gint drive_fd;
+
+  /* Only touched by this target's writer thread, which sets them before it
+   * writes anything. TRUE if the target is a regular file (such as a virtual
+   * machine's disk image) rather than a disk; and if so, whether its old
+   * contents have been deallocated, so that runs of zeros in the image can be
+   * skipped over, leaving holes, rather than written.
+   */
+  gboolean is_file;
+  gboolean sparse;
+
+  /* The fields below are guarded by GisScribe.mutex. */
+
+  /* GBytes chunks of decompressed image data, in order, which the fan-out
+   * subtask has read but this target's writer has not yet written.
+   */
+  GQueue chunks;
+
+  /* TRUE once this target's writer has stopped consuming chunks, whether
+   * because it reached the end of the image or because it failed.
+   */
+  gboolean finished_copying;
+  guint64 bytes_written;
+  GisScribePhase phase;
+  /* When this target's writer returned, or 0 if it has not yet */
+  gint64 finished_usec;
+
+  /* Guarded by GisScribe.metrics_mutex. Only the stages which run once per
+   * target are used.
+   */
+  GisScribeStageMetrics metrics[GIS_SCRIBE_N_STAGES];
+
+  /* The error this target's writer failed with, or NULL. Unlike
+   * GisScribe.error, this does not cause any other target to be aborted.
+   */
+  GError *error;
+} GisScribeTarget;
+
+static void
+gis_scribe_drop_chunks (GQueue *chunks)
+{
+  GBytes *chunk;
+
+  while ((chunk = g_queue_pop_head (chunks)) != NULL)
+    g_bytes_unref (chunk);
+}
+
+static void
+gis_scribe_target_drop_chunks (GisScribeTarget *target)
+{
+  gis_scribe_drop_chunks (&target->chunks);
+}
+
+static GisScribeTarget *
+gis_scribe_target_new (const gchar *drive_path,
+                       gint         drive_fd)
+{
+  GisScribeTarget *target = g_slice_new0 (GisScribeTarget);
+
+  target->drive_path = g_strdup (drive_path);
+  target->drive_fd = drive_fd;
+  g_queue_init (&target->chunks);
+
+  return target;
+}
+
+static void
+gis_scribe_target_free (GisScribeTarget *target)
+{
+  gis_scribe_target_drop_chunks (target);
+  g_clear_pointer (&target->drive_path, g_free);
+  g_clear_error (&target->error);
+
+  if (target->drive_fd != -1)
+    close (target->drive_fd);
+  target->drive_fd = -1;
+
+  g_slice_free (GisScribeTarget, target);
+}
+
 typedef struct _GisScribe {
   GObject parent;
 
@@ -81,7 +275,7 @@ typedef struct _GisScribe {
   guint64 image_size_bytes;
   /* Compressed size of 'image'. We need to provide this to GPG so it can
    * indicate its progress, since it reads the image data from a pipe. Equal to
-   * 'image_size_bytes' if 'image' is uncompressed.
+   * 'image_size_bytes' if 'image' is uncompressed, a squashfs or split.
    */
   guint64 compressed_size_bytes;
   GFile *signature;
@@ -90,13 +284,104 @@ typedef struct _GisScribe {
   gchar *drive_path;
   gboolean convert_to_mbr;
   gchar *gpg_path;
+  GisImageCache *image_cache;
+  GisImageVerifier *image_verifier;
+
+  /* Readable fd for the block device holding the filesystem which :image is
+   * on, or -1.
+   */
+  gint image_device_fd;
+
+  /* Array of (owned) GisScribeTarget *. If :drive-path and :drive-fd were
+   * set, the first element corresponds to them until the first write is
+   * complete and further targets are added.
+   */
+  GPtrArray *targets;
+
+  /* TRUE if self->targets have been (or are being) written, in which case
+   * they are kept until the next call to gis_scribe_add_target() so that
+   * their results can be inspected.
+   */
+  gboolean targets_written;
 
-  gboolean started;
+  /* TRUE between gis_scribe_write_async() (or gis_scribe_prewarm()) and the
+   * completion of its task.
+   */
+  gboolean running;
+
+  /* Set by gis_scribe_prewarm(): the outer task for the pre-warmed pipeline,
+   * and the caller's cancellable (with the ID of our handler for it) until
+   * the pipeline is either handed over to gis_scribe_write_async() or
+   * abandoned. Once handed over, write_task is the task that
+   * gis_scribe_write_async() will complete when prewarm_task completes.
+   */
+  GTask *prewarm_task;
+  GCancellable *prewarm_cancellable;
+  gulong prewarm_cancelled_id;
+  GTask *write_task;
   guint step;
   gdouble verify_progress;
 
-  /* MIN(verify_progress, bytes_written / image_size_bytes) */
+  /* Progress through all phases of the write, where each phase is weighted by
+   * how long it is expected to take; see gis_scribe_update_progress().
+   */
   gdouble overall_progress;
+  /* Expected number of seconds until the write completes, or -1 */
+  gint64 eta;
+
+  /* Start of each block of :image, if it is an xz file with an index, to map
+   * verify_progress (through the compressed image) to progress through the
+   * uncompressed image.
+   */
+  GArray *xz_block_map;
+
+  /* Only touched by gis_scribe_update_progress(). Smoothed rate at which the
+   * slowest target is being written, in bytes per second, or 0 until it
+   * has been measured; and how much had been written (and verified) at the
+   * previous update.
+   */
+  gdouble write_rate;
+  guint64 last_bytes_done;
+  gint64 last_update_usec;
+  /* Phase of the slowest target, when it started, and how long it took
+   * until the write phase ended
+   */
+  GisScribePhase phase;
+  gint64 phase_start_usec;
+  gdouble write_phase_cost;
+  /* How long each phase after GIS_SCRIBE_PHASE_WRITE is expected to take, in
+   * seconds: the sync phase from how much data is waiting to be flushed, the
+   * others from how long they took last time.
+   */
+  gdouble phase_cost[GIS_SCRIBE_N_PHASES];
+
+  /* Guards .metrics and each target's metrics, which the worker threads
+   * update as they go. This is separate from .mutex so that recording
+   * metrics never holds up the pipeline's own synchronisation.
+   */
+  GMutex metrics_mutex;
+  GisScribeStageMetrics metrics[GIS_SCRIBE_N_STAGES];
+  /* When the last write finished, or 0 while it is still running */
+  gint64 end_time_usec;
+  /* The gpg and decompressor subprocesses, if running, whose CPU time is
+   * sampled by gis_scribe_update_progress(); or 0.
+   */
+  GPid verify_pid;
+  GPid decompress_pid;
+  /* TRUE if the fan-out subtask is reading from self->image_cache, in which
+   * case it is the source of the pipeline rather than the tee.
+   */
+  gboolean reading_cached_image;
+
+  /* A trace of the current (or last) write if GIS_TRACE_ENV is set, else
+   * NULL. Created before the worker threads start, so they need no lock to
+   * use it. Also for the trace: when the subprocesses above were started,
+   * and the name of the decompressor.
+   */
+  GisTrace *trace;
+  gint64 verify_start_usec;
+  gint64 decompress_start_usec;
+  const gchar *decompress_name;
 
   GMutex mutex;
   GCond cond;
@@ -110,6 +395,11 @@ typedef struct _GisScribe {
   /* Bitwise-or of GisScribeTask for tasks that have not yet completed. */
   gint outstanding_tasks;
 
+  /* Number of writer subtasks (one per target) which have not yet completed;
+   * GIS_SCRIBE_TASK_WRITE is set in outstanding_tasks while this is non-zero.
+   */
+  guint outstanding_writes;
+
   /* The first error reported by a subtask, or NULL if all (so far) have
    * completed successfully. In particular, this is non-NULL if
    * (outstanding_tasks & GIS_SCRIBE_TASK_VERIFY) == 0 (ie the verify step has
@@ -118,9 +408,39 @@ typedef struct _GisScribe {
    */
   GError *error;
 
+  /* TRUE once the fan-out subtask has stopped adding chunks to the targets'
+   * queues, whether because it reached the end of the decompressed image or
+   * because something failed.
+   */
+  gboolean fan_out_done;
+
+  /* TRUE while a pipeline started by gis_scribe_prewarm() is waiting for its
+   * targets, during which the fan-out subtask queues up to
+   * PREWARM_QUEUE_LENGTH chunks in prewarmed_chunks rather than handing them
+   * to the targets.
+   */
+  gboolean prewarming;
+  GQueue prewarmed_chunks;
+
+  /* Number of targets which are still copying image data, and of those which
+   * were copied successfully.
+   */
+  guint copying_targets;
+  guint copied_targets;
+
+  /* Number of writer threads which have not yet returned. */
+  guint running_writers;
+
+  /* If the image was not found in self->image_cache, the entry which the
+   * fan-out subtask copies the decompressed image into. Only touched by the
+   * fan-out subtask while it is running, which commits it once the image has
+   * been verified.
+   */
+  GisImageCacheEntry *cache_entry;
+
   gint drive_fd;
-  guint64 bytes_written;
-  guint set_indeterminate_progress_id;
+  guint update_progress_id;
+  guint enter_finishing_step_id;
   gint64 start_time_usec;
 } GisScribe;
 
@@ -130,8 +450,12 @@ typedef struct _GisScribe {
 typedef struct {
   GInputStream *image_input;
 
+  /* NULL if the image has already been verified. */
   GOutputStream *verify_pipe;
   GOutputStream *write_pipe;
+
+  /* TRUE if image_input decompresses the image as it is read */
+  gboolean input_decompresses;
 } GisScribeTeeData;
 
 typedef struct {
@@ -188,7 +512,11 @@ typedef enum {
   PROP_CONVERT_TO_MBR,
   PROP_STEP,
   PROP_PROGRESS,
+  PROP_ETA,
   PROP_GPG_PATH,
+  PROP_IMAGE_CACHE,
+  PROP_IMAGE_VERIFIER,
+  PROP_IMAGE_DEVICE_FD,
   N_PROPERTIES
 } GisScribePropertyId;
 
@@ -257,8 +585,28 @@ gis_scribe_set_property (GObject      *object,
       self->gpg_path = g_value_dup_string (value);
       break;
 
+    case PROP_IMAGE_CACHE:
+      g_return_if_fail (!self->running);
+      g_clear_object (&self->image_cache);
+      self->image_cache = g_value_dup_object (value);
+      break;
+
+    case PROP_IMAGE_VERIFIER:
+      g_return_if_fail (!self->running);
+      g_clear_object (&self->image_verifier);
+      self->image_verifier = g_value_dup_object (value);
+      break;
+
+    case PROP_IMAGE_DEVICE_FD:
+      g_return_if_fail (!self->running);
+      if (self->image_device_fd != -1)
+        close (self->image_device_fd);
+      self->image_device_fd = g_value_get_int (value);
+      break;
+
     case PROP_STEP:
     case PROP_PROGRESS:
+    case PROP_ETA:
     case N_PROPERTIES:
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -309,7 +657,15 @@ gis_scribe_get_property (GObject      *object,
       break;
 
     case PROP_DRIVE_FD:
-      g_value_set_int (value, self->drive_fd);
+      if (self->targets->len > 0)
+        {
+          GisScribeTarget *target = g_ptr_array_index (self->targets, 0);
+          g_value_set_int (value, target->drive_fd);
+        }
+      else
+        {
+          g_value_set_int (value, self->drive_fd);
+        }
       break;
 
     case PROP_CONVERT_TO_MBR:
@@ -324,10 +680,26 @@ gis_scribe_get_property (GObject      *object,
       g_value_set_double (value, self->overall_progress);
       break;
 
+    case PROP_ETA:
+      g_value_set_int64 (value, self->eta);
+      break;
+
     case PROP_GPG_PATH:
       g_value_set_string (value, self->gpg_path);
       break;
 
+    case PROP_IMAGE_CACHE:
+      g_value_set_object (value, self->image_cache);
+      break;
+
+    case PROP_IMAGE_VERIFIER:
+      g_value_set_object (value, self->image_verifier);
+      break;
+
+    case PROP_IMAGE_DEVICE_FD:
+      g_value_set_int (value, self->image_device_fd);
+      break;
+
     case N_PROPERTIES:
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -346,10 +718,17 @@ gis_scribe_constructed (GObject *object)
   g_return_if_fail (self->signature != NULL);
   g_return_if_fail (self->checksum != NULL);
   g_return_if_fail (self->keyring_path != NULL);
-  g_return_if_fail (self->drive_path != NULL);
-  g_return_if_fail (self->drive_fd >= 0);
+  g_return_if_fail ((self->drive_path == NULL) == (self->drive_fd < 0));
   g_return_if_fail (self->gpg_path != NULL);
   g_return_if_fail (g_path_is_absolute (self->gpg_path));
+
+  if (self->drive_path != NULL)
+    {
+      /* The target now owns drive_fd. */
+      g_ptr_array_add (self->targets,
+                       gis_scribe_target_new (self->drive_path, self->drive_fd));
+      self->drive_fd = -1;
+    }
 }
 
 static void
@@ -361,6 +740,8 @@ gis_scribe_dispose (GObject *object)
   g_clear_object (&self->image_input);
   g_clear_object (&self->signature);
   g_clear_object (&self->checksum);
+  g_clear_object (&self->image_cache);
+  g_clear_object (&self->image_verifier);
 
   G_OBJECT_CLASS (gis_scribe_parent_class)->dispose (object);
 }
@@ -375,14 +756,24 @@ gis_scribe_finalize (GObject *object)
   g_clear_pointer (&self->keyring_path, g_free);
   g_clear_pointer (&self->drive_path, g_free);
   g_clear_pointer (&self->gpg_path, g_free);
+  g_clear_pointer (&self->targets, g_ptr_array_unref);
+  g_clear_pointer (&self->cache_entry, gis_image_cache_entry_free);
+  g_clear_pointer (&self->xz_block_map, g_array_unref);
+  g_clear_pointer (&self->trace, gis_trace_free);
+  gis_scribe_drop_chunks (&self->prewarmed_chunks);
   g_clear_error (&self->error);
   g_mutex_clear (&self->mutex);
+  g_mutex_clear (&self->metrics_mutex);
   g_cond_clear (&self->cond);
 
   if (self->drive_fd != -1)
     close (self->drive_fd);
   self->drive_fd = -1;
 
+  if (self->image_device_fd != -1)
+    close (self->image_device_fd);
+  self->image_device_fd = -1;
+
   G_OBJECT_CLASS (gis_scribe_parent_class)->finalize (object);
 }
 
@@ -419,7 +810,7 @@ gis_scribe_class_init (GisScribeClass *klass)
       "image-input",
       "Image input stream",
       "Input stream to read :image from, or %NULL to allow this class to open "
-      "it itself. (Used by test suite.)",
+      "it itself. Only used for the first write. (Used by test suite.)",
       G_TYPE_INPUT_STREAM,
       G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
 
@@ -433,7 +824,9 @@ gis_scribe_class_init (GisScribeClass *klass)
   props[PROP_COMPRESSED_SIZE] = g_param_spec_uint64 (
       "compressed-size",
       "Compressed Size",
-      "Compressed size of :image, in bytes.",
+      "Compressed size of :image, in bytes. If :image is a squashfs, the "
+      "image within it is read, and :signature or :checksum are for that "
+      "image, so this is equal to :image-size; likewise for split images.",
       MINIMUM_COMPRESSED_SIZE, G_MAXUINT64, MINIMUM_COMPRESSED_SIZE,
       G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
 
@@ -465,11 +858,14 @@ gis_scribe_class_init (GisScribeClass *klass)
    *
    * Why not accept a UDisksBlock and perform this step internally? It's
    * convenient for testing to be able to operate on a regular file, too.
+   *
+   * Both may be left unset, in which case targets must be added with
+   * gis_scribe_add_target() before each write.
    */
   props[PROP_DRIVE_PATH] = g_param_spec_string (
       "drive-path",
       "Drive path",
-      "Path to target drive.",
+      "Path to first target drive, or %NULL.",
       NULL,
       G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
 
@@ -495,6 +891,53 @@ gis_scribe_class_init (GisScribeClass *klass)
       GPG_PATH,
       G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
 
+  /**
+   * GisScribe:image-cache:
+   *
+   * Cache of decompressed images. If :image has already been written (and
+   * verified) once with this cache, later writes read the decompressed image
+   * from the cache rather than reading, verifying and decompressing it again.
+   * Otherwise, the decompressed image is added to the cache once it has been
+   * verified. May be changed between writes.
+   */
+  props[PROP_IMAGE_CACHE] = g_param_spec_object (
+      "image-cache",
+      "Image cache",
+      "Cache of decompressed images, or %NULL.",
+      GIS_TYPE_IMAGE_CACHE,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GisScribe:image-verifier:
+   *
+   * Verifier which may already have checked :image in the background. If it
+   * has, and :image has not changed since, :image is not verified again while
+   * it is written. May be changed between writes.
+   */
+  props[PROP_IMAGE_VERIFIER] = g_param_spec_object (
+      "image-verifier",
+      "Image verifier",
+      "Background image verifier, or %NULL.",
+      GIS_TYPE_IMAGE_VERIFIER,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GisScribe:image-device-fd:
+   *
+   * Readable file descriptor for the block device holding the filesystem
+   * which :image is on, which is guaranteed to be close()d by this class. If
+   * set, and :image's extents on the device can be found, :image is read
+   * directly from the device rather than through its filesystem. This is
+   * much faster for images on exFAT or NTFS, which are otherwise read
+   * through FUSE. May be changed between writes.
+   */
+  props[PROP_IMAGE_DEVICE_FD] = g_param_spec_int (
+      "image-device-fd",
+      "Image device FD",
+      "Readable file descriptor for the block device holding :image, or -1.",
+      -1, G_MAXINT, -1,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
   /**
    * GisScribe:step:
    *
@@ -510,19 +953,35 @@ gis_scribe_class_init (GisScribeClass *klass)
   /**
    * GisScribe:progress:
    *
-   * Progress in the current GisScribe:step, between 0 and 1 inclusive, or -1
-   * if exact progress can't be determined. Within a given step, this property
-   * is either a constant -1, or increases linearly with progress. It's not
-   * guaranteed to reach 1 before the step completes.
+   * Progress through the whole write, between 0 and 1 inclusive, or -1 if
+   * exact progress can't be determined. Copying the image, flushing it to
+   * disk, re-reading the partition table and converting it to MBR are each
+   * weighted by how long they are expected to take, so this carries on
+   * increasing through GisScribe:step 2. It never decreases during a write,
+   * but is not guaranteed to reach 1 before the write completes.
    */
   props[PROP_PROGRESS] = g_param_spec_double (
       "progress",
       "Progress",
-      "Progress in the current step, between 0 and 1 inclusive, "
+      "Progress through the whole write, between 0 and 1 inclusive, "
       "or -1 if exact progress can't be determined.",
       -1, 1, 0,
       G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
 
+  /**
+   * GisScribe:eta:
+   *
+   * Expected number of seconds until the write completes, based on how fast
+   * it has gone so far, or -1 if not known.
+   */
+  props[PROP_ETA] = g_param_spec_int64 (
+      "eta",
+      "ETA",
+      "Expected number of seconds until the write completes, or -1 if not "
+      "known.",
+      -1, G_MAXINT64, -1,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
   g_object_class_install_properties (object_class, N_PROPERTIES, props);
 }
 
@@ -530,12 +989,29 @@ static void
 gis_scribe_init (GisScribe *self)
 {
   g_mutex_init (&self->mutex);
+  g_mutex_init (&self->metrics_mutex);
   g_cond_init (&self->cond);
 
+  self->targets =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) gis_scribe_target_free);
+  g_queue_init (&self->prewarmed_chunks);
   self->drive_fd = -1;
+  self->image_device_fd = -1;
   self->step = 1;
+  self->eta = -1;
+  self->phase_cost[GIS_SCRIBE_PHASE_PROBE] = DEFAULT_PROBE_COST;
+  self->phase_cost[GIS_SCRIBE_PHASE_CONVERT_TO_MBR] = DEFAULT_CONVERT_TO_MBR_COST;
 }
 
+/**
+ * gis_scribe_new:
+ * @drive_path: (nullable): path to the first target drive, or %NULL to add
+ *  all targets with gis_scribe_add_target()
+ * @drive_fd: writable file descriptor for @drive_path, or -1 if @drive_path
+ *  is %NULL
+ *
+ * Returns: (transfer full): a new #GisScribe.
+ */
 GisScribe *
 gis_scribe_new (GFile       *image,
                 guint64      image_size_bytes,
@@ -550,8 +1026,7 @@ gis_scribe_new (GFile       *image,
   g_return_val_if_fail (image_size_bytes > MINIMUM_IMAGE_SIZE, NULL);
   g_return_val_if_fail (compressed_size_bytes > MINIMUM_COMPRESSED_SIZE, NULL);
   g_return_val_if_fail (G_IS_FILE (signature), NULL);
-  g_return_val_if_fail (drive_path != NULL, NULL);
-  g_return_val_if_fail (drive_fd >= 0, NULL);
+  g_return_val_if_fail ((drive_path == NULL) == (drive_fd < 0), NULL);
 
   return g_object_new (
       GIS_TYPE_SCRIBE,
@@ -574,6 +1049,8 @@ task_return_error (GisScribe *self,
   g_mutex_lock (&self->mutex);
   if (self->error == NULL)
     self->error = g_error_copy (error);
+  /* Wake any writer or the fan-out subtask, so they can give up early. */
+  g_cond_broadcast (&self->cond);
   g_mutex_unlock (&self->mutex);
 
   g_task_return_error (task, g_steal_pointer (&error));
@@ -620,1025 +1097,2912 @@ gis_scribe_close_output_stream_or_warn (GOutputStream *stream,
     g_warning ("error closing %s: %s", label, error->message);
 }
 
-/* Called once per second while the main write operation is in progress.
- */
-static gboolean
-gis_scribe_update_progress (gpointer data)
+/* Adds to the metrics for @stage, which are @target's if it is not %NULL. */
+static void
+gis_scribe_record_stage (GisScribe       *self,
+                         GisScribeTarget *target,
+                         GisScribeStage   stage,
+                         guint64          bytes_in,
+                         guint64          bytes_out,
+                         gint64           busy_usec,
+                         gint64           upstream_usec,
+                         gint64           downstream_usec)
 {
-  GisScribe *self = GIS_SCRIBE (data);
-  guint64 bytes_written;
-  gdouble write_progress;
-  gdouble progress;
-
-  g_mutex_lock (&self->mutex);
-  bytes_written = self->bytes_written;
-  g_mutex_unlock (&self->mutex);
+  GisScribeStageMetrics *metrics;
+
+  g_mutex_lock (&self->metrics_mutex);
+  metrics = target != NULL ? &target->metrics[stage] : &self->metrics[stage];
+  metrics->bytes_in += bytes_in;
+  metrics->bytes_out += bytes_out;
+  metrics->busy_usec += busy_usec;
+  metrics->upstream_usec += upstream_usec;
+  metrics->downstream_usec += downstream_usec;
+  g_mutex_unlock (&self->metrics_mutex);
+}
 
-  write_progress = ((gdouble) bytes_written) / ((gdouble) self->image_size_bytes);
-  /* You'd expect these to be identical ± 1 MiB in the uncompressed case, and
-   * pretty close in the compressed case assuming the compression ratio is
-   * roughly constant throughout the file.
-   */
-  progress = MIN (self->verify_progress, write_progress);
+/* Records in the trace, if any, that the calling thread spent from
+ * @start_usec until now on @name. Returns the current time, so that
+ * consecutive spans can be chained together.
+ */
+static gint64
+gis_scribe_trace (GisScribe   *self,
+                  const gchar *name,
+                  gint64       start_usec,
+                  guint64      bytes)
+{
+  gint64 now_usec = g_get_monotonic_time ();
 
-  g_debug ("%s: verify progress %3.0f%%, write progress %3.0f%%",
-           G_STRFUNC, self->verify_progress * 100, write_progress * 100);
+  if (self->trace != NULL)
+    gis_trace_add_span (self->trace, name, start_usec, now_usec, bytes);
 
-  if (progress != self->overall_progress)
-    {
-      self->overall_progress = progress;
-      g_object_notify_by_pspec (G_OBJECT (self), props[PROP_PROGRESS]);
-    }
+  return now_usec;
+}
 
-  return G_SOURCE_CONTINUE;
+static void
+gis_scribe_trace_thread (GisScribe   *self,
+                         const gchar *name)
+{
+  if (self->trace != NULL)
+    gis_trace_name_thread (self->trace, name);
 }
 
-/* Run BLKDISCARD on the whole device. This tells flash-based disks that all
- * data is now unused, which frees up wear levelling algorithms and boosts
- * performance for next time each eraseblock is written.
- */
-static gboolean
-gis_scribe_blkdiscard (gint     fd,
-                       GError **error)
+/* Notes that @occupancy bytes are waiting for @stage to consume them. */
+static void
+gis_scribe_record_queue (GisScribe       *self,
+                         GisScribeTarget *target,
+                         GisScribeStage   stage,
+                         guint64          occupancy,
+                         guint64          capacity)
 {
-  guint64 range[2];
+  GisScribeStageMetrics *metrics;
+
+  g_mutex_lock (&self->metrics_mutex);
+  metrics = target != NULL ? &target->metrics[stage] : &self->metrics[stage];
+  metrics->queue_total += occupancy;
+  metrics->queue_samples++;
+  metrics->queue_peak = MAX (metrics->queue_peak, occupancy);
+  metrics->queue_last = occupancy;
+  metrics->queue_capacity = capacity;
+  g_mutex_unlock (&self->metrics_mutex);
+}
 
-  range[0] = 0;
+/* Notes how much data is waiting in @pipe for @stage to read it. */
+static void
+gis_scribe_record_pipe_queue (GisScribe      *self,
+                              GisScribeStage  stage,
+                              gpointer        pipe)
+{
+  int fd;
+  int n;
+  int size;
 
-  if (ioctl (fd, BLKGETSIZE64, &range[1]))
-    return glnx_throw_errno_prefix (error, "can't get size for blkdiscard");
+  if (!G_IS_FILE_DESCRIPTOR_BASED (pipe))
+    return;
 
-  if (ioctl (fd, BLKDISCARD, &range))
-    return glnx_throw_errno_prefix (error, "blkdiscard failed");
+  fd = g_file_descriptor_based_get_fd (pipe);
+  if (ioctl (fd, FIONREAD, &n) < 0)
+    return;
 
-  return TRUE;
+  size = fcntl (fd, F_GETPIPE_SZ);
+  gis_scribe_record_queue (self, NULL, stage, n, MAX (size, n));
 }
 
-static gboolean
-gis_scribe_write_thread_await_verify (GisScribe *self,
-                                      GError   **error)
+static GPid
+gis_scribe_get_subprocess_pid (GSubprocess *subprocess)
 {
-  g_autoptr(GError) local_error = NULL;
+  const gchar *identifier = g_subprocess_get_identifier (subprocess);
 
-  g_mutex_lock (&self->mutex);
-  /* Wait until all other tasks have ended */
-  while ((self->outstanding_tasks & ~GIS_SCRIBE_TASK_WRITE) != 0)
-    g_cond_wait (&self->cond, &self->mutex);
+  if (identifier == NULL)
+    return 0;
 
-  /* This task itself should still be outstanding */
-  g_assert_cmpint (self->outstanding_tasks, ==, GIS_SCRIBE_TASK_WRITE);
+  return (GPid) g_ascii_strtoll (identifier, NULL, 10);
+}
 
-  if (self->error != NULL)
-    local_error = g_error_copy (self->error);
-  g_mutex_unlock (&self->mutex);
+/* Returns the CPU time used so far by @pid, or -1 if it can't be found. */
+static gint64
+gis_scribe_get_cpu_usec (GPid pid)
+{
+  g_autofree gchar *path = NULL;
+  g_autofree gchar *stat = NULL;
+  g_auto(GStrv) fields = NULL;
+  const gchar *comm_end;
+  glong ticks_per_sec = sysconf (_SC_CLK_TCK);
+
+  if (pid <= 0 || ticks_per_sec <= 0)
+    return -1;
+
+  path = g_strdup_printf ("/proc/%d/stat", (int) pid);
+  if (!g_file_get_contents (path, &stat, NULL, NULL))
+    return -1;
+
+  /* The command name, in parentheses, may contain spaces. */
+  comm_end = strrchr (stat, ')');
+  if (comm_end == NULL || comm_end[1] == '\0')
+    return -1;
+
+  /* utime and stime are the 14th and 15th fields; the first here is the
+   * 3rd.
+   */
+  fields = g_strsplit (comm_end + 2, " ", -1);
+  if (g_strv_length (fields) < 13)
+    return -1;
 
-  if (local_error == NULL)
-    return TRUE;
+  return (g_ascii_strtoll (fields[11], NULL, 10) +
+          g_ascii_strtoll (fields[12], NULL, 10)) * G_USEC_PER_SEC / ticks_per_sec;
+}
 
-  /* This error will already have been reported by whichever task failed, but
-   * we have to throw *some* error from this task.
-   */
-  g_propagate_error (error, g_steal_pointer (&local_error));
-  return FALSE;
+/* CPU time is cumulative, so the last sample before each subprocess exits is
+ * (nearly) all of it.
+ */
+static void
+gis_scribe_sample_subprocesses (GisScribe *self)
+{
+  gint64 verify_usec = gis_scribe_get_cpu_usec (self->verify_pid);
+  gint64 decompress_usec = gis_scribe_get_cpu_usec (self->decompress_pid);
+
+  g_mutex_lock (&self->metrics_mutex);
+  if (verify_usec >= 0)
+    self->metrics[GIS_SCRIBE_STAGE_VERIFY].busy_usec = verify_usec;
+  if (decompress_usec >= 0)
+    self->metrics[GIS_SCRIBE_STAGE_DECOMPRESS].busy_usec = decompress_usec;
+  g_mutex_unlock (&self->metrics_mutex);
 }
 
-/* Allocates size bytes, page-aligned. */
-G_GNUC_MALLOC
-G_GNUC_ALLOC_SIZE(1)
-static void *
-gis_scribe_malloc_aligned (size_t size)
+/* Fills in @metrics for each stage. The stages which run once per target
+ * have their byte counts summed across the targets, which are written in
+ * parallel, and their times and queue peak taken from whichever target was
+ * slowest.
+ */
+static void
+gis_scribe_collect_metrics (GisScribe             *self,
+                            GisScribeStageMetrics *metrics)
 {
-  const size_t pagesize = sysconf (_SC_PAGESIZE);
-  void *buf = NULL;
+  guint i;
+  gint s;
 
-  if (posix_memalign (&buf, pagesize, size) != 0 || buf == NULL)
-    g_error ("%s: failed to allocate %" G_GSIZE_FORMAT " bytes "
-             "aligned to page size %" G_GSIZE_FORMAT ": %s",
-             G_STRFUNC, size, pagesize, g_strerror (errno));
+  g_mutex_lock (&self->metrics_mutex);
+  memcpy (metrics, self->metrics, sizeof (self->metrics));
 
-  return buf;
+  for (i = 0; i < self->targets->len; i++)
+    {
+      GisScribeTarget *target = g_ptr_array_index (self->targets, i);
+
+      for (s = 0; s < GIS_SCRIBE_N_STAGES; s++)
+        {
+          const GisScribeStageMetrics *from = &target->metrics[s];
+          GisScribeStageMetrics *into = &metrics[s];
+
+          into->bytes_in += from->bytes_in;
+          into->bytes_out += from->bytes_out;
+          into->busy_usec = MAX (into->busy_usec, from->busy_usec);
+          into->upstream_usec = MAX (into->upstream_usec, from->upstream_usec);
+          into->downstream_usec = MAX (into->downstream_usec,
+                                       from->downstream_usec);
+          into->queue_total += from->queue_total;
+          into->queue_samples += from->queue_samples;
+          into->queue_peak = MAX (into->queue_peak, from->queue_peak);
+          into->queue_last += from->queue_last;
+          into->queue_capacity += from->queue_capacity;
+        }
+    }
+  g_mutex_unlock (&self->metrics_mutex);
 }
 
-static gchar *
-format_bytes (guint64 bytes)
+/* The bottleneck is whichever stage spent longest doing its own work: the
+ * others will have spent (some of) that time waiting for it. Returns
+ * GIS_SCRIBE_N_STAGES if nothing has been measured.
+ */
+static GisScribeStage
+gis_scribe_find_bottleneck (const GisScribeStageMetrics *metrics)
 {
-  /* The ' flag is a Single UNIX Specification extension to group the
-   * number with thousands' grouping characters if the locale information
-   * indicates any. We don't use g_format_size_full(...,
-   * G_FORMAT_SIZE_LONG_FORMAT) because it also includes the rounded value
-   * (eg "101.2 GB (101,241,834,086 bytes)"); the rounded value is unlikely
-   * to be helpful when the discrepency is < 512 bytes, as is likely (see
-   * below).
-   *
-   * Some combination of this and G_GUINT64_FORMAT confuses xgettext if it is
-   * used in the translatable string where this value is used.
-   */
-  return g_strdup_printf ("%'" G_GUINT64_FORMAT, bytes);
+  GisScribeStage bottleneck = GIS_SCRIBE_N_STAGES;
+  gint64 busy_usec = 0;
+  gint s;
+
+  for (s = 0; s < GIS_SCRIBE_N_STAGES; s++)
+    {
+      if (metrics[s].busy_usec > busy_usec)
+        {
+          bottleneck = s;
+          busy_usec = metrics[s].busy_usec;
+        }
+    }
+
+  return bottleneck;
 }
 
-static gboolean
-gis_scribe_write_thread_copy (GisScribe     *self,
-                              GInputStream  *decompressed,
-                              gint           fd,
-                              GOutputStream *output,
-                              GCancellable  *cancellable,
-                              GError       **error)
+static void
+gis_scribe_log_metrics (GisScribe *self)
 {
-  g_autofree gchar *buffer = gis_scribe_malloc_aligned (BUFFER_SIZE);
-  g_autofree gchar *first_mib = gis_scribe_malloc_aligned (BUFFER_SIZE);
-  gsize first_mib_bytes_read = 0;
-  gsize r = 0;
-  gsize w = 0;
+  GisScribeStageMetrics metrics[GIS_SCRIBE_N_STAGES];
+  GisScribeStage bottleneck;
+  gint s;
 
-  /* Read the first 1 MiB; write zeros to the target drive. This ensures the
-   * system won't boot until the image is fully written.
-   */
-  memset (first_mib, 0, BUFFER_SIZE);
-  if (!g_output_stream_write_all (output, first_mib, BUFFER_SIZE,
-                                  &w, cancellable, error)
-      || !g_input_stream_read_all (decompressed, first_mib, BUFFER_SIZE,
-                                   &first_mib_bytes_read, cancellable, error))
-    return FALSE;
+  gis_scribe_collect_metrics (self, metrics);
 
-  do
+  for (s = 0; s < GIS_SCRIBE_N_STAGES; s++)
     {
-      if (!g_input_stream_read_all (decompressed, buffer, BUFFER_SIZE,
-                                    &r, cancellable, error))
-        return FALSE;
+      const GisScribeStageMetrics *m = &metrics[s];
+
+      if (m->bytes_in == 0 && m->bytes_out == 0 && m->busy_usec == 0)
+        continue;
+
+      g_message ("%s: %" G_GUINT64_FORMAT " bytes in, %" G_GUINT64_FORMAT
+                 " bytes out; busy %.1f s, waited %.1f s upstream and "
+                 "%.1f s downstream; queue mean %" G_GUINT64_FORMAT
+                 " bytes, peak %" G_GUINT64_FORMAT " bytes",
+                 stage_info[s].label, m->bytes_in, m->bytes_out,
+                 (gdouble) m->busy_usec / G_USEC_PER_SEC,
+                 (gdouble) m->upstream_usec / G_USEC_PER_SEC,
+                 (gdouble) m->downstream_usec / G_USEC_PER_SEC,
+                 m->queue_samples > 0 ? m->queue_total / m->queue_samples : 0,
+                 m->queue_peak);
+    }
 
-      if (!g_output_stream_write_all (output, buffer, r,
-                                      &w, cancellable, error))
-        return FALSE;
+  bottleneck = gis_scribe_find_bottleneck (metrics);
+  if (bottleneck < GIS_SCRIBE_N_STAGES)
+    g_message ("bottleneck: %s (bound by %s)",
+               stage_info[bottleneck].label, stage_info[bottleneck].bound);
+}
 
-      /* We lock to protect bytes_written */
-      g_mutex_lock (&self->mutex);
-      self->bytes_written += w;
-      g_mutex_unlock (&self->mutex);
-    }
-  while (r > 0);
-
-  if (!g_input_stream_close (decompressed, cancellable, error))
-    return FALSE;
-
-  /* Wait for verification to complete */
-  if (!gis_scribe_write_thread_await_verify (self, error))
-    return FALSE;
+/* Returns the number of bytes of written data which the kernel has yet to
+ * flush to disk, which is roughly what syncfs() has to wait for.
+ */
+static guint64
+gis_scribe_get_dirty_bytes (void)
+{
+  g_autofree gchar *meminfo = NULL;
+  g_auto(GStrv) lines = NULL;
+  guint64 dirty = 0;
+  gsize i;
 
-  /* Check that we've written the same amount of data as we expected from the
-   * GPT header. This would only fail if there's something seriously wrong with
-   * the image builder, the decompressor, or the read/write loop above.
-   */
-  g_mutex_lock (&self->mutex);
-  /* Don't forget the first <= 1 MiB we saved for later! */
-  guint64 bytes_written = self->bytes_written + first_mib_bytes_read;
-  g_mutex_unlock (&self->mutex);
+  if (!g_file_get_contents ("/proc/meminfo", &meminfo, NULL, NULL))
+    return 0;
 
-  if (bytes_written != self->image_size_bytes)
+  lines = g_strsplit (meminfo, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
     {
-      /* See comment on format_bytes() to understand why these are formatted
-       * separately.
-       */
-      g_autofree gchar *bytes_written_str = format_bytes (bytes_written);
-      g_autofree gchar *expected_bytes_str = format_bytes (self->image_size_bytes);
-      g_set_error (error,
-                   GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_WRONG_SIZE,
-                   _("Wrote %s bytes, but expected to write %s bytes."),
-                   bytes_written_str, expected_bytes_str);
-      return FALSE;
-    }
-
-  /* Now write the first 1 MiB to disk. Unfortunately GUnixOutputStream does
-   * not implement GSeekable.
-   */
-  if (lseek (fd, 0, SEEK_SET) < 0)
-    return glnx_throw_errno_prefix (error, "can't seek to start of disk");
+      const gchar *value;
 
-  if (!g_output_stream_write_all (output, first_mib, first_mib_bytes_read,
-                                  &w, cancellable, error))
-    return FALSE;
+      if (g_str_has_prefix (lines[i], "Dirty:"))
+        value = lines[i] + strlen ("Dirty:");
+      else if (g_str_has_prefix (lines[i], "Writeback:"))
+        value = lines[i] + strlen ("Writeback:");
+      else
+        continue;
 
-  g_mutex_lock (&self->mutex);
-  self->bytes_written += w;
-  g_mutex_unlock (&self->mutex);
+      /* in kB */
+      dirty += g_ascii_strtoull (value, NULL, 10) * 1024;
+    }
 
-  return TRUE;
+  return dirty;
 }
 
-static gboolean
-gis_scribe_set_indeterminate_progress (gpointer data)
+/* Maps self->verify_progress, which is the fraction of the image file which
+ * has been verified, to the fraction of the uncompressed image. Without an xz
+ * index, the image is assumed to compress evenly.
+ */
+static gdouble
+gis_scribe_get_verify_progress (GisScribe *self)
 {
-  GisScribe *self = GIS_SCRIBE (data);
+  gdouble verify_progress = self->verify_progress;
+  const GduXzBlockOffset *end;
 
-  g_mutex_lock (&self->mutex);
-  self->set_indeterminate_progress_id = 0;
-  g_mutex_unlock (&self->mutex);
+  if (self->xz_block_map == NULL || verify_progress <= 0 || verify_progress >= 1)
+    return verify_progress;
 
-  self->step = 2;
-  self->overall_progress = -1;
-  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_STEP]);
-  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_PROGRESS]);
+  end = &g_array_index (self->xz_block_map, GduXzBlockOffset,
+                        self->xz_block_map->len - 1);
+  if (end->uncompressed_offset == 0)
+    return verify_progress;
 
-  return G_SOURCE_REMOVE;
+  return (gdouble) gdu_xz_decompressor_map_offset (
+      self->xz_block_map, verify_progress * end->compressed_offset) /
+    end->uncompressed_offset;
 }
 
-static gboolean
-gis_scribe_convert_to_mbr (GisScribe *self,
-                           GError   **error)
+/* Notes that the slowest target has moved on to @phase, remembering how long
+ * the previous phase took so that the next write's estimate is closer.
+ */
+static void
+gis_scribe_enter_phase (GisScribe      *self,
+                        GisScribePhase  phase,
+                        gint64          now_usec)
 {
-  const char *cmd = "/usr/sbin/eos-repartition-mbr";
-  g_autoptr(GSubprocessLauncher) launcher = NULL;
-  g_autoptr(GSubprocess) process = NULL;
+  gdouble duration;
 
-  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
-  /* pkexec won't let us run the program if $SHELL isn't in /etc/shells,
-   * so remove it from the environment.
-   */
-  g_subprocess_launcher_unsetenv (launcher, "SHELL");
-  process = g_subprocess_launcher_spawn (launcher, error,
-                                         "pkexec", cmd, self->drive_path, NULL);
-  if (process == NULL ||
-      !g_subprocess_wait_check (process, NULL, error))
-    {
-      g_prefix_error (error, "failed to run %s %s: ",
-                      cmd, self->drive_path);
-      return FALSE;
-    }
+  if (phase == self->phase)
+    return;
 
-  return TRUE;
-}
+  duration = (gdouble) (now_usec - self->phase_start_usec) / G_USEC_PER_SEC;
+  if (self->phase == GIS_SCRIBE_PHASE_WRITE)
+    self->write_phase_cost = duration;
+  else if (self->phase == GIS_SCRIBE_PHASE_PROBE ||
+           self->phase == GIS_SCRIBE_PHASE_CONVERT_TO_MBR)
+    self->phase_cost[self->phase] = duration;
 
-static void
-gis_scribe_log_duration (GisScribe   *self,
-                         const gchar *label)
-{
-  gint64 now_usec = g_get_monotonic_time ();
-  gint64 duration = now_usec - self->start_time_usec;
-  gint64 hours = (duration / G_USEC_PER_SEC) / (60 * 60);
-  int minutes = ((duration / G_USEC_PER_SEC) / 60) % 60;
-  int seconds = (duration / G_USEC_PER_SEC) % 60;
+  g_debug ("%s: phase %d took %.0f s", G_STRFUNC, self->phase, duration);
 
-  g_message ("%s: %01" G_GINT64_FORMAT ":%02d:%02d",
-             label, hours, minutes, seconds);
+  self->phase = phase;
+  self->phase_start_usec = now_usec;
 }
 
-static void
-gis_scribe_write_thread (GTask        *task,
-                         gpointer      source_object,
-                         gpointer      task_data,
-                         GCancellable *cancellable)
+/* Called once per second while the write is in progress. Overall progress is
+ * measured in (expected) seconds: until the image has been copied, the time
+ * it will take is extrapolated from a moving average of how fast the slowest
+ * target is going, or of how fast the image is being verified if that is
+ * slower; the flush which follows is expected to take as long as writing the
+ * data that the kernel is still holding onto; and the remaining phases as long
+ * as they did last time.
+ */
+static gboolean
+gis_scribe_update_progress (gpointer data)
 {
-  GisScribe *self = GIS_SCRIBE (source_object);
-  GInputStream *decompressed = G_INPUT_STREAM (task_data);
-  gint fd = -1;
-  g_autoptr(GOutputStream) output = NULL;
-  gboolean ret;
-  g_autoptr(GError) error = NULL;
-  guint timer_id;
+  GisScribe *self = GIS_SCRIBE (data);
+  guint64 bytes_written = G_MAXUINT64;
+  GisScribePhase phase = GIS_SCRIBE_PHASE_DONE;
+  gint64 now_usec = g_get_monotonic_time ();
+  gdouble verify_progress;
+  gdouble write_progress;
+  gdouble copy_progress;
+  guint64 bytes_done;
+  gdouble done, total;
+  gdouble progress;
+  gint64 eta = -1;
+  gint p;
+  guint i;
 
-  /* Transfer ownership of drive_fd; the GOutputStream will close it. */
+  gis_scribe_sample_subprocesses (self);
+
+  /* Report the progress of the slowest target which is still going. */
   g_mutex_lock (&self->mutex);
-  fd = self->drive_fd;
-  self->drive_fd = -1;
+  for (i = 0; i < self->targets->len; i++)
+    {
+      GisScribeTarget *target = g_ptr_array_index (self->targets, i);
+
+      if (target->error == NULL)
+        {
+          bytes_written = MIN (bytes_written, target->bytes_written);
+          phase = MIN (phase, target->phase);
+        }
+    }
   g_mutex_unlock (&self->mutex);
-  output = g_unix_output_stream_new (fd, TRUE);
 
-  timer_id = g_timeout_add_seconds (1, gis_scribe_update_progress, self);
+  if (bytes_written == G_MAXUINT64)
+    bytes_written = 0;
 
-  g_thread_yield ();
+  write_progress = ((gdouble) bytes_written) / ((gdouble) self->image_size_bytes);
+  verify_progress = gis_scribe_get_verify_progress (self);
+  copy_progress = CLAMP (MIN (verify_progress, write_progress), -1, 1);
+
+  g_debug ("%s: verify progress %3.0f%%, write progress %3.0f%%, phase %d",
+           G_STRFUNC, verify_progress * 100, write_progress * 100, phase);
 
-  if (!gis_scribe_blkdiscard (fd, &error))
+  gis_scribe_enter_phase (self, phase, now_usec);
+
+  if (copy_progress < 0)
     {
-      /* Not fatal: the target device may not support this. */
-      g_message ("%s", error->message);
-      g_clear_error (&error);
+      /* gpg can't tell how far it has got, so neither can we. */
+      progress = -1;
+      goto out;
     }
 
-  ret = gis_scribe_write_thread_copy (self, decompressed, fd, output,
-                                      cancellable, &error);
+  if (self->phase == GIS_SCRIBE_PHASE_WRITE)
+    {
+      gdouble elapsed = (gdouble) (now_usec - self->last_update_usec) / G_USEC_PER_SEC;
+      guint64 written;
 
-  g_source_remove (timer_id);
+      bytes_done = copy_progress * self->image_size_bytes;
+      /* Sample the rate on every tick, even if nothing has been written
+       * since the last one, so that a stall slows the estimate down.
+       */
+      written = bytes_done > self->last_bytes_done
+        ? bytes_done - self->last_bytes_done
+        : 0;
+      self->write_rate = gis_throughput_smooth_rate (self->write_rate, written,
+                                                     elapsed);
 
-  if (!ret)
-    {
-      if (error == NULL)
+      self->last_bytes_done = bytes_done;
+      self->last_update_usec = now_usec;
+
+      if (self->write_rate > 0)
         {
-          /* This path should not be reached. To avoid translators
-           * translating a technical message which should never be shown, we only
-           * mark "Internal error" for translation.
-           */
-          g_set_error (&error, GIS_INSTALL_ERROR,
-                       GIS_INSTALL_ERROR_INTERNAL_ERROR,
-                       "%s: %s",
-                       _("Internal error"),
-                       "gis_scribe_write_thread_copy failed with no error.");
-          g_critical ("%s", error->message);
+          self->write_phase_cost =
+            (gdouble) (now_usec - self->phase_start_usec) / G_USEC_PER_SEC +
+            (self->image_size_bytes - bytes_done) / self->write_rate;
+          self->phase_cost[GIS_SCRIBE_PHASE_SYNC] =
+            gis_scribe_get_dirty_bytes () / self->write_rate;
         }
+    }
 
-      task_return_error (self, task, g_steal_pointer (&error));
-
-      /* On the happy path, gis_scribe_write_thread_copy() closes the
-       * decompressed stream when it reaches EOF. If we hit a write error
-       * before EOF, we need to close the decompressed stream to ensure the
-       * threads upstream of us terminate.
-       */
-      gis_scribe_close_input_stream_or_warn (decompressed, cancellable,
-                                             "decompressed stream");
-      return;
+  if (self->write_phase_cost <= 0)
+    {
+      /* Nothing to go on yet. */
+      progress = copy_progress;
+      goto out;
     }
 
-  gis_scribe_log_duration (self, "image fully written");
+  total = self->write_phase_cost;
+  done = self->phase == GIS_SCRIBE_PHASE_WRITE
+    ? copy_progress * self->write_phase_cost
+    : self->write_phase_cost;
 
-  /* Sync, probe and repartition  can take a long time; notify the UI thread of
-   * indeterminate progress.
-   */
-  g_mutex_lock (&self->mutex);
-  self->set_indeterminate_progress_id =
-    g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
-                     gis_scribe_set_indeterminate_progress,
-                     g_object_ref (self), g_object_unref);
-  g_mutex_unlock (&self->mutex);
+  for (p = GIS_SCRIBE_PHASE_SYNC; p < GIS_SCRIBE_PHASE_DONE; p++)
+    {
+      gdouble cost = self->phase_cost[p];
 
-  g_thread_yield ();
+      if (p == GIS_SCRIBE_PHASE_CONVERT_TO_MBR && !self->convert_to_mbr)
+        continue;
+
+      total += cost;
+      if (p < (gint) self->phase)
+        done += cost;
+      else if (p == (gint) self->phase)
+        done += MIN (cost,
+                     (gdouble) (now_usec - self->phase_start_usec) / G_USEC_PER_SEC);
+    }
 
-  if (syncfs (fd) < 0)
+  progress = CLAMP (done / total, 0, 1);
+  eta = (gint64) (total - done + 0.5);
+
+out:
+  /* Don't go backwards just because the estimate has gone up. */
+  if (progress >= 0 && self->overall_progress > progress)
+    progress = self->overall_progress;
+
+  if (progress != self->overall_progress)
     {
-      glnx_throw_errno_prefix (&error, "syncfs failed");
-      task_return_error (self, task, g_steal_pointer (&error));
-      return;
+      self->overall_progress = progress;
+      g_object_notify_by_pspec (G_OBJECT (self), props[PROP_PROGRESS]);
     }
 
-  if (!g_output_stream_close (output, cancellable, &error))
+  if (eta != self->eta)
     {
-      task_return_error (self, task, g_steal_pointer (&error));
-      return;
+      self->eta = eta;
+      g_object_notify_by_pspec (G_OBJECT (self), props[PROP_ETA]);
     }
 
-  g_spawn_command_line_sync ("partprobe", NULL, NULL, NULL, NULL);
-  if (self->convert_to_mbr)
-    gis_scribe_convert_to_mbr (self, &error);
+  return G_SOURCE_CONTINUE;
+}
 
-  g_mutex_lock (&self->mutex);
-  /* If we didn't get around to setting progress to -1 in the main thread, it's
-   * too late now anyway!
-   */
-  if (self->set_indeterminate_progress_id != 0)
-    g_source_remove (self->set_indeterminate_progress_id);
-  self->set_indeterminate_progress_id = 0;
-  g_mutex_unlock (&self->mutex);
+/* Run BLKDISCARD on the whole device. This tells flash-based disks that all
+ * data is now unused, which frees up wear levelling algorithms and boosts
+ * performance for next time each eraseblock is written.
+ */
+static gboolean
+gis_scribe_blkdiscard (gint     fd,
+                       GError **error)
+{
+  guint64 range[2];
 
-  if (error != NULL)
-    task_return_error (self, task, g_steal_pointer (&error));
-  else
-    g_task_return_boolean (task, TRUE);
+  range[0] = 0;
 
-  gis_scribe_log_duration (self, "write complete");
-}
+  if (ioctl (fd, BLKGETSIZE64, &range[1]))
+    return glnx_throw_errno_prefix (error, "can't get size for blkdiscard");
 
-static void
-gis_scribe_begin_write (GisScribe          *self,
-                        GInputStream       *decompressed,
-                        GCancellable       *cancellable,
-                        GAsyncReadyCallback callback,
-                        gpointer            data)
-{
-  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, data);
+  if (ioctl (fd, BLKDISCARD, &range))
+    return glnx_throw_errno_prefix (error, "blkdiscard failed");
 
-  g_task_set_source_tag (task, GUINT_TO_POINTER (GIS_SCRIBE_TASK_WRITE));
-  g_task_set_task_data (task, g_object_ref (decompressed), g_object_unref);
-  g_task_run_in_thread (task, gis_scribe_write_thread);
+  return TRUE;
 }
 
+/* The equivalent of gis_scribe_blkdiscard() for a regular file: deallocate
+ * all of its contents, without changing its size, so that it reads as zeros.
+ */
 static gboolean
-gis_scribe_gpg_progress (GObject *pollable_stream,
-                         gpointer data)
+gis_scribe_punch_hole (gint     fd,
+                       GError **error)
 {
-  GTask *task = G_TASK (data);
-  GisScribeGpgData *task_data = g_task_get_task_data (task);
-  GisScribe *self = GIS_SCRIBE (g_task_get_source_object (task));
-  g_autofree gchar *line = NULL;
-  g_auto(GStrv) arr = NULL;
-  guint64 curr, full;
-  gchar *units = NULL;
-  g_autoptr(GError) error = NULL;
+  struct stat st;
 
-  line = g_data_input_stream_read_line_utf8 (task_data->stdout_, NULL,
-                                             g_task_get_cancellable (task),
-                                             NULL);
-  if (line == NULL)
-    return G_SOURCE_CONTINUE;
+  if (fstat (fd, &st) < 0)
+    return glnx_throw_errno_prefix (error, "can't get size of target file");
 
-  g_debug ("%s: %s", G_STRFUNC, line);
+  if (st.st_size == 0)
+    return TRUE;
 
-  if (!g_str_has_prefix (line, "[GNUPG:] PROGRESS"))
-    {
-      /* TODO: handle GOODSIG/EXPSIG/BADSIG/etc. to surface the exact
-       * verification error. Or use GPGME?
-       */
-      return G_SOURCE_CONTINUE;
-    }
+  if (fallocate (fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                 0, st.st_size) == 0)
+    return TRUE;
 
-  /* https://git.gnupg.org/cgi-bin/gitweb.cgi?p=gnupg.git;a=blob;f=doc/DETAILS;h=0be55f4d;hb=refs/heads/master#l1043
-   * [GNUPG:] PROGRESS <what> <char> <cur> <total> [<units>]
-   * For example:
-   * [GNUPG:] PROGRESS /dev/mapper/endless- ? 676 4442 MiB
+  /* Not every filesystem can punch holes, but truncating the file and
+   * extending it again has the same effect.
    */
-  arr = g_strsplit (g_strchomp (line), " ", -1);
-  if (g_strv_length (arr) < 6)
-    {
-      g_warning ("%s: GPG progress message has too few fields: %s",
-                 G_STRFUNC, line);
-      return G_SOURCE_CONTINUE;
-    }
-
-  if (!g_ascii_string_to_unsigned (arr[4], 10, 0, G_MAXUINT64, &curr, &error) ||
-      !g_ascii_string_to_unsigned (arr[5], 10, 0, G_MAXUINT64, &full, &error))
-    {
-      g_warning ("%s: couldn't parse GPG progress message '%s': %s",
-                 G_STRFUNC, line, error->message);
-      return G_SOURCE_CONTINUE;
-    }
-  units = arr[6];
-
-  if (full < 1024 && g_strcmp0 (units, "B") == 0)
-    {
-      /* GPG reports progress reading the signature, not just the image. Assume
-       * any file less than 1 KiB is the signature and ignore it.
-       */
-      return G_SOURCE_CONTINUE;
-    }
+  if (errno != EOPNOTSUPP)
+    return glnx_throw_errno_prefix (error, "can't punch hole in target file");
 
-  if (full == 0)
-    {
-      /* gpg can't determine the file size. Should not happen, since we
-       * gave it a hint.
-       */
-      self->verify_progress = -1;
-    }
-  else
-    {
-      self->verify_progress = CLAMP ((gdouble) curr / (gdouble) full, 0, 1);
-    }
+  if (ftruncate (fd, 0) < 0 || ftruncate (fd, st.st_size) < 0)
+    return glnx_throw_errno_prefix (error, "can't truncate target file");
 
-  return G_SOURCE_CONTINUE;
+  return TRUE;
 }
 
-static void
-gis_scribe_gpg_wait_check_cb (GObject      *source,
-                              GAsyncResult *result,
-                              gpointer      data)
+static gboolean
+is_all_zeros (const guint8 *data,
+              gsize         len)
 {
-  GSubprocess *gpg_subprocess = G_SUBPROCESS (source);
-  g_autoptr(GTask) task = G_TASK (data);
+  return len == 0 || (data[0] == 0 && memcmp (data, data + 1, len - 1) == 0);
+}
+
+/* Writes @len bytes of @data to @output, which writes to @fd, setting
+ * @bytes_written to how far through @data it got. If @target is sparse,
+ * runs of zeros are skipped over rather than written.
+ */
+static gboolean
+gis_scribe_write_chunk (GisScribeTarget *target,
+                        gint             fd,
+                        GOutputStream   *output,
+                        const guint8    *data,
+                        gsize            len,
+                        gsize           *bytes_written,
+                        GCancellable    *cancellable,
+                        GError         **error)
+{
+  gsize done = 0;
+
+  if (!target->sparse)
+    return g_output_stream_write_all (output, data, len, bytes_written,
+                                      cancellable, error);
+
+  /* Chunks start on a multiple of BUFFER_SIZE, so each block here is aligned
+   * to SPARSE_BLOCK_SIZE on the target.
+   */
+  while (done < len)
+    {
+      gsize run = MIN (SPARSE_BLOCK_SIZE, len - done);
+      gboolean zeros = is_all_zeros (data + done, run);
+      gsize w = 0;
+      gboolean ret;
+
+      while (done + run < len)
+        {
+          gsize next = MIN (SPARSE_BLOCK_SIZE, len - done - run);
+
+          if (is_all_zeros (data + done + run, next) != zeros)
+            break;
+
+          run += next;
+        }
+
+      if (zeros)
+        {
+          ret = lseek (fd, run, SEEK_CUR) >= 0;
+          if (ret)
+            w = run;
+          else
+            glnx_throw_errno_prefix (error, "can't seek in target file");
+        }
+      else
+        {
+          ret = g_output_stream_write_all (output, data + done, run, &w,
+                                           cancellable, error);
+        }
+
+      done += w;
+      if (!ret)
+        {
+          *bytes_written = done;
+          return FALSE;
+        }
+    }
+
+  *bytes_written = done;
+  return TRUE;
+}
+
+static gboolean
+gis_scribe_write_thread_await_verify (GisScribe *self,
+                                      GError   **error)
+{
+  g_autoptr(GError) local_error = NULL;
+
+  g_mutex_lock (&self->mutex);
+  /* Wait until all other tasks have ended */
+  while ((self->outstanding_tasks & ~GIS_SCRIBE_TASK_WRITE) != 0)
+    g_cond_wait (&self->cond, &self->mutex);
+
+  /* This task itself should still be outstanding */
+  g_assert_cmpint (self->outstanding_tasks, ==, GIS_SCRIBE_TASK_WRITE);
+
+  if (self->error != NULL)
+    local_error = g_error_copy (self->error);
+  g_mutex_unlock (&self->mutex);
+
+  if (local_error == NULL)
+    return TRUE;
+
+  /* This error will already have been reported by whichever task failed, but
+   * we have to throw *some* error from this task.
+   */
+  g_propagate_error (error, g_steal_pointer (&local_error));
+  return FALSE;
+}
+
+/* Allocates size bytes, page-aligned. */
+G_GNUC_MALLOC
+G_GNUC_ALLOC_SIZE(1)
+static void *
+gis_scribe_malloc_aligned (size_t size)
+{
+  const size_t pagesize = sysconf (_SC_PAGESIZE);
+  void *buf = NULL;
+
+  if (posix_memalign (&buf, pagesize, size) != 0 || buf == NULL)
+    g_error ("%s: failed to allocate %" G_GSIZE_FORMAT " bytes "
+             "aligned to page size %" G_GSIZE_FORMAT ": %s",
+             G_STRFUNC, size, pagesize, g_strerror (errno));
+
+  return buf;
+}
+
+static gchar *
+format_bytes (guint64 bytes)
+{
+  /* The ' flag is a Single UNIX Specification extension to group the
+   * number with thousands' grouping characters if the locale information
+   * indicates any. We don't use g_format_size_full(...,
+   * G_FORMAT_SIZE_LONG_FORMAT) because it also includes the rounded value
+   * (eg "101.2 GB (101,241,834,086 bytes)"); the rounded value is unlikely
+   * to be helpful when the discrepency is < 512 bytes, as is likely (see
+   * below).
+   *
+   * Some combination of this and G_GUINT64_FORMAT confuses xgettext if it is
+   * used in the translatable string where this value is used.
+   */
+  return g_strdup_printf ("%'" G_GUINT64_FORMAT, bytes);
+}
+
+/* Waits for the fan-out subtask to provide the next chunk of decompressed
+ * image data for @target. On success, @chunk is set to that chunk, or to %NULL
+ * at the end of the image. Fails if one of the shared subtasks has failed,
+ * since there's no point in carrying on writing an image which will be
+ * rejected anyway.
+ */
+static gboolean
+gis_scribe_target_pop_chunk (GisScribe        *self,
+                             GisScribeTarget  *target,
+                             GBytes          **chunk,
+                             GError          **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  gint64 start_usec = g_get_monotonic_time ();
+  guint64 occupancy;
+
+  g_mutex_lock (&self->mutex);
+  while (self->error == NULL
+         && g_queue_is_empty (&target->chunks)
+         && !self->fan_out_done)
+    g_cond_wait (&self->cond, &self->mutex);
+
+  /* Every chunk but the last is BUFFER_SIZE bytes. */
+  occupancy = (guint64) g_queue_get_length (&target->chunks) * BUFFER_SIZE;
+
+  if (self->error != NULL)
+    local_error = g_error_copy (self->error);
+  else
+    *chunk = g_queue_pop_head (&target->chunks);
+
+  /* The fan-out subtask may be waiting for space in this target's queue. */
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+
+  gis_scribe_record_queue (self, target, GIS_SCRIBE_STAGE_WRITE, occupancy,
+                           (guint64) FAN_OUT_QUEUE_LENGTH * BUFFER_SIZE);
+  gis_scribe_record_stage (self, target, GIS_SCRIBE_STAGE_WRITE,
+                           *chunk != NULL ? g_bytes_get_size (*chunk) : 0, 0,
+                           0,
+                           gis_scribe_trace (self, "wait-for-chunk",
+                                             start_usec, 0) - start_usec,
+                           0);
+
+  if (local_error == NULL)
+    return TRUE;
+
+  /* As in gis_scribe_write_thread_await_verify(), this error will already
+   * have been reported by whichever task failed.
+   */
+  g_propagate_error (error, g_steal_pointer (&local_error));
+  return FALSE;
+}
+
+static gboolean
+gis_scribe_write_thread_copy (GisScribe       *self,
+                              GisScribeTarget *target,
+                              gint             fd,
+                              GOutputStream   *output,
+                              GCancellable    *cancellable,
+                              GError         **error)
+{
+  g_autofree gchar *zeros = gis_scribe_malloc_aligned (BUFFER_SIZE);
+  g_autoptr(GBytes) first_mib = NULL;
+  gsize first_mib_bytes_read = 0;
+  gsize w = 0;
+  gint64 start_usec;
+  /* Where the next chunk will be written on the target */
+  guint64 offset = 0;
+
+  /* Hold back the first 1 MiB; write zeros to the target drive. This ensures
+   * the system won't boot until the image is fully written. The fan-out
+   * subtask reads BUFFER_SIZE bytes at a time, so the first chunk is exactly
+   * the first 1 MiB (or the whole image, if it is smaller than that).
+   */
+  memset (zeros, 0, BUFFER_SIZE);
+  GIS_PROBE3 (write__chunk__start, target->drive_path, offset, BUFFER_SIZE);
+  start_usec = g_get_monotonic_time ();
+  if (!gis_scribe_write_chunk (target, fd, output, (const guint8 *) zeros,
+                               BUFFER_SIZE, &w, cancellable, error))
+    return FALSE;
+
+  GIS_PROBE3 (write__chunk__done, target->drive_path, offset, w);
+  offset += w;
+
+  gis_scribe_record_stage (self, target, GIS_SCRIBE_STAGE_WRITE, 0, 0,
+                           gis_scribe_trace (self, "write-zeros",
+                                             start_usec, w) - start_usec,
+                           0, 0);
+
+  if (!gis_scribe_target_pop_chunk (self, target, &first_mib, error))
+    return FALSE;
+
+  if (first_mib != NULL)
+    first_mib_bytes_read = g_bytes_get_size (first_mib);
+
+  for (;;)
+    {
+      g_autoptr(GBytes) chunk = NULL;
+      gconstpointer data;
+      gsize len;
+
+      if (!gis_scribe_target_pop_chunk (self, target, &chunk, error))
+        return FALSE;
+
+      if (chunk == NULL)
+        break;
+
+      data = g_bytes_get_data (chunk, &len);
+      GIS_PROBE3 (write__chunk__start, target->drive_path, offset, len);
+      start_usec = g_get_monotonic_time ();
+      if (!gis_scribe_write_chunk (target, fd, output, data, len,
+                                   &w, cancellable, error))
+        return FALSE;
+
+      GIS_PROBE3 (write__chunk__done, target->drive_path, offset, w);
+      offset += w;
+
+      gis_scribe_record_stage (self, target, GIS_SCRIBE_STAGE_WRITE, 0, w,
+                               gis_scribe_trace (self, "write",
+                                                 start_usec, w) - start_usec,
+                               0, 0);
+
+      /* We lock to protect bytes_written */
+      g_mutex_lock (&self->mutex);
+      target->bytes_written += w;
+      g_mutex_unlock (&self->mutex);
+    }
+
+  /* If the image ends with zeros, they were skipped over, so the file may not
+   * have reached its full size.
+   */
+  if (target->sparse)
+    {
+      struct stat st;
+
+      if (fstat (fd, &st) < 0 ||
+          ((guint64) st.st_size < offset && ftruncate (fd, offset) < 0))
+        return glnx_throw_errno_prefix (error, "can't extend target file");
+    }
+
+  /* Wait for verification to complete */
+  start_usec = g_get_monotonic_time ();
+  if (!gis_scribe_write_thread_await_verify (self, error))
+    return FALSE;
+
+  gis_scribe_record_stage (self, target, GIS_SCRIBE_STAGE_WRITE, 0, 0,
+                           0,
+                           gis_scribe_trace (self, "await-verify",
+                                             start_usec, 0) - start_usec,
+                           0);
+
+  /* Check that we've written the same amount of data as we expected from the
+   * GPT header. This would only fail if there's something seriously wrong with
+   * the image builder, the decompressor, or the read/write loop above.
+   */
+  g_mutex_lock (&self->mutex);
+  /* Don't forget the first <= 1 MiB we saved for later! */
+  guint64 bytes_written = target->bytes_written + first_mib_bytes_read;
+  g_mutex_unlock (&self->mutex);
+
+  if (bytes_written != self->image_size_bytes)
+    {
+      /* See comment on format_bytes() to understand why these are formatted
+       * separately.
+       */
+      g_autofree gchar *bytes_written_str = format_bytes (bytes_written);
+      g_autofree gchar *expected_bytes_str = format_bytes (self->image_size_bytes);
+      g_set_error (error,
+                   GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_WRONG_SIZE,
+                   _("Wrote %s bytes, but expected to write %s bytes."),
+                   bytes_written_str, expected_bytes_str);
+      return FALSE;
+    }
+
+  if (first_mib == NULL)
+    return TRUE;
+
+  /* Now write the first 1 MiB to disk. Unfortunately GUnixOutputStream does
+   * not implement GSeekable.
+   */
+  if (lseek (fd, 0, SEEK_SET) < 0)
+    return glnx_throw_errno_prefix (error, "can't seek to start of disk");
+
+  GIS_PROBE3 (write__chunk__start, target->drive_path, 0,
+              first_mib_bytes_read);
+  start_usec = g_get_monotonic_time ();
+  if (!gis_scribe_write_chunk (target, fd, output,
+                               g_bytes_get_data (first_mib, NULL),
+                               first_mib_bytes_read,
+                               &w, cancellable, error))
+    return FALSE;
+
+  GIS_PROBE3 (write__chunk__done, target->drive_path, 0, w);
+
+  gis_scribe_record_stage (self, target, GIS_SCRIBE_STAGE_WRITE, 0, w,
+                           gis_scribe_trace (self, "write-first-mib",
+                                             start_usec, w) - start_usec,
+                           0, 0);
+
+  g_mutex_lock (&self->mutex);
+  target->bytes_written += w;
+  g_mutex_unlock (&self->mutex);
+
+  return TRUE;
+}
+
+static gboolean
+gis_scribe_enter_finishing_step (gpointer data)
+{
+  GisScribe *self = GIS_SCRIBE (data);
+
+  g_mutex_lock (&self->mutex);
+  self->enter_finishing_step_id = 0;
+  g_mutex_unlock (&self->mutex);
+
+  self->step = 2;
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_STEP]);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+gis_scribe_target_set_phase (GisScribe       *self,
+                             GisScribeTarget *target,
+                             GisScribePhase   phase)
+{
+  g_mutex_lock (&self->mutex);
+  target->phase = phase;
+  g_mutex_unlock (&self->mutex);
+}
+
+static gboolean
+gis_scribe_convert_to_mbr (const gchar *drive_path,
+                           GError     **error)
+{
+  const char *cmd = "/usr/sbin/eos-repartition-mbr";
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autoptr(GSubprocess) process = NULL;
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  /* pkexec won't let us run the program if $SHELL isn't in /etc/shells,
+   * so remove it from the environment.
+   */
+  g_subprocess_launcher_unsetenv (launcher, "SHELL");
+  process = g_subprocess_launcher_spawn (launcher, error,
+                                         "pkexec", cmd, drive_path, NULL);
+  if (process == NULL ||
+      !g_subprocess_wait_check (process, NULL, error))
+    {
+      g_prefix_error (error, "failed to run %s %s: ",
+                      cmd, drive_path);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+gis_scribe_log_duration (GisScribe   *self,
+                         const gchar *label)
+{
+  gint64 now_usec = g_get_monotonic_time ();
+  gint64 duration = now_usec - self->start_time_usec;
+  gint64 hours = (duration / G_USEC_PER_SEC) / (60 * 60);
+  int minutes = ((duration / G_USEC_PER_SEC) / 60) % 60;
+  int seconds = (duration / G_USEC_PER_SEC) % 60;
+
+  g_message ("%s: %01" G_GINT64_FORMAT ":%02d:%02d",
+             label, hours, minutes, seconds);
+}
+
+/* Called by @target's writer thread when it stops copying image data to the
+ * target, with @error set if it failed to do so.
+ */
+static void
+gis_scribe_target_finish_copying (GisScribe       *self,
+                                  GisScribeTarget *target,
+                                  const GError    *error)
+{
+  g_mutex_lock (&self->mutex);
+
+  target->finished_copying = TRUE;
+  gis_scribe_target_drop_chunks (target);
+
+  if (error == NULL)
+    self->copied_targets++;
+  else if (target->error == NULL)
+    target->error = g_error_copy (error);
+
+  g_assert_cmpuint (self->copying_targets, >, 0);
+  self->copying_targets--;
+
+  /* Sync, probe and repartition can take a long time; let the UI thread
+   * know that they have begun. Progress carries on being updated until the
+   * last writer returns.
+   */
+  if (self->copying_targets == 0 && self->copied_targets > 0)
+    self->enter_finishing_step_id =
+      g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+                       gis_scribe_enter_finishing_step,
+                       g_object_ref (self), g_object_unref);
+
+  /* The fan-out subtask may be waiting for space in this target's queue. */
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+}
+
+/* Completes @task, the writer subtask for @target, failing it with @error if
+ * that is non-%NULL. Unlike task_return_error(), this does not set
+ * self->error, so the other targets are unaffected.
+ */
+static void
+gis_scribe_write_thread_return (GisScribe       *self,
+                                GTask           *task,
+                                GisScribeTarget *target,
+                                GError          *error)
+{
+  g_mutex_lock (&self->mutex);
+
+  if (error != NULL && target->error == NULL)
+    target->error = g_error_copy (error);
+
+  g_assert_cmpuint (self->running_writers, >, 0);
+  self->running_writers--;
+  target->finished_usec = g_get_monotonic_time ();
+
+  if (error == NULL)
+    target->phase = GIS_SCRIBE_PHASE_DONE;
+
+  if (self->running_writers == 0)
+    {
+      g_source_remove (self->update_progress_id);
+      self->update_progress_id = 0;
+
+      /* If we didn't get around to moving on to step 2 in the main thread,
+       * it's too late now anyway!
+       */
+      if (self->enter_finishing_step_id != 0)
+        {
+          g_source_remove (self->enter_finishing_step_id);
+          self->enter_finishing_step_id = 0;
+        }
+    }
+
+  g_mutex_unlock (&self->mutex);
+
+  if (error != NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+gis_scribe_write_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  GisScribe *self = GIS_SCRIBE (source_object);
+  GisScribeTarget *target = task_data;
+  gint fd = -1;
+  g_autoptr(GOutputStream) output = NULL;
+  gboolean ret;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *label = NULL;
+  guint64 bytes_written;
+  gint64 start_usec;
+  struct stat st;
+
+  /* Transfer ownership of drive_fd; the GOutputStream will close it. */
+  g_mutex_lock (&self->mutex);
+  fd = target->drive_fd;
+  target->drive_fd = -1;
+  g_mutex_unlock (&self->mutex);
+  output = g_unix_output_stream_new (fd, TRUE);
+
+  gis_scribe_trace_thread (self, target->drive_path);
+  g_thread_yield ();
+
+  target->is_file = fstat (fd, &st) == 0 && S_ISREG (st.st_mode);
+
+  GIS_PROBE1 (discard__start, target->drive_path);
+  start_usec = g_get_monotonic_time ();
+  if (target->is_file)
+    ret = target->sparse = gis_scribe_punch_hole (fd, &error);
+  else
+    ret = gis_scribe_blkdiscard (fd, &error);
+  GIS_PROBE2 (discard__done, target->drive_path, ret);
+  if (!ret)
+    {
+      /* Not fatal: the target device may not support this. If the target is
+       * a file, it is just written in full.
+       */
+      g_message ("%s: %s", target->drive_path, error->message);
+      g_clear_error (&error);
+    }
+  gis_scribe_record_stage (self, target, GIS_SCRIBE_STAGE_DISCARD, 0, 0,
+                           gis_scribe_trace (self, "discard",
+                                             start_usec, 0) - start_usec,
+                           0, 0);
+
+  ret = gis_scribe_write_thread_copy (self, target, fd, output,
+                                      cancellable, &error);
+
+  if (!ret && error == NULL)
+    {
+      /* This path should not be reached. To avoid translators
+       * translating a technical message which should never be shown, we only
+       * mark "Internal error" for translation.
+       */
+      g_set_error (&error, GIS_INSTALL_ERROR,
+                   GIS_INSTALL_ERROR_INTERNAL_ERROR,
+                   "%s: %s",
+                   _("Internal error"),
+                   "gis_scribe_write_thread_copy failed with no error.");
+      g_critical ("%s", error->message);
+    }
+
+  gis_scribe_target_finish_copying (self, target, error);
+
+  if (!ret)
+    {
+      gis_scribe_write_thread_return (self, task, target,
+                                      g_steal_pointer (&error));
+      return;
+    }
+
+  label = g_strdup_printf ("%s: image fully written", target->drive_path);
+  gis_scribe_log_duration (self, label);
+
+  g_thread_yield ();
+
+  gis_scribe_target_set_phase (self, target, GIS_SCRIBE_PHASE_SYNC);
+  GIS_PROBE1 (sync__start, target->drive_path);
+  start_usec = g_get_monotonic_time ();
+  /* There's no need to flush the whole filesystem that a file is on */
+  ret = (target->is_file ? fdatasync (fd) : syncfs (fd)) == 0;
+  GIS_PROBE2 (sync__done, target->drive_path, ret);
+  if (!ret)
+    {
+      glnx_throw_errno_prefix (&error, target->is_file ? "fdatasync failed"
+                                                       : "syncfs failed");
+      gis_scribe_write_thread_return (self, task, target,
+                                      g_steal_pointer (&error));
+      return;
+    }
+
+  g_mutex_lock (&self->mutex);
+  bytes_written = target->bytes_written;
+  g_mutex_unlock (&self->mutex);
+  gis_scribe_record_stage (self, target, GIS_SCRIBE_STAGE_SYNC,
+                           bytes_written, bytes_written,
+                           gis_scribe_trace (self, "sync",
+                                             start_usec, bytes_written) - start_usec,
+                           0, 0);
+
+  if (!g_output_stream_close (output, cancellable, &error))
+    {
+      gis_scribe_write_thread_return (self, task, target,
+                                      g_steal_pointer (&error));
+      return;
+    }
+
+  /* A file has no partitions for the kernel to re-read, and
+   * eos-repartition-mbr only works on disks.
+   */
+  if (target->is_file)
+    {
+      if (self->convert_to_mbr)
+        g_message ("%s: not converting to MBR: not a disk",
+                   target->drive_path);
+    }
+  else
+    {
+      gis_scribe_target_set_phase (self, target, GIS_SCRIBE_PHASE_PROBE);
+      GIS_PROBE1 (partprobe__start, target->drive_path);
+      start_usec = g_get_monotonic_time ();
+      g_spawn_command_line_sync ("partprobe", NULL, NULL, NULL, NULL);
+      start_usec = gis_scribe_trace (self, "probe", start_usec, 0);
+      GIS_PROBE1 (partprobe__done, target->drive_path);
+    }
+
+  if (self->convert_to_mbr && !target->is_file)
+    {
+      gis_scribe_target_set_phase (self, target,
+                                   GIS_SCRIBE_PHASE_CONVERT_TO_MBR);
+      GIS_PROBE1 (convert__to__mbr__start, target->drive_path);
+      ret = gis_scribe_convert_to_mbr (target->drive_path, &error);
+      gis_scribe_trace (self, "convert-to-mbr", start_usec, 0);
+      GIS_PROBE2 (convert__to__mbr__done, target->drive_path, ret);
+    }
+
+  gis_scribe_write_thread_return (self, task, target,
+                                  g_steal_pointer (&error));
+
+  g_free (label);
+  label = g_strdup_printf ("%s: write complete", target->drive_path);
+  gis_scribe_log_duration (self, label);
+}
+
+static void
+gis_scribe_begin_write (GisScribe          *self,
+                        GisScribeTarget    *target,
+                        GCancellable       *cancellable,
+                        GAsyncReadyCallback callback,
+                        gpointer            data)
+{
+  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, data);
+
+  g_task_set_source_tag (task, GUINT_TO_POINTER (GIS_SCRIBE_TASK_WRITE));
+  /* Owned by self->targets, which outlives the task. */
+  g_task_set_task_data (task, target, NULL);
+  g_task_run_in_thread (task, gis_scribe_write_thread);
+}
+
+/* Queues @chunk for every target which is still copying, waiting until there
+ * is space for it in all of their queues. Returns %FALSE if there's no point
+ * reading any more of the image: either no target is still copying, or one of
+ * the shared subtasks has failed.
+ */
+static gboolean
+gis_scribe_fan_out_push (GisScribe *self,
+                         GBytes    *chunk)
+{
+  gboolean any_copying;
+  gboolean any_full;
+  guint i;
+
+  g_mutex_lock (&self->mutex);
+
+  /* While pre-warming, there are no targets to hand the chunk to yet, so
+   * hold on to it until there are.
+   */
+  while (self->prewarming
+         && self->error == NULL
+         && g_queue_get_length (&self->prewarmed_chunks) >= PREWARM_QUEUE_LENGTH)
+    g_cond_wait (&self->cond, &self->mutex);
+
+  if (self->prewarming && self->error == NULL)
+    {
+      g_queue_push_tail (&self->prewarmed_chunks, g_bytes_ref (chunk));
+      g_mutex_unlock (&self->mutex);
+      return TRUE;
+    }
+
+  do
+    {
+      any_copying = FALSE;
+      any_full = FALSE;
+
+      for (i = 0; i < self->targets->len; i++)
+        {
+          GisScribeTarget *target = g_ptr_array_index (self->targets, i);
+
+          if (target->finished_copying)
+            continue;
+
+          any_copying = TRUE;
+          if (g_queue_get_length (&target->chunks) >= FAN_OUT_QUEUE_LENGTH)
+            any_full = TRUE;
+        }
+
+      if (self->error != NULL || !any_copying)
+        {
+          g_mutex_unlock (&self->mutex);
+          return FALSE;
+        }
+
+      if (any_full)
+        g_cond_wait (&self->cond, &self->mutex);
+    }
+  while (any_full);
+
+  for (i = 0; i < self->targets->len; i++)
+    {
+      GisScribeTarget *target = g_ptr_array_index (self->targets, i);
+
+      if (!target->finished_copying)
+        g_queue_push_tail (&target->chunks, g_bytes_ref (chunk));
+    }
+
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+
+  return TRUE;
+}
+
+/* Copies @chunk into self->cache_entry, if any. If that fails, the image is
+ * not cached, but the write carries on regardless.
+ */
+static void
+gis_scribe_fan_out_cache_chunk (GisScribe *self,
+                                GBytes    *chunk)
+{
+  g_autoptr(GError) error = NULL;
+  gconstpointer data;
+  gsize len;
+
+  if (self->cache_entry == NULL)
+    return;
+
+  data = g_bytes_get_data (chunk, &len);
+  if (!gis_image_cache_entry_write (self->cache_entry, data, len, &error))
+    {
+      g_message ("not caching image: %s", error->message);
+      g_clear_pointer (&self->cache_entry, gis_image_cache_entry_free);
+    }
+}
+
+/* Called by the fan-out subtask once it has read the whole decompressed
+ * image. Waits for the other shared subtasks to finish, and adds the image to
+ * the cache if they all succeeded: in particular, only once it has been
+ * verified.
+ */
+static void
+gis_scribe_fan_out_commit_cache (GisScribe *self)
+{
+  g_autoptr(GisImageCacheEntry) entry = g_steal_pointer (&self->cache_entry);
+  const gint upstream_tasks = GIS_SCRIBE_TASK_TEE
+                            | GIS_SCRIBE_TASK_VERIFY
+                            | GIS_SCRIBE_TASK_DECOMPRESS;
+  g_autoptr(GError) error = NULL;
+  gboolean verified;
+
+  if (entry == NULL)
+    return;
+
+  g_mutex_lock (&self->mutex);
+  while (self->error == NULL && (self->outstanding_tasks & upstream_tasks) != 0)
+    g_cond_wait (&self->cond, &self->mutex);
+
+  verified = self->error == NULL;
+  g_mutex_unlock (&self->mutex);
+
+  if (!verified)
+    return;
+
+  if (gis_image_cache_entry_commit (entry, &error))
+    g_message ("cached decompressed image in %s",
+               gis_image_cache_get_directory (self->image_cache));
+  else
+    g_message ("failed to cache image: %s", error->message);
+}
+
+/* Reads the decompressed image and hands it out, BUFFER_SIZE bytes at a time,
+ * to each target's writer thread. The image is only read, verified and
+ * decompressed once, however many targets there are.
+ */
+static void
+gis_scribe_fan_out_thread (GTask        *task,
+                           gpointer      source_object,
+                           gpointer      task_data,
+                           GCancellable *cancellable)
+{
+  GisScribe *self = GIS_SCRIBE (source_object);
+  GInputStream *decompressed = G_INPUT_STREAM (task_data);
+  g_autoptr(GError) error = NULL;
+  gboolean keep_going = TRUE;
+  guint64 offset = 0;
+  guint i;
+
+  gis_scribe_trace_thread (self, "fan-out");
+
+  while (keep_going)
+    {
+      gchar *buffer = gis_scribe_malloc_aligned (BUFFER_SIZE);
+      g_autoptr(GBytes) chunk = NULL;
+      gsize r = 0;
+      gint64 start_usec = g_get_monotonic_time ();
+      gint64 read_usec;
+      gint64 push_usec;
+
+      GIS_PROBE1 (decode__chunk__start, offset);
+      if (!g_input_stream_read_all (decompressed, buffer, BUFFER_SIZE,
+                                    &r, cancellable, &error)
+          || r == 0)
+        {
+          free (buffer);
+          break;
+        }
+
+      GIS_PROBE2 (decode__chunk__done, offset, r);
+      offset += r;
+
+      read_usec = gis_scribe_trace (self, "read-decompressed",
+                                    start_usec, r) - start_usec;
+
+      chunk = g_bytes_new_with_free_func (buffer, r, free, buffer);
+      start_usec += read_usec;
+      gis_scribe_fan_out_cache_chunk (self, chunk);
+      if (self->cache_entry != NULL)
+        start_usec = gis_scribe_trace (self, "cache", start_usec, r);
+      else
+        start_usec = g_get_monotonic_time ();
+
+      keep_going = gis_scribe_fan_out_push (self, chunk);
+
+      /* Time spent waiting for the targets holds up the decompressor (or,
+       * reading from the cache, the source).
+       */
+      push_usec = gis_scribe_trace (self, "wait-for-targets",
+                                    start_usec, r) - start_usec;
+      if (self->reading_cached_image)
+        gis_scribe_record_stage (self, NULL, GIS_SCRIBE_STAGE_TEE, r, r,
+                                 read_usec, 0, push_usec);
+      else
+        gis_scribe_record_stage (self, NULL, GIS_SCRIBE_STAGE_DECOMPRESS,
+                                 0, r, 0, 0, push_usec);
+    }
+
+  g_mutex_lock (&self->mutex);
+  self->fan_out_done = TRUE;
+
+  if (error == NULL && !keep_going)
+    {
+      if (self->error != NULL)
+        {
+          /* Some other subtask failed; it has already reported its error. */
+          error = g_error_copy (self->error);
+        }
+      else
+        {
+          /* Every target has failed. Report the first target's error as the
+           * overall failure now, before closing the decompressed stream
+           * causes the tee subtask to fail with a less helpful "broken pipe"
+           * error.
+           */
+          for (i = 0; error == NULL && i < self->targets->len; i++)
+            {
+              GisScribeTarget *target = g_ptr_array_index (self->targets, i);
+
+              if (target->error != NULL)
+                error = g_error_copy (target->error);
+            }
+        }
+    }
+
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+
+  /* Only cache the image if all of it was read. */
+  if (error == NULL && keep_going)
+    gis_scribe_fan_out_commit_cache (self);
+  else
+    g_clear_pointer (&self->cache_entry, gis_image_cache_entry_free);
+
+  if (error == NULL)
+    g_task_return_boolean (task, TRUE);
+  else
+    task_return_error (self, task, g_steal_pointer (&error));
+
+  /* If we stopped before EOF, closing the decompressed stream ensures the
+   * threads upstream of us terminate.
+   */
+  gis_scribe_close_input_stream_or_warn (decompressed, cancellable,
+                                         "decompressed stream");
+}
+
+static void
+gis_scribe_begin_fan_out (GisScribe          *self,
+                          GInputStream       *decompressed,
+                          GCancellable       *cancellable,
+                          GAsyncReadyCallback callback,
+                          gpointer            data)
+{
+  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, data);
+
+  g_task_set_source_tag (task, GUINT_TO_POINTER (GIS_SCRIBE_TASK_FAN_OUT));
+  g_task_set_task_data (task, g_object_ref (decompressed), g_object_unref);
+  g_task_run_in_thread (task, gis_scribe_fan_out_thread);
+}
+
+static gboolean
+gis_scribe_gpg_progress (GObject *pollable_stream,
+                         gpointer data)
+{
+  GTask *task = G_TASK (data);
+  GisScribeGpgData *task_data = g_task_get_task_data (task);
+  GisScribe *self = GIS_SCRIBE (g_task_get_source_object (task));
+  g_autofree gchar *line = NULL;
+  g_auto(GStrv) arr = NULL;
+  guint64 curr, full;
+  gchar *units = NULL;
+  g_autoptr(GError) error = NULL;
+
+  line = g_data_input_stream_read_line_utf8 (task_data->stdout_, NULL,
+                                             g_task_get_cancellable (task),
+                                             NULL);
+  if (line == NULL)
+    return G_SOURCE_CONTINUE;
+
+  g_debug ("%s: %s", G_STRFUNC, line);
+
+  if (!g_str_has_prefix (line, "[GNUPG:] PROGRESS"))
+    {
+      /* TODO: handle GOODSIG/EXPSIG/BADSIG/etc. to surface the exact
+       * verification error. Or use GPGME?
+       */
+      return G_SOURCE_CONTINUE;
+    }
+
+  /* https://git.gnupg.org/cgi-bin/gitweb.cgi?p=gnupg.git;a=blob;f=doc/DETAILS;h=0be55f4d;hb=refs/heads/master#l1043
+   * [GNUPG:] PROGRESS <what> <char> <cur> <total> [<units>]
+   * For example:
+   * [GNUPG:] PROGRESS /dev/mapper/endless- ? 676 4442 MiB
+   */
+  arr = g_strsplit (g_strchomp (line), " ", -1);
+  if (g_strv_length (arr) < 6)
+    {
+      g_warning ("%s: GPG progress message has too few fields: %s",
+                 G_STRFUNC, line);
+      return G_SOURCE_CONTINUE;
+    }
+
+  if (!g_ascii_string_to_unsigned (arr[4], 10, 0, G_MAXUINT64, &curr, &error) ||
+      !g_ascii_string_to_unsigned (arr[5], 10, 0, G_MAXUINT64, &full, &error))
+    {
+      g_warning ("%s: couldn't parse GPG progress message '%s': %s",
+                 G_STRFUNC, line, error->message);
+      return G_SOURCE_CONTINUE;
+    }
+  units = arr[6];
+
+  if (full < 1024 && g_strcmp0 (units, "B") == 0)
+    {
+      /* GPG reports progress reading the signature, not just the image. Assume
+       * any file less than 1 KiB is the signature and ignore it.
+       */
+      return G_SOURCE_CONTINUE;
+    }
+
+  if (full == 0)
+    {
+      /* gpg can't determine the file size. Should not happen, since we
+       * gave it a hint.
+       */
+      self->verify_progress = -1;
+    }
+  else
+    {
+      self->verify_progress = CLAMP ((gdouble) curr / (gdouble) full, 0, 1);
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+gis_scribe_gpg_wait_check_cb (GObject      *source,
+                              GAsyncResult *result,
+                              gpointer      data)
+{
+  GSubprocess *gpg_subprocess = G_SUBPROCESS (source);
+  g_autoptr(GTask) task = G_TASK (data);
+  GisScribe *self = GIS_SCRIBE (g_task_get_source_object (task));
+  GisScribeGpgData *task_data = g_task_get_task_data (task);
+  gboolean ok;
+  g_autoptr(GError) error = NULL;
+
+  g_clear_pointer (&task_data->stdout_source, g_source_destroy);
+  if (self->trace != NULL)
+    gis_trace_add_subprocess (self->trace, "gpg", self->verify_pid,
+                              self->verify_start_usec,
+                              g_get_monotonic_time ());
+  self->verify_pid = 0;
+
+  ok = g_subprocess_wait_check_finish (gpg_subprocess, result, &error);
+  if (ok)
+    {
+      /* GPG may finish long before the image has been read, if it was only
+       * verifying a split image's manifest.
+       */
+      self->verify_progress = 1;
+      g_task_return_boolean (task, TRUE);
+    }
+  else
+    {
+      /* TODO: surface more details about the error */
+      g_message ("GPG subprocess failed: %s", error->message);
+      task_return_new_error (self, task, GIS_IMAGE_ERROR,
+                             GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                             _("Image verification error."));
+    }
+}
+
+/*
+ * If the GPG subprocess cannot be started, this function will return %NULL,
+ * and @callback will fire later with the error. Otherwise, it will return
+ * a #GOutputStream for the GPG subprocess' stdin, and @callback will be called
+ * later with the result of verifying the image.
+ *
+ * Returns: (transfer full): the GPG subprocess' stdin, or %NULL on error.
+ */
+static GOutputStream *
+gis_scribe_begin_verify_gpg (GisScribe *self,
+                             GCancellable *cancellable,
+                             GAsyncReadyCallback callback,
+                             gpointer data)
+{
+  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, data);
+  GisScribeGpgData *task_data = g_slice_new0 (GisScribeGpgData);
+  g_autofree gchar *signature_path = g_file_get_path (self->signature);
+  g_autofree gchar *size_str = g_strdup_printf ("%" G_GUINT64_FORMAT,
+                                                self->compressed_size_bytes);
+  const gchar * const args[] = {
+      self->gpg_path,
+      "--enable-progress-filter", "--status-fd", "1",
+      /* Trust the one key in this keyring, and no others */
+      "--keyring", self->keyring_path,
+      "--no-default-keyring",
+      "--trust-model", "always",
+      "--input-size-hint", size_str,
+      "--verify", signature_path, "-", NULL
+  };
+  g_autofree gchar *args_flat = g_strjoinv (" ", (gchar **) args);
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  GInputStream *gpg_stdout = NULL;
+  GOutputStream *gpg_stdin = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_task_set_source_tag (task, GUINT_TO_POINTER (GIS_SCRIBE_TASK_VERIFY));
+  g_task_set_task_data (task, task_data,
+                        (GDestroyNotify) gis_scribe_gpg_data_free);
+
+  if (!g_file_query_exists (self->signature, NULL))
+    {
+      task_return_new_error (
+          self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+          _("The signature file ‘%s’ does not exist."),
+          signature_path);
+      return NULL;
+    }
+
+  g_message ("Spawning %s", args_flat);
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDIN_PIPE |
+                                        G_SUBPROCESS_FLAGS_STDOUT_PIPE);
+  task_data->subprocess = g_subprocess_launcher_spawnv (launcher, args, &error);
+  if (task_data->subprocess == NULL)
+    {
+      task_return_error (self, task, g_steal_pointer (&error));
+      return NULL;
+    }
+
+  self->verify_pid = gis_scribe_get_subprocess_pid (task_data->subprocess);
+  self->verify_start_usec = g_get_monotonic_time ();
+  gpg_stdin = g_subprocess_get_stdin_pipe (task_data->subprocess);
+
+  gpg_stdout = g_subprocess_get_stdout_pipe (task_data->subprocess);
+  g_assert (G_IS_POLLABLE_INPUT_STREAM (gpg_stdout));
+  task_data->stdout_ = g_data_input_stream_new (gpg_stdout);
+  task_data->stdout_source =
+    g_pollable_input_stream_create_source (G_POLLABLE_INPUT_STREAM (gpg_stdout),
+                                           cancellable);
+  g_task_attach_source (task, task_data->stdout_source,
+                        (GSourceFunc) (void (*)(void)) gis_scribe_gpg_progress);
+
+  g_subprocess_wait_check_async (task_data->subprocess, cancellable,
+                                 gis_scribe_gpg_wait_check_cb,
+                                 g_steal_pointer (&task));
+
+  return g_object_ref (gpg_stdin);
+}
+
+static void
+checksum_in_thread (GTask        *task,
+                    gpointer      source,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
+{
+  GisScribe *self = source;
+  GisScribeChecksumData *checksum_data = task_data;
+  gsize len;
+  guint8 buf[BUFFER_SIZE];
+  g_autoptr(GChecksum) sha256sum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr(GError) error = NULL;
+  guint64 bytes_checksummed = 0;
+  const gchar *digest;
+
+  gis_scribe_trace_thread (self, "checksum");
+
+  for (;;) {
+    gint64 start_usec = g_get_monotonic_time ();
+    gint64 read_usec;
+
+    if (!g_input_stream_read_all (checksum_data->input, buf, sizeof (buf), &len,
+                                  NULL, &error))
+      {
+        task_return_error (self, task, g_steal_pointer (&error));
+        return;
+      }
+
+    if (len == 0)
+      break;
+
+    read_usec = gis_scribe_trace (self, "wait-for-data",
+                                  start_usec, len) - start_usec;
+    start_usec += read_usec;
+    GIS_PROBE2 (checksum__chunk__start, bytes_checksummed, len);
+    g_checksum_update (sha256sum, buf, len);
+    GIS_PROBE2 (checksum__chunk__done, bytes_checksummed, len);
+    /* The tee counts the bytes it feeds to the verifier. */
+    gis_scribe_record_stage (self, NULL, GIS_SCRIBE_STAGE_VERIFY, 0, 0,
+                             gis_scribe_trace (self, "hash",
+                                               start_usec, len) - start_usec,
+                             read_usec, 0);
+
+    bytes_checksummed += len;
+    self->verify_progress = ((gdouble) bytes_checksummed) / ((gdouble) self->compressed_size_bytes);
+  }
+
+  digest = g_checksum_get_string (sha256sum);
+  if (g_strcmp0 (digest, checksum_data->expected_checksum) != 0)
+    {
+      task_return_new_error (
+          self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+          _("Image checksum ‘%s‘ does not match expected checksum ‘%s‘."),
+          digest, checksum_data->expected_checksum);
+      return;
+    }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static GOutputStream *
+gis_scribe_begin_verify_checksum (GisScribe           *self,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             data)
+{
+  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, data);
+  GisScribeChecksumData *task_data = g_slice_new0 (GisScribeChecksumData);
+  g_autofree gchar *checksum_path = g_file_get_path (self->checksum);
+  g_autofree gchar *checksum_contents = NULL;
+  g_auto(GStrv) checksum_words = NULL;
+  gsize checksum_len;
+  gchar *cur;
+  gint pipefd[2];
+  g_autoptr(GError) error = NULL;
+
+  g_task_set_source_tag (task, GUINT_TO_POINTER (GIS_SCRIBE_TASK_VERIFY));
+  g_task_set_task_data (task, task_data,
+                        (GDestroyNotify) gis_scribe_checksum_data_free);
+
+  if (!g_file_query_exists (self->checksum, NULL))
+    {
+      task_return_new_error (
+          self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+          _("The checksum file ‘%s’ does not exist."),
+          checksum_path);
+      return NULL;
+    }
+
+  /* Read in the checksum file to get the expected checksum. */
+  if (!g_file_load_contents (self->checksum, cancellable, &checksum_contents,
+                             &checksum_len, NULL, &error))
+    {
+      task_return_error (self, task, g_steal_pointer (&error));
+      return NULL;
+    }
+
+  g_strstrip (checksum_contents);
+  checksum_words = g_strsplit (checksum_contents, " ", -1);
+  if (checksum_words[0] == NULL)
+    {
+      task_return_new_error (
+          self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+          _("The checksum file ‘%s’ does not contain a checksum."),
+          checksum_path);
+      return NULL;
+    }
+
+  if (strlen (checksum_words[0]) != CHECKSUM_STRLEN)
+    {
+      task_return_new_error (
+          self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+          _("The checksum ‘%s’ does not contain %d characters."),
+          checksum_words[0], CHECKSUM_STRLEN);
+      return NULL;
+    }
+
+  for (cur = checksum_words[0]; cur && *cur; cur++)
+    {
+      if (!g_ascii_isxdigit (*cur)) {
+        task_return_new_error (
+            self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+            _("The checksum ‘%s’ contains invalid character ‘%c’."),
+            checksum_words[0], *cur);
+        return NULL;
+      }
+    }
+
+  g_strlcpy (task_data->expected_checksum, checksum_words[0],
+             sizeof (task_data->expected_checksum));
+
+  if (!g_unix_open_pipe (pipefd, FD_CLOEXEC, &error))
+    {
+      task_return_error (self, task, g_steal_pointer (&error));
+      return FALSE;
+    }
+
+  task_data->input = g_unix_input_stream_new (pipefd[0], TRUE);
+  g_task_run_in_thread (task, checksum_in_thread);
+
+  return g_unix_output_stream_new (pipefd[1], TRUE);
+}
+
+static void
+gis_scribe_tee_close (GisScribeTeeData *data,
+                      GCancellable     *cancellable)
+{
+  if (data->image_input != NULL)
+    gis_scribe_close_input_stream_or_warn (data->image_input, cancellable,
+                                           "file input stream");
+
+  /* Closing the verify pipe will ultimately cause the GPG subprocess to
+   * exit when stdin is closed or the checksum read thread to terminate.
+   */
+  if (data->verify_pipe != NULL)
+    gis_scribe_close_output_stream_or_warn (data->verify_pipe, cancellable,
+                                            "verify pipe");
+
+  /* Similarly, closing the pipe will cause the write thread to terminate. */
+  gis_scribe_close_output_stream_or_warn (data->write_pipe, cancellable,
+                                          "write pipe");
+}
+
+static void
+gis_scribe_tee_data_free (GisScribeTeeData *data)
+{
+  gis_scribe_tee_close (data, NULL);
+
+  g_clear_object (&data->image_input);
+  g_clear_object (&data->verify_pipe);
+  g_clear_object (&data->write_pipe);
+
+  g_slice_free (GisScribeTeeData, data);
+}
+
+/* A split image's signature is for its manifest, which lists the checksum
+ * of each part; the parts themselves are checked as they are read. So the
+ * manifest, rather than the image, is written to the verify pipe, which is
+ * then closed.
+ */
+static gboolean
+gis_scribe_tee_manifest (GisScribe        *self,
+                         GisScribeTeeData *task_data,
+                         GCancellable     *cancellable,
+                         GError          **error)
+{
+  g_autoptr(GFile) manifest = gis_split_image_get_manifest (self->image);
+  g_autoptr(GFileInputStream) input = g_file_read (manifest, cancellable,
+                                                   error);
+
+  if (input == NULL ||
+      g_output_stream_splice (task_data->verify_pipe, G_INPUT_STREAM (input),
+                              G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                              G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                              cancellable, error) < 0)
+    {
+      g_prefix_error (error, "error writing manifest to verifier: ");
+      return FALSE;
+    }
+
+  g_clear_object (&task_data->verify_pipe);
+  return TRUE;
+}
+
+/* Reads the image from disk and writes it to both the verify pipe (if any)
+ * and the writer thread.
+ */
+static void
+gis_scribe_tee_thread (GTask            *task,
+                       gpointer          source_object,
+                       GisScribeTeeData *task_data,
+                       GCancellable     *cancellable)
+{
+  GisScribe *self = GIS_SCRIBE (source_object);
+  g_autofree gchar *buffer = gis_scribe_malloc_aligned (BUFFER_SIZE);
+  g_autoptr(GError) error = NULL;
+  guint64 bytes_teed = 0;
+  gssize r = -1;
+
+  gis_scribe_trace_thread (self, "tee");
+
+  if (task_data->verify_pipe != NULL &&
+      gis_split_image_is_split (self->image) &&
+      !gis_scribe_tee_manifest (self, task_data, cancellable, &error))
+    {
+      task_return_error (self, task, g_steal_pointer (&error));
+      gis_scribe_tee_close (task_data, cancellable);
+      return;
+    }
+
+  do
+    {
+      gint64 start_usec = g_get_monotonic_time ();
+      gint64 feed_start_usec;
+      gint64 read_usec;
+      gint64 feed_usec;
+
+      GIS_PROBE1 (tee__read__start, bytes_teed);
+      r = g_input_stream_read (task_data->image_input, buffer, BUFFER_SIZE,
+                               cancellable, &error);
+
+      if (r < 0)
+        {
+          g_prefix_error (&error, "error reading image: ");
+          break;
+        }
+
+      GIS_PROBE2 (tee__read__done, bytes_teed, r);
+
+      read_usec = gis_scribe_trace (self, "read", start_usec, r) - start_usec;
+      start_usec += read_usec;
+      feed_start_usec = start_usec;
+
+      if (task_data->verify_pipe != NULL)
+        {
+          if (!g_output_stream_write_all (task_data->verify_pipe, buffer, r,
+                                          NULL, cancellable, &error))
+            {
+              g_prefix_error (&error, "error writing image to verifier: ");
+              break;
+            }
+
+          feed_start_usec = gis_scribe_trace (self, "feed-verify",
+                                              feed_start_usec, r);
+        }
+
+      if (!g_output_stream_write_all (task_data->write_pipe, buffer, r,
+                                      NULL, cancellable, &error))
+        {
+          g_prefix_error (&error, "error writing image to self: ");
+          break;
+        }
+
+      feed_usec = gis_scribe_trace (self, "feed-decompress",
+                                    feed_start_usec, r) - start_usec;
+      GIS_PROBE2 (tee__chunk__done, bytes_teed, r);
+
+      /* If reading means decompressing, the tee is waiting for its
+       * upstream stage rather than for the source.
+       */
+      if (task_data->input_decompresses)
+        {
+          gis_scribe_record_stage (self, NULL, GIS_SCRIBE_STAGE_TEE, r, r,
+                                   0, read_usec, feed_usec);
+          gis_scribe_record_stage (self, NULL, GIS_SCRIBE_STAGE_DECOMPRESS,
+                                   r, 0, read_usec, 0, 0);
+        }
+      else
+        {
+          gis_scribe_record_stage (self, NULL, GIS_SCRIBE_STAGE_TEE, r, r,
+                                   read_usec, 0, feed_usec);
+          gis_scribe_record_stage (self, NULL, GIS_SCRIBE_STAGE_DECOMPRESS,
+                                   r, 0, 0, 0, 0);
+        }
+      gis_scribe_record_pipe_queue (self, GIS_SCRIBE_STAGE_DECOMPRESS,
+                                    task_data->write_pipe);
+      if (task_data->verify_pipe != NULL)
+        {
+          gis_scribe_record_stage (self, NULL, GIS_SCRIBE_STAGE_VERIFY,
+                                   r, 0, 0, 0, 0);
+          gis_scribe_record_pipe_queue (self, GIS_SCRIBE_STAGE_VERIFY,
+                                        task_data->verify_pipe);
+        }
+
+      bytes_teed += r;
+    }
+  while (r > 0);
+
+  if (error == NULL && bytes_teed != self->compressed_size_bytes)
+    g_set_error (&error, GIS_INSTALL_ERROR, GIS_INSTALL_ERROR_INTERNAL_ERROR,
+                 "%s: teed %" G_GUINT64_FORMAT " bytes but "
+                 "compressed size was %" G_GUINT64_FORMAT " bytes",
+                 _("Internal error"),
+                 bytes_teed, self->compressed_size_bytes);
+
+  if (error == NULL)
+    g_task_return_boolean (task, TRUE);
+  else
+    task_return_error (self, task, g_steal_pointer (&error));
+
+  gis_scribe_tee_close (task_data, cancellable);
+}
+
+/* Opens :image for reading, from its extents on :image-device-fd if
+ * possible. Split images are decompressed here, part by part, rather than by
+ * gis_scribe_begin_decompress(). Images on HTTP servers are fetched by
+ * gis_image_reader_open().
+ */
+static GInputStream *
+gis_scribe_open_image (GisScribe    *self,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  g_autoptr(GError) local_error = NULL;
+
+  if (gis_split_image_is_split (self->image))
+    return gis_split_image_reader_open (self->image, cancellable, error);
+
+  /* The extents of a squashfs are of no use: the image within it must be
+   * decompressed.
+   */
+  if (self->image_device_fd >= 0 &&
+      !gis_squashfs_reader_is_squashfs (self->image))
+    {
+      g_autoptr(GArray) extents =
+        gis_image_extents_query (self->image, self->image_device_fd,
+                                 &local_error);
+      gint device_fd;
+
+      if (extents != NULL)
+        {
+          /* The reader owns its fd, and the device may be read again for
+           * the next write.
+           */
+          device_fd = fcntl (self->image_device_fd, F_DUPFD_CLOEXEC, 3);
+          if (device_fd < 0)
+            return glnx_null_throw_errno_prefix (error,
+                                                 "can't duplicate image device fd");
+
+          g_message ("reading image from %u extents on its device",
+                     extents->len);
+          return gis_image_reader_new_for_extents (device_fd, extents);
+        }
+
+      g_message ("reading image through the filesystem: %s",
+                 local_error->message);
+    }
+
+  return gis_image_reader_open (self->image, cancellable, error);
+}
+
+static void
+gis_scribe_begin_tee (GisScribe          *self,
+                      GOutputStream      *verify_pipe,
+                      GOutputStream      *write_pipe,
+                      GCancellable       *cancellable,
+                      GAsyncReadyCallback callback,
+                      gpointer            user_data)
+{
+  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
+  GisScribeTeeData *task_data = g_slice_new0 (GisScribeTeeData);
+  g_autoptr(GError) error = NULL;
+
+  if (verify_pipe != NULL)
+    task_data->verify_pipe = g_object_ref (verify_pipe);
+  task_data->write_pipe = g_object_ref (write_pipe);
+
+  g_task_set_source_tag (task, GUINT_TO_POINTER (GIS_SCRIBE_TASK_TEE));
+  g_task_set_task_data (task, task_data,
+                        (GDestroyNotify) gis_scribe_tee_data_free);
+
+  if (self->image_input != NULL)
+    {
+      task_data->image_input = g_steal_pointer (&self->image_input);
+    }
+  else
+    {
+      task_data->image_input =
+        gis_scribe_open_image (self, cancellable, &error);
+      task_data->input_decompresses =
+        gis_split_image_is_split (self->image) ||
+        gis_squashfs_reader_is_squashfs (self->image);
+    }
+
+  if (task_data->image_input == NULL)
+    {
+      task_return_error (self, task, g_steal_pointer (&error));
+      gis_scribe_tee_close (task_data, cancellable);
+    }
+  else
+    {
+      g_task_run_in_thread (task, (GTaskThreadFunc) gis_scribe_tee_thread);
+    }
+}
+
+static void
+gis_scribe_decompress_wait_check_cb (GObject      *source,
+                                     GAsyncResult *result,
+                                     gpointer      data)
+{
+  g_autoptr(GSubprocess) subprocess = G_SUBPROCESS (source);
+  g_autoptr(GTask) task = G_TASK (data);
   GisScribe *self = GIS_SCRIBE (g_task_get_source_object (task));
-  GisScribeGpgData *task_data = g_task_get_task_data (task);
-  gboolean ok;
   g_autoptr(GError) error = NULL;
 
-  g_clear_pointer (&task_data->stdout_source, g_source_destroy);
+  if (self->trace != NULL)
+    gis_trace_add_subprocess (self->trace, self->decompress_name,
+                              self->decompress_pid,
+                              self->decompress_start_usec,
+                              g_get_monotonic_time ());
+  self->decompress_pid = 0;
 
-  ok = g_subprocess_wait_check_finish (gpg_subprocess, result, &error);
-  if (ok)
+  if (g_subprocess_wait_check_finish (subprocess, result, &error))
     {
       g_task_return_boolean (task, TRUE);
     }
   else
     {
-      /* TODO: surface more details about the error */
-      g_message ("GPG subprocess failed: %s", error->message);
-      task_return_new_error (self, task, GIS_IMAGE_ERROR,
-                             GIS_IMAGE_ERROR_VERIFICATION_FAILED,
-                             _("Image verification error."));
+      g_message ("decompressor subprocess failed: %s", error->message);
+      task_return_new_error (self, task, GIS_INSTALL_ERROR,
+                             GIS_INSTALL_ERROR_DECOMPRESSION_FAILED,
+                             _("Could not decompress the image file."));
     }
 }
 
-/*
- * If the GPG subprocess cannot be started, this function will return %NULL,
- * and @callback will fire later with the error. Otherwise, it will return
- * a #GOutputStream for the GPG subprocess' stdin, and @callback will be called
- * later with the result of verifying the image.
+
+/* Spawns a subprocess to decompress the image. This function returns %TRUE
+ * with @compressed and @decompressed set if spawning the subprocess succeeds;
+ * and %FALSE with both unset if not. In either case, callback will fire when
+ * the subprocess terminates (which may be immediately).
  *
- * Returns: (transfer full): the GPG subprocess' stdin, or %NULL on error.
+ * The appropriate decompressor is determined from the image file name. If it's
+ * uncompressed, @compressed and @decompressed will be the two ends of a
+ * pipe-to-self and no subprocess will be launched. (@callback will fire with
+ * success.) If the decompressor can't be determined, returns %FALSE and fires
+ * @callback with error.
+ *
+ * @compressed: (out): socket to write compressed image data to
+ * @decompressed: (out): socket to read decompressed image data from
  */
-static GOutputStream *
-gis_scribe_begin_verify_gpg (GisScribe *self,
-                             GCancellable *cancellable,
+static gboolean
+gis_scribe_begin_decompress (GisScribe          *self,
+                             GOutputStream     **compressed,
+                             GInputStream      **decompressed,
+                             GCancellable       *cancellable,
                              GAsyncReadyCallback callback,
-                             gpointer data)
+                             gpointer            user_data)
 {
-  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, data);
-  GisScribeGpgData *task_data = g_slice_new0 (GisScribeGpgData);
-  g_autofree gchar *signature_path = g_file_get_path (self->signature);
-  g_autofree gchar *size_str = g_strdup_printf ("%" G_GUINT64_FORMAT,
-                                                self->compressed_size_bytes);
-  const gchar * const args[] = {
-      self->gpg_path,
-      "--enable-progress-filter", "--status-fd", "1",
-      /* Trust the one key in this keyring, and no others */
-      "--keyring", self->keyring_path,
-      "--no-default-keyring",
-      "--trust-model", "always",
-      "--input-size-hint", size_str,
-      "--verify", signature_path, "-", NULL
-  };
-  g_autofree gchar *args_flat = g_strjoinv (" ", (gchar **) args);
+  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
+  g_autofree gchar *basename = NULL;
+  const gchar *args[] = { NULL, "-cd", NULL };
   g_autoptr(GSubprocessLauncher) launcher = NULL;
-  GInputStream *gpg_stdout = NULL;
-  GOutputStream *gpg_stdin = NULL;
+  GSubprocess *subprocess = NULL;
   g_autoptr(GError) error = NULL;
 
-  g_task_set_source_tag (task, GUINT_TO_POINTER (GIS_SCRIBE_TASK_VERIFY));
-  g_task_set_task_data (task, task_data,
-                        (GDestroyNotify) gis_scribe_gpg_data_free);
+  g_task_set_source_tag (task, GUINT_TO_POINTER (GIS_SCRIBE_TASK_DECOMPRESS));
+
+  basename = g_file_get_basename (self->image);
+  if (basename == NULL)
+    {
+      /* This path should not be reached since g_file_get_basename() cannot
+       * return NULL for local files. To avoid translators translating a
+       * technical message which should never be shown, we only mark "Internal
+       * error" for translation.
+       */
+      g_set_error (&error, GIS_INSTALL_ERROR, GIS_INSTALL_ERROR_INTERNAL_ERROR,
+                   "%s: %s",
+                   _("Internal error"),
+                   "g_file_get_basename returned NULL.");
+      g_critical ("%s", error->message);
+      task_return_error (self, task, g_steal_pointer (&error));
+      return FALSE;
+    }
+
+  /* TODO: use more magical means */
+  if (g_str_has_suffix (basename, "gz"))
+    {
+      args[0] = "gzip";
+    }
+  else if (g_str_has_suffix (basename, "xz"))
+    {
+      args[0] = "xz";
+    }
+  else if (g_str_has_suffix (basename, "img")
+           || g_strcmp0 (basename, "endless-image") == 0
+           || gis_squashfs_reader_is_squashfs (self->image)
+           || gis_split_image_is_split (self->image))
+    {
+      gint pipefd[2];
 
-  if (!g_file_query_exists (self->signature, NULL))
+      if (!g_unix_open_pipe (pipefd, FD_CLOEXEC, &error))
+        {
+          task_return_error (self, task, g_steal_pointer (&error));
+          return FALSE;
+        }
+
+      *compressed = g_unix_output_stream_new (pipefd[1], /* close_fd */ TRUE);
+      *decompressed = g_unix_input_stream_new (pipefd[0], /* close_fd */ TRUE);
+      g_task_return_boolean (task, TRUE);
+      return TRUE;
+    }
+  else
     {
-      task_return_new_error (
-          self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
-          _("The signature file ‘%s’ does not exist."),
-          signature_path);
-      return NULL;
+      /* This should not be reachable, because only images with known
+       * extensions are shown on the image selection page.
+       */
+      task_return_new_error (self, task, GIS_INSTALL_ERROR,
+                             GIS_INSTALL_ERROR_INTERNAL_ERROR,
+                             "%s: ‘%s’ ends in neither ‘.xz’, ‘.gz’ nor ‘.img’.",
+                             _("Internal error"),
+                             basename);
+      return FALSE;
     }
 
-  g_message ("Spawning %s", args_flat);
   launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDIN_PIPE |
                                         G_SUBPROCESS_FLAGS_STDOUT_PIPE);
-  task_data->subprocess = g_subprocess_launcher_spawnv (launcher, args, &error);
-  if (task_data->subprocess == NULL)
+  subprocess = g_subprocess_launcher_spawnv (launcher, args, &error);
+  if (subprocess == NULL)
     {
       task_return_error (self, task, g_steal_pointer (&error));
-      return NULL;
+      return FALSE;
     }
 
-  gpg_stdin = g_subprocess_get_stdin_pipe (task_data->subprocess);
-
-  gpg_stdout = g_subprocess_get_stdout_pipe (task_data->subprocess);
-  g_assert (G_IS_POLLABLE_INPUT_STREAM (gpg_stdout));
-  task_data->stdout_ = g_data_input_stream_new (gpg_stdout);
-  task_data->stdout_source =
-    g_pollable_input_stream_create_source (G_POLLABLE_INPUT_STREAM (gpg_stdout),
-                                           cancellable);
-  g_task_attach_source (task, task_data->stdout_source,
-                        (GSourceFunc) (void (*)(void)) gis_scribe_gpg_progress);
+  self->decompress_pid = gis_scribe_get_subprocess_pid (subprocess);
+  self->decompress_start_usec = g_get_monotonic_time ();
+  self->decompress_name = args[0];
+  *compressed = g_object_ref (g_subprocess_get_stdin_pipe (subprocess));
+  *decompressed = g_object_ref (g_subprocess_get_stdout_pipe (subprocess));
 
-  g_subprocess_wait_check_async (task_data->subprocess, cancellable,
-                                 gis_scribe_gpg_wait_check_cb,
+  g_subprocess_wait_check_async (subprocess, cancellable,
+                                 gis_scribe_decompress_wait_check_cb,
                                  g_steal_pointer (&task));
 
-  return g_object_ref (gpg_stdin);
+  return TRUE;
 }
 
-static void
-checksum_in_thread (GTask        *task,
-                    gpointer      source,
-                    gpointer      task_data,
-                    GCancellable *cancellable)
+/* Returns a copy of the error that the first failed target failed with, or
+ * %NULL if none has failed. Must be called with self->mutex held.
+ */
+static GError *
+gis_scribe_dup_first_target_error (GisScribe *self)
 {
-  GisScribe *self = source;
-  GisScribeChecksumData *checksum_data = task_data;
-  gsize len;
-  guint8 buf[BUFFER_SIZE];
-  g_autoptr(GChecksum) sha256sum = g_checksum_new (G_CHECKSUM_SHA256);
-  g_autoptr(GError) error = NULL;
-  guint64 bytes_checksummed = 0;
-  const gchar *digest;
-
-  for (;;) {
-    if (!g_input_stream_read_all (checksum_data->input, buf, sizeof (buf), &len,
-                                  NULL, &error))
-      {
-        task_return_error (self, task, g_steal_pointer (&error));
-        return;
-      }
+  guint i;
 
-    if (len == 0)
-      break;
+  for (i = 0; i < self->targets->len; i++)
+    {
+      GisScribeTarget *target = g_ptr_array_index (self->targets, i);
+      GError *error;
 
-    g_checksum_update (sha256sum, buf, len);
+      if (target->error == NULL)
+        continue;
 
-    bytes_checksummed += len;
-    self->verify_progress = ((gdouble) bytes_checksummed) / ((gdouble) self->image_size_bytes);
-  }
+      error = g_error_copy (target->error);
+      /* With more than one target, make it clear which one failed. */
+      if (self->targets->len > 1)
+        g_prefix_error (&error, "%s: ", target->drive_path);
 
-  digest = g_checksum_get_string (sha256sum);
-  if (g_strcmp0 (digest, checksum_data->expected_checksum) != 0)
-    {
-      task_return_new_error (
-          self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
-          _("Image checksum ‘%s‘ does not match expected checksum ‘%s‘."),
-          digest, checksum_data->expected_checksum);
-      return;
+      return error;
     }
 
-  g_task_return_boolean (task, TRUE);
+  return NULL;
 }
 
-static GOutputStream *
-gis_scribe_begin_verify_checksum (GisScribe           *self,
-                                  GCancellable        *cancellable,
-                                  GAsyncReadyCallback  callback,
-                                  gpointer             data)
+/* Marks @task_flag as no longer outstanding. Returns %TRUE if no tasks are
+ * outstanding any more, in which case the whole operation has completed and
+ * @outer_error is set to the error it failed with, if any. Must be called with
+ * self->mutex held.
+ */
+static gboolean
+gis_scribe_clear_outstanding_task (GisScribe     *self,
+                                   GisScribeTask  task_flag,
+                                   GError       **outer_error)
 {
-  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, data);
-  GisScribeChecksumData *task_data = g_slice_new0 (GisScribeChecksumData);
-  g_autofree gchar *checksum_path = g_file_get_path (self->checksum);
-  g_autofree gchar *checksum_contents = NULL;
-  g_auto(GStrv) checksum_words = NULL;
-  gsize checksum_len;
-  gchar *cur;
-  gint pipefd[2];
-  g_autoptr(GError) error = NULL;
-
-  g_task_set_source_tag (task, GUINT_TO_POINTER (GIS_SCRIBE_TASK_VERIFY));
-  g_task_set_task_data (task, task_data,
-                        (GDestroyNotify) gis_scribe_checksum_data_free);
-
-  if (!g_file_query_exists (self->checksum, NULL))
+  /* This task should be outstanding */
+  g_assert_cmpint (self->outstanding_tasks & task_flag, ==, task_flag);
+  if (task_flag == GIS_SCRIBE_TASK_WRITE)
     {
-      task_return_new_error (
-          self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
-          _("The checksum file ‘%s’ does not exist."),
-          checksum_path);
-      return NULL;
+      g_assert_cmpuint (self->outstanding_writes, >, 0);
+      self->outstanding_writes--;
     }
 
-  /* Read in the checksum file to get the expected checksum. */
-  if (!g_file_load_contents (self->checksum, cancellable, &checksum_contents,
-                             &checksum_len, NULL, &error))
-    {
-      task_return_error (self, task, g_steal_pointer (&error));
-      return NULL;
-    }
+  if (task_flag != GIS_SCRIBE_TASK_WRITE || self->outstanding_writes == 0)
+    self->outstanding_tasks &= ~task_flag;
 
-  g_strstrip (checksum_contents);
-  checksum_words = g_strsplit (checksum_contents, " ", -1);
-  if (checksum_words[0] == NULL)
-    {
-      task_return_new_error (
-          self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
-          _("The checksum file ‘%s’ does not contain a checksum."),
-          checksum_path);
-      return NULL;
-    }
+  if (self->outstanding_tasks != 0)
+    return FALSE;
 
-  if (strlen (checksum_words[0]) != CHECKSUM_STRLEN)
-    {
-      task_return_new_error (
-          self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
-          _("The checksum ‘%s’ does not contain %d characters."),
-          checksum_words[0], CHECKSUM_STRLEN);
-      return NULL;
-    }
+  /* could steal self->error since all subtasks are now dead but it's
+   * useful to know that once set, it remains set until the next write.
+   */
+  if (self->error != NULL)
+    *outer_error = g_error_copy (self->error);
+  else
+    *outer_error = gis_scribe_dup_first_target_error (self);
 
-  for (cur = checksum_words[0]; cur && *cur; cur++)
-    {
-      if (!g_ascii_isxdigit (*cur)) {
-        task_return_new_error (
-            self, task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
-            _("The checksum ‘%s’ contains invalid character ‘%c’."),
-            checksum_words[0], *cur);
-        return NULL;
-      }
-    }
+  self->running = FALSE;
+  return TRUE;
+}
 
-  g_strlcpy (task_data->expected_checksum, checksum_words[0],
-             sizeof (task_data->expected_checksum));
+static void
+gis_scribe_return_outer_task (GTask  *outer_task,
+                              GError *outer_error)
+{
+  if (outer_error != NULL)
+    g_task_return_error (outer_task, outer_error);
+  else
+    g_task_return_boolean (outer_task, TRUE);
+}
 
-  if (!g_unix_open_pipe (pipefd, FD_CLOEXEC, &error))
+static void
+gis_scribe_subtask_cb (GObject      *source,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  GisScribe *self = GIS_SCRIBE (source);
+  g_autoptr(GTask) outer_task = G_TASK (user_data);
+  GTask *inner_task = G_TASK (result);
+  GisScribeTask task_flag = GPOINTER_TO_INT (g_task_get_source_tag (inner_task));
+  const gchar *inner_task_name = gis_scribe_task_get_label (task_flag);
+  g_autoptr(GError) error = NULL;
+  gboolean completed;
+  GError *outer_error = NULL;
+
+  /* Guard access to self->outstanding_tasks and self->error. */
+  g_mutex_lock (&self->mutex);
+
+  if (g_task_propagate_boolean (inner_task, &error))
     {
-      task_return_error (self, task, g_steal_pointer (&error));
-      return FALSE;
+      g_debug ("%s: %s completed successfully", G_STRFUNC, inner_task_name);
     }
+  else
+    {
+      /* Whichever task failed first should set this; except that a failure
+       * to write to one target does not affect the others.
+       */
+      g_warn_if_fail (self->error != NULL || task_flag == GIS_SCRIBE_TASK_WRITE);
 
-  task_data->input = g_unix_input_stream_new (pipefd[0], TRUE);
-  g_task_run_in_thread (task, checksum_in_thread);
-
-  return g_unix_output_stream_new (pipefd[1], TRUE);
-}
+      g_message ("%s: %s failed: %s", G_STRFUNC, inner_task_name,
+                 error->message);
+      g_clear_error (&error);
+    }
 
-static void
-gis_scribe_tee_close (GisScribeTeeData *data,
-                      GCancellable     *cancellable)
-{
-  if (data->image_input != NULL)
-    gis_scribe_close_input_stream_or_warn (data->image_input, cancellable,
-                                           "file input stream");
+  completed = gis_scribe_clear_outstanding_task (self, task_flag,
+                                                 &outer_error);
 
-  /* Closing the verify pipe will ultimately cause the GPG subprocess to
-   * exit when stdin is closed or the checksum read thread to terminate.
+  /* Alert the write threads, if they're already waiting, that
+   * self->outstanding_tasks and self->error have been updated.
    */
-  gis_scribe_close_output_stream_or_warn (data->verify_pipe, cancellable,
-                                          "verify pipe");
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
 
-  /* Similarly, closing the pipe will cause the write thread to terminate. */
-  gis_scribe_close_output_stream_or_warn (data->write_pipe, cancellable,
-                                          "write pipe");
+  /* The callback may inspect the targets or start another write, both of
+   * which take the lock, so only return once it has been released.
+   */
+  if (completed)
+    {
+      self->end_time_usec = g_get_monotonic_time ();
+      gis_scribe_log_metrics (self);
+      gis_scribe_return_outer_task (outer_task, outer_error);
+    }
 }
 
 static void
-gis_scribe_tee_data_free (GisScribeTeeData *data)
+gis_scribe_setpipe_sz (const gchar          *what,
+                       GFileDescriptorBased *stream)
 {
-  gis_scribe_tee_close (data, NULL);
-
-  g_clear_object (&data->image_input);
-  g_clear_object (&data->verify_pipe);
-  g_clear_object (&data->write_pipe);
+  int fd = g_file_descriptor_based_get_fd (stream);
 
-  g_slice_free (GisScribeTeeData, data);
+  if (fcntl (fd, F_SETPIPE_SZ, BUFFER_SIZE) < 0)
+    g_warning ("failed to set %s pipe size to %d: %s",
+               what, BUFFER_SIZE, g_strerror (errno));
 }
 
-/* Reads the image from disk and writes it to both the verify pipe and the
- * writer thread.
+/* Starts the subtasks which read, verify and decompress the image; if
+ * @preverified is %TRUE, the image is not verified again. Returns a stream
+ * from which to read the decompressed image, or %NULL if one of the subtasks
+ * could not be started (in which case it will have failed @task).
  */
-static void
-gis_scribe_tee_thread (GTask            *task,
-                       gpointer          source_object,
-                       GisScribeTeeData *task_data,
-                       GCancellable     *cancellable)
+static GInputStream *
+gis_scribe_begin_read (GisScribe    *self,
+                       gboolean      verify_gpg,
+                       gboolean      preverified,
+                       GCancellable *cancellable,
+                       GTask        *task)
 {
-  GisScribe *self = GIS_SCRIBE (source_object);
-  g_autofree gchar *buffer = gis_scribe_malloc_aligned (BUFFER_SIZE);
-  g_autoptr(GError) error = NULL;
-  guint64 bytes_teed = 0;
-  gssize r = -1;
+  g_autoptr(GInputStream) decompressed = NULL;
+  g_autoptr(GOutputStream) write_pipe = NULL;
+  g_autoptr(GOutputStream) verify_pipe = NULL;
 
-  do
-    {
-      r = g_input_stream_read (task_data->image_input, buffer, BUFFER_SIZE,
-                               cancellable, &error);
+  /* Attempt to spawn decompressor subprocess (or pipe-to-self) */
+  g_mutex_lock (&self->mutex);
+  self->outstanding_tasks |= GIS_SCRIBE_TASK_DECOMPRESS;
+  g_mutex_unlock (&self->mutex);
+  if (!gis_scribe_begin_decompress (self, &write_pipe, &decompressed,
+                                    cancellable, gis_scribe_subtask_cb,
+                                    g_object_ref (task)))
+    return NULL;
 
-      if (r < 0)
+  if (preverified)
+    {
+      self->verify_progress = 1;
+    }
+  else if (!verify_gpg && gis_split_image_is_split (self->image))
+    {
+      /* Each part is checked against the manifest as it is read. */
+      self->verify_progress = 1;
+    }
+  else
+    {
+      /* Attempt to spawn GPG subprocess or checksum thread */
+      g_mutex_lock (&self->mutex);
+      self->outstanding_tasks |= GIS_SCRIBE_TASK_VERIFY;
+      g_mutex_unlock (&self->mutex);
+      if (verify_gpg)
         {
-          g_prefix_error (&error, "error reading image: ");
-          break;
+          verify_pipe = gis_scribe_begin_verify_gpg (self, cancellable,
+                                                     gis_scribe_subtask_cb,
+                                                     g_object_ref (task));
         }
-
-      if (!g_output_stream_write_all (task_data->verify_pipe, buffer, r,
-                                      NULL, cancellable, &error))
+      else
         {
-          g_prefix_error (&error, "error writing image to verifier: ");
-          break;
+          verify_pipe = gis_scribe_begin_verify_checksum (self, cancellable,
+                                                          gis_scribe_subtask_cb,
+                                                          g_object_ref (task));
         }
 
-      if (!g_output_stream_write_all (task_data->write_pipe, buffer, r,
-                                      NULL, cancellable, &error))
+      if (verify_pipe == NULL)
         {
-          g_prefix_error (&error, "error writing image to self: ");
-          break;
+          gis_scribe_close_output_stream_or_warn (write_pipe, cancellable,
+                                                  "decompressor stdin");
+          gis_scribe_close_input_stream_or_warn (decompressed, cancellable,
+                                                 "decompressor stdout");
+          return NULL;
         }
 
-      bytes_teed += r;
+      gis_scribe_setpipe_sz ("verify input",
+                             G_FILE_DESCRIPTOR_BASED (verify_pipe));
     }
-  while (r > 0);
 
-  if (error == NULL && bytes_teed != self->compressed_size_bytes)
-    g_set_error (&error, GIS_INSTALL_ERROR, GIS_INSTALL_ERROR_INTERNAL_ERROR,
-                 "%s: teed %" G_GUINT64_FORMAT " bytes but "
-                 "compressed size was %" G_GUINT64_FORMAT " bytes",
-                 _("Internal error"),
-                 bytes_teed, self->compressed_size_bytes);
+  gis_scribe_setpipe_sz ("decompressor stdin", G_FILE_DESCRIPTOR_BASED (write_pipe));
+  gis_scribe_setpipe_sz ("decompressor stdout", G_FILE_DESCRIPTOR_BASED (decompressed));
 
-  if (error == NULL)
-    g_task_return_boolean (task, TRUE);
-  else
-    task_return_error (self, task, g_steal_pointer (&error));
+  /* Start feeding the image to the verification pipe (if any) and to the
+   * decompressor (or one end of a pipe-to-self)
+   */
+  g_mutex_lock (&self->mutex);
+  self->outstanding_tasks |= GIS_SCRIBE_TASK_TEE;
+  g_mutex_unlock (&self->mutex);
+  gis_scribe_begin_tee (self, verify_pipe, write_pipe, cancellable,
+                        gis_scribe_subtask_cb, g_object_ref (task));
 
-  gis_scribe_tee_close (task_data, cancellable);
+  return g_steal_pointer (&decompressed);
 }
 
-static void
-gis_scribe_begin_tee (GisScribe          *self,
-                      GOutputStream      *verify_pipe,
-                      GOutputStream      *write_pipe,
-                      GCancellable       *cancellable,
-                      GAsyncReadyCallback callback,
-                      gpointer            user_data)
+/* Returns %TRUE if :image-verifier has already verified :image against
+ * @verification in the background, so it need not be verified again.
+ */
+static gboolean
+gis_scribe_is_preverified (GisScribe    *self,
+                           GFile        *verification,
+                           gboolean      verify_gpg,
+                           GCancellable *cancellable)
 {
-  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
-  GisScribeTeeData *task_data = g_slice_new0 (GisScribeTeeData);
-  g_autoptr(GError) error = NULL;
+  if (self->image_verifier == NULL)
+    return FALSE;
 
-  task_data->verify_pipe = g_object_ref (verify_pipe);
-  task_data->write_pipe = g_object_ref (write_pipe);
+  /* A signature is only as trustworthy as the keyring it was checked
+   * against.
+   */
+  if (verify_gpg &&
+      g_strcmp0 (gis_image_verifier_get_keyring_path (self->image_verifier),
+                 self->keyring_path) != 0)
+    return FALSE;
 
-  g_task_set_source_tag (task, GUINT_TO_POINTER (GIS_SCRIBE_TASK_TEE));
-  g_task_set_task_data (task, task_data,
-                        (GDestroyNotify) gis_scribe_tee_data_free);
+  if (!gis_image_verifier_is_verified (self->image_verifier, self->image,
+                                       verification, cancellable))
+    return FALSE;
 
-  if (self->image_input != NULL)
-    task_data->image_input = g_steal_pointer (&self->image_input);
-  else
-    task_data->image_input =
-      G_INPUT_STREAM (g_file_read (self->image, cancellable, &error));
+  g_message ("image was verified in the background; not verifying it again");
+  return TRUE;
+}
 
-  if (task_data->image_input == NULL)
+/* Looks :image up in :image-cache. Returns a file descriptor for the cached
+ * decompressed image if it is there. Otherwise, returns -1, and sets @key to
+ * the key to cache the image under, if it can be cached.
+ */
+static gint
+gis_scribe_lookup_cache (GisScribe    *self,
+                         GFile        *verification,
+                         GCancellable *cancellable,
+                         gchar       **key)
+{
+  g_autofree gchar *local_key = NULL;
+  g_autoptr(GError) error = NULL;
+  gint fd;
+
+  if (self->image_cache == NULL)
+    return -1;
+
+  local_key = gis_image_cache_compute_key (self->image, verification,
+                                           cancellable, &error);
+  if (local_key == NULL)
     {
-      task_return_error (self, task, g_steal_pointer (&error));
-      gis_scribe_tee_close (task_data, cancellable);
+      g_message ("can't look up image in cache: %s", error->message);
+      return -1;
     }
-  else
+
+  fd = gis_image_cache_open (self->image_cache, local_key,
+                             self->image_size_bytes, &error);
+  if (fd >= 0)
     {
-      g_task_run_in_thread (task, (GTaskThreadFunc) gis_scribe_tee_thread);
+      g_message ("using cached decompressed image %s", local_key);
+      return fd;
     }
+
+  if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    g_message ("can't open cached image: %s", error->message);
+
+  *key = g_steal_pointer (&local_key);
+  return -1;
 }
 
-static void
-gis_scribe_decompress_wait_check_cb (GObject      *source,
-                                     GAsyncResult *result,
-                                     gpointer      data)
+/* Chooses how to verify :image, depending on which of :signature and
+ * :checksum exist. Fails if neither does, so that no subtasks are started.
+ */
+static gboolean
+gis_scribe_choose_verification (GisScribe    *self,
+                                GCancellable *cancellable,
+                                gboolean     *verify_gpg,
+                                GError      **error)
 {
-  g_autoptr(GSubprocess) subprocess = G_SUBPROCESS (source);
-  g_autoptr(GTask) task = G_TASK (data);
-  GisScribe *self = GIS_SCRIBE (g_task_get_source_object (task));
-  g_autoptr(GError) error = NULL;
+  g_autofree gchar *signature_path = NULL;
+  g_autofree gchar *checksum_path = NULL;
 
-  if (g_subprocess_wait_check_finish (subprocess, result, &error))
+  if (g_file_query_exists (self->signature, cancellable))
     {
-      g_task_return_boolean (task, TRUE);
+      *verify_gpg = TRUE;
+      return TRUE;
     }
-  else
+
+  if (g_file_query_exists (self->checksum, cancellable))
     {
-      g_message ("decompressor subprocess failed: %s", error->message);
-      task_return_new_error (self, task, GIS_INSTALL_ERROR,
-                             GIS_INSTALL_ERROR_DECOMPRESSION_FAILED,
-                             _("Could not decompress the image file."));
+      *verify_gpg = FALSE;
+      return TRUE;
     }
-}
 
+  signature_path = g_file_get_path (self->signature);
+  checksum_path = g_file_get_path (self->checksum);
+  g_set_error (
+      error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+      _("Neither the signature file ‘%s’ nor the checksum file ‘%s’ exist."),
+      signature_path, checksum_path);
+  return FALSE;
+}
 
-/* Spawns a subprocess to decompress the image. This function returns %TRUE
- * with @compressed and @decompressed set if spawning the subprocess succeeds;
- * and %FALSE with both unset if not. In either case, callback will fire when
- * the subprocess terminates (which may be immediately).
- *
- * The appropriate decompressor is determined from the image file name. If it's
- * uncompressed, @compressed and @decompressed will be the two ends of a
- * pipe-to-self and no subprocess will be launched. (@callback will fire with
- * success.) If the decompressor can't be determined, returns %FALSE and fires
- * @callback with error.
- *
- * @compressed: (out): socket to write compressed image data to
- * @decompressed: (out): socket to read decompressed image data from
+/* Starts the subtasks which read, verify and decompress the image (or read
+ * it from :image-cache) and hand it out to the targets, which will complete
+ * @task once they have all finished. Returns %FALSE if one of the subtasks
+ * could not be started, in which case @task will fail once the others have
+ * stopped.
  */
 static gboolean
-gis_scribe_begin_decompress (GisScribe          *self,
-                             GOutputStream     **compressed,
-                             GInputStream      **decompressed,
-                             GCancellable       *cancellable,
-                             GAsyncReadyCallback callback,
-                             gpointer            user_data)
+gis_scribe_begin_pipeline (GisScribe    *self,
+                           gboolean      verify_gpg,
+                           GCancellable *cancellable,
+                           GTask        *task)
 {
-  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
-  g_autofree gchar *basename = NULL;
-  const gchar *args[] = { NULL, "-cd", NULL };
-  g_autoptr(GSubprocessLauncher) launcher = NULL;
-  GSubprocess *subprocess = NULL;
-  g_autoptr(GError) error = NULL;
+  GFile *verification;
+  g_autoptr(GInputStream) decompressed = NULL;
+  g_autofree gchar *cache_key = NULL;
+  gint cached_fd;
 
-  g_task_set_source_tag (task, GUINT_TO_POINTER (GIS_SCRIBE_TASK_DECOMPRESS));
+  self->running = TRUE;
+  self->start_time_usec = g_get_monotonic_time ();
 
-  basename = g_file_get_basename (self->image);
-  if (basename == NULL)
+  /* Forget about the previous write, if any. No subtasks are running, so
+   * there's no need to take the lock.
+   */
+  g_clear_error (&self->error);
+  self->fan_out_done = FALSE;
+  g_clear_pointer (&self->cache_entry, gis_image_cache_entry_free);
+  self->copied_targets = 0;
+  self->verify_progress = 0;
+  g_clear_pointer (&self->xz_block_map, g_array_unref);
+  memset (self->metrics, 0, sizeof (self->metrics));
+  self->end_time_usec = 0;
+  self->reading_cached_image = FALSE;
+  g_clear_pointer (&self->trace, gis_trace_free);
+  if (gis_trace_is_enabled ())
+    self->trace = gis_trace_new ();
+
+  if (self->overall_progress != 0)
     {
-      /* This path should not be reached since g_file_get_basename() cannot
-       * return NULL for local files. To avoid translators translating a
-       * technical message which should never be shown, we only mark "Internal
-       * error" for translation.
-       */
-      g_set_error (&error, GIS_INSTALL_ERROR, GIS_INSTALL_ERROR_INTERNAL_ERROR,
-                   "%s: %s",
-                   _("Internal error"),
-                   "g_file_get_basename returned NULL.");
-      g_critical ("%s", error->message);
-      task_return_error (self, task, g_steal_pointer (&error));
-      return FALSE;
+      self->overall_progress = 0;
+      g_object_notify_by_pspec (G_OBJECT (self), props[PROP_PROGRESS]);
     }
 
-  /* TODO: use more magical means */
-  if (g_str_has_suffix (basename, "gz"))
+  if (self->eta != -1)
     {
-      args[0] = "gzip";
+      self->eta = -1;
+      g_object_notify_by_pspec (G_OBJECT (self), props[PROP_ETA]);
     }
-  else if (g_str_has_suffix (basename, "xz"))
+
+  if (self->step != 1)
     {
-      args[0] = "xz";
+      self->step = 1;
+      g_object_notify_by_pspec (G_OBJECT (self), props[PROP_STEP]);
     }
-  else if (g_str_has_suffix (basename, "img")
-           || g_strcmp0 (basename, "endless-image") == 0)
+
+  verification = verify_gpg ? self->signature : self->checksum;
+  cached_fd = gis_scribe_lookup_cache (self, verification, cancellable,
+                                       &cache_key);
+  if (cached_fd >= 0)
     {
-      gint pipefd[2];
+      /* The cached image was verified before it was added to the cache, so
+       * it can be handed straight out to the targets.
+       */
+      self->verify_progress = 1;
+      self->reading_cached_image = TRUE;
+      decompressed = g_unix_input_stream_new (cached_fd, TRUE);
+    }
+  else
+    {
+      gboolean preverified =
+        gis_scribe_is_preverified (self, verification, verify_gpg, cancellable);
 
-      if (!g_unix_open_pipe (pipefd, FD_CLOEXEC, &error))
+      decompressed = gis_scribe_begin_read (self, verify_gpg, preverified,
+                                            cancellable, task);
+      if (decompressed == NULL)
+        return FALSE;
+
+      if (!preverified && self->image_input == NULL &&
+          !gis_split_image_is_split (self->image))
         {
-          task_return_error (self, task, g_steal_pointer (&error));
-          return FALSE;
+          g_autofree gchar *basename = g_file_get_basename (self->image);
+
+          if (g_str_has_suffix (basename, "xz"))
+            self->xz_block_map =
+              gdu_xz_decompressor_get_block_map (self->image);
         }
 
-      *compressed = g_unix_output_stream_new (pipefd[1], /* close_fd */ TRUE);
-      *decompressed = g_unix_input_stream_new (pipefd[0], /* close_fd */ TRUE);
-      g_task_return_boolean (task, TRUE);
-      return TRUE;
+      if (cache_key != NULL)
+        {
+          g_autoptr(GError) error = NULL;
+
+          self->cache_entry =
+            gis_image_cache_begin_entry (self->image_cache, cache_key,
+                                         self->image_size_bytes, &error);
+          if (self->cache_entry == NULL)
+            g_message ("not caching image: %s", error->message);
+        }
     }
-  else
+
+  /* Start reading the decompressed image and handing the data out to
+   * each target
+   */
+  g_mutex_lock (&self->mutex);
+  self->outstanding_tasks |= GIS_SCRIBE_TASK_FAN_OUT;
+  g_mutex_unlock (&self->mutex);
+  gis_scribe_begin_fan_out (self, decompressed, cancellable,
+                            gis_scribe_subtask_cb, g_object_ref (task));
+
+  return TRUE;
+}
+
+/* Starts a writer subtask for each target, which will complete @task once
+ * they and the rest of the pipeline have all finished.
+ */
+static void
+gis_scribe_begin_writes (GisScribe    *self,
+                         GCancellable *cancellable,
+                         GTask        *task)
+{
+  guint i;
+
+  self->write_rate = 0;
+  self->last_bytes_done = 0;
+  self->last_update_usec = g_get_monotonic_time ();
+  self->phase = GIS_SCRIBE_PHASE_WRITE;
+  self->phase_start_usec = self->last_update_usec;
+  self->write_phase_cost = 0;
+  self->phase_cost[GIS_SCRIBE_PHASE_SYNC] = 0;
+
+  self->update_progress_id =
+    g_timeout_add_seconds (1, gis_scribe_update_progress, self);
+
+  for (i = 0; i < self->targets->len; i++)
     {
-      /* This should not be reachable, because only images with known
-       * extensions are shown on the image selection page.
-       */
-      task_return_new_error (self, task, GIS_INSTALL_ERROR,
-                             GIS_INSTALL_ERROR_INTERNAL_ERROR,
-                             "%s: ‘%s’ ends in neither ‘.xz’, ‘.gz’ nor ‘.img’.",
-                             _("Internal error"),
-                             basename);
-      return FALSE;
+      GisScribeTarget *target = g_ptr_array_index (self->targets, i);
+
+      memset (target->metrics, 0, sizeof (target->metrics));
     }
 
-  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDIN_PIPE |
-                                        G_SUBPROCESS_FLAGS_STDOUT_PIPE);
-  subprocess = g_subprocess_launcher_spawnv (launcher, args, &error);
-  if (subprocess == NULL)
+  g_mutex_lock (&self->mutex);
+  self->copying_targets = self->targets->len;
+  self->running_writers = self->targets->len;
+  self->outstanding_writes = self->targets->len;
+  self->outstanding_tasks |= GIS_SCRIBE_TASK_WRITE;
+  g_mutex_unlock (&self->mutex);
+
+  for (i = 0; i < self->targets->len; i++)
+    gis_scribe_begin_write (self, g_ptr_array_index (self->targets, i),
+                            cancellable, gis_scribe_subtask_cb,
+                            g_object_ref (task));
+}
+
+static void
+gis_scribe_disconnect_prewarm_cancellable (GisScribe *self)
+{
+  if (self->prewarm_cancellable == NULL)
+    return;
+
+  g_cancellable_disconnect (self->prewarm_cancellable,
+                            self->prewarm_cancelled_id);
+  self->prewarm_cancelled_id = 0;
+  g_clear_object (&self->prewarm_cancellable);
+}
+
+/* Completes the pre-warmed pipeline's outer task by completing the write it
+ * was handed over to, if any.
+ */
+static void
+gis_scribe_prewarm_cb (GObject      *source,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  GisScribe *self = GIS_SCRIBE (source);
+  g_autoptr(GTask) write_task = g_steal_pointer (&self->write_task);
+  g_autoptr(GError) error = NULL;
+
+  gis_scribe_disconnect_prewarm_cancellable (self);
+  g_clear_object (&self->prewarm_task);
+
+  if (g_task_propagate_boolean (G_TASK (result), &error))
     {
-      task_return_error (self, task, g_steal_pointer (&error));
-      return FALSE;
+      g_assert (write_task != NULL);
+      g_task_return_boolean (write_task, TRUE);
     }
+  else if (write_task != NULL)
+    {
+      g_task_return_error (write_task, g_steal_pointer (&error));
+    }
+  else
+    {
+      g_message ("abandoned pre-warmed write: %s", error->message);
+    }
+}
+
+typedef struct {
+  GTask *task;
+  GError *error;
+} ReturnOuterTaskData;
 
-  *compressed = g_object_ref (g_subprocess_get_stdin_pipe (subprocess));
-  *decompressed = g_object_ref (g_subprocess_get_stdout_pipe (subprocess));
+static gboolean
+gis_scribe_return_outer_task_cb (gpointer user_data)
+{
+  ReturnOuterTaskData *data = user_data;
 
-  g_subprocess_wait_check_async (subprocess, cancellable,
-                                 gis_scribe_decompress_wait_check_cb,
-                                 g_steal_pointer (&task));
+  gis_scribe_return_outer_task (data->task, g_steal_pointer (&data->error));
+  g_object_unref (data->task);
+  g_free (data);
 
-  return TRUE;
+  return G_SOURCE_REMOVE;
 }
 
+/* Abandons the pre-warmed pipeline, unless it has already been handed over
+ * to gis_scribe_write_async(). May be called from any thread.
+ */
 static void
-gis_scribe_subtask_cb (GObject      *source,
-                       GAsyncResult *result,
-                       gpointer      user_data)
+gis_scribe_prewarm_cancelled_cb (GCancellable *cancellable,
+                                 gpointer      user_data)
 {
-  GisScribe *self = GIS_SCRIBE (source);
-  g_autoptr(GTask) outer_task = G_TASK (user_data);
-  GTask *inner_task = G_TASK (result);
-  GisScribeTask task_flag = GPOINTER_TO_INT (g_task_get_source_tag (inner_task));
-  const gchar *inner_task_name = gis_scribe_task_get_label (task_flag);
-  g_autoptr(GError) error = NULL;
+  GisScribe *self = GIS_SCRIBE (user_data);
+  GError *outer_error = NULL;
+  gboolean completed;
 
-  /* Guard access to self->outstanding_tasks and self->error. */
   g_mutex_lock (&self->mutex);
 
-  if (g_task_propagate_boolean (inner_task, &error))
+  if (!self->prewarming)
     {
-      g_debug ("%s: %s completed successfully", G_STRFUNC, inner_task_name);
+      g_mutex_unlock (&self->mutex);
+      return;
     }
-  else
-    {
-      /* Whichever task failed first should set this */
-      g_warn_if_fail (self->error != NULL);
 
-      g_message ("%s: %s failed: %s", G_STRFUNC, inner_task_name,
-                 error->message);
-      g_clear_error (&error);
+  self->prewarming = FALSE;
+  gis_scribe_drop_chunks (&self->prewarmed_chunks);
+
+  /* Make the subtasks give up early, as if one of them had failed. */
+  if (self->error == NULL)
+    g_cancellable_set_error_if_cancelled (cancellable, &self->error);
+
+  completed =
+    gis_scribe_clear_outstanding_task (self, GIS_SCRIBE_TASK_AWAIT_TARGETS,
+                                       &outer_error);
+
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+
+  /* If the pipeline has already failed, the outer task completes now. Its
+   * callback disconnects this handler from @cancellable, which deadlocks if
+   * done from within the handler, so complete it from an idle callback.
+   */
+  if (completed)
+    {
+      ReturnOuterTaskData *data = g_new0 (ReturnOuterTaskData, 1);
+      g_autoptr(GSource) source = g_idle_source_new ();
+
+      data->task = g_object_ref (self->prewarm_task);
+      data->error = outer_error;
+      g_source_set_callback (source, gis_scribe_return_outer_task_cb, data,
+                             NULL);
+      g_source_attach (source, g_task_get_context (self->prewarm_task));
     }
+}
 
-  /* This task should be outstanding */
-  g_assert_cmpint (self->outstanding_tasks & task_flag, ==, task_flag);
-  self->outstanding_tasks &= ~task_flag;
+/**
+ * gis_scribe_prewarm:
+ * @cancellable: (nullable): used to abandon the pre-warmed pipeline
+ *
+ * Starts reading, verifying and decompressing #GisScribe:image before the
+ * targets are known, and before anything has been written, so that when
+ * gis_scribe_write_async() is called the targets can be written at full speed
+ * straight away. Up to a few hundred MiB of the decompressed image are held in
+ * memory until then.
+ *
+ * If @cancellable is triggered before gis_scribe_write_async() is called, the
+ * pre-warmed pipeline is torn down; the next gis_scribe_write_async() call
+ * starts again from scratch. Once gis_scribe_write_async() has been called,
+ * @cancellable has no effect.
+ *
+ * Targets may be added with gis_scribe_add_target() while the pipeline is
+ * pre-warming. Nothing is written to any target until gis_scribe_write_async()
+ * is called.
+ */
+void
+gis_scribe_prewarm (GisScribe    *self,
+                    GCancellable *cancellable)
+{
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean verify_gpg;
+
+  g_return_if_fail (GIS_IS_SCRIBE (self));
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+  g_return_if_fail (!self->running);
 
-  if (self->outstanding_tasks == 0)
+  if (!gis_scribe_choose_verification (self, cancellable, &verify_gpg, &error))
     {
-      if (self->error == NULL)
-        g_task_return_boolean (outer_task, TRUE);
-      else
-        /* could steal self->error since all subtasks are now dead but it's
-         * useful to know that once set, it remains set until destruction.
-         */
-        g_task_return_error (outer_task, g_error_copy (self->error));
+      /* gis_scribe_write_async() will report this, if it's still true. */
+      g_message ("not pre-warming write: %s", error->message);
+      return;
     }
 
-  /* Alert the write thread, if it's already waiting, that
-   * self->outstanding_tasks and self->error have been updated.
+  if (self->targets_written)
+    {
+      g_ptr_array_set_size (self->targets, 0);
+      self->targets_written = FALSE;
+    }
+
+  /* The subtasks do not use @cancellable, since they carry on if the pipeline
+   * is handed over to gis_scribe_write_async(). Instead, if the pipeline is
+   * abandoned they stop just as they would if any one of them had failed.
    */
-  g_cond_signal (&self->cond);
+  task = g_task_new (self, NULL, gis_scribe_prewarm_cb, NULL);
+  self->prewarm_task = g_object_ref (task);
+
+  g_mutex_lock (&self->mutex);
+  self->outstanding_tasks |= GIS_SCRIBE_TASK_AWAIT_TARGETS;
+  self->prewarming = TRUE;
   g_mutex_unlock (&self->mutex);
+
+  /* If this fails, the pipeline still waits for its targets, so that
+   * gis_scribe_write_async() fails with the same error it would have done
+   * without pre-warming.
+   */
+  gis_scribe_begin_pipeline (self, verify_gpg, NULL, task);
+
+  if (cancellable != NULL)
+    {
+      self->prewarm_cancellable = g_object_ref (cancellable);
+      self->prewarm_cancelled_id =
+        g_cancellable_connect (cancellable,
+                               G_CALLBACK (gis_scribe_prewarm_cancelled_cb),
+                               self, NULL);
+    }
 }
 
+/* Hands the pipeline started by gis_scribe_prewarm() over to @task: queues
+ * the chunks it has read ahead for each target, and starts writing to them.
+ */
 static void
-gis_scribe_setpipe_sz (const gchar          *what,
-                       GFileDescriptorBased *stream)
+gis_scribe_finish_prewarm (GisScribe    *self,
+                           GCancellable *cancellable,
+                           GTask        *task)
 {
-  int fd = g_file_descriptor_based_get_fd (stream);
+  GError *outer_error = NULL;
+  gboolean completed;
+  gboolean failed;
+  guint i;
 
-  if (fcntl (fd, F_SETPIPE_SZ, BUFFER_SIZE) < 0)
-    g_warning ("failed to set %s pipe size to %d: %s",
-               what, BUFFER_SIZE, g_strerror (errno));
+  gis_scribe_disconnect_prewarm_cancellable (self);
+
+  self->write_task = g_object_ref (task);
+  self->targets_written = TRUE;
+  self->start_time_usec = g_get_monotonic_time ();
+
+  g_mutex_lock (&self->mutex);
+  self->prewarming = FALSE;
+
+  failed = self->error != NULL;
+  if (!failed)
+    {
+      for (i = 0; i < self->targets->len; i++)
+        {
+          GisScribeTarget *target = g_ptr_array_index (self->targets, i);
+          GList *l;
+
+          for (l = self->prewarmed_chunks.head; l != NULL; l = l->next)
+            g_queue_push_tail (&target->chunks, g_bytes_ref (l->data));
+        }
+    }
+
+  gis_scribe_drop_chunks (&self->prewarmed_chunks);
+  g_mutex_unlock (&self->mutex);
+
+  g_message ("handing pre-warmed write over to %u target(s)",
+             self->targets->len);
+
+  /* If the pipeline has already failed, there's no point writing anything. */
+  if (!failed)
+    gis_scribe_begin_writes (self, cancellable, self->prewarm_task);
+
+  g_mutex_lock (&self->mutex);
+  completed =
+    gis_scribe_clear_outstanding_task (self, GIS_SCRIBE_TASK_AWAIT_TARGETS,
+                                       &outer_error);
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+
+  if (completed)
+    gis_scribe_return_outer_task (self->prewarm_task, outer_error);
 }
 
 /**
  * gis_scribe_write_async:
  *
- * Begins writing #GisScribe:image to #GisScribe:drive-fd. This may be called
- * at most once on any given #GisScribe object. Once called, the target drive's
- * contents should be considered lost, even if @cancellable is subsequently
- * triggered.
+ * Begins writing #GisScribe:image to #GisScribe:drive-fd, and to any targets
+ * added with gis_scribe_add_target(). Once called, the target drives' contents
+ * should be considered lost, even if @cancellable is subsequently triggered.
+ *
+ * Once the write has completed, this may be called again to write the image
+ * to a fresh set of targets added with gis_scribe_add_target(); each target is
+ * only ever written once.
+ *
+ * If #GisScribe:image-cache holds the decompressed image, it is written from
+ * there; otherwise, it is added to the cache once it has been verified. If
+ * #GisScribe:image-verifier has already verified the image, it is not
+ * verified again. If gis_scribe_prewarm() has been called, the pipeline it
+ * started is used.
+ *
+ * A target may be a regular file rather than a disk. Its old contents are
+ * deallocated rather than discarded, runs of zeros in the image are skipped
+ * over, leaving holes, and it is extended to at least the size of the image.
+ * It is not re-partitioned, even if #GisScribe:convert-to-mbr is set.
+ *
+ * If the image cannot be read, verified or decompressed, writing to all
+ * targets fails. If writing to one target fails, the others carry on, but
+ * the operation as a whole fails; use gis_scribe_dup_target_error() to find
+ * out which targets failed.
  */
 void
 gis_scribe_write_async (GisScribe          *self,
@@ -1647,98 +4011,52 @@ gis_scribe_write_async (GisScribe          *self,
                         gpointer            user_data)
 {
   g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
+  g_autoptr(GError) error = NULL;
   gboolean verify_gpg;
-  g_autoptr(GInputStream) decompressed = NULL;
-  g_autoptr(GOutputStream) write_pipe = NULL;
-  g_autoptr(GOutputStream) verify_pipe = NULL;
 
-  if (self->started)
+  if (self->prewarming)
     {
-      g_task_return_new_error (task, GIS_INSTALL_ERROR,
-                               GIS_INSTALL_ERROR_INTERNAL_ERROR,
-                               "already started");
+      if (self->targets->len == 0)
+        g_task_return_new_error (task, GIS_INSTALL_ERROR,
+                                 GIS_INSTALL_ERROR_INTERNAL_ERROR,
+                                 "no target drives");
+      else
+        gis_scribe_finish_prewarm (self, cancellable, task);
       return;
     }
 
-  /* Make sure one of the verification files exists before starting any
-   * subtasks.
-   */
-  if (g_file_query_exists (self->signature, cancellable))
-    {
-      verify_gpg = TRUE;
-    }
-  else if (g_file_query_exists (self->checksum, cancellable))
+  if (self->running)
     {
-      verify_gpg = FALSE;
-    }
-  else
-    {
-      g_autofree gchar *signature_path = g_file_get_path (self->signature);
-      g_autofree gchar *checksum_path = g_file_get_path (self->checksum);
-      g_task_return_new_error (
-          task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
-          _("Neither the signature file ‘%s’ nor the checksum file ‘%s’ exist."),
-          signature_path, checksum_path);
+      g_task_return_new_error (task, GIS_INSTALL_ERROR,
+                               GIS_INSTALL_ERROR_INTERNAL_ERROR,
+                               "already started");
       return;
     }
 
-  self->started = TRUE;
-  self->start_time_usec = g_get_monotonic_time ();
-
-  /* Attempt to spawn decompressor subprocess (or pipe-to-self) */
-  g_mutex_lock (&self->mutex);
-  self->outstanding_tasks |= GIS_SCRIBE_TASK_DECOMPRESS;
-  g_mutex_unlock (&self->mutex);
-  if (!gis_scribe_begin_decompress (self, &write_pipe, &decompressed,
-                                    cancellable, gis_scribe_subtask_cb,
-                                    g_object_ref (task)))
-    return;
-
-  /* Attempt to spawn GPG subprocess or checksum thread */
-  g_mutex_lock (&self->mutex);
-  self->outstanding_tasks |= GIS_SCRIBE_TASK_VERIFY;
-  g_mutex_unlock (&self->mutex);
-  if (verify_gpg)
-    {
-      verify_pipe = gis_scribe_begin_verify_gpg (self, cancellable,
-                                                 gis_scribe_subtask_cb,
-                                                 g_object_ref (task));
-    }
-  else
+  if (self->targets_written || self->targets->len == 0)
     {
-      verify_pipe = gis_scribe_begin_verify_checksum (self, cancellable,
-                                                      gis_scribe_subtask_cb,
-                                                      g_object_ref (task));
+      g_task_return_new_error (task, GIS_INSTALL_ERROR,
+                               GIS_INSTALL_ERROR_INTERNAL_ERROR,
+                               "no target drives");
+      return;
     }
 
-  if (verify_pipe == NULL)
+  /* Make sure one of the verification files exists before starting any
+   * subtasks.
+   */
+  if (!gis_scribe_choose_verification (self, cancellable, &verify_gpg, &error))
     {
-      gis_scribe_close_output_stream_or_warn (write_pipe, cancellable,
-                                              "decompressor stdin");
-      gis_scribe_close_input_stream_or_warn (decompressed, cancellable,
-                                             "decompressor stdout");
+      g_task_return_error (task, g_steal_pointer (&error));
       return;
     }
 
-  gis_scribe_setpipe_sz ("verify input", G_FILE_DESCRIPTOR_BASED (verify_pipe));
-  gis_scribe_setpipe_sz ("decompressor stdin", G_FILE_DESCRIPTOR_BASED (write_pipe));
-  gis_scribe_setpipe_sz ("decompressor stdout", G_FILE_DESCRIPTOR_BASED (decompressed));
+  self->targets_written = TRUE;
 
-  /* Start feeding the image to the verification pipe and to one end of a
-   * pipe-to-self
-   */
-  g_mutex_lock (&self->mutex);
-  self->outstanding_tasks |= GIS_SCRIBE_TASK_TEE;
-  g_mutex_unlock (&self->mutex);
-  gis_scribe_begin_tee (self, verify_pipe, write_pipe, cancellable,
-                        gis_scribe_subtask_cb, g_object_ref (task));
+  if (!gis_scribe_begin_pipeline (self, verify_gpg, cancellable, task))
+    return;
 
-  /* Start reading from the other end of the pipe and writing to disk */
-  g_mutex_lock (&self->mutex);
-  self->outstanding_tasks |= GIS_SCRIBE_TASK_WRITE;
-  g_mutex_unlock (&self->mutex);
-  gis_scribe_begin_write (self, decompressed, cancellable,
-                          gis_scribe_subtask_cb, g_object_ref (task));
+  /* Start writing to each target */
+  gis_scribe_begin_writes (self, cancellable, task);
 }
 
 /**
@@ -1781,3 +4099,286 @@ gis_scribe_get_progress (GisScribe *self)
 
   return self->overall_progress;
 }
+
+/**
+ * gis_scribe_get_eta:
+ *
+ * Returns: the #GisScribe:eta property.
+ */
+gint64
+gis_scribe_get_eta (GisScribe *self)
+{
+  g_return_val_if_fail (GIS_IS_SCRIBE (self), -1);
+
+  return self->eta;
+}
+
+/**
+ * gis_scribe_add_target:
+ * @drive_path: path to another target drive
+ * @drive_fd: writable file descriptor for @drive_path, which is guaranteed to
+ *  be close()d by @self
+ *
+ * Adds another drive to write #GisScribe:image to, alongside
+ * #GisScribe:drive-path. The image is read, verified and decompressed once,
+ * and each target is written by its own thread, so a slow target does not
+ * hold up the others. This must be called before gis_scribe_write_async(),
+ * but may be called after gis_scribe_prewarm().
+ *
+ * If the previous write has completed, its targets are forgotten, and
+ * @drive_path becomes the first target of the next write.
+ */
+void
+gis_scribe_add_target (GisScribe   *self,
+                       const gchar *drive_path,
+                       gint         drive_fd)
+{
+  g_return_if_fail (GIS_IS_SCRIBE (self));
+  g_return_if_fail (!self->running || self->prewarming);
+  g_return_if_fail (drive_path != NULL);
+  g_return_if_fail (drive_fd >= 0);
+
+  if (self->targets_written)
+    {
+      g_ptr_array_set_size (self->targets, 0);
+      self->targets_written = FALSE;
+    }
+
+  /* The fan-out subtask may be running, if the write is pre-warming. */
+  g_mutex_lock (&self->mutex);
+  g_ptr_array_add (self->targets, gis_scribe_target_new (drive_path, drive_fd));
+  g_mutex_unlock (&self->mutex);
+}
+
+/**
+ * gis_scribe_get_n_targets:
+ *
+ * Returns: the number of drives being (or last) written: one if
+ *  #GisScribe:drive-path is set and no write has completed yet, plus the
+ *  number of calls to gis_scribe_add_target().
+ */
+guint
+gis_scribe_get_n_targets (GisScribe *self)
+{
+  g_return_val_if_fail (GIS_IS_SCRIBE (self), 0);
+
+  return self->targets->len;
+}
+
+/**
+ * gis_scribe_get_target_drive_path:
+ * @index: index of a target, less than gis_scribe_get_n_targets(). Until the
+ *  first write has completed, target 0 is #GisScribe:drive-path if it is set.
+ *
+ * Returns: (transfer none): the path to the given target drive.
+ */
+const gchar *
+gis_scribe_get_target_drive_path (GisScribe *self,
+                                  guint      index)
+{
+  GisScribeTarget *target;
+
+  g_return_val_if_fail (GIS_IS_SCRIBE (self), NULL);
+  g_return_val_if_fail (index < self->targets->len, NULL);
+
+  target = g_ptr_array_index (self->targets, index);
+  return target->drive_path;
+}
+
+/**
+ * gis_scribe_get_target_progress:
+ * @index: index of a target, less than gis_scribe_get_n_targets()
+ *
+ * Returns: the fraction of the image which has been written to the given
+ *  target, between 0 and 1 inclusive.
+ */
+gdouble
+gis_scribe_get_target_progress (GisScribe *self,
+                                guint      index)
+{
+  GisScribeTarget *target;
+  guint64 bytes_written;
+
+  g_return_val_if_fail (GIS_IS_SCRIBE (self), 0);
+  g_return_val_if_fail (index < self->targets->len, 0);
+
+  target = g_ptr_array_index (self->targets, index);
+
+  g_mutex_lock (&self->mutex);
+  bytes_written = target->bytes_written;
+  g_mutex_unlock (&self->mutex);
+
+  return CLAMP ((gdouble) bytes_written / (gdouble) self->image_size_bytes,
+                0, 1);
+}
+
+/**
+ * gis_scribe_get_target_duration:
+ * @index: index of a target, less than gis_scribe_get_n_targets()
+ *
+ * Returns: the time from the start of the write until the given target was
+ *  finished with, including syncing it, in microseconds; or 0 if it has not
+ *  been finished with yet. When several targets are written at once, the
+ *  fastest finish first.
+ */
+gint64
+gis_scribe_get_target_duration (GisScribe *self,
+                                guint      index)
+{
+  GisScribeTarget *target;
+  gint64 finished_usec;
+
+  g_return_val_if_fail (GIS_IS_SCRIBE (self), 0);
+  g_return_val_if_fail (index < self->targets->len, 0);
+
+  target = g_ptr_array_index (self->targets, index);
+
+  g_mutex_lock (&self->mutex);
+  finished_usec = target->finished_usec;
+  g_mutex_unlock (&self->mutex);
+
+  if (finished_usec == 0 || self->start_time_usec == 0)
+    return 0;
+
+  return finished_usec - self->start_time_usec;
+}
+
+/**
+ * gis_scribe_dup_target_error:
+ * @index: index of a target, less than gis_scribe_get_n_targets()
+ *
+ * Returns: (transfer full) (nullable): a copy of the error which writing to
+ *  the given target failed with, or %NULL if it has not (yet) failed.
+ */
+GError *
+gis_scribe_dup_target_error (GisScribe *self,
+                             guint      index)
+{
+  GisScribeTarget *target;
+  GError *error = NULL;
+
+  g_return_val_if_fail (GIS_IS_SCRIBE (self), NULL);
+  g_return_val_if_fail (index < self->targets->len, NULL);
+
+  target = g_ptr_array_index (self->targets, index);
+
+  g_mutex_lock (&self->mutex);
+  if (target->error != NULL)
+    error = g_error_copy (target->error);
+  g_mutex_unlock (&self->mutex);
+
+  return error;
+}
+
+/**
+ * gis_scribe_dup_metrics:
+ *
+ * Takes a snapshot of how each stage of the current (or most recent) write
+ * is performing, as a vardict with the following keys:
+ *
+ * - `elapsed-usec` (`x`): time since the write began
+ * - `stages` (`a{sa{sv}}`): for each of `tee`, `verify`, `decompress`,
+ *   `write`, `discard` and `sync`, the bytes it has consumed and produced
+ *   (`bytes-in` and `bytes-out`, `t`), the time it spent working
+ *   (`busy-usec`, `x`) and waiting for the previous and next stages
+ *   (`upstream-blocked-usec` and `downstream-blocked-usec`, `x`), and how
+ *   much data was waiting for it (`queue-mean-bytes` and `queue-peak-bytes`,
+ *   `t`), most recently (`queue-bytes`, `t`) out of how much there was room
+ *   for (`queue-capacity-bytes`, `t`)
+ * - `bottleneck` (`s`): the stage which spent longest working, if any has
+ *   been measured
+ * - `bound` (`s`): `source`, `cpu` or `target`, depending on the bottleneck
+ * - `dirty-bytes` (`t`): data written to the targets (or anything else) which
+ *   the kernel has yet to flush to disk
+ *
+ * Stages which run once per target report the bytes for all targets, and the
+ * times for the slowest target.
+ *
+ * Returns: (transfer full): a #GVariant of type `a{sv}`
+ */
+GVariant *
+gis_scribe_dup_metrics (GisScribe *self)
+{
+  GisScribeStageMetrics metrics[GIS_SCRIBE_N_STAGES];
+  GisScribeStage bottleneck;
+  GVariantBuilder builder;
+  GVariantBuilder stages;
+  gint64 elapsed_usec = 0;
+  gint s;
+
+  g_return_val_if_fail (GIS_IS_SCRIBE (self), NULL);
+
+  gis_scribe_collect_metrics (self, metrics);
+
+  g_variant_builder_init (&stages, G_VARIANT_TYPE ("a{sa{sv}}"));
+  for (s = 0; s < GIS_SCRIBE_N_STAGES; s++)
+    {
+      const GisScribeStageMetrics *m = &metrics[s];
+      GVariantBuilder stage;
+
+      g_variant_builder_init (&stage, G_VARIANT_TYPE_VARDICT);
+      g_variant_builder_add (&stage, "{sv}", "bytes-in",
+                             g_variant_new_uint64 (m->bytes_in));
+      g_variant_builder_add (&stage, "{sv}", "bytes-out",
+                             g_variant_new_uint64 (m->bytes_out));
+      g_variant_builder_add (&stage, "{sv}", "busy-usec",
+                             g_variant_new_int64 (m->busy_usec));
+      g_variant_builder_add (&stage, "{sv}", "upstream-blocked-usec",
+                             g_variant_new_int64 (m->upstream_usec));
+      g_variant_builder_add (&stage, "{sv}", "downstream-blocked-usec",
+                             g_variant_new_int64 (m->downstream_usec));
+      g_variant_builder_add (&stage, "{sv}", "queue-mean-bytes",
+                             g_variant_new_uint64 (m->queue_samples > 0
+                                                   ? m->queue_total / m->queue_samples
+                                                   : 0));
+      g_variant_builder_add (&stage, "{sv}", "queue-peak-bytes",
+                             g_variant_new_uint64 (m->queue_peak));
+      g_variant_builder_add (&stage, "{sv}", "queue-bytes",
+                             g_variant_new_uint64 (m->queue_last));
+      g_variant_builder_add (&stage, "{sv}", "queue-capacity-bytes",
+                             g_variant_new_uint64 (m->queue_capacity));
+      g_variant_builder_add (&stages, "{sa{sv}}", stage_info[s].label,
+                             &stage);
+    }
+
+  if (self->start_time_usec != 0)
+    elapsed_usec = (self->end_time_usec != 0
+                    ? self->end_time_usec
+                    : g_get_monotonic_time ()) - self->start_time_usec;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "elapsed-usec",
+                         g_variant_new_int64 (elapsed_usec));
+  g_variant_builder_add (&builder, "{sv}", "stages",
+                         g_variant_builder_end (&stages));
+
+  bottleneck = gis_scribe_find_bottleneck (metrics);
+  if (bottleneck < GIS_SCRIBE_N_STAGES)
+    {
+      g_variant_builder_add (&builder, "{sv}", "bottleneck",
+                             g_variant_new_string (stage_info[bottleneck].label));
+      g_variant_builder_add (&builder, "{sv}", "bound",
+                             g_variant_new_string (stage_info[bottleneck].bound));
+    }
+
+  g_variant_builder_add (&builder, "{sv}", "dirty-bytes",
+                         g_variant_new_uint64 (gis_scribe_get_dirty_bytes ()));
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/**
+ * gis_scribe_get_trace:
+ *
+ * Returns: (transfer none) (nullable): a trace of what each of the threads
+ *  and subprocesses of the current (or last) write spent its time on, if
+ *  %GIS_TRACE_ENV is set; or %NULL. It is only complete once the write has
+ *  finished.
+ */
+GisTrace *
+gis_scribe_get_trace (GisScribe *self)
+{
+  g_return_val_if_fail (GIS_IS_SCRIBE (self), NULL);
+
+  return self->trace;
+}
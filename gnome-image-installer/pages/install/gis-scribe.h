@@ -21,6 +21,8 @@
 
 #include <gio/gio.h>
 
+#include "gis-trace.h"
+
 G_BEGIN_DECLS
 
 #define GIS_TYPE_SCRIBE (gis_scribe_get_type ())
@@ -36,6 +38,10 @@ gis_scribe_new (GFile       *image,
                 gint         drive_fd,
                 gboolean     convert_to_mbr);
 
+void
+gis_scribe_prewarm (GisScribe    *self,
+                    GCancellable *cancellable);
+
 void
 gis_scribe_write_async (GisScribe          *self,
                         GCancellable       *cancellable,
@@ -53,6 +59,39 @@ gis_scribe_get_step (GisScribe *self);
 gdouble
 gis_scribe_get_progress (GisScribe *self);
 
+gint64
+gis_scribe_get_eta (GisScribe *self);
+
+void
+gis_scribe_add_target (GisScribe   *self,
+                       const gchar *drive_path,
+                       gint         drive_fd);
+
+guint
+gis_scribe_get_n_targets (GisScribe *self);
+
+const gchar *
+gis_scribe_get_target_drive_path (GisScribe *self,
+                                  guint      index);
+
+gdouble
+gis_scribe_get_target_progress (GisScribe *self,
+                                guint      index);
+
+gint64
+gis_scribe_get_target_duration (GisScribe *self,
+                                guint      index);
+
+GError *
+gis_scribe_dup_target_error (GisScribe *self,
+                             guint      index);
+
+GVariant *
+gis_scribe_dup_metrics (GisScribe *self);
+
+GisTrace *
+gis_scribe_get_trace (GisScribe *self);
+
 G_END_DECLS
 
 #endif /* GIS_SCRIBE_H */
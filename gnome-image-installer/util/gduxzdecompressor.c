@@ -170,21 +170,102 @@ gdu_xz_decompressor_iface_init (GConverterIface *iface)
   iface->reset = gdu_xz_decompressor_reset;
 }
 
+/**
+ * gdu_xz_decompressor_decode_index:
+ * @buf: the contents of an xz file
+ * @len: the length of @buf
+ * @error: return location for a #GError
+ *
+ * Decodes the indexes of all the streams in @buf, working backwards from the
+ * end of the file, and combines them. The result can be used to find the
+ * block holding a given uncompressed offset without decompressing anything
+ * before it; free it with lzma_index_end().
+ *
+ * Returns: (transfer full): the combined index, or %NULL on error.
+ */
+lzma_index *
+gdu_xz_decompressor_decode_index (const guint8 *buf,
+                                  gsize         len,
+                                  GError      **error)
+{
+  lzma_index *combined = NULL;
+  gsize pos = len;
+  lzma_vli stream_padding = 0;
+
+  while (pos > 0)
+    {
+      lzma_index *index_object = NULL;
+      lzma_stream_flags footer_flags, header_flags;
+      uint64_t memlimit = UINT64_MAX;
+      size_t bufpos = 0;
+      lzma_vli stream_size;
+      gsize index_pos;
+
+      /* Stream Padding is a multiple of 4 zero bytes between or after
+       * streams; a Stream Footer never ends in zeros.
+       */
+      if (pos >= 4 && memcmp (buf + pos - 4, "\0\0\0\0", 4) == 0)
+        {
+          pos -= 4;
+          stream_padding += 4;
+          continue;
+        }
+
+      if (pos < 2 * LZMA_STREAM_HEADER_SIZE ||
+          lzma_stream_footer_decode (&footer_flags,
+                                     buf + pos - LZMA_STREAM_HEADER_SIZE) != LZMA_OK ||
+          footer_flags.backward_size > pos - 2 * LZMA_STREAM_HEADER_SIZE)
+        goto invalid;
+
+      index_pos = pos - LZMA_STREAM_HEADER_SIZE - footer_flags.backward_size;
+      if (lzma_index_buffer_decode (&index_object, &memlimit,
+                                    NULL /* allocator */,
+                                    buf + index_pos, &bufpos,
+                                    footer_flags.backward_size) != LZMA_OK)
+        goto invalid;
+
+      stream_size = lzma_index_stream_size (index_object);
+      if (stream_size > pos ||
+          lzma_stream_header_decode (&header_flags,
+                                     buf + pos - stream_size) != LZMA_OK ||
+          lzma_stream_flags_compare (&header_flags, &footer_flags) != LZMA_OK ||
+          lzma_index_stream_flags (index_object, &footer_flags) != LZMA_OK ||
+          lzma_index_stream_padding (index_object, stream_padding) != LZMA_OK ||
+          (combined != NULL &&
+           lzma_index_cat (index_object, combined, NULL) != LZMA_OK))
+        {
+          lzma_index_end (index_object, NULL);
+          goto invalid;
+        }
+
+      /* lzma_index_cat() took ownership of the later streams' index */
+      combined = index_object;
+      pos -= stream_size;
+      stream_padding = 0;
+    }
+
+  if (combined == NULL)
+    goto invalid;
+
+  return combined;
+
+ invalid:
+  if (combined != NULL)
+    lzma_index_end (combined, NULL);
+
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "xz index is missing or corrupt");
+  return NULL;
+}
+
 gsize
 gdu_xz_decompressor_get_uncompressed_size (GFile *compressed_file)
 {
   gchar *path = NULL;
   gsize ret = 0;
   GMappedFile *mapped_file = NULL;
-  size_t bufpos = 0;
-  uint64_t memlimit = UINT64_MAX;
   lzma_index *index_object = NULL;
-  lzma_ret res;
   GError *error = NULL;
-  uint8_t *buf;
-  gsize len;
-  lzma_stream_flags stream_flags;
-  uint8_t *footer, *index;
 
   path = g_file_get_path (compressed_file);
   if (path == NULL)
@@ -205,25 +286,11 @@ gdu_xz_decompressor_get_uncompressed_size (GFile *compressed_file)
       goto out;
     }
 
-  buf = (uint8_t*) g_mapped_file_get_contents (mapped_file);
-  len = g_mapped_file_get_length (mapped_file);
-
-  if (len < 12)
-    goto out;
-  footer = buf + len - 12;
-  if (lzma_stream_footer_decode (&stream_flags, footer) != LZMA_OK)
-    goto out;
-  if (stream_flags.backward_size > len - 12)
-    goto out;
-  index = footer - stream_flags.backward_size;
-
-  res = lzma_index_buffer_decode (&index_object,
-                                  &memlimit,
-                                  NULL /* allocator */,
-                                  index,
-                                  &bufpos,
-                                  footer - index);
-  if (res != LZMA_OK)
+  index_object = gdu_xz_decompressor_decode_index (
+      (const guint8 *) g_mapped_file_get_contents (mapped_file),
+      g_mapped_file_get_length (mapped_file),
+      NULL);
+  if (index_object == NULL)
     goto out;
 
   ret = lzma_index_uncompressed_size (index_object);
@@ -236,3 +303,116 @@ gdu_xz_decompressor_get_uncompressed_size (GFile *compressed_file)
   g_free (path);
   return ret;
 }
+
+/**
+ * gdu_xz_decompressor_get_block_map:
+ * @compressed_file: an xz file
+ *
+ * Reads the index of @compressed_file to find where each block starts, so
+ * that progress through the compressed file can be translated to progress
+ * through the uncompressed data with gdu_xz_decompressor_map_offset(). This
+ * only reads the end of the file.
+ *
+ * Returns: (transfer full) (element-type GduXzBlockOffset) (nullable): the
+ *  start of each block, in order, followed by the end of the file; or %NULL
+ *  if @compressed_file is not a local xz file with an index.
+ */
+GArray *
+gdu_xz_decompressor_get_block_map (GFile *compressed_file)
+{
+  g_autofree gchar *path = g_file_get_path (compressed_file);
+  GMappedFile *mapped_file = NULL;
+  lzma_index *index_object = NULL;
+  lzma_index_iter iter;
+  GArray *block_map = NULL;
+  GduXzBlockOffset offset;
+  GError *error = NULL;
+
+  if (path == NULL)
+    return NULL;
+
+  mapped_file = g_mapped_file_new (path, FALSE /* writable */, &error);
+  if (mapped_file == NULL)
+    {
+      g_debug ("Error mapping file '%s': %s", path, error->message);
+      g_clear_error (&error);
+      return NULL;
+    }
+
+  index_object = gdu_xz_decompressor_decode_index (
+      (const guint8 *) g_mapped_file_get_contents (mapped_file),
+      g_mapped_file_get_length (mapped_file),
+      &error);
+  if (index_object == NULL)
+    {
+      g_debug ("Can't read index of '%s': %s", path, error->message);
+      g_clear_error (&error);
+      goto out;
+    }
+
+  block_map = g_array_new (FALSE, FALSE, sizeof (GduXzBlockOffset));
+
+  lzma_index_iter_init (&iter, index_object);
+  while (!lzma_index_iter_next (&iter, LZMA_INDEX_ITER_BLOCK))
+    {
+      offset.compressed_offset = iter.block.compressed_file_offset;
+      offset.uncompressed_offset = iter.block.uncompressed_file_offset;
+      g_array_append_val (block_map, offset);
+    }
+
+  offset.compressed_offset = lzma_index_file_size (index_object);
+  offset.uncompressed_offset = lzma_index_uncompressed_size (index_object);
+  g_array_append_val (block_map, offset);
+
+ out:
+  if (index_object != NULL)
+    lzma_index_end (index_object, NULL);
+  g_mapped_file_unref (mapped_file);
+  return block_map;
+}
+
+/**
+ * gdu_xz_decompressor_map_offset:
+ * @block_map: (element-type GduXzBlockOffset): from
+ *  gdu_xz_decompressor_get_block_map()
+ * @compressed_offset: an offset in the compressed file
+ *
+ * Returns: roughly how much of the uncompressed data has been decompressed
+ *  by the time @compressed_offset has been read, assuming each block
+ *  compresses evenly
+ */
+guint64
+gdu_xz_decompressor_map_offset (GArray  *block_map,
+                                guint64  compressed_offset)
+{
+  const GduXzBlockOffset *start, *end;
+  guint lo = 0, hi;
+
+  g_return_val_if_fail (block_map != NULL && block_map->len > 0, 0);
+
+  hi = block_map->len - 1;
+  end = &g_array_index (block_map, GduXzBlockOffset, hi);
+  if (hi == 0 || compressed_offset >= end->compressed_offset)
+    return end->uncompressed_offset;
+
+  /* Find the last block starting at or before compressed_offset */
+  while (hi - lo > 1)
+    {
+      guint mid = lo + (hi - lo) / 2;
+
+      if (g_array_index (block_map, GduXzBlockOffset, mid).compressed_offset <= compressed_offset)
+        lo = mid;
+      else
+        hi = mid;
+    }
+
+  start = &g_array_index (block_map, GduXzBlockOffset, lo);
+  end = &g_array_index (block_map, GduXzBlockOffset, lo + 1);
+  if (compressed_offset <= start->compressed_offset)
+    return start->uncompressed_offset;
+
+  return start->uncompressed_offset +
+    (guint64) ((gdouble) (compressed_offset - start->compressed_offset) /
+               (end->compressed_offset - start->compressed_offset) *
+               (end->uncompressed_offset - start->uncompressed_offset));
+}
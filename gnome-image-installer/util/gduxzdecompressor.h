@@ -14,9 +14,16 @@
 
 #include <gio/gio.h>
 #include <glib-object.h>
+#include <lzma.h>
 
 G_BEGIN_DECLS
 
+/* Where a block starts, in the compressed file and in the uncompressed data */
+typedef struct {
+  guint64 compressed_offset;
+  guint64 uncompressed_offset;
+} GduXzBlockOffset;
+
 #define GDU_TYPE_XZ_DECOMPRESSOR         (gdu_xz_decompressor_get_type ())
 #define GDU_XZ_DECOMPRESSOR(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), GDU_TYPE_XZ_DECOMPRESSOR, GduXzDecompressor))
 #define GDU_XZ_DECOMPRESSOR_CLASS(k)     (G_TYPE_CHECK_CLASS_CAST((k), GDU_TYPE_XZ_DECOMPRESSOR, GduXzDecompressorClass))
@@ -38,6 +45,12 @@ GType              gdu_xz_decompressor_get_type      (void) G_GNUC_CONST;
 GduXzDecompressor *gdu_xz_decompressor_new           (void);
 
 gsize              gdu_xz_decompressor_get_uncompressed_size (GFile *compressed_file);
+lzma_index        *gdu_xz_decompressor_decode_index (const guint8 *buf,
+                                                     gsize         len,
+                                                     GError      **error);
+GArray            *gdu_xz_decompressor_get_block_map (GFile *compressed_file);
+guint64            gdu_xz_decompressor_map_offset (GArray  *block_map,
+                                                   guint64  compressed_offset);
 
 G_END_DECLS
 
@@ -0,0 +1,1312 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Images may be read straight from an HTTP or HTTPS server, such as an
+ * imaging server on the local network, rather than from local media.
+ *
+ * A single TCP connection rarely keeps a fast link busy, so the image is
+ * fetched as a series of fixed-size Range requests, several at once over
+ * separate keep-alive connections, on a pool of worker threads; the chunks
+ * are handed out in order. If the server does not support Range requests,
+ * the image is read from the body of a single GET request instead.
+ *
+ * The signature or checksum (the "sidecar") is fetched in full beforehand,
+ * with gis_http_image_fetch_sidecars(), and the image is verified as it is
+ * read just as a local image would be. A checksum fetched over plain HTTP is
+ * no defence against tampering, so images on such servers must be signed.
+ *
+ * This is a deliberately minimal HTTP/1.1 client: it follows redirects, but
+ * does not support proxies, authentication, or chunked transfer encoding,
+ * none of which a simple static file server needs.
+ */
+#include "config.h"
+#include "gis-http-image.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gi18n.h>
+
+#include "gis-errors.h"
+
+/* Size of each Range request */
+#define CHUNK_SIZE (2 * 1024 * 1024)
+/* Number of Range requests in flight at once, each on its own connection */
+#define N_CONNECTIONS 4
+/* Number of chunks fetched, or waiting to be fetched, ahead of the current
+ * position. This bounds the memory used to 32 MiB.
+ */
+#define WINDOW (4 * N_CONNECTIONS)
+/* A chunk is retried on a new connection if fetching it fails, in case the
+ * server dropped the connection.
+ */
+#define MAX_ATTEMPTS 3
+#define MAX_REDIRECTS 5
+#define MAX_HEADER_LINES 100
+/* Signatures and checksums are a few hundred bytes */
+#define MAX_SIDECAR_SIZE (1024 * 1024)
+/* Seconds to wait for the server before giving up */
+#define TIMEOUT 30
+
+typedef struct {
+  GIOStream *stream;
+  GDataInputStream *input;
+  /* Owned by .stream */
+  GOutputStream *output;
+} GisHttpConnection;
+
+typedef struct {
+  guint status;
+  gboolean keep_alive;
+  gboolean chunked;
+  /* -1 if the server did not say */
+  gint64 content_length;
+  /* From Content-Range; total_size is 0 if the server did not say */
+  gboolean has_range;
+  guint64 range_start;
+  guint64 range_end;
+  guint64 total_size;
+  gchar *location;
+} GisHttpResponse;
+
+typedef struct {
+  GSocketClient *socket_client;
+
+  /* The URI being fetched, after any redirects, and its parts. These only
+   * change when a redirect is followed, before there are any other users.
+   */
+  gchar *uri;
+  gchar *origin;
+  gchar *host;
+  gchar *path;
+  GSocketConnectable *address;
+
+  GMutex mutex;
+  /* (element-type GisHttpConnection): idle keep-alive connections.
+   * Protected by .mutex.
+   */
+  GQueue idle;
+} GisHttpClient;
+
+typedef struct {
+  guint64 offset;
+  gsize length;
+
+  /* Protected by GisHttpImageReader.mutex */
+  GBytes *data;
+  GError *error;
+  gboolean done;
+} GisHttpImageChunk;
+
+typedef struct _GisHttpImageReader {
+  GInputStream parent;
+
+  GisHttpClient *client;
+  guint64 size;
+
+  /* If the server ignores Range requests, the image is read from the body
+   * of the response to a plain GET, and .sequential_remaining counts down to
+   * its end.
+   */
+  GisHttpConnection *sequential;
+  guint64 sequential_remaining;
+
+  GThreadPool *pool;
+  /* Cancels the workers' requests when the stream is closed */
+  GCancellable *cancellable;
+  guint64 n_chunks;
+
+  GMutex mutex;
+  GCond cond;
+  /* Protected by .mutex. Chunks in flight, indexed by their number modulo
+   * WINDOW; the number of the chunk being read; and of the next chunk to
+   * submit.
+   */
+  GisHttpImageChunk *window[WINDOW];
+  guint64 reading;
+  guint64 next_chunk;
+
+  /* The chunk being copied out, and how much of it has been copied */
+  GBytes *current;
+  gsize current_offset;
+} GisHttpImageReader;
+
+G_DEFINE_TYPE (GisHttpImageReader, gis_http_image_reader, G_TYPE_INPUT_STREAM)
+
+static void
+http_connection_free (GisHttpConnection *conn)
+{
+  g_clear_object (&conn->input);
+  g_clear_object (&conn->stream);
+  g_slice_free (GisHttpConnection, conn);
+}
+
+static void
+http_response_clear (GisHttpResponse *response)
+{
+  g_clear_pointer (&response->location, g_free);
+  memset (response, 0, sizeof *response);
+}
+
+static void
+http_client_clear_idle (GisHttpClient *client)
+{
+  GisHttpConnection *conn;
+
+  g_mutex_lock (&client->mutex);
+  while ((conn = g_queue_pop_head (&client->idle)) != NULL)
+    http_connection_free (conn);
+  g_mutex_unlock (&client->mutex);
+}
+
+static void
+http_client_free (GisHttpClient *client)
+{
+  http_client_clear_idle (client);
+  g_mutex_clear (&client->mutex);
+  g_clear_object (&client->socket_client);
+  g_clear_object (&client->address);
+  g_clear_pointer (&client->uri, g_free);
+  g_clear_pointer (&client->origin, g_free);
+  g_clear_pointer (&client->host, g_free);
+  g_clear_pointer (&client->path, g_free);
+  g_slice_free (GisHttpClient, client);
+}
+
+/* Points @client at @uri, which may be relative to the current URI if it
+ * is a redirect.
+ */
+static gboolean
+http_client_set_uri (GisHttpClient *client,
+                     const gchar   *uri,
+                     GError       **error)
+{
+  g_autofree gchar *absolute = NULL;
+  g_autofree gchar *scheme = NULL;
+  g_autoptr(GSocketConnectable) address = NULL;
+  const gchar *authority;
+  const gchar *path;
+  const gchar *hostname;
+  guint16 default_port;
+  guint16 port;
+  gsize path_len;
+
+  if (*uri == '/' && client->origin != NULL)
+    uri = absolute = g_strconcat (client->origin, uri, NULL);
+
+  scheme = g_uri_parse_scheme (uri);
+  if (g_strcmp0 (scheme, "http") == 0)
+    default_port = 80;
+  else if (g_strcmp0 (scheme, "https") == 0)
+    default_port = 443;
+  else
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "%s is not an HTTP or HTTPS URI", uri);
+      return FALSE;
+    }
+
+  address = g_network_address_parse_uri (uri, default_port, error);
+  if (address == NULL)
+    return FALSE;
+
+  authority = strstr (uri, "://") + strlen ("://");
+  path = authority + strcspn (authority, "/?#");
+  path_len = strcspn (path, "#");
+
+  hostname = g_network_address_get_hostname (G_NETWORK_ADDRESS (address));
+  port = g_network_address_get_port (G_NETWORK_ADDRESS (address));
+
+  http_client_clear_idle (client);
+  g_socket_client_set_tls (client->socket_client, default_port == 443);
+
+  g_free (client->uri);
+  client->uri = g_strdup (uri);
+  g_free (client->origin);
+  client->origin = g_strndup (uri, path - uri);
+  g_free (client->host);
+  client->host = g_strdup_printf (strchr (hostname, ':') != NULL ? "[%s]" : "%s",
+                                  hostname);
+  if (port != default_port)
+    {
+      gchar *host = g_strdup_printf ("%s:%u", client->host, port);
+
+      g_free (client->host);
+      client->host = host;
+    }
+  g_free (client->path);
+  if (*path == '/')
+    client->path = g_strndup (path, path_len);
+  else
+    client->path = g_strdup_printf ("/%.*s", (gint) path_len, path);
+  g_clear_object (&client->address);
+  client->address = g_steal_pointer (&address);
+
+  return TRUE;
+}
+
+static GisHttpClient *
+http_client_new (const gchar *uri,
+                 GError     **error)
+{
+  GisHttpClient *client = g_slice_new0 (GisHttpClient);
+
+  g_mutex_init (&client->mutex);
+  g_queue_init (&client->idle);
+  client->socket_client = g_socket_client_new ();
+  g_socket_client_set_timeout (client->socket_client, TIMEOUT);
+
+  if (!http_client_set_uri (client, uri, error))
+    {
+      http_client_free (client);
+      return NULL;
+    }
+
+  return client;
+}
+
+/* Returns an idle connection to the server, if there is one, or a new
+ * one.
+ */
+static GisHttpConnection *
+http_client_get_connection (GisHttpClient *client,
+                            gboolean      *reused,
+                            GCancellable  *cancellable,
+                            GError       **error)
+{
+  g_autoptr(GSocketConnection) connection = NULL;
+  GisHttpConnection *conn;
+
+  g_mutex_lock (&client->mutex);
+  conn = g_queue_pop_head (&client->idle);
+  g_mutex_unlock (&client->mutex);
+
+  *reused = conn != NULL;
+  if (conn != NULL)
+    return conn;
+
+  connection = g_socket_client_connect (client->socket_client,
+                                        client->address, cancellable, error);
+  if (connection == NULL)
+    return NULL;
+
+  conn = g_slice_new0 (GisHttpConnection);
+  conn->stream = G_IO_STREAM (g_steal_pointer (&connection));
+  conn->input =
+    g_data_input_stream_new (g_io_stream_get_input_stream (conn->stream));
+  g_data_input_stream_set_newline_type (conn->input,
+                                        G_DATA_STREAM_NEWLINE_TYPE_ANY);
+  conn->output = g_io_stream_get_output_stream (conn->stream);
+
+  return conn;
+}
+
+/* Hands @conn back to @client for reuse if the server will keep it open,
+ * and the whole response has been read.
+ */
+static void
+http_client_release_connection (GisHttpClient     *client,
+                                GisHttpConnection *conn,
+                                GisHttpResponse   *response)
+{
+  if (!response->keep_alive)
+    {
+      http_connection_free (conn);
+      return;
+    }
+
+  g_mutex_lock (&client->mutex);
+  g_queue_push_tail (&client->idle, conn);
+  g_mutex_unlock (&client->mutex);
+}
+
+/* Parses a decimal number at the start of @str. If @end is %NULL, the number
+ * must be the whole of @str.
+ */
+static gboolean
+parse_uint64 (const gchar  *str,
+              const gchar **end,
+              guint64      *out)
+{
+  gchar *endptr = NULL;
+
+  if (!g_ascii_isdigit (*str))
+    return FALSE;
+
+  errno = 0;
+  *out = g_ascii_strtoull (str, &endptr, 10);
+  if (errno != 0)
+    return FALSE;
+
+  if (end != NULL)
+    *end = endptr;
+  else if (*endptr != '\0')
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Parses the value of a Content-Range header: "bytes 0-1023/4096". */
+static gboolean
+parse_content_range (const gchar     *value,
+                     GisHttpResponse *response)
+{
+  const gchar *cur;
+
+  if (!g_str_has_prefix (value, "bytes "))
+    return FALSE;
+
+  cur = value + strlen ("bytes ");
+  if (!parse_uint64 (cur, &cur, &response->range_start) || *cur != '-' ||
+      !parse_uint64 (cur + 1, &cur, &response->range_end) || *cur != '/' ||
+      response->range_end < response->range_start)
+    return FALSE;
+
+  cur++;
+  if (g_strcmp0 (cur, "*") == 0)
+    response->total_size = 0;
+  else if (!parse_uint64 (cur, NULL, &response->total_size) ||
+           response->total_size <= response->range_end)
+    return FALSE;
+
+  response->has_range = TRUE;
+  return TRUE;
+}
+
+static gboolean
+http_connection_read_line (GisHttpConnection *conn,
+                           gchar            **line,
+                           GCancellable      *cancellable,
+                           GError           **error)
+{
+  g_autoptr(GError) local_error = NULL;
+
+  *line = g_data_input_stream_read_line (conn->input, NULL, cancellable,
+                                         &local_error);
+  if (*line != NULL)
+    {
+      /* G_DATA_STREAM_NEWLINE_TYPE_ANY leaves the \r of a \r\n behind if
+       * they were split between reads.
+       */
+      g_strchomp (*line);
+      return TRUE;
+    }
+
+  if (local_error != NULL)
+    g_propagate_error (error, g_steal_pointer (&local_error));
+  else
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+                         "server closed the connection");
+
+  return FALSE;
+}
+
+/* Sends a GET request on @conn, and reads the response's status line and
+ * headers into @response.
+ */
+static gboolean
+http_connection_send (GisHttpConnection *conn,
+                      GisHttpClient     *client,
+                      const gchar       *range,
+                      GisHttpResponse   *response,
+                      GCancellable      *cancellable,
+                      GError           **error)
+{
+  g_autoptr(GString) request = g_string_new (NULL);
+  g_autofree gchar *status_line = NULL;
+  const gchar *cur;
+  guint64 status;
+  guint i;
+
+  g_string_append_printf (request, "GET %s HTTP/1.1\r\n", client->path);
+  g_string_append_printf (request, "Host: %s\r\n", client->host);
+  g_string_append (request, "User-Agent: " GETTEXT_PACKAGE "\r\n");
+  g_string_append (request, "Accept-Encoding: identity\r\n");
+  if (range != NULL)
+    g_string_append_printf (request, "Range: %s\r\n", range);
+  g_string_append (request, "\r\n");
+
+  if (!g_output_stream_write_all (conn->output, request->str, request->len,
+                                  NULL, cancellable, error) ||
+      !http_connection_read_line (conn, &status_line, cancellable, error))
+    return FALSE;
+
+  /* "HTTP/1.1 206 Partial Content" */
+  if (!g_str_has_prefix (status_line, "HTTP/1.") ||
+      !g_ascii_isdigit (status_line[7]) ||
+      status_line[8] != ' ' ||
+      !parse_uint64 (status_line + 9, &cur, &status) ||
+      (*cur != ' ' && *cur != '\0') ||
+      status < 100 || status > 999)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "invalid HTTP status line from %s: %s", client->uri,
+                   status_line);
+      return FALSE;
+    }
+
+  response->status = status;
+  response->keep_alive = status_line[7] != '0';
+  response->content_length = -1;
+
+  for (i = 0; ; i++)
+    {
+      g_autofree gchar *line = NULL;
+      gchar *value;
+
+      if (i == MAX_HEADER_LINES)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "too many HTTP headers from %s", client->uri);
+          return FALSE;
+        }
+
+      if (!http_connection_read_line (conn, &line, cancellable, error))
+        return FALSE;
+
+      if (*line == '\0')
+        break;
+
+      value = strchr (line, ':');
+      if (value == NULL)
+        continue;
+
+      *value++ = '\0';
+      g_strstrip (value);
+
+      if (g_ascii_strcasecmp (line, "Content-Length") == 0)
+        {
+          guint64 length;
+
+          if (!parse_uint64 (value, NULL, &length) || length > G_MAXINT64)
+            goto invalid;
+
+          response->content_length = length;
+        }
+      else if (g_ascii_strcasecmp (line, "Content-Range") == 0)
+        {
+          if (!parse_content_range (value, response))
+            goto invalid;
+        }
+      else if (g_ascii_strcasecmp (line, "Connection") == 0)
+        {
+          if (g_ascii_strcasecmp (value, "close") == 0)
+            response->keep_alive = FALSE;
+          else if (g_ascii_strcasecmp (value, "keep-alive") == 0)
+            response->keep_alive = TRUE;
+        }
+      else if (g_ascii_strcasecmp (line, "Transfer-Encoding") == 0)
+        {
+          response->chunked = g_ascii_strcasecmp (value, "identity") != 0;
+        }
+      else if (g_ascii_strcasecmp (line, "Location") == 0)
+        {
+          g_free (response->location);
+          response->location = g_strdup (value);
+        }
+
+      continue;
+
+invalid:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "invalid %s header from %s: %s", line, client->uri, value);
+      return FALSE;
+    }
+
+  /* Without a length, the body runs until the server closes the
+   * connection.
+   */
+  if (response->content_length < 0 || response->chunked)
+    response->keep_alive = FALSE;
+
+  return TRUE;
+}
+
+/* Sends a GET request for @client's URI, with a Range header if @range is
+ * not %NULL, and reads the status and headers of the response. Returns the
+ * connection to read the body from.
+ */
+static GisHttpConnection *
+http_client_request (GisHttpClient   *client,
+                     const gchar     *range,
+                     GisHttpResponse *response,
+                     GCancellable    *cancellable,
+                     GError         **error)
+{
+  for (;;)
+    {
+      g_autoptr(GError) local_error = NULL;
+      GisHttpConnection *conn;
+      gboolean reused = FALSE;
+
+      conn = http_client_get_connection (client, &reused, cancellable, error);
+      if (conn == NULL)
+        return NULL;
+
+      if (http_connection_send (conn, client, range, response, cancellable,
+                                &local_error))
+        return conn;
+
+      http_connection_free (conn);
+      http_response_clear (response);
+
+      /* The server may have closed an idle connection since it was last
+       * used, so try again with a new one.
+       */
+      if (!reused ||
+          g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return NULL;
+        }
+    }
+}
+
+/* Like http_client_request(), but follows redirects. */
+static GisHttpConnection *
+http_client_open (GisHttpClient   *client,
+                  const gchar     *range,
+                  GisHttpResponse *response,
+                  GCancellable    *cancellable,
+                  GError         **error)
+{
+  guint i;
+
+  for (i = 0; ; i++)
+    {
+      GisHttpConnection *conn;
+      g_autofree gchar *location = NULL;
+
+      conn = http_client_request (client, range, response, cancellable, error);
+      if (conn == NULL)
+        return NULL;
+
+      if ((response->status != 301 && response->status != 302 &&
+           response->status != 303 && response->status != 307 &&
+           response->status != 308) ||
+          response->location == NULL)
+        return conn;
+
+      http_connection_free (conn);
+      location = g_steal_pointer (&response->location);
+      http_response_clear (response);
+
+      if (i == MAX_REDIRECTS)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "too many redirects from %s", client->uri);
+          return NULL;
+        }
+
+      g_message ("following redirect from %s to %s", client->uri, location);
+      if (!http_client_set_uri (client, location, error))
+        return NULL;
+    }
+}
+
+static gboolean
+http_response_check_status (GisHttpResponse *response,
+                            GisHttpClient   *client,
+                            guint            expected,
+                            GError         **error)
+{
+  if (response->status == expected)
+    return TRUE;
+
+  if (response->status / 100 == 2)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                 "unexpected HTTP status %u fetching %s", response->status,
+                 client->uri);
+  else
+    g_set_error (error, G_IO_ERROR,
+                 response->status == 404 || response->status == 410
+                   ? G_IO_ERROR_NOT_FOUND : G_IO_ERROR_FAILED,
+                 "HTTP error %u fetching %s", response->status, client->uri);
+  return FALSE;
+}
+
+/* Reads up to @max_length bytes of the body of @response from @conn. If that
+ * is not the whole body, the connection cannot be reused.
+ */
+static GBytes *
+http_connection_read_body (GisHttpConnection *conn,
+                           GisHttpClient     *client,
+                           GisHttpResponse   *response,
+                           gsize              max_length,
+                           GCancellable      *cancellable,
+                           GError           **error)
+{
+  g_autofree guint8 *buf = NULL;
+  gsize length = max_length;
+  gsize bytes_read = 0;
+
+  if (response->chunked)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "chunked transfer encoding from %s is not supported",
+                   client->uri);
+      return NULL;
+    }
+
+  if (response->content_length >= 0 &&
+      (guint64) response->content_length <= max_length)
+    length = response->content_length;
+  else
+    response->keep_alive = FALSE;
+
+  buf = g_malloc (MAX (length, 1));
+  if (!g_input_stream_read_all (G_INPUT_STREAM (conn->input), buf, length,
+                                &bytes_read, cancellable, error))
+    return NULL;
+
+  if (bytes_read < length && response->content_length >= 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+                   "server closed the connection after %" G_GSIZE_FORMAT
+                   " of %" G_GSIZE_FORMAT " bytes of %s",
+                   bytes_read, length, client->uri);
+      return NULL;
+    }
+
+  return g_bytes_new_take (g_steal_pointer (&buf), bytes_read);
+}
+
+/* Fetches @length bytes from @offset with a Range request on one of
+ * @client's connections. Unlike gis_http_image_fetch_range(), it is an error
+ * if the server does not send exactly that range.
+ */
+static GBytes *
+http_client_fetch_chunk (GisHttpClient *client,
+                         guint64        offset,
+                         gsize          length,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  g_autofree gchar *range = NULL;
+  GisHttpResponse response = { 0, };
+  GisHttpConnection *conn;
+  GBytes *data = NULL;
+
+  range = g_strdup_printf ("bytes=%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT,
+                           offset, offset + length - 1);
+  conn = http_client_request (client, range, &response, cancellable, error);
+  if (conn == NULL)
+    return NULL;
+
+  if (!http_response_check_status (&response, client, 206, error))
+    goto out;
+
+  if (!response.has_range ||
+      response.range_start != offset ||
+      response.range_end != offset + length - 1)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "server sent the wrong range of %s for %s", client->uri,
+                   range);
+      goto out;
+    }
+
+  data = http_connection_read_body (conn, client, &response, length,
+                                    cancellable, error);
+
+out:
+  if (data != NULL)
+    {
+      http_client_release_connection (client, conn, &response);
+    }
+  else
+    {
+      http_connection_free (conn);
+    }
+
+  http_response_clear (&response);
+  return data;
+}
+
+/**
+ * gis_http_image_is_http:
+ * @file: an image file
+ *
+ * Returns: %TRUE if @file is on an HTTP or HTTPS server
+ */
+gboolean
+gis_http_image_is_http (GFile *file)
+{
+  g_autofree gchar *scheme = g_file_get_uri_scheme (file);
+
+  return g_strcmp0 (scheme, "http") == 0 || g_strcmp0 (scheme, "https") == 0;
+}
+
+/**
+ * gis_http_image_fetch_range:
+ * @file: an image on an HTTP or HTTPS server
+ * @offset: offset of the first byte to fetch
+ * @length: number of bytes to fetch
+ * @total_size: (out): the size of the whole image
+ *
+ * Fetches part of @file with a single Range request, such as to examine its
+ * partition table. If the server does not support Range requests, @offset
+ * must be 0; the start of the response is used, and the rest is discarded.
+ *
+ * Returns: (transfer full): the bytes fetched, of which there may be fewer
+ *  than @length if @file ends first; or %NULL on error.
+ */
+GBytes *
+gis_http_image_fetch_range (GFile        *file,
+                            guint64       offset,
+                            gsize         length,
+                            guint64      *total_size,
+                            GCancellable *cancellable,
+                            GError      **error)
+{
+  g_autofree gchar *uri = NULL;
+  g_autofree gchar *range = NULL;
+  GisHttpClient *client = NULL;
+  GisHttpConnection *conn = NULL;
+  GisHttpResponse response = { 0, };
+  GBytes *data = NULL;
+
+  g_return_val_if_fail (G_IS_FILE (file), NULL);
+  g_return_val_if_fail (length > 0, NULL);
+  g_return_val_if_fail (total_size != NULL, NULL);
+
+  uri = g_file_get_uri (file);
+  client = http_client_new (uri, error);
+  if (client == NULL)
+    return NULL;
+
+  range = g_strdup_printf ("bytes=%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT,
+                           offset, offset + length - 1);
+  conn = http_client_open (client, range, &response, cancellable, error);
+  if (conn == NULL)
+    goto out;
+
+  if (response.status == 206)
+    {
+      if (!response.has_range || response.range_start != offset ||
+          response.total_size == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "server sent the wrong range of %s for %s",
+                       client->uri, range);
+          goto out;
+        }
+
+      *total_size = response.total_size;
+    }
+  else if (response.status == 200)
+    {
+      if (offset != 0 || response.content_length < 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "server does not support range requests for %s",
+                       client->uri);
+          goto out;
+        }
+
+      *total_size = response.content_length;
+    }
+  else if (!http_response_check_status (&response, client, 206, error))
+    {
+      goto out;
+    }
+
+  data = http_connection_read_body (conn, client, &response, length,
+                                    cancellable, error);
+
+out:
+  g_clear_pointer (&conn, http_connection_free);
+  http_response_clear (&response);
+  http_client_free (client);
+  return data;
+}
+
+/**
+ * gis_http_image_fetch_sidecar:
+ * @file: an image on an HTTP or HTTPS server
+ * @suffix: suffix of the sidecar file, such as ".asc" or ".sha256"
+ * @dir: local directory to save the sidecar file in
+ *
+ * Fetches the signature or checksum for @file, whose URI is @file's with
+ * @suffix appended, and saves it in @dir with the same basename.
+ *
+ * Returns: (transfer full): the local copy of the sidecar file; or %NULL,
+ *  with %G_IO_ERROR_NOT_FOUND if the server does not have it, or some other
+ *  error.
+ */
+GFile *
+gis_http_image_fetch_sidecar (GFile        *file,
+                              const gchar  *suffix,
+                              GFile        *dir,
+                              GCancellable *cancellable,
+                              GError      **error)
+{
+  g_autofree gchar *image_uri = NULL;
+  g_autofree gchar *uri = NULL;
+  g_autofree gchar *basename = NULL;
+  g_autofree gchar *sidecar_name = NULL;
+  g_autoptr(GBytes) data = NULL;
+  g_autoptr(GFile) sidecar = NULL;
+  GisHttpClient *client = NULL;
+  GisHttpConnection *conn = NULL;
+  GisHttpResponse response = { 0, };
+
+  g_return_val_if_fail (G_IS_FILE (file), NULL);
+  g_return_val_if_fail (suffix != NULL, NULL);
+  g_return_val_if_fail (G_IS_FILE (dir), NULL);
+
+  image_uri = g_file_get_uri (file);
+  uri = g_strconcat (image_uri, suffix, NULL);
+  client = http_client_new (uri, error);
+  if (client == NULL)
+    return NULL;
+
+  conn = http_client_open (client, NULL, &response, cancellable, error);
+  if (conn == NULL ||
+      !http_response_check_status (&response, client, 200, error))
+    goto out;
+
+  if (response.content_length > MAX_SIDECAR_SIZE)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is too large to be a signature or checksum",
+                   client->uri);
+      goto out;
+    }
+
+  data = http_connection_read_body (conn, client, &response, MAX_SIDECAR_SIZE,
+                                    cancellable, error);
+  if (data == NULL)
+    goto out;
+
+  basename = g_file_get_basename (file);
+  sidecar_name = g_strconcat (basename, suffix, NULL);
+  sidecar = g_file_get_child (dir, sidecar_name);
+  if (!g_file_replace_contents (sidecar, g_bytes_get_data (data, NULL),
+                                g_bytes_get_size (data), NULL, FALSE,
+                                G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                cancellable, error))
+    g_clear_object (&sidecar);
+
+out:
+  g_clear_pointer (&conn, http_connection_free);
+  http_response_clear (&response);
+  http_client_free (client);
+  return g_steal_pointer (&sidecar);
+}
+
+/**
+ * gis_http_image_fetch_sidecars:
+ * @file: an image on an HTTP or HTTPS server
+ * @dir: local directory to save the sidecar files in
+ *
+ * Fetches the signature for @file, as with gis_http_image_fetch_sidecar(), to
+ * @dir. If @file is on an HTTPS server which does not have a signature, its
+ * checksum is fetched instead; but if @file is on a plain HTTP server, it must
+ * have a signature.
+ *
+ * Returns: %TRUE if a signature or checksum was fetched; %FALSE with
+ *  %GIS_IMAGE_ERROR_VERIFICATION_FAILED if there is none, or some other error.
+ */
+gboolean
+gis_http_image_fetch_sidecars (GFile        *file,
+                               GFile        *dir,
+                               GCancellable *cancellable,
+                               GError      **error)
+{
+  g_autofree gchar *scheme = NULL;
+  g_autofree gchar *uri = NULL;
+  g_autoptr(GFile) sidecar = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  g_return_val_if_fail (G_IS_FILE (file), FALSE);
+  g_return_val_if_fail (G_IS_FILE (dir), FALSE);
+
+  sidecar = gis_http_image_fetch_sidecar (file, ".asc", dir, cancellable,
+                                          &local_error);
+  if (sidecar != NULL)
+    return TRUE;
+
+  if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  g_clear_error (&local_error);
+  uri = g_file_get_uri (file);
+  scheme = g_file_get_uri_scheme (file);
+  if (g_strcmp0 (scheme, "https") != 0)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   /* Translators: the placeholder is a URL. */
+                   _("The signature file ‘%s.asc’ does not exist. Images on servers without HTTPS must be signed."),
+                   uri);
+      return FALSE;
+    }
+
+  sidecar = gis_http_image_fetch_sidecar (file, ".sha256", dir, cancellable,
+                                          &local_error);
+  if (sidecar != NULL)
+    return TRUE;
+
+  if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                 _("Neither the signature file ‘%s.asc’ nor the checksum file ‘%s.sha256’ exist."),
+                 uri, uri);
+  else
+    g_propagate_error (error, g_steal_pointer (&local_error));
+
+  return FALSE;
+}
+
+static void
+gis_http_image_chunk_free (GisHttpImageChunk *chunk)
+{
+  g_clear_pointer (&chunk->data, g_bytes_unref);
+  g_clear_error (&chunk->error);
+  g_slice_free (GisHttpImageChunk, chunk);
+}
+
+static void
+gis_http_image_reader_worker (gpointer data,
+                              gpointer user_data)
+{
+  GisHttpImageChunk *chunk = data;
+  GisHttpImageReader *self = GIS_HTTP_IMAGE_READER (user_data);
+  GBytes *bytes = NULL;
+  GError *error = NULL;
+  guint attempt;
+
+  for (attempt = 1; ; attempt++)
+    {
+      bytes = http_client_fetch_chunk (self->client, chunk->offset,
+                                       chunk->length, self->cancellable,
+                                       &error);
+      if (bytes != NULL ||
+          attempt == MAX_ATTEMPTS ||
+          g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
+          g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        break;
+
+      g_message ("fetching %" G_GSIZE_FORMAT " bytes at %" G_GUINT64_FORMAT
+                 " failed; trying again: %s",
+                 chunk->length, chunk->offset, error->message);
+      g_clear_error (&error);
+    }
+
+  g_mutex_lock (&self->mutex);
+  chunk->data = bytes;
+  chunk->error = error;
+  chunk->done = TRUE;
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+}
+
+/* Submits chunks to the worker pool until the window is full. Called with
+ * the mutex held.
+ */
+static void
+gis_http_image_reader_submit_chunks (GisHttpImageReader *self)
+{
+  while (self->next_chunk < self->n_chunks &&
+         self->next_chunk < self->reading + WINDOW)
+    {
+      GisHttpImageChunk *chunk = g_slice_new0 (GisHttpImageChunk);
+
+      chunk->offset = self->next_chunk * CHUNK_SIZE;
+      chunk->length = MIN (CHUNK_SIZE, self->size - chunk->offset);
+      self->window[self->next_chunk % WINDOW] = chunk;
+      self->next_chunk++;
+      g_thread_pool_push (self->pool, chunk, NULL);
+    }
+}
+
+static gssize
+gis_http_image_reader_read_sequential (GisHttpImageReader *self,
+                                       void               *buffer,
+                                       gsize               count,
+                                       GCancellable       *cancellable,
+                                       GError            **error)
+{
+  gssize n;
+
+  count = MIN (count, self->sequential_remaining);
+  if (count == 0)
+    return 0;
+
+  n = g_input_stream_read (G_INPUT_STREAM (self->sequential->input), buffer,
+                           count, cancellable, error);
+  if (n == 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+                   "server closed the connection with %" G_GUINT64_FORMAT
+                   " bytes of %s left to read",
+                   self->sequential_remaining, self->client->uri);
+      return -1;
+    }
+
+  if (n > 0)
+    self->sequential_remaining -= n;
+
+  return n;
+}
+
+static gssize
+gis_http_image_reader_read (GInputStream  *stream,
+                            void          *buffer,
+                            gsize          count,
+                            GCancellable  *cancellable,
+                            GError       **error)
+{
+  GisHttpImageReader *self = GIS_HTTP_IMAGE_READER (stream);
+  gsize n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  if (self->sequential != NULL)
+    return gis_http_image_reader_read_sequential (self, buffer, count,
+                                                  cancellable, error);
+
+  if (self->current == NULL)
+    {
+      GisHttpImageChunk *chunk;
+
+      g_mutex_lock (&self->mutex);
+      if (self->reading >= self->n_chunks)
+        {
+          g_mutex_unlock (&self->mutex);
+          return 0;
+        }
+
+      chunk = self->window[self->reading % WINDOW];
+      while (!chunk->done)
+        g_cond_wait (&self->cond, &self->mutex);
+
+      if (chunk->error != NULL)
+        {
+          /* Keep failing, rather than skipping to the next chunk. */
+          g_propagate_error (error, g_error_copy (chunk->error));
+          g_mutex_unlock (&self->mutex);
+          return -1;
+        }
+
+      self->current = g_steal_pointer (&chunk->data);
+      self->current_offset = 0;
+      self->window[self->reading % WINDOW] = NULL;
+      gis_http_image_chunk_free (chunk);
+      self->reading++;
+      gis_http_image_reader_submit_chunks (self);
+      g_mutex_unlock (&self->mutex);
+    }
+
+  n = MIN (count, g_bytes_get_size (self->current) - self->current_offset);
+  memcpy (buffer,
+          (const guint8 *) g_bytes_get_data (self->current, NULL)
+          + self->current_offset,
+          n);
+  self->current_offset += n;
+
+  if (self->current_offset == g_bytes_get_size (self->current))
+    g_clear_pointer (&self->current, g_bytes_unref);
+
+  return n;
+}
+
+/* Stops the workers, and frees any chunks they had fetched. */
+static void
+gis_http_image_reader_stop (GisHttpImageReader *self)
+{
+  guint i;
+
+  if (self->pool != NULL)
+    {
+      g_cancellable_cancel (self->cancellable);
+
+      /* Chunks which haven't been started are dropped. */
+      g_thread_pool_free (g_steal_pointer (&self->pool), TRUE, TRUE);
+    }
+
+  for (i = 0; i < WINDOW; i++)
+    g_clear_pointer (&self->window[i], gis_http_image_chunk_free);
+
+  g_clear_pointer (&self->sequential, http_connection_free);
+  g_clear_pointer (&self->client, http_client_free);
+  g_clear_pointer (&self->current, g_bytes_unref);
+}
+
+static gboolean
+gis_http_image_reader_close (GInputStream  *stream,
+                             GCancellable  *cancellable,
+                             GError       **error)
+{
+  gis_http_image_reader_stop (GIS_HTTP_IMAGE_READER (stream));
+
+  return TRUE;
+}
+
+static void
+gis_http_image_reader_init (GisHttpImageReader *self)
+{
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->cond);
+  self->cancellable = g_cancellable_new ();
+}
+
+static void
+gis_http_image_reader_finalize (GObject *object)
+{
+  GisHttpImageReader *self = GIS_HTTP_IMAGE_READER (object);
+
+  /* GInputStream closes the stream on dispose, if it has not been closed
+   * already, so this is just belt and braces.
+   */
+  gis_http_image_reader_stop (self);
+
+  g_clear_object (&self->cancellable);
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->cond);
+
+  G_OBJECT_CLASS (gis_http_image_reader_parent_class)->finalize (object);
+}
+
+static void
+gis_http_image_reader_class_init (GisHttpImageReaderClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *istream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = gis_http_image_reader_finalize;
+
+  istream_class->read_fn = gis_http_image_reader_read;
+  /* Allow parent class to emulate skip; the scribe never skips. */
+  istream_class->close_fn = gis_http_image_reader_close;
+}
+
+/**
+ * gis_http_image_reader_open:
+ * @file: an image on an HTTP or HTTPS server
+ *
+ * Opens @file for reading. Its contents are fetched with several concurrent
+ * Range requests, ahead of the current position, on a pool of worker
+ * threads; or with a single request, if the server does not support Range
+ * requests.
+ *
+ * Returns: (transfer full): a stream reading @file, or %NULL on error.
+ */
+GInputStream *
+gis_http_image_reader_open (GFile        *file,
+                            GCancellable *cancellable,
+                            GError      **error)
+{
+  g_autofree gchar *uri = NULL;
+  g_autoptr(GisHttpImageReader) self = NULL;
+  g_autoptr(GBytes) first_byte = NULL;
+  GisHttpConnection *conn = NULL;
+  GisHttpResponse response = { 0, };
+  gboolean ret = FALSE;
+
+  g_return_val_if_fail (G_IS_FILE (file), NULL);
+
+  self = g_object_new (GIS_TYPE_HTTP_IMAGE_READER, NULL);
+  uri = g_file_get_uri (file);
+  self->client = http_client_new (uri, error);
+  if (self->client == NULL)
+    return NULL;
+
+  /* Ask for just the first byte, to find out how big the image is and
+   * whether the server supports Range requests at all. This also follows
+   * any redirects once and for all.
+   */
+  conn = http_client_open (self->client, "bytes=0-0", &response, cancellable,
+                           error);
+  if (conn == NULL)
+    goto out;
+
+  if (response.status == 206 && response.total_size > 0)
+    {
+      first_byte = http_connection_read_body (conn, self->client, &response, 1,
+                                              cancellable, error);
+      if (first_byte == NULL)
+        goto out;
+
+      http_client_release_connection (self->client, g_steal_pointer (&conn),
+                                      &response);
+
+      self->size = response.total_size;
+      self->n_chunks = (self->size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+      self->pool = g_thread_pool_new (gis_http_image_reader_worker, self,
+                                      N_CONNECTIONS, FALSE, error);
+      if (self->pool == NULL)
+        goto out;
+
+      g_mutex_lock (&self->mutex);
+      gis_http_image_reader_submit_chunks (self);
+      g_mutex_unlock (&self->mutex);
+
+      g_message ("reading %s: %" G_GUINT64_FORMAT " bytes, with up to %u "
+                 "concurrent range requests",
+                 self->client->uri, self->size, N_CONNECTIONS);
+    }
+  else if (response.status == 200 && response.content_length >= 0 &&
+           !response.chunked)
+    {
+      self->size = self->sequential_remaining = response.content_length;
+      self->sequential = g_steal_pointer (&conn);
+
+      g_message ("reading %s: %" G_GUINT64_FORMAT " bytes, with a single "
+                 "request because the server does not support range requests",
+                 self->client->uri, self->size);
+    }
+  else if (response.status / 100 == 2)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "can't determine the size of %s", self->client->uri);
+      goto out;
+    }
+  else
+    {
+      http_response_check_status (&response, self->client, 206, error);
+      goto out;
+    }
+
+  ret = TRUE;
+
+out:
+  g_clear_pointer (&conn, http_connection_free);
+  http_response_clear (&response);
+
+  if (!ret)
+    return NULL;
+
+  return G_INPUT_STREAM (g_steal_pointer (&self));
+}
+
+/**
+ * gis_http_image_reader_get_size:
+ *
+ * Returns: the size of the image, in bytes, as reported by the server
+ */
+guint64
+gis_http_image_reader_get_size (GisHttpImageReader *self)
+{
+  g_return_val_if_fail (GIS_IS_HTTP_IMAGE_READER (self), 0);
+
+  return self->size;
+}
@@ -0,0 +1,57 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_HTTP_IMAGE_H
+#define GIS_HTTP_IMAGE_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define GIS_TYPE_HTTP_IMAGE_READER (gis_http_image_reader_get_type ())
+G_DECLARE_FINAL_TYPE (GisHttpImageReader, gis_http_image_reader, GIS, HTTP_IMAGE_READER, GInputStream);
+
+gboolean gis_http_image_is_http (GFile *file);
+
+GBytes *gis_http_image_fetch_range (GFile        *file,
+                                    guint64       offset,
+                                    gsize         length,
+                                    guint64      *total_size,
+                                    GCancellable *cancellable,
+                                    GError      **error);
+
+GFile *gis_http_image_fetch_sidecar (GFile        *file,
+                                     const gchar  *suffix,
+                                     GFile        *dir,
+                                     GCancellable *cancellable,
+                                     GError      **error);
+
+gboolean gis_http_image_fetch_sidecars (GFile        *file,
+                                        GFile        *dir,
+                                        GCancellable *cancellable,
+                                        GError      **error);
+
+GInputStream *gis_http_image_reader_open (GFile        *file,
+                                          GCancellable *cancellable,
+                                          GError      **error);
+
+guint64 gis_http_image_reader_get_size (GisHttpImageReader *self);
+
+G_END_DECLS
+
+#endif /* GIS_HTTP_IMAGE_H */
@@ -0,0 +1,559 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A directory of decompressed, verified images, so that installing the same
+ * image again on the same machine need not read, verify and decompress it
+ * again. Each image is stored as a (sparse) file named after a key derived
+ * from the compressed image's name, size and modification time, and from its
+ * signature or checksum, so a different image or a re-signed one is never
+ * mistaken for a cached one.
+ */
+#include "config.h"
+#include "gis-image-cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include "glnx-dirfd.h"
+#include "glnx-errors.h"
+#include "glnx-fdio.h"
+
+#define ENTRY_SUFFIX ".img"
+
+typedef struct _GisImageCache {
+  GObject parent;
+
+  gchar *directory;
+  /* 0 means no limit other than the free space on the filesystem. */
+  guint64 max_size;
+  guint max_entries;
+  GisImageCacheEviction eviction;
+
+  /* Guards changes to the contents of the directory, which may be made from
+   * several writers' threads at once.
+   */
+  GMutex mutex;
+} GisImageCache;
+
+struct _GisImageCacheEntry {
+  GisImageCache *cache;
+  gchar *key;
+  guint64 size;
+  /* The cache directory, which tmpf is linked into on commit. */
+  gint dfd;
+  GLnxTmpfile tmpf;
+  /* Number of bytes written (or skipped, for runs of zeros) so far. */
+  guint64 offset;
+};
+
+typedef struct {
+  gchar *name;
+  guint64 allocated;
+  struct timespec mtime;
+} CachedImage;
+
+G_DEFINE_TYPE (GisImageCache, gis_image_cache, G_TYPE_OBJECT)
+
+static void
+gis_image_cache_finalize (GObject *object)
+{
+  GisImageCache *self = GIS_IMAGE_CACHE (object);
+
+  g_clear_pointer (&self->directory, g_free);
+  g_mutex_clear (&self->mutex);
+
+  G_OBJECT_CLASS (gis_image_cache_parent_class)->finalize (object);
+}
+
+static void
+gis_image_cache_class_init (GisImageCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = gis_image_cache_finalize;
+}
+
+static void
+gis_image_cache_init (GisImageCache *self)
+{
+  g_mutex_init (&self->mutex);
+}
+
+/**
+ * gis_image_cache_new:
+ * @directory: directory to store images in; created if it does not exist
+ * @max_size: maximum disk space to use for cached images, in bytes, or 0 to
+ *  use as much as is free
+ * @max_entries: maximum number of images to keep, or 0 for no limit
+ * @eviction: what to do when a new image would exceed either limit
+ *
+ * Returns: (transfer full): a new cache
+ */
+GisImageCache *
+gis_image_cache_new (const gchar          *directory,
+                     guint64               max_size,
+                     guint                 max_entries,
+                     GisImageCacheEviction eviction)
+{
+  GisImageCache *self;
+
+  g_return_val_if_fail (directory != NULL, NULL);
+
+  self = g_object_new (GIS_TYPE_IMAGE_CACHE, NULL);
+  self->directory = g_strdup (directory);
+  self->max_size = max_size;
+  self->max_entries = max_entries;
+  self->eviction = eviction;
+
+  return self;
+}
+
+const gchar *
+gis_image_cache_get_directory (GisImageCache *self)
+{
+  g_return_val_if_fail (GIS_IS_IMAGE_CACHE (self), NULL);
+
+  return self->directory;
+}
+
+/**
+ * gis_image_cache_compute_key:
+ * @image: the (compressed) image file
+ * @verification: the signature or checksum file which @image will be
+ *  verified against
+ *
+ * Returns: (transfer full): a key identifying the decompressed contents of
+ *  @image, suitable for gis_image_cache_open() and
+ *  gis_image_cache_begin_entry(); or %NULL on error
+ */
+gchar *
+gis_image_cache_compute_key (GFile        *image,
+                             GFile        *verification,
+                             GCancellable *cancellable,
+                             GError      **error)
+{
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GChecksum) checksum = NULL;
+  g_autofree gchar *basename = NULL;
+  g_autofree gchar *identity = NULL;
+  g_autofree gchar *contents = NULL;
+  gsize length = 0;
+
+  g_return_val_if_fail (G_IS_FILE (image), NULL);
+  g_return_val_if_fail (G_IS_FILE (verification), NULL);
+
+  info = g_file_query_info (image,
+                            G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                            G_FILE_QUERY_INFO_NONE,
+                            cancellable, error);
+  if (info == NULL)
+    return NULL;
+
+  if (!g_file_load_contents (verification, cancellable, &contents, &length,
+                             NULL, error))
+    return NULL;
+
+  /* The image partition is mounted at a different path each time, so only
+   * the basename identifies it.
+   */
+  basename = g_file_get_basename (image);
+  identity = g_strdup_printf ("%s\n%" G_GUINT64_FORMAT "\n%" G_GUINT64_FORMAT "\n",
+                              basename,
+                              (guint64) g_file_info_get_size (info),
+                              g_file_info_get_attribute_uint64 (info,
+                                  G_FILE_ATTRIBUTE_TIME_MODIFIED));
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_checksum_update (checksum, (const guchar *) identity, -1);
+  g_checksum_update (checksum, (const guchar *) contents, length);
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+static gboolean
+gis_image_cache_open_directory (GisImageCache *self,
+                                gint          *dfd,
+                                GError       **error)
+{
+  if (g_mkdir_with_parents (self->directory, 0700) < 0)
+    return glnx_throw_errno_prefix (error, "can't create %s", self->directory);
+
+  return glnx_opendirat (AT_FDCWD, self->directory, TRUE, dfd, error);
+}
+
+/**
+ * gis_image_cache_open:
+ * @key: a key returned by gis_image_cache_compute_key()
+ * @size: expected size of the decompressed image
+ *
+ * Opens the cached image for @key, and marks it as recently used.
+ *
+ * Returns: a file descriptor, or -1 with %G_IO_ERROR_NOT_FOUND if the image
+ *  is not cached, or some other error.
+ */
+gint
+gis_image_cache_open (GisImageCache *self,
+                      const gchar   *key,
+                      guint64        size,
+                      GError       **error)
+{
+  glnx_autofd int dfd = -1;
+  glnx_autofd int fd = -1;
+  g_autofree gchar *name = g_strconcat (key, ENTRY_SUFFIX, NULL);
+  struct stat stbuf;
+
+  g_return_val_if_fail (GIS_IS_IMAGE_CACHE (self), -1);
+  g_return_val_if_fail (key != NULL, -1);
+
+  if (!glnx_opendirat (AT_FDCWD, self->directory, TRUE, &dfd, error))
+    return -1;
+
+  fd = openat (dfd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd < 0)
+    {
+      glnx_throw_errno_prefix (error, "can't open cached image %s", name);
+      return -1;
+    }
+
+  if (!glnx_fstat (fd, &stbuf, error))
+    return -1;
+
+  if ((guint64) stbuf.st_size != size)
+    {
+      g_message ("cached image %s is %" G_GUINT64_FORMAT " bytes, expected "
+                 "%" G_GUINT64_FORMAT "; discarding it",
+                 name, (guint64) stbuf.st_size, size);
+
+      g_mutex_lock (&self->mutex);
+      (void) unlinkat (dfd, name, 0);
+      g_mutex_unlock (&self->mutex);
+
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "cached image %s has the wrong size", name);
+      return -1;
+    }
+
+  /* The modification time records when each image was last used, for
+   * GIS_IMAGE_CACHE_EVICTION_LEAST_RECENTLY_USED. The access time is no good
+   * because most filesystems are mounted with relatime.
+   */
+  if (futimens (fd, NULL) < 0)
+    g_message ("can't mark cached image %s as used: %s",
+               name, g_strerror (errno));
+
+  return glnx_steal_fd (&fd);
+}
+
+static void
+cached_image_free (CachedImage *image)
+{
+  g_free (image->name);
+  g_slice_free (CachedImage, image);
+}
+
+static gint
+cached_image_compare_mtime (gconstpointer a,
+                            gconstpointer b)
+{
+  const CachedImage *image_a = *(const CachedImage **) a;
+  const CachedImage *image_b = *(const CachedImage **) b;
+
+  if (image_a->mtime.tv_sec != image_b->mtime.tv_sec)
+    return image_a->mtime.tv_sec < image_b->mtime.tv_sec ? -1 : 1;
+
+  if (image_a->mtime.tv_nsec != image_b->mtime.tv_nsec)
+    return image_a->mtime.tv_nsec < image_b->mtime.tv_nsec ? -1 : 1;
+
+  return 0;
+}
+
+/* Returns the images currently in the cache, least recently used first. */
+static GPtrArray *
+gis_image_cache_list (gint     dfd,
+                      GError **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0, };
+  g_autoptr(GPtrArray) images =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) cached_image_free);
+
+  if (!glnx_dirfd_iterator_init_at (dfd, ".", FALSE, &iter, error))
+    return NULL;
+
+  for (;;)
+    {
+      struct dirent *dent;
+      struct stat stbuf;
+      CachedImage *image;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, NULL,
+                                                       error))
+        return NULL;
+
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type != DT_REG || !g_str_has_suffix (dent->d_name, ENTRY_SUFFIX))
+        continue;
+
+      if (fstatat (dfd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+        continue;
+
+      image = g_slice_new0 (CachedImage);
+      image->name = g_strdup (dent->d_name);
+      image->allocated = (guint64) stbuf.st_blocks * 512;
+      image->mtime = stbuf.st_mtim;
+      g_ptr_array_add (images, image);
+    }
+
+  g_ptr_array_sort (images, cached_image_compare_mtime);
+
+  return g_steal_pointer (&images);
+}
+
+/* Makes room for a new image of @size bytes, deleting old images if allowed.
+ * Must be called with self->mutex held.
+ */
+static gboolean
+gis_image_cache_make_room (GisImageCache *self,
+                           gint           dfd,
+                           guint64        size,
+                           GError       **error)
+{
+  g_autoptr(GPtrArray) images = NULL;
+  guint64 total = 0;
+  guint n_images;
+  guint i;
+
+  if (self->max_size != 0 && size > self->max_size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                   "image is larger than the cache size limit");
+      return FALSE;
+    }
+
+  images = gis_image_cache_list (dfd, error);
+  if (images == NULL)
+    return FALSE;
+
+  for (i = 0; i < images->len; i++)
+    {
+      CachedImage *image = g_ptr_array_index (images, i);
+
+      total += image->allocated;
+    }
+
+  /* Delete images, oldest first, until the new one fits */
+  n_images = images->len;
+  for (i = 0; ; i++)
+    {
+      struct statvfs stvfsbuf;
+      CachedImage *image;
+
+      if (fstatvfs (dfd, &stvfsbuf) < 0)
+        return glnx_throw_errno_prefix (error, "can't get free space");
+
+      if ((self->max_entries == 0 || n_images < self->max_entries) &&
+          (self->max_size == 0 || total + size <= self->max_size) &&
+          (guint64) stvfsbuf.f_bavail * stvfsbuf.f_frsize >= size)
+        return TRUE;
+
+      if (self->eviction == GIS_IMAGE_CACHE_EVICTION_NONE || i >= images->len)
+        break;
+
+      image = g_ptr_array_index (images, i);
+      g_message ("evicting cached image %s", image->name);
+      if (unlinkat (dfd, image->name, 0) < 0)
+        return glnx_throw_errno_prefix (error, "can't delete cached image %s",
+                                        image->name);
+
+      total -= image->allocated;
+      n_images--;
+    }
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+               "not enough room in %s to cache image", self->directory);
+  return FALSE;
+}
+
+/**
+ * gis_image_cache_begin_entry:
+ * @key: a key returned by gis_image_cache_compute_key()
+ * @size: size of the decompressed image
+ *
+ * Makes room in the cache for a new image, deleting old images according to
+ * the cache's eviction policy, and begins writing it. The new image does not
+ * appear in the cache until gis_image_cache_entry_commit() is called, which
+ * should only be done once the image has been verified.
+ *
+ * Returns: (transfer full): the new entry, or %NULL if there is not enough
+ *  room for it or some other error occurs
+ */
+GisImageCacheEntry *
+gis_image_cache_begin_entry (GisImageCache *self,
+                             const gchar   *key,
+                             guint64        size,
+                             GError       **error)
+{
+  g_autoptr(GisImageCacheEntry) entry = NULL;
+  glnx_autofd int dfd = -1;
+  gboolean ret;
+
+  g_return_val_if_fail (GIS_IS_IMAGE_CACHE (self), NULL);
+  g_return_val_if_fail (key != NULL, NULL);
+
+  if (!gis_image_cache_open_directory (self, &dfd, error))
+    return NULL;
+
+  g_mutex_lock (&self->mutex);
+  ret = gis_image_cache_make_room (self, dfd, size, error);
+  g_mutex_unlock (&self->mutex);
+
+  if (!ret)
+    return NULL;
+
+  entry = g_slice_new0 (GisImageCacheEntry);
+  entry->dfd = -1;
+  entry->cache = g_object_ref (self);
+  entry->key = g_strdup (key);
+  entry->size = size;
+  entry->dfd = glnx_steal_fd (&dfd);
+
+  if (!glnx_open_tmpfile_linkable_at (entry->dfd, ".", O_WRONLY | O_CLOEXEC,
+                                      &entry->tmpf, error))
+    return NULL;
+
+  return g_steal_pointer (&entry);
+}
+
+static gboolean
+is_all_zeros (const guint8 *data,
+              gsize         len)
+{
+  return len == 0 || (data[0] == 0 && memcmp (data, data + 1, len - 1) == 0);
+}
+
+/**
+ * gis_image_cache_entry_write:
+ *
+ * Appends @data to @entry. Runs of zeros are skipped rather than written, so
+ * that they take up no space in the cache.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gis_image_cache_entry_write (GisImageCacheEntry *entry,
+                             gconstpointer       data,
+                             gsize               len,
+                             GError            **error)
+{
+  g_return_val_if_fail (entry != NULL, FALSE);
+
+  if (entry->offset + len > entry->size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "image is larger than the expected %" G_GUINT64_FORMAT
+                   " bytes", entry->size);
+      return FALSE;
+    }
+
+  if (is_all_zeros (data, len))
+    {
+      if (lseek (entry->tmpf.fd, len, SEEK_CUR) < 0)
+        return glnx_throw_errno_prefix (error, "can't seek in cached image");
+    }
+  else if (glnx_loop_write (entry->tmpf.fd, data, len) < 0)
+    {
+      return glnx_throw_errno_prefix (error, "can't write cached image");
+    }
+
+  entry->offset += len;
+  return TRUE;
+}
+
+/**
+ * gis_image_cache_entry_commit:
+ *
+ * Adds the fully-written @entry to the cache, replacing any existing image
+ * with the same key. @entry must not be written to again, but must still be
+ * freed with gis_image_cache_entry_free().
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gis_image_cache_entry_commit (GisImageCacheEntry *entry,
+                              GError            **error)
+{
+  g_autofree gchar *name = NULL;
+  gboolean ret;
+
+  g_return_val_if_fail (entry != NULL, FALSE);
+  g_return_val_if_fail (entry->tmpf.initialized, FALSE);
+
+  if (entry->offset != entry->size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "cached %" G_GUINT64_FORMAT " bytes but image is "
+                   "%" G_GUINT64_FORMAT " bytes",
+                   entry->offset, entry->size);
+      return FALSE;
+    }
+
+  /* If the image ends in zeros, they were skipped; extend the file to cover
+   * them. Then make sure the data is on disk before the file appears in the
+   * cache, so a crash cannot leave a truncated image behind.
+   */
+  if (ftruncate (entry->tmpf.fd, entry->size) < 0)
+    return glnx_throw_errno_prefix (error, "can't set size of cached image");
+
+  if (fdatasync (entry->tmpf.fd) < 0)
+    return glnx_throw_errno_prefix (error, "can't sync cached image");
+
+  name = g_strconcat (entry->key, ENTRY_SUFFIX, NULL);
+
+  g_mutex_lock (&entry->cache->mutex);
+  ret = glnx_link_tmpfile_at (&entry->tmpf, GLNX_LINK_TMPFILE_REPLACE,
+                              entry->dfd, name, error);
+  g_mutex_unlock (&entry->cache->mutex);
+
+  return ret;
+}
+
+/**
+ * gis_image_cache_entry_free:
+ *
+ * Frees @entry. If it was not committed, the partially-written image is
+ * discarded.
+ */
+void
+gis_image_cache_entry_free (GisImageCacheEntry *entry)
+{
+  if (entry == NULL)
+    return;
+
+  glnx_tmpfile_clear (&entry->tmpf);
+  if (entry->dfd != -1)
+    close (entry->dfd);
+  g_clear_object (&entry->cache);
+  g_free (entry->key);
+  g_slice_free (GisImageCacheEntry, entry);
+}
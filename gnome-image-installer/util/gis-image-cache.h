@@ -0,0 +1,80 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_IMAGE_CACHE_H
+#define GIS_IMAGE_CACHE_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * GisImageCacheEviction:
+ * @GIS_IMAGE_CACHE_EVICTION_LEAST_RECENTLY_USED: when there is not enough
+ *  room for a new image, delete the images which were least recently used
+ *  until there is
+ * @GIS_IMAGE_CACHE_EVICTION_NONE: never delete cached images; if there is not
+ *  enough room for a new image, it is not cached
+ */
+typedef enum {
+    GIS_IMAGE_CACHE_EVICTION_LEAST_RECENTLY_USED,
+    GIS_IMAGE_CACHE_EVICTION_NONE,
+} GisImageCacheEviction;
+
+#define GIS_TYPE_IMAGE_CACHE (gis_image_cache_get_type ())
+G_DECLARE_FINAL_TYPE (GisImageCache, gis_image_cache, GIS, IMAGE_CACHE, GObject);
+
+typedef struct _GisImageCacheEntry GisImageCacheEntry;
+
+GisImageCache *gis_image_cache_new (const gchar          *directory,
+                                    guint64               max_size,
+                                    guint                 max_entries,
+                                    GisImageCacheEviction eviction);
+
+const gchar *gis_image_cache_get_directory (GisImageCache *self);
+
+gchar *gis_image_cache_compute_key (GFile        *image,
+                                    GFile        *verification,
+                                    GCancellable *cancellable,
+                                    GError      **error);
+
+gint gis_image_cache_open (GisImageCache *self,
+                           const gchar   *key,
+                           guint64        size,
+                           GError       **error);
+
+GisImageCacheEntry *gis_image_cache_begin_entry (GisImageCache *self,
+                                                 const gchar   *key,
+                                                 guint64        size,
+                                                 GError       **error);
+
+gboolean gis_image_cache_entry_write (GisImageCacheEntry *entry,
+                                      gconstpointer       data,
+                                      gsize               len,
+                                      GError            **error);
+
+gboolean gis_image_cache_entry_commit (GisImageCacheEntry *entry,
+                                       GError            **error);
+
+void gis_image_cache_entry_free (GisImageCacheEntry *entry);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisImageCacheEntry, gis_image_cache_entry_free)
+
+G_END_DECLS
+
+#endif /* GIS_IMAGE_CACHE_H */
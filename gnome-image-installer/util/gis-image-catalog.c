@@ -0,0 +1,303 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A list of the images on the partition and what the image builder knew
+ * about them, so that the image page can be populated without opening, let
+ * alone decompressing, each image. It looks like:
+ *
+ *   [Catalog]
+ *   version=1
+ *
+ *   [Image eos-eos3.9-amd64-amd64.200101-000000.base.img.xz]
+ *   size=2684354560
+ *   required-size=15032385536
+ *
+ * with optional signature and checksum keys giving the basenames of the
+ * image's signature and checksum, if they are not named after the image.
+ * Other keys are ignored, so builders may record more about each image. The
+ * catalog is only trusted if eos-images.catalog.asc is a good signature for
+ * it; and only while every image it lists is present with the size it
+ * gives, so a partition whose contents have changed is scanned as before.
+ */
+#include "config.h"
+#include "gis-image-catalog.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "gis-errors.h"
+
+#define CATALOG_GROUP "Catalog"
+#define VERSION_KEY "version"
+#define CATALOG_VERSION 1
+
+#define IMAGE_GROUP_PREFIX "Image "
+#define SIZE_KEY "size"
+#define REQUIRED_SIZE_KEY "required-size"
+#define SIGNATURE_KEY "signature"
+#define CHECKSUM_KEY "checksum"
+
+void
+gis_image_catalog_entry_free (GisImageCatalogEntry *entry)
+{
+  g_free (entry->path);
+  g_free (entry->signature);
+  g_free (entry->checksum);
+  g_free (entry);
+}
+
+/* Only files in the catalog's own directory may be listed. */
+static gboolean
+is_valid_basename (const gchar *basename)
+{
+  return *basename != '\0'
+    && strchr (basename, '/') == NULL
+    && !g_str_equal (basename, ".")
+    && !g_str_equal (basename, "..");
+}
+
+/* Sets *@path_out to the file named by @key in @group, if it is set. */
+static gboolean
+get_optional_path (GKeyFile    *key_file,
+                   const gchar *directory,
+                   const gchar *group,
+                   const gchar *key,
+                   gchar      **path_out,
+                   GError     **error)
+{
+  g_autofree gchar *basename = NULL;
+
+  if (!g_key_file_has_key (key_file, group, key, NULL))
+    return TRUE;
+
+  basename = g_key_file_get_string (key_file, group, key, error);
+  if (basename == NULL)
+    return FALSE;
+
+  if (!is_valid_basename (basename))
+    {
+      g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                   "[%s] %s is not a filename: %s", group, key, basename);
+      return FALSE;
+    }
+
+  *path_out = g_build_filename (directory, basename, NULL);
+  return TRUE;
+}
+
+static GisImageCatalogEntry *
+parse_entry (GKeyFile    *key_file,
+             const gchar *directory,
+             const gchar *group,
+             GError     **error)
+{
+  g_autoptr(GisImageCatalogEntry) entry = g_new0 (GisImageCatalogEntry, 1);
+  const gchar *basename = group + strlen (IMAGE_GROUP_PREFIX);
+  GError *local_error = NULL;
+
+  if (!is_valid_basename (basename))
+    {
+      g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                   "[%s] does not name an image", group);
+      return NULL;
+    }
+
+  entry->path = g_build_filename (directory, basename, NULL);
+
+  entry->size = g_key_file_get_uint64 (key_file, group, SIZE_KEY,
+                                       &local_error);
+  if (local_error == NULL)
+    entry->required_size = g_key_file_get_uint64 (key_file, group,
+                                                  REQUIRED_SIZE_KEY,
+                                                  &local_error);
+  if (local_error != NULL)
+    {
+      g_propagate_prefixed_error (error, local_error, "[%s]: ", group);
+      return NULL;
+    }
+
+  if (entry->required_size == 0)
+    {
+      g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                   "[%s] %s must be positive", group, REQUIRED_SIZE_KEY);
+      return NULL;
+    }
+
+  if (!get_optional_path (key_file, directory, group, SIGNATURE_KEY,
+                          &entry->signature, error) ||
+      !get_optional_path (key_file, directory, group, CHECKSUM_KEY,
+                          &entry->checksum, error))
+    return NULL;
+
+  return g_steal_pointer (&entry);
+}
+
+/**
+ * gis_image_catalog_parse:
+ * @directory: the directory the catalog describes
+ * @data: the contents of the catalog
+ * @length: the length of @data
+ *
+ * Parses a catalog without checking its signature; see
+ * gis_image_catalog_load().
+ *
+ * Returns: (transfer full) (element-type GisImageCatalogEntry): the images
+ *  listed in the catalog, in the order they are listed.
+ */
+GPtrArray *
+gis_image_catalog_parse (const gchar *directory,
+                         const gchar *data,
+                         gsize        length,
+                         GError     **error)
+{
+  g_autoptr(GKeyFile) key_file = g_key_file_new ();
+  g_autoptr(GPtrArray) entries = NULL;
+  g_auto(GStrv) groups = NULL;
+  GError *local_error = NULL;
+  gint version;
+  gsize i;
+
+  g_return_val_if_fail (directory != NULL, NULL);
+  g_return_val_if_fail (data != NULL, NULL);
+
+  if (!g_key_file_load_from_data (key_file, data, length, G_KEY_FILE_NONE,
+                                  error))
+    return NULL;
+
+  version = g_key_file_get_integer (key_file, CATALOG_GROUP, VERSION_KEY,
+                                    &local_error);
+  if (local_error != NULL)
+    {
+      g_propagate_error (error, local_error);
+      return NULL;
+    }
+
+  if (version != CATALOG_VERSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "catalog version %d is not supported", version);
+      return NULL;
+    }
+
+  entries = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) gis_image_catalog_entry_free);
+  groups = g_key_file_get_groups (key_file, NULL);
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      GisImageCatalogEntry *entry;
+
+      if (!g_str_has_prefix (groups[i], IMAGE_GROUP_PREFIX))
+        continue;
+
+      entry = parse_entry (key_file, directory, groups[i], error);
+      if (entry == NULL)
+        return NULL;
+
+      g_ptr_array_add (entries, entry);
+    }
+
+  return g_steal_pointer (&entries);
+}
+
+/**
+ * gis_image_catalog_load:
+ * @directory: the directory holding the images, and perhaps a catalog
+ * @verifier: checks the catalog's signature
+ *
+ * Loads the catalog in @directory, if there is one and it is signed. This
+ * runs GPG, so should be called from a worker thread.
+ *
+ * Returns: (transfer full) (element-type GisImageCatalogEntry): the images
+ *  listed in the catalog, or %NULL with %G_IO_ERROR_NOT_FOUND if there is no
+ *  catalog.
+ */
+GPtrArray *
+gis_image_catalog_load (const gchar      *directory,
+                        GisImageVerifier *verifier,
+                        GCancellable     *cancellable,
+                        GError          **error)
+{
+  g_autofree gchar *path = g_build_filename (directory,
+                                             GIS_IMAGE_CATALOG_BASENAME,
+                                             NULL);
+  g_autofree gchar *signature_path = g_strconcat (path, ".asc", NULL);
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(GFile) signature = g_file_new_for_path (signature_path);
+  g_autofree gchar *data = NULL;
+  gsize length = 0;
+
+  g_return_val_if_fail (GIS_IS_IMAGE_VERIFIER (verifier), NULL);
+
+  if (!g_file_query_exists (file, cancellable))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "%s does not exist", path);
+      return NULL;
+    }
+
+  if (!g_file_query_exists (signature, cancellable))
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   "%s is not signed", path);
+      return NULL;
+    }
+
+  if (!gis_image_verifier_verify_signature (verifier, file, signature,
+                                            cancellable, error) ||
+      !g_file_load_contents (file, cancellable, &data, &length, NULL, error))
+    return NULL;
+
+  return gis_image_catalog_parse (directory, data, length, error);
+}
+
+/**
+ * gis_image_catalog_entry_check:
+ *
+ * Checks that @entry's image is still present, with the size the catalog
+ * gives, without reading it.
+ *
+ * Returns: %TRUE if @entry can be trusted.
+ */
+gboolean
+gis_image_catalog_entry_check (const GisImageCatalogEntry *entry,
+                               GError                    **error)
+{
+  struct stat buf;
+
+  g_return_val_if_fail (entry != NULL, FALSE);
+
+  if (stat (entry->path, &buf) < 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "can't stat %s: %s", entry->path, g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  if (!S_ISREG (buf.st_mode) || (guint64) buf.st_size != entry->size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is not the %" G_GUINT64_FORMAT "-byte file the catalog "
+                   "lists", entry->path, entry->size);
+      return FALSE;
+    }
+
+  return TRUE;
+}
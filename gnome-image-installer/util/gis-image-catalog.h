@@ -0,0 +1,72 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_IMAGE_CATALOG_H
+#define GIS_IMAGE_CATALOG_H
+
+#include <gio/gio.h>
+
+#include "gis-image-verifier.h"
+
+G_BEGIN_DECLS
+
+/* Written by image builders at the root of the images partition, with a
+ * detached GPG signature alongside it.
+ */
+#define GIS_IMAGE_CATALOG_BASENAME "eos-images.catalog"
+
+/**
+ * GisImageCatalogEntry:
+ * @path: the absolute path of the image
+ * @signature: (nullable): the absolute path of its signature, if it is not
+ *  named after the image
+ * @checksum: (nullable): the absolute path of its checksum, if it is not
+ *  named after the image
+ * @size: the size of the image file
+ * @required_size: the size the image needs on the target disk
+ *
+ * What the image builder knew about one image on the partition.
+ */
+typedef struct {
+  gchar *path;
+  gchar *signature;
+  gchar *checksum;
+  guint64 size;
+  guint64 required_size;
+} GisImageCatalogEntry;
+
+void gis_image_catalog_entry_free (GisImageCatalogEntry *entry);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisImageCatalogEntry, gis_image_catalog_entry_free);
+
+GPtrArray *gis_image_catalog_parse (const gchar *directory,
+                                    const gchar *data,
+                                    gsize        length,
+                                    GError     **error);
+
+GPtrArray *gis_image_catalog_load (const gchar      *directory,
+                                   GisImageVerifier *verifier,
+                                   GCancellable     *cancellable,
+                                   GError          **error);
+
+gboolean gis_image_catalog_entry_check (const GisImageCatalogEntry *entry,
+                                        GError                    **error);
+
+G_END_DECLS
+
+#endif /* GIS_IMAGE_CATALOG_H */
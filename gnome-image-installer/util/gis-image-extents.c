@@ -0,0 +1,616 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Finds where an image file's data is stored on the block device holding its
+ * filesystem, so that it can be read straight from the device rather than
+ * through the filesystem. This is worthwhile when the filesystem is slow to
+ * read through, as FUSE-backed exFAT and NTFS are, or when it is on an ISO.
+ *
+ * The kernel is asked with FIEMAP where it can tell us. It can't for
+ * iso9660, but there every file is stored in one or more contiguous extents
+ * listed in its directory entry, so we read the directory ourselves.
+ */
+#include "config.h"
+#include "gis-image-extents.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "glnx-errors.h"
+#include "glnx-local-alloc.h"
+
+/* Number of extents to ask FIEMAP for at a time */
+#define FIEMAP_BATCH 64
+
+/* FIEMAP extents with any other flags set can't simply be read from the
+ * device: their location is not yet known, they are compressed or encrypted,
+ * they share a block with other data, or they have not been written yet (and
+ * so should read as zeros).
+ */
+#define FIEMAP_EXTENT_READABLE_FLAGS \
+  (FIEMAP_EXTENT_LAST | FIEMAP_EXTENT_MERGED | FIEMAP_EXTENT_SHARED)
+
+#define ISO9660_SECTOR_SIZE 2048
+#define ISO9660_FIRST_DESCRIPTOR_SECTOR 16
+#define ISO9660_DESCRIPTOR_PRIMARY 1
+#define ISO9660_DESCRIPTOR_TERMINATOR 255
+#define ISO9660_RECORD_MIN_LENGTH 33
+#define ISO9660_FLAG_DIRECTORY 0x02
+#define ISO9660_FLAG_MULTI_EXTENT 0x80
+/* Directories larger than this are assumed to be corrupt. */
+#define ISO9660_MAX_DIRECTORY_SIZE (16 * 1024 * 1024)
+
+static guint16
+read_le16 (const guint8 *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static guint32
+read_le32 (const guint8 *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+static gboolean
+pread_all (gint      fd,
+           gpointer  buf,
+           gsize     len,
+           guint64   offset,
+           GError  **error)
+{
+  gsize done = 0;
+
+  while (done < len)
+    {
+      gssize r = pread (fd, (guint8 *) buf + done, len - done, offset + done);
+
+      if (r < 0 && errno == EINTR)
+        continue;
+
+      if (r < 0)
+        return glnx_throw_errno_prefix (error, "can't read device at %" G_GUINT64_FORMAT,
+                                        offset + done);
+
+      if (r == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "unexpected end of device at %" G_GUINT64_FORMAT,
+                       offset + done);
+          return FALSE;
+        }
+
+      done += r;
+    }
+
+  return TRUE;
+}
+
+static GArray *
+extents_new (void)
+{
+  return g_array_new (FALSE, FALSE, sizeof (GisImageExtent));
+}
+
+static void
+extents_append (GArray  *extents,
+                guint64  physical,
+                guint64  length)
+{
+  GisImageExtent extent = { 0, physical, length };
+
+  if (extents->len > 0)
+    {
+      const GisImageExtent *last =
+        &g_array_index (extents, GisImageExtent, extents->len - 1);
+
+      extent.logical = last->logical + last->length;
+    }
+
+  g_array_append_val (extents, extent);
+}
+
+static guint64
+extents_get_size (GArray *extents)
+{
+  const GisImageExtent *last;
+
+  if (extents->len == 0)
+    return 0;
+
+  last = &g_array_index (extents, GisImageExtent, extents->len - 1);
+  return last->logical + last->length;
+}
+
+static GArray *
+query_fiemap (gint      fd,
+              guint64   size,
+              GError  **error)
+{
+  g_autoptr(GArray) extents = extents_new ();
+  g_autofree struct fiemap *fm =
+    g_malloc0 (sizeof *fm + FIEMAP_BATCH * sizeof (struct fiemap_extent));
+  guint64 next = 0;
+  gboolean last = FALSE;
+  guint i;
+
+  while (!last && next < size)
+    {
+      fm->fm_start = next;
+      fm->fm_length = FIEMAP_MAX_OFFSET - next;
+      fm->fm_flags = FIEMAP_FLAG_SYNC;
+      fm->fm_extent_count = FIEMAP_BATCH;
+
+      if (ioctl (fd, FS_IOC_FIEMAP, fm) < 0)
+        {
+          if (errno == EOPNOTSUPP || errno == ENOTTY)
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                                 "filesystem does not support FIEMAP");
+          else
+            glnx_throw_errno_prefix (error, "FIEMAP failed");
+          return NULL;
+        }
+
+      if (fm->fm_mapped_extents == 0)
+        break;
+
+      for (i = 0; i < fm->fm_mapped_extents; i++)
+        {
+          const struct fiemap_extent *fe = &fm->fm_extents[i];
+
+          if ((fe->fe_flags & ~FIEMAP_EXTENT_READABLE_FLAGS) != 0)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "extent at %" G_GUINT64_FORMAT " has flags 0x%x",
+                           (guint64) fe->fe_logical, fe->fe_flags);
+              return NULL;
+            }
+
+          if (fe->fe_logical != next)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "file has a hole at %" G_GUINT64_FORMAT, next);
+              return NULL;
+            }
+
+          extents_append (extents, fe->fe_physical, fe->fe_length);
+          next = fe->fe_logical + fe->fe_length;
+          last = (fe->fe_flags & FIEMAP_EXTENT_LAST) != 0;
+        }
+    }
+
+  if (next < size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "only %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+                   " bytes are mapped", next, size);
+      return NULL;
+    }
+
+  /* The last extent is rounded up to a whole block. */
+  if (next > size)
+    g_array_index (extents, GisImageExtent, extents->len - 1).length -= next - size;
+
+  return g_steal_pointer (&extents);
+}
+
+/* Returns the path of @path relative to the root of the filesystem holding
+ * it, which is on device @dev.
+ */
+static gchar *
+get_path_within_filesystem (const gchar *path,
+                            dev_t        dev,
+                            GError     **error)
+{
+  g_autofree gchar *real_path = NULL;
+  g_autofree gchar *root = NULL;
+  gchar *p;
+
+  p = realpath (path, NULL);
+  if (p == NULL)
+    return glnx_null_throw_errno_prefix (error, "can't resolve %s", path);
+
+  real_path = g_strdup (p);
+  free (p);
+
+  /* Walk up until the parent is on a different filesystem. */
+  root = g_path_get_dirname (real_path);
+  for (;;)
+    {
+      g_autofree gchar *parent = g_path_get_dirname (root);
+      struct stat stbuf;
+
+      if (g_str_equal (parent, root))
+        break;
+
+      if (stat (parent, &stbuf) < 0)
+        return glnx_null_throw_errno_prefix (error, "can't stat %s", parent);
+
+      if (stbuf.st_dev != dev)
+        break;
+
+      g_free (root);
+      root = g_steal_pointer (&parent);
+    }
+
+  return g_strdup (real_path + strlen (root));
+}
+
+/* Sets @name to the Rock Ridge name in the system use area of @record, if
+ * it has one.
+ */
+static void
+iso9660_get_rock_ridge_name (const guint8 *record,
+                             gsize         record_len,
+                             GString      *name)
+{
+  guint8 name_len = record[32];
+  /* The file identifier is padded to an even length. */
+  gsize pos = ISO9660_RECORD_MIN_LENGTH + name_len + (name_len % 2 == 0 ? 1 : 0);
+
+  g_string_truncate (name, 0);
+
+  while (pos + 4 <= record_len)
+    {
+      const guint8 *entry = record + pos;
+      guint8 entry_len = entry[2];
+
+      if (entry_len < 4 || pos + entry_len > record_len)
+        break;
+
+      /* "NM" entries hold (pieces of) the name, after a flags byte */
+      if (entry[0] == 'N' && entry[1] == 'M' && entry_len > 5)
+        g_string_append_len (name, (const gchar *) entry + 5, entry_len - 5);
+      else if (entry[0] == 'S' && entry[1] == 'T')
+        break;
+
+      pos += entry_len;
+    }
+}
+
+/* Returns TRUE if @record is named @component. Rock Ridge names are matched
+ * exactly; plain ISO 9660 names, which are upper-case and have a ";1" version
+ * suffix, are matched case-insensitively without the suffix. Joliet names are
+ * not supported.
+ */
+static gboolean
+iso9660_record_matches (const guint8 *record,
+                        gsize         record_len,
+                        const gchar  *component,
+                        GString      *scratch)
+{
+  guint8 name_len = record[32];
+  gchar *semicolon;
+
+  iso9660_get_rock_ridge_name (record, record_len, scratch);
+  if (scratch->len > 0)
+    return g_str_equal (scratch->str, component);
+
+  g_string_truncate (scratch, 0);
+  g_string_append_len (scratch, (const gchar *) record + 33, name_len);
+
+  semicolon = strchr (scratch->str, ';');
+  if (semicolon != NULL)
+    g_string_truncate (scratch, semicolon - scratch->str);
+
+  /* Files without an extension have a trailing '.' */
+  if (scratch->len > 0 && scratch->str[scratch->len - 1] == '.')
+    g_string_truncate (scratch, scratch->len - 1);
+
+  return g_ascii_strcasecmp (scratch->str, component) == 0;
+}
+
+/* Looks @component up in the directory whose contents are @dir. If it is
+ * found and is a directory iff @want_directory, appends its extents to
+ * @extents.
+ */
+static gboolean
+iso9660_lookup (const guint8  *dir,
+                gsize          dir_len,
+                guint16        block_size,
+                const gchar   *component,
+                gboolean       want_directory,
+                GArray        *extents,
+                GError       **error)
+{
+  g_autoptr(GString) scratch = g_string_new ("");
+  gboolean found = FALSE;
+  gsize pos = 0;
+
+  while (pos < dir_len)
+    {
+      const guint8 *record = dir + pos;
+      guint8 record_len = record[0];
+      guint8 flags;
+
+      /* Records do not cross block boundaries; the rest of the block is
+       * padded with zeros.
+       */
+      if (record_len == 0)
+        {
+          pos = (pos / block_size + 1) * block_size;
+          continue;
+        }
+
+      if (record_len < ISO9660_RECORD_MIN_LENGTH ||
+          pos + record_len > dir_len ||
+          ISO9660_RECORD_MIN_LENGTH + record[32] > record_len)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "invalid iso9660 directory record at %" G_GSIZE_FORMAT,
+                       pos);
+          return FALSE;
+        }
+
+      flags = record[25];
+
+      /* Each extent of a file which has several has its own record, all
+       * with the same name, in order.
+       */
+      if (found || iso9660_record_matches (record, record_len, component,
+                                           scratch))
+        {
+          guint64 lba = read_le32 (record + 2) + record[1];
+
+          if (((flags & ISO9660_FLAG_DIRECTORY) != 0) != want_directory)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                           want_directory ? "‘%s’ is not a directory"
+                                          : "‘%s’ is a directory",
+                           component);
+              return FALSE;
+            }
+
+          extents_append (extents, lba * block_size, read_le32 (record + 10));
+          found = TRUE;
+
+          if ((flags & ISO9660_FLAG_MULTI_EXTENT) == 0)
+            return TRUE;
+        }
+
+      pos += record_len;
+    }
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+               found ? "last extent of ‘%s’ is missing" : "‘%s’ not found",
+               component);
+  return FALSE;
+}
+
+/**
+ * gis_image_extents_query_iso9660:
+ * @device_fd: readable file descriptor for a device holding an iso9660
+ *  filesystem
+ * @path: path to a file within the filesystem
+ *
+ * Reads the iso9660 filesystem on @device_fd to find the extents of @path.
+ *
+ * Returns: (transfer full) (element-type GisImageExtent): the extents of
+ *  @path, in order, or %NULL on error.
+ */
+GArray *
+gis_image_extents_query_iso9660 (gint          device_fd,
+                                 const gchar  *path,
+                                 GError      **error)
+{
+  guint8 descriptor[ISO9660_SECTOR_SIZE];
+  g_autoptr(GArray) extents = extents_new ();
+  g_auto(GStrv) components = g_strsplit (path, "/", -1);
+  const guint8 *root;
+  guint16 block_size;
+  guint64 dir_offset;
+  guint64 dir_len;
+  guint sector;
+  guint i;
+
+  /* Find the primary volume descriptor */
+  for (sector = ISO9660_FIRST_DESCRIPTOR_SECTOR; ; sector++)
+    {
+      if (!pread_all (device_fd, descriptor, sizeof descriptor,
+                      (guint64) sector * ISO9660_SECTOR_SIZE, error))
+        return NULL;
+
+      if (memcmp (descriptor + 1, "CD001", 5) != 0 ||
+          descriptor[0] == ISO9660_DESCRIPTOR_TERMINATOR)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                               "no iso9660 primary volume descriptor found");
+          return NULL;
+        }
+
+      if (descriptor[0] == ISO9660_DESCRIPTOR_PRIMARY)
+        break;
+    }
+
+  block_size = read_le16 (descriptor + 128);
+  if (block_size == 0 || block_size > ISO9660_SECTOR_SIZE)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "invalid iso9660 block size %u", block_size);
+      return NULL;
+    }
+
+  root = descriptor + 156;
+  dir_offset = (guint64) (read_le32 (root + 2) + root[1]) * block_size;
+  dir_len = read_le32 (root + 10);
+
+  for (i = 0; components[i] != NULL; i++)
+    {
+      g_autofree guint8 *dir = NULL;
+      gboolean is_last = TRUE;
+      guint j;
+
+      if (*components[i] == '\0')
+        continue;
+
+      for (j = i + 1; components[j] != NULL; j++)
+        if (*components[j] != '\0')
+          is_last = FALSE;
+
+      if (dir_len > ISO9660_MAX_DIRECTORY_SIZE)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "iso9660 directory is %" G_GUINT64_FORMAT " bytes",
+                       dir_len);
+          return NULL;
+        }
+
+      dir = g_malloc (dir_len);
+      if (!pread_all (device_fd, dir, dir_len, dir_offset, error))
+        return NULL;
+
+      if (is_last)
+        {
+          if (!iso9660_lookup (dir, dir_len, block_size, components[i], FALSE,
+                               extents, error))
+            return NULL;
+
+          return g_steal_pointer (&extents);
+        }
+      else
+        {
+          g_autoptr(GArray) dir_extents = extents_new ();
+          const GisImageExtent *dir_extent;
+
+          if (!iso9660_lookup (dir, dir_len, block_size, components[i], TRUE,
+                               dir_extents, error))
+            return NULL;
+
+          dir_extent = &g_array_index (dir_extents, GisImageExtent, 0);
+          dir_offset = dir_extent->physical;
+          dir_len = dir_extent->length;
+        }
+    }
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+               "‘%s’ is not a file", path);
+  return NULL;
+}
+
+/**
+ * gis_image_extents_query:
+ * @image: an image file
+ * @device_fd: readable file descriptor for the block device holding the
+ *  filesystem which @image is on
+ *
+ * Finds where @image's data is stored on @device_fd. Fails with
+ * %G_IO_ERROR_NOT_SUPPORTED if @image's data cannot simply be read from
+ * @device_fd: for example, if @image is not on @device_fd, its filesystem
+ * does not support FIEMAP, or it is sparse or compressed.
+ *
+ * Returns: (transfer full) (element-type GisImageExtent): the extents of
+ *  @image, in order, covering the whole file; or %NULL on error.
+ */
+GArray *
+gis_image_extents_query (GFile   *image,
+                         gint     device_fd,
+                         GError **error)
+{
+  g_autofree gchar *path = g_file_get_path (image);
+  glnx_autofd gint fd = -1;
+  struct stat image_stbuf;
+  struct stat device_stbuf;
+  struct statfs fs_stbuf;
+  g_autoptr(GArray) extents = NULL;
+
+  if (path == NULL)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "image is not a local file");
+      return NULL;
+    }
+
+  fd = open (path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd < 0)
+    return glnx_null_throw_errno_prefix (error, "can't open %s", path);
+
+  if (fstat (fd, &image_stbuf) < 0 ||
+      fstat (device_fd, &device_stbuf) < 0 ||
+      fstatfs (fd, &fs_stbuf) < 0)
+    return glnx_null_throw_errno_prefix (error, "can't stat %s", path);
+
+  if (!S_ISREG (image_stbuf.st_mode))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "%s is not a regular file", path);
+      return NULL;
+    }
+
+  /* If we were to get this wrong, we would read some arbitrary part of some
+   * other device; so insist that the kernel agrees that the file is on this
+   * device. This rules out FUSE-backed filesystems, whose files are on an
+   * anonymous device.
+   */
+  if (!S_ISBLK (device_stbuf.st_mode) ||
+      device_stbuf.st_rdev != image_stbuf.st_dev)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "%s is not on the given device", path);
+      return NULL;
+    }
+
+  switch (fs_stbuf.f_type)
+    {
+    case ISOFS_SUPER_MAGIC:
+      {
+        g_autofree gchar *fs_path =
+          get_path_within_filesystem (path, image_stbuf.st_dev, error);
+
+        if (fs_path == NULL)
+          return NULL;
+
+        extents = gis_image_extents_query_iso9660 (device_fd, fs_path, error);
+      }
+      break;
+
+    case BTRFS_SUPER_MAGIC:
+      /* FIEMAP's "physical" offsets are within btrfs's own address space,
+       * which may span several devices.
+       */
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "btrfs extents cannot be read directly");
+      return NULL;
+
+    default:
+      extents = query_fiemap (fd, image_stbuf.st_size, error);
+      break;
+    }
+
+  if (extents == NULL)
+    return NULL;
+
+  if (extents_get_size (extents) != (guint64) image_stbuf.st_size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "extents of %s cover %" G_GUINT64_FORMAT " bytes, "
+                   "not %" G_GUINT64_FORMAT, path,
+                   extents_get_size (extents), (guint64) image_stbuf.st_size);
+      return NULL;
+    }
+
+  return g_steal_pointer (&extents);
+}
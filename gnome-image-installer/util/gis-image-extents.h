@@ -0,0 +1,45 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_IMAGE_EXTENTS_H
+#define GIS_IMAGE_EXTENTS_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* @length bytes of a file, starting at offset @logical within the file, are
+ * stored at offset @physical on the block device holding the filesystem.
+ */
+typedef struct {
+  guint64 logical;
+  guint64 physical;
+  guint64 length;
+} GisImageExtent;
+
+GArray *gis_image_extents_query (GFile   *image,
+                                 gint     device_fd,
+                                 GError **error);
+
+GArray *gis_image_extents_query_iso9660 (gint          device_fd,
+                                         const gchar  *path,
+                                         GError      **error);
+
+G_END_DECLS
+
+#endif /* GIS_IMAGE_EXTENTS_H */
@@ -0,0 +1,448 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A file next to the images which records what was learned about each of
+ * them the last time they were probed — whether it has a valid GPT, the size
+ * it needs on the target disk, and so on — so that the next launch need not
+ * decompress the start of every image on a slow USB stick to find out again.
+ *
+ * Each image's entry is keyed by its basename, size, modification time and
+ * inode, so an image which has been replaced or modified is probed again
+ * and its entry refreshed. If the image partition is read-only, as an ISO
+ * is, the cache is written to a fallback directory (typically on a tmpfs)
+ * instead, which at least helps if the app is launched again in the same
+ * session.
+ */
+#include "config.h"
+#include "gis-image-metadata-cache.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib/gstdio.h>
+
+#define CACHE_BASENAME ".eos-installer-metadata.ini"
+
+static const gchar * const format_names[] = {
+  [GIS_IMAGE_FORMAT_UNKNOWN] = "unknown",
+  [GIS_IMAGE_FORMAT_RAW] = "raw",
+  [GIS_IMAGE_FORMAT_GZIP] = "gzip",
+  [GIS_IMAGE_FORMAT_XZ] = "xz",
+  [GIS_IMAGE_FORMAT_SQUASHFS] = "squashfs",
+};
+
+static const gchar * const verification_names[] = {
+  [GIS_IMAGE_VERIFICATION_UNKNOWN] = "unknown",
+  [GIS_IMAGE_VERIFICATION_VERIFIED] = "verified",
+  [GIS_IMAGE_VERIFICATION_FAILED] = "failed",
+};
+
+struct _GisImageMetadataCache {
+  GObject parent;
+
+  /* Next to the images */
+  gchar *path;
+  /* Used if @path can't be written */
+  gchar *fallback_path;
+
+  /* Guards everything below: images are probed on several threads at once */
+  GMutex mutex;
+  GKeyFile *key_file;
+  gboolean dirty;
+};
+
+G_DEFINE_TYPE (GisImageMetadataCache, gis_image_metadata_cache, G_TYPE_OBJECT)
+
+static void
+gis_image_metadata_cache_finalize (GObject *object)
+{
+  GisImageMetadataCache *self = GIS_IMAGE_METADATA_CACHE (object);
+
+  g_clear_pointer (&self->key_file, g_key_file_unref);
+  g_mutex_clear (&self->mutex);
+  g_free (self->path);
+  g_free (self->fallback_path);
+
+  G_OBJECT_CLASS (gis_image_metadata_cache_parent_class)->finalize (object);
+}
+
+static void
+gis_image_metadata_cache_class_init (GisImageMetadataCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = gis_image_metadata_cache_finalize;
+}
+
+static void
+gis_image_metadata_cache_init (GisImageMetadataCache *self)
+{
+  g_mutex_init (&self->mutex);
+  self->key_file = g_key_file_new ();
+}
+
+static gboolean
+load (GisImageMetadataCache *self,
+      const gchar           *path)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (g_key_file_load_from_file (self->key_file, path, G_KEY_FILE_NONE,
+                                 &error))
+    return TRUE;
+
+  if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+    g_message ("ignoring image metadata cache %s: %s", path, error->message);
+
+  return FALSE;
+}
+
+/**
+ * gis_image_metadata_cache_new:
+ * @directory: the directory holding the images
+ * @fallback_directory: (nullable): where to keep the cache if @directory is
+ *  read-only, or %NULL to not keep it at all in that case
+ *
+ * Returns: (transfer full): the cache for the images in @directory, loaded
+ *  from the fallback directory if it has been saved there before, or from
+ *  @directory otherwise.
+ */
+GisImageMetadataCache *
+gis_image_metadata_cache_new (const gchar *directory,
+                              const gchar *fallback_directory)
+{
+  GisImageMetadataCache *self;
+
+  g_return_val_if_fail (directory != NULL, NULL);
+
+  self = g_object_new (GIS_TYPE_IMAGE_METADATA_CACHE, NULL);
+  self->path = g_build_filename (directory, CACHE_BASENAME, NULL);
+
+  if (fallback_directory != NULL)
+    {
+      /* The same fallback directory may be used for several image
+       * directories.
+       */
+      g_autofree gchar *hash =
+        g_compute_checksum_for_string (G_CHECKSUM_SHA256, directory, -1);
+      g_autofree gchar *basename =
+        g_strdup_printf ("image-metadata-%.16s.ini", hash);
+
+      self->fallback_path = g_build_filename (fallback_directory, basename,
+                                              NULL);
+    }
+
+  if (self->fallback_path == NULL || !load (self, self->fallback_path))
+    load (self, self->path);
+
+  return self;
+}
+
+/* Images are rarely named with these, so don't bother escaping them. */
+static gboolean
+is_valid_group_name (const gchar *basename)
+{
+  return strpbrk (basename, "[]\n\r") == NULL;
+}
+
+static gboolean
+stat_image (const gchar  *path,
+            struct stat  *buf,
+            gchar       **group)
+{
+  g_autofree gchar *basename = g_path_get_basename (path);
+
+  if (!is_valid_group_name (basename) || stat (path, buf) < 0)
+    return FALSE;
+
+  *group = g_steal_pointer (&basename);
+  return TRUE;
+}
+
+static guint64
+get_mtime_usec (const struct stat *buf)
+{
+  return (guint64) buf->st_mtim.tv_sec * G_USEC_PER_SEC +
+         buf->st_mtim.tv_nsec / 1000;
+}
+
+/* Called with the mutex held. */
+static gboolean
+entry_matches (GisImageMetadataCache *self,
+               const gchar           *group,
+               const struct stat     *buf)
+{
+  g_autoptr(GError) error = NULL;
+  guint64 size, mtime, inode;
+
+  if (!g_key_file_has_group (self->key_file, group))
+    return FALSE;
+
+  size = g_key_file_get_uint64 (self->key_file, group, "size", &error);
+  if (error == NULL)
+    mtime = g_key_file_get_uint64 (self->key_file, group, "mtime", &error);
+  if (error == NULL)
+    inode = g_key_file_get_uint64 (self->key_file, group, "inode", &error);
+  if (error != NULL)
+    return FALSE;
+
+  return size == (guint64) buf->st_size &&
+         mtime == get_mtime_usec (buf) &&
+         inode == (guint64) buf->st_ino;
+}
+
+static guint
+lookup_name (const gchar * const *names,
+             gsize                n_names,
+             const gchar         *name)
+{
+  guint i;
+
+  for (i = 0; i < n_names; i++)
+    if (g_strcmp0 (names[i], name) == 0)
+      return i;
+
+  return 0;
+}
+
+/* Called with the mutex held. */
+static gboolean
+lookup_entry (GisImageMetadataCache *self,
+              const gchar           *group,
+              const struct stat     *buf,
+              GisImageMetadata      *metadata)
+{
+  g_autofree gchar *format = NULL;
+  g_autofree gchar *verification = NULL;
+  g_autoptr(GError) error = NULL;
+  GisImageMetadata m = { 0 };
+
+  if (!entry_matches (self, group, buf))
+    return FALSE;
+
+  m.valid = g_key_file_get_boolean (self->key_file, group, "valid", &error);
+  if (error == NULL)
+    m.required_size = g_key_file_get_uint64 (self->key_file, group,
+                                             "required-size", &error);
+  if (error == NULL)
+    m.uncompressed_size = g_key_file_get_uint64 (self->key_file, group,
+                                                 "uncompressed-size", &error);
+  if (error != NULL)
+    return FALSE;
+
+  format = g_key_file_get_string (self->key_file, group, "format", NULL);
+  m.format = lookup_name (format_names, G_N_ELEMENTS (format_names), format);
+  verification = g_key_file_get_string (self->key_file, group,
+                                        "verification", NULL);
+  m.verification = lookup_name (verification_names,
+                                G_N_ELEMENTS (verification_names),
+                                verification);
+
+  *metadata = m;
+  return TRUE;
+}
+
+/**
+ * gis_image_metadata_cache_lookup:
+ * @path: an image in the cache's directory
+ * @metadata: (out caller-allocates): where to store the cached metadata
+ *
+ * Looks up the metadata for @path, if it was stored when @path had the
+ * same size, modification time and inode as it does now.
+ *
+ * Returns: %TRUE if @metadata was filled in; %FALSE if @path must be probed
+ *  again.
+ */
+gboolean
+gis_image_metadata_cache_lookup (GisImageMetadataCache *self,
+                                 const gchar           *path,
+                                 GisImageMetadata      *metadata)
+{
+  g_autofree gchar *group = NULL;
+  struct stat buf;
+  gboolean ret;
+
+  g_return_val_if_fail (GIS_IS_IMAGE_METADATA_CACHE (self), FALSE);
+  g_return_val_if_fail (path != NULL, FALSE);
+  g_return_val_if_fail (metadata != NULL, FALSE);
+
+  if (!stat_image (path, &buf, &group))
+    return FALSE;
+
+  g_mutex_lock (&self->mutex);
+  ret = lookup_entry (self, group, &buf, metadata);
+  g_mutex_unlock (&self->mutex);
+
+  return ret;
+}
+
+/**
+ * gis_image_metadata_cache_update:
+ * @path: an image in the cache's directory
+ * @metadata: what was found out about @path
+ *
+ * Replaces the entry for @path. The cache is only written out by
+ * gis_image_metadata_cache_save().
+ */
+void
+gis_image_metadata_cache_update (GisImageMetadataCache  *self,
+                                 const gchar            *path,
+                                 const GisImageMetadata *metadata)
+{
+  g_autofree gchar *group = NULL;
+  struct stat buf;
+
+  g_return_if_fail (GIS_IS_IMAGE_METADATA_CACHE (self));
+  g_return_if_fail (path != NULL);
+  g_return_if_fail (metadata != NULL);
+  g_return_if_fail (metadata->format < G_N_ELEMENTS (format_names));
+  g_return_if_fail (metadata->verification < G_N_ELEMENTS (verification_names));
+
+  if (!stat_image (path, &buf, &group))
+    return;
+
+  g_mutex_lock (&self->mutex);
+
+  g_key_file_remove_group (self->key_file, group, NULL);
+  g_key_file_set_uint64 (self->key_file, group, "size", buf.st_size);
+  g_key_file_set_uint64 (self->key_file, group, "mtime",
+                         get_mtime_usec (&buf));
+  g_key_file_set_uint64 (self->key_file, group, "inode", buf.st_ino);
+  g_key_file_set_boolean (self->key_file, group, "valid", metadata->valid);
+  g_key_file_set_uint64 (self->key_file, group, "required-size",
+                         metadata->required_size);
+  g_key_file_set_string (self->key_file, group, "format",
+                         format_names[metadata->format]);
+  g_key_file_set_uint64 (self->key_file, group, "uncompressed-size",
+                         metadata->uncompressed_size);
+  g_key_file_set_string (self->key_file, group, "verification",
+                         verification_names[metadata->verification]);
+  self->dirty = TRUE;
+
+  g_mutex_unlock (&self->mutex);
+}
+
+/**
+ * gis_image_metadata_cache_set_verification:
+ * @path: an image in the cache's directory
+ * @verification: the outcome of verifying @path
+ *
+ * Records the outcome of verifying @path, if it has an up-to-date entry.
+ */
+void
+gis_image_metadata_cache_set_verification (GisImageMetadataCache *self,
+                                           const gchar           *path,
+                                           GisImageVerification   verification)
+{
+  g_autofree gchar *group = NULL;
+  struct stat buf;
+
+  g_return_if_fail (GIS_IS_IMAGE_METADATA_CACHE (self));
+  g_return_if_fail (path != NULL);
+  g_return_if_fail (verification < G_N_ELEMENTS (verification_names));
+
+  if (!stat_image (path, &buf, &group))
+    return;
+
+  g_mutex_lock (&self->mutex);
+
+  if (entry_matches (self, group, &buf))
+    {
+      g_key_file_set_string (self->key_file, group, "verification",
+                             verification_names[verification]);
+      self->dirty = TRUE;
+    }
+
+  g_mutex_unlock (&self->mutex);
+}
+
+/* Called with the mutex held. */
+static gboolean
+save_locked (GisImageMetadataCache *self,
+             GError               **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_autofree gchar *data = NULL;
+  g_autofree gchar *fallback_dir = NULL;
+  gsize len;
+
+  data = g_key_file_to_data (self->key_file, &len, NULL);
+
+  if (g_file_set_contents (self->path, data, len, &local_error))
+    {
+      /* Don't let a stale copy in the fallback directory shadow it */
+      if (self->fallback_path != NULL)
+        g_unlink (self->fallback_path);
+
+      return TRUE;
+    }
+
+  if (self->fallback_path == NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_ROFS))
+    g_message ("can't save image metadata cache %s: %s; using %s",
+               self->path, local_error->message, self->fallback_path);
+
+  fallback_dir = g_path_get_dirname (self->fallback_path);
+  if (g_mkdir_with_parents (fallback_dir, 0700) < 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "can't create %s: %s", fallback_dir,
+                   g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  return g_file_set_contents (self->fallback_path, data, len, error);
+}
+
+/**
+ * gis_image_metadata_cache_save:
+ *
+ * Writes the cache out next to the images if it has changed, or to the
+ * fallback directory if that fails.
+ *
+ * Returns: %TRUE if the cache was saved, or did not need to be.
+ */
+gboolean
+gis_image_metadata_cache_save (GisImageMetadataCache *self,
+                               GError               **error)
+{
+  gboolean ret = TRUE;
+
+  g_return_val_if_fail (GIS_IS_IMAGE_METADATA_CACHE (self), FALSE);
+
+  g_mutex_lock (&self->mutex);
+
+  if (self->dirty)
+    {
+      ret = save_locked (self, error);
+      if (ret)
+        self->dirty = FALSE;
+    }
+
+  g_mutex_unlock (&self->mutex);
+
+  return ret;
+}
@@ -0,0 +1,83 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_IMAGE_METADATA_CACHE_H
+#define GIS_IMAGE_METADATA_CACHE_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    GIS_IMAGE_FORMAT_UNKNOWN,
+    GIS_IMAGE_FORMAT_RAW,
+    GIS_IMAGE_FORMAT_GZIP,
+    GIS_IMAGE_FORMAT_XZ,
+    GIS_IMAGE_FORMAT_SQUASHFS,
+} GisImageFormat;
+
+typedef enum {
+    GIS_IMAGE_VERIFICATION_UNKNOWN,
+    GIS_IMAGE_VERIFICATION_VERIFIED,
+    GIS_IMAGE_VERIFICATION_FAILED,
+} GisImageVerification;
+
+/**
+ * GisImageMetadata:
+ * @valid: whether the image has a valid Endless OS GPT
+ * @required_size: the size the image needs on the target disk, from its GPT
+ * @format: how the image is stored
+ * @uncompressed_size: the uncompressed size of the image, or 0 if it is not
+ *  known without decompressing the whole image
+ * @verification: the outcome of the last time the image was verified
+ *  against its signature or checksum
+ *
+ * What is known about an image, which is expensive to find out.
+ */
+typedef struct {
+  gboolean valid;
+  guint64 required_size;
+  GisImageFormat format;
+  guint64 uncompressed_size;
+  GisImageVerification verification;
+} GisImageMetadata;
+
+#define GIS_TYPE_IMAGE_METADATA_CACHE (gis_image_metadata_cache_get_type ())
+G_DECLARE_FINAL_TYPE (GisImageMetadataCache, gis_image_metadata_cache, GIS, IMAGE_METADATA_CACHE, GObject);
+
+GisImageMetadataCache *gis_image_metadata_cache_new (const gchar *directory,
+                                                     const gchar *fallback_directory);
+
+gboolean gis_image_metadata_cache_lookup (GisImageMetadataCache *self,
+                                          const gchar           *path,
+                                          GisImageMetadata      *metadata);
+
+void gis_image_metadata_cache_update (GisImageMetadataCache  *self,
+                                      const gchar            *path,
+                                      const GisImageMetadata *metadata);
+
+void gis_image_metadata_cache_set_verification (GisImageMetadataCache *self,
+                                                const gchar           *path,
+                                                GisImageVerification   verification);
+
+gboolean gis_image_metadata_cache_save (GisImageMetadataCache *self,
+                                        GError               **error);
+
+G_END_DECLS
+
+#endif /* GIS_IMAGE_METADATA_CACHE_H */
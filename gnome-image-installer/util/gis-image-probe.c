@@ -0,0 +1,259 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks that a disk image begins with a GPT of the kind that Endless OS
+ * images have, and finds how much space it needs on disk, without reading
+ * (or decompressing) the whole image. These are shared by the disk image page,
+ * which probes every image it finds, and by eos-installer-cli.
+ */
+
+#include "config.h"
+#include "gis-image-probe.h"
+
+#include "gduxzdecompressor.h"
+#include "gis-seekable-image.h"
+#include "gis-split-image.h"
+#include "gis-squashfs-reader.h"
+#include "gpt.h"
+#include "gpt_gz.h"
+#include "gpt_lzma.h"
+
+/* Like get_is_valid_eos_gpt(), but for the image within a squashfs. Sets
+ * @image_size to the size of that image.
+ */
+static gboolean
+get_squashfs_is_valid_eos_gpt (const gchar *squashfs_path,
+                               guint64     *size,
+                               guint64     *image_size)
+{
+  g_autoptr(GFile) squashfs = g_file_new_for_path (squashfs_path);
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GError) error = NULL;
+  struct ptable pt;
+  gsize bytes_read = 0;
+
+  input = gis_squashfs_reader_open (squashfs, GIS_SQUASHFS_LIVE_IMAGE_PATH,
+                                    NULL, &error);
+  if (input == NULL ||
+      !g_input_stream_read_all (input, &pt, sizeof pt, &bytes_read, NULL,
+                                &error))
+    {
+      g_warning ("can't read image within %s: %s", squashfs_path,
+                 error->message);
+      return FALSE;
+    }
+
+  *image_size = gis_squashfs_reader_get_size (GIS_SQUASHFS_READER (input));
+  return bytes_read == sizeof pt && is_eos_gpt_valid (&pt, size);
+}
+
+/* Like get_is_valid_eos_gpt(), but for the first part of a split image, which
+ * is compressed on its own. Sets @image_size to the total size of the parts.
+ */
+static gboolean
+get_split_is_valid_eos_gpt (const gchar *first_part_path,
+                            guint64     *size,
+                            guint64     *image_size)
+{
+  g_autoptr(GFile) first_part = g_file_new_for_path (first_part_path);
+  g_autoptr(GPtrArray) parts = NULL;
+  g_autoptr(GError) error = NULL;
+  guint i;
+
+  parts = gis_split_image_list_parts (first_part, NULL, &error);
+  if (parts == NULL)
+    {
+      g_warning ("can't list parts of %s: %s", first_part_path,
+                 error->message);
+      return FALSE;
+    }
+
+  *image_size = 0;
+  for (i = 0; i < parts->len; i++)
+    {
+      g_autoptr(GFileInfo) info =
+        g_file_query_info (g_ptr_array_index (parts, i),
+                           G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                           G_FILE_QUERY_INFO_NONE, NULL, &error);
+
+      if (info == NULL)
+        {
+          g_warning ("Could not get file info: %s", error->message);
+          return FALSE;
+        }
+
+      *image_size += g_file_info_get_size (info);
+    }
+
+  if (g_str_has_suffix (first_part_path, ".img.gz.000"))
+    return get_gzip_is_valid_eos_gpt (first_part_path, size);
+  else if (g_str_has_suffix (first_part_path, ".img.xz.000"))
+    return get_xz_is_valid_eos_gpt (first_part_path, size);
+  else
+    return get_is_valid_eos_gpt (first_part_path, size);
+}
+
+/* Like get_is_valid_eos_gpt() or get_xz_is_valid_eos_gpt(), but also checks
+ * the whole partition table and the backup GPT at the end of the image, if
+ * that can be done without decompressing the whole image. Sets @image_size
+ * to the uncompressed size of the image if that is known, or 0 otherwise.
+ */
+static gboolean
+get_seekable_is_valid_eos_gpt (const gchar *path,
+                               guint64     *size,
+                               guint64     *image_size)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(GisSeekableImage) seekable = NULL;
+  g_autoptr(GError) error = NULL;
+
+  seekable = gis_seekable_image_open (file, &error);
+  *image_size = seekable != NULL ? gis_seekable_image_get_size (seekable) : 0;
+  if (seekable != NULL && gis_seekable_image_check_gpt (seekable, size, &error))
+    return TRUE;
+
+  if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+    {
+      g_warning ("%s", error->message);
+      return FALSE;
+    }
+
+  g_message ("%s; only checking the primary GPT", error->message);
+  if (g_str_has_suffix (path, ".xz"))
+    return get_xz_is_valid_eos_gpt (path, size);
+
+  return get_is_valid_eos_gpt (path, size);
+}
+
+/**
+ * gis_image_probe_http_head:
+ * @url: the URL of an image
+ * @head: the first few bytes of the image, which may be compressed
+ * @size: (out): location to store the size the image needs on disk
+ *
+ * Like get_is_valid_eos_gpt(), but for an image on an HTTP server.
+ *
+ * Returns: %TRUE if @head begins with a valid Endless OS GPT
+ */
+gboolean
+gis_image_probe_http_head (const gchar *url,
+                           GBytes      *head,
+                           guint64     *size)
+{
+  g_autoptr(GInputStream) input = g_memory_input_stream_new_from_bytes (head);
+  g_autoptr(GConverter) converter = NULL;
+  g_autoptr(GError) error = NULL;
+  struct ptable pt;
+  gsize bytes_read = 0;
+
+  if (g_str_has_suffix (url, ".img.gz"))
+    converter =
+      G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+  else if (g_str_has_suffix (url, ".img.xz"))
+    converter = G_CONVERTER (gdu_xz_decompressor_new ());
+  else if (!g_str_has_suffix (url, ".img"))
+    return FALSE;
+
+  if (converter != NULL)
+    {
+      GInputStream *decompressed =
+        g_converter_input_stream_new (input, converter);
+
+      g_object_unref (input);
+      input = decompressed;
+    }
+
+  if (!g_input_stream_read_all (input, &pt, sizeof pt, &bytes_read, NULL,
+                                &error))
+    {
+      g_warning ("can't read start of %s: %s", url, error->message);
+      return FALSE;
+    }
+
+  return bytes_read == sizeof pt && is_eos_gpt_valid (&pt, size);
+}
+
+/**
+ * gis_image_probe_file:
+ * @image: path to a local image file, or the first part of a split image
+ * @image_device: (nullable): a device to read the image from instead of
+ *  @image, such as the live image's device-mapper device
+ * @format: (out): location to store the format of @image, or
+ *  %GIS_IMAGE_FORMAT_UNKNOWN for split images and files which are not images
+ * @required_size: (out): location to store the size the image needs on disk
+ * @uncompressed_size: (out): location to store the uncompressed size of the
+ *  image if that can be found cheaply, or 0
+ * @split_size: (out): location to store the total size of the parts of a
+ *  split image, or 0
+ *
+ * Picks how to check @image from its name, and checks it.
+ *
+ * Returns: %TRUE if @image has a valid Endless OS GPT
+ */
+gboolean
+gis_image_probe_file (const gchar    *image,
+                      const gchar    *image_device,
+                      GisImageFormat *format,
+                      guint64        *required_size,
+                      guint64        *uncompressed_size,
+                      guint64        *split_size)
+{
+  g_autoptr(GFile) f = g_file_new_for_commandline_arg (image);
+
+  *format = GIS_IMAGE_FORMAT_UNKNOWN;
+  *required_size = 0;
+  *uncompressed_size = 0;
+  *split_size = 0;
+
+  if (gis_split_image_is_split (f))
+    {
+      return get_split_is_valid_eos_gpt (image, required_size, split_size);
+    }
+  else if (g_str_has_suffix (image, ".img.gz"))
+    {
+      *format = GIS_IMAGE_FORMAT_GZIP;
+      return get_gzip_is_valid_eos_gpt (image, required_size);
+    }
+  else if (g_str_has_suffix (image, ".img.xz"))
+    {
+      *format = GIS_IMAGE_FORMAT_XZ;
+      return get_seekable_is_valid_eos_gpt (image, required_size,
+                                            uncompressed_size);
+    }
+  else if (image_device != NULL)
+    {
+      *format = GIS_IMAGE_FORMAT_RAW;
+      return get_seekable_is_valid_eos_gpt (image_device, required_size,
+                                            uncompressed_size);
+    }
+  else if (g_str_has_suffix (image, ".squash"))
+    {
+      *format = GIS_IMAGE_FORMAT_SQUASHFS;
+      return get_squashfs_is_valid_eos_gpt (image, required_size,
+                                            uncompressed_size);
+    }
+  else if (g_str_has_suffix (image, ".img"))
+    {
+      *format = GIS_IMAGE_FORMAT_RAW;
+      return get_seekable_is_valid_eos_gpt (image, required_size,
+                                            uncompressed_size);
+    }
+
+  return FALSE;
+}
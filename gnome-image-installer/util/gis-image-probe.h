@@ -0,0 +1,41 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_IMAGE_PROBE_H
+#define GIS_IMAGE_PROBE_H
+
+#include <gio/gio.h>
+
+#include "gis-image-metadata-cache.h"
+
+G_BEGIN_DECLS
+
+gboolean gis_image_probe_file (const gchar    *image,
+                               const gchar    *image_device,
+                               GisImageFormat *format,
+                               guint64        *required_size,
+                               guint64        *uncompressed_size,
+                               guint64        *split_size);
+
+gboolean gis_image_probe_http_head (const gchar *url,
+                                    GBytes      *head,
+                                    guint64     *size);
+
+G_END_DECLS
+
+#endif /* GIS_IMAGE_PROBE_H */
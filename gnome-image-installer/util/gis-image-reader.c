@@ -0,0 +1,598 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* An input stream which reads an image file (or block device) from start to
+ * end, once. It tells the kernel to read ahead of the current position, so
+ * that slow sources such as USB 2 sticks are kept busy with large sequential
+ * reads, and to drop the parts which have already been read from the page
+ * cache, so that a multi-GiB image does not push out everything else
+ * (including the data waiting to be written to the target).
+ *
+ * Alternatively, it can read an image file's extents (as found by
+ * gis_image_extents_query()) straight from the block device holding the
+ * file, bypassing the filesystem and the page cache with large O_DIRECT
+ * reads.
+ */
+#include "config.h"
+#include "gis-image-reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gis-http-image.h"
+#include "gis-image-extents.h"
+#include "gis-squashfs-reader.h"
+#include "glnx-errors.h"
+
+/* How far ahead of the current position to ask the kernel to read. A new
+ * window is requested each time the position passes half way through the
+ * previous one.
+ */
+#define READAHEAD_WINDOW (32 * 1024 * 1024)
+/* How much data which has already been read to accumulate before dropping it
+ * from the page cache.
+ */
+#define DROP_BEHIND (16 * 1024 * 1024)
+/* Readahead to set on block devices while they are being read, in 512-byte
+ * sectors.
+ */
+#define BLOCK_DEVICE_READAHEAD_SECTORS (16 * 1024 * 1024 / 512)
+/* Size of each read from the device when reading extents. */
+#define DIRECT_READ_SIZE (4 * 1024 * 1024)
+/* O_DIRECT reads must be aligned, in offset, length and memory, to the
+ * device's logical block size, which is at most this.
+ */
+#define DIRECT_ALIGNMENT 4096
+
+typedef struct _GisImageReader {
+  GInputStream parent;
+
+  gint fd;
+  size_t page_size;
+
+  /* The block device's readahead before it was raised, in 512-byte sectors,
+   * or 0 if it was left alone.
+   */
+  gulong saved_readahead;
+
+  /* Current position. */
+  guint64 offset;
+  /* End of the last range the kernel was asked to read ahead. */
+  guint64 advised_until;
+  /* End of the last range dropped from the page cache. */
+  guint64 dropped_until;
+
+  /* (element-type GisImageExtent) (nullable): if set, the image is read from
+   * these extents of the block device @fd.
+   */
+  GArray *extents;
+  /* Index of the extent containing @offset */
+  guint extent_index;
+  /* Aligned buffer for reads from the device, holding @buffer_len bytes of
+   * the image starting at offset @buffer_offset within the image, at
+   * @buffer_data.
+   */
+  guint8 *buffer;
+  const guint8 *buffer_data;
+  guint64 buffer_offset;
+  gsize buffer_len;
+} GisImageReader;
+
+typedef enum {
+  PROP_FD = 1,
+  PROP_EXTENTS,
+  N_PROPERTIES
+} GisImageReaderPropertyId;
+
+static GParamSpec *props[N_PROPERTIES] = { 0 };
+
+G_DEFINE_TYPE (GisImageReader, gis_image_reader, G_TYPE_INPUT_STREAM)
+
+static void
+gis_image_reader_init (GisImageReader *self)
+{
+  self->fd = -1;
+  self->page_size = sysconf (_SC_PAGESIZE);
+}
+
+/* Raises the readahead of the block device being read, until the stream is
+ * closed. Setting it needs CAP_SYS_ADMIN, so this often fails; in which case
+ * the WILLNEED hints have to do.
+ */
+static void
+gis_image_reader_raise_readahead (GisImageReader *self)
+{
+  long readahead = 0;
+
+  if (ioctl (self->fd, BLKRAGET, &readahead) < 0)
+    {
+      g_debug ("can't get readahead: %s", g_strerror (errno));
+      return;
+    }
+
+  if (readahead >= BLOCK_DEVICE_READAHEAD_SECTORS)
+    return;
+
+  if (ioctl (self->fd, BLKRASET, (unsigned long) BLOCK_DEVICE_READAHEAD_SECTORS) < 0)
+    {
+      g_debug ("can't raise readahead from %ld sectors: %s",
+               readahead, g_strerror (errno));
+      return;
+    }
+
+  g_debug ("raised readahead from %ld to %d sectors",
+           readahead, BLOCK_DEVICE_READAHEAD_SECTORS);
+  self->saved_readahead = readahead;
+}
+
+static void
+gis_image_reader_restore_readahead (GisImageReader *self)
+{
+  if (self->saved_readahead == 0)
+    return;
+
+  if (ioctl (self->fd, BLKRASET, self->saved_readahead) < 0)
+    g_warning ("can't restore readahead to %lu sectors: %s",
+               self->saved_readahead, g_strerror (errno));
+
+  self->saved_readahead = 0;
+}
+
+/* The device's file descriptor may be shared with someone else, so O_DIRECT
+ * is turned off again when we are done.
+ */
+static void
+gis_image_reader_set_direct (GisImageReader *self,
+                             gboolean        direct)
+{
+  gint flags = fcntl (self->fd, F_GETFL);
+
+  if (flags < 0 ||
+      fcntl (self->fd, F_SETFL,
+             direct ? flags | O_DIRECT : flags & ~O_DIRECT) < 0)
+    g_debug ("can't %s O_DIRECT: %s", direct ? "set" : "clear",
+             g_strerror (errno));
+}
+
+static void
+gis_image_reader_constructed (GObject *object)
+{
+  GisImageReader *self = GIS_IMAGE_READER (object);
+  struct stat stbuf;
+  gint r;
+
+  G_OBJECT_CLASS (gis_image_reader_parent_class)->constructed (object);
+
+  g_return_if_fail (self->fd >= 0);
+
+  if (self->extents != NULL)
+    {
+      gis_image_reader_set_direct (self, TRUE);
+      return;
+    }
+
+  /* This doubles the kernel's own readahead, as well as telling it that the
+   * data it has read ahead can be dropped once it has been read.
+   */
+  r = posix_fadvise (self->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  if (r != 0)
+    g_debug ("posix_fadvise (SEQUENTIAL) failed: %s", g_strerror (r));
+
+  if (fstat (self->fd, &stbuf) == 0 && S_ISBLK (stbuf.st_mode))
+    gis_image_reader_raise_readahead (self);
+}
+
+static void
+gis_image_reader_set_property (GObject      *object,
+                               guint         property_id,
+                               const GValue *value,
+                               GParamSpec   *pspec)
+{
+  GisImageReader *self = GIS_IMAGE_READER (object);
+
+  switch ((GisImageReaderPropertyId) property_id)
+    {
+    case PROP_FD:
+      self->fd = g_value_get_int (value);
+      break;
+
+    case PROP_EXTENTS:
+      self->extents = g_value_dup_boxed (value);
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+gis_image_reader_get_property (GObject    *object,
+                               guint       property_id,
+                               GValue     *value,
+                               GParamSpec *pspec)
+{
+  GisImageReader *self = GIS_IMAGE_READER (object);
+
+  switch ((GisImageReaderPropertyId) property_id)
+    {
+    case PROP_FD:
+      g_value_set_int (value, self->fd);
+      break;
+
+    case PROP_EXTENTS:
+      g_value_set_boxed (value, self->extents);
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+gis_image_reader_finalize (GObject *object)
+{
+  GisImageReader *self = GIS_IMAGE_READER (object);
+
+  /* GInputStream closes the stream on dispose, if it has not been closed
+   * already, so this is just belt and braces.
+   */
+  if (self->fd != -1)
+    {
+      if (self->extents != NULL)
+        gis_image_reader_set_direct (self, FALSE);
+      else
+        gis_image_reader_restore_readahead (self);
+      close (self->fd);
+      self->fd = -1;
+    }
+
+  g_clear_pointer (&self->extents, g_array_unref);
+  g_clear_pointer (&self->buffer, free);
+
+  G_OBJECT_CLASS (gis_image_reader_parent_class)->finalize (object);
+}
+
+static void
+gis_image_reader_advise (GisImageReader *self,
+                         guint64         offset,
+                         guint64         len,
+                         gint            advice)
+{
+  gint r = posix_fadvise (self->fd, offset, len, advice);
+
+  if (r != 0)
+    g_debug ("posix_fadvise (%" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT
+             ", %d) failed: %s", offset, len, advice, g_strerror (r));
+}
+
+/* Fills the buffer with data from the image starting at the current
+ * position, up to the end of the extent containing it. Returns FALSE on error
+ * or at the end of the image.
+ */
+static gboolean
+gis_image_reader_fill_buffer (GisImageReader *self,
+                              GError        **error)
+{
+  const GisImageExtent *extent;
+  guint64 physical, aligned_start, end, aligned_end;
+  gsize skip;
+  gssize r;
+
+  while (self->extent_index < self->extents->len)
+    {
+      extent = &g_array_index (self->extents, GisImageExtent,
+                               self->extent_index);
+      if (self->offset < extent->logical + extent->length)
+        break;
+
+      self->extent_index++;
+    }
+
+  if (self->extent_index == self->extents->len)
+    return FALSE;
+
+  if (self->buffer == NULL)
+    {
+      gint err = posix_memalign ((void **) &self->buffer, DIRECT_ALIGNMENT,
+                                 DIRECT_READ_SIZE + 2 * DIRECT_ALIGNMENT);
+      if (err != 0)
+        {
+          errno = err;
+          return glnx_throw_errno_prefix (error, "can't allocate buffer");
+        }
+    }
+
+  extent = &g_array_index (self->extents, GisImageExtent, self->extent_index);
+  physical = extent->physical + (self->offset - extent->logical);
+  end = MIN (physical + DIRECT_READ_SIZE,
+             extent->physical + extent->length);
+  aligned_start = physical - physical % DIRECT_ALIGNMENT;
+  aligned_end = end + (DIRECT_ALIGNMENT - end % DIRECT_ALIGNMENT) % DIRECT_ALIGNMENT;
+  skip = physical - aligned_start;
+
+  for (;;)
+    {
+      r = pread (self->fd, self->buffer, aligned_end - aligned_start,
+                 aligned_start);
+
+      if (r < 0 && errno == EINTR)
+        continue;
+
+      /* Not every device (or, in the tests, filesystem) supports O_DIRECT, or
+       * it may need stricter alignment than we assumed; fall back to
+       * buffered reads.
+       */
+      if (r < 0 && errno == EINVAL && (fcntl (self->fd, F_GETFL) & O_DIRECT))
+        {
+          g_debug ("O_DIRECT read failed; retrying without it");
+          gis_image_reader_set_direct (self, FALSE);
+          continue;
+        }
+
+      break;
+    }
+
+  if (r < 0)
+    return glnx_throw_errno_prefix (error, "error reading image from device");
+
+  if ((gsize) r <= skip)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "unexpected end of device at %" G_GUINT64_FORMAT,
+                   aligned_start + r);
+      return FALSE;
+    }
+
+  self->buffer_data = self->buffer + skip;
+  self->buffer_offset = self->offset;
+  self->buffer_len = MIN ((gsize) r - skip, end - physical);
+  return TRUE;
+}
+
+static gssize
+gis_image_reader_read_extents (GisImageReader *self,
+                               void           *buffer,
+                               gsize           count,
+                               GError        **error)
+{
+  gsize available;
+
+  if (self->offset < self->buffer_offset ||
+      self->offset >= self->buffer_offset + self->buffer_len)
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      if (!gis_image_reader_fill_buffer (self, &local_error))
+        {
+          if (local_error == NULL)
+            return 0;
+
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return -1;
+        }
+    }
+
+  available = self->buffer_offset + self->buffer_len - self->offset;
+  count = MIN (count, available);
+  memcpy (buffer, self->buffer_data + (self->offset - self->buffer_offset),
+          count);
+  self->offset += count;
+
+  return count;
+}
+
+static gssize
+gis_image_reader_read (GInputStream  *stream,
+                       void          *buffer,
+                       gsize          count,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  GisImageReader *self = GIS_IMAGE_READER (stream);
+  guint64 consumed;
+  gssize r;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  if (self->extents != NULL)
+    return gis_image_reader_read_extents (self, buffer, count, error);
+
+  if (self->offset + READAHEAD_WINDOW / 2 >= self->advised_until)
+    {
+      gis_image_reader_advise (self, self->advised_until, READAHEAD_WINDOW,
+                               POSIX_FADV_WILLNEED);
+      self->advised_until += READAHEAD_WINDOW;
+    }
+
+  do
+    r = read (self->fd, buffer, count);
+  while (r < 0 && errno == EINTR);
+
+  if (r < 0)
+    {
+      glnx_throw_errno_prefix (error, "error reading image");
+      return -1;
+    }
+
+  self->offset += r;
+
+  /* Only whole pages can be dropped. */
+  consumed = self->offset - self->offset % self->page_size;
+  if (consumed - self->dropped_until >= DROP_BEHIND)
+    {
+      gis_image_reader_advise (self, self->dropped_until,
+                               consumed - self->dropped_until,
+                               POSIX_FADV_DONTNEED);
+      self->dropped_until = consumed;
+    }
+
+  return r;
+}
+
+static gboolean
+gis_image_reader_close (GInputStream  *stream,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  GisImageReader *self = GIS_IMAGE_READER (stream);
+  gint fd = self->fd;
+
+  if (self->extents != NULL)
+    {
+      gis_image_reader_set_direct (self, FALSE);
+    }
+  else
+    {
+      /* Drop whatever is left of the image, including anything which was
+       * read ahead but not used.
+       */
+      gis_image_reader_advise (self, self->dropped_until, 0,
+                               POSIX_FADV_DONTNEED);
+      gis_image_reader_restore_readahead (self);
+    }
+
+  self->fd = -1;
+  if (close (fd) < 0)
+    return glnx_throw_errno_prefix (error, "error closing image");
+
+  return TRUE;
+}
+
+static void
+gis_image_reader_class_init (GisImageReaderClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *istream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->constructed = gis_image_reader_constructed;
+  object_class->set_property = gis_image_reader_set_property;
+  object_class->get_property = gis_image_reader_get_property;
+  object_class->finalize = gis_image_reader_finalize;
+
+  istream_class->read_fn = gis_image_reader_read;
+  /* Allow parent class to emulate skip; the scribe never skips. */
+  istream_class->close_fn = gis_image_reader_close;
+
+  props[PROP_FD] = g_param_spec_int (
+      "fd",
+      "FD",
+      "Readable file descriptor for the image, which is guaranteed to be "
+      "close()d by this class.",
+      -1, G_MAXINT, -1,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  props[PROP_EXTENTS] = g_param_spec_boxed (
+      "extents",
+      "Extents",
+      "GArray of GisImageExtent: if set, the image is read from these "
+      "extents of the block device given by the fd property.",
+      G_TYPE_ARRAY,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, props);
+}
+
+/**
+ * gis_image_reader_new:
+ * @fd: readable file descriptor, positioned at the start of the image, which
+ *  is guaranteed to be close()d by the returned stream
+ *
+ * Returns: (transfer full): a new stream reading from @fd.
+ */
+GInputStream *
+gis_image_reader_new (gint fd)
+{
+  g_return_val_if_fail (fd >= 0, NULL);
+
+  return g_object_new (GIS_TYPE_IMAGE_READER,
+                       "fd", fd,
+                       NULL);
+}
+
+/**
+ * gis_image_reader_new_for_extents:
+ * @device_fd: readable file descriptor for a block device, which is
+ *  guaranteed to be close()d by the returned stream
+ * @extents: (element-type GisImageExtent): extents of the image on the device,
+ *  in order, as returned by gis_image_extents_query()
+ *
+ * Returns: (transfer full): a new stream reading @extents from @device_fd,
+ *  with O_DIRECT if possible.
+ */
+GInputStream *
+gis_image_reader_new_for_extents (gint    device_fd,
+                                  GArray *extents)
+{
+  g_return_val_if_fail (device_fd >= 0, NULL);
+  g_return_val_if_fail (extents != NULL, NULL);
+
+  return g_object_new (GIS_TYPE_IMAGE_READER,
+                       "fd", device_fd,
+                       "extents", extents,
+                       NULL);
+}
+
+/**
+ * gis_image_reader_open:
+ * @file: image file, or block device, to read
+ *
+ * Opens @file for reading with a #GisImageReader. If @file is a squashfs
+ * image, the image within it is read with a #GisSquashfsReader instead; if it
+ * is on an HTTP or HTTPS server, it is read with a #GisHttpImageReader; and
+ * if it is some other non-local file, it is opened with g_file_read().
+ *
+ * Returns: (transfer full): a stream reading @file, or %NULL on error.
+ */
+GInputStream *
+gis_image_reader_open (GFile        *file,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  g_autofree gchar *path = g_file_get_path (file);
+  gint fd;
+
+  if (gis_http_image_is_http (file))
+    return gis_http_image_reader_open (file, cancellable, error);
+
+  if (path == NULL)
+    return G_INPUT_STREAM (g_file_read (file, cancellable, error));
+
+  if (gis_squashfs_reader_is_squashfs (file))
+    return gis_squashfs_reader_open (file, GIS_SQUASHFS_LIVE_IMAGE_PATH,
+                                     cancellable, error);
+
+  fd = open (path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd < 0)
+    {
+      glnx_throw_errno_prefix (error, "can't open %s", path);
+      return NULL;
+    }
+
+  return gis_image_reader_new (fd);
+}
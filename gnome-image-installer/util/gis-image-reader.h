@@ -0,0 +1,40 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_IMAGE_READER_H
+#define GIS_IMAGE_READER_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define GIS_TYPE_IMAGE_READER (gis_image_reader_get_type ())
+G_DECLARE_FINAL_TYPE (GisImageReader, gis_image_reader, GIS, IMAGE_READER, GInputStream);
+
+GInputStream *gis_image_reader_new (gint fd);
+
+GInputStream *gis_image_reader_new_for_extents (gint    device_fd,
+                                                GArray *extents);
+
+GInputStream *gis_image_reader_open (GFile        *file,
+                                     GCancellable *cancellable,
+                                     GError      **error);
+
+G_END_DECLS
+
+#endif /* GIS_IMAGE_READER_H */
@@ -0,0 +1,770 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Verifies images in the background, at low priority, as soon as they are
+ * selected, so that a bad image is reported before the user is asked to
+ * confirm that their disk may be erased, and so that GisScribe need not
+ * verify the image again while writing it.
+ *
+ * A verified image is remembered by its identity: its device, inode, size and
+ * modification time, a hash of a few blocks sampled from throughout it, and
+ * the contents of the signature or checksum it was verified against. This is
+ * much cheaper to recompute than verifying the whole image again, and will
+ * not match an image which has been replaced or modified since.
+ */
+#include "config.h"
+#include "gis-image-verifier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <glib/gi18n.h>
+
+#include "glnx-errors.h"
+#include "glnx-fdio.h"
+#include "gis-errors.h"
+#include "gis-image-reader.h"
+#include "gis-split-image.h"
+#include "gis-squashfs-reader.h"
+
+#define BUFFER_SIZE (1 * 1024 * 1024)
+/* Number and size of the blocks of the image which are hashed to check that
+ * it has not changed since it was verified.
+ */
+#define N_SAMPLES 16
+#define SAMPLE_SIZE (64 * 1024)
+/* String length of a sha256 checksum hex digest */
+#define CHECKSUM_STRLEN 64
+
+/* ioprio_set(2) has no glibc wrapper, and its constants are not in glibc's
+ * headers.
+ */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+typedef struct _GisImageVerifier {
+  GObject parent;
+
+  gchar *gpg_path;
+  gchar *keyring_path;
+
+  /* Set of (owned) identities of images which have been verified
+   * successfully, as returned by gis_image_verifier_compute_identity().
+   * Guarded by .mutex, since it is added to from worker threads.
+   */
+  GHashTable *verified;
+  GMutex mutex;
+} GisImageVerifier;
+
+typedef struct {
+  GFile *image;
+  /* The signature if verify_gpg is TRUE; otherwise the checksum. */
+  GFile *verification;
+  gboolean verify_gpg;
+} GisImageVerifierData;
+
+static void
+gis_image_verifier_data_free (GisImageVerifierData *data)
+{
+  g_clear_object (&data->image);
+  g_clear_object (&data->verification);
+  g_slice_free (GisImageVerifierData, data);
+}
+
+G_DEFINE_TYPE (GisImageVerifier, gis_image_verifier, G_TYPE_OBJECT)
+
+typedef enum {
+  PROP_GPG_PATH = 1,
+  PROP_KEYRING_PATH,
+  N_PROPERTIES
+} GisImageVerifierPropertyId;
+
+static GParamSpec *props[N_PROPERTIES] = { 0 };
+
+static void
+gis_image_verifier_set_property (GObject      *object,
+                                 guint         property_id,
+                                 const GValue *value,
+                                 GParamSpec   *pspec)
+{
+  GisImageVerifier *self = GIS_IMAGE_VERIFIER (object);
+
+  switch ((GisImageVerifierPropertyId) property_id)
+    {
+    case PROP_GPG_PATH:
+      g_free (self->gpg_path);
+      self->gpg_path = g_value_dup_string (value);
+      break;
+
+    case PROP_KEYRING_PATH:
+      g_free (self->keyring_path);
+      self->keyring_path = g_value_dup_string (value);
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+gis_image_verifier_get_property (GObject    *object,
+                                 guint       property_id,
+                                 GValue     *value,
+                                 GParamSpec *pspec)
+{
+  GisImageVerifier *self = GIS_IMAGE_VERIFIER (object);
+
+  switch ((GisImageVerifierPropertyId) property_id)
+    {
+    case PROP_GPG_PATH:
+      g_value_set_string (value, self->gpg_path);
+      break;
+
+    case PROP_KEYRING_PATH:
+      g_value_set_string (value, self->keyring_path);
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+gis_image_verifier_finalize (GObject *object)
+{
+  GisImageVerifier *self = GIS_IMAGE_VERIFIER (object);
+
+  g_clear_pointer (&self->gpg_path, g_free);
+  g_clear_pointer (&self->keyring_path, g_free);
+  g_clear_pointer (&self->verified, g_hash_table_unref);
+  g_mutex_clear (&self->mutex);
+
+  G_OBJECT_CLASS (gis_image_verifier_parent_class)->finalize (object);
+}
+
+static void
+gis_image_verifier_class_init (GisImageVerifierClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  /* Images within a squashfs are fed to GPG through a pipe, which it may
+   * close early; see gis_scribe_class_init().
+   */
+  signal (SIGPIPE, SIG_IGN);
+
+  object_class->set_property = gis_image_verifier_set_property;
+  object_class->get_property = gis_image_verifier_get_property;
+  object_class->finalize = gis_image_verifier_finalize;
+
+  props[PROP_GPG_PATH] = g_param_spec_string (
+      "gpg-path",
+      "GPG path",
+      "Path to GPG executable",
+      GPG_PATH,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  props[PROP_KEYRING_PATH] = g_param_spec_string (
+      "keyring-path",
+      "Keyring path",
+      "Path to GPG keyring holding image signing public keys",
+      IMAGE_KEYRING,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, props);
+}
+
+static void
+gis_image_verifier_init (GisImageVerifier *self)
+{
+  g_mutex_init (&self->mutex);
+  self->verified = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, NULL);
+}
+
+/**
+ * gis_image_verifier_new:
+ *
+ * Returns: (transfer full): a new verifier, which checks signatures against
+ *  the default keyring.
+ */
+GisImageVerifier *
+gis_image_verifier_new (void)
+{
+  return g_object_new (GIS_TYPE_IMAGE_VERIFIER, NULL);
+}
+
+const gchar *
+gis_image_verifier_get_keyring_path (GisImageVerifier *self)
+{
+  g_return_val_if_fail (GIS_IS_IMAGE_VERIFIER (self), NULL);
+
+  return self->keyring_path;
+}
+
+/* Adds the identity of @file to @checksum: its device, inode, size and
+ * modification time, and a few blocks sampled from throughout it.
+ */
+static gboolean
+gis_image_verifier_hash_file (GChecksum    *checksum,
+                              GFile        *file,
+                              GCancellable *cancellable,
+                              GError      **error)
+{
+  g_autofree gchar *path = g_file_get_path (file);
+  glnx_autofd int fd = -1;
+  struct stat stbuf;
+  off_t size;
+  g_autofree gchar *header = NULL;
+  g_autofree guint8 *sample = NULL;
+  guint i;
+
+  if (path == NULL)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "image is not a local file");
+      return FALSE;
+    }
+
+  fd = open (path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd < 0)
+    return glnx_throw_errno_prefix (error, "can't open %s", path);
+
+  if (!glnx_fstat (fd, &stbuf, error))
+    return FALSE;
+
+  /* st_size is 0 for block devices, such as the uncompressed image within
+   * the squashfs on a live USB.
+   */
+  size = lseek (fd, 0, SEEK_END);
+  if (size < 0)
+    return glnx_throw_errno_prefix (error, "can't find size of %s", path);
+
+  header = g_strdup_printf ("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":"
+                            "%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT ".%09ld\n",
+                            (guint64) stbuf.st_dev,
+                            (guint64) stbuf.st_ino,
+                            (guint64) size,
+                            (gint64) stbuf.st_mtim.tv_sec,
+                            stbuf.st_mtim.tv_nsec);
+  g_checksum_update (checksum, (const guchar *) header, -1);
+
+  /* Evenly spaced, including the very start and end of the file. */
+  sample = g_malloc (SAMPLE_SIZE);
+  for (i = 0; i < N_SAMPLES; i++)
+    {
+      off_t offset = 0;
+      ssize_t r;
+
+      if (size > SAMPLE_SIZE)
+        offset = (size - SAMPLE_SIZE) * i / (N_SAMPLES - 1);
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      r = pread (fd, sample, SAMPLE_SIZE, offset);
+      if (r < 0)
+        return glnx_throw_errno_prefix (error, "can't read %s", path);
+
+      g_checksum_update (checksum, sample, r);
+    }
+
+  return TRUE;
+}
+
+/* Returns a string identifying the current contents of @image (or of every
+ * part of it, if it is split), and the signature or checksum @verification
+ * it is to be verified against, without reading the whole image.
+ */
+static gchar *
+gis_image_verifier_compute_identity (GFile        *image,
+                                     GFile        *verification,
+                                     GCancellable *cancellable,
+                                     GError      **error)
+{
+  g_autofree gchar *contents = NULL;
+  gsize length = 0;
+  g_autoptr(GChecksum) checksum = NULL;
+  g_autoptr(GPtrArray) parts = NULL;
+  guint i;
+
+  if (!g_file_load_contents (verification, cancellable, &contents, &length,
+                             NULL, error))
+    return NULL;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_checksum_update (checksum, (const guchar *) contents, length);
+
+  if (gis_split_image_is_split (image))
+    {
+      parts = gis_split_image_list_parts (image, cancellable, error);
+      if (parts == NULL)
+        return NULL;
+    }
+  else
+    {
+      parts = g_ptr_array_new_with_free_func (g_object_unref);
+      g_ptr_array_add (parts, g_object_ref (image));
+    }
+
+  for (i = 0; i < parts->len; i++)
+    {
+      if (!gis_image_verifier_hash_file (checksum,
+                                         g_ptr_array_index (parts, i),
+                                         cancellable, error))
+        return NULL;
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* Runs in the GPG subprocess before it is executed, so must only make
+ * async-signal-safe calls.
+ */
+static void
+gis_image_verifier_child_setup (gpointer user_data)
+{
+  /* Failure is harmless: GPG just competes with the user on an equal
+   * footing.
+   */
+  (void) setpriority (PRIO_PROCESS, 0, 19);
+  (void) syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                  IOPRIO_PRIO_VALUE (IOPRIO_CLASS_IDLE, 0));
+}
+
+/* Lowers the I/O priority of the calling thread, and returns its old
+ * priority. This is a shared GTask worker thread, so only its I/O priority is
+ * lowered, and only while reading the image: once lowered, its CPU priority
+ * could not be raised again.
+ */
+static int
+gis_image_verifier_lower_ioprio (void)
+{
+  int old_ioprio = syscall (SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+
+  (void) syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                  IOPRIO_PRIO_VALUE (IOPRIO_CLASS_IDLE, 0));
+  return old_ioprio;
+}
+
+static void
+gis_image_verifier_restore_ioprio (int old_ioprio)
+{
+  if (old_ioprio >= 0)
+    (void) syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, old_ioprio);
+}
+
+static gboolean
+gis_image_verifier_run_gpg (GisImageVerifier *self,
+                            GFile            *image,
+                            GFile            *signature,
+                            GCancellable     *cancellable,
+                            GError          **error)
+{
+  g_autofree gchar *image_path = g_file_get_path (image);
+  g_autofree gchar *signature_path = g_file_get_path (signature);
+  g_autoptr(GInputStream) input = NULL;
+  GSubprocessFlags flags = G_SUBPROCESS_FLAGS_STDOUT_SILENCE;
+  const gchar *image_arg = image_path;
+  g_autofree gchar *args_flat = NULL;
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autoptr(GSubprocess) subprocess = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GError) splice_error = NULL;
+
+  /* GPG can't read the image within a squashfs itself, so feed it through
+   * its stdin.
+   */
+  if (gis_squashfs_reader_is_squashfs (image))
+    {
+      input = gis_image_reader_open (image, cancellable, error);
+      if (input == NULL)
+        return FALSE;
+
+      image_arg = "-";
+      flags |= G_SUBPROCESS_FLAGS_STDIN_PIPE;
+    }
+
+  const gchar * const args[] = {
+      self->gpg_path,
+      /* Trust the one key in this keyring, and no others */
+      "--keyring", self->keyring_path,
+      "--no-default-keyring",
+      "--trust-model", "always",
+      "--verify", signature_path, image_arg, NULL
+  };
+
+  args_flat = g_strjoinv (" ", (gchar **) args);
+  g_message ("Spawning %s", args_flat);
+  launcher = g_subprocess_launcher_new (flags);
+  g_subprocess_launcher_set_child_setup (launcher,
+                                         gis_image_verifier_child_setup,
+                                         NULL, NULL);
+  subprocess = g_subprocess_launcher_spawnv (launcher, args, error);
+  if (subprocess == NULL)
+    return FALSE;
+
+  /* If GPG gives up early, the pipe is closed, but what matters is its exit
+   * status.
+   */
+  if (input != NULL)
+    (void) g_output_stream_splice (g_subprocess_get_stdin_pipe (subprocess),
+                                   input,
+                                   G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                   G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                   cancellable, &splice_error);
+
+  if (g_error_matches (splice_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    local_error = g_steal_pointer (&splice_error);
+
+  if (local_error != NULL ||
+      !g_subprocess_wait (subprocess, cancellable, &local_error))
+    {
+      /* Don't leave GPG reading the image in the background. */
+      g_subprocess_force_exit (subprocess);
+      (void) g_subprocess_wait (subprocess, NULL, NULL);
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  if (!g_subprocess_get_successful (subprocess))
+    {
+      g_message ("GPG subprocess failed to verify %s", image_path);
+      g_set_error_literal (error, GIS_IMAGE_ERROR,
+                           GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                           _("Image verification error."));
+      return FALSE;
+    }
+
+  /* GPG can't have verified an image it didn't read all of. */
+  if (splice_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&splice_error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * gis_image_verifier_verify_signature:
+ * @file: a small file, such as a manifest
+ * @signature: a detached GPG signature for @file
+ *
+ * Synchronously checks @file against @signature and the keyring. Unlike
+ * gis_image_verifier_verify_async(), the outcome is not remembered, so this
+ * is only suitable for files which are much smaller than an image.
+ *
+ * Returns: %TRUE if @signature is a good signature for @file.
+ */
+gboolean
+gis_image_verifier_verify_signature (GisImageVerifier *self,
+                                     GFile            *file,
+                                     GFile            *signature,
+                                     GCancellable     *cancellable,
+                                     GError          **error)
+{
+  g_return_val_if_fail (GIS_IS_IMAGE_VERIFIER (self), FALSE);
+  g_return_val_if_fail (G_IS_FILE (file), FALSE);
+  g_return_val_if_fail (G_IS_FILE (signature), FALSE);
+
+  return gis_image_verifier_run_gpg (self, file, signature, cancellable,
+                                     error);
+}
+
+static gboolean
+gis_image_verifier_check_checksum (GFile        *image,
+                                   GFile        *checksum_file,
+                                   GCancellable *cancellable,
+                                   GError      **error)
+{
+  g_autofree gchar *checksum_path = g_file_get_path (checksum_file);
+  g_autofree gchar *contents = NULL;
+  g_auto(GStrv) words = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GChecksum) sha256sum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree guint8 *buf = NULL;
+  const gchar *digest;
+  gsize len = 0;
+  gboolean ok;
+  int old_ioprio;
+
+  if (!g_file_load_contents (checksum_file, cancellable, &contents, NULL,
+                             NULL, error))
+    return FALSE;
+
+  g_strstrip (contents);
+  words = g_strsplit (contents, " ", 2);
+  if (words[0] == NULL || strlen (words[0]) != CHECKSUM_STRLEN)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   _("The checksum file ‘%s’ does not contain a checksum."),
+                   checksum_path);
+      return FALSE;
+    }
+
+  input = gis_image_reader_open (image, cancellable, error);
+  if (input == NULL)
+    return FALSE;
+
+  old_ioprio = gis_image_verifier_lower_ioprio ();
+
+  buf = g_malloc (BUFFER_SIZE);
+  do
+    {
+      ok = g_input_stream_read_all (input, buf, BUFFER_SIZE, &len,
+                                    cancellable, error);
+      if (ok)
+        g_checksum_update (sha256sum, buf, len);
+    }
+  while (ok && len > 0);
+
+  gis_image_verifier_restore_ioprio (old_ioprio);
+
+  if (!ok)
+    return FALSE;
+
+  digest = g_checksum_get_string (sha256sum);
+  if (g_strcmp0 (digest, words[0]) != 0)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   _("Image checksum ‘%s‘ does not match expected checksum ‘%s‘."),
+                   digest, words[0]);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* A split image's signature is for its manifest, which lists the checksum of
+ * each part.
+ */
+static gboolean
+gis_image_verifier_verify_split (GisImageVerifier     *self,
+                                 GisImageVerifierData *data,
+                                 GCancellable         *cancellable,
+                                 GError              **error)
+{
+  g_autoptr(GFile) manifest = gis_split_image_get_manifest (data->image);
+  gboolean ok;
+  int old_ioprio;
+
+  if (data->verify_gpg &&
+      !gis_image_verifier_run_gpg (self, manifest, data->verification,
+                                   cancellable, error))
+    return FALSE;
+
+  old_ioprio = gis_image_verifier_lower_ioprio ();
+  ok = gis_split_image_verify_parts (data->image, cancellable, error);
+  gis_image_verifier_restore_ioprio (old_ioprio);
+
+  return ok;
+}
+
+static void
+gis_image_verifier_verify_thread (GTask        *task,
+                                  gpointer      source_object,
+                                  gpointer      task_data,
+                                  GCancellable *cancellable)
+{
+  GisImageVerifier *self = GIS_IMAGE_VERIFIER (source_object);
+  GisImageVerifierData *data = task_data;
+  g_autofree gchar *before = NULL;
+  g_autofree gchar *after = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean ok;
+
+  before = gis_image_verifier_compute_identity (data->image,
+                                                data->verification,
+                                                cancellable, &error);
+  if (before == NULL)
+    {
+      g_task_return_error (task, g_steal_pointer (&error));
+      return;
+    }
+
+  if (gis_split_image_is_split (data->image))
+    ok = gis_image_verifier_verify_split (self, data, cancellable, &error);
+  else if (data->verify_gpg)
+    ok = gis_image_verifier_run_gpg (self, data->image, data->verification,
+                                     cancellable, &error);
+  else
+    ok = gis_image_verifier_check_checksum (data->image, data->verification,
+                                            cancellable, &error);
+
+  if (!ok)
+    {
+      g_task_return_error (task, g_steal_pointer (&error));
+      return;
+    }
+
+  after = gis_image_verifier_compute_identity (data->image,
+                                               data->verification,
+                                               cancellable, &error);
+  if (after == NULL)
+    {
+      g_task_return_error (task, g_steal_pointer (&error));
+      return;
+    }
+
+  /* Not a verification failure as such: whatever is there now will be
+   * verified when it is written.
+   */
+  if (g_strcmp0 (before, after) != 0)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "image changed while it was being verified");
+      return;
+    }
+
+  g_mutex_lock (&self->mutex);
+  g_hash_table_add (self->verified, g_steal_pointer (&after));
+  g_mutex_unlock (&self->mutex);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * gis_image_verifier_verify_async:
+ * @image: the (possibly compressed) image file
+ * @signature: detached GPG signature for @image, which is used if it exists
+ * @checksum: file containing a SHA256 checksum for @image, which is used if
+ *  @signature does not exist
+ *
+ * Verifies @image in a worker thread, as GisScribe would while writing it,
+ * but at idle I/O priority. If verification succeeds, @image is remembered
+ * so that gis_image_verifier_is_verified() returns %TRUE for it until it is
+ * modified.
+ *
+ * If @image is the first part of a split image, @signature is for its
+ * manifest, and each part is checked against the manifest.
+ *
+ * If @image is not valid, fails with %GIS_IMAGE_ERROR_VERIFICATION_FAILED.
+ * Any other error just means the image could not be checked in advance.
+ */
+void
+gis_image_verifier_verify_async (GisImageVerifier   *self,
+                                 GFile              *image,
+                                 GFile              *signature,
+                                 GFile              *checksum,
+                                 GCancellable       *cancellable,
+                                 GAsyncReadyCallback callback,
+                                 gpointer            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  GisImageVerifierData *data;
+
+  g_return_if_fail (GIS_IS_IMAGE_VERIFIER (self));
+  g_return_if_fail (G_IS_FILE (image));
+  g_return_if_fail (G_IS_FILE (signature));
+  g_return_if_fail (G_IS_FILE (checksum));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  data = g_slice_new0 (GisImageVerifierData);
+  g_task_set_source_tag (task, gis_image_verifier_verify_async);
+  g_task_set_task_data (task, data,
+                        (GDestroyNotify) gis_image_verifier_data_free);
+
+  data->image = g_object_ref (image);
+
+  if (g_file_query_exists (signature, cancellable))
+    {
+      data->verification = g_object_ref (signature);
+      data->verify_gpg = TRUE;
+    }
+  else if (g_file_query_exists (checksum, cancellable))
+    {
+      data->verification = g_object_ref (checksum);
+      data->verify_gpg = FALSE;
+    }
+  else
+    {
+      g_autofree gchar *signature_path = g_file_get_path (signature);
+      g_autofree gchar *checksum_path = g_file_get_path (checksum);
+      g_task_return_new_error (
+          task, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+          _("Neither the signature file ‘%s’ nor the checksum file ‘%s’ exist."),
+          signature_path, checksum_path);
+      return;
+    }
+
+  g_task_run_in_thread (task, gis_image_verifier_verify_thread);
+}
+
+gboolean
+gis_image_verifier_verify_finish (GisImageVerifier *self,
+                                  GAsyncResult     *result,
+                                  GError          **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * gis_image_verifier_is_verified:
+ * @image: the (possibly compressed) image file
+ * @verification: the signature or checksum file which @image is to be
+ *  verified against
+ *
+ * Checks whether @image has been verified against @verification by
+ * gis_image_verifier_verify_async(), and has not changed since. This reads a
+ * few blocks of @image, so may block briefly.
+ *
+ * Returns: %TRUE if @image need not be verified again
+ */
+gboolean
+gis_image_verifier_is_verified (GisImageVerifier *self,
+                                GFile            *image,
+                                GFile            *verification,
+                                GCancellable     *cancellable)
+{
+  g_autofree gchar *identity = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean verified;
+
+  g_return_val_if_fail (GIS_IS_IMAGE_VERIFIER (self), FALSE);
+  g_return_val_if_fail (G_IS_FILE (image), FALSE);
+  g_return_val_if_fail (G_IS_FILE (verification), FALSE);
+
+  identity = gis_image_verifier_compute_identity (image, verification,
+                                                  cancellable, &error);
+  if (identity == NULL)
+    {
+      g_message ("can't check whether image was verified: %s",
+                 error->message);
+      return FALSE;
+    }
+
+  g_mutex_lock (&self->mutex);
+  verified = g_hash_table_contains (self->verified, identity);
+  g_mutex_unlock (&self->mutex);
+
+  return verified;
+}
@@ -0,0 +1,61 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_IMAGE_VERIFIER_H
+#define GIS_IMAGE_VERIFIER_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* GPG keyring holding the public keys which images are signed with */
+#define IMAGE_KEYRING "/usr/share/keyrings/eos-image-keyring.gpg"
+
+#define GIS_TYPE_IMAGE_VERIFIER (gis_image_verifier_get_type ())
+G_DECLARE_FINAL_TYPE (GisImageVerifier, gis_image_verifier, GIS, IMAGE_VERIFIER, GObject);
+
+GisImageVerifier *gis_image_verifier_new (void);
+
+const gchar *gis_image_verifier_get_keyring_path (GisImageVerifier *self);
+
+void gis_image_verifier_verify_async (GisImageVerifier   *self,
+                                      GFile              *image,
+                                      GFile              *signature,
+                                      GFile              *checksum,
+                                      GCancellable       *cancellable,
+                                      GAsyncReadyCallback callback,
+                                      gpointer            user_data);
+
+gboolean gis_image_verifier_verify_finish (GisImageVerifier *self,
+                                           GAsyncResult     *result,
+                                           GError          **error);
+
+gboolean gis_image_verifier_verify_signature (GisImageVerifier *self,
+                                              GFile            *file,
+                                              GFile            *signature,
+                                              GCancellable     *cancellable,
+                                              GError          **error);
+
+gboolean gis_image_verifier_is_verified (GisImageVerifier *self,
+                                         GFile            *image,
+                                         GFile            *verification,
+                                         GCancellable     *cancellable);
+
+G_END_DECLS
+
+#endif /* GIS_IMAGE_VERIFIER_H */
@@ -0,0 +1,427 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A compact record of each install, whether or not it succeeded, for
+ * analysing installs across many computers: which image was written, in
+ * which format, to what hardware; how long it took; how fast each stage of
+ * the scribe's pipeline went; and how it ended.
+ *
+ * Records are built as a GVariant vardict and appended to
+ * GIS_INSTALL_RECORD_BASENAME as one JSON object per line, so that the file
+ * can be read with jq or any JSON lines reader. For example:
+ *
+ *   {"time":"2020-06-01T12:34:56Z","version":"3.35.91","outcome":"success",
+ *    "image-name":"eos-eos3.8-amd64-amd64.200601-121212.en","image-format":"xz",
+ *    "image-size":…,"compressed-size":…,"vendor":"Endless",
+ *    "product":"EC-200","target-model":"ATA SAMSUNG MZ7LN256",
+ *    "duration-usec":…,"bottleneck":"write","bound":"target",
+ *    "stages":{"tee":{"bytes":…,"busy-usec":…,"rate":…},…}}
+ *
+ * (but all on one line). Keys which are not known are left out.
+ */
+
+#include "config.h"
+#include "gis-install-record.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "gis-split-image.h"
+#include "gis-squashfs-reader.h"
+
+/**
+ * gis_install_record_get_image_format:
+ * @image: the image being installed
+ *
+ * Returns: a short name for the format of @image, such as `xz` or `split-gz`
+ */
+const gchar *
+gis_install_record_get_image_format (GFile *image)
+{
+  g_autofree gchar *basename = NULL;
+
+  g_return_val_if_fail (G_IS_FILE (image), NULL);
+
+  basename = g_file_get_basename (image);
+  if (basename == NULL)
+    return "raw";
+
+  if (gis_split_image_is_split (image))
+    return strstr (basename, ".xz.") != NULL ? "split-xz" : "split-gz";
+
+  if (gis_squashfs_reader_is_squashfs (image))
+    return "squashfs";
+
+  if (g_str_has_suffix (basename, ".gz"))
+    return "gz";
+
+  if (g_str_has_suffix (basename, ".xz"))
+    return "xz";
+
+  return "raw";
+}
+
+static void
+add_string (GVariantBuilder *builder,
+            const gchar     *key,
+            const gchar     *value)
+{
+  if (value != NULL)
+    g_variant_builder_add (builder, "{sv}", key, g_variant_new_string (value));
+}
+
+/* Boils down each stage of gis_scribe_dup_metrics() to how much data it
+ * handled, how long it spent doing so, and so how fast it could go.
+ */
+static GVariant *
+summarize_stages (GVariant *stages)
+{
+  GVariantBuilder builder;
+  GVariantIter iter;
+  const gchar *label;
+  GVariant *stage;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sa{sv}}"));
+  g_variant_iter_init (&iter, stages);
+  while (g_variant_iter_loop (&iter, "{&s@a{sv}}", &label, &stage))
+    {
+      GVariantBuilder summary;
+      guint64 bytes_in = 0;
+      guint64 bytes_out = 0;
+      gint64 busy_usec = 0;
+      guint64 bytes;
+
+      g_variant_lookup (stage, "bytes-in", "t", &bytes_in);
+      g_variant_lookup (stage, "bytes-out", "t", &bytes_out);
+      g_variant_lookup (stage, "busy-usec", "x", &busy_usec);
+      bytes = MAX (bytes_in, bytes_out);
+
+      /* For example, there is no verify stage if the image is not signed */
+      if (bytes == 0 && busy_usec == 0)
+        continue;
+
+      g_variant_builder_init (&summary, G_VARIANT_TYPE_VARDICT);
+      g_variant_builder_add (&summary, "{sv}", "bytes",
+                             g_variant_new_uint64 (bytes));
+      g_variant_builder_add (&summary, "{sv}", "busy-usec",
+                             g_variant_new_int64 (busy_usec));
+      if (busy_usec > 0)
+        g_variant_builder_add (&summary, "{sv}", "rate",
+                               g_variant_new_uint64 (bytes * (gdouble) G_USEC_PER_SEC /
+                                                     busy_usec));
+      g_variant_builder_add (&builder, "{sa{sv}}", label, &summary);
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+/**
+ * gis_install_record_new:
+ * @image_name: (nullable): the name of the image, as shown to the user
+ * @image_format: (nullable): from gis_install_record_get_image_format()
+ * @image_size: the uncompressed size of the image, in bytes
+ * @compressed_size: the size of the image file, in bytes
+ * @vendor: (nullable): the computer's vendor, from
+ *  gis_dmi_read_vendor_product()
+ * @product: (nullable): the computer's product name
+ * @target_model: (nullable): the vendor and model of the disk written to
+ * @metrics: (nullable): from gis_scribe_dup_metrics(), once the write has
+ *  finished
+ * @error: (nullable): why the install failed, or %NULL if it succeeded
+ *
+ * Returns: (transfer full): a record of an install which has just finished,
+ *  as a vardict, for gis_install_record_append()
+ */
+GVariant *
+gis_install_record_new (const gchar  *image_name,
+                        const gchar  *image_format,
+                        guint64       image_size,
+                        guint64       compressed_size,
+                        const gchar  *vendor,
+                        const gchar  *product,
+                        const gchar  *target_model,
+                        GVariant     *metrics,
+                        const GError *error)
+{
+  g_autoptr(GDateTime) now = g_date_time_new_now_utc ();
+  g_autofree gchar *now_str = g_date_time_format (now, "%Y-%m-%dT%H:%M:%SZ");
+  const gchar *outcome = "success";
+  GVariantBuilder builder;
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    outcome = "cancelled";
+  else if (error != NULL)
+    outcome = "failure";
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  add_string (&builder, "time", now_str);
+  add_string (&builder, "version", PACKAGE_VERSION);
+  add_string (&builder, "outcome", outcome);
+
+  if (error != NULL)
+    {
+      add_string (&builder, "error-domain", g_quark_to_string (error->domain));
+      g_variant_builder_add (&builder, "{sv}", "error-code",
+                             g_variant_new_int32 (error->code));
+      add_string (&builder, "error-message", error->message);
+    }
+
+  add_string (&builder, "image-name", image_name);
+  add_string (&builder, "image-format", image_format);
+  g_variant_builder_add (&builder, "{sv}", "image-size",
+                         g_variant_new_uint64 (image_size));
+  g_variant_builder_add (&builder, "{sv}", "compressed-size",
+                         g_variant_new_uint64 (compressed_size));
+  add_string (&builder, "vendor", vendor);
+  add_string (&builder, "product", product);
+  add_string (&builder, "target-model", target_model);
+
+  if (metrics != NULL)
+    {
+      g_autoptr(GVariant) stages =
+        g_variant_lookup_value (metrics, "stages", G_VARIANT_TYPE ("a{sa{sv}}"));
+      gint64 elapsed_usec;
+      const gchar *value;
+
+      if (g_variant_lookup (metrics, "elapsed-usec", "x", &elapsed_usec))
+        g_variant_builder_add (&builder, "{sv}", "duration-usec",
+                               g_variant_new_int64 (elapsed_usec));
+
+      if (g_variant_lookup (metrics, "bottleneck", "&s", &value))
+        add_string (&builder, "bottleneck", value);
+
+      if (g_variant_lookup (metrics, "bound", "&s", &value))
+        add_string (&builder, "bound", value);
+
+      if (stages != NULL)
+        g_variant_builder_add (&builder, "{sv}", "stages",
+                               summarize_stages (stages));
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static void
+append_json_string (GString     *json,
+                    const gchar *str)
+{
+  const gchar *p;
+
+  g_string_append_c (json, '"');
+  for (p = str; *p != '\0'; p++)
+    {
+      if (*p == '"' || *p == '\\')
+        g_string_append_printf (json, "\\%c", *p);
+      else if ((guchar) *p < 0x20)
+        g_string_append_printf (json, "\\u%04x", (guint) (guchar) *p);
+      else
+        g_string_append_c (json, *p);
+    }
+  g_string_append_c (json, '"');
+}
+
+/* Arrays of dictionary entries, which must have string keys, become objects;
+ * other arrays become arrays; anything else which JSON has no equivalent
+ * for becomes null.
+ */
+static void
+append_json_value (GString  *json,
+                   GVariant *value)
+{
+  switch (g_variant_classify (value))
+    {
+    case G_VARIANT_CLASS_BOOLEAN:
+      g_string_append (json, g_variant_get_boolean (value) ? "true" : "false");
+      break;
+
+    case G_VARIANT_CLASS_INT32:
+      g_string_append_printf (json, "%" G_GINT32_FORMAT,
+                              g_variant_get_int32 (value));
+      break;
+
+    case G_VARIANT_CLASS_UINT32:
+      g_string_append_printf (json, "%" G_GUINT32_FORMAT,
+                              g_variant_get_uint32 (value));
+      break;
+
+    case G_VARIANT_CLASS_INT64:
+      g_string_append_printf (json, "%" G_GINT64_FORMAT,
+                              g_variant_get_int64 (value));
+      break;
+
+    case G_VARIANT_CLASS_UINT64:
+      g_string_append_printf (json, "%" G_GUINT64_FORMAT,
+                              g_variant_get_uint64 (value));
+      break;
+
+    case G_VARIANT_CLASS_DOUBLE:
+      {
+        gdouble d = g_variant_get_double (value);
+        gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+        if (isfinite (d))
+          g_string_append (json, g_ascii_dtostr (buf, sizeof (buf), d));
+        else
+          g_string_append (json, "null");
+      }
+      break;
+
+    case G_VARIANT_CLASS_STRING:
+      append_json_string (json, g_variant_get_string (value, NULL));
+      break;
+
+    case G_VARIANT_CLASS_VARIANT:
+      {
+        g_autoptr(GVariant) child = g_variant_get_variant (value);
+
+        append_json_value (json, child);
+      }
+      break;
+
+    case G_VARIANT_CLASS_ARRAY:
+      {
+        const GVariantType *element_type =
+          g_variant_type_element (g_variant_get_type (value));
+        gboolean is_object = g_variant_type_is_dict_entry (element_type);
+        gsize i, n = g_variant_n_children (value);
+
+        g_string_append_c (json, is_object ? '{' : '[');
+        for (i = 0; i < n; i++)
+          {
+            g_autoptr(GVariant) child = g_variant_get_child_value (value, i);
+
+            if (i > 0)
+              g_string_append_c (json, ',');
+
+            if (is_object)
+              {
+                g_autoptr(GVariant) key = g_variant_get_child_value (child, 0);
+                g_autoptr(GVariant) member = g_variant_get_child_value (child, 1);
+
+                append_json_string (json, g_variant_get_string (key, NULL));
+                g_string_append_c (json, ':');
+                append_json_value (json, member);
+              }
+            else
+              {
+                append_json_value (json, child);
+              }
+          }
+        g_string_append_c (json, is_object ? '}' : ']');
+      }
+      break;
+
+    default:
+      g_string_append (json, "null");
+      break;
+    }
+}
+
+/**
+ * gis_install_record_to_json:
+ * @record: from gis_install_record_new()
+ *
+ * Returns: (transfer full): @record as a single line of JSON, without a
+ *  trailing newline
+ */
+gchar *
+gis_install_record_to_json (GVariant *record)
+{
+  GString *json = g_string_new (NULL);
+
+  g_return_val_if_fail (g_variant_is_of_type (record, G_VARIANT_TYPE_VARDICT),
+                        NULL);
+
+  append_json_value (json, record);
+  return g_string_free (json, FALSE);
+}
+
+static GFile *
+gis_install_record_append_in_dir (GFile        *dir,
+                                  const gchar  *line,
+                                  GCancellable *cancellable,
+                                  GError      **error)
+{
+  g_autoptr(GFile) file = g_file_get_child (dir, GIS_INSTALL_RECORD_BASENAME);
+  g_autoptr(GFileOutputStream) stream = NULL;
+
+  stream = g_file_append_to (file, G_FILE_CREATE_NONE, cancellable, error);
+  if (stream == NULL ||
+      !g_output_stream_write_all (G_OUTPUT_STREAM (stream), line, strlen (line),
+                                  NULL, cancellable, error) ||
+      !g_output_stream_close (G_OUTPUT_STREAM (stream), cancellable, error))
+    return NULL;
+
+  return g_steal_pointer (&file);
+}
+
+/**
+ * gis_install_record_append:
+ * @record: from gis_install_record_new()
+ * @image_dir: (nullable): root directory of image partition, or %NULL if not
+ *  known
+ * @home_dir: (nullable): path to home directory, or %NULL if the record
+ *  should not be written to the home directory
+ *
+ * Appends @record, as a line of JSON, to %GIS_INSTALL_RECORD_BASENAME in the
+ * first of @image_dir and @home_dir which is not %NULL and writable; that is,
+ * alongside the diagnostics which gis_write_diagnostics_async() would write.
+ * The file is created if it does not exist.
+ *
+ * Returns: (transfer full): the file the record was appended to, or %NULL
+ *  with @error set
+ */
+GFile *
+gis_install_record_append (GVariant     *record,
+                           GFile        *image_dir,
+                           const gchar  *home_dir,
+                           GCancellable *cancellable,
+                           GError      **error)
+{
+  g_autofree gchar *json = gis_install_record_to_json (record);
+  g_autofree gchar *line = g_strconcat (json, "\n", NULL);
+  g_autoptr(GError) local_error = NULL;
+  GFile *file;
+
+  if (image_dir != NULL)
+    {
+      file = gis_install_record_append_in_dir (image_dir, line, cancellable,
+                                               &local_error);
+      if (file != NULL || home_dir == NULL)
+        {
+          if (file == NULL)
+            g_propagate_error (error, g_steal_pointer (&local_error));
+          return file;
+        }
+
+      g_message ("failed to append install record to image partition: %s",
+                 local_error->message);
+    }
+
+  if (home_dir != NULL)
+    {
+      g_autoptr(GFile) dir = g_file_new_for_path (home_dir);
+
+      return gis_install_record_append_in_dir (dir, line, cancellable, error);
+    }
+
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                       "nowhere to write install record");
+  return NULL;
+}
@@ -0,0 +1,51 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_INSTALL_RECORD_H
+#define GIS_INSTALL_RECORD_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Where a line is appended for each install, alongside the diagnostics */
+#define GIS_INSTALL_RECORD_BASENAME "eos-installer-installs.jsonl"
+
+const gchar *gis_install_record_get_image_format (GFile *image);
+
+GVariant *gis_install_record_new (const gchar  *image_name,
+                                  const gchar  *image_format,
+                                  guint64       image_size,
+                                  guint64       compressed_size,
+                                  const gchar  *vendor,
+                                  const gchar  *product,
+                                  const gchar  *target_model,
+                                  GVariant     *metrics,
+                                  const GError *error);
+
+gchar *gis_install_record_to_json (GVariant *record);
+
+GFile *gis_install_record_append (GVariant     *record,
+                                  GFile        *image_dir,
+                                  const gchar  *home_dir,
+                                  GCancellable *cancellable,
+                                  GError      **error);
+
+G_END_DECLS
+
+#endif /* GIS_INSTALL_RECORD_H */
@@ -0,0 +1,519 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Reads an image at arbitrary offsets, so that metadata which is not at the
+ * start of the image — such as the backup GPT at the very end — can be
+ * checked without decompressing everything before it. Raw images and block
+ * devices are simply read with pread(). For xz images, the index at the end
+ * of each stream says where every block starts, both in the compressed file
+ * and in the uncompressed image, so only the block holding the requested
+ * offset need be decoded.
+ *
+ * An xz image compressed as a single block (as plain `xz` does, unlike
+ * `xz -T0`) has to be decoded from the start to reach any offset. Rather than
+ * quietly spend minutes doing so, reads more than %MAX_SKIP bytes into a
+ * block fail with %G_IO_ERROR_NOT_SUPPORTED, as do reads from gzip images,
+ * which have no index at all.
+ */
+#include "config.h"
+#include "gis-seekable-image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gduxzdecompressor.h"
+#include "glnx-errors.h"
+#include "gpt.h"
+
+/* The furthest into an xz block that a read may start. This is enough for
+ * the last block of an image compressed with `xz -T0` at the default preset,
+ * and decoding this much takes a second or so even on slow machines.
+ */
+#define MAX_SKIP (64 * 1024 * 1024)
+/* Where data before the requested offset is decoded to, and discarded. */
+#define SCRATCH_SIZE (64 * 1024)
+/* The largest partition table we are prepared to read. The UEFI spec requires
+ * at least 16 KiB, and nothing uses much more.
+ */
+#define MAX_PTABLE_SIZE (1024 * 1024)
+
+static const guint8 XZ_MAGIC[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+static const guint8 GZIP_MAGIC[] = { 0x1f, 0x8b };
+
+struct _GisSeekableImage
+{
+  GObject parent_instance;
+
+  gchar *path;
+  /* The uncompressed size */
+  guint64 size;
+
+  /* Raw images */
+  gint fd;
+
+  /* xz images */
+  GMappedFile *mapped;
+  lzma_index *index;
+};
+
+G_DEFINE_TYPE (GisSeekableImage, gis_seekable_image, G_TYPE_OBJECT)
+
+static void
+gis_seekable_image_finalize (GObject *object)
+{
+  GisSeekableImage *self = GIS_SEEKABLE_IMAGE (object);
+
+  if (self->fd >= 0)
+    close (self->fd);
+
+  if (self->index != NULL)
+    lzma_index_end (self->index, NULL);
+
+  g_clear_pointer (&self->mapped, g_mapped_file_unref);
+  g_free (self->path);
+
+  G_OBJECT_CLASS (gis_seekable_image_parent_class)->finalize (object);
+}
+
+static void
+gis_seekable_image_class_init (GisSeekableImageClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = gis_seekable_image_finalize;
+}
+
+static void
+gis_seekable_image_init (GisSeekableImage *self)
+{
+  self->fd = -1;
+}
+
+static gboolean
+pread_all (gint         fd,
+           gpointer     buf,
+           gsize        len,
+           guint64      offset,
+           const gchar *path,
+           GError     **error)
+{
+  gsize done = 0;
+
+  while (done < len)
+    {
+      gssize r = pread (fd, (guint8 *) buf + done, len - done, offset + done);
+
+      if (r < 0 && errno == EINTR)
+        continue;
+
+      if (r < 0)
+        return glnx_throw_errno_prefix (error, "can't read %s at %"
+                                        G_GUINT64_FORMAT, path, offset + done);
+
+      if (r == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "%s is truncated at %" G_GUINT64_FORMAT,
+                       path, offset + done);
+          return FALSE;
+        }
+
+      done += r;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+invalid_xz (GisSeekableImage *self,
+            GError          **error)
+{
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "%s: xz data is corrupt", self->path);
+  return FALSE;
+}
+
+/* Reads @count bytes at @offset, all within a single xz block, into @buf. */
+static gboolean
+read_xz_block (GisSeekableImage      *self,
+               const lzma_index_iter *iter,
+               guint64                offset,
+               guint8                *buf,
+               gsize                  count,
+               GError               **error)
+{
+  const guint8 *data = (const guint8 *) g_mapped_file_get_contents (self->mapped);
+  gsize len = g_mapped_file_get_length (self->mapped);
+  lzma_filter filters[LZMA_FILTERS_MAX + 1];
+  lzma_block block = { 0 };
+  lzma_stream strm = LZMA_STREAM_INIT;
+  g_autofree guint8 *scratch = NULL;
+  guint64 skip = offset - iter->block.uncompressed_file_offset;
+  const guint8 *header;
+  lzma_ret res;
+  gsize i;
+
+  if (skip > MAX_SKIP)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "%s: reading offset %" G_GUINT64_FORMAT " would mean "
+                   "decompressing %" G_GUINT64_FORMAT " bytes before it",
+                   self->path, offset, skip);
+      return FALSE;
+    }
+
+  if (iter->block.compressed_file_offset > len ||
+      iter->block.total_size > len - iter->block.compressed_file_offset)
+    return invalid_xz (self, error);
+
+  header = data + iter->block.compressed_file_offset;
+  block.version = 0;
+  block.check = iter->stream.flags->check;
+  block.filters = filters;
+  block.header_size = lzma_block_header_size_decode (header[0]);
+  if (header[0] == 0 ||
+      block.header_size > iter->block.total_size ||
+      lzma_block_header_decode (&block, NULL, header) != LZMA_OK)
+    return invalid_xz (self, error);
+
+  if (lzma_block_compressed_size (&block, iter->block.unpadded_size) == LZMA_OK)
+    res = lzma_block_decoder (&strm, &block);
+  else
+    res = LZMA_DATA_ERROR;
+
+  /* The decoder has copied the filter options */
+  for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++)
+    free (filters[i].options);
+
+  if (res != LZMA_OK)
+    {
+      lzma_end (&strm);
+      return invalid_xz (self, error);
+    }
+
+  strm.next_in = header + block.header_size;
+  strm.avail_in = iter->block.total_size - block.header_size;
+
+  if (skip > 0)
+    scratch = g_malloc (SCRATCH_SIZE);
+
+  /* The block's check is not verified, since we stop decoding as soon as we
+   * have what we wanted.
+   */
+  while (skip > 0 || count > 0)
+    {
+      gsize avail_out;
+
+      if (skip > 0)
+        {
+          strm.next_out = scratch;
+          strm.avail_out = MIN (skip, SCRATCH_SIZE);
+        }
+      else
+        {
+          strm.next_out = buf;
+          strm.avail_out = count;
+        }
+
+      avail_out = strm.avail_out;
+      res = lzma_code (&strm, LZMA_RUN);
+      if (res != LZMA_OK && res != LZMA_STREAM_END)
+        break;
+
+      if (skip > 0)
+        skip -= avail_out - strm.avail_out;
+      else
+        {
+          buf += avail_out - strm.avail_out;
+          count -= avail_out - strm.avail_out;
+        }
+
+      if (res == LZMA_STREAM_END)
+        break;
+    }
+
+  lzma_end (&strm);
+
+  if (skip > 0 || count > 0)
+    return invalid_xz (self, error);
+
+  return TRUE;
+}
+
+static gboolean
+read_xz (GisSeekableImage *self,
+         guint64           offset,
+         guint8           *buf,
+         gsize             count,
+         GError          **error)
+{
+  while (count > 0)
+    {
+      lzma_index_iter iter;
+      gsize n;
+
+      lzma_index_iter_init (&iter, self->index);
+      if (lzma_index_iter_locate (&iter, offset))
+        return invalid_xz (self, error);
+
+      n = MIN (count, iter.block.uncompressed_file_offset +
+                      iter.block.uncompressed_size - offset);
+      if (!read_xz_block (self, &iter, offset, buf, n, error))
+        return FALSE;
+
+      offset += n;
+      buf += n;
+      count -= n;
+    }
+
+  return TRUE;
+}
+
+/**
+ * gis_seekable_image_open:
+ * @file: a raw or xz-compressed image, or a block device holding an image
+ *
+ * Opens @file for reading at arbitrary offsets. If @file is compressed in
+ * some other way, fails with %G_IO_ERROR_NOT_SUPPORTED.
+ *
+ * Returns: (transfer full): a #GisSeekableImage, or %NULL on error.
+ */
+GisSeekableImage *
+gis_seekable_image_open (GFile   *file,
+                         GError **error)
+{
+  g_autoptr(GisSeekableImage) self = NULL;
+  guint8 magic[sizeof XZ_MAGIC] = { 0 };
+  gssize r;
+
+  g_return_val_if_fail (G_IS_FILE (file), NULL);
+
+  self = g_object_new (GIS_TYPE_SEEKABLE_IMAGE, NULL);
+  self->path = g_file_get_path (file);
+  if (self->path == NULL)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "image is not a local file");
+      return NULL;
+    }
+
+  self->fd = open (self->path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (self->fd < 0)
+    {
+      glnx_throw_errno_prefix (error, "can't open %s", self->path);
+      return NULL;
+    }
+
+  do
+    r = pread (self->fd, magic, sizeof magic, 0);
+  while (r < 0 && errno == EINTR);
+  if (r < 0)
+    {
+      glnx_throw_errno_prefix (error, "can't read %s", self->path);
+      return NULL;
+    }
+
+  if (memcmp (magic, XZ_MAGIC, sizeof XZ_MAGIC) == 0)
+    {
+      self->mapped = g_mapped_file_new_from_fd (self->fd, FALSE, error);
+      if (self->mapped == NULL)
+        {
+          g_prefix_error (error, "%s: ", self->path);
+          return NULL;
+        }
+
+      close (self->fd);
+      self->fd = -1;
+
+      self->index = gdu_xz_decompressor_decode_index (
+          (const guint8 *) g_mapped_file_get_contents (self->mapped),
+          g_mapped_file_get_length (self->mapped),
+          error);
+      if (self->index == NULL)
+        {
+          g_prefix_error (error, "%s: ", self->path);
+          return NULL;
+        }
+
+      self->size = lzma_index_uncompressed_size (self->index);
+    }
+  else if (memcmp (magic, GZIP_MAGIC, sizeof GZIP_MAGIC) == 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "%s: gzip images can only be read from the start",
+                   self->path);
+      return NULL;
+    }
+  else
+    {
+      /* Unlike fstat(), this works for block devices too */
+      off_t end = lseek (self->fd, 0, SEEK_END);
+
+      if (end < 0)
+        {
+          glnx_throw_errno_prefix (error, "can't find size of %s",
+                                   self->path);
+          return NULL;
+        }
+
+      self->size = end;
+    }
+
+  return g_steal_pointer (&self);
+}
+
+/**
+ * gis_seekable_image_get_size:
+ *
+ * Returns: the uncompressed size of the image, in bytes.
+ */
+guint64
+gis_seekable_image_get_size (GisSeekableImage *self)
+{
+  g_return_val_if_fail (GIS_IS_SEEKABLE_IMAGE (self), 0);
+
+  return self->size;
+}
+
+/**
+ * gis_seekable_image_read_at:
+ * @offset: offset within the uncompressed image
+ * @buffer: where to store @count bytes
+ * @count: number of bytes to read
+ *
+ * Reads @count bytes at @offset. It is an error to read beyond the end of the
+ * image.
+ *
+ * Returns: %TRUE if @count bytes were read; %FALSE on error.
+ */
+gboolean
+gis_seekable_image_read_at (GisSeekableImage *self,
+                            guint64           offset,
+                            gpointer          buffer,
+                            gsize             count,
+                            GError          **error)
+{
+  g_return_val_if_fail (GIS_IS_SEEKABLE_IMAGE (self), FALSE);
+  g_return_val_if_fail (buffer != NULL || count == 0, FALSE);
+
+  if (offset > self->size || count > self->size - offset)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "%s: can't read %" G_GSIZE_FORMAT " bytes at %"
+                   G_GUINT64_FORMAT ", beyond its end at %" G_GUINT64_FORMAT,
+                   self->path, count, offset, self->size);
+      return FALSE;
+    }
+
+  if (self->index != NULL)
+    return read_xz (self, offset, buffer, count, error);
+
+  return pread_all (self->fd, buffer, count, offset, self->path, error);
+}
+
+static gboolean
+read_lba (GisSeekableImage *self,
+          guint64           lba,
+          gpointer          buffer,
+          gsize             count,
+          GError          **error)
+{
+  if (lba > self->size / SECTOR_SIZE)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s: LBA %" G_GUINT64_FORMAT " is beyond the end of the "
+                   "image", self->path, lba);
+      return FALSE;
+    }
+
+  return gis_seekable_image_read_at (self, lba * SECTOR_SIZE, buffer, count,
+                                     error);
+}
+
+static gboolean
+invalid_gpt (GisSeekableImage *self,
+             const gchar      *what,
+             GError          **error)
+{
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "%s: invalid %s", self->path, what);
+  return FALSE;
+}
+
+/**
+ * gis_seekable_image_check_gpt:
+ * @size: (out) (optional): location to store the disk size, in bytes, if the
+ *  GPT is valid
+ *
+ * Checks the primary GPT with is_eos_gpt_valid(), then the whole partition
+ * table and the backup GPT at the end of the image, which
+ * is_eos_gpt_valid() never sees.
+ *
+ * Returns: %TRUE if the GPT is valid
+ */
+gboolean
+gis_seekable_image_check_gpt (GisSeekableImage *self,
+                              guint64          *size,
+                              GError          **error)
+{
+  struct ptable pt;
+  struct gpt_header backup;
+  g_autofree guint8 *ptable = NULL;
+  gsize ptable_len;
+  guint64 disk_size;
+
+  g_return_val_if_fail (GIS_IS_SEEKABLE_IMAGE (self), FALSE);
+
+  if (!gis_seekable_image_read_at (self, 0, &pt, sizeof pt, error))
+    return FALSE;
+
+  if (!is_eos_gpt_valid (&pt, &disk_size))
+    return invalid_gpt (self, "GPT", error);
+
+  ptable_len = (gsize) pt.header.ptable_count * pt.header.ptable_partition_size;
+  if (ptable_len > MAX_PTABLE_SIZE)
+    return invalid_gpt (self, "partition table size", error);
+
+  ptable = g_malloc (ptable_len);
+  if (!read_lba (self, pt.header.ptable_starting_lba, ptable, ptable_len,
+                 error))
+    return FALSE;
+
+  if (!is_gpt_ptable_valid (&pt.header, ptable, ptable_len))
+    return invalid_gpt (self, "partition table", error);
+
+  if (!read_lba (self, pt.header.backup_lba, &backup, sizeof backup, error))
+    return FALSE;
+
+  if (!is_gpt_backup_valid (&pt.header, &backup))
+    return invalid_gpt (self, "backup GPT header", error);
+
+  if (!read_lba (self, backup.ptable_starting_lba, ptable, ptable_len, error))
+    return FALSE;
+
+  if (!is_gpt_ptable_valid (&backup, ptable, ptable_len))
+    return invalid_gpt (self, "backup partition table", error);
+
+  if (size != NULL)
+    *size = disk_size;
+
+  return TRUE;
+}
@@ -0,0 +1,46 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_SEEKABLE_IMAGE_H
+#define GIS_SEEKABLE_IMAGE_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define GIS_TYPE_SEEKABLE_IMAGE (gis_seekable_image_get_type ())
+G_DECLARE_FINAL_TYPE (GisSeekableImage, gis_seekable_image, GIS, SEEKABLE_IMAGE, GObject);
+
+GisSeekableImage *gis_seekable_image_open (GFile   *file,
+                                           GError **error);
+
+guint64 gis_seekable_image_get_size (GisSeekableImage *self);
+
+gboolean gis_seekable_image_read_at (GisSeekableImage *self,
+                                     guint64           offset,
+                                     gpointer          buffer,
+                                     gsize             count,
+                                     GError          **error);
+
+gboolean gis_seekable_image_check_gpt (GisSeekableImage *self,
+                                       guint64          *size,
+                                       GError          **error);
+
+G_END_DECLS
+
+#endif /* GIS_SEEKABLE_IMAGE_H */
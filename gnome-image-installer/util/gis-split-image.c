@@ -0,0 +1,949 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Images may be split into numbered parts, each compressed separately:
+ *
+ *   eos-….img.xz.000
+ *   eos-….img.xz.001
+ *   …
+ *   eos-….img.xz.sha256      manifest: sha256sum output for every part
+ *   eos-….img.xz.sha256.asc  detached signature for the manifest
+ *
+ * The parts are concatenated once decompressed. Since each can be read,
+ * checked and decompressed without the others, a window of parts ahead of
+ * the current position is decompressed in parallel, on a pool of worker
+ * threads, and handed out in order. Each part is checked against the manifest
+ * as it is read; the manifest itself is checked against its signature by the
+ * caller, if there is one.
+ *
+ * Parts may be compressed with xz or gzip, or not at all.
+ */
+#include "config.h"
+#include "gis-split-image.h"
+
+#include <lzma.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <glib/gi18n.h>
+
+#include "gis-errors.h"
+#include "gis-image-reader.h"
+
+/* Size of reads from each part, and of the decompressed chunks handed out */
+#define BUFFER_SIZE (1 * 1024 * 1024)
+/* Upper bound on the decompressed data buffered ahead of the current
+ * position, across all parts. Parts which decompress to less than this
+ * divided by the number of CPUs are decompressed fully in parallel; larger
+ * parts are decompressed in parallel until their buffers fill.
+ */
+#define MAX_BUFFERED (512 * 1024 * 1024)
+/* Parts are numbered with 3 digits */
+#define MAX_PARTS 1000
+#define PART_SUFFIX_LEN (sizeof ".000" - 1)
+/* String length of a sha256 checksum hex digest */
+#define CHECKSUM_STRLEN 64
+
+typedef enum {
+  GIS_SPLIT_IMAGE_CODEC_NONE,
+  GIS_SPLIT_IMAGE_CODEC_XZ,
+  GIS_SPLIT_IMAGE_CODEC_GZIP,
+} GisSplitImageCodec;
+
+typedef struct {
+  GFile *file;
+  gchar *digest;
+
+  /* Protected by GisSplitImageReader.mutex */
+  /* (element-type GBytes): decompressed data, in order */
+  GQueue chunks;
+  gsize buffered;
+  gboolean done;
+  GError *error;
+} GisSplitImagePart;
+
+typedef struct _GisSplitImageReader {
+  GInputStream parent;
+
+  GisSplitImageCodec codec;
+  /* (element-type GisSplitImagePart) */
+  GPtrArray *parts;
+
+  GThreadPool *pool;
+  guint n_workers;
+  /* Decompressed bytes each part may buffer before its worker waits */
+  gsize part_limit;
+
+  GMutex mutex;
+  GCond cond;
+  /* Protected by .mutex */
+  gboolean closing;
+  /* Index of the part being read, and of the next part to submit */
+  guint reading;
+  guint next_part;
+
+  /* The chunk being copied out, and how much of it has been copied */
+  GBytes *current;
+  gsize current_offset;
+} GisSplitImageReader;
+
+G_DEFINE_TYPE (GisSplitImageReader, gis_split_image_reader, G_TYPE_INPUT_STREAM)
+
+static void
+gis_split_image_part_free (GisSplitImagePart *part)
+{
+  g_clear_object (&part->file);
+  g_clear_pointer (&part->digest, g_free);
+  g_queue_foreach (&part->chunks, (GFunc) g_bytes_unref, NULL);
+  g_queue_clear (&part->chunks);
+  g_clear_error (&part->error);
+  g_slice_free (GisSplitImagePart, part);
+}
+
+/* Returns the length of @basename without its part number, or 0 if it is not
+ * a part of a split image.
+ */
+static gsize
+get_base_len (const gchar *basename)
+{
+  gsize len = strlen (basename);
+  g_autofree gchar *base = NULL;
+
+  if (len <= PART_SUFFIX_LEN ||
+      basename[len - 4] != '.' ||
+      !g_ascii_isdigit (basename[len - 3]) ||
+      !g_ascii_isdigit (basename[len - 2]) ||
+      !g_ascii_isdigit (basename[len - 1]))
+    return 0;
+
+  base = g_strndup (basename, len - PART_SUFFIX_LEN);
+  if (!g_str_has_suffix (base, ".img") &&
+      !g_str_has_suffix (base, ".img.xz") &&
+      !g_str_has_suffix (base, ".img.gz"))
+    return 0;
+
+  return len - PART_SUFFIX_LEN;
+}
+
+static GisSplitImageCodec
+get_codec (const gchar *base)
+{
+  if (g_str_has_suffix (base, ".xz"))
+    return GIS_SPLIT_IMAGE_CODEC_XZ;
+
+  if (g_str_has_suffix (base, ".gz"))
+    return GIS_SPLIT_IMAGE_CODEC_GZIP;
+
+  return GIS_SPLIT_IMAGE_CODEC_NONE;
+}
+
+/**
+ * gis_split_image_is_split:
+ * @file: an image file
+ *
+ * Returns: %TRUE if @file is one part of a split image, such as
+ *  eos-….img.xz.000
+ */
+gboolean
+gis_split_image_is_split (GFile *file)
+{
+  g_autofree gchar *basename = g_file_get_basename (file);
+
+  return basename != NULL && get_base_len (basename) > 0;
+}
+
+/**
+ * gis_split_image_get_manifest:
+ * @first_part: the first part of a split image
+ *
+ * Returns: (transfer full): the manifest listing the checksum of each part
+ *  of the image. Its detached signature, if any, has ".asc" appended.
+ */
+GFile *
+gis_split_image_get_manifest (GFile *first_part)
+{
+  g_autofree gchar *basename = g_file_get_basename (first_part);
+  g_autoptr(GFile) parent = g_file_get_parent (first_part);
+  gsize base_len;
+  g_autofree gchar *manifest_name = NULL;
+
+  g_return_val_if_fail (basename != NULL, NULL);
+  g_return_val_if_fail (parent != NULL, NULL);
+
+  base_len = get_base_len (basename);
+  g_return_val_if_fail (base_len > 0, NULL);
+
+  manifest_name = g_strdup_printf ("%.*s.sha256", (gint) base_len, basename);
+  return g_file_get_child (parent, manifest_name);
+}
+
+/* Loads the manifest for @first_part, and returns its parts, which must be
+ * listed in order.
+ */
+static GPtrArray *
+load_parts (GFile        *first_part,
+            GCancellable *cancellable,
+            GError      **error)
+{
+  g_autofree gchar *basename = g_file_get_basename (first_part);
+  g_autoptr(GFile) parent = g_file_get_parent (first_part);
+  g_autoptr(GFile) manifest = NULL;
+  g_autofree gchar *manifest_path = NULL;
+  g_autofree gchar *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  g_autoptr(GPtrArray) parts =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) gis_split_image_part_free);
+  gsize base_len;
+  guint i;
+
+  base_len = basename != NULL ? get_base_len (basename) : 0;
+  if (base_len == 0 || !g_str_has_suffix (basename, ".000") || parent == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "%s is not the first part of a split image", basename);
+      return NULL;
+    }
+
+  manifest = gis_split_image_get_manifest (first_part);
+  manifest_path = g_file_get_path (manifest);
+  if (!g_file_load_contents (manifest, cancellable, &contents, NULL, NULL,
+                             error))
+    return NULL;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      gchar *line = g_strstrip (lines[i]);
+      gchar *name;
+      const gchar *cur;
+      g_autofree gchar *name_base = NULL;
+      g_autofree gchar *expected = NULL;
+      GisSplitImagePart *part;
+
+      if (*line == '\0')
+        continue;
+
+      /* sha256sum output: the digest, then two spaces, or a space and an
+       * asterisk, then the name.
+       */
+      name = strchr (line, ' ');
+      if (name == NULL || name - line != CHECKSUM_STRLEN)
+        goto invalid;
+
+      *name++ = '\0';
+      if (*name == ' ' || *name == '*')
+        name++;
+
+      for (cur = line; *cur != '\0'; cur++)
+        if (!g_ascii_isxdigit (*cur))
+          goto invalid;
+
+      name_base = g_path_get_basename (name);
+      expected = g_strdup_printf ("%.*s.%03u", (gint) base_len, basename,
+                                  parts->len);
+      if (parts->len >= MAX_PARTS || g_strcmp0 (name_base, expected) != 0)
+        goto invalid;
+
+      part = g_slice_new0 (GisSplitImagePart);
+      part->file = g_file_get_child (parent, expected);
+      part->digest = g_ascii_strdown (line, -1);
+      g_queue_init (&part->chunks);
+      g_ptr_array_add (parts, part);
+
+      if (!g_file_query_exists (part->file, cancellable))
+        {
+          g_autofree gchar *part_path = g_file_get_path (part->file);
+
+          g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_FOUND,
+                       _("Image file ‘%s’ does not exist."), part_path);
+          return NULL;
+        }
+    }
+
+  if (parts->len == 0)
+    {
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   _("The checksum file ‘%s’ does not contain a checksum."),
+                   manifest_path);
+      return NULL;
+    }
+
+  return g_steal_pointer (&parts);
+
+invalid:
+  g_message ("invalid line %u in split image manifest %s", i + 1,
+             manifest_path);
+  g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+               _("The checksum file ‘%s’ does not list the parts of the image."),
+               manifest_path);
+  return NULL;
+}
+
+/**
+ * gis_split_image_list_parts:
+ * @first_part: the first part of a split image
+ *
+ * Returns: (transfer full) (element-type GFile): every part of the image, in
+ *  order, as listed in its manifest; or %NULL if the manifest is invalid or
+ *  a part is missing.
+ */
+GPtrArray *
+gis_split_image_list_parts (GFile        *first_part,
+                            GCancellable *cancellable,
+                            GError      **error)
+{
+  g_autoptr(GPtrArray) parts = NULL;
+  GPtrArray *files;
+  guint i;
+
+  g_return_val_if_fail (G_IS_FILE (first_part), NULL);
+
+  parts = load_parts (first_part, cancellable, error);
+  if (parts == NULL)
+    return NULL;
+
+  files = g_ptr_array_new_full (parts->len, g_object_unref);
+  for (i = 0; i < parts->len; i++)
+    {
+      GisSplitImagePart *part = g_ptr_array_index (parts, i);
+
+      g_ptr_array_add (files, g_object_ref (part->file));
+    }
+
+  return files;
+}
+
+static gboolean
+check_digest (GisSplitImagePart *part,
+              GChecksum         *sha256sum,
+              GError           **error)
+{
+  const gchar *digest = g_checksum_get_string (sha256sum);
+
+  if (g_strcmp0 (digest, part->digest) != 0)
+    {
+      g_autofree gchar *basename = g_file_get_basename (part->file);
+
+      g_message ("checksum of %s does not match manifest", basename);
+      g_set_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+                   _("Image checksum ‘%s‘ does not match expected checksum ‘%s‘."),
+                   digest, part->digest);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Decompresses one part, in a worker thread. */
+typedef struct {
+  GisSplitImageReader *reader;
+  GisSplitImagePart *part;
+
+  lzma_stream lzma;
+  z_stream zlib;
+  gboolean zlib_initialized;
+  /* Set at the end of each xz stream or gzip member; more may follow. */
+  gboolean stream_end;
+
+  guint8 *out;
+  gsize out_len;
+} Decoder;
+
+static void
+decoder_clear (Decoder *decoder)
+{
+  lzma_end (&decoder->lzma);
+  if (decoder->zlib_initialized)
+    inflateEnd (&decoder->zlib);
+  g_clear_pointer (&decoder->out, g_free);
+}
+
+static gboolean
+set_decompression_error (GisSplitImagePart *part,
+                         const gchar       *codec,
+                         gint               code,
+                         GError           **error)
+{
+  g_autofree gchar *basename = g_file_get_basename (part->file);
+
+  g_message ("%s decompression of %s failed: %d", codec, basename, code);
+  g_set_error_literal (error, GIS_INSTALL_ERROR,
+                       GIS_INSTALL_ERROR_DECOMPRESSION_FAILED,
+                       _("Could not decompress the image file."));
+  return FALSE;
+}
+
+static gboolean
+is_closing (GisSplitImageReader *self,
+            GError             **error)
+{
+  gboolean closing;
+
+  g_mutex_lock (&self->mutex);
+  closing = self->closing;
+  g_mutex_unlock (&self->mutex);
+
+  if (closing)
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                         "split image reader was closed");
+
+  return closing;
+}
+
+/* Hands @data out to the reader, waiting while this part has too much
+ * buffered already. Fails if the reader is being closed.
+ */
+static gboolean
+push_chunk (GisSplitImageReader *self,
+            GisSplitImagePart   *part,
+            GBytes              *data,
+            GError             **error)
+{
+  g_autoptr(GBytes) chunk = data;
+  gsize size = g_bytes_get_size (chunk);
+
+  if (size == 0)
+    return TRUE;
+
+  g_mutex_lock (&self->mutex);
+  while (part->buffered >= self->part_limit && !self->closing)
+    g_cond_wait (&self->cond, &self->mutex);
+
+  if (self->closing)
+    {
+      g_mutex_unlock (&self->mutex);
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                           "split image reader was closed");
+      return FALSE;
+    }
+
+  g_queue_push_tail (&part->chunks, g_steal_pointer (&chunk));
+  part->buffered += size;
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+
+  return TRUE;
+}
+
+static gboolean
+decoder_flush (Decoder *decoder,
+               GError **error)
+{
+  GBytes *chunk = g_bytes_new_take (g_steal_pointer (&decoder->out),
+                                    decoder->out_len);
+
+  decoder->out = g_malloc (BUFFER_SIZE);
+  decoder->out_len = 0;
+
+  return push_chunk (decoder->reader, decoder->part, chunk, error);
+}
+
+static gboolean
+decoder_feed_xz (Decoder      *decoder,
+                 const guint8 *in,
+                 gsize         len,
+                 gboolean      eof,
+                 GError      **error)
+{
+  lzma_stream *strm = &decoder->lzma;
+
+  strm->next_in = in;
+  strm->avail_in = len;
+
+  while (strm->avail_in > 0 || (eof && !decoder->stream_end))
+    {
+      lzma_ret r;
+
+      strm->next_out = decoder->out + decoder->out_len;
+      strm->avail_out = BUFFER_SIZE - decoder->out_len;
+      r = lzma_code (strm, eof ? LZMA_FINISH : LZMA_RUN);
+      decoder->out_len = BUFFER_SIZE - strm->avail_out;
+
+      if (decoder->out_len == BUFFER_SIZE && !decoder_flush (decoder, error))
+        return FALSE;
+
+      if (r == LZMA_STREAM_END)
+        {
+          decoder->stream_end = TRUE;
+          break;
+        }
+
+      if (r != LZMA_OK)
+        return set_decompression_error (decoder->part, "xz", r, error);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+decoder_feed_gzip (Decoder      *decoder,
+                   const guint8 *in,
+                   gsize         len,
+                   GError      **error)
+{
+  z_stream *strm = &decoder->zlib;
+
+  strm->next_in = (Bytef *) in;
+  strm->avail_in = len;
+
+  while (strm->avail_in > 0)
+    {
+      gint r;
+
+      /* gzip allows several members to be concatenated */
+      if (decoder->stream_end)
+        {
+          inflateReset (strm);
+          decoder->stream_end = FALSE;
+        }
+
+      strm->next_out = decoder->out + decoder->out_len;
+      strm->avail_out = BUFFER_SIZE - decoder->out_len;
+      r = inflate (strm, Z_NO_FLUSH);
+      decoder->out_len = BUFFER_SIZE - strm->avail_out;
+
+      if (decoder->out_len == BUFFER_SIZE && !decoder_flush (decoder, error))
+        return FALSE;
+
+      if (r == Z_STREAM_END)
+        decoder->stream_end = TRUE;
+      else if (r != Z_OK)
+        return set_decompression_error (decoder->part, "gzip", r, error);
+    }
+
+  return TRUE;
+}
+
+/* Feeds @len bytes of the compressed part to @decoder. @eof is %TRUE if they
+ * are the last.
+ */
+static gboolean
+decoder_feed (Decoder           *decoder,
+              GisSplitImageCodec codec,
+              const guint8      *in,
+              gsize              len,
+              gboolean           eof,
+              GError           **error)
+{
+  switch (codec)
+    {
+    case GIS_SPLIT_IMAGE_CODEC_NONE:
+      if (len > 0 &&
+          !push_chunk (decoder->reader, decoder->part, g_bytes_new (in, len),
+                       error))
+        return FALSE;
+
+      decoder->stream_end = TRUE;
+      break;
+
+    case GIS_SPLIT_IMAGE_CODEC_XZ:
+      if (!decoder_feed_xz (decoder, in, len, eof, error))
+        return FALSE;
+      break;
+
+    case GIS_SPLIT_IMAGE_CODEC_GZIP:
+      if (!decoder_feed_gzip (decoder, in, len, error))
+        return FALSE;
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  if (!eof)
+    return TRUE;
+
+  if (!decoder->stream_end)
+    return set_decompression_error (decoder->part, "truncated", 0, error);
+
+  return decoder_flush (decoder, error);
+}
+
+/* Reads, checks and decompresses @part, handing the decompressed data out
+ * to the reader as it goes.
+ */
+static gboolean
+gis_split_image_reader_decode_part (GisSplitImageReader *self,
+                                    GisSplitImagePart   *part,
+                                    GError             **error)
+{
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GChecksum) sha256sum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree guint8 *buf = g_malloc (BUFFER_SIZE);
+  Decoder decoder = { self, part, LZMA_STREAM_INIT, };
+  g_autoptr(GError) decode_error = NULL;
+  gboolean eof = FALSE;
+  gboolean ret = FALSE;
+  lzma_ret lr;
+  gint zr;
+
+  decoder.out = g_malloc (BUFFER_SIZE);
+
+  switch (self->codec)
+    {
+    case GIS_SPLIT_IMAGE_CODEC_NONE:
+      break;
+
+    case GIS_SPLIT_IMAGE_CODEC_XZ:
+      lr = lzma_stream_decoder (&decoder.lzma, G_MAXUINT64,
+                                LZMA_CONCATENATED);
+      if (lr != LZMA_OK)
+        {
+          set_decompression_error (part, "xz", lr, error);
+          goto out;
+        }
+      break;
+
+    case GIS_SPLIT_IMAGE_CODEC_GZIP:
+      /* 15 bits of window, plus 16 to expect a gzip header */
+      zr = inflateInit2 (&decoder.zlib, 15 + 16);
+      if (zr != Z_OK)
+        {
+          set_decompression_error (part, "gzip", zr, error);
+          goto out;
+        }
+      decoder.zlib_initialized = TRUE;
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  input = gis_image_reader_open (part->file, NULL, error);
+  if (input == NULL)
+    goto out;
+
+  while (!eof)
+    {
+      gsize len = 0;
+
+      if (is_closing (self, error) ||
+          !g_input_stream_read_all (input, buf, BUFFER_SIZE, &len, NULL,
+                                    error))
+        goto out;
+
+      eof = len < BUFFER_SIZE;
+      g_checksum_update (sha256sum, buf, len);
+
+      /* If the data is corrupt, carry on reading it: the checksum will
+       * say so more usefully than the decompressor.
+       */
+      if (decode_error == NULL)
+        decoder_feed (&decoder, self->codec, buf, len, eof, &decode_error);
+
+      if (g_error_matches (decode_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_propagate_error (error, g_steal_pointer (&decode_error));
+          goto out;
+        }
+    }
+
+  if (!check_digest (part, sha256sum, error))
+    goto out;
+
+  if (decode_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&decode_error));
+      goto out;
+    }
+
+  ret = TRUE;
+
+out:
+  decoder_clear (&decoder);
+  return ret;
+}
+
+static void
+gis_split_image_reader_worker (gpointer data,
+                               gpointer user_data)
+{
+  GisSplitImagePart *part = data;
+  GisSplitImageReader *self = GIS_SPLIT_IMAGE_READER (user_data);
+  GError *error = NULL;
+
+  gis_split_image_reader_decode_part (self, part, &error);
+
+  g_mutex_lock (&self->mutex);
+  part->error = error;
+  part->done = TRUE;
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+}
+
+/* Submits parts to the worker pool until each worker has one. Since there are
+ * never more parts in flight than workers, the part being read is always
+ * being worked on. Called with the mutex held.
+ */
+static void
+gis_split_image_reader_submit_parts (GisSplitImageReader *self)
+{
+  while (self->next_part < self->parts->len &&
+         self->next_part < self->reading + self->n_workers)
+    g_thread_pool_push (self->pool,
+                        g_ptr_array_index (self->parts, self->next_part++),
+                        NULL);
+}
+
+static gssize
+gis_split_image_reader_read (GInputStream  *stream,
+                             void          *buffer,
+                             gsize          count,
+                             GCancellable  *cancellable,
+                             GError       **error)
+{
+  GisSplitImageReader *self = GIS_SPLIT_IMAGE_READER (stream);
+  gsize n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  if (self->current == NULL)
+    {
+      g_mutex_lock (&self->mutex);
+      while (self->current == NULL)
+        {
+          GisSplitImagePart *part;
+
+          if (self->reading >= self->parts->len)
+            {
+              g_mutex_unlock (&self->mutex);
+              return 0;
+            }
+
+          part = g_ptr_array_index (self->parts, self->reading);
+          while (g_queue_is_empty (&part->chunks) && !part->done)
+            g_cond_wait (&self->cond, &self->mutex);
+
+          if (!g_queue_is_empty (&part->chunks))
+            {
+              self->current = g_queue_pop_head (&part->chunks);
+              self->current_offset = 0;
+              part->buffered -= g_bytes_get_size (self->current);
+              /* Let the worker carry on, if it was waiting. */
+              g_cond_broadcast (&self->cond);
+            }
+          else if (part->error != NULL)
+            {
+              /* Keep failing, rather than skipping to the next part. */
+              g_propagate_error (error, g_error_copy (part->error));
+              g_mutex_unlock (&self->mutex);
+              return -1;
+            }
+          else
+            {
+              self->reading++;
+              gis_split_image_reader_submit_parts (self);
+            }
+        }
+      g_mutex_unlock (&self->mutex);
+    }
+
+  n = MIN (count, g_bytes_get_size (self->current) - self->current_offset);
+  memcpy (buffer,
+          (const guint8 *) g_bytes_get_data (self->current, NULL)
+          + self->current_offset,
+          n);
+  self->current_offset += n;
+
+  if (self->current_offset == g_bytes_get_size (self->current))
+    g_clear_pointer (&self->current, g_bytes_unref);
+
+  return n;
+}
+
+/* Stops the workers, and frees any data they had decompressed. */
+static void
+gis_split_image_reader_stop (GisSplitImageReader *self)
+{
+  if (self->pool != NULL)
+    {
+      g_mutex_lock (&self->mutex);
+      self->closing = TRUE;
+      g_cond_broadcast (&self->cond);
+      g_mutex_unlock (&self->mutex);
+
+      /* Parts which haven't been started are dropped. */
+      g_thread_pool_free (g_steal_pointer (&self->pool), TRUE, TRUE);
+    }
+
+  g_clear_pointer (&self->parts, g_ptr_array_unref);
+  g_clear_pointer (&self->current, g_bytes_unref);
+}
+
+static gboolean
+gis_split_image_reader_close (GInputStream  *stream,
+                              GCancellable  *cancellable,
+                              GError       **error)
+{
+  gis_split_image_reader_stop (GIS_SPLIT_IMAGE_READER (stream));
+
+  return TRUE;
+}
+
+static void
+gis_split_image_reader_init (GisSplitImageReader *self)
+{
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->cond);
+}
+
+static void
+gis_split_image_reader_finalize (GObject *object)
+{
+  GisSplitImageReader *self = GIS_SPLIT_IMAGE_READER (object);
+
+  /* GInputStream closes the stream on dispose, if it has not been closed
+   * already, so this is just belt and braces.
+   */
+  gis_split_image_reader_stop (self);
+
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->cond);
+
+  G_OBJECT_CLASS (gis_split_image_reader_parent_class)->finalize (object);
+}
+
+static void
+gis_split_image_reader_class_init (GisSplitImageReaderClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *istream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = gis_split_image_reader_finalize;
+
+  istream_class->read_fn = gis_split_image_reader_read;
+  /* Allow parent class to emulate skip; the scribe never skips. */
+  istream_class->close_fn = gis_split_image_reader_close;
+}
+
+/**
+ * gis_split_image_reader_open:
+ * @first_part: the first part of a split image
+ *
+ * Opens the split image whose first part is @first_part for reading. Its
+ * parts are checked against the manifest and decompressed on a pool of worker
+ * threads, ahead of the current position. If a part does not match the
+ * manifest, reading fails with %GIS_IMAGE_ERROR_VERIFICATION_FAILED once its
+ * decompressed data has been read.
+ *
+ * The manifest is not checked against its signature.
+ *
+ * Returns: (transfer full): a stream reading the decompressed image, or
+ *  %NULL on error.
+ */
+GInputStream *
+gis_split_image_reader_open (GFile        *first_part,
+                             GCancellable *cancellable,
+                             GError      **error)
+{
+  g_autofree gchar *basename = NULL;
+  g_autoptr(GisSplitImageReader) self = NULL;
+  guint64 budget = MAX_BUFFERED;
+  glong pages = sysconf (_SC_PHYS_PAGES);
+  glong page_size = sysconf (_SC_PAGE_SIZE);
+
+  g_return_val_if_fail (G_IS_FILE (first_part), NULL);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return NULL;
+
+  self = g_object_new (GIS_TYPE_SPLIT_IMAGE_READER, NULL);
+  self->parts = load_parts (first_part, cancellable, error);
+  if (self->parts == NULL)
+    return NULL;
+
+  basename = g_file_get_basename (first_part);
+  basename[get_base_len (basename)] = '\0';
+  self->codec = get_codec (basename);
+
+  /* Leave most of the memory for the page cache and the rest of the system. */
+  if (pages > 0 && page_size > 0)
+    budget = MIN (budget, (guint64) pages * page_size / 4);
+
+  self->n_workers = CLAMP (g_get_num_processors (), 1, self->parts->len);
+  self->part_limit = MAX (budget / self->n_workers, 2 * BUFFER_SIZE);
+  self->pool = g_thread_pool_new (gis_split_image_reader_worker, self,
+                                  self->n_workers, FALSE, error);
+  if (self->pool == NULL)
+    return NULL;
+
+  g_mutex_lock (&self->mutex);
+  gis_split_image_reader_submit_parts (self);
+  g_mutex_unlock (&self->mutex);
+
+  g_message ("reading split image %s: %u parts, with %u workers", basename,
+             self->parts->len, self->n_workers);
+
+  return G_INPUT_STREAM (g_steal_pointer (&self));
+}
+
+/**
+ * gis_split_image_verify_parts:
+ * @first_part: the first part of a split image
+ *
+ * Checks every part of the split image whose first part is @first_part
+ * against its manifest, without decompressing them. The manifest is not
+ * checked against its signature.
+ *
+ * If a part does not match, fails with %GIS_IMAGE_ERROR_VERIFICATION_FAILED.
+ */
+gboolean
+gis_split_image_verify_parts (GFile        *first_part,
+                              GCancellable *cancellable,
+                              GError      **error)
+{
+  g_autoptr(GPtrArray) parts = NULL;
+  g_autofree guint8 *buf = NULL;
+  guint i;
+
+  g_return_val_if_fail (G_IS_FILE (first_part), FALSE);
+
+  parts = load_parts (first_part, cancellable, error);
+  if (parts == NULL)
+    return FALSE;
+
+  buf = g_malloc (BUFFER_SIZE);
+  for (i = 0; i < parts->len; i++)
+    {
+      GisSplitImagePart *part = g_ptr_array_index (parts, i);
+      g_autoptr(GInputStream) input = NULL;
+      g_autoptr(GChecksum) sha256sum = g_checksum_new (G_CHECKSUM_SHA256);
+      gsize len = 0;
+
+      input = gis_image_reader_open (part->file, cancellable, error);
+      if (input == NULL)
+        return FALSE;
+
+      do
+        {
+          if (!g_input_stream_read_all (input, buf, BUFFER_SIZE, &len,
+                                        cancellable, error))
+            return FALSE;
+
+          g_checksum_update (sha256sum, buf, len);
+        }
+      while (len > 0);
+
+      if (!check_digest (part, sha256sum, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
@@ -0,0 +1,47 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_SPLIT_IMAGE_H
+#define GIS_SPLIT_IMAGE_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define GIS_TYPE_SPLIT_IMAGE_READER (gis_split_image_reader_get_type ())
+G_DECLARE_FINAL_TYPE (GisSplitImageReader, gis_split_image_reader, GIS, SPLIT_IMAGE_READER, GInputStream);
+
+gboolean gis_split_image_is_split (GFile *file);
+
+GFile *gis_split_image_get_manifest (GFile *first_part);
+
+GPtrArray *gis_split_image_list_parts (GFile        *first_part,
+                                       GCancellable *cancellable,
+                                       GError      **error);
+
+GInputStream *gis_split_image_reader_open (GFile        *first_part,
+                                           GCancellable *cancellable,
+                                           GError      **error);
+
+gboolean gis_split_image_verify_parts (GFile        *first_part,
+                                       GCancellable *cancellable,
+                                       GError      **error);
+
+G_END_DECLS
+
+#endif /* GIS_SPLIT_IMAGE_H */
@@ -0,0 +1,1009 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* An input stream which reads one file from a squashfs image, without
+ * mounting it. Live USBs hold the uncompressed OS image as endless.img within
+ * endless.squash; normally the initramfs mounts this and we read it from
+ * /dev/disk/endless-image, but that is not always available.
+ *
+ * Reading through a mount would have the kernel decompress one block at a
+ * time, on the reading thread. Instead, this reads and decompresses a window
+ * of the file's data blocks ahead of the current position in parallel, on a
+ * pool of worker threads, and hands them out in order.
+ *
+ * Only squashfs 4.0 with gzip or xz compression is supported, which is what
+ * Endless OS live images use.
+ */
+#include "config.h"
+#include "gis-squashfs-reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <lzma.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "glnx-errors.h"
+#include "glnx-local-alloc.h"
+
+#define SQUASHFS_MAGIC 0x73717368
+#define SQUASHFS_SUPERBLOCK_SIZE 96
+#define SQUASHFS_METADATA_SIZE 8192
+#define SQUASHFS_METADATA_UNCOMPRESSED 0x8000
+#define SQUASHFS_DATA_UNCOMPRESSED (1 << 24)
+#define SQUASHFS_DATA_SIZE_MASK (SQUASHFS_DATA_UNCOMPRESSED - 1)
+#define SQUASHFS_NO_FRAGMENT 0xFFFFFFFF
+#define SQUASHFS_FRAGMENT_ENTRY_SIZE 16
+#define SQUASHFS_MIN_BLOCK_SIZE (4 * 1024)
+#define SQUASHFS_MAX_BLOCK_SIZE (1024 * 1024)
+
+typedef enum {
+  SQUASHFS_COMPRESSION_GZIP = 1,
+  SQUASHFS_COMPRESSION_XZ = 4,
+} SquashfsCompression;
+
+typedef enum {
+  SQUASHFS_BASIC_DIRECTORY = 1,
+  SQUASHFS_BASIC_FILE = 2,
+  SQUASHFS_EXTENDED_DIRECTORY = 8,
+  SQUASHFS_EXTENDED_FILE = 9,
+} SquashfsInodeType;
+
+/* Number of decompressed blocks to keep in flight, per worker thread */
+#define BLOCKS_PER_WORKER 2
+
+/* One data block of the file (or the part of a fragment block holding its
+ * tail), which is read and decompressed by a worker thread.
+ */
+typedef struct {
+  /* Location on disk, and the size field from the squashfs. If size is 0,
+   * the block is sparse.
+   */
+  guint64 start;
+  guint32 size;
+
+  /* The range within the decompressed block which belongs to the file */
+  gsize slice_offset;
+  gsize slice_len;
+
+  /* Protected by GisSquashfsReader.mutex */
+  gboolean done;
+  guint8 *data;
+  GError *error;
+} GisSquashfsBlock;
+
+typedef struct _GisSquashfsReader {
+  GInputStream parent;
+
+  gint fd;
+  guint16 compression;
+  guint32 block_size;
+
+  guint64 file_size;
+  guint64 blocks_start;
+  /* (element-type guint32): size fields of the file's data blocks */
+  GArray *block_sizes;
+  /* Location of the file's tail, if it is in a fragment */
+  guint32 fragment_index;
+  guint32 fragment_offset;
+  guint64 fragment_start;
+  guint32 fragment_size;
+
+  GThreadPool *pool;
+  guint max_in_flight;
+
+  GMutex mutex;
+  GCond cond;
+  /* (element-type GisSquashfsBlock): submitted to the pool, in order */
+  GQueue in_flight;
+  /* Index of the next block to submit, counting the tail as the last block,
+   * and its location if it is a data block.
+   */
+  guint next_block;
+  guint64 next_block_start;
+  guint n_blocks;
+
+  /* The block being copied out, and how much of it has been copied */
+  GisSquashfsBlock *current;
+  gsize current_offset;
+} GisSquashfsReader;
+
+G_DEFINE_TYPE (GisSquashfsReader, gis_squashfs_reader, G_TYPE_INPUT_STREAM)
+
+static void
+gis_squashfs_block_free (GisSquashfsBlock *block)
+{
+  g_free (block->data);
+  g_clear_error (&block->error);
+  g_slice_free (GisSquashfsBlock, block);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisSquashfsBlock, gis_squashfs_block_free)
+
+static guint16
+read_le16 (const guint8 *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static guint32
+read_le32 (const guint8 *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+static guint64
+read_le64 (const guint8 *p)
+{
+  return read_le32 (p) | ((guint64) read_le32 (p + 4) << 32);
+}
+
+static gboolean
+pread_all (gint      fd,
+           gpointer  buf,
+           gsize     len,
+           guint64   offset,
+           GError  **error)
+{
+  gsize done = 0;
+
+  while (done < len)
+    {
+      gssize r = pread (fd, (guint8 *) buf + done, len - done, offset + done);
+
+      if (r < 0 && errno == EINTR)
+        continue;
+
+      if (r < 0)
+        return glnx_throw_errno_prefix (error, "can't read squashfs at %"
+                                        G_GUINT64_FORMAT, offset + done);
+
+      if (r == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "squashfs is truncated at %" G_GUINT64_FORMAT,
+                       offset + done);
+          return FALSE;
+        }
+
+      done += r;
+    }
+
+  return TRUE;
+}
+
+/* Decompresses @in into @out, which has room for @out_size bytes, and sets
+ * @out_len to the decompressed size. Called from worker threads.
+ */
+static gboolean
+decompress (guint16        compression,
+            const guint8  *in,
+            gsize          in_len,
+            guint8        *out,
+            gsize          out_size,
+            gsize         *out_len,
+            GError       **error)
+{
+  switch ((SquashfsCompression) compression)
+    {
+    case SQUASHFS_COMPRESSION_GZIP:
+      {
+        uLongf dest_len = out_size;
+        gint r = uncompress (out, &dest_len, in, in_len);
+
+        if (r != Z_OK)
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                         "zlib decompression failed: %d", r);
+            return FALSE;
+          }
+
+        *out_len = dest_len;
+        return TRUE;
+      }
+
+    case SQUASHFS_COMPRESSION_XZ:
+      {
+        guint64 memlimit = G_MAXUINT64;
+        gsize in_pos = 0;
+        gsize out_pos = 0;
+        lzma_ret r = lzma_stream_buffer_decode (&memlimit, 0, NULL,
+                                                in, &in_pos, in_len,
+                                                out, &out_pos, out_size);
+
+        if (r != LZMA_OK)
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                         "xz decompression failed: %d", r);
+            return FALSE;
+          }
+
+        *out_len = out_pos;
+        return TRUE;
+      }
+
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "squashfs compression %u is not supported", compression);
+      return FALSE;
+    }
+}
+
+/* Reads and decompresses @block. Returns the decompressed block, of up to
+ * block_size bytes, or %NULL on error.
+ */
+static guint8 *
+gis_squashfs_reader_read_block (GisSquashfsReader *self,
+                                GisSquashfsBlock  *block,
+                                GError           **error)
+{
+  guint32 disk_size = block->size & SQUASHFS_DATA_SIZE_MASK;
+  g_autofree guint8 *data = g_malloc (self->block_size);
+  g_autofree guint8 *compressed = NULL;
+  gsize len;
+
+  if (block->size == 0)
+    {
+      memset (data, 0, self->block_size);
+      return g_steal_pointer (&data);
+    }
+
+  if (disk_size > self->block_size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "squashfs block at %" G_GUINT64_FORMAT " is %u bytes",
+                   block->start, disk_size);
+      return NULL;
+    }
+
+  if (block->size & SQUASHFS_DATA_UNCOMPRESSED)
+    {
+      if (!pread_all (self->fd, data, disk_size, block->start, error))
+        return NULL;
+
+      len = disk_size;
+    }
+  else
+    {
+      compressed = g_malloc (disk_size);
+      if (!pread_all (self->fd, compressed, disk_size, block->start, error) ||
+          !decompress (self->compression, compressed, disk_size,
+                       data, self->block_size, &len, error))
+        return NULL;
+    }
+
+  if (len < block->slice_offset + block->slice_len)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "squashfs block at %" G_GUINT64_FORMAT " is too short",
+                   block->start);
+      return NULL;
+    }
+
+  return g_steal_pointer (&data);
+}
+
+static void
+gis_squashfs_reader_worker (gpointer data,
+                            gpointer user_data)
+{
+  GisSquashfsBlock *block = data;
+  GisSquashfsReader *self = GIS_SQUASHFS_READER (user_data);
+  GError *error = NULL;
+  guint8 *block_data = gis_squashfs_reader_read_block (self, block, &error);
+
+  g_mutex_lock (&self->mutex);
+  block->data = block_data;
+  block->error = error;
+  block->done = TRUE;
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+}
+
+/* Submits blocks to the worker pool until the window is full. Called with
+ * the mutex held.
+ */
+static void
+gis_squashfs_reader_submit_blocks (GisSquashfsReader *self)
+{
+  guint n_data_blocks = self->block_sizes->len;
+
+  while (self->in_flight.length < self->max_in_flight &&
+         self->next_block < self->n_blocks)
+    {
+      GisSquashfsBlock *block = g_slice_new0 (GisSquashfsBlock);
+      guint i = self->next_block++;
+
+      if (i < n_data_blocks)
+        {
+          block->start = self->next_block_start;
+          block->size = g_array_index (self->block_sizes, guint32, i);
+          /* Data blocks are stored back to back. */
+          self->next_block_start += block->size & SQUASHFS_DATA_SIZE_MASK;
+          block->slice_offset = 0;
+          block->slice_len = MIN (self->block_size,
+                                  self->file_size - (guint64) i * self->block_size);
+        }
+      else
+        {
+          block->start = self->fragment_start;
+          block->size = self->fragment_size;
+          block->slice_offset = self->fragment_offset;
+          block->slice_len = self->file_size % self->block_size;
+        }
+
+      g_queue_push_tail (&self->in_flight, block);
+      g_thread_pool_push (self->pool, block, NULL);
+    }
+}
+
+static gssize
+gis_squashfs_reader_read (GInputStream  *stream,
+                          void          *buffer,
+                          gsize          count,
+                          GCancellable  *cancellable,
+                          GError       **error)
+{
+  GisSquashfsReader *self = GIS_SQUASHFS_READER (stream);
+  gsize n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  if (self->current == NULL)
+    {
+      GisSquashfsBlock *head;
+
+      g_mutex_lock (&self->mutex);
+      gis_squashfs_reader_submit_blocks (self);
+
+      head = g_queue_peek_head (&self->in_flight);
+      if (head == NULL)
+        {
+          g_mutex_unlock (&self->mutex);
+          return 0;
+        }
+
+      while (!head->done)
+        g_cond_wait (&self->cond, &self->mutex);
+
+      self->current = g_queue_pop_head (&self->in_flight);
+      self->current_offset = 0;
+      /* Keep the workers busy while this block is copied out. */
+      gis_squashfs_reader_submit_blocks (self);
+      g_mutex_unlock (&self->mutex);
+
+      if (self->current->error != NULL)
+        {
+          g_propagate_error (error, g_steal_pointer (&self->current->error));
+          g_clear_pointer (&self->current, gis_squashfs_block_free);
+          return -1;
+        }
+    }
+
+  n = MIN (count, self->current->slice_len - self->current_offset);
+  memcpy (buffer,
+          self->current->data + self->current->slice_offset + self->current_offset,
+          n);
+  self->current_offset += n;
+
+  if (self->current_offset == self->current->slice_len)
+    g_clear_pointer (&self->current, gis_squashfs_block_free);
+
+  return n;
+}
+
+/* Stops the workers, and frees any blocks they were working on. */
+static void
+gis_squashfs_reader_stop (GisSquashfsReader *self)
+{
+  if (self->pool != NULL)
+    {
+      /* Blocks which haven't been started are dropped. */
+      g_thread_pool_free (g_steal_pointer (&self->pool), TRUE, TRUE);
+    }
+
+  g_queue_foreach (&self->in_flight, (GFunc) gis_squashfs_block_free, NULL);
+  g_queue_clear (&self->in_flight);
+  g_clear_pointer (&self->current, gis_squashfs_block_free);
+}
+
+static gboolean
+gis_squashfs_reader_close (GInputStream  *stream,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+  GisSquashfsReader *self = GIS_SQUASHFS_READER (stream);
+  gint fd = self->fd;
+
+  gis_squashfs_reader_stop (self);
+
+  self->fd = -1;
+  if (fd != -1 && close (fd) < 0)
+    return glnx_throw_errno_prefix (error, "error closing squashfs");
+
+  return TRUE;
+}
+
+static void
+gis_squashfs_reader_init (GisSquashfsReader *self)
+{
+  self->fd = -1;
+  self->fragment_index = SQUASHFS_NO_FRAGMENT;
+  self->block_sizes = g_array_new (FALSE, FALSE, sizeof (guint32));
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->cond);
+  g_queue_init (&self->in_flight);
+}
+
+static void
+gis_squashfs_reader_finalize (GObject *object)
+{
+  GisSquashfsReader *self = GIS_SQUASHFS_READER (object);
+
+  /* GInputStream closes the stream on dispose, if it has not been closed
+   * already, so this is just belt and braces.
+   */
+  gis_squashfs_reader_stop (self);
+
+  if (self->fd != -1)
+    close (self->fd);
+  self->fd = -1;
+
+  g_clear_pointer (&self->block_sizes, g_array_unref);
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->cond);
+
+  G_OBJECT_CLASS (gis_squashfs_reader_parent_class)->finalize (object);
+}
+
+static void
+gis_squashfs_reader_class_init (GisSquashfsReaderClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *istream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = gis_squashfs_reader_finalize;
+
+  istream_class->read_fn = gis_squashfs_reader_read;
+  /* Allow parent class to emulate skip; the scribe never skips. */
+  istream_class->close_fn = gis_squashfs_reader_close;
+}
+
+/* Reads through the metadata (inode, directory and lookup) tables, which are
+ * stored as a series of blocks of up to 8 KiB, each compressed separately.
+ */
+typedef struct {
+  GisSquashfsReader *reader;
+  /* On-disk location of the next block */
+  guint64 next;
+  guint8 data[SQUASHFS_METADATA_SIZE];
+  gsize len;
+  gsize pos;
+} MetadataCursor;
+
+static gboolean
+metadata_cursor_next_block (MetadataCursor *cursor,
+                            GError        **error)
+{
+  guint8 header[2];
+  guint8 compressed[SQUASHFS_METADATA_SIZE];
+  guint16 size;
+
+  if (!pread_all (cursor->reader->fd, header, sizeof header, cursor->next,
+                  error))
+    return FALSE;
+
+  size = read_le16 (header) & ~SQUASHFS_METADATA_UNCOMPRESSED;
+  if (size == 0 || size > SQUASHFS_METADATA_SIZE)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "invalid squashfs metadata block at %" G_GUINT64_FORMAT,
+                   cursor->next);
+      return FALSE;
+    }
+
+  if (read_le16 (header) & SQUASHFS_METADATA_UNCOMPRESSED)
+    {
+      if (!pread_all (cursor->reader->fd, cursor->data, size,
+                      cursor->next + sizeof header, error))
+        return FALSE;
+
+      cursor->len = size;
+    }
+  else
+    {
+      if (!pread_all (cursor->reader->fd, compressed, size,
+                      cursor->next + sizeof header, error) ||
+          !decompress (cursor->reader->compression, compressed, size,
+                       cursor->data, sizeof cursor->data, &cursor->len, error))
+        return FALSE;
+    }
+
+  cursor->next += sizeof header + size;
+  cursor->pos = 0;
+  return TRUE;
+}
+
+static gboolean
+metadata_cursor_init (MetadataCursor    *cursor,
+                      GisSquashfsReader *reader,
+                      guint64            block,
+                      gsize              offset,
+                      GError           **error)
+{
+  cursor->reader = reader;
+  cursor->next = block;
+
+  if (!metadata_cursor_next_block (cursor, error))
+    return FALSE;
+
+  if (offset > cursor->len)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "offset %" G_GSIZE_FORMAT " is beyond squashfs metadata "
+                   "block at %" G_GUINT64_FORMAT, offset, block);
+      return FALSE;
+    }
+
+  cursor->pos = offset;
+  return TRUE;
+}
+
+static gboolean
+metadata_cursor_read (MetadataCursor *cursor,
+                      gpointer        dest,
+                      gsize           len,
+                      GError        **error)
+{
+  guint8 *out = dest;
+
+  while (len > 0)
+    {
+      gsize n;
+
+      if (cursor->pos == cursor->len &&
+          !metadata_cursor_next_block (cursor, error))
+        return FALSE;
+
+      n = MIN (len, cursor->len - cursor->pos);
+      memcpy (out, cursor->data + cursor->pos, n);
+      cursor->pos += n;
+      out += n;
+      len -= n;
+    }
+
+  return TRUE;
+}
+
+/* An inode reference holds the location of the inode's metadata block,
+ * relative to the start of the inode table, and its offset within the
+ * block.
+ */
+static gboolean
+gis_squashfs_reader_open_inode (GisSquashfsReader *self,
+                                guint64            inode_table_start,
+                                guint64            ref,
+                                MetadataCursor    *cursor,
+                                guint16           *type,
+                                GError           **error)
+{
+  guint8 header[16];
+
+  if (!metadata_cursor_init (cursor, self, inode_table_start + (ref >> 16),
+                             ref & 0xFFFF, error) ||
+      !metadata_cursor_read (cursor, header, sizeof header, error))
+    return FALSE;
+
+  *type = read_le16 (header);
+  return TRUE;
+}
+
+/* Looks up @name in the directory whose inode @cursor is positioned after the
+ * header of, and sets @ref to its inode reference.
+ */
+static gboolean
+gis_squashfs_reader_lookup (GisSquashfsReader *self,
+                            guint64            directory_table_start,
+                            MetadataCursor    *cursor,
+                            guint16            type,
+                            const gchar       *name,
+                            guint64           *ref,
+                            GError           **error)
+{
+  guint8 buf[24];
+  guint32 block_index;
+  guint16 block_offset;
+  guint32 size;
+  MetadataCursor dir;
+
+  if (type == SQUASHFS_BASIC_DIRECTORY)
+    {
+      if (!metadata_cursor_read (cursor, buf, 16, error))
+        return FALSE;
+
+      block_index = read_le32 (buf);
+      size = read_le16 (buf + 8);
+      block_offset = read_le16 (buf + 10);
+    }
+  else if (type == SQUASHFS_EXTENDED_DIRECTORY)
+    {
+      if (!metadata_cursor_read (cursor, buf, 24, error))
+        return FALSE;
+
+      size = read_le32 (buf + 4);
+      block_index = read_le32 (buf + 8);
+      block_offset = read_le16 (buf + 18);
+    }
+  else
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY,
+                   "parent of ‘%s’ is not a directory", name);
+      return FALSE;
+    }
+
+  /* The size includes 3 bytes for the implicit "." and ".." entries. */
+  if (size < 3)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "squashfs directory has invalid size %u", size);
+      return FALSE;
+    }
+  size -= 3;
+
+  if (size > 0 &&
+      !metadata_cursor_init (&dir, self, directory_table_start + block_index,
+                             block_offset, error))
+    return FALSE;
+
+  while (size > 0)
+    {
+      guint32 count, start;
+
+      if (size < 12 || !metadata_cursor_read (&dir, buf, 12, error))
+        goto invalid;
+
+      count = read_le32 (buf) + 1;
+      start = read_le32 (buf + 4);
+      size -= 12;
+
+      for (; count > 0; count--)
+        {
+          gchar entry_name[257];
+          guint16 offset, name_size;
+
+          if (size < 8 || !metadata_cursor_read (&dir, buf, 8, error))
+            goto invalid;
+
+          offset = read_le16 (buf);
+          name_size = read_le16 (buf + 6) + 1;
+          size -= 8;
+
+          if (name_size > 256 || size < name_size ||
+              !metadata_cursor_read (&dir, entry_name, name_size, error))
+            goto invalid;
+
+          entry_name[name_size] = '\0';
+          size -= name_size;
+
+          if (g_str_equal (entry_name, name))
+            {
+              *ref = ((guint64) start << 16) | offset;
+              return TRUE;
+            }
+        }
+    }
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+               "‘%s’ not found in squashfs", name);
+  return FALSE;
+
+invalid:
+  if (error != NULL && *error == NULL)
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                         "invalid squashfs directory");
+  return FALSE;
+}
+
+static gboolean
+gis_squashfs_reader_load_file (GisSquashfsReader *self,
+                               MetadataCursor    *cursor,
+                               guint16            type,
+                               const gchar       *path,
+                               GError           **error)
+{
+  guint8 buf[40];
+  guint64 n_blocks;
+  guint i;
+
+  if (type == SQUASHFS_BASIC_FILE)
+    {
+      if (!metadata_cursor_read (cursor, buf, 16, error))
+        return FALSE;
+
+      self->blocks_start = read_le32 (buf);
+      self->fragment_index = read_le32 (buf + 4);
+      self->fragment_offset = read_le32 (buf + 8);
+      self->file_size = read_le32 (buf + 12);
+    }
+  else if (type == SQUASHFS_EXTENDED_FILE)
+    {
+      if (!metadata_cursor_read (cursor, buf, 40, error))
+        return FALSE;
+
+      self->blocks_start = read_le64 (buf);
+      self->file_size = read_le64 (buf + 8);
+      self->fragment_index = read_le32 (buf + 28);
+      self->fragment_offset = read_le32 (buf + 32);
+    }
+  else
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_REGULAR_FILE,
+                   "‘%s’ is not a regular file", path);
+      return FALSE;
+    }
+
+  /* Unless the tail is in a fragment, the last block may be partial. */
+  n_blocks = self->file_size / self->block_size;
+  if (self->fragment_index == SQUASHFS_NO_FRAGMENT &&
+      self->file_size % self->block_size != 0)
+    n_blocks++;
+
+  if (n_blocks >= G_MAXUINT)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "‘%s’ has too many blocks", path);
+      return FALSE;
+    }
+
+  g_array_set_size (self->block_sizes, n_blocks);
+  if (!metadata_cursor_read (cursor, self->block_sizes->data,
+                             n_blocks * sizeof (guint32), error))
+    return FALSE;
+
+  for (i = 0; i < n_blocks; i++)
+    g_array_index (self->block_sizes, guint32, i) =
+      GUINT32_FROM_LE (g_array_index (self->block_sizes, guint32, i));
+
+  self->n_blocks = n_blocks;
+  self->next_block_start = self->blocks_start;
+  return TRUE;
+}
+
+/* The fragment table is a list of pointers to metadata blocks holding the
+ * fragment entries.
+ */
+static gboolean
+gis_squashfs_reader_load_fragment (GisSquashfsReader *self,
+                                   guint64            fragment_table_start,
+                                   guint32            fragment_count,
+                                   GError           **error)
+{
+  const guint entries_per_block =
+    SQUASHFS_METADATA_SIZE / SQUASHFS_FRAGMENT_ENTRY_SIZE;
+  guint8 buf[SQUASHFS_FRAGMENT_ENTRY_SIZE];
+  MetadataCursor cursor;
+
+  if (self->fragment_index >= fragment_count)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "invalid squashfs fragment %u", self->fragment_index);
+      return FALSE;
+    }
+
+  if (!pread_all (self->fd, buf, 8,
+                  fragment_table_start
+                  + (self->fragment_index / entries_per_block) * 8,
+                  error) ||
+      !metadata_cursor_init (&cursor, self, read_le64 (buf),
+                             (self->fragment_index % entries_per_block)
+                             * SQUASHFS_FRAGMENT_ENTRY_SIZE,
+                             error) ||
+      !metadata_cursor_read (&cursor, buf, sizeof buf, error))
+    return FALSE;
+
+  self->fragment_start = read_le64 (buf);
+  self->fragment_size = read_le32 (buf + 8);
+
+  if (self->fragment_offset + self->file_size % self->block_size >
+      self->block_size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "invalid squashfs fragment offset %u",
+                   self->fragment_offset);
+      return FALSE;
+    }
+
+  self->n_blocks++;
+  return TRUE;
+}
+
+static gboolean
+gis_squashfs_reader_load (GisSquashfsReader *self,
+                          const gchar       *path,
+                          GError           **error)
+{
+  guint8 sb[SQUASHFS_SUPERBLOCK_SIZE];
+  g_auto(GStrv) components = g_strsplit (path, "/", -1);
+  guint64 inode_table_start, directory_table_start, fragment_table_start;
+  guint32 fragment_count;
+  guint64 ref;
+  MetadataCursor cursor;
+  guint16 type;
+  guint i;
+
+  if (!pread_all (self->fd, sb, sizeof sb, 0, error))
+    return FALSE;
+
+  if (read_le32 (sb) != SQUASHFS_MAGIC)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                           "not a squashfs filesystem");
+      return FALSE;
+    }
+
+  if (read_le16 (sb + 28) != 4 || read_le16 (sb + 30) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "squashfs version %u.%u is not supported",
+                   read_le16 (sb + 28), read_le16 (sb + 30));
+      return FALSE;
+    }
+
+  self->block_size = read_le32 (sb + 12);
+  fragment_count = read_le32 (sb + 16);
+  self->compression = read_le16 (sb + 20);
+  ref = read_le64 (sb + 32);
+  inode_table_start = read_le64 (sb + 64);
+  directory_table_start = read_le64 (sb + 72);
+  fragment_table_start = read_le64 (sb + 80);
+
+  if (self->block_size < SQUASHFS_MIN_BLOCK_SIZE ||
+      self->block_size > SQUASHFS_MAX_BLOCK_SIZE ||
+      (self->block_size & (self->block_size - 1)) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "invalid squashfs block size %u", self->block_size);
+      return FALSE;
+    }
+
+  if (self->compression != SQUASHFS_COMPRESSION_GZIP &&
+      self->compression != SQUASHFS_COMPRESSION_XZ)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "squashfs compression %u is not supported",
+                   self->compression);
+      return FALSE;
+    }
+
+  if (!gis_squashfs_reader_open_inode (self, inode_table_start, ref, &cursor,
+                                       &type, error))
+    return FALSE;
+
+  for (i = 0; components[i] != NULL; i++)
+    {
+      if (*components[i] == '\0')
+        continue;
+
+      if (!gis_squashfs_reader_lookup (self, directory_table_start, &cursor,
+                                       type, components[i], &ref, error) ||
+          !gis_squashfs_reader_open_inode (self, inode_table_start, ref,
+                                           &cursor, &type, error))
+        return FALSE;
+    }
+
+  if (!gis_squashfs_reader_load_file (self, &cursor, type, path, error))
+    return FALSE;
+
+  if (self->fragment_index != SQUASHFS_NO_FRAGMENT &&
+      self->file_size % self->block_size != 0 &&
+      !gis_squashfs_reader_load_fragment (self, fragment_table_start,
+                                          fragment_count, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ * gis_squashfs_reader_open:
+ * @squashfs: a squashfs image
+ * @path: path to a regular file within @squashfs
+ *
+ * Opens @path within @squashfs for reading. Its data is decompressed on a
+ * pool of worker threads, ahead of the current position.
+ *
+ * Returns: (transfer full): a stream reading @path, or %NULL on error.
+ */
+GInputStream *
+gis_squashfs_reader_open (GFile        *squashfs,
+                          const gchar  *path,
+                          GCancellable *cancellable,
+                          GError      **error)
+{
+  g_autofree gchar *squashfs_path = g_file_get_path (squashfs);
+  g_autoptr(GisSquashfsReader) self = NULL;
+  guint n_workers = MAX (1, g_get_num_processors ());
+
+  g_return_val_if_fail (G_IS_FILE (squashfs), NULL);
+  g_return_val_if_fail (path != NULL, NULL);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return NULL;
+
+  if (squashfs_path == NULL)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "squashfs is not a local file");
+      return NULL;
+    }
+
+  self = g_object_new (GIS_TYPE_SQUASHFS_READER, NULL);
+  self->fd = open (squashfs_path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (self->fd < 0)
+    {
+      glnx_throw_errno_prefix (error, "can't open %s", squashfs_path);
+      return NULL;
+    }
+
+  if (!gis_squashfs_reader_load (self, path, error))
+    {
+      g_prefix_error (error, "%s: ", squashfs_path);
+      return NULL;
+    }
+
+  self->max_in_flight = n_workers * BLOCKS_PER_WORKER;
+  self->pool = g_thread_pool_new (gis_squashfs_reader_worker, self,
+                                  n_workers, FALSE, error);
+  if (self->pool == NULL)
+    return NULL;
+
+  g_message ("reading %s from %s: %" G_GUINT64_FORMAT " bytes in %u blocks, "
+             "with %u workers", path, squashfs_path, self->file_size,
+             self->n_blocks, n_workers);
+
+  return G_INPUT_STREAM (g_steal_pointer (&self));
+}
+
+/**
+ * gis_squashfs_reader_get_size:
+ *
+ * Returns: the size of the file being read, in bytes.
+ */
+guint64
+gis_squashfs_reader_get_size (GisSquashfsReader *self)
+{
+  g_return_val_if_fail (GIS_IS_SQUASHFS_READER (self), 0);
+
+  return self->file_size;
+}
+
+/**
+ * gis_squashfs_reader_is_squashfs:
+ * @file: an image file
+ *
+ * Returns: %TRUE if @file is a squashfs image holding the real image at
+ *  %GIS_SQUASHFS_LIVE_IMAGE_PATH, like endless.squash on a live USB.
+ */
+gboolean
+gis_squashfs_reader_is_squashfs (GFile *file)
+{
+  g_autofree gchar *basename = g_file_get_basename (file);
+
+  return basename != NULL && g_str_has_suffix (basename, ".squash");
+}
@@ -0,0 +1,43 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_SQUASHFS_READER_H
+#define GIS_SQUASHFS_READER_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Path of the uncompressed image within endless.squash on live USBs */
+#define GIS_SQUASHFS_LIVE_IMAGE_PATH "endless.img"
+
+#define GIS_TYPE_SQUASHFS_READER (gis_squashfs_reader_get_type ())
+G_DECLARE_FINAL_TYPE (GisSquashfsReader, gis_squashfs_reader, GIS, SQUASHFS_READER, GInputStream);
+
+GInputStream *gis_squashfs_reader_open (GFile        *squashfs,
+                                        const gchar  *path,
+                                        GCancellable *cancellable,
+                                        GError      **error);
+
+guint64 gis_squashfs_reader_get_size (GisSquashfsReader *self);
+
+gboolean gis_squashfs_reader_is_squashfs (GFile *file);
+
+G_END_DECLS
+
+#endif /* GIS_SQUASHFS_READER_H */
@@ -27,11 +27,16 @@
 static GObject *_objects[GIS_STORE_N_OBJECTS];
 static guint64 _size = 0;
 static guint64 _image_size = 0;
+static gdouble _target_rate = 0;
+static gdouble _decode_rate = 0;
+static gdouble _verify_rate = 0;
 static gchar *_name = NULL;
 static gchar *_signature = NULL;
 static gchar *_checksum = NULL;
 static GError *_error = NULL;
 static GisUnattendedConfig *_config = NULL;
+static GisImageCache *_image_cache = NULL;
+static GisImageVerifier *_image_verifier = NULL;
 static gboolean _live_install = FALSE;
 static gchar *_uuid = NULL;
 
@@ -80,6 +85,33 @@ void gis_store_set_image_size (guint64 size)
   _image_size = size;
 }
 
+/* Rates are in bytes per second, or 0 if not (yet) measured. See
+ * gis-throughput.c.
+ */
+gdouble gis_store_get_target_rate (void)
+{
+  return _target_rate;
+}
+
+void gis_store_set_target_rate (gdouble rate)
+{
+  _target_rate = rate;
+}
+
+void gis_store_get_image_rates (gdouble *decode_rate,
+                                gdouble *verify_rate)
+{
+  *decode_rate = _decode_rate;
+  *verify_rate = _verify_rate;
+}
+
+void gis_store_set_image_rates (gdouble decode_rate,
+                                gdouble verify_rate)
+{
+  _decode_rate = decode_rate;
+  _verify_rate = verify_rate;
+}
+
 gchar *gis_store_get_image_name(void)
 {
   return _name;
@@ -167,6 +199,18 @@ gis_store_is_unattended (void)
   return _config != NULL;
 }
 
+/**
+ * gis_store_is_batch:
+ *
+ * Returns: %TRUE if we are in unattended mode, and the configuration asks for
+ *  drives to be written as they are plugged in.
+ */
+gboolean
+gis_store_is_batch (void)
+{
+  return _config != NULL && gis_unattended_config_is_batch (_config);
+}
+
 /**
  * gis_store_get_unattended_config:
  *
@@ -179,6 +223,48 @@ gis_store_get_unattended_config (void)
   return _config;
 }
 
+/**
+ * gis_store_get_image_cache:
+ *
+ * Returns: (nullable) (transfer none): the cache of decompressed images, or
+ *  %NULL if the unattended config does not ask for one.
+ */
+GisImageCache *
+gis_store_get_image_cache (void)
+{
+  const gchar *directory = NULL;
+  guint64 max_size = 0;
+  guint max_entries = 0;
+  GisImageCacheEviction eviction;
+
+  if (_image_cache != NULL)
+    return _image_cache;
+
+  if (_config == NULL ||
+      !gis_unattended_config_get_cache (_config, &directory, &max_size,
+                                        &max_entries, &eviction))
+    return NULL;
+
+  _image_cache = gis_image_cache_new (directory, max_size, max_entries,
+                                      eviction);
+  return _image_cache;
+}
+
+/**
+ * gis_store_get_image_verifier:
+ *
+ * Returns: (transfer none): the verifier which checks images in the
+ *  background as soon as they are selected.
+ */
+GisImageVerifier *
+gis_store_get_image_verifier (void)
+{
+  if (_image_verifier == NULL)
+    _image_verifier = gis_image_verifier_new ();
+
+  return _image_verifier;
+}
+
 void gis_store_enter_live_install(void)
 {
   _live_install = TRUE;
@@ -25,6 +25,8 @@
 
 #include <glib.h>
 
+#include "gis-image-cache.h"
+#include "gis-image-verifier.h"
 #include "gis-unattended-config.h"
 
 G_BEGIN_DECLS
@@ -50,6 +52,16 @@ typedef enum {
    */
   GIS_STORE_IMAGE_SOURCE,
 
+  /* UDisksBlock: partition mounted at GIS_STORE_IMAGE_DIR, which images
+   * may be read from directly, bypassing its filesystem.
+   */
+  GIS_STORE_IMAGE_BLOCK,
+
+  /* GisScribe: write of GIS_STORE_IMAGE which was pre-warmed while the
+   * unattended mode countdown was running, but has no targets yet, or NULL.
+   */
+  GIS_STORE_PREWARMED_SCRIBE,
+
   GIS_STORE_N_OBJECTS
 } GISStoreObjectKey;
 
@@ -63,6 +75,14 @@ void gis_store_set_required_size(guint64 size);
 guint64 gis_store_get_image_size (void);
 void gis_store_set_image_size (guint64 size);
 
+gdouble gis_store_get_target_rate (void);
+void gis_store_set_target_rate (gdouble rate);
+
+void gis_store_get_image_rates (gdouble *decode_rate,
+                                gdouble *verify_rate);
+void gis_store_set_image_rates (gdouble decode_rate,
+                                gdouble verify_rate);
+
 gchar *gis_store_get_image_name(void);
 void gis_store_set_image_name(gchar *name);
 void gis_store_clear_image_name(void);
@@ -82,7 +102,10 @@ void gis_store_clear_error(void);
 
 void gis_store_enter_unattended (GisUnattendedConfig *config);
 gboolean gis_store_is_unattended (void);
+gboolean gis_store_is_batch (void);
 GisUnattendedConfig *gis_store_get_unattended_config (void);
+GisImageCache *gis_store_get_image_cache (void);
+GisImageVerifier *gis_store_get_image_verifier (void);
 
 void gis_store_enter_live_install(void);
 gboolean gis_store_is_live_install(void);
@@ -0,0 +1,492 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures how quickly an install is likely to go, without writing anything.
+ *
+ * Writing an image is a pipeline: the image is read and decompressed, its
+ * signature or checksum is checked, and it is written to the target, all at
+ * the same time. So the install goes as fast as the slowest of these, which
+ * is usually the target. gis_throughput_probe_device() reads a few scattered
+ * chunks of the target, and gis_throughput_probe_image() decompresses and
+ * hashes the start of the image; gis_throughput_estimate_seconds() combines
+ * them.
+ *
+ * Reading a disk is faster than writing to it, often much faster for flash
+ * storage, so the estimate from a probe is optimistic. Once an image has been
+ * written, the rate it was written at is recorded with
+ * gis_throughput_history_record() in GIS_THROUGHPUT_HISTORY_BASENAME on the
+ * images partition, keyed by the target's vendor and model, which is a better
+ * guide for the next computer of the same model. The history is a keyfile
+ * with a group per model:
+ *
+ *   [Vendor Model]
+ *   write-rate=123456789.0
+ *   samples=3
+ */
+#include "config.h"
+#include "gis-throughput.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gduxzdecompressor.h"
+#include "gis-image-reader.h"
+#include "glnx-errors.h"
+
+/* How many chunks of the target to read, spread evenly over the disk, since
+ * hard disks are faster at the start than the end.
+ */
+#define DEVICE_PROBE_SAMPLES 8
+/* Size of each chunk read from the target */
+#define DEVICE_PROBE_CHUNK (4 * 1024 * 1024)
+/* O_DIRECT reads must be aligned to the device's logical block size, which
+ * is at most this.
+ */
+#define DEVICE_PROBE_ALIGNMENT 4096
+
+/* How much of the image to decompress */
+#define IMAGE_PROBE_SIZE (32 * 1024 * 1024)
+#define IMAGE_PROBE_BUFFER_SIZE (1024 * 1024)
+
+/* The history is a moving average over (roughly) this many installs, so that
+ * it follows changes such as a new USB stick for the images.
+ */
+#define HISTORY_WEIGHT 8
+
+/* Weight given to the latest sample in gis_throughput_smooth_rate() */
+#define RATE_SMOOTHING 0.2
+
+#define HISTORY_KEY_WRITE_RATE "write-rate"
+#define HISTORY_KEY_SAMPLES "samples"
+
+static gdouble
+rate (guint64 bytes,
+      gint64  usec)
+{
+  return bytes * (gdouble) G_USEC_PER_SEC / MAX (usec, 1);
+}
+
+static gboolean
+pread_all (gint    fd,
+           guint8 *buf,
+           gsize   len,
+           guint64 offset,
+           GError **error)
+{
+  while (len > 0)
+    {
+      gssize r = pread (fd, buf, len, offset);
+
+      if (r < 0 && errno == EINTR)
+        continue;
+
+      if (r < 0)
+        return glnx_throw_errno_prefix (error, "can't read at %" G_GUINT64_FORMAT,
+                                        offset);
+
+      if (r == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "unexpected end of device at %" G_GUINT64_FORMAT,
+                       offset);
+          return FALSE;
+        }
+
+      buf += r;
+      len -= r;
+      offset += r;
+    }
+
+  return TRUE;
+}
+
+/**
+ * gis_throughput_probe_device:
+ * @fd: a file descriptor for the target block device, opened for reading
+ * @read_rate: (out): the rate at which the device was read, in bytes per
+ *  second
+ *
+ * Reads a few chunks of @fd, bypassing the page cache if possible, to
+ * measure how fast the device is. Nothing is written. This blocks for as long
+ * as the reads take, which is a second or two for most disks, so it is called
+ * from a worker thread.
+ *
+ * Returns: %TRUE if @read_rate was measured
+ */
+gboolean
+gis_throughput_probe_device (gint          fd,
+                             GCancellable *cancellable,
+                             gdouble      *read_rate,
+                             GError      **error)
+{
+  guint8 *buf = NULL;
+  g_autoptr(GError) local_error = NULL;
+  off_t size;
+  guint64 chunk = DEVICE_PROBE_CHUNK;
+  guint64 total = 0;
+  gint64 start;
+  gboolean direct = FALSE;
+  gint flags;
+  gint err;
+  guint i;
+
+  g_return_val_if_fail (fd >= 0, FALSE);
+  g_return_val_if_fail (read_rate != NULL, FALSE);
+
+  size = lseek (fd, 0, SEEK_END);
+  if (size < 0)
+    return glnx_throw_errno_prefix (error, "can't find size of device");
+
+  chunk = MIN (chunk, (guint64) size);
+  chunk -= chunk % DEVICE_PROBE_ALIGNMENT;
+  if (chunk == 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "device is too small to probe");
+      return FALSE;
+    }
+
+  err = posix_memalign ((void **) &buf, DEVICE_PROBE_ALIGNMENT, chunk);
+  if (err != 0)
+    {
+      errno = err;
+      return glnx_throw_errno_prefix (error, "can't allocate buffer");
+    }
+
+  /* Otherwise, whatever is in the page cache makes the device look faster
+   * than it is.
+   */
+  flags = fcntl (fd, F_GETFL);
+  if (flags >= 0 && fcntl (fd, F_SETFL, flags | O_DIRECT) == 0)
+    direct = TRUE;
+  else
+    g_debug ("can't set O_DIRECT: %s", g_strerror (errno));
+
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < DEVICE_PROBE_SAMPLES; i++)
+    {
+      guint64 offset = (size - chunk) / (DEVICE_PROBE_SAMPLES - 1) * i;
+
+      offset -= offset % DEVICE_PROBE_ALIGNMENT;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      if (!direct)
+        posix_fadvise (fd, offset, chunk, POSIX_FADV_DONTNEED);
+
+      if (!pread_all (fd, buf, chunk, offset, &local_error) &&
+          direct &&
+          g_error_matches (local_error, G_IO_ERROR,
+                           G_IO_ERROR_INVALID_ARGUMENT))
+        {
+          /* Some filesystems accept O_DIRECT but can't do it */
+          g_debug ("O_DIRECT read failed: %s", local_error->message);
+          g_clear_error (&local_error);
+          fcntl (fd, F_SETFL, flags);
+          direct = FALSE;
+          posix_fadvise (fd, offset, chunk, POSIX_FADV_DONTNEED);
+          pread_all (fd, buf, chunk, offset, &local_error);
+        }
+
+      if (local_error != NULL)
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          goto out;
+        }
+
+      total += chunk;
+    }
+
+  *read_rate = rate (total, g_get_monotonic_time () - start);
+
+out:
+  if (direct)
+    fcntl (fd, F_SETFL, flags);
+
+  free (buf);
+  return total == DEVICE_PROBE_SAMPLES * chunk;
+}
+
+/**
+ * gis_throughput_probe_image:
+ * @image: the image to probe
+ * @decode_rate: (out): the rate at which @image was read and decompressed,
+ *  in uncompressed bytes per second
+ * @verify_rate: (out): the rate at which it was hashed, in bytes per second
+ *
+ * Reads and decompresses the first few MiB of @image, and hashes what was
+ * read, as writing it would. This blocks for as long as that takes, so it is
+ * called from a worker thread.
+ *
+ * Returns: %TRUE if the rates were measured
+ */
+gboolean
+gis_throughput_probe_image (GFile        *image,
+                            GCancellable *cancellable,
+                            gdouble      *decode_rate,
+                            gdouble      *verify_rate,
+                            GError      **error)
+{
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GConverter) converter = NULL;
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree gchar *basename = g_file_get_basename (image);
+  g_autofree guint8 *buf = g_malloc (IMAGE_PROBE_BUFFER_SIZE);
+  guint64 total = 0;
+  gint64 decode_usec = 0;
+  gint64 verify_usec = 0;
+
+  g_return_val_if_fail (G_IS_FILE (image), FALSE);
+  g_return_val_if_fail (decode_rate != NULL, FALSE);
+  g_return_val_if_fail (verify_rate != NULL, FALSE);
+
+  input = gis_image_reader_open (image, cancellable, error);
+  if (input == NULL)
+    return FALSE;
+
+  if (g_str_has_suffix (basename, ".gz"))
+    converter =
+      G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+  else if (g_str_has_suffix (basename, ".xz"))
+    converter = G_CONVERTER (gdu_xz_decompressor_new ());
+
+  if (converter != NULL)
+    {
+      GInputStream *decompressed =
+        g_converter_input_stream_new (input, converter);
+
+      g_object_unref (input);
+      input = decompressed;
+    }
+
+  while (total < IMAGE_PROBE_SIZE)
+    {
+      gint64 start = g_get_monotonic_time ();
+      gint64 decoded;
+      gsize bytes_read = 0;
+
+      if (!g_input_stream_read_all (input, buf, IMAGE_PROBE_BUFFER_SIZE,
+                                    &bytes_read, cancellable, error))
+        return FALSE;
+
+      decoded = g_get_monotonic_time ();
+      g_checksum_update (checksum, buf, bytes_read);
+      verify_usec += g_get_monotonic_time () - decoded;
+      decode_usec += decoded - start;
+      total += bytes_read;
+
+      if (bytes_read < IMAGE_PROBE_BUFFER_SIZE)
+        break;
+    }
+
+  if (total == 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "image is empty");
+      return FALSE;
+    }
+
+  *decode_rate = rate (total, decode_usec);
+  *verify_rate = rate (total, verify_usec);
+  return TRUE;
+}
+
+/* Keyfile group names can't contain square brackets. */
+static gchar *
+history_group (const gchar *model)
+{
+  gchar *group;
+
+  if (model == NULL || *model == '\0')
+    return NULL;
+
+  group = g_strdup (model);
+  g_strdelimit (group, "[]", '_');
+  return group;
+}
+
+/**
+ * gis_throughput_history_lookup:
+ * @directory: the directory holding the images
+ * @model: the target's vendor and model
+ *
+ * Returns: the average rate at which images were written to @model before,
+ *  end to end, in bytes per second; or 0 if none have been
+ */
+gdouble
+gis_throughput_history_lookup (const gchar *directory,
+                               const gchar *model)
+{
+  g_autoptr(GKeyFile) key_file = g_key_file_new ();
+  g_autofree gchar *path = NULL;
+  g_autofree gchar *group = history_group (model);
+  gdouble write_rate;
+
+  g_return_val_if_fail (directory != NULL, 0);
+
+  if (group == NULL)
+    return 0;
+
+  path = g_build_filename (directory, GIS_THROUGHPUT_HISTORY_BASENAME, NULL);
+  if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, NULL))
+    return 0;
+
+  write_rate = g_key_file_get_double (key_file, group, HISTORY_KEY_WRITE_RATE,
+                                      NULL);
+  return MAX (write_rate, 0);
+}
+
+/**
+ * gis_throughput_history_record:
+ * @directory: the directory holding the images
+ * @model: the target's vendor and model
+ * @write_rate: the rate at which an image was just written to @model, end to
+ *  end, in bytes per second
+ *
+ * Adds @write_rate to the history for @model. The history lives alongside
+ * the images, since what matters is how fast this installer's images go onto
+ * the same model of disk on other computers; so if the images partition is
+ * read-only, nothing is recorded.
+ *
+ * Returns: %TRUE if the history was saved
+ */
+gboolean
+gis_throughput_history_record (const gchar *directory,
+                               const gchar *model,
+                               gdouble      write_rate,
+                               GError     **error)
+{
+  g_autoptr(GKeyFile) key_file = g_key_file_new ();
+  g_autoptr(GError) local_error = NULL;
+  g_autofree gchar *path = NULL;
+  g_autofree gchar *group = history_group (model);
+  gdouble average;
+  gint samples;
+
+  g_return_val_if_fail (directory != NULL, FALSE);
+  g_return_val_if_fail (write_rate > 0, FALSE);
+
+  if (group == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "target model is unknown");
+      return FALSE;
+    }
+
+  path = g_build_filename (directory, GIS_THROUGHPUT_HISTORY_BASENAME, NULL);
+  if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_KEEP_COMMENTS,
+                                  &local_error) &&
+      !g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+    g_message ("can't load %s; starting again: %s", path,
+               local_error->message);
+
+  samples = g_key_file_get_integer (key_file, group, HISTORY_KEY_SAMPLES,
+                                    NULL);
+  average = g_key_file_get_double (key_file, group, HISTORY_KEY_WRITE_RATE,
+                                   NULL);
+  if (samples <= 0 || average <= 0)
+    {
+      samples = 0;
+      average = write_rate;
+    }
+  else
+    {
+      average += (write_rate - average) / MIN (samples + 1, HISTORY_WEIGHT);
+    }
+
+  g_key_file_set_double (key_file, group, HISTORY_KEY_WRITE_RATE, average);
+  g_key_file_set_integer (key_file, group, HISTORY_KEY_SAMPLES, samples + 1);
+
+  return g_key_file_save_to_file (key_file, path, error);
+}
+
+/**
+ * gis_throughput_smooth_rate:
+ * @smoothed_rate: the rate so far, in bytes per second, or 0 if there is no
+ *  rate yet
+ * @bytes: how many bytes were written since the last sample, which may be 0
+ * @elapsed_seconds: how long it has been since the last sample
+ *
+ * Folds the latest sample into an exponential moving average of the rate.
+ * This should be called periodically whether or not anything was written, so
+ * that the rate falls (and an estimate based on it grows) while writing is
+ * stalled, rather than staying at whatever it was before the stall.
+ *
+ * Returns: the new smoothed rate, in bytes per second
+ */
+gdouble
+gis_throughput_smooth_rate (gdouble smoothed_rate,
+                            guint64 bytes,
+                            gdouble elapsed_seconds)
+{
+  gdouble sample;
+
+  if (elapsed_seconds <= 0)
+    return smoothed_rate;
+
+  sample = bytes / elapsed_seconds;
+
+  /* Don't average the first sample with nothing. */
+  if (smoothed_rate <= 0)
+    return sample;
+
+  return RATE_SMOOTHING * sample + (1 - RATE_SMOOTHING) * smoothed_rate;
+}
+
+/**
+ * gis_throughput_estimate_seconds:
+ * @image_size: the size of the image file, which is what is verified
+ * @required_size: the uncompressed size of the image, which is what is
+ *  decompressed and written
+ * @write_rate: how fast the target can be written, in bytes per second
+ * @decode_rate: how fast the image can be read and decompressed, or 0 if
+ *  not known
+ * @verify_rate: how fast the image can be hashed, or 0 if not known
+ *
+ * Returns: how long writing the image should take, in seconds, given that
+ *  it goes no faster than the slowest of the three; or 0 if @write_rate is
+ *  not known
+ */
+guint64
+gis_throughput_estimate_seconds (guint64 image_size,
+                                 guint64 required_size,
+                                 gdouble write_rate,
+                                 gdouble decode_rate,
+                                 gdouble verify_rate)
+{
+  gdouble seconds;
+
+  if (write_rate <= 0 || required_size == 0)
+    return 0;
+
+  seconds = required_size / write_rate;
+
+  if (decode_rate > 0)
+    seconds = MAX (seconds, required_size / decode_rate);
+
+  if (verify_rate > 0)
+    seconds = MAX (seconds, image_size / verify_rate);
+
+  return (guint64) (seconds + 0.5);
+}
@@ -0,0 +1,60 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_THROUGHPUT_H
+#define GIS_THROUGHPUT_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Where the history of past installs is kept, in the images directory */
+#define GIS_THROUGHPUT_HISTORY_BASENAME ".eos-installer-throughput.ini"
+
+gboolean gis_throughput_probe_device (gint          fd,
+                                      GCancellable *cancellable,
+                                      gdouble      *read_rate,
+                                      GError      **error);
+
+gboolean gis_throughput_probe_image (GFile        *image,
+                                     GCancellable *cancellable,
+                                     gdouble      *decode_rate,
+                                     gdouble      *verify_rate,
+                                     GError      **error);
+
+gdouble gis_throughput_history_lookup (const gchar *directory,
+                                       const gchar *model);
+
+gboolean gis_throughput_history_record (const gchar *directory,
+                                        const gchar *model,
+                                        gdouble      write_rate,
+                                        GError     **error);
+
+gdouble gis_throughput_smooth_rate (gdouble smoothed_rate,
+                                    guint64 bytes,
+                                    gdouble elapsed_seconds);
+
+guint64 gis_throughput_estimate_seconds (guint64 image_size,
+                                         guint64 required_size,
+                                         gdouble write_rate,
+                                         gdouble decode_rate,
+                                         gdouble verify_rate);
+
+G_END_DECLS
+
+#endif /* GIS_THROUGHPUT_H */
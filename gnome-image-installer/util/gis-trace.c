@@ -0,0 +1,336 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Records what each of the scribe's threads (and subprocesses) was doing, and
+ * when, so that a slow install can be loaded into Perfetto or chrome://tracing
+ * and the stalls seen directly. This is only done if GIS_TRACE_ENV is set.
+ *
+ * Each span is a complete ("X") event in the Chrome trace event format, on a
+ * track for the thread which recorded it, with the number of bytes it handled
+ * as an argument. Subprocesses get a track of their own, keyed by their pid,
+ * with a single span covering their lifetime. Timestamps are from
+ * g_get_monotonic_time().
+ */
+
+#include "config.h"
+#include "gis-trace.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct {
+  /* Not owned: spans are named with string literals */
+  const gchar *name;
+  gint64 tid;
+  gint64 start_usec;
+  gint64 end_usec;
+  guint64 bytes;
+} GisTraceSpan;
+
+struct _GisTrace {
+  GMutex mutex;
+  /* GisTraceSpan */
+  GArray *spans;
+  /* tid → (owned) name for the thread's track */
+  GHashTable *thread_names;
+};
+
+static gint64
+gis_trace_get_tid (void)
+{
+  return syscall (SYS_gettid);
+}
+
+/**
+ * gis_trace_is_enabled:
+ *
+ * Returns: %TRUE if GIS_TRACE_ENV is set in the environment
+ */
+gboolean
+gis_trace_is_enabled (void)
+{
+  const gchar *value = g_getenv (GIS_TRACE_ENV);
+
+  return value != NULL && *value != '\0';
+}
+
+/**
+ * gis_trace_new:
+ *
+ * Returns: (transfer full): a new, empty trace. Spans may be added to it from
+ *  any thread.
+ */
+GisTrace *
+gis_trace_new (void)
+{
+  GisTrace *trace = g_new0 (GisTrace, 1);
+
+  g_mutex_init (&trace->mutex);
+  trace->spans = g_array_new (FALSE, FALSE, sizeof (GisTraceSpan));
+  trace->thread_names = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                               g_free, g_free);
+
+  return trace;
+}
+
+void
+gis_trace_free (GisTrace *trace)
+{
+  g_mutex_clear (&trace->mutex);
+  g_array_unref (trace->spans);
+  g_hash_table_unref (trace->thread_names);
+  g_free (trace);
+}
+
+static void
+gis_trace_name_track (GisTrace    *trace,
+                      gint64       tid,
+                      const gchar *name)
+{
+  gint64 *key = g_new (gint64, 1);
+
+  *key = tid;
+  g_mutex_lock (&trace->mutex);
+  g_hash_table_replace (trace->thread_names, key, g_strdup (name));
+  g_mutex_unlock (&trace->mutex);
+}
+
+/**
+ * gis_trace_name_thread:
+ * @name: what the calling thread is doing
+ *
+ * Labels the calling thread's track. Worker threads are reused, so a thread
+ * which is given more than one name is shown with the last.
+ */
+void
+gis_trace_name_thread (GisTrace    *trace,
+                       const gchar *name)
+{
+  gis_trace_name_track (trace, gis_trace_get_tid (), name);
+}
+
+/**
+ * gis_trace_add_span:
+ * @name: (not nullable): a string literal describing what the calling thread
+ *  was doing
+ * @bytes: how much data it handled in that time, or 0
+ *
+ * Records that the calling thread spent from @start_usec to @end_usec on
+ * @name.
+ */
+void
+gis_trace_add_span (GisTrace    *trace,
+                    const gchar *name,
+                    gint64       start_usec,
+                    gint64       end_usec,
+                    guint64      bytes)
+{
+  GisTraceSpan span = {
+      .name = name,
+      .tid = gis_trace_get_tid (),
+      .start_usec = start_usec,
+      .end_usec = MAX (start_usec, end_usec),
+      .bytes = bytes,
+  };
+
+  g_mutex_lock (&trace->mutex);
+  g_array_append_val (trace->spans, span);
+  g_mutex_unlock (&trace->mutex);
+}
+
+/**
+ * gis_trace_add_subprocess:
+ * @name: (not nullable): a string literal naming the subprocess
+ *
+ * Records that subprocess @pid ran from @start_usec to @end_usec, on a track
+ * of its own.
+ */
+void
+gis_trace_add_subprocess (GisTrace    *trace,
+                          const gchar *name,
+                          GPid         pid,
+                          gint64       start_usec,
+                          gint64       end_usec)
+{
+  GisTraceSpan span = {
+      .name = name,
+      .tid = pid,
+      .start_usec = start_usec,
+      .end_usec = MAX (start_usec, end_usec),
+  };
+
+  gis_trace_name_track (trace, pid, name);
+
+  g_mutex_lock (&trace->mutex);
+  g_array_append_val (trace->spans, span);
+  g_mutex_unlock (&trace->mutex);
+}
+
+static void
+append_json_string (GString     *json,
+                    const gchar *str)
+{
+  const gchar *p;
+
+  g_string_append_c (json, '"');
+  for (p = str; *p != '\0'; p++)
+    {
+      if (*p == '"' || *p == '\\')
+        g_string_append_printf (json, "\\%c", *p);
+      else if ((guchar) *p < 0x20)
+        g_string_append_printf (json, "\\u%04x", (guint) (guchar) *p);
+      else
+        g_string_append_c (json, *p);
+    }
+  g_string_append_c (json, '"');
+}
+
+/**
+ * gis_trace_to_json:
+ *
+ * Returns: (transfer full): @trace in the Chrome trace event format
+ */
+GBytes *
+gis_trace_to_json (GisTrace *trace)
+{
+  GString *json = g_string_new ("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  const gint pid = getpid ();
+  GHashTableIter iter;
+  gpointer key, value;
+  gboolean first = TRUE;
+  guint i;
+
+  g_mutex_lock (&trace->mutex);
+
+  g_hash_table_iter_init (&iter, trace->thread_names);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      if (!first)
+        g_string_append_c (json, ',');
+      first = FALSE;
+
+      g_string_append_printf (json,
+                              "\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                              "\"pid\":%d,\"tid\":%" G_GINT64_FORMAT ","
+                              "\"args\":{\"name\":",
+                              pid, *(gint64 *) key);
+      append_json_string (json, value);
+      g_string_append (json, "}}");
+    }
+
+  for (i = 0; i < trace->spans->len; i++)
+    {
+      const GisTraceSpan *span = &g_array_index (trace->spans, GisTraceSpan, i);
+
+      if (!first)
+        g_string_append_c (json, ',');
+      first = FALSE;
+
+      g_string_append (json, "\n{\"name\":");
+      append_json_string (json, span->name);
+      g_string_append_printf (json,
+                              ",\"cat\":\"scribe\",\"ph\":\"X\","
+                              "\"ts\":%" G_GINT64_FORMAT ","
+                              "\"dur\":%" G_GINT64_FORMAT ","
+                              "\"pid\":%d,\"tid\":%" G_GINT64_FORMAT ","
+                              "\"args\":{\"bytes\":%" G_GUINT64_FORMAT "}}",
+                              span->start_usec,
+                              span->end_usec - span->start_usec,
+                              pid, span->tid, span->bytes);
+    }
+
+  g_mutex_unlock (&trace->mutex);
+
+  g_string_append (json, "\n]}\n");
+  return g_string_free_to_bytes (json);
+}
+
+static GFile *
+gis_trace_write_in_dir (GFile        *dir,
+                        const gchar  *basename,
+                        GBytes       *json,
+                        GCancellable *cancellable,
+                        GError      **error)
+{
+  g_autoptr(GFile) file = g_file_get_child (dir, basename);
+  gsize size = 0;
+  gconstpointer data = g_bytes_get_data (json, &size);
+
+  if (!g_file_replace_contents (file, data, size, NULL, FALSE,
+                                G_FILE_CREATE_NONE, NULL, cancellable, error))
+    return NULL;
+
+  return g_steal_pointer (&file);
+}
+
+/**
+ * gis_trace_write:
+ * @image_dir: (nullable): root directory of image partition, or %NULL if not
+ *  known
+ * @home_dir: (nullable): path to home directory, or %NULL if the trace
+ *  should not be written to the home directory
+ *
+ * Writes @trace, as JSON, to the first of @image_dir and @home_dir which is
+ * not %NULL and writable; that is, alongside the diagnostics which
+ * gis_write_diagnostics_async() would write.
+ *
+ * Returns: (transfer full): the file the trace was written to, or %NULL with
+ *  @error set
+ */
+GFile *
+gis_trace_write (GisTrace     *trace,
+                 GFile        *image_dir,
+                 const gchar  *home_dir,
+                 GCancellable *cancellable,
+                 GError      **error)
+{
+  g_autoptr(GBytes) json = gis_trace_to_json (trace);
+  g_autoptr(GDateTime) now = g_date_time_new_now_local ();
+  g_autofree gchar *now_str = g_date_time_format (now, "%y%m%d_%H%M%S_UTC%z");
+  g_autofree gchar *basename = g_strdup_printf ("eos-installer-trace-%s.json",
+                                                now_str);
+  g_autoptr(GError) local_error = NULL;
+  GFile *file;
+
+  if (image_dir != NULL)
+    {
+      file = gis_trace_write_in_dir (image_dir, basename, json, cancellable,
+                                     &local_error);
+      if (file != NULL || home_dir == NULL)
+        {
+          if (file == NULL)
+            g_propagate_error (error, g_steal_pointer (&local_error));
+          return file;
+        }
+
+      g_message ("failed to write trace to image partition: %s",
+                 local_error->message);
+    }
+
+  if (home_dir != NULL)
+    {
+      g_autoptr(GFile) dir = g_file_new_for_path (home_dir);
+
+      return gis_trace_write_in_dir (dir, basename, json, cancellable, error);
+    }
+
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                       "nowhere to write trace");
+  return NULL;
+}
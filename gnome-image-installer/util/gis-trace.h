@@ -0,0 +1,63 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GIS_TRACE_H
+#define GIS_TRACE_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Set to a non-empty value to record a trace of each write */
+#define GIS_TRACE_ENV "EI_TRACE"
+
+typedef struct _GisTrace GisTrace;
+
+gboolean gis_trace_is_enabled (void);
+
+GisTrace *gis_trace_new (void);
+void gis_trace_free (GisTrace *trace);
+
+void gis_trace_name_thread (GisTrace    *trace,
+                            const gchar *name);
+
+void gis_trace_add_span (GisTrace    *trace,
+                         const gchar *name,
+                         gint64       start_usec,
+                         gint64       end_usec,
+                         guint64      bytes);
+
+void gis_trace_add_subprocess (GisTrace    *trace,
+                               const gchar *name,
+                               GPid         pid,
+                               gint64       start_usec,
+                               gint64       end_usec);
+
+GBytes *gis_trace_to_json (GisTrace *trace);
+
+GFile *gis_trace_write (GisTrace     *trace,
+                        GFile        *image_dir,
+                        const gchar  *home_dir,
+                        GCancellable *cancellable,
+                        GError      **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GisTrace, gis_trace_free)
+
+G_END_DECLS
+
+#endif /* GIS_TRACE_H */
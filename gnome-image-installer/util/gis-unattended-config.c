@@ -35,6 +35,17 @@
 #define FILENAME_KEY "filename"
 #define BLOCK_DEVICE_KEY "block-device"
 
+#define BATCH_GROUP "Batch"
+#define MAX_CONCURRENT_WRITES_KEY "max-concurrent-writes"
+#define DEFAULT_MAX_CONCURRENT_WRITES 4
+
+#define CACHE_GROUP "Cache"
+#define DIRECTORY_KEY "directory"
+#define MAX_SIZE_MB_KEY "max-size-mb"
+#define MAX_ENTRIES_KEY "max-entries"
+#define EVICTION_KEY "eviction"
+#define DEFAULT_CACHE_MAX_ENTRIES 1
+
 typedef struct _GisUnattendedConfig {
   GObject parent;
 
@@ -53,6 +64,18 @@ typedef struct _GisUnattendedConfig {
   /** Basename of image file */
   gchar *filename;
   gchar *block_device;
+
+  /* TRUE if there is a [Batch] section */
+  gboolean batch;
+  guint max_concurrent_writes;
+
+  /* TRUE if there is a [Cache] section */
+  gboolean cache;
+  gchar *cache_directory;
+  /* in bytes; 0 means no limit */
+  guint64 cache_max_size;
+  guint cache_max_entries;
+  GisImageCacheEviction cache_eviction;
 } GisUnattendedConfig;
 
 G_DEFINE_QUARK (gis-unattended-error, gis_unattended_error);
@@ -79,6 +102,9 @@ gis_unattended_config_init (GisUnattendedConfig *self)
   self->key_file = g_key_file_new ();
   self->vendors = g_ptr_array_new_with_free_func (g_free);
   self->products = g_ptr_array_new_with_free_func (g_free);
+  self->max_concurrent_writes = DEFAULT_MAX_CONCURRENT_WRITES;
+  self->cache_max_entries = DEFAULT_CACHE_MAX_ENTRIES;
+  self->cache_eviction = GIS_IMAGE_CACHE_EVICTION_LEAST_RECENTLY_USED;
 }
 
 static void
@@ -124,6 +150,7 @@ gis_unattended_config_finalize (GObject *object)
   g_clear_pointer (&self->products, g_ptr_array_unref);
   g_clear_pointer (&self->filename, g_free);
   g_clear_pointer (&self->block_device, g_free);
+  g_clear_pointer (&self->cache_directory, g_free);
 
   G_OBJECT_CLASS (gis_unattended_config_parent_class)->finalize (object);
 }
@@ -206,6 +233,157 @@ key_file_get_optional_nonempty_string (GKeyFile    *key_file,
   return TRUE;
 }
 
+static gboolean
+gis_unattended_config_populate_batch (GisUnattendedConfig *self,
+                                      GError **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  gint max_concurrent_writes;
+
+  if (!g_key_file_has_group (self->key_file, BATCH_GROUP))
+    return TRUE;
+
+  self->batch = TRUE;
+
+  max_concurrent_writes = g_key_file_get_integer (self->key_file, BATCH_GROUP,
+                                                  MAX_CONCURRENT_WRITES_KEY,
+                                                  &local_error);
+  if (g_error_matches (local_error, G_KEY_FILE_ERROR,
+                       G_KEY_FILE_ERROR_KEY_NOT_FOUND))
+    return TRUE;
+
+  if (local_error != NULL)
+    {
+      g_set_error_literal (error, GIS_UNATTENDED_ERROR,
+                           GIS_UNATTENDED_ERROR_INVALID_BATCH,
+                           local_error->message);
+      return FALSE;
+    }
+
+  if (max_concurrent_writes < 1)
+    {
+      g_set_error (error, GIS_UNATTENDED_ERROR,
+                   GIS_UNATTENDED_ERROR_INVALID_BATCH,
+                   /* Translators: this error refers to a configuration
+                    * file. The placeholder is the name of a field in
+                    * the file.
+                    */
+                   _("%s key must be at least 1"),
+                   MAX_CONCURRENT_WRITES_KEY);
+      return FALSE;
+    }
+
+  self->max_concurrent_writes = max_concurrent_writes;
+  return TRUE;
+}
+
+static gboolean
+key_file_get_optional_uint64 (GKeyFile    *key_file,
+                              const gchar *group_name,
+                              const gchar *key,
+                              guint64     *value_out,
+                              GError     **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  guint64 value;
+
+  value = g_key_file_get_uint64 (key_file, group_name, key, &local_error);
+  if (g_error_matches (local_error, G_KEY_FILE_ERROR,
+                       G_KEY_FILE_ERROR_KEY_NOT_FOUND))
+    return TRUE;
+
+  if (local_error != NULL)
+    {
+      g_set_error_literal (error, GIS_UNATTENDED_ERROR,
+                           GIS_UNATTENDED_ERROR_INVALID_CACHE,
+                           local_error->message);
+      return FALSE;
+    }
+
+  *value_out = value;
+  return TRUE;
+}
+
+static gboolean
+gis_unattended_config_populate_cache (GisUnattendedConfig *self,
+                                      GError **error)
+{
+  g_autofree gchar *eviction = NULL;
+  guint64 max_size_mb = 0;
+  guint64 max_entries = self->cache_max_entries;
+
+  if (!g_key_file_has_group (self->key_file, CACHE_GROUP))
+    return TRUE;
+
+  self->cache = TRUE;
+
+  if (!key_file_get_optional_string (self->key_file, CACHE_GROUP,
+                                     DIRECTORY_KEY, &self->cache_directory,
+                                     error) ||
+      !key_file_get_optional_string (self->key_file, CACHE_GROUP,
+                                     EVICTION_KEY, &eviction,
+                                     error) ||
+      !key_file_get_optional_uint64 (self->key_file, CACHE_GROUP,
+                                     MAX_SIZE_MB_KEY, &max_size_mb,
+                                     error) ||
+      !key_file_get_optional_uint64 (self->key_file, CACHE_GROUP,
+                                     MAX_ENTRIES_KEY, &max_entries,
+                                     error))
+    return FALSE;
+
+  if (self->cache_directory == NULL)
+    self->cache_directory = g_build_filename (g_get_user_cache_dir (),
+                                              "eos-installer", "images",
+                                              NULL);
+  else if (!g_path_is_absolute (self->cache_directory))
+    {
+      g_set_error (error, GIS_UNATTENDED_ERROR,
+                   GIS_UNATTENDED_ERROR_INVALID_CACHE,
+                   /* Translators: this error refers to a configuration
+                    * file. The placeholder is the name of a field in
+                    * the file.
+                    */
+                   _("%s key must be an absolute path"),
+                   DIRECTORY_KEY);
+      return FALSE;
+    }
+
+  if (max_size_mb > G_MAXUINT64 / 1000000 || max_entries > G_MAXUINT)
+    {
+      g_set_error (error, GIS_UNATTENDED_ERROR,
+                   GIS_UNATTENDED_ERROR_INVALID_CACHE,
+                   /* Translators: this error refers to a configuration
+                    * file. The placeholder is the name of a section in
+                    * the file.
+                    */
+                   _("Value out of range in %s section"),
+                   CACHE_GROUP);
+      return FALSE;
+    }
+
+  self->cache_max_size = max_size_mb * 1000000;
+  self->cache_max_entries = max_entries;
+
+  if (eviction == NULL || g_strcmp0 (eviction, "least-recently-used") == 0)
+    self->cache_eviction = GIS_IMAGE_CACHE_EVICTION_LEAST_RECENTLY_USED;
+  else if (g_strcmp0 (eviction, "none") == 0)
+    self->cache_eviction = GIS_IMAGE_CACHE_EVICTION_NONE;
+  else
+    {
+      g_set_error (error, GIS_UNATTENDED_ERROR,
+                   GIS_UNATTENDED_ERROR_INVALID_CACHE,
+                   /* Translators: this error refers to a configuration
+                    * file. The first placeholder is the name of a field in
+                    * the file; the second is its value.
+                    */
+                   _("Unknown %s value ‘%s’"),
+                   EVICTION_KEY, eviction);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 gis_unattended_config_populate_fields (GisUnattendedConfig *self,
                                        GError **error)
@@ -273,7 +451,8 @@ gis_unattended_config_populate_fields (GisUnattendedConfig *self,
         }
     }
 
-  return TRUE;
+  return gis_unattended_config_populate_batch (self, error) &&
+    gis_unattended_config_populate_cache (self, error);
 }
 
 static gboolean
@@ -353,6 +532,36 @@ gis_unattended_config_get_image (GisUnattendedConfig *self)
   return self->filename;
 }
 
+/**
+ * gis_unattended_config_check_images:
+ * @n_images: how many suitable images were found
+ * @error: return location for a #GError
+ *
+ * Checks that there is exactly one image to write, given that @n_images were
+ * found. If an image is configured, only that image can have been found;
+ * otherwise, finding more than one is an error, so this must only be called
+ * once every image has been probed.
+ *
+ * Returns: %TRUE if @n_images is 1; %FALSE with @error set if it is more.
+ */
+gboolean
+gis_unattended_config_check_images (GisUnattendedConfig *self,
+                                    guint n_images,
+                                    GError **error)
+{
+  g_return_val_if_fail (n_images > 0, FALSE);
+
+  if (n_images > 1)
+    {
+      g_set_error_literal (error, GIS_UNATTENDED_ERROR,
+                           GIS_UNATTENDED_ERROR_IMAGE_AMBIGUOUS,
+                           _("More than one image was found."));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 /**
  * gis_unattended_config_matches_device:
  * @device: full path to a block device
@@ -376,6 +585,65 @@ gis_unattended_config_matches_device (GisUnattendedConfig *self,
   return g_str_has_prefix (basename, self->block_device);
 }
 
+/**
+ * gis_unattended_config_is_batch:
+ *
+ * Returns: %TRUE if @self has a [Batch] section, in which case every drive
+ *  plugged in after the installer starts is reformatted, until the installer
+ *  is closed.
+ */
+gboolean
+gis_unattended_config_is_batch (GisUnattendedConfig *self)
+{
+  return self->batch;
+}
+
+/**
+ * gis_unattended_config_get_max_concurrent_writes:
+ *
+ * Returns: the maximum number of drives to write to at once in batch mode.
+ */
+guint
+gis_unattended_config_get_max_concurrent_writes (GisUnattendedConfig *self)
+{
+  return self->max_concurrent_writes;
+}
+
+/**
+ * gis_unattended_config_get_cache:
+ * @directory: (out) (optional) (transfer none): directory to cache
+ *  decompressed images in
+ * @max_size: (out) (optional): maximum size of the cache in bytes, or 0 for
+ *  no limit
+ * @max_entries: (out) (optional): maximum number of cached images, or 0 for
+ *  no limit
+ * @eviction: (out) (optional): what to do when the cache is full
+ *
+ * Returns: %TRUE if @self has a [Cache] section, in which case the out
+ *  parameters are set; %FALSE otherwise.
+ */
+gboolean
+gis_unattended_config_get_cache (GisUnattendedConfig   *self,
+                                 const gchar          **directory,
+                                 guint64               *max_size,
+                                 guint                 *max_entries,
+                                 GisImageCacheEviction *eviction)
+{
+  if (!self->cache)
+    return FALSE;
+
+  if (directory != NULL)
+    *directory = self->cache_directory;
+  if (max_size != NULL)
+    *max_size = self->cache_max_size;
+  if (max_entries != NULL)
+    *max_entries = self->cache_max_entries;
+  if (eviction != NULL)
+    *eviction = self->cache_eviction;
+
+  return TRUE;
+}
+
 /**
  * gis_unattended_config_match_computer:
  * @vendor: (nullable): the current computer's vendor, or %NULL if it could not
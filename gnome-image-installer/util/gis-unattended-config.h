@@ -21,6 +21,8 @@
 
 #include <gio/gio.h>
 
+#include "gis-image-cache.h"
+
 G_BEGIN_DECLS
 
 GQuark gis_unattended_error_quark (void);
@@ -40,6 +42,10 @@ GQuark gis_unattended_error_quark (void);
  *  found (or none matching the [Image...] definition, if provided)
  * @GIS_UNATTENDED_ERROR_DEVICE_AMBIGUOUS: more than one suitable block device
  *  was found
+ * @GIS_UNATTENDED_ERROR_INVALID_BATCH: the [Batch] section in unattended.ini
+ *  had incorrect fields
+ * @GIS_UNATTENDED_ERROR_INVALID_CACHE: the [Cache] section in unattended.ini
+ *  had incorrect fields
  */
 typedef enum {
     GIS_UNATTENDED_ERROR_READ,
@@ -49,6 +55,8 @@ typedef enum {
     GIS_UNATTENDED_ERROR_IMAGE_AMBIGUOUS,
     GIS_UNATTENDED_ERROR_DEVICE_NOT_FOUND,
     GIS_UNATTENDED_ERROR_DEVICE_AMBIGUOUS,
+    GIS_UNATTENDED_ERROR_INVALID_BATCH,
+    GIS_UNATTENDED_ERROR_INVALID_CACHE,
 } GisUnattendedError;
 
 #define GIS_TYPE_UNATTENDED_CONFIG (gis_unattended_config_get_type ())
@@ -79,9 +87,23 @@ const gchar *gis_unattended_config_get_locale (GisUnattendedConfig *self);
 
 const gchar *gis_unattended_config_get_image (GisUnattendedConfig *self);
 
+gboolean gis_unattended_config_check_images (GisUnattendedConfig *self,
+                                             guint n_images,
+                                             GError **error);
+
 gboolean gis_unattended_config_matches_device (GisUnattendedConfig *self,
                                                const gchar *device);
 
+gboolean gis_unattended_config_is_batch (GisUnattendedConfig *self);
+
+guint gis_unattended_config_get_max_concurrent_writes (GisUnattendedConfig *self);
+
+gboolean gis_unattended_config_get_cache (GisUnattendedConfig   *self,
+                                          const gchar          **directory,
+                                          guint64               *max_size,
+                                          guint                 *max_entries,
+                                          GisImageCacheEviction *eviction);
+
 GisUnattendedComputerMatch gis_unattended_config_match_computer (GisUnattendedConfig *self,
                                                                  const gchar *vendor,
                                                                  const gchar *product);
@@ -162,6 +162,16 @@ static uint64_t get_disk_size(struct ptable *pt)
         pt->header.last_usable_lba * SECTOR_SIZE; // rest of the usable disk size
 }
 
+//  crc32 of header, with 'crc' field zero'ed
+static int is_gpt_header_crc_valid(const struct gpt_header *header)
+{
+    struct gpt_header testcrc_header;
+    memset(&testcrc_header, 0, GPT_HEADER_SIZE);
+    memcpy(&testcrc_header, header, GPT_HEADER_SIZE);
+    testcrc_header.crc = 0;
+    return calc_crc32((uint8_t*)(&testcrc_header), GPT_HEADER_SIZE) == header->crc;
+}
+
 /**
  * is_eos_gpt_valid:
  * @size: (out) (optional): location to store the disk size, in bytes, if the
@@ -214,12 +224,7 @@ int is_eos_gpt_valid(struct ptable *pt, uint64_t *size)
             return 0;
         }
     }
-    //  crc32 of header, with 'crc' field zero'ed
-    struct gpt_header testcrc_header;
-    memset(&testcrc_header, 0, GPT_HEADER_SIZE);
-    memcpy(&testcrc_header, &pt->header, GPT_HEADER_SIZE);
-    testcrc_header.crc = 0;
-    if(calc_crc32((uint8_t*)(&testcrc_header), GPT_HEADER_SIZE)!=pt->header.crc) {
+    if(!is_gpt_header_crc_valid(&pt->header)) {
         g_warning("invalid header crc");
         return 0;
     }
@@ -288,3 +293,81 @@ int get_is_valid_eos_gpt(const char *filepath, uint64_t *size)
     fclose(in_file);
     return 0;
 }
+
+/**
+ * is_gpt_ptable_valid:
+ * @header: a GPT header which has passed is_eos_gpt_valid(), or the backup
+ *  header
+ * @ptable: the whole partition table described by @header
+ * @len: the length of @ptable, in bytes
+ *
+ * Unlike is_eos_gpt_valid(), which only sees the first few entries, checks the
+ * CRC of every entry in the partition table.
+ *
+ * Returns: 1 if the partition table is valid, 0 otherwise
+ */
+int is_gpt_ptable_valid(const struct gpt_header *header, const uint8_t *ptable, size_t len)
+{
+    if(NULL==header || NULL==ptable) return 0;
+
+    if((uint64_t)header->ptable_count * header->ptable_partition_size != len) {
+        g_warning("partition table has the wrong size");
+        return 0;
+    }
+    if(calc_crc32(ptable, len) != header->ptable_crc) {
+        g_warning("invalid partition table crc");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * is_gpt_backup_valid:
+ * @primary: a GPT header which has passed is_eos_gpt_valid()
+ * @backup: the header at @primary's backup_lba
+ *
+ * Checks that @backup is a valid backup of @primary: it must point back at
+ * @primary, and describe the same disk and partition table.
+ *
+ * Returns: 1 if the backup header is valid, 0 otherwise
+ */
+int is_gpt_backup_valid(const struct gpt_header *primary, const struct gpt_header *backup)
+{
+    if(NULL==primary || NULL==backup) return 0;
+
+    if(memcmp(backup->signature, "EFI PART", 8)!=0) {
+        g_warning("invalid backup signature");
+        return 0;
+    }
+    if(backup->header_size != GPT_HEADER_SIZE) {
+        g_warning("invalid backup header size");
+        return 0;
+    }
+    if(!is_gpt_header_crc_valid(backup)) {
+        g_warning("invalid backup header crc");
+        return 0;
+    }
+    if(backup->current_lba != primary->backup_lba ||
+       backup->backup_lba != primary->current_lba) {
+        g_warning("backup header is in the wrong place");
+        return 0;
+    }
+    if(backup->revision != primary->revision ||
+       backup->first_usable_lba != primary->first_usable_lba ||
+       backup->last_usable_lba != primary->last_usable_lba ||
+       memcmp(backup->disk_guid, primary->disk_guid, 16)!=0 ||
+       backup->ptable_count != primary->ptable_count ||
+       backup->ptable_partition_size != primary->ptable_partition_size ||
+       backup->ptable_crc != primary->ptable_crc) {
+        g_warning("backup header does not match primary header");
+        return 0;
+    }
+    // The backup partition table lies between the last usable LBA and the
+    // backup header.
+    if(backup->ptable_starting_lba <= primary->last_usable_lba ||
+       backup->ptable_starting_lba >= backup->current_lba) {
+        g_warning("backup partition table is in the wrong place");
+        return 0;
+    }
+    return 1;
+}
@@ -64,6 +64,8 @@ struct ptable {
 } __attribute__((packed));
 
 int is_eos_gpt_valid(struct ptable *pt, uint64_t *size);
+int is_gpt_ptable_valid(const struct gpt_header *header, const uint8_t *ptable, size_t len);
+int is_gpt_backup_valid(const struct gpt_header *primary, const struct gpt_header *backup);
 uint8_t is_nth_flag_set(uint64_t flags, uint8_t n);
 
 // helper function
@@ -0,0 +1,722 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures how fast GisScribe writes different kinds of image to different
+ * kinds of target, so that changes to the pipeline can be compared. For each
+ * combination of --content, --format and --target, an image of --size MiB is
+ * generated, written, and checked against its SHA-256 checksum.
+ *
+ * For each write, a line of JSON is printed to stdout in the format of
+ * gis_install_record_new(), with the rate of each stage in bytes per second,
+ * plus "content" and "target" saying what was written where, and "rate", the
+ * end-to-end rate in bytes of uncompressed image per second. A summary in
+ * MB/s is printed to stderr.
+ *
+ * The images have just been generated, so are usually read from the page
+ * cache: this measures the pipeline, not the disk that the images are on.
+ *
+ * Run with `meson test --benchmark`, passing options with --test-args, or
+ * run benchmark-scribe --help directly.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "gis-install-record.h"
+#include "gis-scribe.h"
+#include "gis-squashfs-reader.h"
+#include "glnx-errors.h"
+#include "glnx-missing.h"
+#include "glnx-shutil.h"
+
+#define MiB (1024 * 1024)
+/* Size of each run of one kind of data in a "mixed" image */
+#define EXTENT_SIZE (64 * 1024)
+
+static const gchar * const contents[] = {
+  /* Compresses to almost nothing, and is skipped when writing to a file */
+  "zeros",
+  /* Doesn't compress at all */
+  "random",
+  /* Roughly like an OS image: runs of free space, of files which are already
+   * compressed, and of text and code.
+   */
+  "mixed",
+  NULL
+};
+
+/* Named as gis_install_record_get_image_format() names them */
+static const gchar * const formats[] = {
+  "raw",
+  "gz",
+  "xz",
+  "squashfs",
+  "split-gz",
+  "split-xz",
+  NULL
+};
+
+static const gchar * const targets[] = {
+  /* A sparse file next to the images */
+  "file",
+  /* Writes cost nothing, so the other stages set the pace */
+  "null",
+  /* A memfd, which is a file on an internal tmpfs */
+  "tmpfs",
+  NULL
+};
+
+typedef struct {
+  GFile *image;
+  GFile *checksum;
+  guint64 image_size;
+  guint64 compressed_size;
+} Image;
+
+static void
+image_clear (Image *image)
+{
+  g_clear_object (&image->image);
+  g_clear_object (&image->checksum);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (Image, image_clear)
+
+/* xorshift64*: not remotely cryptographic, but random enough that the image
+ * doesn't compress, and much faster than g_random_int().
+ */
+static guint64
+next_random (guint64 *state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * G_GUINT64_CONSTANT (0x2545F4914F6CDD1D);
+}
+
+static void
+fill_random (guint8  *data,
+             gsize    len,
+             guint64 *state)
+{
+  gsize i;
+
+  for (i = 0; i < len; i += sizeof (guint64))
+    {
+      guint64 r = next_random (state);
+
+      memcpy (data + i, &r, MIN (sizeof (r), len - i));
+    }
+}
+
+static void
+fill_text (guint8  *data,
+           gsize    len,
+           guint64 *state)
+{
+  static const gchar * const words[] = {
+    "the", "image", "is", "written", "to", "disk", "while", "its",
+    "signature", "verified", "in", "parallel", "static", "void", "return",
+    "if", "else", "for", "#include", "<glib.h>", "{", "}", "(", ");",
+  };
+  gsize i = 0;
+
+  while (i < len)
+    {
+      guint64 r = next_random (state);
+      const gchar *word = words[r % G_N_ELEMENTS (words)];
+      gsize n = MIN (strlen (word), len - i);
+
+      memcpy (data + i, word, n);
+      i += n;
+
+      if (i < len)
+        data[i++] = (r >> 32) % 8 == 0 ? '\n' : ' ';
+    }
+}
+
+static void
+fill_chunk (const gchar *content,
+            guint8      *data,
+            gsize        len,
+            guint64     *state)
+{
+  gsize i;
+
+  if (g_str_equal (content, "zeros"))
+    {
+      memset (data, 0, len);
+      return;
+    }
+
+  if (g_str_equal (content, "random"))
+    {
+      fill_random (data, len, state);
+      return;
+    }
+
+  for (i = 0; i < len; i += EXTENT_SIZE)
+    {
+      gsize n = MIN (EXTENT_SIZE, len - i);
+      guint64 r = next_random (state) % 10;
+
+      if (r < 4)
+        memset (data + i, 0, n);
+      else if (r < 7)
+        fill_random (data + i, n, state);
+      else
+        fill_text (data + i, n, state);
+    }
+}
+
+/* Writes @size bytes of @content to @path. The same content and size always
+ * give the same image.
+ */
+static gboolean
+generate_raw_image (const gchar *path,
+                    const gchar *content,
+                    guint64      size,
+                    GError     **error)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(GFileOutputStream) output = NULL;
+  g_autofree guint8 *buffer = g_malloc (MiB);
+  guint64 state = G_GUINT64_CONSTANT (0x853c49e6748fea9b);
+  guint64 written = 0;
+
+  output = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                           NULL, error);
+  if (output == NULL)
+    return FALSE;
+
+  while (written < size)
+    {
+      gsize len = MIN (MiB, size - written);
+
+      fill_chunk (content, buffer, len, &state);
+      if (!g_output_stream_write_all (G_OUTPUT_STREAM (output), buffer, len,
+                                      NULL, NULL, error))
+        return FALSE;
+
+      written += len;
+    }
+
+  return g_output_stream_close (G_OUTPUT_STREAM (output), NULL, error);
+}
+
+static gboolean
+run (GError **error,
+     const gchar *argv0,
+     ...)
+{
+  g_autoptr(GPtrArray) argv = g_ptr_array_new ();
+  g_autoptr(GSubprocess) subprocess = NULL;
+  const gchar *arg;
+  va_list ap;
+
+  g_ptr_array_add (argv, (gpointer) argv0);
+  va_start (ap, argv0);
+  while ((arg = va_arg (ap, const gchar *)) != NULL)
+    g_ptr_array_add (argv, (gpointer) arg);
+  va_end (ap);
+  g_ptr_array_add (argv, NULL);
+
+  subprocess = g_subprocess_newv ((const gchar * const *) argv->pdata,
+                                  G_SUBPROCESS_FLAGS_NONE, error);
+
+  return subprocess != NULL && g_subprocess_wait_check (subprocess, NULL, error);
+}
+
+/* Writes the SHA-256 checksum of @path to @checksum_path, in the format of
+ * sha256sum's output.
+ */
+static gboolean
+write_checksum (const gchar *path,
+                const gchar *checksum_path,
+                GError     **error)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(GFileInputStream) input = g_file_read (file, NULL, error);
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree guint8 *buffer = g_malloc (MiB);
+  g_autofree gchar *basename = g_path_get_basename (path);
+  g_autofree gchar *contents = NULL;
+  gssize r;
+
+  if (input == NULL)
+    return FALSE;
+
+  while ((r = g_input_stream_read (G_INPUT_STREAM (input), buffer, MiB,
+                                   NULL, error)) > 0)
+    g_checksum_update (checksum, buffer, r);
+
+  if (r < 0)
+    return FALSE;
+
+  contents = g_strdup_printf ("%s  %s\n", g_checksum_get_string (checksum),
+                              basename);
+  return g_file_set_contents (checksum_path, contents, -1, error);
+}
+
+/* Produces @format of the image at @raw_path, named after it, and its
+ * checksum. The compressors use the same settings as for the test images,
+ * which are quick to generate; images compressed harder are not much slower
+ * to decompress.
+ */
+static gboolean
+make_image (const gchar *srcdir,
+            const gchar *raw_path,
+            const gchar *format,
+            guint64      image_size,
+            Image       *image,
+            GError     **error)
+{
+  g_autofree gchar *path = NULL;
+  g_autofree gchar *checksum_path = NULL;
+  g_autoptr(GFileInfo) info = NULL;
+
+  if (g_str_equal (format, "raw"))
+    {
+      path = g_strdup (raw_path);
+    }
+  else if (g_str_equal (format, "gz"))
+    {
+      path = g_strconcat (raw_path, ".gz", NULL);
+      if (!run (error, "gzip", "-1", "--keep", "--force", raw_path, NULL))
+        return FALSE;
+    }
+  else if (g_str_equal (format, "xz"))
+    {
+      path = g_strconcat (raw_path, ".xz", NULL);
+      if (!run (error, "xz", "-0", "--keep", "--force", raw_path, NULL))
+        return FALSE;
+    }
+  else if (g_str_equal (format, "squashfs"))
+    {
+      g_autofree gchar *script =
+        g_build_filename (srcdir, "make-fake-squashfs", NULL);
+
+      path = g_strconcat (raw_path, ".squash", NULL);
+      if (!run (error, script, "--compression", "xz", raw_path, path, NULL))
+        return FALSE;
+    }
+  else
+    {
+      const gchar *compression =
+        g_str_equal (format, "split-gz") ? "gzip" : "xz";
+      g_autofree gchar *script =
+        g_build_filename (srcdir, "make-fake-split-image", NULL);
+      /* foo.img becomes foo-split.img.xz.000, foo-split.img.xz.001, … */
+      g_autofree gchar *base =
+        g_strdup_printf ("%.*s-split.img.%s",
+                         (int) (strlen (raw_path) - strlen (".img")), raw_path,
+                         g_str_equal (format, "split-gz") ? "gz" : "xz");
+
+      /* The checksum is the manifest, and the image is the first part */
+      checksum_path = g_strconcat (base, ".sha256", NULL);
+      path = g_strconcat (base, ".000", NULL);
+      if (!run (error, script, "--compression", compression, raw_path,
+                checksum_path, NULL))
+        return FALSE;
+    }
+
+  image->image = g_file_new_for_path (path);
+
+  /* The scribe reads the image within a squashfs, so its checksum is for that
+   * image, which is also what the "compressed" size is of; see
+   * GisScribe:compressed-size.
+   */
+  if (checksum_path == NULL)
+    {
+      checksum_path = g_strconcat (path, ".sha256", NULL);
+      if (!write_checksum (gis_squashfs_reader_is_squashfs (image->image)
+                             ? raw_path : path,
+                           checksum_path, error))
+        return FALSE;
+    }
+
+  image->checksum = g_file_new_for_path (checksum_path);
+  image->image_size = image_size;
+
+  /* Likewise, progress through a split image is measured by the uncompressed
+   * size.
+   */
+  if (gis_squashfs_reader_is_squashfs (image->image) ||
+      g_str_has_prefix (format, "split-"))
+    {
+      image->compressed_size = image_size;
+    }
+  else
+    {
+      info = g_file_query_info (image->image, G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                G_FILE_QUERY_INFO_NONE, NULL, error);
+      if (info == NULL)
+        return FALSE;
+
+      image->compressed_size = g_file_info_get_size (info);
+    }
+
+  return TRUE;
+}
+
+static gint
+open_target (const gchar *target,
+             const gchar *target_path,
+             GError     **error)
+{
+  gint fd;
+
+  if (g_str_equal (target, "file"))
+    {
+      (void) unlink (target_path);
+      fd = open (target_path, O_WRONLY | O_CLOEXEC | O_CREAT | O_EXCL, 0644);
+    }
+  else if (g_str_equal (target, "null"))
+    {
+      fd = open ("/dev/null", O_WRONLY | O_CLOEXEC);
+    }
+  else
+    {
+      fd = memfd_create ("benchmark-target", MFD_CLOEXEC);
+    }
+
+  if (fd < 0)
+    glnx_throw_errno_prefix (error, "can't open %s target", target);
+
+  return fd;
+}
+
+static void
+write_cb (GObject      *source,
+          GAsyncResult *result,
+          gpointer      data)
+{
+  GAsyncResult **result_out = data;
+
+  *result_out = g_object_ref (result);
+}
+
+static void
+print_summary (const gchar *content,
+               const gchar *format,
+               const gchar *target,
+               GVariant    *result)
+{
+  g_autoptr(GString) summary = g_string_new (NULL);
+  g_autoptr(GVariant) stages = NULL;
+  const gchar *outcome = "failure";
+  const gchar *bottleneck;
+  guint64 rate = 0;
+  GVariantIter iter;
+  const gchar *label;
+  GVariant *stage;
+
+  g_variant_lookup (result, "outcome", "&s", &outcome);
+  g_string_append_printf (summary, "%-6s %-8s %-5s ", content, format, target);
+
+  if (!g_str_equal (outcome, "success"))
+    {
+      const gchar *message = outcome;
+
+      g_variant_lookup (result, "error-message", "&s", &message);
+      g_printerr ("%s%s\n", summary->str, message);
+      return;
+    }
+
+  g_variant_lookup (result, "rate", "t", &rate);
+  g_string_append_printf (summary, "%8.1f MB/s", rate / 1e6);
+
+  stages = g_variant_lookup_value (result, "stages",
+                                   G_VARIANT_TYPE ("a{sa{sv}}"));
+  g_variant_iter_init (&iter, stages);
+  while (g_variant_iter_loop (&iter, "{&s@a{sv}}", &label, &stage))
+    {
+      guint64 stage_rate;
+
+      if (g_variant_lookup (stage, "rate", "t", &stage_rate))
+        g_string_append_printf (summary, "; %s %.1f", label, stage_rate / 1e6);
+    }
+
+  if (g_variant_lookup (result, "bottleneck", "&s", &bottleneck))
+    g_string_append_printf (summary, " (bottleneck: %s)", bottleneck);
+
+  g_printerr ("%s\n", summary->str);
+}
+
+/* Writes @image to a new @target, returning the result to print */
+static GVariant *
+run_benchmark (const Image *image,
+               const gchar *content,
+               const gchar *target,
+               const gchar *dir)
+{
+  g_autofree gchar *target_path = g_build_filename (dir, "target.img", NULL);
+  g_autofree gchar *checksum_path = g_file_get_path (image->checksum);
+  g_autofree gchar *signature_path = NULL;
+  g_autoptr(GFile) signature = NULL;
+  g_autoptr(GisScribe) scribe = NULL;
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GVariant) metrics = NULL;
+  g_autoptr(GVariant) record = NULL;
+  g_autoptr(GError) error = NULL;
+  GVariantBuilder builder;
+  GVariantIter iter;
+  GVariant *child;
+  gint64 elapsed_usec = 0;
+  gint fd;
+
+  fd = open_target (target, target_path, &error);
+  if (fd >= 0)
+    {
+      /* There is no signature, so the checksum is used */
+      signature_path = g_strconcat (checksum_path, ".asc", NULL);
+      signature = g_file_new_for_path (signature_path);
+      scribe = gis_scribe_new (image->image,
+                               image->image_size,
+                               image->compressed_size,
+                               signature,
+                               image->checksum,
+                               target_path,
+                               fd,
+                               FALSE);
+
+      gis_scribe_write_async (scribe, NULL, write_cb, &result);
+      while (result == NULL)
+        g_main_context_iteration (NULL, TRUE);
+
+      gis_scribe_write_finish (scribe, result, &error);
+      metrics = gis_scribe_dup_metrics (scribe);
+
+      if (g_str_equal (target, "file"))
+        (void) unlink (target_path);
+    }
+
+  record = gis_install_record_new (content,
+                                   gis_install_record_get_image_format (image->image),
+                                   image->image_size,
+                                   image->compressed_size,
+                                   NULL,
+                                   NULL,
+                                   NULL,
+                                   metrics,
+                                   error);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "content",
+                         g_variant_new_string (content));
+  g_variant_builder_add (&builder, "{sv}", "target",
+                         g_variant_new_string (target));
+  if (error == NULL &&
+      g_variant_lookup (metrics, "elapsed-usec", "x", &elapsed_usec) &&
+      elapsed_usec > 0)
+    g_variant_builder_add (&builder, "{sv}", "rate",
+                           g_variant_new_uint64 (image->image_size *
+                                                 (gdouble) G_USEC_PER_SEC /
+                                                 elapsed_usec));
+
+  g_variant_iter_init (&iter, record);
+  while ((child = g_variant_iter_next_value (&iter)) != NULL)
+    {
+      g_variant_builder_add_value (&builder, child);
+      g_variant_unref (child);
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/* Splits @list, a comma-separated subset of @all, or %NULL for all of them */
+static gchar **
+parse_list (const gchar        *option,
+            const gchar        *list,
+            const gchar * const *all,
+            GError            **error)
+{
+  g_auto(GStrv) names = NULL;
+  gsize i;
+
+  if (list == NULL)
+    return g_strdupv ((gchar **) all);
+
+  names = g_strsplit (list, ",", -1);
+  for (i = 0; names[i] != NULL; i++)
+    {
+      if (!g_strv_contains (all, names[i]))
+        {
+          g_autofree gchar *valid = g_strjoinv (", ", (gchar **) all);
+
+          g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                       "unknown %s ‘%s’: expected one or more of %s",
+                       option, names[i], valid);
+          return NULL;
+        }
+    }
+
+  return g_steal_pointer (&names);
+}
+
+int
+main (int argc, char *argv[])
+{
+  gint size_mib = 64;
+  g_autofree gchar *content_list = NULL;
+  g_autofree gchar *format_list = NULL;
+  g_autofree gchar *target_list = NULL;
+  g_autofree gchar *dir = NULL;
+  GOptionEntry entries[] = {
+    { "size", 0, 0, G_OPTION_ARG_INT, &size_mib,
+      "Size of each image, uncompressed (default: 64)", "MiB" },
+    { "content", 0, 0, G_OPTION_ARG_STRING, &content_list,
+      "What to fill the images with (default: zeros,random,mixed)", "LIST" },
+    { "format", 0, 0, G_OPTION_ARG_STRING, &format_list,
+      "Formats to write the images in "
+      "(default: raw,gz,xz,squashfs,split-gz,split-xz)", "LIST" },
+    { "target", 0, 0, G_OPTION_ARG_STRING, &target_list,
+      "What to write the images to (default: file,null,tmpfs)", "LIST" },
+    { "dir", 0, 0, G_OPTION_ARG_FILENAME, &dir,
+      "Directory for the images and the file target, which is kept "
+      "afterwards (default: a temporary directory in the working directory)",
+      "DIR" },
+    { NULL }
+  };
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_auto(GStrv) content_names = NULL;
+  g_auto(GStrv) format_names = NULL;
+  g_auto(GStrv) target_names = NULL;
+  g_autofree gchar *srcdir = NULL;
+  gboolean remove_dir = FALSE;
+  gboolean failed = FALSE;
+  gsize c, f, t;
+
+  setlocale (LC_ALL, "");
+
+  context = g_option_context_new (NULL);
+  g_option_context_set_summary (context,
+      "Measures how fast images of each content and format are written to "
+      "each target.");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error) ||
+      (content_names = parse_list ("content", content_list, contents,
+                                   &error)) == NULL ||
+      (format_names = parse_list ("format", format_list, formats,
+                                  &error)) == NULL ||
+      (target_names = parse_list ("target", target_list, targets,
+                                  &error)) == NULL)
+    {
+      g_printerr ("%s: %s\n", g_get_prgname (), error->message);
+      return 2;
+    }
+
+  if (size_mib <= 0)
+    {
+      g_printerr ("%s: --size must be positive\n", g_get_prgname ());
+      return 2;
+    }
+
+  /* The scripts which generate the test images */
+  if (g_getenv ("G_TEST_SRCDIR") != NULL)
+    srcdir = g_strdup (g_getenv ("G_TEST_SRCDIR"));
+  else
+    srcdir = g_path_get_dirname (argv[0]);
+
+  if (dir == NULL)
+    {
+      dir = g_strdup ("benchmark-scribe.XXXXXX");
+      if (g_mkdtemp (dir) == NULL)
+        {
+          g_printerr ("%s: can't create %s: %s\n", g_get_prgname (), dir,
+                      g_strerror (errno));
+          return 1;
+        }
+
+      remove_dir = TRUE;
+    }
+  else if (g_mkdir_with_parents (dir, 0755) < 0)
+    {
+      g_printerr ("%s: can't create %s: %s\n", g_get_prgname (), dir,
+                  g_strerror (errno));
+      return 1;
+    }
+
+  for (c = 0; content_names[c] != NULL; c++)
+    {
+      const gchar *content = content_names[c];
+      g_autofree gchar *basename = g_strdup_printf ("%s.img", content);
+      g_autofree gchar *raw_path = g_build_filename (dir, basename, NULL);
+      guint64 image_size = (guint64) size_mib * MiB;
+
+      if (!generate_raw_image (raw_path, content, image_size, &error))
+        {
+          g_printerr ("%s: can't generate %s image: %s\n", g_get_prgname (),
+                      content, error->message);
+          g_clear_error (&error);
+          failed = TRUE;
+          continue;
+        }
+
+      for (f = 0; format_names[f] != NULL; f++)
+        {
+          const gchar *format = format_names[f];
+          g_auto(Image) image = { NULL, };
+
+          if (!make_image (srcdir, raw_path, format, image_size, &image,
+                           &error))
+            {
+              g_printerr ("%s: can't make %s %s image: %s\n",
+                          g_get_prgname (), content, format, error->message);
+              g_clear_error (&error);
+              failed = TRUE;
+              continue;
+            }
+
+          for (t = 0; target_names[t] != NULL; t++)
+            {
+              const gchar *target = target_names[t];
+              g_autoptr(GVariant) result = run_benchmark (&image, content,
+                                                          target, dir);
+              g_autofree gchar *json = gis_install_record_to_json (result);
+              const gchar *outcome = NULL;
+
+              g_print ("%s\n", json);
+              print_summary (content, format, target, result);
+
+              if (!g_variant_lookup (result, "outcome", "&s", &outcome) ||
+                  !g_str_equal (outcome, "success"))
+                failed = TRUE;
+            }
+        }
+    }
+
+  if (remove_dir && !glnx_shutil_rm_rf_at (AT_FDCWD, dir, NULL, &error))
+    g_printerr ("%s: can't remove %s: %s\n", g_get_prgname (), dir,
+                error->message);
+
+  return failed ? 1 : 0;
+}
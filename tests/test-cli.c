@@ -0,0 +1,298 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <locale.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "crc32.h"
+#include "gpt.h"
+#include "glnx-shutil.h"
+
+/* 4 MiB, with the GPT at either end, as in test-seekable-image.c */
+#define N_SECTORS 8192
+#define IMAGE_SIZE (N_SECTORS * SECTOR_SIZE)
+#define PTABLE_COUNT 128
+#define PTABLE_SECTORS (PTABLE_COUNT * GPT_PART_SIZE / SECTOR_SIZE)
+#define FIRST_USABLE_LBA (2 + PTABLE_SECTORS)
+#define LAST_USABLE_LBA (N_SECTORS - 2 - PTABLE_SECTORS)
+#define BACKUP_PTABLE_LBA (LAST_USABLE_LBA + 1)
+
+/* Exit statuses of eos-installer-cli */
+#define EXIT_STATUS_SUCCESS 0
+#define EXIT_STATUS_INVALID_IMAGE 3
+
+static const guint8 GUID_EFI[] = {
+  0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8, 0xd2, 0x11,
+  0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b,
+};
+static const guint8 GUID_LINUX_ROOTFS_X86_64[] = {
+  0xe3, 0xbc, 0x68, 0x4f, 0xcd, 0xe8, 0xb1, 0x4d,
+  0x96, 0xe7, 0xfb, 0xca, 0xf9, 0x84, 0xb7, 0x09,
+};
+
+typedef struct {
+  guint8 *image;
+  gchar *tmpdir;
+  gchar *image_path;
+  gchar *target_path;
+} Fixture;
+
+static struct gpt_header *
+get_header (Fixture *fixture,
+            guint64  lba)
+{
+  return (struct gpt_header *) (fixture->image + lba * SECTOR_SIZE);
+}
+
+/* Fills in the CRCs of the header at @lba, and of its partition table. */
+static void
+update_crcs (Fixture *fixture,
+             guint64  lba)
+{
+  struct gpt_header *header = get_header (fixture, lba);
+
+  header->ptable_crc =
+    calc_crc32 (fixture->image + header->ptable_starting_lba * SECTOR_SIZE,
+                PTABLE_COUNT * GPT_PART_SIZE);
+  header->crc = 0;
+  header->crc = calc_crc32 (header, GPT_HEADER_SIZE);
+}
+
+/* Builds an image with an ESP and an Endless OS root partition, which is
+ * enough for eos-installer-cli to accept it, and writes it to image_path.
+ * Between the GPTs, each 32-bit word holds its own offset.
+ */
+static void
+fixture_set_up (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  struct gpt_header *primary, *backup;
+  struct gpt_partition *partitions;
+  g_autoptr(GError) error = NULL;
+  guint32 *words;
+  gsize i;
+
+  fixture->image = g_malloc0 (IMAGE_SIZE);
+
+  words = (guint32 *) (fixture->image + FIRST_USABLE_LBA * SECTOR_SIZE);
+  for (i = 0; i < (LAST_USABLE_LBA + 1 - FIRST_USABLE_LBA) * SECTOR_SIZE / 4; i++)
+    words[i] = FIRST_USABLE_LBA * SECTOR_SIZE + i * 4;
+
+  partitions = (struct gpt_partition *) (fixture->image + 2 * SECTOR_SIZE);
+  memcpy (partitions[0].type_guid, GUID_EFI, 16);
+  partitions[0].first_lba = FIRST_USABLE_LBA;
+  partitions[0].last_lba = 2047;
+  memcpy (partitions[1].type_guid, GUID_LINUX_ROOTFS_X86_64, 16);
+  partitions[1].first_lba = 2048;
+  partitions[1].last_lba = LAST_USABLE_LBA;
+  /* Flag 55 */
+  partitions[1].attributes[6] = 0x80;
+  memcpy (fixture->image + BACKUP_PTABLE_LBA * SECTOR_SIZE, partitions,
+          PTABLE_COUNT * GPT_PART_SIZE);
+
+  primary = get_header (fixture, 1);
+  memcpy (primary->signature, "EFI PART", 8);
+  primary->revision = 0x00010000;
+  primary->header_size = GPT_HEADER_SIZE;
+  primary->current_lba = 1;
+  primary->backup_lba = N_SECTORS - 1;
+  primary->first_usable_lba = FIRST_USABLE_LBA;
+  primary->last_usable_lba = LAST_USABLE_LBA;
+  memset (primary->disk_guid, 0x42, 16);
+  primary->ptable_starting_lba = 2;
+  primary->ptable_count = PTABLE_COUNT;
+  primary->ptable_partition_size = GPT_PART_SIZE;
+
+  backup = get_header (fixture, N_SECTORS - 1);
+  memcpy (backup, primary, SECTOR_SIZE);
+  backup->current_lba = N_SECTORS - 1;
+  backup->backup_lba = 1;
+  backup->ptable_starting_lba = BACKUP_PTABLE_LBA;
+
+  update_crcs (fixture, 1);
+  update_crcs (fixture, N_SECTORS - 1);
+
+  fixture->tmpdir = g_dir_make_tmp ("eos-installer.XXXXXX", &error);
+  g_assert_no_error (error);
+
+  fixture->image_path = g_build_filename (fixture->tmpdir, "endless.img", NULL);
+  fixture->target_path = g_build_filename (fixture->tmpdir, "target.img", NULL);
+  g_file_set_contents (fixture->image_path, (const gchar *) fixture->image,
+                       IMAGE_SIZE, &error);
+  g_assert_no_error (error);
+
+  /* eos-installer-cli writes to an existing target, as it would to a disk */
+  g_file_set_contents (fixture->target_path, "", 0, &error);
+  g_assert_no_error (error);
+}
+
+static void
+fixture_tear_down (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, fixture->tmpdir, NULL, &error))
+    g_warning ("Failed to remove %s: %s", fixture->tmpdir, error->message);
+
+  g_clear_pointer (&fixture->tmpdir, g_free);
+  g_clear_pointer (&fixture->image_path, g_free);
+  g_clear_pointer (&fixture->target_path, g_free);
+  g_clear_pointer (&fixture->image, g_free);
+}
+
+/* Writes the checksum of the (uncompressed) image to @path */
+static void
+write_checksum (Fixture     *fixture,
+                const gchar *path)
+{
+  g_autofree gchar *checksum =
+    g_compute_checksum_for_data (G_CHECKSUM_SHA256, fixture->image,
+                                 IMAGE_SIZE);
+  g_autofree gchar *contents = g_strdup_printf ("%s  endless.img\n", checksum);
+  g_autoptr(GError) error = NULL;
+
+  g_file_set_contents (path, contents, -1, &error);
+  g_assert_no_error (error);
+}
+
+/* Runs eos-installer-cli with @image and the fixture's target, returning its
+ * exit status.
+ */
+static gint
+run_cli (Fixture     *fixture,
+         const gchar *image)
+{
+  const gchar *cli = g_getenv ("EOS_INSTALLER_CLI");
+  g_autoptr(GSubprocess) subprocess = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_assert_nonnull (cli);
+  subprocess = g_subprocess_new (G_SUBPROCESS_FLAGS_NONE, &error,
+                                 cli, "--quiet", image, fixture->target_path,
+                                 NULL);
+  g_assert_no_error (error);
+
+  g_subprocess_wait (subprocess, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (g_subprocess_get_if_exited (subprocess));
+
+  return g_subprocess_get_exit_status (subprocess);
+}
+
+static void
+assert_image_written (Fixture *fixture)
+{
+  g_autofree gchar *contents = NULL;
+  gsize length = 0;
+  g_autoptr(GError) error = NULL;
+
+  g_file_get_contents (fixture->target_path, &contents, &length, &error);
+  g_assert_no_error (error);
+  g_assert_cmpmem (contents, length, fixture->image, IMAGE_SIZE);
+}
+
+static void
+test_raw (Fixture      *fixture,
+          gconstpointer user_data)
+{
+  g_autofree gchar *checksum_path =
+    g_strconcat (fixture->image_path, ".sha256", NULL);
+
+  write_checksum (fixture, checksum_path);
+
+  g_assert_cmpint (run_cli (fixture, fixture->image_path), ==,
+                   EXIT_STATUS_SUCCESS);
+  assert_image_written (fixture);
+}
+
+/* The signature or checksum of a squashfs, at IMAGE.asc or IMAGE.sha256 by
+ * default, is for the image within it; and it is the size of that image which
+ * the scribe reads and verifies.
+ */
+static void
+test_squashfs (Fixture      *fixture,
+               gconstpointer user_data)
+{
+  g_autofree gchar *squashfs_path =
+    g_build_filename (fixture->tmpdir, "endless.squash", NULL);
+  g_autofree gchar *checksum_path =
+    g_strconcat (squashfs_path, ".sha256", NULL);
+  g_autofree gchar *script =
+    g_test_build_filename (G_TEST_DIST, "make-fake-squashfs", NULL);
+  g_autoptr(GSubprocess) subprocess = NULL;
+  g_autoptr(GError) error = NULL;
+
+  subprocess = g_subprocess_new (G_SUBPROCESS_FLAGS_NONE, &error,
+                                 script, fixture->image_path, squashfs_path,
+                                 NULL);
+  g_assert_no_error (error);
+  g_subprocess_wait_check (subprocess, NULL, &error);
+  g_assert_no_error (error);
+
+  write_checksum (fixture, checksum_path);
+
+  g_assert_cmpint (run_cli (fixture, squashfs_path), ==,
+                   EXIT_STATUS_SUCCESS);
+  assert_image_written (fixture);
+}
+
+/* Images without an Endless OS GPT are refused before anything is written */
+static void
+test_invalid_image (Fixture      *fixture,
+                    gconstpointer user_data)
+{
+  g_autofree gchar *contents = NULL;
+  gsize length = 0;
+  g_autoptr(GError) error = NULL;
+
+  memset (fixture->image, 0, SECTOR_SIZE * 2);
+  g_file_set_contents (fixture->image_path, (const gchar *) fixture->image,
+                       IMAGE_SIZE, NULL);
+
+  g_assert_cmpint (run_cli (fixture, fixture->image_path), ==,
+                   EXIT_STATUS_INVALID_IMAGE);
+
+  g_file_get_contents (fixture->target_path, &contents, &length, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (length, ==, 0);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+#define TEST(name, func) \
+  g_test_add ("/cli/" name, Fixture, NULL, \
+              fixture_set_up, func, fixture_tear_down)
+
+  TEST ("raw", test_raw);
+  TEST ("squashfs", test_squashfs);
+  TEST ("invalid-image", test_invalid_image);
+
+#undef TEST
+
+  return g_test_run ();
+}
@@ -0,0 +1,612 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <locale.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "gis-errors.h"
+#include "gis-http-image.h"
+#include "gis-image-reader.h"
+#include "glnx-shutil.h"
+
+/* Several times the reader's chunk size, and not a multiple of it */
+#define IMAGE_SIZE (11 * 1024 * 1024 + 123)
+
+/* A stand-in for an imaging server, serving files from memory on a random
+ * port on the loopback interface, with a thread per connection.
+ */
+typedef struct {
+  GSocketListener *listener;
+  GCancellable *cancellable;
+  GThread *accept_thread;
+  /* (element-type GThread): only used by .accept_thread until it exits */
+  GPtrArray *connection_threads;
+  guint16 port;
+  /* (element-type utf8 GBytes): path without the leading / to contents */
+  GHashTable *files;
+
+  /* Whether to honour Range headers */
+  gboolean ranges;
+  /* Whether to drop the connection instead of answering the first request
+   * for a range after the first byte
+   */
+  gboolean drop_once;
+
+  GMutex mutex;
+  /* Protected by .mutex */
+  guint n_requests;
+  guint n_range_requests;
+  guint n_active;
+  guint max_active;
+  gboolean dropped;
+} Server;
+
+typedef struct {
+  Server *server;
+  GSocketConnection *connection;
+} ServerConnection;
+
+typedef struct {
+  gchar *tmpdir;
+  Server server;
+  GBytes *image;
+} Fixture;
+
+static void
+write_response (GOutputStream *output,
+                guint          status,
+                const gchar   *extra_headers,
+                const guint8  *body,
+                gsize          body_len)
+{
+  g_autofree gchar *headers = NULL;
+
+  headers = g_strdup_printf ("HTTP/1.1 %u Whatever\r\n"
+                             "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+                             "%s"
+                             "\r\n",
+                             status, body_len, extra_headers);
+  g_output_stream_write_all (output, headers, strlen (headers), NULL, NULL,
+                             NULL);
+  g_output_stream_write_all (output, body, body_len, NULL, NULL, NULL);
+}
+
+/* Answers one request. Returns FALSE if the connection should be closed. */
+static gboolean
+server_handle_request (Server           *server,
+                       GDataInputStream *input,
+                       GOutputStream    *output)
+{
+  g_autofree gchar *request_line = NULL;
+  g_autofree gchar *range = NULL;
+  g_auto(GStrv) words = NULL;
+  const gchar *path;
+  GBytes *contents;
+  const guint8 *data;
+  gsize size;
+  guint64 start, end;
+  gboolean drop = FALSE;
+
+  request_line = g_data_input_stream_read_line (input, NULL, NULL, NULL);
+  if (request_line == NULL)
+    return FALSE;
+
+  for (;;)
+    {
+      g_autofree gchar *line =
+        g_data_input_stream_read_line (input, NULL, NULL, NULL);
+
+      if (line == NULL)
+        return FALSE;
+
+      g_strchomp (line);
+      if (*line == '\0')
+        break;
+
+      if (g_ascii_strncasecmp (line, "Range: ", strlen ("Range: ")) == 0)
+        range = g_strdup (line + strlen ("Range: "));
+    }
+
+  words = g_strsplit (g_strchomp (request_line), " ", -1);
+  g_assert_cmpuint (g_strv_length (words), ==, 3);
+  g_assert_cmpstr (words[0], ==, "GET");
+  g_assert_cmpstr (words[2], ==, "HTTP/1.1");
+  path = words[1];
+
+  g_mutex_lock (&server->mutex);
+  server->n_requests++;
+  if (range != NULL)
+    server->n_range_requests++;
+  server->n_active++;
+  server->max_active = MAX (server->max_active, server->n_active);
+  if (server->drop_once && !server->dropped && range != NULL &&
+      !g_str_equal (range, "bytes=0-0"))
+    drop = server->dropped = TRUE;
+  g_mutex_unlock (&server->mutex);
+
+  /* Give the other connections a chance to be busy at the same time. */
+  g_usleep (G_USEC_PER_SEC / 100);
+
+  if (drop)
+    goto out;
+
+  if (g_str_has_prefix (path, "/redirect/"))
+    {
+      g_autofree gchar *location =
+        g_strdup_printf ("Location: /%s\r\n", path + strlen ("/redirect/"));
+
+      write_response (output, 302, location, NULL, 0);
+      goto out;
+    }
+
+  contents = g_hash_table_lookup (server->files, path + 1);
+  if (contents == NULL)
+    {
+      write_response (output, 404, "", NULL, 0);
+      goto out;
+    }
+
+  data = g_bytes_get_data (contents, &size);
+  if (server->ranges && range != NULL &&
+      sscanf (range, "bytes=%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT,
+              &start, &end) == 2 &&
+      start <= end && start < size)
+    {
+      g_autofree gchar *content_range = NULL;
+
+      end = MIN (end, size - 1);
+      content_range =
+        g_strdup_printf ("Content-Range: bytes %" G_GUINT64_FORMAT
+                         "-%" G_GUINT64_FORMAT "/%" G_GSIZE_FORMAT "\r\n",
+                         start, end, size);
+      write_response (output, 206, content_range, data + start,
+                      end - start + 1);
+    }
+  else
+    {
+      write_response (output, 200, "", data, size);
+    }
+
+out:
+  g_mutex_lock (&server->mutex);
+  server->n_active--;
+  g_mutex_unlock (&server->mutex);
+
+  return !drop;
+}
+
+static gpointer
+server_connection_thread (gpointer user_data)
+{
+  ServerConnection *data = user_data;
+  GIOStream *stream = G_IO_STREAM (data->connection);
+  g_autoptr(GDataInputStream) input =
+    g_data_input_stream_new (g_io_stream_get_input_stream (stream));
+  GOutputStream *output = g_io_stream_get_output_stream (stream);
+
+  while (server_handle_request (data->server, input, output))
+    ;
+
+  g_io_stream_close (stream, NULL, NULL);
+  g_object_unref (data->connection);
+  g_slice_free (ServerConnection, data);
+
+  return NULL;
+}
+
+static gpointer
+server_accept_thread (gpointer user_data)
+{
+  Server *server = user_data;
+
+  for (;;)
+    {
+      g_autoptr(GError) error = NULL;
+      ServerConnection *data;
+      GSocketConnection *connection;
+
+      connection = g_socket_listener_accept (server->listener, NULL,
+                                             server->cancellable, &error);
+      if (connection == NULL)
+        {
+          g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+          return NULL;
+        }
+
+      data = g_slice_new0 (ServerConnection);
+      data->server = server;
+      data->connection = connection;
+      g_ptr_array_add (server->connection_threads,
+                       g_thread_new ("connection", server_connection_thread,
+                                     data));
+    }
+}
+
+static void
+server_start (Server *server)
+{
+  g_autoptr(GInetAddress) loopback =
+    g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  g_autoptr(GSocketAddress) address =
+    g_inet_socket_address_new (loopback, 0);
+  g_autoptr(GSocketAddress) effective_address = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+
+  g_mutex_init (&server->mutex);
+  server->ranges = TRUE;
+  server->files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                         (GDestroyNotify) g_bytes_unref);
+  server->connection_threads = g_ptr_array_new ();
+  server->cancellable = g_cancellable_new ();
+  server->listener = g_socket_listener_new ();
+
+  ret = g_socket_listener_add_address (server->listener, address,
+                                       G_SOCKET_TYPE_STREAM,
+                                       G_SOCKET_PROTOCOL_TCP, NULL,
+                                       &effective_address, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  server->port =
+    g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (effective_address));
+
+  server->accept_thread = g_thread_new ("accept", server_accept_thread,
+                                        server);
+}
+
+/* Every client connection must have been closed already. */
+static void
+server_stop (Server *server)
+{
+  guint i;
+
+  g_cancellable_cancel (server->cancellable);
+  g_thread_join (g_steal_pointer (&server->accept_thread));
+
+  for (i = 0; i < server->connection_threads->len; i++)
+    g_thread_join (g_ptr_array_index (server->connection_threads, i));
+
+  g_socket_listener_close (server->listener);
+  g_clear_object (&server->listener);
+  g_clear_object (&server->cancellable);
+  g_clear_pointer (&server->connection_threads, g_ptr_array_unref);
+  g_clear_pointer (&server->files, g_hash_table_unref);
+  g_mutex_clear (&server->mutex);
+}
+
+static GFile *
+server_file_new (Server      *server,
+                 const gchar *path)
+{
+  g_autofree gchar *uri = g_strdup_printf ("http://127.0.0.1:%u/%s",
+                                           server->port, path);
+
+  return g_file_new_for_uri (uri);
+}
+
+static void
+fixture_set_up (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *checksum = NULL;
+  g_autofree gchar *checksum_line = NULL;
+  guint32 *words = g_malloc0 (IMAGE_SIZE);
+  guint32 i;
+
+  fixture->tmpdir = g_dir_make_tmp ("eos-installer.XXXXXX", &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (fixture->tmpdir);
+
+  /* Every 4 bytes of the image are different, so chunks handed out in the
+   * wrong order are caught.
+   */
+  for (i = 0; i < IMAGE_SIZE / sizeof *words; i++)
+    words[i] = i;
+  fixture->image = g_bytes_new_take (words, IMAGE_SIZE);
+
+  server_start (&fixture->server);
+  g_hash_table_insert (fixture->server.files, g_strdup ("x.img"),
+                       g_bytes_ref (fixture->image));
+
+  checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, fixture->image);
+  checksum_line = g_strdup_printf ("%s  x.img\n", checksum);
+  g_hash_table_insert (fixture->server.files, g_strdup ("x.img.sha256"),
+                       g_bytes_new (checksum_line, strlen (checksum_line)));
+}
+
+static void
+fixture_tear_down (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  server_stop (&fixture->server);
+  g_clear_pointer (&fixture->image, g_bytes_unref);
+
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, fixture->tmpdir, NULL, &error))
+    g_warning ("Failed to remove %s: %s", fixture->tmpdir, error->message);
+
+  g_clear_pointer (&fixture->tmpdir, g_free);
+}
+
+/* Reads @reader to the end, or until it fails. */
+static GByteArray *
+read_all (GInputStream *reader,
+          GError      **error)
+{
+  g_autoptr(GByteArray) contents = g_byte_array_new ();
+  /* Deliberately not a multiple of the reader's chunk size */
+  const gsize chunk_size = 10000;
+  g_autofree guint8 *buffer = g_malloc (chunk_size);
+  gssize r;
+
+  while ((r = g_input_stream_read (reader, buffer, chunk_size, NULL,
+                                   error)) > 0)
+    g_byte_array_append (contents, buffer, r);
+
+  if (r < 0)
+    return NULL;
+
+  return g_steal_pointer (&contents);
+}
+
+/* Opens @path on the server as the scribe would, and checks that it reads
+ * back as the image.
+ */
+static void
+assert_reads_image (Fixture     *fixture,
+                    const gchar *path)
+{
+  g_autoptr(GFile) file = server_file_new (&fixture->server, path);
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GByteArray) contents = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+
+  reader = gis_image_reader_open (file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (GIS_IS_HTTP_IMAGE_READER (reader));
+  g_assert_cmpuint (gis_http_image_reader_get_size (GIS_HTTP_IMAGE_READER (reader)),
+                    ==, IMAGE_SIZE);
+
+  contents = read_all (reader, &error);
+  g_assert_no_error (error);
+  g_assert_cmpmem (contents->data, contents->len,
+                   g_bytes_get_data (fixture->image, NULL), IMAGE_SIZE);
+
+  ret = g_input_stream_close (reader, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+}
+
+/* The image is fetched with several range requests at once, and reassembled
+ * in order.
+ */
+static void
+test_read (Fixture      *fixture,
+           gconstpointer user_data)
+{
+  assert_reads_image (fixture, "x.img");
+
+  /* The first byte, then each chunk */
+  g_assert_cmpuint (fixture->server.n_range_requests, >, 2);
+  g_assert_cmpuint (fixture->server.n_range_requests, ==,
+                    fixture->server.n_requests);
+  g_assert_cmpuint (fixture->server.max_active, >, 1);
+}
+
+/* If the server ignores Range headers, the image is read with one request. */
+static void
+test_no_ranges (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  fixture->server.ranges = FALSE;
+
+  assert_reads_image (fixture, "x.img");
+  g_assert_cmpuint (fixture->server.n_requests, ==, 1);
+}
+
+static void
+test_redirect (Fixture      *fixture,
+               gconstpointer user_data)
+{
+  assert_reads_image (fixture, "redirect/x.img");
+}
+
+/* A chunk whose connection is dropped is fetched again. */
+static void
+test_retry (Fixture      *fixture,
+            gconstpointer user_data)
+{
+  fixture->server.drop_once = TRUE;
+
+  assert_reads_image (fixture, "x.img");
+  g_assert_true (fixture->server.dropped);
+}
+
+static void
+test_not_found (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  g_autoptr(GFile) file = server_file_new (&fixture->server, "missing.img");
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GError) error = NULL;
+
+  reader = gis_http_image_reader_open (file, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (reader);
+}
+
+static void
+test_fetch_range (Fixture      *fixture,
+                  gconstpointer user_data)
+{
+  g_autoptr(GFile) file = server_file_new (&fixture->server, "x.img");
+  g_autoptr(GBytes) head = NULL;
+  g_autoptr(GBytes) expected = NULL;
+  guint64 total_size = 0;
+  g_autoptr(GError) error = NULL;
+
+  head = gis_http_image_fetch_range (file, 512, 1024, &total_size, NULL,
+                                     &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (head);
+  g_assert_cmpuint (total_size, ==, IMAGE_SIZE);
+
+  expected = g_bytes_new_from_bytes (fixture->image, 512, 1024);
+  g_assert_true (g_bytes_equal (head, expected));
+}
+
+/* The checksum is fetched to a local file; a missing signature is reported
+ * as such.
+ */
+static void
+test_sidecar (Fixture      *fixture,
+              gconstpointer user_data)
+{
+  g_autoptr(GFile) file = server_file_new (&fixture->server, "x.img");
+  g_autoptr(GFile) dir = g_file_new_for_path (fixture->tmpdir);
+  g_autoptr(GFile) checksum = NULL;
+  g_autoptr(GFile) signature = NULL;
+  g_autofree gchar *checksum_path = NULL;
+  g_autofree gchar *contents = NULL;
+  gsize length = 0;
+  g_autoptr(GError) error = NULL;
+  GBytes *expected;
+
+  checksum = gis_http_image_fetch_sidecar (file, ".sha256", dir, NULL,
+                                           &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (checksum);
+
+  checksum_path = g_file_get_path (checksum);
+  g_assert_true (g_str_has_prefix (checksum_path, fixture->tmpdir));
+  g_assert_true (g_str_has_suffix (checksum_path, "/x.img.sha256"));
+
+  g_file_load_contents (checksum, NULL, &contents, &length, NULL, &error);
+  g_assert_no_error (error);
+  expected = g_hash_table_lookup (fixture->server.files, "x.img.sha256");
+  g_assert_cmpmem (contents, length,
+                   g_bytes_get_data (expected, NULL),
+                   g_bytes_get_size (expected));
+
+  signature = gis_http_image_fetch_sidecar (file, ".asc", dir, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (signature);
+}
+
+/* The test server does not use TLS, so its checksums are not trusted: the
+ * image must be signed.
+ */
+static void
+test_sidecars_http (Fixture      *fixture,
+                    gconstpointer user_data)
+{
+  g_autoptr(GFile) file = server_file_new (&fixture->server, "x.img");
+  g_autoptr(GFile) dir = g_file_new_for_path (fixture->tmpdir);
+  g_autoptr(GFile) checksum = g_file_get_child (dir, "x.img.sha256");
+  g_autoptr(GFile) signature = g_file_get_child (dir, "x.img.asc");
+  g_autoptr(GError) error = NULL;
+  const gchar *asc = "not really a signature\n";
+  gboolean ret;
+
+  ret = gis_http_image_fetch_sidecars (file, dir, NULL, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+  g_assert_false (ret);
+  g_assert_false (g_file_query_exists (checksum, NULL));
+  g_clear_error (&error);
+
+  g_hash_table_insert (fixture->server.files, g_strdup ("x.img.asc"),
+                       g_bytes_new_static (asc, strlen (asc)));
+
+  ret = gis_http_image_fetch_sidecars (file, dir, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  g_assert_true (g_file_query_exists (signature, NULL));
+  g_assert_false (g_file_query_exists (checksum, NULL));
+}
+
+/* Closing the stream before the end stops the workers. */
+static void
+test_close_early (Fixture      *fixture,
+                  gconstpointer user_data)
+{
+  g_autoptr(GFile) file = server_file_new (&fixture->server, "x.img");
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GError) error = NULL;
+  guint8 buf[4096];
+  gsize bytes_read = 0;
+  gboolean ret;
+
+  reader = gis_http_image_reader_open (file, NULL, &error);
+  g_assert_no_error (error);
+
+  ret = g_input_stream_read_all (reader, buf, sizeof buf, &bytes_read, NULL,
+                                 &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  g_assert_cmpmem (buf, bytes_read,
+                   g_bytes_get_data (fixture->image, NULL), sizeof buf);
+
+  ret = g_input_stream_close (reader, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+}
+
+static void
+test_is_http (void)
+{
+  g_autoptr(GFile) http = g_file_new_for_uri ("http://example.com/x.img");
+  g_autoptr(GFile) https = g_file_new_for_uri ("https://example.com/x.img");
+  g_autoptr(GFile) local = g_file_new_for_path ("/x.img");
+
+  g_assert_true (gis_http_image_is_http (http));
+  g_assert_true (gis_http_image_is_http (https));
+  g_assert_false (gis_http_image_is_http (local));
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+#define TEST(name, func) \
+  g_test_add ("/http-image/" name, Fixture, NULL, \
+              fixture_set_up, func, fixture_tear_down)
+
+  TEST ("read", test_read);
+  TEST ("no-ranges", test_no_ranges);
+  TEST ("redirect", test_redirect);
+  TEST ("retry", test_retry);
+  TEST ("not-found", test_not_found);
+  TEST ("fetch-range", test_fetch_range);
+  TEST ("sidecar", test_sidecar);
+  TEST ("sidecars/http", test_sidecars_http);
+  TEST ("close-early", test_close_early);
+  g_test_add_func ("/http-image/is-http", test_is_http);
+
+#undef TEST
+
+  return g_test_run ();
+}
@@ -0,0 +1,320 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <locale.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "gis-image-cache.h"
+#include "glnx-shutil.h"
+
+#define CHUNK_SIZE 4096
+
+typedef struct {
+  gchar *tmpdir;
+  gchar *cache_dir;
+  GError *error;
+} Fixture;
+
+static void
+fixture_set_up (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  GError *error = NULL;
+
+  fixture->tmpdir = g_dir_make_tmp ("eos-installer.XXXXXX", &error);
+  g_assert_no_error (error);
+  g_assert (fixture->tmpdir != NULL);
+
+  fixture->cache_dir = g_build_filename (fixture->tmpdir, "cache", NULL);
+}
+
+static void
+fixture_tear_down (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, fixture->tmpdir, NULL, &error))
+    g_warning ("Failed to remove %s: %s", fixture->tmpdir, error->message);
+
+  g_clear_pointer (&fixture->tmpdir, g_free);
+  g_clear_pointer (&fixture->cache_dir, g_free);
+  g_clear_error (&fixture->error);
+}
+
+/* Caches an image consisting of a chunk of @byte, a chunk of zeros, and
+ * another chunk of @byte, under @key.
+ */
+static gboolean
+add_image (GisImageCache *cache,
+           const gchar   *key,
+           gchar          byte,
+           GError       **error)
+{
+  g_autoptr(GisImageCacheEntry) entry = NULL;
+  gchar data[CHUNK_SIZE];
+  gchar zeros[CHUNK_SIZE] = { 0, };
+
+  memset (data, byte, sizeof data);
+
+  entry = gis_image_cache_begin_entry (cache, key, 3 * CHUNK_SIZE, error);
+  return entry != NULL
+    && gis_image_cache_entry_write (entry, data, sizeof data, error)
+    && gis_image_cache_entry_write (entry, zeros, sizeof zeros, error)
+    && gis_image_cache_entry_write (entry, data, sizeof data, error)
+    && gis_image_cache_entry_commit (entry, error);
+}
+
+static void
+assert_cached (GisImageCache *cache,
+               const gchar   *key,
+               gchar          byte)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *contents = g_malloc (3 * CHUNK_SIZE);
+  g_autofree gchar *expected = g_malloc0 (3 * CHUNK_SIZE);
+  gssize r;
+  gint fd;
+
+  memset (expected, byte, CHUNK_SIZE);
+  memset (expected + 2 * CHUNK_SIZE, byte, CHUNK_SIZE);
+
+  fd = gis_image_cache_open (cache, key, 3 * CHUNK_SIZE, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (fd, >=, 0);
+
+  r = read (fd, contents, 3 * CHUNK_SIZE);
+  g_assert_cmpint (r, ==, 3 * CHUNK_SIZE);
+  g_assert_cmpmem (contents, r, expected, 3 * CHUNK_SIZE);
+
+  close (fd);
+}
+
+static void
+assert_not_cached (GisImageCache *cache,
+                   const gchar   *key)
+{
+  g_autoptr(GError) error = NULL;
+  gint fd;
+
+  fd = gis_image_cache_open (cache, key, 3 * CHUNK_SIZE, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_cmpint (fd, ==, -1);
+}
+
+/* Sets the last-used time of @key's image to @mtime seconds after the epoch. */
+static void
+set_last_used (Fixture     *fixture,
+               const gchar *key,
+               time_t       mtime)
+{
+  g_autofree gchar *basename = g_strconcat (key, ".img", NULL);
+  g_autofree gchar *path = g_build_filename (fixture->cache_dir, basename,
+                                             NULL);
+  struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+
+  g_assert_cmpint (utimensat (AT_FDCWD, path, times, 0), ==, 0);
+}
+
+static void
+test_miss (Fixture      *fixture,
+           gconstpointer user_data)
+{
+  g_autoptr(GisImageCache) cache =
+    gis_image_cache_new (fixture->cache_dir, 0, 0,
+                         GIS_IMAGE_CACHE_EVICTION_LEAST_RECENTLY_USED);
+
+  /* The cache directory doesn't exist yet */
+  assert_not_cached (cache, "a");
+
+  add_image (cache, "a", 'a', &fixture->error);
+  g_assert_no_error (fixture->error);
+
+  assert_not_cached (cache, "b");
+}
+
+static void
+test_round_trip (Fixture      *fixture,
+                 gconstpointer user_data)
+{
+  g_autoptr(GisImageCache) cache =
+    gis_image_cache_new (fixture->cache_dir, 0, 0,
+                         GIS_IMAGE_CACHE_EVICTION_LEAST_RECENTLY_USED);
+
+  add_image (cache, "a", 'a', &fixture->error);
+  g_assert_no_error (fixture->error);
+  assert_cached (cache, "a", 'a');
+}
+
+static void
+test_not_committed (Fixture      *fixture,
+                    gconstpointer user_data)
+{
+  g_autoptr(GisImageCache) cache =
+    gis_image_cache_new (fixture->cache_dir, 0, 0,
+                         GIS_IMAGE_CACHE_EVICTION_LEAST_RECENTLY_USED);
+  g_autoptr(GisImageCacheEntry) entry = NULL;
+  g_autoptr(GDir) dir = NULL;
+  gchar data[CHUNK_SIZE] = { 'a', };
+  gboolean ret;
+
+  entry = gis_image_cache_begin_entry (cache, "a", 3 * CHUNK_SIZE,
+                                       &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_assert_nonnull (entry);
+
+  ret = gis_image_cache_entry_write (entry, data, sizeof data,
+                                     &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_assert_true (ret);
+
+  /* The image is incomplete, so can't be committed */
+  ret = gis_image_cache_entry_commit (entry, &fixture->error);
+  g_assert_error (fixture->error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_assert_false (ret);
+
+  g_clear_pointer (&entry, gis_image_cache_entry_free);
+  assert_not_cached (cache, "a");
+
+  /* ...and nothing is left behind */
+  g_clear_error (&fixture->error);
+  dir = g_dir_open (fixture->cache_dir, 0, &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_assert_null (g_dir_read_name (dir));
+}
+
+static void
+test_evict_least_recently_used (Fixture      *fixture,
+                                gconstpointer user_data)
+{
+  g_autoptr(GisImageCache) cache =
+    gis_image_cache_new (fixture->cache_dir, 0, 2,
+                         GIS_IMAGE_CACHE_EVICTION_LEAST_RECENTLY_USED);
+
+  add_image (cache, "a", 'a', &fixture->error);
+  g_assert_no_error (fixture->error);
+  add_image (cache, "b", 'b', &fixture->error);
+  g_assert_no_error (fixture->error);
+
+  /* "a" was added first, but used more recently */
+  set_last_used (fixture, "a", 2000);
+  set_last_used (fixture, "b", 1000);
+
+  add_image (cache, "c", 'c', &fixture->error);
+  g_assert_no_error (fixture->error);
+
+  assert_cached (cache, "a", 'a');
+  assert_not_cached (cache, "b");
+  assert_cached (cache, "c", 'c');
+}
+
+static void
+test_evict_none (Fixture      *fixture,
+                 gconstpointer user_data)
+{
+  g_autoptr(GisImageCache) cache =
+    gis_image_cache_new (fixture->cache_dir, 0, 1,
+                         GIS_IMAGE_CACHE_EVICTION_NONE);
+  gboolean ret;
+
+  add_image (cache, "a", 'a', &fixture->error);
+  g_assert_no_error (fixture->error);
+
+  ret = add_image (cache, "b", 'b', &fixture->error);
+  g_assert_error (fixture->error, G_IO_ERROR, G_IO_ERROR_NO_SPACE);
+  g_assert_false (ret);
+
+  assert_cached (cache, "a", 'a');
+  assert_not_cached (cache, "b");
+}
+
+static void
+test_too_big (Fixture      *fixture,
+              gconstpointer user_data)
+{
+  g_autoptr(GisImageCache) cache =
+    gis_image_cache_new (fixture->cache_dir, CHUNK_SIZE, 0,
+                         GIS_IMAGE_CACHE_EVICTION_LEAST_RECENTLY_USED);
+  gboolean ret;
+
+  ret = add_image (cache, "a", 'a', &fixture->error);
+  g_assert_error (fixture->error, G_IO_ERROR, G_IO_ERROR_NO_SPACE);
+  g_assert_false (ret);
+}
+
+static void
+test_compute_key (Fixture      *fixture,
+                  gconstpointer user_data)
+{
+  g_autofree gchar *image_path = g_build_filename (fixture->tmpdir, "a.img.xz",
+                                                   NULL);
+  g_autofree gchar *signature_path = g_build_filename (fixture->tmpdir,
+                                                       "a.img.xz.asc", NULL);
+  g_autoptr(GFile) image = g_file_new_for_path (image_path);
+  g_autoptr(GFile) signature = g_file_new_for_path (signature_path);
+  g_autofree gchar *key1 = NULL;
+  g_autofree gchar *key2 = NULL;
+  g_autofree gchar *key3 = NULL;
+
+  g_file_set_contents (image_path, "image", -1, &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_file_set_contents (signature_path, "signature", -1, &fixture->error);
+  g_assert_no_error (fixture->error);
+
+  key1 = gis_image_cache_compute_key (image, signature, NULL, &fixture->error);
+  g_assert_no_error (fixture->error);
+  key2 = gis_image_cache_compute_key (image, signature, NULL, &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_assert_cmpstr (key1, ==, key2);
+
+  /* Re-signing the image changes its key */
+  g_file_set_contents (signature_path, "new signature", -1, &fixture->error);
+  g_assert_no_error (fixture->error);
+  key3 = gis_image_cache_compute_key (image, signature, NULL, &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_assert_cmpstr (key1, !=, key3);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+#define TEST(name, func) \
+  g_test_add ("/image-cache/" name, Fixture, NULL, \
+              fixture_set_up, func, fixture_tear_down)
+
+  TEST ("miss", test_miss);
+  TEST ("round-trip", test_round_trip);
+  TEST ("not-committed", test_not_committed);
+  TEST ("evict/least-recently-used", test_evict_least_recently_used);
+  TEST ("evict/none", test_evict_none);
+  TEST ("too-big", test_too_big);
+  TEST ("compute-key", test_compute_key);
+
+#undef TEST
+
+  return g_test_run ();
+}
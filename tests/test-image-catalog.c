@@ -0,0 +1,214 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <locale.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "gis-errors.h"
+#include "gis-image-catalog.h"
+#include "glnx-shutil.h"
+
+typedef struct {
+  gchar *tmpdir;
+  GError *error;
+} Fixture;
+
+static void
+fixture_set_up (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  fixture->tmpdir = g_dir_make_tmp ("eos-installer.XXXXXX", &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_assert (fixture->tmpdir != NULL);
+}
+
+static void
+fixture_tear_down (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, fixture->tmpdir, NULL, &error))
+    g_warning ("Failed to remove %s: %s", fixture->tmpdir, error->message);
+
+  g_clear_pointer (&fixture->tmpdir, g_free);
+  g_clear_error (&fixture->error);
+}
+
+static GPtrArray *
+parse (Fixture     *fixture,
+       const gchar *data)
+{
+  return gis_image_catalog_parse (fixture->tmpdir, data, -1, &fixture->error);
+}
+
+static void
+test_parse (Fixture      *fixture,
+            gconstpointer user_data)
+{
+  g_autoptr(GPtrArray) entries = NULL;
+  g_autofree gchar *a = g_build_filename (fixture->tmpdir, "a.img.xz", NULL);
+  g_autofree gchar *b = g_build_filename (fixture->tmpdir, "b.img", NULL);
+  g_autofree gchar *b_asc = g_build_filename (fixture->tmpdir, "b.asc", NULL);
+  const GisImageCatalogEntry *entry;
+
+  entries = parse (fixture,
+                   "[Catalog]\n"
+                   "version=1\n"
+                   "\n"
+                   "[Image a.img.xz]\n"
+                   "size=5\n"
+                   "required-size=4194304\n"
+                   "personality=base\n"
+                   "\n"
+                   "[Image b.img]\n"
+                   "size=4194304\n"
+                   "required-size=4194304\n"
+                   "signature=b.asc\n");
+  g_assert_no_error (fixture->error);
+  g_assert_nonnull (entries);
+  g_assert_cmpuint (entries->len, ==, 2);
+
+  entry = g_ptr_array_index (entries, 0);
+  g_assert_cmpstr (entry->path, ==, a);
+  g_assert_null (entry->signature);
+  g_assert_null (entry->checksum);
+  g_assert_cmpuint (entry->size, ==, 5);
+  g_assert_cmpuint (entry->required_size, ==, 4194304);
+
+  entry = g_ptr_array_index (entries, 1);
+  g_assert_cmpstr (entry->path, ==, b);
+  g_assert_cmpstr (entry->signature, ==, b_asc);
+  g_assert_null (entry->checksum);
+}
+
+static void
+test_parse_invalid (Fixture      *fixture,
+                    gconstpointer user_data)
+{
+  const gchar * const invalid[] = {
+      /* Not a key file */
+      "garbage",
+      /* Missing or unknown version */
+      "[Image a.img]\nsize=1\nrequired-size=1\n",
+      "[Catalog]\nversion=2\n",
+      /* Missing sizes */
+      "[Catalog]\nversion=1\n[Image a.img]\nsize=1\n",
+      "[Catalog]\nversion=1\n[Image a.img]\nsize=1\nrequired-size=0\n",
+      /* Files outside the directory */
+      "[Catalog]\nversion=1\n[Image ../a.img]\nsize=1\nrequired-size=1\n",
+      "[Catalog]\nversion=1\n[Image a.img]\nsize=1\nrequired-size=1\n"
+      "checksum=/etc/passwd\n",
+  };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (invalid); i++)
+    {
+      g_autoptr(GPtrArray) entries = NULL;
+
+      g_test_message ("%s", invalid[i]);
+      entries = parse (fixture, invalid[i]);
+      g_assert_nonnull (fixture->error);
+      g_assert_null (entries);
+      g_clear_error (&fixture->error);
+    }
+}
+
+static void
+test_check (Fixture      *fixture,
+            gconstpointer user_data)
+{
+  g_autoptr(GPtrArray) entries = NULL;
+  g_autofree gchar *a = g_build_filename (fixture->tmpdir, "a.img.xz", NULL);
+  const GisImageCatalogEntry *entry;
+
+  entries = parse (fixture,
+                   "[Catalog]\n"
+                   "version=1\n"
+                   "[Image a.img.xz]\n"
+                   "size=5\n"
+                   "required-size=4194304\n");
+  g_assert_no_error (fixture->error);
+  entry = g_ptr_array_index (entries, 0);
+
+  g_assert_false (gis_image_catalog_entry_check (entry, &fixture->error));
+  g_assert_error (fixture->error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_clear_error (&fixture->error);
+
+  g_file_set_contents (a, "image", -1, &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_assert_true (gis_image_catalog_entry_check (entry, &fixture->error));
+  g_assert_no_error (fixture->error);
+
+  /* Replaced by a different image */
+  g_file_set_contents (a, "new image", -1, &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_assert_false (gis_image_catalog_entry_check (entry, &fixture->error));
+  g_assert_error (fixture->error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+}
+
+static void
+test_load_unsigned (Fixture      *fixture,
+                    gconstpointer user_data)
+{
+  g_autoptr(GisImageVerifier) verifier = gis_image_verifier_new ();
+  g_autoptr(GPtrArray) entries = NULL;
+  g_autofree gchar *path = g_build_filename (fixture->tmpdir,
+                                             GIS_IMAGE_CATALOG_BASENAME, NULL);
+
+  entries = gis_image_catalog_load (fixture->tmpdir, verifier, NULL,
+                                    &fixture->error);
+  g_assert_error (fixture->error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (entries);
+  g_clear_error (&fixture->error);
+
+  g_file_set_contents (path,
+                       "[Catalog]\n"
+                       "version=1\n",
+                       -1, &fixture->error);
+  g_assert_no_error (fixture->error);
+
+  entries = gis_image_catalog_load (fixture->tmpdir, verifier, NULL,
+                                    &fixture->error);
+  g_assert_error (fixture->error, GIS_IMAGE_ERROR,
+                  GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+  g_assert_null (entries);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+#define TEST(name, func) \
+  g_test_add ("/image-catalog/" name, Fixture, NULL, \
+              fixture_set_up, func, fixture_tear_down)
+
+  TEST ("parse", test_parse);
+  TEST ("parse/invalid", test_parse_invalid);
+  TEST ("check", test_check);
+  TEST ("load/unsigned", test_load_unsigned);
+
+#undef TEST
+
+  return g_test_run ();
+}
@@ -0,0 +1,259 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <locale.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "gis-image-extents.h"
+#include "gis-image-reader.h"
+
+#define SECTOR_SIZE 2048
+#define ROOT_DIR_SECTOR 18
+#define IMAGES_DIR_SECTOR 19
+#define SECOND_EXTENT_SECTOR 20
+#define FIRST_EXTENT_SECTOR 22
+#define SECOND_EXTENT_LENGTH 1000
+#define N_SECTORS 24
+
+typedef struct {
+  gchar *path;
+  gint fd;
+} Fixture;
+
+static void
+put_le16 (guint8 *p,
+          guint16 v)
+{
+  p[0] = v & 0xff;
+  p[1] = v >> 8;
+}
+
+static void
+put_le32 (guint8 *p,
+          guint32 v)
+{
+  put_le16 (p, v & 0xffff);
+  put_le16 (p + 2, v >> 16);
+}
+
+/* Writes a directory record to @p, returning its length. If @rr_name is not
+ * %NULL, it is added as a Rock Ridge NM entry.
+ */
+static gsize
+put_record (guint8      *p,
+            guint32      lba,
+            guint32      length,
+            guint8       flags,
+            const gchar *name,
+            gsize        name_len,
+            const gchar *rr_name)
+{
+  gsize len = 33 + name_len + (name_len % 2 == 0 ? 1 : 0);
+
+  if (rr_name != NULL)
+    {
+      guint8 *nm = p + len;
+      gsize rr_len = strlen (rr_name);
+
+      nm[0] = 'N';
+      nm[1] = 'M';
+      nm[2] = 5 + rr_len;
+      nm[3] = 1;
+      nm[4] = 0;
+      memcpy (nm + 5, rr_name, rr_len);
+      len += 5 + rr_len;
+    }
+
+  p[0] = len;
+  put_le32 (p + 2, lba);
+  put_le32 (p + 10, length);
+  p[25] = flags;
+  p[32] = name_len;
+  memcpy (p + 33, name, name_len);
+
+  return len;
+}
+
+/* Builds an iso9660 filesystem holding /images/eos.img, a file of 2048 "a"s
+ * followed by 1000 "b"s. It is stored in two extents, in the opposite order
+ * on disk, with a Rock Ridge name. The directory /images has only an ISO 9660
+ * name.
+ */
+static void
+fixture_set_up (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  g_autofree guint8 *iso = g_malloc0 (N_SECTORS * SECTOR_SIZE);
+  guint8 *pvd = iso + 16 * SECTOR_SIZE;
+  guint8 *terminator = iso + 17 * SECTOR_SIZE;
+  guint8 *root = iso + ROOT_DIR_SECTOR * SECTOR_SIZE;
+  guint8 *images = iso + IMAGES_DIR_SECTOR * SECTOR_SIZE;
+  g_autoptr(GError) error = NULL;
+
+  pvd[0] = 1;
+  memcpy (pvd + 1, "CD001", 5);
+  pvd[6] = 1;
+  put_le16 (pvd + 128, SECTOR_SIZE);
+  put_record (pvd + 156, ROOT_DIR_SECTOR, SECTOR_SIZE, 0x02, "\0", 1, NULL);
+
+  terminator[0] = 255;
+  memcpy (terminator + 1, "CD001", 5);
+  terminator[6] = 1;
+
+  root += put_record (root, ROOT_DIR_SECTOR, SECTOR_SIZE, 0x02, "\0", 1, NULL);
+  root += put_record (root, ROOT_DIR_SECTOR, SECTOR_SIZE, 0x02, "\1", 1, NULL);
+  root += put_record (root, IMAGES_DIR_SECTOR, SECTOR_SIZE, 0x02,
+                      "IMAGES", 6, NULL);
+
+  images += put_record (images, IMAGES_DIR_SECTOR, SECTOR_SIZE, 0x02, "\0", 1,
+                        NULL);
+  images += put_record (images, ROOT_DIR_SECTOR, SECTOR_SIZE, 0x02, "\1", 1,
+                        NULL);
+  images += put_record (images, FIRST_EXTENT_SECTOR, SECTOR_SIZE, 0x80,
+                        "EOS.IMG;1", 9, "eos.img");
+  images += put_record (images, SECOND_EXTENT_SECTOR, SECOND_EXTENT_LENGTH, 0,
+                        "EOS.IMG;1", 9, "eos.img");
+
+  memset (iso + FIRST_EXTENT_SECTOR * SECTOR_SIZE, 'a', SECTOR_SIZE);
+  memset (iso + SECOND_EXTENT_SECTOR * SECTOR_SIZE, 'b', SECOND_EXTENT_LENGTH);
+
+  fixture->fd = g_file_open_tmp ("eos-installer-XXXXXX.iso", &fixture->path,
+                                 &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (write (fixture->fd, iso, N_SECTORS * SECTOR_SIZE), ==,
+                   N_SECTORS * SECTOR_SIZE);
+}
+
+static void
+fixture_tear_down (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  if (fixture->fd != -1)
+    close (fixture->fd);
+
+  g_unlink (fixture->path);
+  g_clear_pointer (&fixture->path, g_free);
+}
+
+static void
+test_iso9660 (Fixture      *fixture,
+              gconstpointer user_data)
+{
+  g_autoptr(GArray) extents = NULL;
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *expected = g_malloc (SECTOR_SIZE + SECOND_EXTENT_LENGTH);
+  guint8 contents[SECTOR_SIZE + SECOND_EXTENT_LENGTH + 1];
+  gsize bytes_read = 0;
+  GisImageExtent *extent;
+  gboolean ret;
+
+  extents = gis_image_extents_query_iso9660 (fixture->fd, "/images/eos.img",
+                                             &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (extents);
+  g_assert_cmpuint (extents->len, ==, 2);
+
+  extent = &g_array_index (extents, GisImageExtent, 0);
+  g_assert_cmpuint (extent->logical, ==, 0);
+  g_assert_cmpuint (extent->physical, ==, FIRST_EXTENT_SECTOR * SECTOR_SIZE);
+  g_assert_cmpuint (extent->length, ==, SECTOR_SIZE);
+
+  extent = &g_array_index (extents, GisImageExtent, 1);
+  g_assert_cmpuint (extent->logical, ==, SECTOR_SIZE);
+  g_assert_cmpuint (extent->physical, ==, SECOND_EXTENT_SECTOR * SECTOR_SIZE);
+  g_assert_cmpuint (extent->length, ==, SECOND_EXTENT_LENGTH);
+
+  /* The reader now owns the fd. */
+  reader = gis_image_reader_new_for_extents (fixture->fd, extents);
+  fixture->fd = -1;
+
+  ret = g_input_stream_read_all (reader, contents, sizeof contents,
+                                 &bytes_read, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+
+  memset (expected, 'a', SECTOR_SIZE);
+  memset (expected + SECTOR_SIZE, 'b', SECOND_EXTENT_LENGTH);
+  g_assert_cmpmem (contents, bytes_read,
+                   expected, SECTOR_SIZE + SECOND_EXTENT_LENGTH);
+
+  ret = g_input_stream_close (reader, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+}
+
+static void
+test_iso9660_not_found (Fixture      *fixture,
+                        gconstpointer user_data)
+{
+  g_autoptr(GArray) extents = NULL;
+  g_autoptr(GError) error = NULL;
+
+  extents = gis_image_extents_query_iso9660 (fixture->fd, "/images/other.img",
+                                             &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (extents);
+  g_clear_error (&error);
+
+  /* eos.img is not a directory */
+  extents = gis_image_extents_query_iso9660 (fixture->fd, "/images/eos.img/x",
+                                             &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (extents);
+}
+
+/* An image can only be read directly from the block device it is on, which
+ * an ordinary file is not.
+ */
+static void
+test_not_block_device (Fixture      *fixture,
+                       gconstpointer user_data)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (fixture->path);
+  g_autoptr(GArray) extents = NULL;
+  g_autoptr(GError) error = NULL;
+
+  extents = gis_image_extents_query (file, fixture->fd, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED);
+  g_assert_null (extents);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+#define TEST(name, func) \
+  g_test_add ("/image-extents/" name, Fixture, NULL, \
+              fixture_set_up, func, fixture_tear_down)
+
+  TEST ("iso9660", test_iso9660);
+  TEST ("iso9660/not-found", test_iso9660_not_found);
+  TEST ("not-block-device", test_not_block_device);
+
+#undef TEST
+
+  return g_test_run ();
+}
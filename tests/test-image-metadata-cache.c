@@ -0,0 +1,249 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <locale.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "gis-image-metadata-cache.h"
+#include "glnx-shutil.h"
+
+typedef struct {
+  gchar *tmpdir;
+  gchar *image_dir;
+  gchar *fallback_dir;
+  gchar *image_path;
+  GError *error;
+} Fixture;
+
+static void
+fixture_set_up (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  fixture->tmpdir = g_dir_make_tmp ("eos-installer.XXXXXX", &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_assert (fixture->tmpdir != NULL);
+
+  fixture->image_dir = g_build_filename (fixture->tmpdir, "images", NULL);
+  g_assert_cmpint (g_mkdir (fixture->image_dir, 0755), ==, 0);
+  fixture->fallback_dir = g_build_filename (fixture->tmpdir, "run", NULL);
+  fixture->image_path = g_build_filename (fixture->image_dir, "a.img.xz",
+                                          NULL);
+
+  g_file_set_contents (fixture->image_path, "image", -1, &fixture->error);
+  g_assert_no_error (fixture->error);
+}
+
+static void
+fixture_tear_down (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  /* In case a test left it read-only */
+  g_chmod (fixture->image_dir, 0755);
+
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, fixture->tmpdir, NULL, &error))
+    g_warning ("Failed to remove %s: %s", fixture->tmpdir, error->message);
+
+  g_clear_pointer (&fixture->tmpdir, g_free);
+  g_clear_pointer (&fixture->image_dir, g_free);
+  g_clear_pointer (&fixture->fallback_dir, g_free);
+  g_clear_pointer (&fixture->image_path, g_free);
+  g_clear_error (&fixture->error);
+}
+
+static const GisImageMetadata example = {
+  .valid = TRUE,
+  .required_size = 4 * 1024 * 1024,
+  .format = GIS_IMAGE_FORMAT_XZ,
+  .uncompressed_size = 4 * 1024 * 1024 + 512,
+  .verification = GIS_IMAGE_VERIFICATION_UNKNOWN,
+};
+
+/* Saves @example for the fixture's image, and returns a new cache loaded from
+ * disk.
+ */
+static GisImageMetadataCache *
+save_and_reload (Fixture *fixture)
+{
+  g_autoptr(GisImageMetadataCache) cache =
+    gis_image_metadata_cache_new (fixture->image_dir, fixture->fallback_dir);
+
+  gis_image_metadata_cache_update (cache, fixture->image_path, &example);
+  gis_image_metadata_cache_save (cache, &fixture->error);
+  g_assert_no_error (fixture->error);
+
+  return gis_image_metadata_cache_new (fixture->image_dir,
+                                       fixture->fallback_dir);
+}
+
+static void
+assert_example (GisImageMetadataCache *cache,
+                const gchar           *path)
+{
+  GisImageMetadata metadata = { 0 };
+
+  g_assert_true (gis_image_metadata_cache_lookup (cache, path, &metadata));
+  g_assert_cmpint (metadata.valid, ==, example.valid);
+  g_assert_cmpuint (metadata.required_size, ==, example.required_size);
+  g_assert_cmpint (metadata.format, ==, example.format);
+  g_assert_cmpuint (metadata.uncompressed_size, ==, example.uncompressed_size);
+  g_assert_cmpint (metadata.verification, ==, example.verification);
+}
+
+static void
+test_miss (Fixture      *fixture,
+           gconstpointer user_data)
+{
+  g_autoptr(GisImageMetadataCache) cache =
+    gis_image_metadata_cache_new (fixture->image_dir, fixture->fallback_dir);
+  g_autofree gchar *missing = g_build_filename (fixture->image_dir,
+                                                "missing.img", NULL);
+  GisImageMetadata metadata;
+
+  g_assert_false (gis_image_metadata_cache_lookup (cache, fixture->image_path,
+                                                   &metadata));
+
+  /* Images which don't exist can't be cached */
+  gis_image_metadata_cache_update (cache, missing, &example);
+  g_assert_false (gis_image_metadata_cache_lookup (cache, missing, &metadata));
+}
+
+static void
+test_round_trip (Fixture      *fixture,
+                 gconstpointer user_data)
+{
+  g_autoptr(GisImageMetadataCache) cache = save_and_reload (fixture);
+  g_autofree gchar *cache_path =
+    g_build_filename (fixture->image_dir, ".eos-installer-metadata.ini", NULL);
+
+  g_assert_true (g_file_test (cache_path, G_FILE_TEST_EXISTS));
+  g_assert_false (g_file_test (fixture->fallback_dir, G_FILE_TEST_EXISTS));
+  assert_example (cache, fixture->image_path);
+}
+
+static void
+test_stale (Fixture      *fixture,
+            gconstpointer user_data)
+{
+  g_autoptr(GisImageMetadataCache) cache = save_and_reload (fixture);
+  GisImageMetadata metadata;
+  struct utimbuf times = { .actime = 0, .modtime = 1 };
+
+  /* Same size, but a new modification time */
+  g_assert_cmpint (g_utime (fixture->image_path, &times), ==, 0);
+  g_assert_false (gis_image_metadata_cache_lookup (cache, fixture->image_path,
+                                                   &metadata));
+
+  /* The entry is refreshed by probing the image again */
+  gis_image_metadata_cache_update (cache, fixture->image_path, &example);
+  assert_example (cache, fixture->image_path);
+
+  /* A different image with the same name */
+  g_file_set_contents (fixture->image_path, "new image", -1, &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_assert_false (gis_image_metadata_cache_lookup (cache, fixture->image_path,
+                                                   &metadata));
+}
+
+static void
+test_read_only (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  g_autoptr(GisImageMetadataCache) cache = NULL;
+  g_autoptr(GisImageMetadataCache) reloaded = NULL;
+  g_autofree gchar *cache_path =
+    g_build_filename (fixture->image_dir, ".eos-installer-metadata.ini", NULL);
+  GisImageMetadata metadata;
+
+  if (geteuid () == 0)
+    {
+      g_test_skip ("root can write to read-only directories");
+      return;
+    }
+
+  g_assert_cmpint (g_chmod (fixture->image_dir, 0555), ==, 0);
+
+  cache = save_and_reload (fixture);
+  g_assert_false (g_file_test (cache_path, G_FILE_TEST_EXISTS));
+  assert_example (cache, fixture->image_path);
+
+  /* Once the directory is writable again, the cache moves back there */
+  g_assert_cmpint (g_chmod (fixture->image_dir, 0755), ==, 0);
+  gis_image_metadata_cache_set_verification (cache, fixture->image_path,
+                                             GIS_IMAGE_VERIFICATION_VERIFIED);
+  gis_image_metadata_cache_save (cache, &fixture->error);
+  g_assert_no_error (fixture->error);
+  g_assert_true (g_file_test (cache_path, G_FILE_TEST_EXISTS));
+
+  reloaded = gis_image_metadata_cache_new (fixture->image_dir,
+                                           fixture->fallback_dir);
+  g_assert_true (gis_image_metadata_cache_lookup (reloaded,
+                                                  fixture->image_path,
+                                                  &metadata));
+  g_assert_cmpint (metadata.verification, ==, GIS_IMAGE_VERIFICATION_VERIFIED);
+}
+
+static void
+test_verification (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(GisImageMetadataCache) cache = save_and_reload (fixture);
+  g_autoptr(GisImageMetadataCache) reloaded = NULL;
+  GisImageMetadata metadata;
+
+  gis_image_metadata_cache_set_verification (cache, fixture->image_path,
+                                             GIS_IMAGE_VERIFICATION_FAILED);
+  gis_image_metadata_cache_save (cache, &fixture->error);
+  g_assert_no_error (fixture->error);
+
+  reloaded = gis_image_metadata_cache_new (fixture->image_dir,
+                                           fixture->fallback_dir);
+  g_assert_true (gis_image_metadata_cache_lookup (reloaded,
+                                                  fixture->image_path,
+                                                  &metadata));
+  g_assert_cmpint (metadata.verification, ==, GIS_IMAGE_VERIFICATION_FAILED);
+  g_assert_cmpuint (metadata.required_size, ==, example.required_size);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+#define TEST(name, func) \
+  g_test_add ("/image-metadata-cache/" name, Fixture, NULL, \
+              fixture_set_up, func, fixture_tear_down)
+
+  TEST ("miss", test_miss);
+  TEST ("round-trip", test_round_trip);
+  TEST ("stale", test_stale);
+  TEST ("read-only", test_read_only);
+  TEST ("verification", test_verification);
+
+#undef TEST
+
+  return g_test_run ();
+}
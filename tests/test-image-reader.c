@@ -0,0 +1,123 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "gis-image-reader.h"
+
+/* A 4 MiB file of "w"s (0x77), and one of 8193 sectors */
+#define IMAGE "w.img"
+#define IMAGE_8193 "w-8193.img"
+
+static GFile *
+test_file_new (const gchar *basename)
+{
+  g_autofree gchar *path = g_test_build_filename (G_TEST_BUILT, basename,
+                                                  NULL);
+
+  return g_file_new_for_path (path);
+}
+
+/* Reads all of @data through a GisImageReader, a little over 1 MiB at a
+ * time, and checks that it matches what g_file_load_contents() reads.
+ */
+static void
+test_read (gconstpointer data)
+{
+  const gchar *basename = data;
+  g_autoptr(GFile) file = test_file_new (basename);
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GByteArray) contents = g_byte_array_new ();
+  g_autofree gchar *expected = NULL;
+  gsize expected_length = 0;
+  /* Deliberately not a multiple of the page size */
+  const gsize chunk_size = 1024 * 1024 + 17;
+  g_autofree guint8 *buffer = g_malloc (chunk_size);
+  g_autoptr(GError) error = NULL;
+  gssize r;
+  gboolean ret;
+
+  g_file_load_contents (file, NULL, &expected, &expected_length, NULL,
+                        &error);
+  g_assert_no_error (error);
+
+  reader = gis_image_reader_open (file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (GIS_IS_IMAGE_READER (reader));
+
+  while ((r = g_input_stream_read (reader, buffer, chunk_size, NULL,
+                                   &error)) > 0)
+    g_byte_array_append (contents, buffer, r);
+
+  g_assert_no_error (error);
+  g_assert_cmpint (r, ==, 0);
+  g_assert_cmpmem (contents->data, contents->len, expected, expected_length);
+
+  ret = g_input_stream_close (reader, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+}
+
+static void
+test_missing (void)
+{
+  g_autoptr(GFile) file = test_file_new ("nonexistent");
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GError) error = NULL;
+
+  reader = gis_image_reader_open (file, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (reader);
+}
+
+static void
+test_cancelled (void)
+{
+  g_autoptr(GFile) file = test_file_new (IMAGE);
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autoptr(GError) error = NULL;
+  gchar buffer[512];
+  gssize r;
+
+  reader = gis_image_reader_open (file, NULL, &error);
+  g_assert_no_error (error);
+
+  g_cancellable_cancel (cancellable);
+  r = g_input_stream_read (reader, buffer, sizeof buffer, cancellable,
+                           &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_cmpint (r, ==, -1);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_data_func ("/image-reader/read", IMAGE, test_read);
+  g_test_add_data_func ("/image-reader/read-8193", IMAGE_8193, test_read);
+  g_test_add_func ("/image-reader/missing", test_missing);
+  g_test_add_func ("/image-reader/cancelled", test_cancelled);
+
+  return g_test_run ();
+}
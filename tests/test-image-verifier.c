@@ -0,0 +1,345 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <locale.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "gis-errors.h"
+#include "gis-image-verifier.h"
+#include "glnx-shutil.h"
+
+/* A 4 MiB file of "w"s (0x77), with a signature and checksum */
+#define IMAGE "w.img"
+
+typedef struct {
+  gchar *tmpdir;
+  GisImageVerifier *verifier;
+
+  GFile *image;
+  GFile *signature;
+  GFile *checksum;
+  /* A signature made by the trusted key for a different file */
+  GFile *bad_signature;
+  /* A valid checksum for a different file */
+  GFile *bad_checksum;
+  GFile *missing;
+} Fixture;
+
+static GFile *
+test_file_new (GTestFileType file_type,
+               const gchar  *basename)
+{
+  g_autofree gchar *path = g_test_build_filename (file_type, basename, NULL);
+
+  return g_file_new_for_path (path);
+}
+
+static void
+fixture_set_up (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  g_autofree gchar *keyring_path =
+    g_test_build_filename (G_TEST_DIST, "public.asc", NULL);
+  g_autoptr(GError) error = NULL;
+
+  fixture->tmpdir = g_dir_make_tmp ("eos-installer.XXXXXX", &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (fixture->tmpdir);
+
+  fixture->verifier = g_object_new (GIS_TYPE_IMAGE_VERIFIER,
+                                    "keyring-path", keyring_path,
+                                    NULL);
+
+  fixture->image = test_file_new (G_TEST_BUILT, IMAGE);
+  fixture->signature = test_file_new (G_TEST_BUILT, IMAGE ".asc");
+  fixture->checksum = test_file_new (G_TEST_BUILT, IMAGE ".sha256");
+  fixture->bad_signature = test_file_new (G_TEST_BUILT, IMAGE ".gz.asc");
+  fixture->bad_checksum = test_file_new (G_TEST_DIST, "bad.sha256");
+  fixture->missing = test_file_new (G_TEST_BUILT, "nonexistent");
+}
+
+static void
+fixture_tear_down (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, fixture->tmpdir, NULL, &error))
+    g_warning ("Failed to remove %s: %s", fixture->tmpdir, error->message);
+
+  g_clear_pointer (&fixture->tmpdir, g_free);
+  g_clear_object (&fixture->verifier);
+  g_clear_object (&fixture->image);
+  g_clear_object (&fixture->signature);
+  g_clear_object (&fixture->checksum);
+  g_clear_object (&fixture->bad_signature);
+  g_clear_object (&fixture->bad_checksum);
+  g_clear_object (&fixture->missing);
+}
+
+static void
+verify_cb (GObject      *source,
+           GAsyncResult *result,
+           gpointer      data)
+{
+  GAsyncResult **result_out = data;
+
+  *result_out = g_object_ref (result);
+}
+
+static gboolean
+verify_and_wait (Fixture      *fixture,
+                 GFile        *image,
+                 GFile        *signature,
+                 GFile        *checksum,
+                 GCancellable *cancellable,
+                 GError      **error)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+
+  gis_image_verifier_verify_async (fixture->verifier, image, signature,
+                                   checksum, cancellable, verify_cb, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  return gis_image_verifier_verify_finish (fixture->verifier, result, error);
+}
+
+static void
+test_good_signature (Fixture      *fixture,
+                     gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+
+  g_assert_false (gis_image_verifier_is_verified (fixture->verifier,
+                                                  fixture->image,
+                                                  fixture->signature,
+                                                  NULL));
+
+  /* The signature is preferred to the checksum */
+  ret = verify_and_wait (fixture, fixture->image, fixture->signature,
+                         fixture->bad_checksum, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+
+  g_assert_true (gis_image_verifier_is_verified (fixture->verifier,
+                                                 fixture->image,
+                                                 fixture->signature,
+                                                 NULL));
+  g_assert_false (gis_image_verifier_is_verified (fixture->verifier,
+                                                  fixture->image,
+                                                  fixture->bad_checksum,
+                                                  NULL));
+}
+
+static void
+test_bad_signature (Fixture      *fixture,
+                    gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+
+  ret = verify_and_wait (fixture, fixture->image, fixture->bad_signature,
+                         fixture->checksum, NULL, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+  g_assert_false (ret);
+
+  g_assert_false (gis_image_verifier_is_verified (fixture->verifier,
+                                                  fixture->image,
+                                                  fixture->bad_signature,
+                                                  NULL));
+}
+
+static void
+test_good_checksum (Fixture      *fixture,
+                    gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+
+  ret = verify_and_wait (fixture, fixture->image, fixture->missing,
+                         fixture->checksum, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+
+  g_assert_true (gis_image_verifier_is_verified (fixture->verifier,
+                                                 fixture->image,
+                                                 fixture->checksum,
+                                                 NULL));
+}
+
+static void
+test_bad_checksum (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+
+  ret = verify_and_wait (fixture, fixture->image, fixture->missing,
+                         fixture->bad_checksum, NULL, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+  g_assert_false (ret);
+
+  g_assert_false (gis_image_verifier_is_verified (fixture->verifier,
+                                                  fixture->image,
+                                                  fixture->bad_checksum,
+                                                  NULL));
+}
+
+static void
+test_missing_verification (Fixture      *fixture,
+                           gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+
+  ret = verify_and_wait (fixture, fixture->image, fixture->missing,
+                         fixture->missing, NULL, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+  g_assert_false (ret);
+}
+
+/* A split image's signature is for its manifest, and each part is checked
+ * against the manifest.
+ */
+static void
+test_split (Fixture      *fixture,
+            gconstpointer user_data)
+{
+  g_autoptr(GFile) first_part = test_file_new (G_TEST_BUILT,
+                                               "w-split.img.xz.000");
+  g_autoptr(GFile) manifest = test_file_new (G_TEST_BUILT,
+                                             "w-split.img.xz.sha256");
+  g_autoptr(GFile) manifest_signature =
+    test_file_new (G_TEST_BUILT, "w-split.img.xz.sha256.asc");
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+
+  ret = verify_and_wait (fixture, first_part, manifest_signature,
+                         fixture->missing, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  g_assert_true (gis_image_verifier_is_verified (fixture->verifier,
+                                                 first_part,
+                                                 manifest_signature,
+                                                 NULL));
+
+  ret = verify_and_wait (fixture, first_part, fixture->missing, manifest,
+                         NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+
+  /* A valid signature, but not for the manifest */
+  ret = verify_and_wait (fixture, first_part, fixture->signature,
+                         fixture->missing, NULL, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+  g_assert_false (ret);
+}
+
+/* An image which is modified after it was verified, even if its size and
+ * modification time are unchanged, is no longer considered verified.
+ */
+static void
+test_modified (Fixture      *fixture,
+               gconstpointer user_data)
+{
+  g_autofree gchar *copy_path = g_build_filename (fixture->tmpdir, IMAGE,
+                                                  NULL);
+  g_autoptr(GFile) copy = g_file_new_for_path (copy_path);
+  g_autoptr(GError) error = NULL;
+  struct stat stbuf;
+  struct timespec times[2];
+  gboolean ret;
+  int fd;
+
+  ret = g_file_copy (fixture->image, copy, G_FILE_COPY_NONE, NULL, NULL,
+                     NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+
+  ret = verify_and_wait (fixture, copy, fixture->missing, fixture->checksum,
+                         NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  g_assert_true (gis_image_verifier_is_verified (fixture->verifier, copy,
+                                                 fixture->checksum, NULL));
+
+  g_assert_cmpint (stat (copy_path, &stbuf), ==, 0);
+
+  fd = open (copy_path, O_WRONLY | O_CLOEXEC);
+  g_assert_cmpint (fd, >=, 0);
+  g_assert_cmpint (pwrite (fd, "x", 1, 0), ==, 1);
+  times[0] = stbuf.st_atim;
+  times[1] = stbuf.st_mtim;
+  g_assert_cmpint (futimens (fd, times), ==, 0);
+  close (fd);
+
+  g_assert_false (gis_image_verifier_is_verified (fixture->verifier, copy,
+                                                  fixture->checksum, NULL));
+}
+
+static void
+test_cancelled (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+
+  g_cancellable_cancel (cancellable);
+  ret = verify_and_wait (fixture, fixture->image, fixture->signature,
+                         fixture->checksum, cancellable, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_false (ret);
+
+  g_assert_false (gis_image_verifier_is_verified (fixture->verifier,
+                                                  fixture->image,
+                                                  fixture->signature,
+                                                  NULL));
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+#define TEST(name, func) \
+  g_test_add ("/image-verifier/" name, Fixture, NULL, \
+              fixture_set_up, func, fixture_tear_down)
+
+  TEST ("good-signature", test_good_signature);
+  TEST ("bad-signature", test_bad_signature);
+  TEST ("good-checksum", test_good_checksum);
+  TEST ("bad-checksum", test_bad_checksum);
+  TEST ("missing-verification", test_missing_verification);
+  TEST ("split", test_split);
+  TEST ("modified", test_modified);
+  TEST ("cancelled", test_cancelled);
+
+#undef TEST
+
+  return g_test_run ();
+}
@@ -0,0 +1,292 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "gis-install-record.h"
+#include "glnx-shutil.h"
+
+static void
+test_image_format (void)
+{
+  struct {
+    const gchar *path;
+    const gchar *format;
+  } cases[] = {
+    { "/eos-eos3.8-amd64-amd64.200601-121212.en.img", "raw" },
+    { "/eos-eos3.8-amd64-amd64.200601-121212.en.img.gz", "gz" },
+    { "/eos-eos3.8-amd64-amd64.200601-121212.en.img.xz", "xz" },
+    { "/eos-eos3.8-amd64-amd64.200601-121212.en.img.xz.000", "split-xz" },
+    { "/eos-eos3.8-amd64-amd64.200601-121212.en.img.gz.000", "split-gz" },
+    { "/endless/endless.squash", "squashfs" },
+    { "/dev/mapper/endless-image", "raw" },
+  };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (cases); i++)
+    {
+      g_autoptr(GFile) image = g_file_new_for_path (cases[i].path);
+
+      g_test_message ("%s", cases[i].path);
+      g_assert_cmpstr (gis_install_record_get_image_format (image), ==,
+                       cases[i].format);
+    }
+}
+
+/* As returned by gis_scribe_dup_metrics(), but with only the keys which the
+ * record uses.
+ */
+static GVariant *
+make_metrics (void)
+{
+  return g_variant_ref_sink (g_variant_new_parsed (
+      "{'elapsed-usec': <int64 4000000>,"
+      " 'stages': <{"
+      "   'tee': {'bytes-in': <uint64 2000000>, 'bytes-out': <uint64 2000000>,"
+      "           'busy-usec': <int64 1000000>},"
+      "   'verify': {'bytes-in': <uint64 0>, 'bytes-out': <uint64 0>,"
+      "              'busy-usec': <int64 0>},"
+      "   'write': {'bytes-in': <uint64 8000000>, 'bytes-out': <uint64 8000000>,"
+      "             'busy-usec': <int64 2000000>}"
+      " }>,"
+      " 'bottleneck': <'write'>,"
+      " 'bound': <'target'>}"));
+}
+
+static void
+test_json_success (void)
+{
+  g_autoptr(GVariant) metrics = make_metrics ();
+  g_autoptr(GVariant) record = NULL;
+  g_autofree gchar *json = NULL;
+
+  record = gis_install_record_new ("eos-eos3.8", "xz", 8000000, 2000000,
+                                   "Endless", "EC-200",
+                                   "ATA \"SAMSUNG\"\\MZ7LN256", metrics, NULL);
+  json = gis_install_record_to_json (record);
+  g_test_message ("%s", json);
+
+  g_assert_true (g_str_has_prefix (json, "{\"time\":\""));
+  g_assert_true (g_str_has_suffix (json, "}"));
+  g_assert_null (strchr (json, '\n'));
+
+  g_assert_nonnull (strstr (json, "\"outcome\":\"success\""));
+  g_assert_null (strstr (json, "\"error-"));
+  g_assert_nonnull (strstr (json, "\"image-name\":\"eos-eos3.8\","
+                                  "\"image-format\":\"xz\","
+                                  "\"image-size\":8000000,"
+                                  "\"compressed-size\":2000000,"
+                                  "\"vendor\":\"Endless\","
+                                  "\"product\":\"EC-200\","
+                                  "\"target-model\":\"ATA \\\"SAMSUNG\\\"\\\\MZ7LN256\""));
+  g_assert_nonnull (strstr (json, "\"duration-usec\":4000000"));
+  g_assert_nonnull (strstr (json, "\"bottleneck\":\"write\",\"bound\":\"target\""));
+  g_assert_nonnull (strstr (json, "\"stages\":{"
+                                  "\"tee\":{\"bytes\":2000000,"
+                                  "\"busy-usec\":1000000,\"rate\":2000000},"
+                                  "\"write\":{\"bytes\":8000000,"
+                                  "\"busy-usec\":2000000,\"rate\":4000000}}"));
+  /* It did nothing, so is left out */
+  g_assert_null (strstr (json, "\"verify\""));
+}
+
+static void
+test_json_failure (void)
+{
+  g_autoptr(GVariant) record = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *json = NULL;
+
+  g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                       "No space left on device");
+  record = gis_install_record_new (NULL, "gz", 8000000, 2000000,
+                                   NULL, NULL, NULL, NULL, error);
+  json = gis_install_record_to_json (record);
+  g_test_message ("%s", json);
+
+  g_assert_nonnull (strstr (json, "\"outcome\":\"failure\""));
+  g_assert_nonnull (strstr (json, "\"error-domain\":\"g-io-error-quark\""));
+  g_assert_nonnull (strstr (json, "\"error-code\":12"));
+  g_assert_nonnull (strstr (json, "\"error-message\":\"No space left on device\""));
+
+  /* Whatever is not known is left out */
+  g_assert_null (strstr (json, "\"image-name\""));
+  g_assert_null (strstr (json, "\"vendor\""));
+  g_assert_null (strstr (json, "\"stages\""));
+
+  g_clear_pointer (&record, g_variant_unref);
+  g_clear_pointer (&json, g_free);
+  g_clear_error (&error);
+
+  g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Cancelled");
+  record = gis_install_record_new (NULL, NULL, 0, 0, NULL, NULL, NULL, NULL,
+                                   error);
+  json = gis_install_record_to_json (record);
+  g_assert_nonnull (strstr (json, "\"outcome\":\"cancelled\""));
+}
+
+typedef struct {
+  gchar *tmpdir;
+  gchar *image_dir;
+  gchar *home_dir;
+  GVariant *record;
+} Fixture;
+
+static void
+fixture_set_up (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  fixture->tmpdir = g_dir_make_tmp ("eos-installer.XXXXXX", &error);
+  g_assert_no_error (error);
+
+  fixture->image_dir = g_build_filename (fixture->tmpdir, "imagedir", NULL);
+  fixture->home_dir = g_build_filename (fixture->tmpdir, "homedir", NULL);
+  g_assert_cmpint (g_mkdir (fixture->home_dir, 0755), ==, 0);
+
+  fixture->record = gis_install_record_new ("eos-eos3.8", "xz", 8000000,
+                                            2000000, NULL, NULL, NULL, NULL,
+                                            NULL);
+}
+
+static void
+fixture_tear_down (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, fixture->tmpdir, NULL, &error))
+    g_warning ("Failed to remove %s: %s", fixture->tmpdir, error->message);
+
+  g_clear_pointer (&fixture->tmpdir, g_free);
+  g_clear_pointer (&fixture->image_dir, g_free);
+  g_clear_pointer (&fixture->home_dir, g_free);
+  g_clear_pointer (&fixture->record, g_variant_unref);
+}
+
+/* Asserts that @file is the record file in @dir, holding @n_lines records */
+static void
+assert_records_in_dir (GFile       *file,
+                       const gchar *dir,
+                       guint        n_lines)
+{
+  g_autofree gchar *expected_path =
+    g_build_filename (dir, GIS_INSTALL_RECORD_BASENAME, NULL);
+  g_autofree gchar *path = g_file_get_path (file);
+  g_autofree gchar *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  g_autoptr(GError) error = NULL;
+  guint i;
+
+  g_assert_cmpstr (path, ==, expected_path);
+
+  g_file_get_contents (path, &contents, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (g_str_has_suffix (contents, "}\n"));
+
+  lines = g_strsplit (contents, "\n", -1);
+  /* …plus the empty string after the last newline */
+  g_assert_cmpuint (g_strv_length (lines), ==, n_lines + 1);
+  for (i = 0; i < n_lines; i++)
+    g_assert_true (g_str_has_prefix (lines[i], "{\"time\":"));
+}
+
+static void
+test_append_image_dir (Fixture      *fixture,
+                       gconstpointer user_data)
+{
+  g_autoptr(GFile) image_dir = g_file_new_for_path (fixture->image_dir);
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_assert_cmpint (g_mkdir (fixture->image_dir, 0755), ==, 0);
+
+  file = gis_install_record_append (fixture->record, image_dir,
+                                    fixture->home_dir, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (file);
+  assert_records_in_dir (file, fixture->image_dir, 1);
+  g_clear_object (&file);
+
+  /* Subsequent installs are added to the end */
+  file = gis_install_record_append (fixture->record, image_dir,
+                                    fixture->home_dir, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (file);
+  assert_records_in_dir (file, fixture->image_dir, 2);
+}
+
+static void
+test_append_home_dir (Fixture      *fixture,
+                      gconstpointer user_data)
+{
+  g_autoptr(GFile) image_dir = g_file_new_for_path (fixture->image_dir);
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+
+  /* The image directory doesn't exist, so the home directory is used */
+  file = gis_install_record_append (fixture->record, image_dir,
+                                    fixture->home_dir, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (file);
+  assert_records_in_dir (file, fixture->home_dir, 1);
+}
+
+static void
+test_append_nowhere (Fixture      *fixture,
+                     gconstpointer user_data)
+{
+  g_autoptr(GFile) image_dir = g_file_new_for_path (fixture->image_dir);
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+
+  file = gis_install_record_append (fixture->record, image_dir, NULL, NULL,
+                                    &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (file);
+  g_clear_error (&error);
+
+  file = gis_install_record_append (fixture->record, NULL, NULL, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (file);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/install-record/image-format", test_image_format);
+  g_test_add_func ("/install-record/json/success", test_json_success);
+  g_test_add_func ("/install-record/json/failure", test_json_failure);
+  g_test_add ("/install-record/append/image-dir", Fixture, NULL,
+              fixture_set_up, test_append_image_dir, fixture_tear_down);
+  g_test_add ("/install-record/append/home-dir", Fixture, NULL,
+              fixture_set_up, test_append_home_dir, fixture_tear_down);
+  g_test_add ("/install-record/append/nowhere", Fixture, NULL,
+              fixture_set_up, test_append_nowhere, fixture_tear_down);
+
+  return g_test_run ();
+}
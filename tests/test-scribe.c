@@ -32,7 +32,11 @@
 #include <gio/gunixoutputstream.h>
 
 #include "gis-errors.h"
+#include "gis-image-cache.h"
+#include "gis-image-verifier.h"
 #include "gis-scribe.h"
+#include "gis-split-image.h"
+#include "gis-squashfs-reader.h"
 #include "glnx-missing.h"
 #include "glnx-shutil.h"
 
@@ -72,6 +76,16 @@ typedef struct {
   guint64 read_error_offset;
 
   const gchar *gpg_path;
+
+  /* Number of targets to write to in addition to the main target. These are
+   * always regular files.
+   */
+  guint n_extra_targets;
+
+  /* If TRUE, the main target is an empty file, which the scribe must extend
+   * to the size of the image.
+   */
+  gboolean empty_target;
 } TestData;
 
 typedef struct {
@@ -85,6 +99,8 @@ typedef struct {
   GFile *checksum;
   gchar *target_path;
   GFile *target;
+  /* Paths to the extra targets, if data->n_extra_targets > 0. */
+  GPtrArray *extra_target_paths;
   /* Equal to data->uncompressed_size if that is non-0; IMAGE_SIZE_BYTES
    * otherwise.
    */
@@ -197,6 +213,24 @@ fixture_create_memfd (Fixture *fixture)
   return fd;
 }
 
+/* Creates a file at target_path, filled with easily-recognised data, and
+ * returns a writable fd for it.
+ */
+static int
+fixture_create_target_file (Fixture     *fixture,
+                            const gchar *target_path)
+{
+  g_autofree gchar *target_contents = g_malloc (fixture->uncompressed_size);
+  GError *error = NULL;
+
+  memset (target_contents, 'D', fixture->uncompressed_size);
+  g_file_set_contents (target_path, target_contents,
+                       fixture->uncompressed_size, &error);
+  g_assert_no_error (error);
+
+  return open (target_path, O_WRONLY | O_SYNC | O_CLOEXEC | O_EXCL);
+}
+
 static void
 fixture_set_up (Fixture *fixture,
                 gconstpointer user_data)
@@ -207,6 +241,7 @@ fixture_set_up (Fixture *fixture,
   g_autoptr(GInputStream) image_input = NULL;
   GError *error = NULL;
   int fd;
+  guint i;
 
   fixture->uncompressed_size = data->uncompressed_size ?: IMAGE_SIZE_BYTES;
   fixture->data = data;
@@ -236,6 +271,14 @@ fixture_set_up (Fixture *fixture,
   compressed_size = g_file_info_get_size (info);
   g_assert_cmpint (compressed_size, >, 0);
 
+  /* The scribe reads the image within a squashfs, not the squashfs itself,
+   * and decompresses split images as it reads them; see
+   * GisScribe:compressed-size.
+   */
+  if (gis_squashfs_reader_is_squashfs (fixture->image) ||
+      gis_split_image_is_split (fixture->image))
+    compressed_size = fixture->uncompressed_size;
+
   if (data->read_error.domain != 0)
     {
       g_autoptr(GInputStream) real_input =
@@ -257,16 +300,16 @@ fixture_set_up (Fixture *fixture,
     {
       fd = fixture_create_memfd (fixture);
     }
-  else
+  else if (data->empty_target)
     {
-      g_autofree gchar *target_contents = g_malloc (fixture->uncompressed_size);
-
-      memset (target_contents, 'D', fixture->uncompressed_size);
-      g_file_set_contents (fixture->target_path, target_contents,
-                           fixture->uncompressed_size, &error);
+      g_file_set_contents (fixture->target_path, "", 0, &error);
       g_assert_no_error (error);
-
-      fd = open (fixture->target_path, O_WRONLY | O_SYNC | O_CLOEXEC | O_EXCL);
+      fd = open (fixture->target_path, O_WRONLY | O_CLOEXEC);
+      fixture->memfd = -1;
+    }
+  else
+    {
+      fd = fixture_create_target_file (fixture, fixture->target_path);
       fixture->memfd = -1;
     }
 
@@ -283,6 +326,21 @@ fixture_set_up (Fixture *fixture,
                                   "drive-fd", fd,
                                   data->gpg_path ? "gpg-path" : NULL, data->gpg_path,
                                   NULL);
+
+  fixture->extra_target_paths = g_ptr_array_new_with_free_func (g_free);
+  for (i = 0; i < data->n_extra_targets; i++)
+    {
+      g_autofree gchar *basename = g_strdup_printf ("target-%u.img", i + 1);
+      gchar *extra_target_path = g_build_filename (fixture->tmpdir, basename,
+                                                   NULL);
+
+      g_ptr_array_add (fixture->extra_target_paths, extra_target_path);
+
+      fd = fixture_create_target_file (fixture, extra_target_path);
+      g_assert (fd >= 0);
+      gis_scribe_add_target (fixture->scribe, extra_target_path, fd);
+    }
+
   g_signal_connect (fixture->scribe, "notify::step",
                     (GCallback) test_scribe_notify_step_cb, fixture);
   g_signal_connect (fixture->scribe, "notify::progress",
@@ -306,6 +364,7 @@ fixture_tear_down (Fixture *fixture,
   g_clear_object (&fixture->checksum);
   g_clear_pointer (&fixture->target_path, g_free);
   g_clear_object (&fixture->target);
+  g_clear_pointer (&fixture->extra_target_paths, g_ptr_array_unref);
   g_clear_pointer (&fixture->main_thread, g_thread_unref);
 
   if (fixture->memfd != -1 && 0 != close (fixture->memfd))
@@ -424,16 +483,151 @@ test_error (Fixture       *fixture,
     assert_first_mib_zeroed (fixture);
 }
 
+static void
+assert_image_written (Fixture     *fixture,
+                      const gchar *target_path)
+{
+  gboolean ret;
+  g_autofree gchar *target_contents = NULL;
+  gsize target_length = 0;
+  g_autofree gchar *expected_contents = g_malloc (fixture->uncompressed_size);
+  GError *error = NULL;
+
+  ret = g_file_get_contents (target_path,
+                             &target_contents, &target_length,
+                             &error);
+  g_assert_no_error (error);
+  g_assert (ret);
+
+  memset (expected_contents, IMAGE_BYTE, fixture->uncompressed_size);
+  g_assert_cmpmem (expected_contents, fixture->uncompressed_size,
+                   target_contents, target_length);
+}
+
+/* Every byte of the image should have been written to each of @n_targets,
+ * and something should have been found to be the bottleneck.
+ */
+static void
+assert_metrics (Fixture *fixture,
+                guint    n_targets)
+{
+  g_autoptr(GVariant) metrics = gis_scribe_dup_metrics (fixture->scribe);
+  g_autoptr(GVariant) stages = NULL;
+  g_autoptr(GVariant) write = NULL;
+  g_autoptr(GVariant) bottleneck_stage = NULL;
+  const gchar *bottleneck = NULL;
+  guint64 bytes_out = 0;
+  guint64 queue_bytes = 0;
+  guint64 queue_capacity = 0;
+  gint64 elapsed_usec = -1;
+
+  g_assert_true (g_variant_lookup (metrics, "elapsed-usec", "x",
+                                   &elapsed_usec));
+  g_assert_cmpint (elapsed_usec, >, 0);
+
+  stages = g_variant_lookup_value (metrics, "stages",
+                                   G_VARIANT_TYPE ("a{sa{sv}}"));
+  g_assert_nonnull (stages);
+  g_assert_cmpuint (g_variant_n_children (stages), ==, 6);
+
+  write = g_variant_lookup_value (stages, "write", G_VARIANT_TYPE_VARDICT);
+  g_assert_nonnull (write);
+  g_assert_true (g_variant_lookup (write, "bytes-out", "t", &bytes_out));
+  g_assert_cmpuint (bytes_out, ==, fixture->uncompressed_size * n_targets);
+  g_assert_true (g_variant_lookup (write, "queue-bytes", "t", &queue_bytes));
+  g_assert_true (g_variant_lookup (write, "queue-capacity-bytes", "t",
+                                   &queue_capacity));
+  g_assert_cmpuint (queue_bytes, <=, queue_capacity);
+  g_assert_true (g_variant_lookup (metrics, "dirty-bytes", "t", NULL));
+
+  g_assert_true (g_variant_lookup (metrics, "bottleneck", "&s", &bottleneck));
+  bottleneck_stage = g_variant_lookup_value (stages, bottleneck,
+                                             G_VARIANT_TYPE_VARDICT);
+  g_assert_nonnull (bottleneck_stage);
+}
+
 static void
 test_write_success (Fixture       *fixture,
                     gconstpointer  user_data)
 {
   g_autoptr(GAsyncResult) result = NULL;
   gboolean ret;
+  GError *error = NULL;
+
+  gis_scribe_write_async (fixture->scribe, fixture->cancellable,
+                          test_scribe_write_cb, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  ret = gis_scribe_write_finish (fixture->scribe, result, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+
+  assert_image_written (fixture, fixture->target_path);
+  assert_metrics (fixture, 1);
+}
+
+static gint64
+lookup_stage_usec (GVariant    *stages,
+                   const gchar *stage,
+                   const gchar *key)
+{
+  g_autoptr(GVariant) metrics =
+    g_variant_lookup_value (stages, stage, G_VARIANT_TYPE_VARDICT);
+  gint64 usec = -1;
+
+  g_assert_nonnull (metrics);
+  g_assert_true (g_variant_lookup (metrics, key, "x", &usec));
+
+  return usec;
+}
+
+/* Writes a split image, which is decompressed as the tee reads it. The time
+ * this takes should count as decompression, not as reading the source.
+ */
+static void
+test_write_split (Fixture       *fixture,
+                  gconstpointer  user_data)
+{
+  g_autoptr(GVariant) metrics = NULL;
+  g_autoptr(GVariant) stages = NULL;
+  g_autoptr(GVariant) decompress = NULL;
+  guint64 bytes_out = 0;
+
+  test_write_success (fixture, user_data);
+
+  metrics = gis_scribe_dup_metrics (fixture->scribe);
+  stages = g_variant_lookup_value (metrics, "stages",
+                                   G_VARIANT_TYPE ("a{sa{sv}}"));
+  g_assert_nonnull (stages);
+
+  g_assert_cmpint (lookup_stage_usec (stages, "tee", "busy-usec"), ==, 0);
+  g_assert_cmpint (lookup_stage_usec (stages, "tee", "upstream-blocked-usec"),
+                   >, 0);
+  g_assert_cmpint (lookup_stage_usec (stages, "decompress", "busy-usec"),
+                   >, 0);
+
+  decompress = g_variant_lookup_value (stages, "decompress",
+                                       G_VARIANT_TYPE_VARDICT);
+  g_assert_true (g_variant_lookup (decompress, "bytes-out", "t", &bytes_out));
+  g_assert_cmpuint (bytes_out, ==, fixture->uncompressed_size);
+}
+
+/* Writes an image whose second half is zeros to a regular file. The zeros
+ * should be skipped over, leaving a hole, but the file should still read back
+ * as the image.
+ */
+static void
+test_write_sparse (Fixture       *fixture,
+                   gconstpointer  user_data)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+  gboolean ret;
+  g_autoptr(GError) error = NULL;
   g_autofree gchar *target_contents = NULL;
   gsize target_length = 0;
-  g_autofree gchar *expected_contents = g_malloc (fixture->uncompressed_size);
-  GError *error = NULL;
+  g_autofree gchar *expected_contents = g_malloc0 (fixture->uncompressed_size);
+  struct stat st;
 
   gis_scribe_write_async (fixture->scribe, fixture->cancellable,
                           test_scribe_write_cb, &result);
@@ -448,11 +642,442 @@ test_write_success (Fixture       *fixture,
                              &target_contents, &target_length,
                              &error);
   g_assert_no_error (error);
-  g_assert (ret);
+  g_assert_true (ret);
 
-  memset (expected_contents, IMAGE_BYTE, fixture->uncompressed_size);
+  memset (expected_contents, IMAGE_BYTE, fixture->uncompressed_size / 2);
   g_assert_cmpmem (expected_contents, fixture->uncompressed_size,
                    target_contents, target_length);
+
+  g_assert_cmpint (stat (fixture->target_path, &st), ==, 0);
+  g_assert_cmpint (st.st_blocks * 512, <, fixture->uncompressed_size);
+
+  assert_metrics (fixture, 1);
+}
+
+/* Writes to the main target and fixture->extra_target_paths at once. The
+ * extra targets should always be written successfully; the main target may be
+ * set up to fail, in which case the operation as a whole should fail with that
+ * error.
+ */
+static void
+test_write_multiple (Fixture       *fixture,
+                     gconstpointer  user_data)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+  gboolean ret;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GError) target_error = NULL;
+  g_autoptr(GVariant) metrics = NULL;
+  gint64 elapsed_usec = 0;
+  guint i;
+
+  g_assert_cmpuint (gis_scribe_get_n_targets (fixture->scribe), ==,
+                    1 + fixture->extra_target_paths->len);
+
+  gis_scribe_write_async (fixture->scribe, fixture->cancellable,
+                          test_scribe_write_cb, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  ret = gis_scribe_write_finish (fixture->scribe, result, &error);
+  target_error = gis_scribe_dup_target_error (fixture->scribe, 0);
+
+  if (fixture->data->error_domain != 0)
+    {
+      g_assert_false (ret);
+      g_assert_error (error,
+                      fixture->data->error_domain,
+                      fixture->data->error_code);
+      g_assert_error (target_error,
+                      fixture->data->error_domain,
+                      fixture->data->error_code);
+      /* The failed target should be named in the overall error */
+      g_assert_nonnull (strstr (error->message, fixture->target_path));
+      assert_first_mib_zeroed (fixture);
+    }
+  else
+    {
+      g_assert_no_error (error);
+      g_assert_true (ret);
+      g_assert_no_error (target_error);
+      assert_image_written (fixture, fixture->target_path);
+      assert_metrics (fixture, 1 + fixture->extra_target_paths->len);
+    }
+
+  /* Each target's duration is its own, and none is longer than the write */
+  metrics = gis_scribe_dup_metrics (fixture->scribe);
+  g_assert_true (g_variant_lookup (metrics, "elapsed-usec", "x",
+                                   &elapsed_usec));
+
+  for (i = 0; i < fixture->extra_target_paths->len; i++)
+    {
+      const gchar *extra_target_path =
+        g_ptr_array_index (fixture->extra_target_paths, i);
+      g_autoptr(GError) extra_target_error =
+        gis_scribe_dup_target_error (fixture->scribe, i + 1);
+
+      g_assert_cmpstr (gis_scribe_get_target_drive_path (fixture->scribe, i + 1),
+                       ==, extra_target_path);
+      g_assert_no_error (extra_target_error);
+      g_assert_cmpfloat (gis_scribe_get_target_progress (fixture->scribe, i + 1),
+                         ==, 1);
+      g_assert_cmpint (gis_scribe_get_target_duration (fixture->scribe, i + 1),
+                       >, 0);
+      g_assert_cmpint (gis_scribe_get_target_duration (fixture->scribe, i + 1),
+                       <=, elapsed_usec);
+      assert_image_written (fixture, extra_target_path);
+    }
+}
+
+static void
+write_and_wait (Fixture   *fixture,
+                gboolean  *ret,
+                GError   **error)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+
+  gis_scribe_write_async (fixture->scribe, fixture->cancellable,
+                          test_scribe_write_cb, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  *ret = gis_scribe_write_finish (fixture->scribe, result, error);
+}
+
+/* Writes the image to the main target, then uses the same GisScribe to write
+ * it to a second target, as batch mode does.
+ */
+static void
+test_write_reuse (Fixture       *fixture,
+                  gconstpointer  user_data)
+{
+  gboolean ret;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *second_target_path =
+    g_build_filename (fixture->tmpdir, "second-target.img", NULL);
+  int fd;
+
+  write_and_wait (fixture, &ret, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  assert_image_written (fixture, fixture->target_path);
+
+  /* Each target may only be written once */
+  write_and_wait (fixture, &ret, &error);
+  g_assert_error (error, GIS_INSTALL_ERROR, GIS_INSTALL_ERROR_INTERNAL_ERROR);
+  g_assert_false (ret);
+  g_clear_error (&error);
+
+  /* The previous target's result is still available... */
+  g_assert_cmpuint (gis_scribe_get_n_targets (fixture->scribe), ==, 1);
+  g_assert_cmpstr (gis_scribe_get_target_drive_path (fixture->scribe, 0),
+                   ==, fixture->target_path);
+
+  /* ...until a new one is added. */
+  fd = fixture_create_target_file (fixture, second_target_path);
+  g_assert (fd >= 0);
+  gis_scribe_add_target (fixture->scribe, second_target_path, fd);
+  g_assert_cmpuint (gis_scribe_get_n_targets (fixture->scribe), ==, 1);
+  g_assert_cmpstr (gis_scribe_get_target_drive_path (fixture->scribe, 0),
+                   ==, second_target_path);
+
+  /* Progress starts again from step 1 */
+  fixture->step = 0;
+  fixture->progress = 0;
+
+  write_and_wait (fixture, &ret, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  assert_image_written (fixture, second_target_path);
+}
+
+/* Returns the paths of the images in @cache_dir. */
+static GPtrArray *
+list_cached_images (const gchar *cache_dir)
+{
+  g_autoptr(GPtrArray) paths = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GDir) dir = NULL;
+  g_autoptr(GError) error = NULL;
+  const gchar *name;
+
+  dir = g_dir_open (cache_dir, 0, &error);
+  g_assert_no_error (error);
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    g_ptr_array_add (paths, g_build_filename (cache_dir, name, NULL));
+
+  return g_steal_pointer (&paths);
+}
+
+/* Writes the image with a cache of decompressed images. If the image is
+ * expected to fail verification, checks that it is not cached; otherwise,
+ * checks that the second write reads the image from the cache.
+ */
+static void
+test_write_cache (Fixture       *fixture,
+                  gconstpointer  user_data)
+{
+  g_autofree gchar *cache_dir = g_build_filename (fixture->tmpdir, "cache",
+                                                  NULL);
+  g_autofree gchar *second_target_path =
+    g_build_filename (fixture->tmpdir, "second-target.img", NULL);
+  g_autoptr(GisImageCache) cache =
+    gis_image_cache_new (cache_dir, 0, 1,
+                         GIS_IMAGE_CACHE_EVICTION_LEAST_RECENTLY_USED);
+  g_autoptr(GPtrArray) cached = NULL;
+  g_autofree gchar *cached_contents = NULL;
+  gsize cached_length = 0;
+  g_autofree gchar *target_contents = NULL;
+  gsize target_length = 0;
+  gboolean ret;
+  g_autoptr(GError) error = NULL;
+  int fd;
+
+  g_object_set (fixture->scribe, "image-cache", cache, NULL);
+
+  write_and_wait (fixture, &ret, &error);
+
+  if (fixture->data->error_domain != 0)
+    {
+      g_assert_error (error,
+                      fixture->data->error_domain,
+                      fixture->data->error_code);
+      g_assert_false (ret);
+
+      /* An image which failed verification must not be cached. */
+      cached = list_cached_images (cache_dir);
+      g_assert_cmpuint (cached->len, ==, 0);
+      return;
+    }
+
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  assert_image_written (fixture, fixture->target_path);
+
+  /* The decompressed image should now be cached */
+  cached = list_cached_images (cache_dir);
+  g_assert_cmpuint (cached->len, ==, 1);
+  g_file_get_contents (g_ptr_array_index (cached, 0),
+                       &cached_contents, &cached_length, &error);
+  g_assert_no_error (error);
+  g_file_get_contents (fixture->target_path,
+                       &target_contents, &target_length, &error);
+  g_assert_no_error (error);
+  g_assert_cmpmem (cached_contents, cached_length,
+                   target_contents, target_length);
+
+  /* Replace the cached image with different data of the same size, so we can
+   * tell whether the next write reads it rather than the real image.
+   */
+  memset (cached_contents, 'c', cached_length);
+  g_file_set_contents (g_ptr_array_index (cached, 0),
+                       cached_contents, cached_length, &error);
+  g_assert_no_error (error);
+
+  fd = fixture_create_target_file (fixture, second_target_path);
+  g_assert (fd >= 0);
+  gis_scribe_add_target (fixture->scribe, second_target_path, fd);
+
+  fixture->step = 0;
+  fixture->progress = 0;
+
+  write_and_wait (fixture, &ret, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+
+  g_clear_pointer (&target_contents, g_free);
+  g_file_get_contents (second_target_path,
+                       &target_contents, &target_length, &error);
+  g_assert_no_error (error);
+  g_assert_cmpmem (cached_contents, cached_length,
+                   target_contents, target_length);
+}
+
+static void
+test_scribe_verify_cb (GObject      *source,
+                       GAsyncResult *result,
+                       gpointer      data)
+{
+  GAsyncResult **result_out = data;
+
+  *result_out = g_object_ref (result);
+}
+
+/* Verifies the image in the background before writing it. The GPG executable
+ * given to the scribe always fails, so the write only succeeds if the image
+ * is not verified again.
+ */
+static void
+test_write_preverified (Fixture       *fixture,
+                        gconstpointer  user_data)
+{
+  g_autoptr(GisImageVerifier) verifier =
+    g_object_new (GIS_TYPE_IMAGE_VERIFIER,
+                  "keyring-path", keyring_path,
+                  NULL);
+  g_autoptr(GAsyncResult) result = NULL;
+  gboolean ret;
+  g_autoptr(GError) error = NULL;
+
+  gis_image_verifier_verify_async (verifier, fixture->image,
+                                   fixture->signature, fixture->checksum,
+                                   fixture->cancellable,
+                                   test_scribe_verify_cb, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  ret = gis_image_verifier_verify_finish (verifier, result, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+
+  g_object_set (fixture->scribe, "image-verifier", verifier, NULL);
+
+  write_and_wait (fixture, &ret, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  assert_image_written (fixture, fixture->target_path);
+}
+
+static gboolean
+test_scribe_timeout_cb (gpointer data)
+{
+  gboolean *timed_out = data;
+
+  *timed_out = TRUE;
+  return G_SOURCE_REMOVE;
+}
+
+/* Pre-warms the write, with no targets, then adds the main target and writes
+ * to it. If the image is expected to fail verification, checks that the write
+ * fails.
+ */
+static void
+test_write_prewarm (Fixture       *fixture,
+                    gconstpointer  user_data)
+{
+  g_autoptr(GCancellable) prewarm_cancellable = g_cancellable_new ();
+  gboolean timed_out = FALSE;
+  gboolean ret;
+  g_autoptr(GError) error = NULL;
+  guint64 compressed_size;
+  int fd;
+
+  /* The fixture's scribe was created with a target, but the point is to
+   * start before the target is known.
+   */
+  g_object_get (fixture->scribe, "compressed-size", &compressed_size, NULL);
+  g_signal_handlers_disconnect_by_data (fixture->scribe, fixture);
+  g_clear_object (&fixture->scribe);
+  fixture->scribe = g_object_new (GIS_TYPE_SCRIBE,
+                                  "image", fixture->image,
+                                  "image-size", fixture->uncompressed_size,
+                                  "compressed-size", compressed_size,
+                                  "signature", fixture->signature,
+                                  "checksum", fixture->checksum,
+                                  "keyring-path", keyring_path,
+                                  NULL);
+  g_signal_connect (fixture->scribe, "notify::step",
+                    (GCallback) test_scribe_notify_step_cb, fixture);
+  g_signal_connect (fixture->scribe, "notify::progress",
+                    (GCallback) test_scribe_notify_progress_cb, fixture);
+
+  gis_scribe_prewarm (fixture->scribe, prewarm_cancellable);
+
+  /* Give the pipeline a chance to fill up */
+  g_timeout_add (100, test_scribe_timeout_cb, &timed_out);
+  while (!timed_out)
+    g_main_context_iteration (NULL, TRUE);
+
+  fd = open (fixture->target_path, O_WRONLY | O_SYNC | O_CLOEXEC);
+  g_assert (fd >= 0);
+  gis_scribe_add_target (fixture->scribe, fixture->target_path, fd);
+
+  write_and_wait (fixture, &ret, &error);
+
+  /* Once the pipeline has been handed over, cancelling the pre-warm has no
+   * effect.
+   */
+  g_cancellable_cancel (prewarm_cancellable);
+
+  if (fixture->data->error_domain != 0)
+    {
+      g_assert_error (error,
+                      fixture->data->error_domain,
+                      fixture->data->error_code);
+      g_assert_false (ret);
+    }
+  else
+    {
+      g_assert_no_error (error);
+      g_assert_true (ret);
+      assert_image_written (fixture, fixture->target_path);
+    }
+}
+
+/* Pre-warms the write, then abandons it. The scribe should be left able to
+ * write the image from scratch.
+ */
+static void
+test_write_prewarm_cancelled (Fixture       *fixture,
+                              gconstpointer  user_data)
+{
+  g_autoptr(GCancellable) prewarm_cancellable = g_cancellable_new ();
+  gboolean ret = FALSE;
+  g_autoptr(GError) error = NULL;
+
+  gis_scribe_prewarm (fixture->scribe, prewarm_cancellable);
+  g_cancellable_cancel (prewarm_cancellable);
+
+  /* Until the abandoned pipeline has stopped, the scribe is busy. */
+  do
+    {
+      g_clear_error (&error);
+      g_main_context_iteration (NULL, FALSE);
+      write_and_wait (fixture, &ret, &error);
+    }
+  while (g_error_matches (error, GIS_INSTALL_ERROR,
+                          GIS_INSTALL_ERROR_INTERNAL_ERROR));
+
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  assert_image_written (fixture, fixture->target_path);
+}
+
+/* Pre-warms a write whose pipeline fails straight away, then abandons it once
+ * the pipeline has stopped, as the confirmation page's Cancel button does.
+ * The scribe should be left able to try again, and fail in the same way.
+ */
+static void
+test_write_prewarm_failed_cancelled (Fixture       *fixture,
+                                     gconstpointer  user_data)
+{
+  g_autoptr(GCancellable) prewarm_cancellable = g_cancellable_new ();
+  gboolean timed_out = FALSE;
+  gboolean ret = FALSE;
+  g_autoptr(GError) error = NULL;
+
+  gis_scribe_prewarm (fixture->scribe, prewarm_cancellable);
+
+  /* Give the pipeline a chance to fail */
+  g_timeout_add (500, test_scribe_timeout_cb, &timed_out);
+  while (!timed_out)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_cancellable_cancel (prewarm_cancellable);
+
+  do
+    {
+      g_clear_error (&error);
+      g_main_context_iteration (NULL, FALSE);
+      write_and_wait (fixture, &ret, &error);
+    }
+  while (g_error_matches (error, GIS_INSTALL_ERROR,
+                          GIS_INSTALL_ERROR_INTERNAL_ERROR));
+
+  g_assert_error (error,
+                  fixture->data->error_domain,
+                  fixture->data->error_code);
+  g_assert_false (ret);
 }
 
 static gchar *
@@ -495,6 +1120,12 @@ main (int argc, char *argv[])
   g_autofree gchar *s8193_gz_sig_path  = test_build_filename (G_TEST_BUILT, "w-8193.img.gz.asc");
   g_autofree gchar *s8193_xz_path      = test_build_filename (G_TEST_BUILT, "w-8193.img.xz");
   g_autofree gchar *s8193_xz_sig_path  = test_build_filename (G_TEST_BUILT, "w-8193.img.xz.asc");
+  g_autofree gchar *squash_path        = test_build_filename (G_TEST_BUILT, "w.squash");
+  g_autofree gchar *s8193_squash_path  = test_build_filename (G_TEST_BUILT, "w-8193.squash");
+  g_autofree gchar *split_path         = test_build_filename (G_TEST_BUILT, "w-split.img.xz.000");
+  g_autofree gchar *split_sig_path     = test_build_filename (G_TEST_BUILT, "w-split.img.xz.sha256.asc");
+  g_autofree gchar *zeros_path         = test_build_filename (G_TEST_BUILT, "z.img");
+  g_autofree gchar *zeros_csum_path    = test_build_filename (G_TEST_BUILT, "z.img.sha256");
   g_autofree gchar *wjt_sig_path       = test_build_filename (G_TEST_DIST, "wjt.asc");
   g_autofree gchar *bad_csum_path      = test_build_filename (G_TEST_DIST, "bad.sha256");
   g_autofree gchar *invalid1_csum_path = test_build_filename (G_TEST_DIST, "invalid-1.sha256");
@@ -775,6 +1406,64 @@ main (int argc, char *argv[])
               test_write_success,
               fixture_tear_down);
 
+  /* The signature or checksum of a squashfs image is for the image within
+   * it. w.squash is compressed with xz; w-8193.squash with gzip, and the end
+   * of its image is in a fragment block.
+   */
+  TestData squashfs_checksum = {
+      .image_path = squash_path,
+      .signature_path = missing_path,
+      .checksum_path = image_csum_path,
+  };
+  g_test_add ("/scribe/squashfs/checksum", Fixture, &squashfs_checksum,
+              fixture_set_up,
+              test_write_success,
+              fixture_tear_down);
+
+  TestData squashfs_signature = {
+      .image_path = s8193_squash_path,
+      .signature_path = s8193_sig_path,
+      .checksum_path = missing_path,
+      .uncompressed_size = 8193 * 512,
+  };
+  g_test_add ("/scribe/squashfs/signature", Fixture, &squashfs_signature,
+              fixture_set_up,
+              test_write_success,
+              fixture_tear_down);
+
+  /* The signature of a split image is for its manifest */
+  TestData split = {
+      .image_path = split_path,
+      .signature_path = split_sig_path,
+      .checksum_path = missing_path,
+  };
+  g_test_add ("/scribe/split", Fixture, &split,
+              fixture_set_up,
+              test_write_split,
+              fixture_tear_down);
+
+  /* Writing to a file over its old contents, and to an empty file */
+  TestData sparse = {
+      .image_path = zeros_path,
+      .signature_path = missing_path,
+      .checksum_path = zeros_csum_path,
+  };
+  g_test_add ("/scribe/sparse-file/overwrite", Fixture, &sparse,
+              fixture_set_up,
+              test_write_sparse,
+              fixture_tear_down);
+
+  TestData sparse_empty = {
+      .image_path = zeros_path,
+      .signature_path = missing_path,
+      .checksum_path = zeros_csum_path,
+      .empty_target = TRUE,
+  };
+  g_test_add ("/scribe/sparse-file/empty", Fixture, &sparse_empty,
+              fixture_set_up,
+              test_write_sparse,
+              fixture_tear_down);
+
   /* IMAGE_SIZE_BYTES / 2 is a multiple of the 1 MiB block size used by
    * GisScribe so it is likely that it will not hit a short write, but two full
    * writes followed by an error.
@@ -935,6 +1624,115 @@ main (int argc, char *argv[])
               test_error,
               fixture_tear_down);
 
+  /* Write one image to three targets at once */
+  TestData multiple_targets = {
+      .image_path = image_xz_path,
+      .signature_path = image_xz_sig_path,
+      .checksum_path = missing_path,
+      .n_extra_targets = 2,
+  };
+  g_test_add ("/scribe/multiple-targets/success", Fixture, &multiple_targets,
+              fixture_set_up,
+              test_write_multiple,
+              fixture_tear_down);
+
+  /* Writing to one target fails; the other targets should be unaffected */
+  TestData multiple_targets_write_error = {
+      .image_path = image_path,
+      .signature_path = image_sig_path,
+      .checksum_path = missing_path,
+      .error_domain = G_IO_ERROR,
+      .error_code = G_IO_ERROR_PERMISSION_DENIED,
+      .create_memfd = TRUE,
+      .memfd_size = IMAGE_SIZE_BYTES / 2,
+      .n_extra_targets = 2,
+  };
+  g_test_add ("/scribe/multiple-targets/write-error", Fixture,
+              &multiple_targets_write_error,
+              fixture_set_up,
+              test_write_multiple,
+              fixture_tear_down);
+
+  /* Verification fails; all targets should fail */
+  TestData multiple_targets_bad_checksum = {
+      .image_path = image_path,
+      .signature_path = missing_path,
+      .checksum_path = bad_csum_path,
+      .error_domain = GIS_IMAGE_ERROR,
+      .error_code = GIS_IMAGE_ERROR_VERIFICATION_FAILED,
+      .n_extra_targets = 2,
+  };
+  g_test_add ("/scribe/multiple-targets/bad-checksum", Fixture,
+              &multiple_targets_bad_checksum,
+              fixture_set_up,
+              test_error,
+              fixture_tear_down);
+
+  /* Write the image twice with the same GisScribe */
+  TestData reuse = {
+      .image_path = image_gz_path,
+      .signature_path = image_gz_sig_path,
+      .checksum_path = missing_path,
+  };
+  g_test_add ("/scribe/reuse", Fixture, &reuse,
+              fixture_set_up,
+              test_write_reuse,
+              fixture_tear_down);
+
+  /* Write the image twice with a cache, so the second write reads the
+   * decompressed image from the cache
+   */
+  TestData cache_xz = {
+      .image_path = image_xz_path,
+      .signature_path = image_xz_sig_path,
+      .checksum_path = missing_path,
+  };
+  g_test_add ("/scribe/cache/success", Fixture, &cache_xz,
+              fixture_set_up,
+              test_write_cache,
+              fixture_tear_down);
+
+  /* An image which fails verification should not be cached */
+  g_test_add ("/scribe/cache/bad-signature", Fixture, &bad_signature,
+              fixture_set_up,
+              test_write_cache,
+              fixture_tear_down);
+
+  /* Verify the image in the background before writing it, so the scribe
+   * need not verify it again
+   */
+  TestData preverified = {
+      .image_path = image_xz_path,
+      .signature_path = image_xz_sig_path,
+      .checksum_path = missing_path,
+      .gpg_path = "/bin/false",
+  };
+  g_test_add ("/scribe/preverified", Fixture, &preverified,
+              fixture_set_up,
+              test_write_preverified,
+              fixture_tear_down);
+
+  /* Start reading the image before there are any targets */
+  g_test_add ("/scribe/prewarm/success", Fixture, &good_signature_xz,
+              fixture_set_up,
+              test_write_prewarm,
+              fixture_tear_down);
+
+  g_test_add ("/scribe/prewarm/bad-signature", Fixture, &bad_signature,
+              fixture_set_up,
+              test_write_prewarm,
+              fixture_tear_down);
+
+  g_test_add ("/scribe/prewarm/cancelled", Fixture, &good_signature_gz,
+              fixture_set_up,
+              test_write_prewarm_cancelled,
+              fixture_tear_down);
+
+  g_test_add ("/scribe/prewarm/failed-cancelled", Fixture, &read_error_start,
+              fixture_set_up,
+              test_write_prewarm_failed_cancelled,
+              fixture_tear_down);
+
   int ret = g_test_run ();
 
   g_free (keyring_path);
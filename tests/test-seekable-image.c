@@ -0,0 +1,416 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <locale.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <lzma.h>
+
+#include "crc32.h"
+#include "gduxzdecompressor.h"
+#include "gis-seekable-image.h"
+#include "gpt.h"
+
+/* 4 MiB, with the GPT at either end */
+#define N_SECTORS 8192
+#define IMAGE_SIZE (N_SECTORS * SECTOR_SIZE)
+#define PTABLE_COUNT 128
+#define PTABLE_SECTORS (PTABLE_COUNT * GPT_PART_SIZE / SECTOR_SIZE)
+#define FIRST_USABLE_LBA (2 + PTABLE_SECTORS)
+#define LAST_USABLE_LBA (N_SECTORS - 2 - PTABLE_SECTORS)
+#define BACKUP_PTABLE_LBA (LAST_USABLE_LBA + 1)
+
+static const guint8 GUID_EFI[] = {
+  0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8, 0xd2, 0x11,
+  0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b,
+};
+static const guint8 GUID_LINUX_ROOTFS_X86_64[] = {
+  0xe3, 0xbc, 0x68, 0x4f, 0xcd, 0xe8, 0xb1, 0x4d,
+  0x96, 0xe7, 0xfb, 0xca, 0xf9, 0x84, 0xb7, 0x09,
+};
+
+typedef struct {
+  guint8 *image;
+  gchar *path;
+} Fixture;
+
+static struct gpt_header *
+get_header (Fixture *fixture,
+            guint64  lba)
+{
+  return (struct gpt_header *) (fixture->image + lba * SECTOR_SIZE);
+}
+
+/* Fills in the CRCs of the header at @lba, and of its partition table. */
+static void
+update_crcs (Fixture *fixture,
+             guint64  lba)
+{
+  struct gpt_header *header = get_header (fixture, lba);
+
+  header->ptable_crc =
+    calc_crc32 (fixture->image + header->ptable_starting_lba * SECTOR_SIZE,
+                PTABLE_COUNT * GPT_PART_SIZE);
+  header->crc = 0;
+  header->crc = calc_crc32 (header, GPT_HEADER_SIZE);
+}
+
+/* Builds an image with an ESP and an Endless OS root partition, described
+ * both by the primary GPT at the start and the backup GPT at the end. Between
+ * them, each 32-bit word holds its own offset.
+ */
+static void
+fixture_set_up (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  struct gpt_header *primary, *backup;
+  struct gpt_partition *partitions;
+  g_autoptr(GError) error = NULL;
+  guint32 *words;
+  gsize i;
+  gint fd;
+
+  fixture->image = g_malloc0 (IMAGE_SIZE);
+
+  words = (guint32 *) (fixture->image + FIRST_USABLE_LBA * SECTOR_SIZE);
+  for (i = 0; i < (LAST_USABLE_LBA + 1 - FIRST_USABLE_LBA) * SECTOR_SIZE / 4; i++)
+    words[i] = FIRST_USABLE_LBA * SECTOR_SIZE + i * 4;
+
+  partitions = (struct gpt_partition *) (fixture->image + 2 * SECTOR_SIZE);
+  memcpy (partitions[0].type_guid, GUID_EFI, 16);
+  partitions[0].first_lba = FIRST_USABLE_LBA;
+  partitions[0].last_lba = 2047;
+  memcpy (partitions[1].type_guid, GUID_LINUX_ROOTFS_X86_64, 16);
+  partitions[1].first_lba = 2048;
+  partitions[1].last_lba = LAST_USABLE_LBA;
+  /* Flag 55 */
+  partitions[1].attributes[6] = 0x80;
+  memcpy (fixture->image + BACKUP_PTABLE_LBA * SECTOR_SIZE, partitions,
+          PTABLE_COUNT * GPT_PART_SIZE);
+
+  primary = get_header (fixture, 1);
+  memcpy (primary->signature, "EFI PART", 8);
+  primary->revision = 0x00010000;
+  primary->header_size = GPT_HEADER_SIZE;
+  primary->current_lba = 1;
+  primary->backup_lba = N_SECTORS - 1;
+  primary->first_usable_lba = FIRST_USABLE_LBA;
+  primary->last_usable_lba = LAST_USABLE_LBA;
+  memset (primary->disk_guid, 0x42, 16);
+  primary->ptable_starting_lba = 2;
+  primary->ptable_count = PTABLE_COUNT;
+  primary->ptable_partition_size = GPT_PART_SIZE;
+
+  backup = get_header (fixture, N_SECTORS - 1);
+  memcpy (backup, primary, SECTOR_SIZE);
+  backup->current_lba = N_SECTORS - 1;
+  backup->backup_lba = 1;
+  backup->ptable_starting_lba = BACKUP_PTABLE_LBA;
+
+  update_crcs (fixture, 1);
+  update_crcs (fixture, N_SECTORS - 1);
+
+  fd = g_file_open_tmp ("eos-installer-XXXXXX.img", &fixture->path, &error);
+  g_assert_no_error (error);
+  close (fd);
+}
+
+static void
+fixture_tear_down (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_unlink (fixture->path);
+  g_clear_pointer (&fixture->path, g_free);
+  g_clear_pointer (&fixture->image, g_free);
+}
+
+static void
+write_raw (Fixture *fixture)
+{
+  g_autoptr(GError) error = NULL;
+
+  g_file_set_contents (fixture->path, (const gchar *) fixture->image,
+                       IMAGE_SIZE, &error);
+  g_assert_no_error (error);
+}
+
+/* Compresses the image as @n_streams concatenated xz streams, each holding a
+ * single block and followed by some Stream Padding.
+ */
+static void
+write_xz (Fixture *fixture,
+          guint    n_streams)
+{
+  gsize stream_size = IMAGE_SIZE / n_streams;
+  gsize max_len = n_streams * (lzma_stream_buffer_bound (stream_size) + 4);
+  g_autofree guint8 *xz = g_malloc0 (max_len);
+  g_autoptr(GError) error = NULL;
+  size_t len = 0;
+  guint i;
+
+  for (i = 0; i < n_streams; i++)
+    {
+      g_assert_cmpint (lzma_easy_buffer_encode (0, LZMA_CHECK_CRC64, NULL,
+                                                fixture->image + i * stream_size,
+                                                stream_size, xz, &len, max_len),
+                       ==, LZMA_OK);
+      len += 4;
+    }
+
+  g_file_set_contents (fixture->path, (const gchar *) xz, len, &error);
+  g_assert_no_error (error);
+}
+
+static GisSeekableImage *
+open_image (Fixture *fixture)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (fixture->path);
+  g_autoptr(GisSeekableImage) seekable = NULL;
+  g_autoptr(GError) error = NULL;
+
+  seekable = gis_seekable_image_open (file, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (seekable);
+  g_assert_cmpuint (gis_seekable_image_get_size (seekable), ==, IMAGE_SIZE);
+
+  return g_steal_pointer (&seekable);
+}
+
+static void
+assert_read_at (Fixture          *fixture,
+                GisSeekableImage *seekable,
+                guint64           offset,
+                gsize             count)
+{
+  g_autofree guint8 *buf = g_malloc (count);
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+
+  ret = gis_seekable_image_read_at (seekable, offset, buf, count, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  g_assert_cmpmem (buf, count, fixture->image + offset, count);
+}
+
+static void
+assert_gpt_valid (GisSeekableImage *seekable)
+{
+  g_autoptr(GError) error = NULL;
+  guint64 size = 0;
+  gboolean ret;
+
+  ret = gis_seekable_image_check_gpt (seekable, &size, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  g_assert_cmpuint (size, ==,
+                    2 * SECTOR_SIZE + PTABLE_COUNT * GPT_PART_SIZE +
+                    LAST_USABLE_LBA * SECTOR_SIZE);
+}
+
+static void
+assert_reads (Fixture          *fixture,
+              GisSeekableImage *seekable)
+{
+  assert_read_at (fixture, seekable, 0, SECTOR_SIZE);
+  assert_read_at (fixture, seekable, 12345, 6789);
+  /* Spans two xz streams, when there is more than one */
+  assert_read_at (fixture, seekable, IMAGE_SIZE / 2 - 100, 200);
+  assert_read_at (fixture, seekable, IMAGE_SIZE - SECTOR_SIZE, SECTOR_SIZE);
+  assert_read_at (fixture, seekable, 0, IMAGE_SIZE);
+  assert_read_at (fixture, seekable, IMAGE_SIZE, 0);
+}
+
+static void
+test_raw (Fixture      *fixture,
+          gconstpointer user_data)
+{
+  g_autoptr(GisSeekableImage) seekable = NULL;
+
+  write_raw (fixture);
+  seekable = open_image (fixture);
+  assert_reads (fixture, seekable);
+  assert_gpt_valid (seekable);
+}
+
+static void
+test_xz (Fixture      *fixture,
+         gconstpointer user_data)
+{
+  guint n_streams = GPOINTER_TO_UINT (user_data);
+  g_autoptr(GisSeekableImage) seekable = NULL;
+
+  write_xz (fixture, n_streams);
+  seekable = open_image (fixture);
+  assert_reads (fixture, seekable);
+  assert_gpt_valid (seekable);
+}
+
+/* The xz index also tells us how far through the uncompressed image a given
+ * offset in the compressed file is.
+ */
+static void
+test_xz_block_map (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (fixture->path);
+  g_autoptr(GArray) block_map = NULL;
+  const GduXzBlockOffset *offset;
+  guint64 previous = 0;
+  guint64 file_size;
+  guint i;
+
+  write_xz (fixture, 4);
+  block_map = gdu_xz_decompressor_get_block_map (file);
+  g_assert_nonnull (block_map);
+
+  /* One entry per block, plus the end */
+  g_assert_cmpuint (block_map->len, ==, 5);
+  for (i = 0; i < block_map->len; i++)
+    {
+      offset = &g_array_index (block_map, GduXzBlockOffset, i);
+      g_assert_cmpuint (offset->uncompressed_offset, ==, i * IMAGE_SIZE / 4);
+      g_assert_cmpuint (gdu_xz_decompressor_map_offset (block_map,
+                                                        offset->compressed_offset),
+                        ==, offset->uncompressed_offset);
+    }
+
+  file_size = offset->compressed_offset;
+  for (i = 0; i <= 100; i++)
+    {
+      guint64 mapped = gdu_xz_decompressor_map_offset (block_map,
+                                                       file_size * i / 100);
+
+      g_assert_cmpuint (mapped, >=, previous);
+      g_assert_cmpuint (mapped, <=, IMAGE_SIZE);
+      previous = mapped;
+    }
+
+  g_assert_cmpuint (gdu_xz_decompressor_map_offset (block_map, G_MAXUINT64),
+                    ==, IMAGE_SIZE);
+}
+
+static void
+test_past_end (Fixture      *fixture,
+               gconstpointer user_data)
+{
+  g_autoptr(GisSeekableImage) seekable = NULL;
+  g_autoptr(GError) error = NULL;
+  guint8 buf[SECTOR_SIZE];
+  gboolean ret;
+
+  write_raw (fixture);
+  seekable = open_image (fixture);
+
+  ret = gis_seekable_image_read_at (seekable, IMAGE_SIZE - 1, buf, 2, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+  g_assert_false (ret);
+  g_clear_error (&error);
+
+  ret = gis_seekable_image_read_at (seekable, G_MAXUINT64, buf, 1, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+  g_assert_false (ret);
+}
+
+static void
+assert_gpt_invalid (Fixture     *fixture,
+                    const gchar *warning)
+{
+  g_autoptr(GisSeekableImage) seekable = NULL;
+  g_autoptr(GError) error = NULL;
+  struct ptable pt;
+  gboolean ret;
+
+  /* The primary GPT alone still looks fine */
+  memcpy (&pt, fixture->image, sizeof pt);
+  g_assert_true (is_eos_gpt_valid (&pt, NULL));
+
+  write_xz (fixture, 4);
+  seekable = open_image (fixture);
+
+  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, warning);
+  ret = gis_seekable_image_check_gpt (seekable, NULL, &error);
+  g_test_assert_expected_messages ();
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_assert_false (ret);
+}
+
+static void
+test_bad_backup_header (Fixture      *fixture,
+                        gconstpointer user_data)
+{
+  get_header (fixture, N_SECTORS - 1)->last_usable_lba--;
+  update_crcs (fixture, N_SECTORS - 1);
+
+  assert_gpt_invalid (fixture, "backup header does not match primary header");
+}
+
+static void
+test_bad_backup_ptable (Fixture      *fixture,
+                        gconstpointer user_data)
+{
+  fixture->image[BACKUP_PTABLE_LBA * SECTOR_SIZE + GPT_PART_SIZE + 40] ^= 1;
+
+  assert_gpt_invalid (fixture, "invalid partition table crc");
+}
+
+/* gzip has no index, so the only way to reach the end is to decompress the
+ * whole image.
+ */
+static void
+test_gzip (Fixture      *fixture,
+           gconstpointer user_data)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (fixture->path);
+  g_autoptr(GisSeekableImage) seekable = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_file_set_contents (fixture->path, "\x1f\x8b\x08\x00", 4, &error);
+  g_assert_no_error (error);
+
+  seekable = gis_seekable_image_open (file, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED);
+  g_assert_null (seekable);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+#define TEST(name, data, func) \
+  g_test_add ("/seekable-image/" name, Fixture, data, \
+              fixture_set_up, func, fixture_tear_down)
+
+  TEST ("raw", NULL, test_raw);
+  TEST ("xz/single-stream", GUINT_TO_POINTER (1), test_xz);
+  TEST ("xz/multi-stream", GUINT_TO_POINTER (4), test_xz);
+  TEST ("xz/block-map", NULL, test_xz_block_map);
+  TEST ("past-end", NULL, test_past_end);
+  TEST ("bad-backup-header", NULL, test_bad_backup_header);
+  TEST ("bad-backup-ptable", NULL, test_bad_backup_ptable);
+  TEST ("gzip", NULL, test_gzip);
+
+#undef TEST
+
+  return g_test_run ();
+}
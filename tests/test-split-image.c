@@ -0,0 +1,392 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <locale.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "gis-errors.h"
+#include "gis-split-image.h"
+#include "glnx-shutil.h"
+
+/* w.img split into 4 parts compressed with xz, and w-8193.img split into 4
+ * parts compressed with gzip
+ */
+#define IMAGE "w.img"
+#define SPLIT_IMAGE "w-split.img.xz"
+#define IMAGE_8193 "w-8193.img"
+#define SPLIT_IMAGE_8193 "w-8193-split.img.gz"
+#define N_PARTS 4
+
+typedef struct {
+  gchar *tmpdir;
+} Fixture;
+
+typedef struct {
+  const gchar *image;
+  const gchar *split_image;
+} ReadData;
+
+static const ReadData read_xz = { IMAGE, SPLIT_IMAGE };
+static const ReadData read_gzip = { IMAGE_8193, SPLIT_IMAGE_8193 };
+
+static GFile *
+test_file_new (const gchar *basename)
+{
+  g_autofree gchar *path = g_test_build_filename (G_TEST_BUILT, basename,
+                                                  NULL);
+
+  return g_file_new_for_path (path);
+}
+
+static void
+fixture_set_up (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  fixture->tmpdir = g_dir_make_tmp ("eos-installer.XXXXXX", &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (fixture->tmpdir);
+}
+
+static void
+fixture_tear_down (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, fixture->tmpdir, NULL, &error))
+    g_warning ("Failed to remove %s: %s", fixture->tmpdir, error->message);
+
+  g_clear_pointer (&fixture->tmpdir, g_free);
+}
+
+/* Copies the manifest and parts of @split_image to the fixture's temporary
+ * directory, and returns the copy of the first part.
+ */
+static GFile *
+copy_split_image (Fixture     *fixture,
+                  const gchar *split_image)
+{
+  g_autofree gchar *first_part_path = NULL;
+  g_autoptr(GError) error = NULL;
+  guint i;
+
+  for (i = 0; i <= N_PARTS; i++)
+    {
+      g_autofree gchar *basename =
+        i < N_PARTS ? g_strdup_printf ("%s.%03u", split_image, i)
+                    : g_strdup_printf ("%s.sha256", split_image);
+      g_autofree gchar *copy_path = g_build_filename (fixture->tmpdir,
+                                                      basename, NULL);
+      g_autoptr(GFile) source = test_file_new (basename);
+      g_autoptr(GFile) copy = g_file_new_for_path (copy_path);
+      gboolean ret;
+
+      ret = g_file_copy (source, copy, G_FILE_COPY_NONE, NULL, NULL, NULL,
+                         &error);
+      g_assert_no_error (error);
+      g_assert_true (ret);
+    }
+
+  first_part_path = g_strdup_printf ("%s/%s.000", fixture->tmpdir,
+                                     split_image);
+  return g_file_new_for_path (first_part_path);
+}
+
+/* Reads @reader to the end, or until it fails. */
+static GByteArray *
+read_all (GInputStream *reader,
+          GError      **error)
+{
+  g_autoptr(GByteArray) contents = g_byte_array_new ();
+  /* Deliberately not a multiple of the reader's chunk size */
+  const gsize chunk_size = 10000;
+  g_autofree guint8 *buffer = g_malloc (chunk_size);
+  gssize r;
+
+  while ((r = g_input_stream_read (reader, buffer, chunk_size, NULL,
+                                   error)) > 0)
+    g_byte_array_append (contents, buffer, r);
+
+  if (r < 0)
+    return NULL;
+
+  return g_steal_pointer (&contents);
+}
+
+/* Reads the split image made from data->image, and checks that it matches
+ * data->image.
+ */
+static void
+test_read (gconstpointer user_data)
+{
+  const ReadData *data = user_data;
+  g_autoptr(GFile) image = test_file_new (data->image);
+  g_autofree gchar *first_part_basename =
+    g_strconcat (data->split_image, ".000", NULL);
+  g_autoptr(GFile) first_part = test_file_new (first_part_basename);
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GByteArray) contents = NULL;
+  g_autofree gchar *expected = NULL;
+  gsize expected_length = 0;
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+
+  g_assert_true (gis_split_image_is_split (first_part));
+
+  g_file_load_contents (image, NULL, &expected, &expected_length, NULL,
+                        &error);
+  g_assert_no_error (error);
+
+  reader = gis_split_image_reader_open (first_part, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (GIS_IS_SPLIT_IMAGE_READER (reader));
+
+  contents = read_all (reader, &error);
+  g_assert_no_error (error);
+  g_assert_cmpmem (contents->data, contents->len, expected, expected_length);
+
+  ret = g_input_stream_close (reader, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+}
+
+/* Parts are handed out in order, even though they are decompressed in
+ * parallel, and there may be more parts than workers. The parts here are not
+ * compressed, and each is filled with a different byte.
+ */
+static void
+test_order (Fixture      *fixture,
+            gconstpointer user_data)
+{
+  const guint n_parts = 2 * g_get_num_processors () + 3;
+  g_autoptr(GString) manifest = g_string_new ("");
+  g_autofree gchar *manifest_path =
+    g_build_filename (fixture->tmpdir, "x.img.sha256", NULL);
+  g_autofree gchar *first_part_path =
+    g_build_filename (fixture->tmpdir, "x.img.000", NULL);
+  g_autoptr(GFile) first_part = g_file_new_for_path (first_part_path);
+  g_autoptr(GByteArray) expected = g_byte_array_new ();
+  g_autoptr(GByteArray) contents = NULL;
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GPtrArray) parts = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+  guint i;
+
+  for (i = 0; i < n_parts; i++)
+    {
+      g_autofree gchar *basename = g_strdup_printf ("x.img.%03u", i);
+      g_autofree gchar *path = g_build_filename (fixture->tmpdir, basename,
+                                                 NULL);
+      gsize len = (i % 7 + 1) * 100000;
+      g_autofree guint8 *data = g_malloc (len);
+      g_autofree gchar *digest = NULL;
+
+      memset (data, 'a' + i, len);
+      ret = g_file_set_contents (path, (const gchar *) data, len, &error);
+      g_assert_no_error (error);
+      g_assert_true (ret);
+
+      g_byte_array_append (expected, data, len);
+      digest = g_compute_checksum_for_data (G_CHECKSUM_SHA256, data, len);
+      g_string_append_printf (manifest, "%s  %s\n", digest, basename);
+    }
+
+  ret = g_file_set_contents (manifest_path, manifest->str, manifest->len,
+                             &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+
+  parts = gis_split_image_list_parts (first_part, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (parts->len, ==, n_parts);
+
+  reader = gis_split_image_reader_open (first_part, NULL, &error);
+  g_assert_no_error (error);
+
+  contents = read_all (reader, &error);
+  g_assert_no_error (error);
+  g_assert_cmpmem (contents->data, contents->len,
+                   expected->data, expected->len);
+}
+
+static void
+test_verify_parts (void)
+{
+  g_autoptr(GFile) first_part = test_file_new (SPLIT_IMAGE ".000");
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+
+  ret = gis_split_image_verify_parts (first_part, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+}
+
+/* A part which does not match the manifest fails verification, rather than
+ * decompression, even though it is corrupt.
+ */
+static void
+test_corrupt_part (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(GFile) first_part = copy_split_image (fixture, SPLIT_IMAGE);
+  g_autofree gchar *part_path =
+    g_build_filename (fixture->tmpdir, SPLIT_IMAGE ".002", NULL);
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GByteArray) contents = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean ret;
+  guint8 byte;
+  int fd;
+  off_t size;
+
+  fd = open (part_path, O_RDWR | O_CLOEXEC);
+  g_assert_cmpint (fd, >=, 0);
+  size = lseek (fd, 0, SEEK_END);
+  g_assert_cmpint (size, >, 0);
+  g_assert_cmpint (pread (fd, &byte, 1, size / 2), ==, 1);
+  byte = ~byte;
+  g_assert_cmpint (pwrite (fd, &byte, 1, size / 2), ==, 1);
+  close (fd);
+
+  ret = gis_split_image_verify_parts (first_part, NULL, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+  g_assert_false (ret);
+  g_clear_error (&error);
+
+  reader = gis_split_image_reader_open (first_part, NULL, &error);
+  g_assert_no_error (error);
+
+  contents = read_all (reader, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_VERIFICATION_FAILED);
+  g_assert_null (contents);
+}
+
+static void
+test_missing_part (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(GFile) first_part = copy_split_image (fixture, SPLIT_IMAGE);
+  g_autofree gchar *part_path =
+    g_build_filename (fixture->tmpdir, SPLIT_IMAGE ".003", NULL);
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_assert_cmpint (unlink (part_path), ==, 0);
+
+  reader = gis_split_image_reader_open (first_part, NULL, &error);
+  g_assert_error (error, GIS_IMAGE_ERROR, GIS_IMAGE_ERROR_NOT_FOUND);
+  g_assert_null (reader);
+}
+
+static void
+test_not_first_part (void)
+{
+  g_autoptr(GFile) part = test_file_new (SPLIT_IMAGE ".001");
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_assert_true (gis_split_image_is_split (part));
+
+  reader = gis_split_image_reader_open (part, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED);
+  g_assert_null (reader);
+}
+
+static void
+test_is_split (void)
+{
+  const struct {
+    const gchar *path;
+    gboolean is_split;
+  } cases[] = {
+    { "/a/eos.img.xz.000", TRUE },
+    { "/a/eos.img.gz.012", TRUE },
+    { "/a/eos.img.999", TRUE },
+    { "/a/eos.img.xz", FALSE },
+    { "/a/eos.img.xz.sha256", FALSE },
+    { "/a/eos.img.xz.0000", FALSE },
+    { "/a/eos.tar.000", FALSE },
+    { "/a/.000", FALSE },
+  };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (cases); i++)
+    {
+      g_autoptr(GFile) file = g_file_new_for_path (cases[i].path);
+
+      g_assert_cmpint (gis_split_image_is_split (file), ==,
+                       cases[i].is_split);
+    }
+}
+
+/* Closing the stream part way through stops the workers, even if they are
+ * waiting for their buffers to be read.
+ */
+static void
+test_close_early (void)
+{
+  g_autoptr(GFile) first_part = test_file_new (SPLIT_IMAGE ".000");
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GError) error = NULL;
+  gchar buffer[512];
+  gssize r;
+  gboolean ret;
+
+  reader = gis_split_image_reader_open (first_part, NULL, &error);
+  g_assert_no_error (error);
+
+  r = g_input_stream_read (reader, buffer, sizeof buffer, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (r, ==, sizeof buffer);
+
+  ret = g_input_stream_close (reader, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+#define TEST(name, func) \
+  g_test_add ("/split-image/" name, Fixture, NULL, \
+              fixture_set_up, func, fixture_tear_down)
+
+  g_test_add_data_func ("/split-image/read/xz", &read_xz, test_read);
+  g_test_add_data_func ("/split-image/read/gzip", &read_gzip, test_read);
+  TEST ("order", test_order);
+  g_test_add_func ("/split-image/verify-parts", test_verify_parts);
+  TEST ("corrupt-part", test_corrupt_part);
+  TEST ("missing-part", test_missing_part);
+  g_test_add_func ("/split-image/not-first-part", test_not_first_part);
+  g_test_add_func ("/split-image/is-split", test_is_split);
+  g_test_add_func ("/split-image/close-early", test_close_early);
+
+#undef TEST
+
+  return g_test_run ();
+}
@@ -0,0 +1,196 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "gis-image-reader.h"
+#include "gis-squashfs-reader.h"
+
+/* squashfs images holding w.img (with xz) and w-8193.img (with gzip, and its
+ * last 512 bytes in a fragment) as endless.img
+ */
+#define IMAGE "w.img"
+#define IMAGE_8193 "w-8193.img"
+
+static GFile *
+test_file_new (const gchar *basename)
+{
+  g_autofree gchar *path = g_test_build_filename (G_TEST_BUILT, basename,
+                                                  NULL);
+
+  return g_file_new_for_path (path);
+}
+
+/* Reads endless.img from the squashfs made from @data, and checks that it
+ * matches @data.
+ */
+static void
+test_read (gconstpointer data)
+{
+  const gchar *basename = data;
+  g_autofree gchar *squashfs_basename = g_strdup (basename);
+  g_autoptr(GFile) image = test_file_new (basename);
+  g_autoptr(GFile) squashfs = NULL;
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GByteArray) contents = g_byte_array_new ();
+  g_autofree gchar *expected = NULL;
+  gsize expected_length = 0;
+  /* Deliberately not a multiple of the block size */
+  const gsize chunk_size = 10000;
+  g_autofree guint8 *buffer = g_malloc (chunk_size);
+  g_autoptr(GError) error = NULL;
+  gssize r;
+  gboolean ret;
+
+  strcpy (strrchr (squashfs_basename, '.'), ".squash");
+  squashfs = test_file_new (squashfs_basename);
+
+  g_file_load_contents (image, NULL, &expected, &expected_length, NULL,
+                        &error);
+  g_assert_no_error (error);
+
+  reader = gis_squashfs_reader_open (squashfs, GIS_SQUASHFS_LIVE_IMAGE_PATH,
+                                     NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (GIS_IS_SQUASHFS_READER (reader));
+  g_assert_cmpuint (gis_squashfs_reader_get_size (GIS_SQUASHFS_READER (reader)),
+                    ==, expected_length);
+
+  while ((r = g_input_stream_read (reader, buffer, chunk_size, NULL,
+                                   &error)) > 0)
+    g_byte_array_append (contents, buffer, r);
+
+  g_assert_no_error (error);
+  g_assert_cmpint (r, ==, 0);
+  g_assert_cmpmem (contents->data, contents->len, expected, expected_length);
+
+  ret = g_input_stream_close (reader, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+}
+
+/* Squashfs images are read through GisSquashfsReader by
+ * gis_image_reader_open().
+ */
+static void
+test_image_reader (void)
+{
+  g_autoptr(GFile) squashfs = test_file_new ("w.squash");
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_assert_true (gis_squashfs_reader_is_squashfs (squashfs));
+
+  reader = gis_image_reader_open (squashfs, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (GIS_IS_SQUASHFS_READER (reader));
+}
+
+/* Closing the stream part way through stops the workers. */
+static void
+test_close_early (void)
+{
+  g_autoptr(GFile) squashfs = test_file_new ("w.squash");
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GError) error = NULL;
+  gchar buffer[512];
+  gssize r;
+  gboolean ret;
+
+  reader = gis_squashfs_reader_open (squashfs, GIS_SQUASHFS_LIVE_IMAGE_PATH,
+                                     NULL, &error);
+  g_assert_no_error (error);
+
+  r = g_input_stream_read (reader, buffer, sizeof buffer, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (r, ==, sizeof buffer);
+
+  ret = g_input_stream_close (reader, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+}
+
+static void
+test_missing_path (void)
+{
+  g_autoptr(GFile) squashfs = test_file_new ("w.squash");
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GError) error = NULL;
+
+  reader = gis_squashfs_reader_open (squashfs, "nonexistent.img", NULL,
+                                     &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (reader);
+}
+
+static void
+test_not_squashfs (void)
+{
+  g_autoptr(GFile) image = test_file_new (IMAGE);
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_assert_false (gis_squashfs_reader_is_squashfs (image));
+
+  reader = gis_squashfs_reader_open (image, GIS_SQUASHFS_LIVE_IMAGE_PATH,
+                                     NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_assert_null (reader);
+}
+
+static void
+test_cancelled (void)
+{
+  g_autoptr(GFile) squashfs = test_file_new ("w.squash");
+  g_autoptr(GInputStream) reader = NULL;
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autoptr(GError) error = NULL;
+  gchar buffer[512];
+  gssize r;
+
+  reader = gis_squashfs_reader_open (squashfs, GIS_SQUASHFS_LIVE_IMAGE_PATH,
+                                     NULL, &error);
+  g_assert_no_error (error);
+
+  g_cancellable_cancel (cancellable);
+  r = g_input_stream_read (reader, buffer, sizeof buffer, cancellable,
+                           &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_cmpint (r, ==, -1);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_data_func ("/squashfs-reader/read/xz", IMAGE, test_read);
+  g_test_add_data_func ("/squashfs-reader/read/gzip-fragment", IMAGE_8193,
+                        test_read);
+  g_test_add_func ("/squashfs-reader/image-reader", test_image_reader);
+  g_test_add_func ("/squashfs-reader/close-early", test_close_early);
+  g_test_add_func ("/squashfs-reader/missing-path", test_missing_path);
+  g_test_add_func ("/squashfs-reader/not-squashfs", test_not_squashfs);
+  g_test_add_func ("/squashfs-reader/cancelled", test_cancelled);
+
+  return g_test_run ();
+}
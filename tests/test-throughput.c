@@ -0,0 +1,213 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <locale.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "gis-throughput.h"
+#include "glnx-shutil.h"
+
+/* A 4 MiB file of "w"s (0x77), and the same compressed with xz */
+#define IMAGE "w.img"
+#define IMAGE_XZ "w.img.xz"
+
+#define MiB (1024 * 1024)
+
+static void
+test_estimate (void)
+{
+  const guint64 image_size = 1000 * MiB;
+  const guint64 required_size = 4000 * MiB;
+
+  /* Nothing can be said without knowing how fast the target is */
+  g_assert_cmpuint (gis_throughput_estimate_seconds (image_size, required_size,
+                                                     0, 100 * MiB, 100 * MiB),
+                    ==, 0);
+
+  /* Writing is the bottleneck */
+  g_assert_cmpuint (gis_throughput_estimate_seconds (image_size, required_size,
+                                                     20 * MiB, 0, 0),
+                    ==, 200);
+  g_assert_cmpuint (gis_throughput_estimate_seconds (image_size, required_size,
+                                                     20 * MiB, 100 * MiB,
+                                                     100 * MiB),
+                    ==, 200);
+
+  /* Decompressing is the bottleneck */
+  g_assert_cmpuint (gis_throughput_estimate_seconds (image_size, required_size,
+                                                     100 * MiB, 10 * MiB,
+                                                     100 * MiB),
+                    ==, 400);
+
+  /* Verifying is the bottleneck; only the compressed image is verified */
+  g_assert_cmpuint (gis_throughput_estimate_seconds (image_size, required_size,
+                                                     100 * MiB, 100 * MiB,
+                                                     2 * MiB),
+                    ==, 500);
+}
+
+static void
+test_smooth_rate (void)
+{
+  const guint64 remaining = 1000 * MiB;
+  gdouble rate = 0;
+  guint64 last_estimate;
+  guint i;
+
+  /* Nothing written yet, so there is still no rate */
+  rate = gis_throughput_smooth_rate (rate, 0, 1.0);
+  g_assert_cmpfloat (rate, ==, 0);
+
+  /* The first sample is taken as it is */
+  rate = gis_throughput_smooth_rate (rate, 20 * MiB, 1.0);
+  g_assert_cmpfloat (rate, ==, 20 * MiB);
+
+  /* A sample over no time at all is ignored */
+  rate = gis_throughput_smooth_rate (rate, 20 * MiB, 0);
+  g_assert_cmpfloat (rate, ==, 20 * MiB);
+
+  /* A steady rate stays put, however it is sampled */
+  for (i = 0; i < 10; i++)
+    rate = gis_throughput_smooth_rate (rate, 40 * MiB, 2.0);
+  g_assert_cmpfloat (ABS (rate - 20 * MiB), <, 1);
+
+  /* While writing is stalled, the rate falls and the estimate grows on every
+   * sample, without ever getting to 0.
+   */
+  last_estimate = gis_throughput_estimate_seconds (remaining, remaining,
+                                                   rate, 0, 0);
+  g_assert_cmpuint (last_estimate, ==, 50);
+
+  for (i = 0; i < 10; i++)
+    {
+      gdouble last_rate = rate;
+      guint64 estimate;
+
+      rate = gis_throughput_smooth_rate (rate, 0, 1.0);
+      g_assert_cmpfloat (rate, <, last_rate);
+      g_assert_cmpfloat (rate, >, 0);
+
+      estimate = gis_throughput_estimate_seconds (remaining, remaining,
+                                                  rate, 0, 0);
+      g_assert_cmpuint (estimate, >, last_estimate);
+      last_estimate = estimate;
+    }
+
+  /* Once writing resumes, the rate recovers */
+  for (i = 0; i < 50; i++)
+    rate = gis_throughput_smooth_rate (rate, 20 * MiB, 1.0);
+  g_assert_cmpfloat (ABS (rate - 20 * MiB), <, MiB);
+}
+
+static void
+test_history (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *tmpdir = g_dir_make_tmp ("eos-installer.XXXXXX", &error);
+  const gchar *model = "ACME [Fast] SSD";
+  gboolean ret;
+
+  g_assert_no_error (error);
+
+  g_assert_cmpfloat (gis_throughput_history_lookup (tmpdir, model), ==, 0);
+
+  ret = gis_throughput_history_record (tmpdir, model, 100 * MiB, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  g_assert_cmpfloat (gis_throughput_history_lookup (tmpdir, model),
+                     ==, 100 * MiB);
+
+  /* Later installs are averaged in */
+  ret = gis_throughput_history_record (tmpdir, model, 200 * MiB, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  g_assert_cmpfloat (gis_throughput_history_lookup (tmpdir, model),
+                     ==, 150 * MiB);
+
+  /* Other models are unaffected */
+  g_assert_cmpfloat (gis_throughput_history_lookup (tmpdir, "ACME Slow HDD"),
+                     ==, 0);
+  g_assert_cmpfloat (gis_throughput_history_lookup (tmpdir, NULL), ==, 0);
+
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, tmpdir, NULL, &error))
+    g_warning ("Failed to remove %s: %s", tmpdir, error->message);
+}
+
+static void
+test_probe_device (void)
+{
+  g_autofree gchar *path = g_test_build_filename (G_TEST_BUILT, IMAGE, NULL);
+  g_autoptr(GError) error = NULL;
+  gdouble read_rate = 0;
+  gboolean ret;
+  gint fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  g_assert_cmpint (fd, >=, 0);
+
+  ret = gis_throughput_probe_device (fd, NULL, &read_rate, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  g_assert_cmpfloat (read_rate, >, 0);
+
+  /* O_DIRECT is turned off again */
+  g_assert_cmpint (fcntl (fd, F_GETFL) & O_DIRECT, ==, 0);
+
+  close (fd);
+}
+
+static void
+test_probe_image (gconstpointer data)
+{
+  const gchar *basename = data;
+  g_autofree gchar *path = g_test_build_filename (G_TEST_BUILT, basename,
+                                                  NULL);
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(GError) error = NULL;
+  gdouble decode_rate = 0;
+  gdouble verify_rate = 0;
+  gboolean ret;
+
+  ret = gis_throughput_probe_image (file, NULL, &decode_rate, &verify_rate,
+                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  g_assert_cmpfloat (decode_rate, >, 0);
+  g_assert_cmpfloat (verify_rate, >, 0);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/throughput/estimate", test_estimate);
+  g_test_add_func ("/throughput/smooth-rate", test_smooth_rate);
+  g_test_add_func ("/throughput/history", test_history);
+  g_test_add_func ("/throughput/probe-device", test_probe_device);
+  g_test_add_data_func ("/throughput/probe-image", IMAGE, test_probe_image);
+  g_test_add_data_func ("/throughput/probe-image-xz", IMAGE_XZ,
+                        test_probe_image);
+
+  return g_test_run ();
+}
@@ -0,0 +1,228 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright © 2020 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "gis-trace.h"
+#include "glnx-shutil.h"
+
+static void
+test_enabled (void)
+{
+  g_setenv (GIS_TRACE_ENV, "1", TRUE);
+  g_assert_true (gis_trace_is_enabled ());
+
+  g_setenv (GIS_TRACE_ENV, "", TRUE);
+  g_assert_false (gis_trace_is_enabled ());
+
+  g_unsetenv (GIS_TRACE_ENV);
+  g_assert_false (gis_trace_is_enabled ());
+}
+
+static gpointer
+add_span_thread (gpointer data)
+{
+  GisTrace *trace = data;
+
+  gis_trace_name_thread (trace, "other");
+  gis_trace_add_span (trace, "elsewhere", 100, 200, 0);
+
+  return NULL;
+}
+
+static guint
+count_occurrences (const gchar *haystack,
+                   const gchar *needle)
+{
+  guint n = 0;
+
+  while ((haystack = strstr (haystack, needle)) != NULL)
+    {
+      n++;
+      haystack += strlen (needle);
+    }
+
+  return n;
+}
+
+static void
+test_json (void)
+{
+  g_autoptr(GisTrace) trace = gis_trace_new ();
+  g_autoptr(GBytes) json = NULL;
+  g_autofree gchar *contents = NULL;
+  GThread *thread;
+  gsize len;
+
+  gis_trace_name_thread (trace, "\"quoted\"\\thread");
+  gis_trace_add_span (trace, "read", 1000, 1500, 42);
+  /* A span can't end before it began */
+  gis_trace_add_span (trace, "backwards", 2000, 1000, 0);
+  gis_trace_add_subprocess (trace, "xz", 12345, 1000, 3000);
+
+  thread = g_thread_new ("add-span", add_span_thread, trace);
+  g_thread_join (thread);
+
+  json = gis_trace_to_json (trace);
+  contents = g_strndup (g_bytes_get_data (json, &len), len);
+
+  g_assert_true (g_str_has_prefix (contents, "{\"displayTimeUnit\":\"ms\","
+                                             "\"traceEvents\":["));
+  g_assert_true (g_str_has_suffix (contents, "]}\n"));
+
+  /* Three threads' tracks, one of them the subprocess's */
+  g_assert_cmpuint (count_occurrences (contents, "\"ph\":\"M\""), ==, 3);
+  g_assert_nonnull (strstr (contents,
+                            "\"args\":{\"name\":\"\\\"quoted\\\"\\\\thread\"}"));
+  g_assert_nonnull (strstr (contents, "\"args\":{\"name\":\"other\"}"));
+  g_assert_nonnull (strstr (contents, "\"tid\":12345,\"args\":{\"name\":\"xz\"}"));
+
+  g_assert_cmpuint (count_occurrences (contents, "\"ph\":\"X\""), ==, 4);
+  g_assert_nonnull (strstr (contents,
+                            "{\"name\":\"read\",\"cat\":\"scribe\",\"ph\":\"X\","
+                            "\"ts\":1000,\"dur\":500,"));
+  g_assert_nonnull (strstr (contents, "\"args\":{\"bytes\":42}"));
+  g_assert_nonnull (strstr (contents,
+                            "{\"name\":\"backwards\",\"cat\":\"scribe\","
+                            "\"ph\":\"X\",\"ts\":2000,\"dur\":0,"));
+  g_assert_nonnull (strstr (contents,
+                            "{\"name\":\"xz\",\"cat\":\"scribe\",\"ph\":\"X\","
+                            "\"ts\":1000,\"dur\":2000,"));
+}
+
+typedef struct {
+  gchar *tmpdir;
+  gchar *image_dir;
+  gchar *home_dir;
+} Fixture;
+
+static void
+fixture_set_up (Fixture      *fixture,
+                gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  fixture->tmpdir = g_dir_make_tmp ("eos-installer.XXXXXX", &error);
+  g_assert_no_error (error);
+
+  fixture->image_dir = g_build_filename (fixture->tmpdir, "imagedir", NULL);
+  fixture->home_dir = g_build_filename (fixture->tmpdir, "homedir", NULL);
+  g_assert_cmpint (g_mkdir (fixture->home_dir, 0755), ==, 0);
+}
+
+static void
+fixture_tear_down (Fixture      *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!glnx_shutil_rm_rf_at (AT_FDCWD, fixture->tmpdir, NULL, &error))
+    g_warning ("Failed to remove %s: %s", fixture->tmpdir, error->message);
+
+  g_clear_pointer (&fixture->tmpdir, g_free);
+  g_clear_pointer (&fixture->image_dir, g_free);
+  g_clear_pointer (&fixture->home_dir, g_free);
+}
+
+static void
+assert_trace_in_dir (GFile       *file,
+                     const gchar *dir)
+{
+  g_autoptr(GFile) parent = g_file_get_parent (file);
+  g_autofree gchar *parent_path = g_file_get_path (parent);
+  g_autofree gchar *basename = g_file_get_basename (file);
+
+  g_assert_cmpstr (parent_path, ==, dir);
+  g_assert_true (g_str_has_prefix (basename, "eos-installer-trace-"));
+  g_assert_true (g_str_has_suffix (basename, ".json"));
+}
+
+static void
+test_write_image_dir (Fixture      *fixture,
+                      gconstpointer user_data)
+{
+  g_autoptr(GisTrace) trace = gis_trace_new ();
+  g_autoptr(GFile) image_dir = g_file_new_for_path (fixture->image_dir);
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_assert_cmpint (g_mkdir (fixture->image_dir, 0755), ==, 0);
+
+  file = gis_trace_write (trace, image_dir, fixture->home_dir, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (file);
+  assert_trace_in_dir (file, fixture->image_dir);
+}
+
+static void
+test_write_home_dir (Fixture      *fixture,
+                     gconstpointer user_data)
+{
+  g_autoptr(GisTrace) trace = gis_trace_new ();
+  g_autoptr(GFile) image_dir = g_file_new_for_path (fixture->image_dir);
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+
+  /* The image directory doesn't exist, so the home directory is used */
+  file = gis_trace_write (trace, image_dir, fixture->home_dir, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (file);
+  assert_trace_in_dir (file, fixture->home_dir);
+}
+
+static void
+test_write_nowhere (Fixture      *fixture,
+                    gconstpointer user_data)
+{
+  g_autoptr(GisTrace) trace = gis_trace_new ();
+  g_autoptr(GFile) image_dir = g_file_new_for_path (fixture->image_dir);
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+
+  file = gis_trace_write (trace, image_dir, NULL, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (file);
+  g_clear_error (&error);
+
+  file = gis_trace_write (trace, NULL, NULL, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (file);
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/trace/enabled", test_enabled);
+  g_test_add_func ("/trace/json", test_json);
+  g_test_add ("/trace/write/image-dir", Fixture, NULL,
+              fixture_set_up, test_write_image_dir, fixture_tear_down);
+  g_test_add ("/trace/write/home-dir", Fixture, NULL,
+              fixture_set_up, test_write_home_dir, fixture_tear_down);
+  g_test_add ("/trace/write/nowhere", Fixture, NULL,
+              fixture_set_up, test_write_nowhere, fixture_tear_down);
+
+  return g_test_run ();
+}
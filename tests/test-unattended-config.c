@@ -74,6 +74,10 @@ test_parse_empty (void)
   g_assert_null (gis_unattended_config_get_image (config));
   g_assert_true (gis_unattended_config_matches_device (config, "/dev/sda"));
   g_assert_true (gis_unattended_config_matches_device (config, "/dev/mmcblk0"));
+
+  g_assert_false (gis_unattended_config_is_batch (config));
+  g_assert_false (gis_unattended_config_get_cache (config, NULL, NULL, NULL,
+                                                   NULL));
 }
 
 static void
@@ -309,6 +313,123 @@ test_two_images (void)
   g_assert_null (config);
 }
 
+/* With no [Image] definition, every image found is a candidate, so two images
+ * are ambiguous.
+ */
+static void
+test_images_ambiguous (void)
+{
+  g_autofree gchar *empty_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/empty.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (empty_ini, &error);
+  g_assert_no_error (error);
+  g_assert_null (gis_unattended_config_get_image (config));
+
+  g_assert_true (gis_unattended_config_check_images (config, 1, &error));
+  g_assert_no_error (error);
+
+  g_assert_false (gis_unattended_config_check_images (config, 2, &error));
+  g_assert_error (error,
+                  GIS_UNATTENDED_ERROR,
+                  GIS_UNATTENDED_ERROR_IMAGE_AMBIGUOUS);
+}
+
+static void
+test_batch (void)
+{
+  g_autofree gchar *batch_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/batch.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (batch_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_true (gis_unattended_config_is_batch (config));
+  g_assert_cmpuint (gis_unattended_config_get_max_concurrent_writes (config),
+                    ==, 8);
+
+  g_assert_true (gis_unattended_config_matches_device (config, "/dev/sdb"));
+  g_assert_false (gis_unattended_config_matches_device (config, "/dev/mmcblk0"));
+}
+
+static void
+test_batch_default (void)
+{
+  g_autofree gchar *batch_default_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/batch-default.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (batch_default_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  g_assert_true (gis_unattended_config_is_batch (config));
+  g_assert_cmpuint (gis_unattended_config_get_max_concurrent_writes (config),
+                    >=, 1);
+}
+
+static void
+test_batch_invalid (void)
+{
+  g_autofree gchar *batch_invalid_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/batch-invalid.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (batch_invalid_ini, &error);
+  g_assert_error (error,
+                  GIS_UNATTENDED_ERROR,
+                  GIS_UNATTENDED_ERROR_INVALID_BATCH);
+  g_assert_null (config);
+}
+
+static void
+test_cache (void)
+{
+  g_autofree gchar *cache_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/cache.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+  const gchar *directory = NULL;
+  guint64 max_size = 0;
+  guint max_entries = 0;
+  GisImageCacheEviction eviction;
+  gboolean ret;
+
+  config = gis_unattended_config_new (cache_ini, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  ret = gis_unattended_config_get_cache (config, &directory, &max_size,
+                                         &max_entries, &eviction);
+  g_assert_true (ret);
+  g_assert_cmpstr (directory, ==, "/var/tmp/eos-installer-cache");
+  g_assert_cmpuint (max_size, ==, G_GUINT64_CONSTANT (64000000000));
+  g_assert_cmpuint (max_entries, ==, 2);
+  g_assert_cmpint (eviction, ==, GIS_IMAGE_CACHE_EVICTION_NONE);
+}
+
+static void
+test_cache_invalid (void)
+{
+  g_autofree gchar *cache_invalid_ini =
+    g_test_build_filename (G_TEST_DIST, "unattended/cache-invalid.ini", NULL);
+  g_autoptr(GisUnattendedConfig) config = NULL;
+  g_autoptr(GError) error = NULL;
+
+  config = gis_unattended_config_new (cache_invalid_ini, &error);
+  g_assert_error (error,
+                  GIS_UNATTENDED_ERROR,
+                  GIS_UNATTENDED_ERROR_INVALID_CACHE);
+  g_assert_null (config);
+}
+
 static void
 test_write_empty (Fixture *fixture,
                   gconstpointer data)
@@ -442,6 +563,12 @@ main (int argc, char *argv[])
   g_test_add_func ("/unattended-config/image/missing-block-device", test_missing_block_device);
   g_test_add_func ("/unattended-config/image/missing-filename", test_missing_filename);
   g_test_add_func ("/unattended-config/image/two-images", test_two_images);
+  g_test_add_func ("/unattended-config/image/ambiguous", test_images_ambiguous);
+  g_test_add_func ("/unattended-config/batch/full", test_batch);
+  g_test_add_func ("/unattended-config/batch/default", test_batch_default);
+  g_test_add_func ("/unattended-config/batch/invalid", test_batch_invalid);
+  g_test_add_func ("/unattended-config/cache/full", test_cache);
+  g_test_add_func ("/unattended-config/cache/invalid", test_cache_invalid);
 
   g_test_add ("/unattended-config/write/empty", Fixture, NULL, fixture_set_up,
               test_write_empty, fixture_tear_down);